@@ -323,6 +323,9 @@ AppleUSBEHCI::UIMInitialize(IOService * provider)
          */
         _errataBits = GetErrataBits(_vendorID, _deviceID, _revisionID);
 		
+		// the root hub timer can back off if we can count on the port change interrupt
+		_v3ExpansionData->_rootHubPolling.portChangeInterrupts = !(_errataBits & kErrataMissingPortChangeInt);
+		
 		if (_v3ExpansionData->_onThunderbolt && !((_v3ExpansionData->_thunderboltModelID == kAppleThunderboltDisplay2011MID) && (_v3ExpansionData->_thunderboltVendorID == kAppleThunderboltVID)))
 		{
 			// if we are tunnelled, but not on an Apple Thunderbolt Display, then we disallow all controllers, including EHCI
@@ -1256,6 +1259,10 @@ AppleUSBEHCI::DeallocateTD (EHCIGeneralTransferDescriptorPtr pTD)
 {
     UInt32		physical;
 	
+	// a queue with a polled endpoint keeps its TDs for the next read
+	if (pTD->pQH && IOUSBPolledTDReserveGive<AppleEHCITDOps>(&pTD->pQH->_polledTDs, pTD))
+		return kIOReturnSuccess;
+	
     //zero out all unnecessary fields
     physical = pTD->pPhysical;
     // bzero(pTD, sizeof(*pTD));
@@ -1281,6 +1288,17 @@ AppleUSBEHCI::DeallocateTD (EHCIGeneralTransferDescriptorPtr pTD)
 IOReturn 
 AppleUSBEHCI::DeallocateED (AppleEHCIQueueHead *pED)
 {
+	EHCIGeneralTransferDescriptorPtr	pTD, pTDNext;
+	
+	// the TDs a polled endpoint set aside go back to the free list with the queue
+	pTD = IOUSBPolledTDReserveDrain(&pED->_polledTDs);
+	while (pTD)
+	{
+		pTDNext = pTD->pLogicalNext;
+		DeallocateTD(pTD);
+		pTD = pTDNext;
+	}
+	
     USBLog(7, "AppleUSBEHCI[%p]::DeallocateED - AsyncListAddr(%08x) deallocating %08x and smashing physical link",  this, (int)_pEHCIRegisters->AsyncListAddr, (int)pED->_sharedPhysical);
     pED->_logicalNext = NULL;
 	pED->SetPhysicalLink(0xFEDCBA98);
@@ -1348,6 +1366,7 @@ AppleUSBEHCI::AllocateTD(void)
 		if (!_pFreeTD)
 			_pLastFreeTD = NULL;
 		freeTD->pLogicalNext = NULL;
+		freeTD->pQH = NULL;
 		freeTD->lastFrame = 0;
 		freeTD->lastRemaining = 0;
 		freeTD->command = NULL;
@@ -1362,6 +1381,30 @@ AppleUSBEHCI::AllocateTD(void)
 
 
 
+// A TD for a transfer on pQH - from the TDs set aside for a polled endpoint if there are any, so that a polled read does not
+// need a new memory block
+EHCIGeneralTransferDescriptorPtr 
+AppleUSBEHCI::AllocateQueueTD(AppleEHCIQueueHead *pQH)
+{
+    EHCIGeneralTransferDescriptorPtr	pTD = IOUSBPolledTDReserveTake<AppleEHCITDOps>(&pQH->_polledTDs);
+	
+	if (!pTD)
+		return AllocateTD();
+	
+	// what AllocateTD does to a TD from the free list
+	pTD->pQH = NULL;
+	pTD->lastFrame = 0;
+	pTD->lastRemaining = 0;
+	pTD->command = NULL;
+	pTD->callbackOnTD = false;
+	pTD->multiXferTransaction = false;
+	pTD->finalXferInTransaction = false;
+	pTD->tdSize = 0;
+	return pTD;
+}
+
+
+
 AppleEHCIIsochTransferDescriptor * 
 AppleUSBEHCI::AllocateITD(void)
 {
@@ -72,6 +72,10 @@ AppleUSBEHCI::PollInterrupts(IOUSBCompletionAction safeAction)
 		}
     }
 	
+	// hand the completions of this pass to the clients together, unless we are only completing safeAction
+	if (!safeAction)
+		BeginCompletionBatch();
+	
     if (_errorInterrupt & kEHCIErrorIntBit)
     {
         _errorInterrupt = 0;
@@ -89,6 +93,9 @@ AppleUSBEHCI::PollInterrupts(IOUSBCompletionAction safeAction)
         scavengeCompletedTransactions(safeAction);
     }
 	
+	if (!safeAction)
+		EndCompletionBatch();
+	
 	 //  Port Change Interrupt
     if (_portChangeInterrupt & kEHCIPortChangeIntBit)
     {
@@ -103,6 +110,9 @@ AppleUSBEHCI::PollInterrupts(IOUSBCompletionAction safeAction)
 		{
 			// Check to see if we are resuming the port
 			RHCheckForPortResumes();
+			
+			// and let the root hub see the change now rather than at its next poll
+			RootHubPortChangeInterrupt();
 		}
 		else
 		{
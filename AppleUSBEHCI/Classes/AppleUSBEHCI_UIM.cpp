@@ -28,6 +28,7 @@
 #include <IOKit/IOMemoryDescriptor.h>
 #include <IOKit/IOMemoryCursor.h>
 #include <IOKit/usb/IOUSBRootHubDevice.h>
+#include <IOKit/usb/IOUSBTransferPlanner.h>
 
 #include <IOKit/usb/IOUSBLog.h>
 #include "AppleUSBEHCI.h"
@@ -694,25 +695,15 @@ AppleUSBEHCI::allocateTDs(AppleEHCIQueueHead* pEDQueue, IOUSBCommand *command, I
 	UInt32								myCerr = (3 << kEHCITDFlags_CerrPhase);
 	UInt32								debugRetryCount = 0;
     UInt32								myDirection = 0;
-    IOByteCount							transferOffset;
-    UInt32								pageCount;
     UInt32								flags;
     IOReturn							status = kIOReturnSuccess;
     UInt32								maxPacket;
     UInt32								bytesThisTD, segment;
     UInt32								curTDsegment;
-    UInt32								totalPhysLength;
-    IOPhysicalAddress					dmaStartAddr;
-    UInt32								dmaStartOffset;
-	UInt32								dmaAddrHighBits;
-    UInt32								bytesToSchedule;
-    bool								needNewTD = false;
-    UInt32								maxTDLength;
+	UInt32								fragment;
 	UInt16								endpoint;
 	IODMACommand						*dmaCommand = command->GetDMACommand();
-	UInt64								offset;
-	IODMACommand::Segment64				segments;
-	UInt32								numSegments;
+	IOUSBTransferPlanEntry				planEntry;
 
 	/* *********** Note: Always put the flags in the TD last. ************** */
 	/* *********** This is what kicks off the transaction if  ************** */
@@ -762,7 +753,7 @@ AppleUSBEHCI::allocateTDs(AppleEHCIQueueHead* pEDQueue, IOUSBCommand *command, I
     // Its easy to point to something when you know where it is.
     
     // First allocate the first of the new bunch
-    pTD1 = AllocateTD();
+    pTD1 = AllocateQueueTD(pEDQueue);
 	pEDQueue->_numTDs++;
 	
     if (pTD1 == NULL)
@@ -799,125 +790,44 @@ AppleUSBEHCI::allocateTDs(AppleEHCIQueueHead* pEDQueue, IOUSBCommand *command, I
 
     if (bufferSize != 0)
     {	    
-        transferOffset = 0;
-		curTDsegment = 0;
-		bytesThisTD = 0;
-        while (transferOffset < bufferSize)
+		// the planner walks the DMA segments and decides what each TD carries - we only encode its entries
+		IOUSBTransferPlanConstraints							constraints = kUSBEHCITransferPlanConstraints;
+		
+		constraints.addressLimit32 = !_is64bit;
+		
+		IOUSBDMACommandSegmentSource							segmentSource(dmaCommand);
+		IOUSBTransferPlanner<IOUSBDMACommandSegmentSource>		planner(segmentSource, constraints, bufferSize, maxPacket, myToggle ? 1 : 0);
+		
+        while (!planner.Done())
         {
-			// first, calculate the maximum possible transfer of the given segment. note that this was already checked for
-			// being disjoint, so we don't have to worry about that.
-			
-			offset = transferOffset;
-			numSegments = 1;
-			status = dmaCommand->gen64IOVMSegments(&offset, &segments, &numSegments);
-			dmaAddrHighBits = (UInt32)(segments.fIOVMAddr >> 32);
-			if (status || (numSegments != 1) || (dmaAddrHighBits && !_is64bit))
+			status = planner.Next(&planEntry);
+			if (!status && (planEntry.flags & kUSBTransferPlanEntryNeedsBounce))
 			{
-				USBError(1, "AppleUSBEHCI[%p]::allocateTDs - could not generate segments err (%p) numSegments (%d) fLength (%d)", this, (void*)status, (int)numSegments, (int)segments.fLength);
-				status = status ? status : kIOReturnInternalError;
-				dmaStartAddr = 0;
-				totalPhysLength = 0;
-				return kIOReturnInternalError;
+				// there are no bounce buffers here, and a TD which is not a whole number of packets would end the transfer early
+				USBError(1, "AppleUSBEHCI[%p]::allocateTDs - less than one packet is physically contiguous at offset (%d)", this, (uint32_t)planEntry.offset);
+				status = kIOReturnInternalError;
 			}
-			else
+			if (status)
 			{
-				dmaStartAddr = segments.fIOVMAddr;
-				totalPhysLength = segments.fLength;
-			}			
-			
-			USBLog(7, "AppleUSBEHCI[%p]::allocateTDs - gen64IOVMSegments returned length of %d (out of %d) and start of %p:%p", this, (uint32_t)totalPhysLength, (uint32_t)bufferSize, (void*)dmaAddrHighBits, (void*)dmaStartAddr);
-			dmaStartOffset = (dmaStartAddr & (kEHCIPageSize-1));			
-			bytesToSchedule = 0;
+				USBError(1, "AppleUSBEHCI[%p]::allocateTDs - could not plan TD err (%p) TDs planned (%d) bufferSize (%d)", this, (void*)status, (int)planner.EntriesPlanned(), (int)bufferSize);
+				return status;
+			}
 			
-			// only the first segment can start on a non page boundary
-			if ((curTDsegment == 0) || (dmaStartOffset == 0))
+			// one buffer pointer for every page a fragment touches - only the first one can start inside its page
+			curTDsegment = 0;
+			for (fragment = 0; fragment < planEntry.fragmentCount; fragment++)
 			{
-                needNewTD = false;
-                
-				if (totalPhysLength > bufferSize)
-				{
-					USBLog(5, "AppleUSBEHCI[%p]::allocateTDs - segment physical length (%d) > buffer size(%d) - truncating", this, (uint32_t)totalPhysLength, (uint32_t)bufferSize);
-					totalPhysLength = bufferSize;
-				}
-				// each TD can transfer at most four full pages plus from the initial offset to the end of the first page
-				maxTDLength = ((kEHCIPagesPerTD-curTDsegment) * kEHCIPageSize) - dmaStartOffset;
-				if (totalPhysLength > maxTDLength)
-				{
-					if ((curTDsegment == 0) && (dmaStartOffset != 0))
-					{
-						// truncate this TD to exactly 4 pages, which will always be a multiple of MPS
-						USBLog(7, "AppleUSBEHCI[%p]::allocateTDs - segment won't fit - using 4 pages for this TD", this);
-						bytesToSchedule = (kEHCIPagesPerTD-1) * kEHCIPageSize;
-					}
-					else
-					{
-						// truncate this TD to however many pages are left, which will always be a multiple of MPS
-						USBLog(7, "AppleUSBEHCI[%p]::allocateTDs - segment is larger than 1 TD - using %d pages for this TD", this, (uint32_t)(kEHCIPagesPerTD - curTDsegment));
-						bytesToSchedule = (kEHCIPagesPerTD - curTDsegment) * kEHCIPageSize;
-					}
-				}
-				else
-					bytesToSchedule = totalPhysLength;
-				
-				bytesThisTD += bytesToSchedule;
-				transferOffset += bytesToSchedule;
-
-				
-				// <radr://6973523> Overrun with large interrupt transfer with unusual packet size.
-				// With an interrupt endpoint which has a max packet size not a submultiple of 4k
-				// with a transfer size which needs more than 1 TD, you get overrun errors at the 
-				// end of the TD because the TD size is not an exact multiple of max packet
-				// This adjusts the end of the TD so it is an exact multiple of max packet
-				
-				if( ((kEHCIPagesPerTD-1) == curTDsegment) && (maxPacket != 0) && ( (kEHCIPageSize%maxPacket) != 0) )
-				{
-					// Last TD segment, and odd sized max packet
-					
-					if(transferOffset < bufferSize)
-					{
-						// Not completely filled
-						UInt32 ovBytes;
-						ovBytes = bytesThisTD % maxPacket;	// number of bytes we need to knock off end of transfer to make even packet transfer.
-						
-						if(bytesToSchedule > ovBytes)		// Not a full TD. This is the driver's problem, not ours.
-						{
-							bytesToSchedule -= ovBytes;
-							bytesThisTD -= ovBytes;
-							transferOffset -= ovBytes;
-							USBLog(7, "AppleUSBEHCI[%p]::allocateTDs - Adjusted for odd maxpacket: bytesToSchedule:%d, bytesThisTD:%d, transferOffset:%d, ovBytes:%d", this, (int)bytesToSchedule, (int)bytesThisTD, (int)transferOffset, (int)ovBytes);
-						}
-					}
-				}
-				
-                // If our transfer for this TD does not end on a page boundary, we need to close the TD
-                //
-                if ( (transferOffset < bufferSize) && ((dmaStartOffset+bytesToSchedule) & kEHCIPageOffsetMask) )
-                {
-                    USBLog(6, "AppleUSBEHCI[%p]::allocateTDs - non-last transfer didn't end at end of page (%d, %d)", this, (uint32_t)dmaStartOffset, (uint32_t)bytesToSchedule);
-                    needNewTD = true;
-                }
+				UInt64		dmaAddr = planEntry.fragments[fragment].address;
+				UInt64		dmaEnd = dmaAddr + planEntry.fragments[fragment].length;
 				
-                // now schedule all of the bytes I just discovered
-				while (bytesToSchedule)
+				while ((dmaAddr < dmaEnd) && (curTDsegment < kEHCIPagesPerTD))
 				{
-					pTD->pShared->extBuffPtr[curTDsegment] = HostToUSBLong(dmaAddrHighBits);
-					pTD->pShared->BuffPtr[curTDsegment++] = HostToUSBLong(dmaStartAddr);
-					dmaStartAddr += (kEHCIPageSize - dmaStartOffset);
-					if (_is64bit && (dmaStartAddr == 0))
-						dmaAddrHighBits++;
-					if (bytesToSchedule > (kEHCIPageSize - dmaStartOffset))
-						bytesToSchedule -= (kEHCIPageSize - dmaStartOffset);
-					else
-						bytesToSchedule = 0;
-					dmaStartOffset = 0;
-				}
-				
-                if ( ((curTDsegment < kEHCIPagesPerTD) && (transferOffset < bufferSize)) && !needNewTD )
-				{
-					USBLog(7, "AppleUSBEHCI[%p]::allocateTDs - didn't fill up this TD (segment %d) - going back for more", this, (uint32_t)curTDsegment);
-					continue;
+					pTD->pShared->extBuffPtr[curTDsegment] = HostToUSBLong((UInt32)(dmaAddr >> 32));
+					pTD->pShared->BuffPtr[curTDsegment++] = HostToUSBLong((UInt32)dmaAddr);
+					dmaAddr = (dmaAddr & ~((UInt64)kEHCIPageOffsetMask)) + kEHCIPageSize;
 				}
 			}
+			bytesThisTD = planEntry.length;
 			
             flags = kEHCITDioc;				// Want to interrupt on completion
 			
@@ -927,6 +837,9 @@ AppleUSBEHCI::allocateTDs(AppleEHCIQueueHead* pEDQueue, IOUSBCommand *command, I
 				USBLog(7, "AppleUSBEHCI[%p]::allocateTDs - addr[%d]:0x%x", this, (uint32_t)segment, (uint32_t)USBToHostLong(pTD->pShared->BuffPtr[segment]));
 			}
 			
+			// the toggle is controlled by the queue head for bulk and interrupt, and by the planner for the stages of a control transfer
+			myToggle = (controlTransaction && planEntry.toggle) ? (UInt32)kEHCITDFlags_DT : 0;
+			
             flags |= (bytesThisTD << kEHCITDFlags_BytesPhase);
 			pTD->tdSize = bytesThisTD;	// Note for statistics
 			pTD->flagsAtError = 0xffffffff; // A value you'll never see in the flags word
@@ -939,33 +852,11 @@ AppleUSBEHCI::allocateTDs(AppleEHCIQueueHead* pEDQueue, IOUSBCommand *command, I
             pTD->traceFlag = false;
             pTD->pQH = pEDQueue;
 			
-			
-            // only supply a callback when the entire buffer has been
-            // transfered.
-			
-            // USBLog(5, "AppleUSBEHCI[%p]:new control path for data toggle");
-			// adjust data toggle for multi-TD control transfers
-			// this will adjust toggle on the next TD since the flags are already set above.
-			if (controlTransaction)
-			{
-				int numPackets = (bytesToSchedule +maxPacket-1)/maxPacket;
-				// if number of packets is odd toggle the toggle
-				if (numPackets&1) 
-				{
-					myToggle = myToggle ? 0 : (UInt32)kEHCITDFlags_DT;
-				}
-			}
-			else 
-			{
-				// toggle is controlled by queue head for bulk/int case
-				myToggle = 0;
-			}
-			
 			USBLog(7, "AppleUSBEHCI[%p]::allocateTDs - putting command into TD (%p) on ED (%p)", this, pTD, pEDQueue);
 			pTD->command = command;						// Do like OHCI, link to command from each TD
-            if (transferOffset >= bufferSize)
+            if (planEntry.flags & kUSBTransferPlanEntryLast)
             {
-				//myToggle = 0;							// Only set toggle on first TD				
+				// only supply a callback when the entire buffer has been transfered.
 				pTD->callbackOnTD = true;
 				pTD->logicalBuffer = CBP;
 				pTD->pShared->flags = HostToUSBLong(flags);
@@ -978,8 +869,7 @@ AppleUSBEHCI::allocateTDs(AppleEHCIQueueHead* pEDQueue, IOUSBCommand *command, I
 			else
             {
 				pTD->callbackOnTD = false;
-				//myToggle = 0;	// Only set toggle on first TD
-				pTDnew = AllocateTD();
+				pTDnew = AllocateQueueTD(pEDQueue);
 				if (pTDnew == NULL)
 				{
 					status = kIOReturnNoMemory;
@@ -993,9 +883,7 @@ AppleUSBEHCI::allocateTDs(AppleEHCIQueueHead* pEDQueue, IOUSBCommand *command, I
 					pTD->pShared->flags = HostToUSBLong(flags);		// Doesn't matter about flags, not linked in yet
 					// if (trace)printTD(pTD);
 					pTD = pTDnew;
-					curTDsegment = 0;
-					bytesThisTD = 0;
-					USBLog(7, "AppleUSBEHCI[%p]::allocateTDs - got another TD - going to fill it up too (%d, %d)", this, (uint32_t)transferOffset, (uint32_t)bufferSize);
+					USBLog(7, "AppleUSBEHCI[%p]::allocateTDs - got another TD - going to fill it up too (%d, %d)", this, (uint32_t)(planEntry.offset + planEntry.length), (uint32_t)bufferSize);
 				}
             }
         }
@@ -2753,6 +2641,50 @@ AppleUSBEHCI::UIMCreateInterruptTransfer(IOUSBCommand* command)
 
 
 
+// Sets aside on the interrupt queue of a polled endpoint the TDs for a read of maxBufferSize, or gives them back
+IOReturn
+AppleUSBEHCI::UIMReservePolledTDs(short functionNumber, short endpointNumber, UInt32 maxBufferSize, bool reserve)
+{
+    AppleEHCIQueueHead *				pEDQueue;
+	EHCIGeneralTransferDescriptorPtr	pTD, pTDNext;
+	
+    pEDQueue = FindInterruptEndpoint(functionNumber, endpointNumber, kUSBIn, NULL);
+    if (!pEDQueue)
+    {
+		USBLog(1, "AppleUSBEHCI[%p]::UIMReservePolledTDs - endpoint %d:%d not found", this, functionNumber, endpointNumber);
+		return kIOUSBEndpointNotFound;
+    }
+	
+	if (reserve)
+	{
+		IOUSBPolledTDReserveSetTarget(&pEDQueue->_polledTDs, IOUSBPolledTDReserveTarget(maxBufferSize, (kEHCIPagesPerTD-1) * kEHCIPageSize));
+		while (IOUSBPolledTDReserveShort(&pEDQueue->_polledTDs))
+		{
+			pTD = AllocateTD();
+			if (!pTD)
+				break;
+			IOUSBPolledTDReserveGive<AppleEHCITDOps>(&pEDQueue->_polledTDs, pTD);
+		}
+		if (!IOUSBPolledTDReserveShort(&pEDQueue->_polledTDs))
+		{
+			USBLog(5, "AppleUSBEHCI[%p]::UIMReservePolledTDs - %d TDs set aside on ED (%p) for %d:%d", this, (int)pEDQueue->_polledTDs.count, pEDQueue, functionNumber, endpointNumber);
+			return kIOReturnSuccess;
+		}
+		USBError(1, "AppleUSBEHCI[%p]::UIMReservePolledTDs - could not set aside TDs for %d:%d", this, functionNumber, endpointNumber);
+	}
+	
+	pTD = IOUSBPolledTDReserveDrain(&pEDQueue->_polledTDs);
+	while (pTD)
+	{
+		pTDNext = pTD->pLogicalNext;
+		DeallocateTD(pTD);
+		pTD = pTDNext;
+	}
+	return reserve ? kIOReturnNoMemory : kIOReturnSuccess;
+}
+
+
+
 IOReturn
 AppleUSBEHCI::UIMCreateInterruptTransfer(
 										 short				functionAddress,
@@ -28,6 +28,7 @@
 
 #include <libkern/c++/OSObject.h>
 #include <IOKit/usb/IOUSBControllerListElement.h>
+#include <IOKit/usb/IOUSBPolledTDReserve.h>
 
 #include "AppleUSBEHCI.h"
 #include "USBEHCI.h"
@@ -104,6 +105,7 @@ public:
 	IOPhysicalAddress						_lastSeenTD;							// For inactive QH detection
 	UInt64									_lastSeenFrame;							// Also for inactive detection
 	UInt32									_numTDs;								// For more intelligent broken queue detection
+	IOUSBPolledTDReserve<EHCIGeneralTransferDescriptor>	_polledTDs;					// TDs set aside for a polled endpoint (UIMReservePolledTDs)
 };
 
 
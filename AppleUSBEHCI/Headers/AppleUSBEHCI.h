@@ -103,6 +103,13 @@ struct EHCIGeneralTransferDescriptor
 	
 };
 
+// how a queue head's IOUSBPolledTDReserve links its TDs
+struct AppleEHCITDOps
+{
+	static EHCIGeneralTransferDescriptorPtr Next(EHCIGeneralTransferDescriptorPtr pTD)							{ return pTD->pLogicalNext; }
+	static void SetNext(EHCIGeneralTransferDescriptorPtr pTD, EHCIGeneralTransferDescriptorPtr next)			{ pTD->pLogicalNext = next; }
+};
+
 struct EHCIDoneQueueParams 
 { 
 	EHCIGeneralTransferDescriptorPtr		pHCDoneTD; 
@@ -352,6 +359,7 @@ protected:
 											  IOUSBControllerListElement			**pLEBack);
     AppleEHCIQueueHead *AllocateQH(void);
     EHCIGeneralTransferDescriptorPtr AllocateTD(void);
+    EHCIGeneralTransferDescriptorPtr AllocateQueueTD(AppleEHCIQueueHead *pQH);
     AppleEHCIIsochTransferDescriptor *AllocateITD(void);
     AppleEHCISplitIsochTransferDescriptor *AllocateSITD(void);
 	
@@ -559,6 +567,8 @@ public:
     // method in 1.8.2
     virtual IOReturn UIMCreateInterruptTransfer(IOUSBCommand* command);
 	
+	virtual IOReturn UIMReservePolledTDs(short functionNumber, short endpointNumber, UInt32 maxBufferSize, bool reserve);
+	
     // Isoch
     virtual IOReturn UIMCreateIsochEndpoint(short				functionAddress,
 											short				endpointNumber,
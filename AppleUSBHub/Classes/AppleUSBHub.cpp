@@ -102,7 +102,7 @@ enum
 //   Globals (static member variables)
 //
 //================================================================================================
-static ErrataListEntry	errataList[] = {
+static ErrataListEntry	errataList[] = {		// keep sorted by vendID, then deviceID - see USBFindErrataBits
 
 /* For the Cherry 4 port KB, From Cherry:
 We use the bcd_releasenumber-highbyte for hardware- and the lowbyte for
@@ -2853,8 +2853,7 @@ UInt32
 AppleUSBHub::GetHubErrataBits()
 {
 	UInt16		vendID, deviceID, revisionID;
-	ErrataListEntry	*entryPtr;
-	UInt32		i, errata = 0;
+	UInt32		errata;
 	
 	USBLog(6,"AppleUSBHub[%p]::GetHubErrataBits  Hub at location 0x%x", this, (uint32_t)_locationID);
 	
@@ -2863,16 +2862,8 @@ AppleUSBHub::GetHubErrataBits()
 	deviceID = _device->GetProductID();
 	revisionID = _device->GetDeviceRelease();
 	
-	for(i=0, entryPtr = errataList; i < errataListLength; i++, entryPtr++)
-	{
-		if (vendID == entryPtr->vendID
-			&& deviceID == entryPtr->deviceID
-			&& revisionID >= entryPtr->revisionLo
-			&& revisionID <= entryPtr->revisionHi)
-		{
-			errata |= entryPtr->errata;  // we match, add this errata to our list
-		}
-	}
+	// errataList is sorted by vendor and product ID
+	errata = USBFindErrataBits(errataList, errataListLength, vendID, deviceID, revisionID);
 	
 	
 	UInt32	bits = 0;
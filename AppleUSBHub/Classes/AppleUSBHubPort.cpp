@@ -2084,6 +2084,9 @@ AppleUSBHubPort::AddDeviceResetChangeHandler(UInt16 changeFlags, UInt16 statusFl
     	}
     	else
     	{	
+			uint64_t		heldTime;
+			uint64_t		heldNS;
+			
 			if ( _addDeviceThreadActive)
 			{
 				USBLog(7, "AppleUSBHubPort[%p]::AddDeviceResetChangeHandler - port %d of hub @ 0x%x, _addDeviceThreadActive after SetAddress(), before IOSleep(2) ", this, _portNum,  (uint32_t)_hub->_locationID);
@@ -2097,6 +2100,10 @@ AppleUSBHubPort::AddDeviceResetChangeHandler(UInt16 changeFlags, UInt16 statusFl
             _bus->ReleaseDeviceZero();
             _devZero = false;
             _state = hpsNormal;
+			
+			heldTime = mach_absolute_time() - _devZeroHeldSince;
+			absolutetime_to_nanoseconds(*(AbsoluteTime *)&heldTime, &heldNS);
+			usbDevice->setProperty("DeviceZeroHoldTimeMS", (unsigned long long)(heldNS / 1000000), 32);
             
         }
         
@@ -4069,7 +4076,10 @@ AppleUSBHubPort::AcquireDeviceZero()
     // at time 0.
     //
     if ( devZero )
+	{
         _devZeroCounter++;
+		_devZeroHeldSince = mach_absolute_time();
+	}
     
     return devZero;
 }
@@ -145,6 +145,7 @@ private:
     bool							_getDeviceDescriptorFailed;
     UInt8							_setAddressFailed;
     UInt32							_devZeroCounter;
+	uint64_t						_devZeroHeldSince;									// mach_absolute_time() at which this port last got device zero
     bool							_extraResetDelay;
 	bool							_resumePending;
 	bool							_resetPending;
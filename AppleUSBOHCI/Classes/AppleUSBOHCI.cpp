@@ -276,6 +276,9 @@ AppleUSBOHCI::UIMInitialize(IOService * provider)
 			 * Initialize my data and the hardware
 			 */
 			_errataBits = GetErrataBits(_vendorID, _deviceID, _revisionID);
+			
+			// RHSC tells us about every root hub port change, so the root hub timer can back off
+			_v3ExpansionData->_rootHubPolling.portChangeInterrupts = true;
 
 			if (_v3ExpansionData->_onThunderbolt || (_errataBits & kErrataDontUseCompanionController))
 			{
@@ -984,6 +987,7 @@ AppleUSBOHCI::AllocateTD(void)
     
     _pFreeTD = freeTD->pLogicalNext;
     freeTD->pLogicalNext = NULL;
+    freeTD->pEndpoint = NULL;
     freeTD->uimFlags = 0;
     freeTD->lastFrame = 0;		// used in timeout logic
     freeTD->lastRemaining = 0;		// used in timeout logic
@@ -993,6 +997,26 @@ AppleUSBOHCI::AllocateTD(void)
 
 
 
+// A TD for a transfer on pED - from the TDs set aside for a polled endpoint if there are any, so that a polled read does not
+// need a new memory block
+AppleOHCIGeneralTransferDescriptorPtr 
+AppleUSBOHCI::AllocateQueueTD(AppleOHCIEndpointDescriptorPtr pED)
+{
+    AppleOHCIGeneralTransferDescriptorPtr	pTD = IOUSBPolledTDReserveTake<AppleOHCITDOps>(&pED->polledTDs);
+	
+	if (!pTD)
+		return AllocateTD();
+	
+	// what AllocateTD does to a TD from the free list
+    pTD->pEndpoint = NULL;
+    pTD->uimFlags = 0;
+    pTD->lastFrame = 0;
+    pTD->lastRemaining = 0;
+	return pTD;
+}
+
+
+
 AppleOHCIEndpointDescriptorPtr 
 AppleUSBOHCI::AllocateED()
 {
@@ -1080,6 +1104,10 @@ AppleUSBOHCI::DeallocateTD (AppleOHCIGeneralTransferDescriptorPtr pTD)
 {
     UInt32		physical;
 	
+	// an ED with a polled endpoint keeps its TDs for the next read
+	if (pTD->pEndpoint && IOUSBPolledTDReserveGive<AppleOHCITDOps>(&pTD->pEndpoint->polledTDs, pTD))
+		return kIOReturnSuccess;
+	
     //zero out all unnecessary fields
     physical = pTD->pPhysical;
     //bzero(pTD, sizeof(*pTD));
@@ -1103,7 +1131,17 @@ AppleUSBOHCI::DeallocateTD (AppleOHCIGeneralTransferDescriptorPtr pTD)
 IOReturn 
 AppleUSBOHCI::DeallocateED (AppleOHCIEndpointDescriptorPtr pED)
 {
-    UInt32		physical;
+    UInt32									physical;
+	AppleOHCIGeneralTransferDescriptorPtr	pTD, pTDNext;
+	
+	// the TDs a polled endpoint set aside go back to the free list with the ED
+	pTD = IOUSBPolledTDReserveDrain(&pED->polledTDs);
+	while (pTD)
+	{
+		pTDNext = pTD->pLogicalNext;
+		DeallocateTD(pTD);
+		pTD = pTDNext;
+	}
 	
     //zero out all unnecessary fields
     physical = pED->pPhysical;
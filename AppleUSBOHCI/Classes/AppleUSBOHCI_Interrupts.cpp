@@ -56,7 +56,12 @@ void AppleUSBOHCI::PollInterrupts(IOUSBCompletionAction safeAction)
 
 		USBTrace( kUSBTOHCIInterrupts, kTPOHCIInterruptsPollInterrupts , (uintptr_t)this, 0, 0, 1 );
 		
+		// hand the completions of this pass to the clients together, unless we are only completing safeAction
+		if (!safeAction)
+			BeginCompletionBatch();
 		UIMProcessDoneQueue(safeAction);
+		if (!safeAction)
+			EndCompletionBatch();
     }
 	
     // ResumeDetected Interrupt
@@ -144,6 +149,11 @@ void AppleUSBOHCI::PollInterrupts(IOUSBCompletionAction safeAction)
 			_pOHCIRegisters->hcInterruptEnable = HostToUSBLong (kOHCIHcInterrupt_MIE | kOHCIHcInterrupt_RHSC);
 			IOSync();
 		}
+		else if (_myPowerState == kUSBPowerStateOn)
+		{
+			// let the root hub see the change now rather than at its next poll
+			RootHubPortChangeInterrupt();
+		}
 	}
 	
 	// Frame Rollover Interrupt
@@ -33,6 +33,7 @@ extern "C" {
 
 #include <IOKit/usb/IOUSBLog.h>
 #include <IOKit/usb/IOUSBRootHubDevice.h>
+#include <IOKit/usb/IOUSBTransferPlanner.h>
 
 #include "AppleUSBOHCI.h"
 #include "AppleUSBOHCIMemoryBlocks.h"
@@ -54,15 +55,12 @@ AppleUSBOHCI::CreateGeneralTransfer(AppleOHCIEndpointDescriptorPtr queue, IOUSBC
     AppleOHCIGeneralTransferDescriptorPtr	pOHCIGeneralTransferDescriptor = NULL,
 											newOHCIGeneralTransferDescriptor = NULL;
     IOReturn								status = kIOReturnSuccess;
-    IOByteCount								transferOffset;
-    UInt32									pageCount;
     UInt32									altFlags;		// for all but the final TD
     IOUSBCompletion							completion = command->GetUSLCompletion();
 	IODMACommand							*dmaCommand = command->GetDMACommand();
-	UInt64									offset;
-	IODMACommand::Segment32					segments32[2];
-	IODMACommand::Segment64					segments64[2];
-	UInt32									i;
+	UInt32									maxPacket = (USBToHostLong(queue->pShared->flags) & kOHCIEDControl_MPS) >> kOHCIEDControl_MPSPhase;
+	IOUSBTransferPlanEntry					planEntry;
+	IOUSBTransferPlanFragment				*lastFragment;
 
     // Handy for debugging transfer lists
     flags |= (kOHCIGTDConditionNotAccessed << kOHCIGTDControl_CCPhase);
@@ -115,104 +113,57 @@ AppleUSBOHCI::CreateGeneralTransfer(AppleOHCIEndpointDescriptorPtr queue, IOUSBC
 		}
 		if (!status)
 		{
-			transferOffset = 0;
-			while (transferOffset < bufferSize)
+			// the planner walks the DMA segments and decides what each TD carries - we only encode its entries
+			IOUSBTransferPlanConstraints							constraints = kUSBOHCITransferPlanConstraints;
+			
+			if (_errataBits & kErrataOnlySinglePageTransfers)
 			{
-				offset = transferOffset;
-				if (_errataBits & kErrataOnlySinglePageTransfers)
-					pageCount = 1;
-				else
-					pageCount = 2;
-				
-				USBLog(7, "AppleUSBOHCI[%p]::CreateGeneralTransfer - getting segments - offset (%qd) pageCount (%d) transferOffset (%d) bufferSize (%d)", this, offset, (int)pageCount, (int)transferOffset, (int)bufferSize);
-				status = dmaCommand->gen64IOVMSegments(&offset, segments64, &pageCount);
-				if (status || ((pageCount != 1) && (pageCount != 2)))
+				constraints.maxPagesPerDescriptor = 1;
+				constraints.maxBytesPerDescriptor = constraints.pageSize;
+			}
+			
+			// the data toggle is carried in flags (control) or by the ED (bulk and interrupt), so the planner's toggle is not used
+			IOUSBDMACommandSegmentSource							segmentSource(dmaCommand);
+			IOUSBTransferPlanner<IOUSBDMACommandSegmentSource>		planner(segmentSource, constraints, bufferSize, maxPacket, 0);
+			
+			while (!planner.Done())
+			{
+				status = planner.Next(&planEntry);
+				if (status)
 				{
-					USBError(1, "AppleUSBOHCI[%p]::CreateGeneralTransfer - could not generate segments - err (%p) pageCount (%d) offset (%qd) transferOffset (%d) bufferSize (%d) getMemoryDescriptor (%p)", this, (void*)status, (int)pageCount, offset, (int)transferOffset, (int)bufferSize, dmaCommand->getMemoryDescriptor());
-					status = status ? status : kIOReturnInternalError;
+					USBError(1, "AppleUSBOHCI[%p]::CreateGeneralTransfer - could not plan TD - err (%p) TDs planned (%d) bufferSize (%d) getMemoryDescriptor (%p)", this, (void*)status, (int)planner.EntriesPlanned(), (int)bufferSize, dmaCommand->getMemoryDescriptor());
 					return status;
 				}
-				if (pageCount == 2)
+				if (planEntry.flags & kUSBTransferPlanEntryNeedsBounce)
 				{
-					USBLog(7, "AppleUSBOHCI[%p]::CreateGeneralTransfer  - after gen64IOVMSegments, offset (%qd) pageCount (%d) segments64[0].fIOVMAddr (%p) segments64[0].fLength (%d) segments64[1].fIOVMAddr (%p) segments64[1].fLength (%d)", this, offset, (int)pageCount, (void*)segments64[0].fIOVMAddr, (int)segments64[0].fLength, (void*)segments64[1].fIOVMAddr, (int)segments64[1].fLength);
-				}
-				else
-				{
-					USBLog(7, "AppleUSBOHCI[%p]::CreateGeneralTransfer  - after gen64IOVMSegments, offset (%qd) pageCount (%d) segments64[0].fIOVMAddr (%p) segments64[0].fLength (%d)", this, offset, (int)pageCount, (void*)segments64[0].fIOVMAddr, (int)segments64[0].fLength);
-				}
-				for (i=0; i< pageCount; i++)
-				{
-					if (((UInt32)(segments64[i].fIOVMAddr >> 32) > 0) || ((UInt32)(segments64[i].fLength >> 32) > 0))
-					{
-						USBError(1, "AppleUSBOHCI[%p]::CreateGeneralTransfer - generated segments (%d) not 32 bit -  offset (0x%qx) length (0x%qx) ", this, (int)i, segments64[0].fIOVMAddr, segments64[0].fLength);
-						return kIOReturnInternalError;
-					}
-					// OK to convert to 32 bit (which it should have been already)
-					segments32[i].fIOVMAddr = (UInt32)segments64[i].fIOVMAddr;
-					segments32[i].fLength = (UInt32)segments64[i].fLength;
+					// less than one packet is physically contiguous, and a short TD would end the transfer early
+					USBError(1, "AppleUSBOHCI[%p] CreateGeneralTransfer: non-multiple MPS transfer required -- giving up!", this);
+					status = kIOReturnNoMemory;
+					break;
 				}
+				USBLog(7, "AppleUSBOHCI[%p]::CreateGeneralTransfer - planned TD - offset (%d) length (%d) fragments (%d) bufferSize (%d)", this, (int)planEntry.offset, (int)planEntry.length, (int)planEntry.fragmentCount, (int)bufferSize);
 
-				newOHCIGeneralTransferDescriptor = AllocateTD();
+				newOHCIGeneralTransferDescriptor = AllocateQueueTD(queue);
 				if (newOHCIGeneralTransferDescriptor == NULL) 
 				{
 					status = kIOReturnNoMemory;
 					break;
 				}
 	 
-				// 3973735 - check to see if we have 2 pages, but we only need 1 to get to bufferSize
-				if ((pageCount == 2) && (transferOffset + segments32[0].fLength >= bufferSize))
-				{
-					USBLog(6, "AppleUSBOHCI[%p]::CreateGeneralTransfer - bufferSize < Descriptor size - adjusting pageCount", this);
-					pageCount = 1;
-				}
-				
-				// if the first segment doesn't end on a page boundary, we will just do that much.
-				if ((pageCount == 2) && ((((segments32[0].fIOVMAddr + segments32[0].fLength) & PAGE_MASK) != 0) || ((segments32[1].fIOVMAddr & PAGE_MASK) != 0)))
-				{
-					pageCount = 1; // we can only do one page here
-					// must be a multiple of max packet size to avoid short packets
-					if (segments32[0].fLength % ((USBToHostLong(queue->pShared->flags) & kOHCIEDControl_MPS) >> kOHCIEDControl_MPSPhase) != 0)
-					{
-						USBError(1, "AppleUSBOHCI[%p] CreateGeneralTransfer: non-multiple MPS transfer required -- giving up!", this);
-						status = kIOReturnNoMemory;
-						break;
-					}
-				}
+				// CBP is the first byte of the first fragment and BE the last byte of the last one - the controller crosses at most one page boundary between them
+				lastFragment = &planEntry.fragments[planEntry.fragmentCount - 1];
 				pOHCIGeneralTransferDescriptor = (AppleOHCIGeneralTransferDescriptorPtr)queue->pLogicalTailP;
-				OSWriteLittleInt32(&pOHCIGeneralTransferDescriptor->pShared->currentBufferPtr, 0, segments32[0].fIOVMAddr);
+				OSWriteLittleInt32(&pOHCIGeneralTransferDescriptor->pShared->currentBufferPtr, 0, (UInt32)planEntry.fragments[0].address);
 				OSWriteLittleInt32(&pOHCIGeneralTransferDescriptor->pShared->nextTD, 0, newOHCIGeneralTransferDescriptor->pPhysical);
-				if (pageCount == 2) 
-				{
-					// check to see if we need to use only part of the 2nd page
-					if ((transferOffset + segments32[0].fLength + segments32[1].fLength) > bufferSize)
-					{
-						USBLog(6, "AppleUSBOHCI[%p]::CreateGeneralTransfer - bufferSize < Descriptor size - adjusting physical segment 1", this);
-						segments32[1].fLength = bufferSize - (transferOffset + segments32[0].fLength);
-					}
-					OSWriteLittleInt32(&pOHCIGeneralTransferDescriptor->pShared->bufferEnd, 0, segments32[1].fIOVMAddr + segments32[1].fLength - 1);
-					transferOffset += segments32[1].fLength;
-					USBLog(7, "AppleUSBOHCI[%p]::CreateGeneralTransfer - added length of segment 1, transferOffset now %d", this, (int)transferOffset);
-				}
-				else
-				{
-					// need to check to make sure we need all of the 1st (and only) segment
-					if ((transferOffset + segments32[0].fLength) > bufferSize)
-					{
-						USBLog(6, "AppleUSBOHCI[%p]::CreateGeneralTransfer - bufferSize < Descriptor size - adjusting physical segment 0", this);
-						segments32[0].fLength = bufferSize - transferOffset;
-					}
-					OSWriteLittleInt32(&pOHCIGeneralTransferDescriptor->pShared->bufferEnd, 0, segments32[0].fIOVMAddr + segments32[0].fLength - 1);
-				}
+				OSWriteLittleInt32(&pOHCIGeneralTransferDescriptor->pShared->bufferEnd, 0, (UInt32)(lastFragment->address + lastFragment->length - 1));
 				
 				pOHCIGeneralTransferDescriptor->pLogicalNext = newOHCIGeneralTransferDescriptor;
 				pOHCIGeneralTransferDescriptor->pEndpoint = queue;
 				pOHCIGeneralTransferDescriptor->pType = type;
 				pOHCIGeneralTransferDescriptor->command = command;
-				transferOffset += segments32[0].fLength;
-				USBLog(7, "AppleUSBOHCI[%p]::CreateGeneralTransfer - added length of segment 0, transferOffset now %d", this, (int)transferOffset);
 
 				// only supply a callback when the entire buffer has been transfered.
-				if (transferOffset >= bufferSize)
+				if (planEntry.flags & kUSBTransferPlanEntryLast)
 				{
 					pOHCIGeneralTransferDescriptor->pShared->ohciFlags = HostToUSBLong(flags);
 					pOHCIGeneralTransferDescriptor->uimFlags |= kUIMFlagsCallbackTD;
@@ -236,7 +187,7 @@ AppleUSBOHCI::CreateGeneralTransfer(AppleOHCIEndpointDescriptorPtr queue, IOUSBC
     }
     else
     {
-        newOHCIGeneralTransferDescriptor = AllocateTD();
+        newOHCIGeneralTransferDescriptor = AllocateQueueTD(queue);
         if (newOHCIGeneralTransferDescriptor == NULL) 
         {
             status = kIOReturnNoMemory;
@@ -790,6 +741,51 @@ AppleUSBOHCI::UIMCreateInterruptTransfer(IOUSBCommand* command)
 
 
 
+// Sets aside on the interrupt ED of a polled endpoint the TDs for a read of maxBufferSize, or gives them back
+IOReturn
+AppleUSBOHCI::UIMReservePolledTDs(short functionNumber, short endpointNumber, UInt32 maxBufferSize, bool reserve)
+{
+    AppleOHCIEndpointDescriptorPtr			pED;
+    AppleOHCIEndpointDescriptorPtr			temp;
+	AppleOHCIGeneralTransferDescriptorPtr	pTD, pTDNext;
+	
+    pED = FindInterruptEndpoint(functionNumber, endpointNumber, kOHCIEDDirectionIn, &temp);
+    if (!pED)
+    {
+        USBLog(1, "AppleUSBOHCI[%p]::UIMReservePolledTDs - endpoint %d:%d not found", this, functionNumber, endpointNumber);
+        return kIOUSBEndpointNotFound;
+    }
+	
+	if (reserve)
+	{
+		IOUSBPolledTDReserveSetTarget(&pED->polledTDs, IOUSBPolledTDReserveTarget(maxBufferSize, kOHCIPageSize));
+		while (IOUSBPolledTDReserveShort(&pED->polledTDs))
+		{
+			pTD = AllocateTD();
+			if (!pTD)
+				break;
+			IOUSBPolledTDReserveGive<AppleOHCITDOps>(&pED->polledTDs, pTD);
+		}
+		if (!IOUSBPolledTDReserveShort(&pED->polledTDs))
+		{
+			USBLog(5, "AppleUSBOHCI[%p]::UIMReservePolledTDs - %d TDs set aside on ED (%p) for %d:%d", this, (int)pED->polledTDs.count, pED, functionNumber, endpointNumber);
+			return kIOReturnSuccess;
+		}
+		USBError(1, "AppleUSBOHCI[%p]::UIMReservePolledTDs - could not set aside TDs for %d:%d", this, functionNumber, endpointNumber);
+	}
+	
+	pTD = IOUSBPolledTDReserveDrain(&pED->polledTDs);
+	while (pTD)
+	{
+		pTDNext = pTD->pLogicalNext;
+		DeallocateTD(pTD);
+		pTD = pTDNext;
+	}
+	return reserve ? kIOReturnNoMemory : kIOReturnSuccess;
+}
+
+
+
 IOReturn
 AppleUSBOHCI::UIMCreateIsochEndpoint(
                                           short			functionAddress,
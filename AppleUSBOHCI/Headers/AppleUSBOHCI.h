@@ -34,6 +34,7 @@
 #include <IOKit/pci/IOPCIDevice.h>
 
 #include <IOKit/usb/IOUSBControllerV3.h>
+#include <IOKit/usb/IOUSBPolledTDReserve.h>
 #include <IOKit/usb/USB.h>
 #include <IOKit/usb/USBHub.h>
 
@@ -94,6 +95,7 @@ struct AppleOHCIEndpointDescriptorStruct
     void*							pLogicalTailP;		
     void*							pLogicalHeadP;
 	bool							pAborting;
+	IOUSBPolledTDReserve<AppleOHCIGeneralTransferDescriptor>	polledTDs;		// TDs set aside while a polled endpoint is registered on this ED
 };
 
 struct AppleOHCIGeneralTransferDescriptorStruct
@@ -110,6 +112,13 @@ struct AppleOHCIGeneralTransferDescriptorStruct
     UInt32									bufferSize;			// used only by control transfers to keep track of data buffers size leftover
 };
 
+// how an ED's IOUSBPolledTDReserve links its TDs
+struct AppleOHCITDOps
+{
+	static AppleOHCIGeneralTransferDescriptorPtr Next(AppleOHCIGeneralTransferDescriptorPtr pTD)							{ return pTD->pLogicalNext; }
+	static void SetNext(AppleOHCIGeneralTransferDescriptorPtr pTD, AppleOHCIGeneralTransferDescriptorPtr next)			{ pTD->pLogicalNext = next; }
+};
+
 struct AppleOHCIIsochTransferDescriptorStruct
 {
     UInt16									pType;						// Note this must appear at the same offset in GTD & ITD structs
@@ -252,6 +261,7 @@ protected:
     UInt32										findBufferRemaining (AppleOHCIGeneralTransferDescriptorPtr pCurrentTD);
     AppleOHCIIsochTransferDescriptorPtr			AllocateITD(void);
     AppleOHCIGeneralTransferDescriptorPtr		AllocateTD(void);
+    AppleOHCIGeneralTransferDescriptorPtr		AllocateQueueTD(AppleOHCIEndpointDescriptorPtr pED);
     AppleOHCIEndpointDescriptorPtr				AllocateED(void);
     IOReturn									TranslateStatusToUSBError(UInt32 status);
     
@@ -481,6 +491,8 @@ public:
 
     // method in 1.8.2
     virtual IOReturn UIMCreateInterruptTransfer(IOUSBCommand* command);
+	
+	virtual IOReturn UIMReservePolledTDs(short functionNumber, short endpointNumber, UInt32 maxBufferSize, bool reserve);
 
     // Isoch
     virtual IOReturn UIMCreateIsochEndpoint(short				functionAddress,
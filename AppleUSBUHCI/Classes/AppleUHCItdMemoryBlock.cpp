@@ -70,6 +70,8 @@ AppleUHCItdMemoryBlock::NewMemoryBlock(void)
 			}
 			me->_sharedLogical = (UHCITransferDescriptorSharedPtr)me->_buffer->getBytesNoCopy();
 			bzero(me->_sharedLogical, kUHCIPageSize);
+			bzero(me->_armedTDs, sizeof(me->_armedTDs));
+			me->_armedCount = 0;
 			status = dmaCommand->setMemoryDescriptor(me->_buffer);
 			if (status)
 			{
@@ -150,3 +152,95 @@ AppleUHCItdMemoryBlock::SetNextBlock(AppleUHCItdMemoryBlock* next)
 {
     _nextBlock = next;
 }
+
+
+
+// ArmTD and DisarmTD keep track of which TDs in this block the controller currently owns. Only
+// armed TDs are looked at by HasRetiredTDs, so the dummy TDs at the end of each queue and the
+// unused parts of the block are never touched when we look for completions
+void
+AppleUHCItdMemoryBlock::ArmTD(UInt32 index)
+{
+	UInt32		bit = 1 << (index & 31);
+	
+	if (index >= TDsPerBlock)
+		return;
+	
+	if (!(_armedTDs[index >> 5] & bit))
+	{
+		_armedTDs[index >> 5] |= bit;
+		_armedCount++;
+	}
+}
+
+
+
+void
+AppleUHCItdMemoryBlock::DisarmTD(UInt32 index)
+{
+	UInt32		bit = 1 << (index & 31);
+	
+	if (index >= TDsPerBlock)
+		return;
+	
+	if (_armedTDs[index >> 5] & bit)
+	{
+		_armedTDs[index >> 5] &= ~bit;
+		_armedCount--;
+	}
+}
+
+
+
+// returns true if any armed TD in this block has been retired (is no longer active) by the controller
+bool
+AppleUHCItdMemoryBlock::HasRetiredTDs(void)
+{
+	UInt32		word, armed, base;
+	
+	if (!_armedCount)
+		return false;
+	
+	for (word = 0; word < TDArmedWordsPerBlock; word++)
+	{
+		armed = _armedTDs[word];
+		if (!armed)
+			continue;								// no armed TDs in this part of the block - skip all 32 of them
+		
+		base = word << 5;
+		
+#if UHCI_USE_BATCHED_TD_SCAN
+		UInt32		group, i;
+		
+		// gather the status words 8 at a time into a contiguous array and test them together. TDs which are not armed
+		// are forced to look active, so one AND across the group tells us whether every armed TD is still active
+		for (group = 0; group < 32; group += 8)
+		{
+			UInt32		status[8];
+			UInt32		groupArmed = (armed >> group) & 0xFF;
+			UInt32		allActive;
+			
+			if (!groupArmed)
+				continue;
+			
+			for (i = 0; i < 8; i++)
+			{
+				UInt32		notArmed = ((groupArmed >> i) & 1) - 1;				// 0 if armed, 0xFFFFFFFF if not
+				status[i] = _sharedLogical[base + group + i].ctrlStatus | (notArmed & HostToUSBLong(kUHCI_TD_ACTIVE));
+			}
+			allActive = status[0] & status[1] & status[2] & status[3] & status[4] & status[5] & status[6] & status[7];
+			if (!(allActive & HostToUSBLong(kUHCI_TD_ACTIVE)))
+				return true;
+		}
+#else
+		UInt32		i;
+		
+		for (i = 0; i < 32; i++)
+		{
+			if ((armed & (1 << i)) && !(USBToHostLong(_sharedLogical[base + i].ctrlStatus) & kUHCI_TD_ACTIVE))
+				return true;
+		}
+#endif
+	}
+	return false;
+}
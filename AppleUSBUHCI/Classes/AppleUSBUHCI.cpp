@@ -50,6 +50,8 @@ extern "C" {
 
 #define super IOUSBControllerV3
 
+static UInt64	FSBRNowNS(void);
+
 
 /*
  * TODO:
@@ -313,6 +315,7 @@ AppleUSBUHCI::HardwareInit(void)
 	//	Don't link the software pointer.
 	//
     _lastQH->SetPhysicalLink(fsQH->GetPhysicalAddrWithType() | kUHCI_QH_T);					// start with a terminated list
+	UHCIFSBRPolicyLoopReset(&_fsbr, FSBRNowNS());
 
 	// Use 64-byte packets, and mark controller as configured
 	Command(kUHCI_CMD_MAXP | kUHCI_CMD_CF);
@@ -342,6 +345,8 @@ AppleUSBUHCI::UIMInitialize(IOService * provider)
     IOReturn		status;
 	int				i;
 	uint64_t		tempTime;
+	OSNumber		*idleWindowProp;
+	UInt32			idleWindowMS, maxIdleWindowMS;
     
     USBLog(7, "+AppleUSBUHCI[%p]::UIMInitialize", this);
     
@@ -435,6 +440,24 @@ AppleUSBUHCI::UIMInitialize(IOService * provider)
 			_rhResumePortTimerThread[i] = thread_call_allocate((thread_call_func_t)RHResumePortTimerEntry, (thread_call_param_t)this);
 		}
 		
+		// the bandwidth reclamation idle windows can be overridden from the personality
+		idleWindowMS = kUHCIFSBRIdleWindowMS;
+		maxIdleWindowMS = kUHCIFSBRMaxIdleWindowMS;
+		idleWindowProp = OSDynamicCast(OSNumber, getProperty("FSBRIdleWindowMS"));
+		if (idleWindowProp)
+			idleWindowMS = idleWindowProp->unsigned32BitValue();
+		idleWindowProp = OSDynamicCast(OSNumber, getProperty("FSBRMaxIdleWindowMS"));
+		if (idleWindowProp)
+			maxIdleWindowMS = idleWindowProp->unsigned32BitValue();
+		UHCIFSBRPolicyInit(&_fsbr, idleWindowMS, idleWindowMS ? maxIdleWindowMS : 0);
+		
+		_fsbrIdleTimer = IOTimerEventSource::timerEventSource(this, FSBRIdleTimerFired);
+		if (!_fsbrIdleTimer || (_workLoop->addEventSource(_fsbrIdleTimer) != kIOReturnSuccess))
+		{
+			USBError(1, "AppleUSBUHCI[%p]::UIMInitialize - could not create the FSBR idle timer", this);
+			return kIOReturnNoResources;
+		}
+		
         _uimInitialized = true;
 		
 		_myBusState = kUSBBusStateReset;
@@ -498,6 +521,15 @@ AppleUSBUHCI::UIMFinalize()
         _interruptSource = NULL;
     }
 	
+    if (_fsbrIdleTimer) 
+	{
+		_fsbrIdleTimer->cancelTimeout();
+        _workLoop->removeEventSource(_fsbrIdleTimer);
+        _fsbrIdleTimer->release();
+        _fsbrIdleTimer = NULL;
+		_fsbr.timerPending = false;
+    }
+	
     IOLockFree(_frameLock);
     _frameLock = NULL;
     
@@ -993,16 +1025,50 @@ AppleUSBUHCI::ProcessCompletedTransactions(void)
     {
 		USBLog(3, "AppleUSBUHCI[%p]::ProcessCompletedTransactions err isoch list %x", this, err);
     }
-    err = scavengeQueueHeads(_intrQH[kUHCI_NINTR_QHS - 1]);
-    if (err != kIOReturnSuccess)
-    {
-		USBLog(3, "AppleUSBUHCI[%p]::ProcessCompletedTransactions -  err queue heads %x", this, err);
-    }
+	// only walk the queue heads if the controller has actually retired one of the TDs we gave it
+	if (HaveRetiredTDs())
+	{
+		err = scavengeQueueHeads(_intrQH[kUHCI_NINTR_QHS - 1]);
+		if (err != kIOReturnSuccess)
+		{
+			USBLog(3, "AppleUSBUHCI[%p]::ProcessCompletedTransactions -  err queue heads %x", this, err);
+		}
+	}
 	
 }
 
 
 
+bool
+AppleUSBUHCI::HaveRetiredTDs(void)
+{
+	AppleUHCItdMemoryBlock		*memBlock = _tdMBHead;
+	
+	while (memBlock)
+	{
+		if (memBlock->HasRetiredTDs())
+			return true;
+		memBlock = memBlock->GetNextBlock();
+	}
+	return false;
+}
+
+
+
+// mark the TDs from pTD up to (but not including) stopAt as owned by the controller
+void
+AppleUSBUHCI::ArmTDChain(AppleUHCITransferDescriptor *pTD, AppleUHCITransferDescriptor *stopAt)
+{
+	while (pTD && (pTD != stopAt))
+	{
+		if (pTD->memBlock)
+			pTD->memBlock->ArmTD(pTD->memBlockIndex);
+		pTD = OSDynamicCast(AppleUHCITransferDescriptor, pTD->_logicalNext);
+	}
+}
+
+
+
 IOReturn						
 AppleUSBUHCI::scavengeIsochTransactions(void)
 {
@@ -1370,6 +1436,25 @@ AppleUSBUHCI::scavengeQueueHeads(IOUSBControllerListElement *pLE)
 
 
 
+// clear what a completed TD knew about its transfer, so that it can go straight into the endpoint's next one
+void
+AppleUSBUHCI::RecycleDoneTD(AppleUHCITransferDescriptor *pTD)
+{
+	pTD->GetSharedLogical()->ctrlStatus = 0;
+	if (pTD->memBlock)
+		pTD->memBlock->DisarmTD(pTD->memBlockIndex);
+	pTD->logicalBuffer = NULL;
+	pTD->command = NULL;
+	pTD->alignBuffer = NULL;
+	pTD->callbackOnTD = false;
+	pTD->multiXferTransaction = false;
+	pTD->finalXferInTransaction = false;
+	pTD->lastFrame = 0;
+	pTD->lastRemaining = 0;
+}
+
+
+
 IOReturn
 AppleUSBUHCI::UHCIUIMDoDoneQueueProcessing(AppleUHCITransferDescriptor *pHCDoneTD, OSStatus forceErr, AppleUHCITransferDescriptor *stopAt)
 {
@@ -1377,6 +1462,10 @@ AppleUSBUHCI::UHCIUIMDoDoneQueueProcessing(AppleUHCITransferDescriptor *pHCDoneT
     UInt32							bufferSizeRemaining = 0;
     AppleUHCITransferDescriptor		*nextTD;
     OSStatus						accumErr = kIOReturnSuccess;
+	AppleUHCIQueueHead				*pQH;
+	AppleUHCITransferDescriptor		*chainHead = NULL, *chainTail = NULL;			// the TDs of the transfer being completed
+	UInt32							chainCount = 0;
+	IOUSBCompletion					completion;
 	
     USBLog(7, "+AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing", this);
     while (pHCDoneTD != NULL)
@@ -1390,6 +1479,7 @@ AppleUSBUHCI::UHCIUIMDoDoneQueueProcessing(AppleUHCITransferDescriptor *pHCDoneT
         }
 		
         nextTD	= OSDynamicCast(AppleUHCITransferDescriptor, pHCDoneTD->_logicalNext);
+		pQH = pHCDoneTD->pQH;
         ctrlStatus = USBToHostLong(pHCDoneTD->GetSharedLogical()->ctrlStatus);
         token = USBToHostLong(pHCDoneTD->GetSharedLogical()->token);
 		if (forceErr != kIOReturnSuccess)
@@ -1422,58 +1512,76 @@ AppleUSBUHCI::UHCIUIMDoDoneQueueProcessing(AppleUHCITransferDescriptor *pHCDoneT
 		
 		bufferSizeRemaining += (UHCI_TD_GET_MAXLEN(token) - UHCI_TD_GET_ACTLEN(ctrlStatus));
 		
-		if (pHCDoneTD->callbackOnTD)
+		if (!chainHead)
+			chainHead = pHCDoneTD;
+		chainTail = pHCDoneTD;
+		chainCount++;
+		
+		if (!pHCDoneTD->callbackOnTD)
+		{
+			RecycleDoneTD(pHCDoneTD);
+			pHCDoneTD = nextTD;	// New qHead
+			continue;
+		}
+		
+		completion.action = NULL;
+		if ( pHCDoneTD->command == NULL )
+		{
+			USBError (1, "AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing pHCDoneTD->command is NULL (%p)", this, pHCDoneTD);
+		}
+		else
+		{
+			completion = pHCDoneTD->command->GetUSLCompletion();
+			if (!completion.action)
+			{	
+				USBError(1, "The UHCI driver has detected an error [completion.action == NULL]");
+			}
+		}
+		
+		// this is the last TD of the transfer. The transfer's TDs go back to the endpoint before the completion runs, since
+		// that may well queue the endpoint's next transfer, which can then reuse them
+		RecycleDoneTD(pHCDoneTD);
+		RecycleTDChain(pQH, chainHead, chainTail, chainCount);
+		chainHead = chainTail = NULL;
+		chainCount = 0;
+		
+		if (completion.action)
 		{
-			if ( pHCDoneTD->command == NULL )
+			if (errStatus)
 			{
-				USBError (1, "AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing pHCDoneTD->command is NULL (%p)", this, pHCDoneTD);
+				USBLog(3, "AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing - calling completion routine (%p) - err[%p] remain[%p]", this, completion.action, (void*)errStatus, (void*)bufferSizeRemaining);
 			}
-			else
+			Complete(completion, errStatus, bufferSizeRemaining);
+			if ((pQH->type == kUSBControl) || (pQH->type == kUSBBulk))
 			{
-				IOUSBCompletion completion = pHCDoneTD->command->GetUSLCompletion();
-				if (completion.action)
+				if (!_controlBulkTransactionsOut)
 				{
-					// remove flag before completing
-					pHCDoneTD->callbackOnTD = false;
-					if (errStatus)
-					{
-						USBLog(3, "AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing - calling completion routine (%p) - err[%p] remain[%p]", this, completion.action, (void*)errStatus, (void*)bufferSizeRemaining);
-					}
-					Complete(completion, errStatus, bufferSizeRemaining);
-					if ((pHCDoneTD->pQH->type == kUSBControl) || (pHCDoneTD->pQH->type == kUSBBulk))
-					{
-						if (!_controlBulkTransactionsOut)
-						{
-							USBError(1, "AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing - _controlBulkTransactionsOut underrun!", this);
-						}
-						else
-						{
-							_controlBulkTransactionsOut--;
-							USBLog(7, "AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing - _controlBulkTransactionsOut(%p) pHCDoneTD(%p)", this, (void*)_controlBulkTransactionsOut, pHCDoneTD);
-							if (!_controlBulkTransactionsOut)
-							{
-								UInt32 link;
-								link = _lastQH->GetPhysicalLink();
-								USBLog(7, "AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing - no more _controlBulkTransactionsOut - terminating list (%p to %p)", this, (void*)link, (void*)(link | kUHCI_QH_T));
-								_lastQH->SetPhysicalLink(link | kUHCI_QH_T);
-							}
-						}
-					}
-					bufferSizeRemaining = 0;	// So next transaction starts afresh.
-					accumErr = kIOReturnSuccess;
+					USBError(1, "AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing - _controlBulkTransactionsOut underrun!", this);
 				}
 				else
-				{	
-					USBError(1, "The UHCI driver has detected an error [completion.action == NULL]");
+				{
+					_controlBulkTransactionsOut--;
+					USBLog(7, "AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing - _controlBulkTransactionsOut(%p) pHCDoneTD(%p)", this, (void*)_controlBulkTransactionsOut, pHCDoneTD);
+					if (!_controlBulkTransactionsOut)
+					{
+						USBLog(7, "AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing - no more _controlBulkTransactionsOut", this);
+						FSBRAsyncWorkCompleted();
+					}
 				}
 			}
+			bufferSizeRemaining = 0;	// So next transaction starts afresh.
+			accumErr = kIOReturnSuccess;
 		}
-		pHCDoneTD->logicalBuffer = NULL;
-		USBLog(7, "AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing - deallocating TD (%p)", this, pHCDoneTD);
-		DeallocateTD(pHCDoneTD);
         pHCDoneTD = nextTD;	// New qHead
     }
 	
+	// the TDs of a transfer which did not reach its last TD before stopAt
+	if (chainHead)
+	{
+		chainTail->_logicalNext = NULL;
+		FreeTDChain(chainHead);
+	}
+	
     USBLog(7, "-AppleUSBUHCI[%p]::UHCIUIMDoDoneQueueProcessing", this);
     return(kIOReturnSuccess);
 }
@@ -1494,6 +1602,103 @@ AppleUSBUHCI::ReturnIsochDoneQueue(IOUSBControllerIsochEndpoint* isochEP)
 }
 
 
+// ========================================================================
+#pragma mark Bandwidth reclamation
+// ========================================================================
+
+// The FSBR policy (UHCIFSBRPolicy.h) decides, and these apply what it decided to the schedule and the idle timer
+static UInt64
+FSBRNowNS(void)
+{
+	uint64_t		now = mach_absolute_time();
+	uint64_t		nanoSeconds;
+	
+	absolutetime_to_nanoseconds(*(AbsoluteTime*)&now, &nanoSeconds);
+	return nanoSeconds;
+}
+
+
+
+// Called when the first control or bulk transaction is queued
+void
+AppleUSBUHCI::FSBRAsyncWorkQueued(void)
+{
+	FSBRApplyActions(UHCIFSBRPolicyWorkQueued(&_fsbr, FSBRNowNS()));
+}
+
+
+
+// Called when the last outstanding control or bulk transaction completes
+void
+AppleUSBUHCI::FSBRAsyncWorkCompleted(void)
+{
+	UInt32		actions = UHCIFSBRPolicyWorkCompleted(&_fsbr, FSBRNowNS());
+	
+	if ((actions & kUHCIFSBRActionArmTimer) && !_fsbrIdleTimer)
+	{
+		// no timer to wait out the window with - open the loop right away
+		UHCIFSBRPolicyIdleTimerFired(&_fsbr, FSBRNowNS(), 0);
+		actions = kUHCIFSBRActionDisengage;
+	}
+	FSBRApplyActions(actions);
+}
+
+
+
+void
+AppleUSBUHCI::FSBRIdleTimerFired(OSObject *owner, IOTimerEventSource *sender)
+{
+#pragma unused (sender)
+	AppleUSBUHCI		*me = OSDynamicCast(AppleUSBUHCI, owner);
+	
+	if (!me)
+		return;
+	
+	me->FSBRApplyActions(UHCIFSBRPolicyIdleTimerFired(&me->_fsbr, FSBRNowNS(), me->_controlBulkTransactionsOut));
+}
+
+
+
+void
+AppleUSBUHCI::FSBRApplyActions(UInt32 actions)
+{
+	UInt32			link = _lastQH->GetPhysicalLink();
+	
+	if (actions & kUHCIFSBRActionCancelTimer)
+		_fsbrIdleTimer->cancelTimeout();
+	
+	if (actions & kUHCIFSBRActionEngage)
+	{
+		USBLog(7, "AppleUSBUHCI[%p]::FSBRApplyActions - closing the reclamation loop (%p to %p)", this, (void*)link, (void*)(link & ~kUHCI_QH_T));
+		_lastQH->SetPhysicalLink(link & ~kUHCI_QH_T);
+	}
+	
+	if (actions & kUHCIFSBRActionDisengage)
+	{
+		USBLog(7, "AppleUSBUHCI[%p]::FSBRApplyActions - opening the reclamation loop (%p to %p)", this, (void*)link, (void*)(link | kUHCI_QH_T));
+		_lastQH->SetPhysicalLink(link | kUHCI_QH_T);
+	}
+	
+	if (actions & kUHCIFSBRActionArmTimer)
+		_fsbrIdleTimer->setTimeoutMS(_fsbr.idleWindowCurrentMS);
+}
+
+
+
+// Called from UIMCheckForTimeouts, so the registry is only touched about once a second
+void
+AppleUSBUHCI::FSBRPublishStatistics(void)
+{
+	setProperty("FSBRTimeInMS", (UInt32)(UHCIFSBRPolicyEngagedNS(&_fsbr, FSBRNowNS()) / NANOSECOND_TO_MILLISECOND), 32);
+	setProperty("FSBREngagements", _fsbr.engagements, 32);
+	setProperty("FSBRDisengagements", _fsbr.disengagements, 32);
+	setProperty("FSBRIdleWindowsCancelled", _fsbr.idleWindowsCancelled, 32);
+	setProperty("FSBRIdleWindowIncreases", _fsbr.idleWindowIncreases, 32);
+	setProperty("FSBRIdleWindowMS", _fsbr.idleWindowCurrentMS, 32);
+}
+
+
+
 // ========================================================================
 #pragma mark Memory management
 // ========================================================================
@@ -1525,6 +1730,11 @@ AppleUSBUHCI::AllocateTD(AppleUHCIQueueHead *pQH)
 		numTDs = memBlock->NumTDs();
 		_pLastFreeTD = AppleUHCITransferDescriptor::WithSharedMemory(memBlock->GetLogicalPtr(0), memBlock->GetPhysicalPtr(0));
         _pFreeTD = _pLastFreeTD;
+		if (_pLastFreeTD)
+		{
+			_pLastFreeTD->memBlock = memBlock;
+			_pLastFreeTD->memBlockIndex = 0;
+		}
 		for (i=1; i < numTDs; i++)
 		{
 			freeTD = AppleUHCITransferDescriptor::WithSharedMemory(memBlock->GetLogicalPtr(i), memBlock->GetPhysicalPtr(i));
@@ -1534,6 +1744,8 @@ AppleUSBUHCI::AllocateTD(AppleUHCIQueueHead *pQH)
 				freeTD = _pFreeTD;
 				break;
 			}
+			freeTD->memBlock = memBlock;
+			freeTD->memBlockIndex = i;
 			freeTD->_logicalNext = _pFreeTD;
 			_pFreeTD = freeTD;
 			// in a normal loop termination, freeED and _pFreeED are the same, just like when we don't use this code
@@ -1570,6 +1782,8 @@ AppleUSBUHCI::DeallocateTD(AppleUHCITransferDescriptor *pTD)
 	
 	pTD->GetSharedLogical()->ctrlStatus = 0;
     pTD->_logicalNext = NULL;
+	if (pTD->memBlock)
+		pTD->memBlock->DisarmTD(pTD->memBlockIndex);
 	
     if (_pLastFreeTD)
     {
@@ -1588,6 +1802,98 @@ AppleUSBUHCI::DeallocateTD(AppleUHCITransferDescriptor *pTD)
 
 
 
+// deallocate a chain of TDs linked through _logicalNext and terminated after the last one
+void
+AppleUSBUHCI::FreeTDChain(AppleUHCITransferDescriptor *pTD)
+{
+	AppleUHCITransferDescriptor		*nextTD;
+	
+	while (pTD)
+	{
+		nextTD = OSDynamicCast(AppleUHCITransferDescriptor, pTD->_logicalNext);
+		DeallocateTD(pTD);
+		pTD = nextTD;
+	}
+}
+
+
+
+// keep the TDs of a completed transfer, still linked from head to tail, for the endpoint's next transfer
+void
+AppleUSBUHCI::RecycleTDChain(AppleUHCIQueueHead *pQH, AppleUHCITransferDescriptor *head, AppleUHCITransferDescriptor *tail, UInt32 count)
+{
+	AppleUHCITransferDescriptor		*discard;
+	
+	if (pQH)
+		discard = UHCITDChainReservoirGiveBack<AppleUHCITDChainOps>(&pQH->tdReservoir, head, tail, count);
+	else
+	{
+		tail->_logicalNext = NULL;
+		discard = head;
+	}
+	
+	if (discard)
+	{
+		_tdReservoirDiscards++;
+		FreeTDChain(discard);
+	}
+}
+
+
+
+// return the TDs an endpoint has been keeping to the controller wide free list
+void
+AppleUSBUHCI::FlushTDChainReservoir(AppleUHCIQueueHead *pQH)
+{
+	if (pQH->tdReservoir.count)
+	{
+		USBLog(6, "AppleUSBUHCI[%p]::FlushTDChainReservoir - QH (%p) fn (%d) ep (%d) kept %d TDs - hits (%d) misses (%d) discards (%d)", this, pQH, pQH->functionNumber, pQH->endpointNumber, (int)pQH->tdReservoir.count, (int)pQH->tdReservoir.hits, (int)pQH->tdReservoir.misses, (int)pQH->tdReservoir.discards);
+	}
+	FreeTDChain(UHCITDChainReservoirFlush<AppleUHCITDChainOps>(&pQH->tdReservoir));
+}
+
+
+
+// Called from UIMCheckForTimeouts. An endpoint which has not reused its TDs for a whole timeout period gives them back
+void
+AppleUSBUHCI::CheckTDChainReservoirs(void)
+{
+	AppleUHCIQueueHead		*pQH;
+	OSDictionary			*dict;
+	OSNumber				*num;
+	UInt32					held = 0;
+	int						loopCount = 0;
+	int						i;
+	
+	for (pQH = _intrQH[kUHCI_NINTR_QHS-1]; pQH && (pQH != _lastQH) && (loopCount++ < 1000); pQH = OSDynamicCast(AppleUHCIQueueHead, pQH->_logicalNext))
+	{
+		if (UHCITDChainReservoirIdleCheck(&pQH->tdReservoir))
+			FlushTDChainReservoir(pQH);
+		held += pQH->tdReservoir.count;
+	}
+	
+	UInt32				values[4] = {_tdReservoirHits, _tdReservoirMisses, _tdReservoirDiscards, held};
+	const char *		names[4] = {"Hits", "Misses", "Discards", "TDsHeld"};
+	
+	dict = OSDictionary::withCapacity(4);
+	if (!dict)
+		return;
+	
+	for (i=0; i < 4; i++)
+	{
+		num = OSNumber::withNumber(values[i], 32);
+		if (num)
+		{
+			dict->setObject(names[i], num);
+			num->release();
+		}
+	}
+	setProperty("TDChainReservoir", dict);
+	dict->release();
+}
+
+
+
 AppleUHCIIsochTransferDescriptor* 
 AppleUSBUHCI::AllocateITD(void)
 {
@@ -1737,6 +2043,7 @@ AppleUSBUHCI::AllocateQH(UInt16 functionNumber, UInt16 endpointNumber, UInt8 dir
 		freeQH->maxPacketSize = maxPacketSize;
 		freeQH->type = type;
         freeQH->stalled = false;
+		UHCITDChainReservoirInit(&freeQH->tdReservoir, (type == kQHTypeDummy) ? 0 : (UInt32)kUHCITDChainReservoirLimit);
 	}
     return freeQH;
 }
@@ -1750,6 +2057,8 @@ AppleUSBUHCI::DeallocateQH(AppleUHCIQueueHead *pQH)
 {
     UInt32		physical;
 	
+	FlushTDChainReservoir(pQH);
+	
     //zero out all unnecessary fields
     pQH->_logicalNext = NULL;
 	
@@ -1800,23 +2109,17 @@ IOReturn
 AppleUSBUHCI::InitializeBufferMemory()
 {
 	IOReturn									status;
-	char *										logicalBytes;
 	UInt64										offset = 0;
 	IODMACommand::Segment32						segments;
 	UInt32										numSegments = 1;
     IOPhysicalAddress							pPhysical= 0;
 	IODMACommand *								dmaCommand = NULL;
-	UHCIAlignmentBuffer							*alignBuf;
-	bool										alignBufferPrepared = false;
-	bool										isochBufferPrepared = false;
 	bool										frameBufferPrepared = false;
-	int											i,j;
+	int											i;
 	
 	// make sure that things are initialized to NULL
-	_cbiAlignBuffer = NULL;
-	_isochAlignBuffer = NULL;
-	queue_init(&_cbiAlignmentBuffers);
-	queue_init(&_isochAlignmentBuffers);
+	InitAlignmentBufferPool(&_cbiAlignmentBuffers, UHCIAlignmentBuffer::kTypeCBI, kUHCI_BUFFER_CBI_ALIGN_SIZE, 0, 0);
+	InitAlignmentBufferPool(&_isochAlignmentBuffers, UHCIAlignmentBuffer::kTypeIsoch, kUHCI_BUFFER_ISOCH_ALIGN_SIZE, 0, 0);
 
 	// Use IODMACommand to get the physical address
 	dmaCommand = IODMACommand::withSpecification(kIODMACommandOutputHost32, 32, PAGE_SIZE, (IODMACommand::MappingOptions)(IODMACommand::kMapped | IODMACommand::kIterateOnly));
@@ -1876,120 +2179,17 @@ AppleUSBUHCI::InitializeBufferMemory()
 		_framesPaddr = pPhysical;
 		dmaCommand->clearMemoryDescriptor();
 		
-		// set up some alignment buffers for control/bulk/interrupt
-		_cbiAlignBuffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIOMemoryUnshared | kIODirectionInOut, PAGE_SIZE, kUHCIStructureAllocationPhysicalMask);
-		if (!_cbiAlignBuffer)
-		{
-			USBError(1, "AppleUSBUHCI[%p]::InitializeBufferMemory - could not get alignment buffer", this);
-			status = kIOReturnNoMemory;
-			break;
-		}
-		status = _cbiAlignBuffer->prepare();
-		if (status)
-		{
-			USBError(1, "AppleUSBUHCI[%p]::InitializeBufferMemory - _alignBuffer->prepare failed with status(%p)", this, (void*)status);
-			break;
-		}
-		alignBufferPrepared = true;
-		status = dmaCommand->setMemoryDescriptor(_cbiAlignBuffer);
-		if (status)
-		{
-			USBError(1, "AppleUSBUHCI[%p]::InitializeBufferMemory - setMemoryDescriptor (_alignBuffer) returned err (%p)", this, (void*)status);
-			break;
-		}
+		// set up the alignment buffer pools. Each isoch transfer can be up to a max of 1023 bytes, so each isoch alignment buffer
+		// needs to be at least that much -- we make them 1024 bytes.  We start with kUHCI_BUFFER_ISOCH_ALIGN_QTY isoch buffers and one
+		// page of control/bulk/interrupt buffers, and let the pools grow from there
+		InitAlignmentBufferPool(&_cbiAlignmentBuffers, UHCIAlignmentBuffer::kTypeCBI, kUHCI_BUFFER_CBI_ALIGN_SIZE, 1, kUHCI_BUFFER_CBI_MAX_CHUNKS);
+		InitAlignmentBufferPool(&_isochAlignmentBuffers, UHCIAlignmentBuffer::kTypeIsoch, kUHCI_BUFFER_ISOCH_ALIGN_SIZE, (kUHCI_BUFFER_ISOCH_ALIGN_QTY * kUHCI_BUFFER_ISOCH_ALIGN_SIZE) / PAGE_SIZE, kUHCI_BUFFER_ISOCH_MAX_CHUNKS);
 		
-		logicalBytes = (char*)_cbiAlignBuffer->getBytesNoCopy();
-
-		offset = 0;
-		segments.fIOVMAddr = 0;
-		segments.fLength = 0;
-		numSegments = 1;
-		
-		status = dmaCommand->gen32IOVMSegments(&offset, &segments, &numSegments);
-		if (status || (numSegments != 1) || (segments.fLength != PAGE_SIZE))
-		{
-			USBError(1, "AppleUSBUHCI[%p]::InitializeBufferMemory - could not generate segments err (%p) numSegments (%d) fLength (%d)", this, (void*)status, (int)numSegments, (int)segments.fLength);
-			dmaCommand->clearMemoryDescriptor();
-			status = status ? status : kIOReturnInternalError;
-			break;
-		}
-		pPhysical = segments.fIOVMAddr;
-		for (i=0; i < (PAGE_SIZE/kUHCI_BUFFER_CBI_ALIGN_SIZE); i++)
-		{
-			alignBuf = new UHCIAlignmentBuffer;
-			if (!alignBuf)
-			{
-				USBError(1, "AppleUSBUHCI[%p]::InitializeBufferMemory - unable to allocate expected UHCIAlignmentBuffer", this);
-				break;
-			}
-			alignBuf->paddr = pPhysical+(i*kUHCI_BUFFER_CBI_ALIGN_SIZE);
-			alignBuf->vaddr = (IOVirtualAddress)(logicalBytes+(i*kUHCI_BUFFER_CBI_ALIGN_SIZE));
-			alignBuf->userBuffer = NULL;
-			alignBuf->userOffset = 0;
-			alignBuf->type = UHCIAlignmentBuffer::kTypeCBI;
-			queue_enter(&_cbiAlignmentBuffers, alignBuf, UHCIAlignmentBuffer *, chain);
-		}
-		dmaCommand->clearMemoryDescriptor();
+		for (i=0; (i < (int)_cbiAlignmentBuffers.minChunks) && !status; i++)
+			status = GrowAlignmentBufferPool(&_cbiAlignmentBuffers);
 		
-		// Set up some alignment buffers for isoch.  Note that each isoch transfer can be up to a max for 1023 bytes, so each alignment buffer needs to be
-		// at least that much -- we make them 1024 bytes.  We allocate kUHCI_BUFFER_ISOCH_ALIGN_QTY buffers to begin with.
-		
-		_isochAlignBuffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIOMemoryUnshared | kIODirectionInOut, kUHCI_BUFFER_ISOCH_ALIGN_QTY * kUHCI_BUFFER_ISOCH_ALIGN_SIZE, kUHCIStructureAllocationPhysicalMask);
-		if (!_isochAlignBuffer)
-		{
-			USBError(1, "AppleUSBUHCI[%p]::InitializeBufferMemory - could not get isoch alignment buffer", this);
-			status = kIOReturnNoMemory;
-			break;
-		}
-		status = _isochAlignBuffer->prepare();
-		if (status)
-		{
-			USBError(1, "AppleUSBUHCI[%p]::InitializeBufferMemory - _alignBuffer->prepare failed with status(%p)", this, (void*)status);
-			break;
-		}
-		isochBufferPrepared = true;
-		status = dmaCommand->setMemoryDescriptor(_isochAlignBuffer);
-		if (status)
-		{
-			USBError(1, "AppleUSBUHCI[%p]::InitializeBufferMemory - setMemoryDescriptor (_alignBuffer) returned err (%p)", this, (void*)status);
-			break;
-		}
-		
-		logicalBytes = (char*)_isochAlignBuffer->getBytesNoCopy();
-
-		for (j=0; j < (kUHCI_BUFFER_ISOCH_ALIGN_QTY * kUHCI_BUFFER_ISOCH_ALIGN_SIZE / PAGE_SIZE) ; j++ )
-		{
-			offset = j * PAGE_SIZE;
-		segments.fIOVMAddr = 0;
-		segments.fLength = 0;
-		numSegments = 1;
-		
-		status = dmaCommand->gen32IOVMSegments(&offset, &segments, &numSegments);
-		if (status || (numSegments != 1) || (segments.fLength != PAGE_SIZE))
-		{
-			USBError(1, "AppleUSBUHCI[%p]::InitializeBufferMemory - could not generate segments err (%p) numSegments (%d) fLength (%d)", this, (void*)status, (int)numSegments, (int)segments.fLength);
-			dmaCommand->clearMemoryDescriptor();
-			status = status ? status : kIOReturnInternalError;
-			break;
-		}
-		pPhysical = segments.fIOVMAddr;
-		for (i=0; i < (PAGE_SIZE/kUHCI_BUFFER_ISOCH_ALIGN_SIZE); i++)
-		{
-			alignBuf = new UHCIAlignmentBuffer;
-			if (!alignBuf)
-			{
-				USBError(1, "AppleUSBUHCI[%p]::InitializeBufferMemory - unable to allocate expected UHCIAlignmentBuffer", this);
-				break;
-			}
-			alignBuf->paddr = pPhysical+(i*kUHCI_BUFFER_ISOCH_ALIGN_SIZE);
-				alignBuf->vaddr = (IOVirtualAddress)(logicalBytes + (j*PAGE_SIZE) + (i*kUHCI_BUFFER_ISOCH_ALIGN_SIZE));
-			alignBuf->userBuffer = NULL;
-			alignBuf->userOffset = 0;
-			alignBuf->type = UHCIAlignmentBuffer::kTypeIsoch;
-			queue_enter(&_isochAlignmentBuffers, alignBuf, UHCIAlignmentBuffer *, chain);
-		}
-		}
-		dmaCommand->clearMemoryDescriptor();
+		for (i=0; (i < (int)_isochAlignmentBuffers.minChunks) && !status; i++)
+			status = GrowAlignmentBufferPool(&_isochAlignmentBuffers);
 		
 	} while (false);
 	
@@ -2002,20 +2202,8 @@ AppleUSBUHCI::InitializeBufferMemory()
 			_frameListBuffer->release();
 			_frameListBuffer = NULL;
 		}
-		if (_cbiAlignBuffer)
-		{
-			if (alignBufferPrepared)
-				_cbiAlignBuffer->complete();
-			_cbiAlignBuffer->release();
-			_cbiAlignBuffer = NULL;
-		}
-		if (_isochAlignBuffer)
-		{
-			if (alignBufferPrepared)
-				_isochAlignBuffer->complete();
-			_isochAlignBuffer->release();
-			_isochAlignBuffer = NULL;
-		}
+		FreeAlignmentBufferPool(&_cbiAlignmentBuffers);
+		FreeAlignmentBufferPool(&_isochAlignmentBuffers);
 	}
 	
 	if (dmaCommand)
@@ -2034,52 +2222,190 @@ AppleUSBUHCI::InitializeBufferMemory()
 void
 AppleUSBUHCI::FreeBufferMemory()
 {
-	UHCIAlignmentBuffer			*ap;
+	FreeAlignmentBufferPool(&_cbiAlignmentBuffers);
+	FreeAlignmentBufferPool(&_isochAlignmentBuffers);
 	
-	while (!queue_empty(&_cbiAlignmentBuffers)) 
+	if (_frameListBuffer)
 	{
-		queue_remove_first(&_cbiAlignmentBuffers, ap, UHCIAlignmentBuffer *, chain);
-		ap->release();
+		_frameListBuffer->complete();
+		_frameListBuffer->release();
+		_frameListBuffer = NULL;
 	}
+}
+
+
+
+void
+AppleUSBUHCI::InitAlignmentBufferPool(UHCIAlignmentBufferPool *pool, UHCIAlignmentBuffer::bufferType type, UInt32 bufferSize, UInt32 minChunks, UInt32 maxChunks)
+{
+	UHCIAlignmentBufferPoolInit(pool, type, bufferSize, minChunks, maxChunks);
+}
+
+
+
+// add one page worth of buffers to the pool
+IOReturn
+AppleUSBUHCI::GrowAlignmentBufferPool(UHCIAlignmentBufferPool *pool)
+{
+	IOReturn									status;
+	IODMACommand *								dmaCommand = NULL;
+	IODMACommand::Segment32						segments;
+	UInt64										offset = 0;
+	UInt32										numSegments = 1;
+	UHCIAlignmentBufferChunk					*chunk;
+	UHCIAlignmentBuffer							*alignBuf;
+	char *										logicalBytes;
+	UInt32										i;
 	
-	while (!queue_empty(&_isochAlignmentBuffers)) 
+	if (!UHCIAlignmentBufferPoolCanGrow(pool))
 	{
-		queue_remove_first(&_isochAlignmentBuffers, ap, UHCIAlignmentBuffer *, chain);
-		ap->release();
+		USBLog(3, "AppleUSBUHCI[%p]::GrowAlignmentBufferPool - pool (%p) already has the maximum (%d) chunks", this, pool, (int)pool->maxChunks);
+		return kIOReturnNoResources;
 	}
 	
-	if (_frameListBuffer)
+	chunk = new UHCIAlignmentBufferChunk;
+	if (!chunk)
+		return kIOReturnNoMemory;
+	
+	chunk->buffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIOMemoryUnshared | kIODirectionInOut, PAGE_SIZE, kUHCIStructureAllocationPhysicalMask);
+	if (!chunk->buffer)
 	{
-		_frameListBuffer->complete();
-		_frameListBuffer->release();
-		_frameListBuffer = NULL;
+		USBError(1, "AppleUSBUHCI[%p]::GrowAlignmentBufferPool - could not get alignment buffer page", this);
+		chunk->release();
+		return kIOReturnNoMemory;
+	}
+	
+	status = chunk->buffer->prepare();
+	if (status)
+	{
+		USBError(1, "AppleUSBUHCI[%p]::GrowAlignmentBufferPool - prepare failed with status(%p)", this, (void*)status);
+		chunk->buffer->release();
+		chunk->release();
+		return status;
+	}
+	
+	// Use IODMACommand to get the physical address
+	dmaCommand = IODMACommand::withSpecification(kIODMACommandOutputHost32, 32, PAGE_SIZE, (IODMACommand::MappingOptions)(IODMACommand::kMapped | IODMACommand::kIterateOnly));
+	if (!dmaCommand)
+	{
+		USBError(1, "AppleUSBUHCI[%p]::GrowAlignmentBufferPool - could not create IODMACommand", this);
+		status = kIOReturnInternalError;
+	}
+	else
+	{
+		status = dmaCommand->setMemoryDescriptor(chunk->buffer);
+		if (!status)
+		{
+			segments.fIOVMAddr = 0;
+			segments.fLength = 0;
+			status = dmaCommand->gen32IOVMSegments(&offset, &segments, &numSegments);
+			if (!status && ((numSegments != 1) || (segments.fLength != PAGE_SIZE)))
+				status = kIOReturnInternalError;
+			dmaCommand->clearMemoryDescriptor();
+		}
+		dmaCommand->release();
 	}
-	if (_cbiAlignBuffer)
+	if (status)
 	{
-		_cbiAlignBuffer->complete();
-		_cbiAlignBuffer->release();
-		_cbiAlignBuffer = NULL;
+		USBError(1, "AppleUSBUHCI[%p]::GrowAlignmentBufferPool - could not generate segments err (%p) numSegments (%d) fLength (%d)", this, (void*)status, (int)numSegments, (int)segments.fLength);
+		chunk->buffer->complete();
+		chunk->buffer->release();
+		chunk->release();
+		return status;
 	}
-	if (_isochAlignBuffer)
+	
+	logicalBytes = (char*)chunk->buffer->getBytesNoCopy();
+	for (i=0; i < (PAGE_SIZE / pool->bufferSize); i++)
 	{
-		_isochAlignBuffer->complete();
-		_isochAlignBuffer->release();
-		_isochAlignBuffer = NULL;
+		alignBuf = new UHCIAlignmentBuffer;
+		if (!alignBuf)
+		{
+			USBError(1, "AppleUSBUHCI[%p]::GrowAlignmentBufferPool - unable to allocate expected UHCIAlignmentBuffer", this);
+			break;
+		}
+		alignBuf->paddr = segments.fIOVMAddr + (i * pool->bufferSize);
+		alignBuf->vaddr = (IOVirtualAddress)(logicalBytes + (i * pool->bufferSize));
+		alignBuf->userBuffer = NULL;
+		alignBuf->userOffset = 0;
+		alignBuf->type = (UHCIAlignmentBuffer::bufferType)pool->type;
+		UHCIAlignmentBufferPoolAddBuffer(pool, chunk, alignBuf);
 	}
+	
+	UHCIAlignmentBufferPoolAddChunk(pool, chunk);
+	
+	USBLog(5, "AppleUSBUHCI[%p]::GrowAlignmentBufferPool - pool (%p) now has %d chunks", this, pool, (int)pool->numChunks);
+	return kIOReturnSuccess;
 }
 
+
+
+// give back any chunk beyond the pool's minimum whose buffers are all free
+void
+AppleUSBUHCI::ShrinkAlignmentBufferPool(UHCIAlignmentBufferPool *pool)
+{
+	UHCIAlignmentBufferChunk		*chunk;
+	UHCIAlignmentBuffer				*ap;
+	queue_head_t					released;
+	
+	queue_init(&released);
+	while ((chunk = UHCIAlignmentBufferPoolRemoveIdleChunk<UHCIAlignmentBuffer, UHCIAlignmentBufferChunk>(pool, &released)))
+	{
+		while (!queue_empty(&released))
+		{
+			queue_remove_first(&released, ap, UHCIAlignmentBuffer *, chain);
+			ap->release();
+		}
+		chunk->buffer->complete();
+		chunk->buffer->release();
+		chunk->release();
+		USBLog(5, "AppleUSBUHCI[%p]::ShrinkAlignmentBufferPool - pool (%p) now has %d chunks", this, pool, (int)pool->numChunks);
+	}
+}
+
+
+
+void
+AppleUSBUHCI::FreeAlignmentBufferPool(UHCIAlignmentBufferPool *pool)
+{
+	UHCIAlignmentBufferChunk		*chunk;
+	UHCIAlignmentBuffer				*ap;
+	
+	while (!queue_empty(&pool->freeBuffers)) 
+	{
+		queue_remove_first(&pool->freeBuffers, ap, UHCIAlignmentBuffer *, chain);
+		ap->release();
+	}
+	
+	while (!queue_empty(&pool->chunks)) 
+	{
+		queue_remove_first(&pool->chunks, chunk, UHCIAlignmentBufferChunk *, chain);
+		chunk->buffer->complete();
+		chunk->buffer->release();
+		chunk->release();
+	}
+	pool->numChunks = 0;
+}
+
+
+
 UHCIAlignmentBuffer *
-AppleUSBUHCI::GetCBIAlignmentBuffer()
+AppleUSBUHCI::GetAlignmentBuffer(UHCIAlignmentBufferPool *pool)
 {
 	UHCIAlignmentBuffer			*ap;
-	UInt32						align;
 	
-	if (queue_empty(&_cbiAlignmentBuffers)) 
+	ap = UHCIAlignmentBufferPoolGet<UHCIAlignmentBuffer>(pool);
+	if (!ap)
 	{
-		USBError(1, "AppleUSBUHCI[%p]::GetCBIAlignmentBuffer - ran out of alignment buffers", this);
-		return NULL;
+		if (GrowAlignmentBufferPool(pool) != kIOReturnSuccess)
+		{
+			USBError(1, "AppleUSBUHCI[%p]::GetAlignmentBuffer - ran out of alignment buffers (%d chunks of %d byte buffers)", this, (int)pool->numChunks, (int)pool->bufferSize);
+			return NULL;
+		}
+		ap = UHCIAlignmentBufferPoolTake<UHCIAlignmentBuffer>(pool);
+		if (!ap)
+			return NULL;
 	}
-	queue_remove_first(&_cbiAlignmentBuffers, ap, UHCIAlignmentBuffer *, chain);
+	
 	ap->userBuffer = NULL;
 	ap->userOffset = 0;
 	ap->controller = this;
@@ -2087,11 +2413,71 @@ AppleUSBUHCI::GetCBIAlignmentBuffer()
 }
 
 
+
+void
+AppleUSBUHCI::ReleaseAlignmentBuffer(UHCIAlignmentBufferPool *pool, UHCIAlignmentBuffer *ap)
+{
+	UHCIAlignmentBufferPoolRelease(pool, ap);
+}
+
+
+
+void
+AppleUSBUHCI::PublishAlignmentBufferPool(UHCIAlignmentBufferPool *pool, const char *key)
+{
+	OSDictionary		*dict;
+	OSNumber			*num;
+	UInt32				values[5] = {pool->hits, pool->misses, pool->grows, pool->shrinks, pool->numChunks};
+	const char *		names[5] = {"Hits", "Misses", "Grows", "Shrinks", "Chunks"};
+	int					i;
+	
+	dict = OSDictionary::withCapacity(5);
+	if (!dict)
+		return;
+	
+	for (i=0; i < 5; i++)
+	{
+		num = OSNumber::withNumber(values[i], 32);
+		if (num)
+		{
+			dict->setObject(names[i], num);
+			num->release();
+		}
+	}
+	setProperty(key, dict);
+	dict->release();
+}
+
+
+
+// Called from UIMCheckForTimeouts. A pool which has not run dry since the last check is considered idle and may shrink
+void
+AppleUSBUHCI::CheckAlignmentBufferPools(void)
+{
+	if (UHCIAlignmentBufferPoolIdleCheck(&_cbiAlignmentBuffers))
+		ShrinkAlignmentBufferPool(&_cbiAlignmentBuffers);
+	
+	if (UHCIAlignmentBufferPoolIdleCheck(&_isochAlignmentBuffers))
+		ShrinkAlignmentBufferPool(&_isochAlignmentBuffers);
+	
+	PublishAlignmentBufferPool(&_cbiAlignmentBuffers, "CBIAlignmentBufferPool");
+	PublishAlignmentBufferPool(&_isochAlignmentBuffers, "IsochAlignmentBufferPool");
+}
+
+
+
+UHCIAlignmentBuffer *
+AppleUSBUHCI::GetCBIAlignmentBuffer()
+{
+	return GetAlignmentBuffer(&_cbiAlignmentBuffers);
+}
+
+
 void
 AppleUSBUHCI::ReleaseCBIAlignmentBuffer(UHCIAlignmentBuffer *ap)
 {
 	// USBLog(7, "AppleUSBUHCI[%p]::ReleaseAlignmentBuffer - putting alignment buffer %p into freeBuffers", this, ap);
-	queue_enter(&_cbiAlignmentBuffers, ap, UHCIAlignmentBuffer *, chain);
+	ReleaseAlignmentBuffer(&_cbiAlignmentBuffers, ap);
 }
 
 
@@ -2099,17 +2485,10 @@ UHCIAlignmentBuffer *
 AppleUSBUHCI::GetIsochAlignmentBuffer()
 {
 	UHCIAlignmentBuffer			*ap;
-	UInt32						align;
 	
-	if (queue_empty(&_isochAlignmentBuffers)) 
-	{
-		USBError(1, "AppleUSBUHCI[%p]::GetIsochAlignmentBuffer - ran out of alignment buffers", this);
+	ap = GetAlignmentBuffer(&_isochAlignmentBuffers);
+	if (!ap)
 		return NULL;
-	}
-	queue_remove_first(&_isochAlignmentBuffers, ap, UHCIAlignmentBuffer *, chain);
-	ap->userBuffer = NULL;
-	ap->userOffset = 0;
-	ap->controller = this;
 	
 	_uhciAlignmentBuffersInUse++;
 	if ( _uhciAlignmentBuffersInUse > _uhciAlignmentHighWaterMark )
@@ -2127,12 +2506,13 @@ void
 AppleUSBUHCI::ReleaseIsochAlignmentBuffer(UHCIAlignmentBuffer *ap)
 {
 	//USBLog(6, "AppleUSBUHCI[%p]::ReleaseIsochAlignmentBuffer - putting alignment buffer %p into freeBuffers", this, ap);
-	queue_enter(&_isochAlignmentBuffers, ap, UHCIAlignmentBuffer *, chain);
+	ReleaseAlignmentBuffer(&_isochAlignmentBuffers, ap);
 	_uhciAlignmentBuffersInUse--;
 }
 
 
 OSDefineMetaClassAndStructors(UHCIAlignmentBuffer, OSObject);
+OSDefineMetaClassAndStructors(UHCIAlignmentBufferChunk, OSObject);
 
 // ========================================================================
 #pragma mark AppleUSBUHCIDMACommand
@@ -426,7 +426,9 @@ AppleUSBUHCI::HandleInterrupt(void)
 	if (_myPowerState == kUSBPowerStateOn)
 	{
 		USBTrace( kUSBTUHCIInterrupts,  kTPUHCIInterruptsHandleInterrupt, (uintptr_t)this, status, 0, 9);
+		BeginCompletionBatch();
 		ProcessCompletedTransactions();
+		EndCompletionBatch();
 	
 		// Check for root hub status change
 		RHCheckStatus();
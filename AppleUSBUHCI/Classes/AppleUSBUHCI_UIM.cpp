@@ -27,6 +27,7 @@
 #include <IOKit/usb/IOUSBRootHubDevice.h>
 #include <IOKit/usb/IOUSBLog.h>
 
+#include <IOKit/usb/IOUSBTransferPlanner.h>
 #include "AppleUSBUHCI.h"
 #include "AppleUHCIListElement.h"
 #include "USBTracepoints.h"
@@ -493,6 +494,47 @@ AppleUSBUHCI::UIMCreateInterruptTransfer(IOUSBCommand* command)
 }
 
 
+
+// Pins in the reservoir of a polled endpoint's queue head the TDs for a read of maxBufferSize, or unpins them
+IOReturn
+AppleUSBUHCI::UIMReservePolledTDs(short functionNumber, short endpointNumber, UInt32 maxBufferSize, bool reserve)
+{
+    AppleUHCIQueueHead				*pQH;
+	AppleUHCITransferDescriptor		*pTD;
+	UInt32							reserved;
+	
+    pQH = FindQueueHead(functionNumber, endpointNumber, kUSBIn, kUSBInterrupt);
+    if (pQH == NULL) 
+	{
+		USBLog(1, "AppleUSBUHCI[%p]::UIMReservePolledTDs - QH not found for %d:%d", this, functionNumber, endpointNumber);
+        return kIOUSBEndpointNotFound;
+    }
+	
+	if (reserve)
+	{
+		reserved = 2 * UHCITDChainReservoirTDsNeeded(maxBufferSize, pQH->maxPacketSize);
+		UHCITDChainReservoirReserve(&pQH->tdReservoir, reserved, kUHCITDChainReservoirLimit);
+		while (pQH->tdReservoir.count < reserved)
+		{
+			pTD = AllocateTD(pQH);
+			if (!pTD)
+				break;
+			FreeTDChain(UHCITDChainReservoirGiveBack<AppleUHCITDChainOps>(&pQH->tdReservoir, pTD, pTD, 1));
+		}
+		if (pQH->tdReservoir.count >= reserved)
+		{
+			USBLog(5, "AppleUSBUHCI[%p]::UIMReservePolledTDs - %d TDs pinned on QH (%p) for %d:%d", this, (int)pQH->tdReservoir.count, pQH, functionNumber, endpointNumber);
+			return kIOReturnSuccess;
+		}
+		USBError(1, "AppleUSBUHCI[%p]::UIMReservePolledTDs - could not pin TDs for %d:%d", this, functionNumber, endpointNumber);
+	}
+	
+	UHCITDChainReservoirReserve(&pQH->tdReservoir, 0, kUHCITDChainReservoirLimit);
+	FlushTDChainReservoir(pQH);
+	return reserve ? kIOReturnNoMemory : kIOReturnSuccess;
+}
+
+
 // ========================================================================
 #pragma mark Isochronous
 // ========================================================================
@@ -1108,6 +1150,10 @@ AppleUSBUHCI::HandleEndpointAbort(short functionAddress, short endpointNumber, s
     USBLog(4, "AppleUSBUHCI[%p]::HandleEndpointAbort: Addr: %d, Endpoint: %d,%d - calling DoDoneQueue", this, functionAddress, endpointNumber, direction);
 	UHCIUIMDoDoneQueueProcessing(savedFirstTD, kIOUSBTransactionReturned, savedLastTD);
 	
+	// a polled endpoint keeps its TDs through an abort - its next polled read must not need the free list
+	if (!pQH->tdReservoir.reserved)
+		FlushTDChainReservoir(pQH);
+	
 	pQH->aborting = false;
     return kIOReturnSuccess;
 	
@@ -1368,6 +1414,10 @@ AppleUSBUHCI::UIMCheckForTimeouts(void)
     
     _lastTimeoutFrameNumber = frameNumber;
     _lastFrameNumberTime = currentTime;
+	
+	FSBRPublishStatistics();
+	CheckAlignmentBufferPools();
+	CheckTDChainReservoirs();
 
 	for (pQH = _lsControlQHStart; pQH && (loopCount++ < 100); pQH = OSDynamicCast(AppleUHCIQueueHead, pQH->_logicalNext))
 	{
@@ -1625,18 +1675,14 @@ AppleUSBUHCI::AllocTDChain(AppleUHCIQueueHead* pQH, IOUSBCommand *command, IOMem
     AppleUHCITransferDescriptor			*pTD1, *pTD, *pTDnew, *pTDLast;
     UInt32								myToggle = 0;
     UInt32								myDirection = 0;
-    IOByteCount							transferOffset;
     UInt32								token;
 	UInt32								ctrlStatus;
     IOReturn							status = kIOReturnSuccess;
     UInt32								maxPacket;
-    UInt32								totalPhysLength;
     IOPhysicalAddress					dmaStartAddr;
     UInt32								bytesToSchedule;
 	IODMACommand						*dmaCommand = NULL;
-	UInt64								offset;
-	IODMACommand::Segment64				segments64;
-	UInt32								numSegments;
+	IOUSBTransferPlanEntry				planEntry;
 				
 	/* *********** Note: Always put the flags in the TD last. ************** */
 	/* *********** This is what kicks off the transaction if  ************** */
@@ -1676,8 +1722,16 @@ AppleUSBUHCI::AllocTDChain(AppleUHCIQueueHead* pQH, IOUSBCommand *command, IOMem
 		return kIOReturnNoResources;
 	}
 	
-    // First allocate the first of the new bunch
-    pTD1 = AllocateTD(pQH);
+    // First get the new bunch - a whole chain from the endpoint's reservoir if it has enough TDs, or else the first
+	// of them from the free list
+    pTD1 = UHCITDChainReservoirTake<AppleUHCITDChainOps>(&pQH->tdReservoir, UHCITDChainReservoirTDsNeeded(bufferSize, maxPacket));
+	if (pTD1)
+		_tdReservoirHits++;
+	else
+	{
+		_tdReservoirMisses++;
+		pTD1 = AllocateTD(pQH);
+	}
 	
     if (pTD1 == NULL)
     {
@@ -1702,54 +1756,38 @@ AppleUSBUHCI::AllocTDChain(AppleUHCIQueueHead* pQH, IOUSBCommand *command, IOMem
 		if (!dmaCommand)
 		{
 			USBError(1, "AppleUSBUHCI[%p]::AllocTDChain - no dmaCommand", this);
-			DeallocateTD(pTD1);
+			FreeTDChain(pTD1);
 			return kIOReturnInternalError;
 		}
 		if (dmaCommand->getMemoryDescriptor() != CBP)
 		{
 			USBError(1, "AppleUSBUHCI[%p]::AllocTDChain - mismatched CBP (%p) and dmaCommand memory descriptor (%p)", this, CBP, dmaCommand->getMemoryDescriptor());
-			DeallocateTD(pTD);
+			FreeTDChain(pTD1);
 			return kIOReturnInternalError;
 		}
 	}
 	
     if (bufferSize != 0)
     {	    
-        transferOffset = 0;
-        while (transferOffset < bufferSize)
+		// the planner walks the DMA segments and decides what each TD carries - we only encode its entries
+		IOUSBDMACommandSegmentSource							segmentSource(dmaCommand);
+		IOUSBTransferPlanner<IOUSBDMACommandSegmentSource>		planner(segmentSource, kUSBUHCITransferPlanConstraints, bufferSize, maxPacket, myToggle);
+		
+        while (!planner.Done())
         {
-			offset = transferOffset;
-			numSegments = 1;
-			
-			status = dmaCommand->gen64IOVMSegments(&offset, &segments64, &numSegments);
-			if (status || (numSegments != 1))
+			status = planner.Next(&planEntry);
+			if (status)
 			{
-				USBError(1, "AppleUSBUHCI[%p]::AllocTDChain - could not generate segments err (%p) offset (%d) transferOffset (%d) bufferSize (%d) getMemoryDescriptor (%p)", this, (void*)status, (int)offset, (int)transferOffset, (int)bufferSize, dmaCommand->getMemoryDescriptor());
-				status = status ? status : kIOReturnInternalError;
+				USBError(1, "AppleUSBUHCI[%p]::AllocTDChain - could not plan TD err (%p) TDs planned (%d) bufferSize (%d) getMemoryDescriptor (%p)", this, (void*)status, (int)planner.EntriesPlanned(), (int)bufferSize, dmaCommand->getMemoryDescriptor());
 				return status;
 			}
 			
-			if (((UInt32)(segments64.fIOVMAddr >> 32) > 0) || ((UInt32)(segments64.fLength >> 32) > 0))
-			{
-				USBError(1, "AppleUSBUHCI[%p]::AllocTDChain - generated segment not 32 bit -  offset (0x%qx) length (0x%qx) ", this, segments64.fIOVMAddr, segments64.fLength);
-				return kIOReturnInternalError;
-			}
-			
-			dmaStartAddr = (IOPhysicalAddress)segments64.fIOVMAddr;
-			totalPhysLength = (UInt32)segments64.fLength;
+			dmaStartAddr = (IOPhysicalAddress)planEntry.fragments[0].address;
+			bytesToSchedule = planEntry.length;
 		
-			USBLog(7, "AppleUSBUHCI[%p]::AllocTDChain - gen64IOVMSegments returned length of %d (out of %d) and start of 0x%x", this, (uint32_t)totalPhysLength, (uint32_t)bufferSize, (uint32_t)dmaStartAddr);
-			bytesToSchedule = 0;
-			if ((bufferSize-transferOffset) > maxPacket)
-			{
-				bytesToSchedule = maxPacket;
-			}
-			else 
-			{
-				bytesToSchedule = (bufferSize-transferOffset);
-			}
+			USBLog(7, "AppleUSBUHCI[%p]::AllocTDChain - planned TD of length %d (contiguous %d) at offset %d (out of %d) and start of 0x%x", this, (uint32_t)bytesToSchedule, (uint32_t)planEntry.fragments[0].length, (uint32_t)planEntry.offset, (uint32_t)bufferSize, (uint32_t)dmaStartAddr);
 				
-			if (totalPhysLength < bytesToSchedule)
+			if (planEntry.flags & kUSBTransferPlanEntryNeedsBounce)
 			{
                 UHCIAlignmentBuffer *bp;
                 
@@ -1760,32 +1798,30 @@ AppleUSBUHCI::AllocTDChain(AppleUHCIQueueHead* pQH, IOUSBCommand *command, IOMem
 					USBError(1, "AppleUSBUHCI[%p]:AllocTDChain - could not get the alignment buffer I needed", this);
 					return kIOReturnNoResources;
 				}
-                USBLog(1, "AppleUSBUHCI[%p]:AllocTDChain - pTD (%p) using UHCIAlignmentBuffer (%p) paddr (%p) instead of CBP (%p) dmaStartAddr (%p) totalPhysLength (%d) bytesToSchedule (%d)", this, pTD, bp, (void*)bp->paddr, CBP, (void*)dmaStartAddr, (int)totalPhysLength, (int)bytesToSchedule);
+                USBLog(1, "AppleUSBUHCI[%p]:AllocTDChain - pTD (%p) using UHCIAlignmentBuffer (%p) paddr (%p) instead of CBP (%p) dmaStartAddr (%p) totalPhysLength (%d) bytesToSchedule (%d)", this, pTD, bp, (void*)bp->paddr, CBP, (void*)dmaStartAddr, (int)planEntry.fragments[0].length, (int)bytesToSchedule);
 				USBTrace( kUSBTUHCIUIM,  kTPUHCIUIMAllocateTDChain, (uintptr_t)this, (uintptr_t)pTD, (uintptr_t)bp, 1);
 				USBTrace( kUSBTUHCIUIM,  kTPUHCIUIMAllocateTDChain, (uintptr_t)this, bp->paddr, (uintptr_t)CBP, 2);
-				USBTrace( kUSBTUHCIUIM,  kTPUHCIUIMAllocateTDChain, (uintptr_t)this, dmaStartAddr, totalPhysLength, bytesToSchedule);
+				USBTrace( kUSBTUHCIUIM,  kTPUHCIUIMAllocateTDChain, (uintptr_t)this, dmaStartAddr, planEntry.fragments[0].length, bytesToSchedule);
                 pTD->alignBuffer = bp;
                 dmaStartAddr = bp->paddr;
                 if (direction != kUSBIn) 
 				{
-                    CBP->readBytes(transferOffset, (void *)bp->vaddr, bytesToSchedule);
+                    CBP->readBytes(planEntry.offset, (void *)bp->vaddr, bytesToSchedule);
                 }
                 bp->userBuffer = CBP;
-                bp->userOffset = transferOffset;
+                bp->userOffset = planEntry.offset;
 				bp->actCount = 0;
 			}
 			
-			transferOffset += bytesToSchedule;
 			pTD->direction = direction;
 			pTD->GetSharedLogical()->buffer = HostToUSBLong(dmaStartAddr);
 						
-			token = myDirection | myToggle | UHCI_TD_SET_MAXLEN(bytesToSchedule) | UHCI_TD_SET_ENDPT(pQH->endpointNumber) | UHCI_TD_SET_ADDR(pQH->functionNumber);
+			token = myDirection | (planEntry.toggle ? kUHCI_TD_D : 0) | UHCI_TD_SET_MAXLEN(bytesToSchedule) | UHCI_TD_SET_ENDPT(pQH->endpointNumber) | UHCI_TD_SET_ADDR(pQH->functionNumber);
 			pTD->GetSharedLogical()->token = HostToUSBLong(token);
-			myToggle = myToggle ? 0 : (int)kUHCI_TD_D;
 			
 			USBLog(7, "AppleUSBUHCI[%p]::AllocTDChain - putting command into TD (%p) on QH (%p)", this, pTD, pQH);
 			pTD->command = command;								// Do like OHCI, link to command from each TD
-            if (transferOffset >= bufferSize)
+            if (planEntry.flags & kUSBTransferPlanEntryLast)
             {
 				ctrlStatus |= kUHCI_TD_IOC;
 				pTD->callbackOnTD = true;
@@ -1797,7 +1833,16 @@ AppleUSBUHCI::AllocTDChain(AppleUHCIQueueHead* pQH, IOUSBCommand *command, IOMem
 			else
             {
 				pTD->callbackOnTD = false;
-				pTDnew = AllocateTD(pQH);
+				pTDnew = OSDynamicCast(AppleUHCITransferDescriptor, pTD->_logicalNext);						// the next TD of a reused chain is already linked
+				if (pTDnew == NULL)
+				{
+					pTDnew = AllocateTD(pQH);
+					if (pTDnew)
+					{
+						pTD->SetPhysicalLink(pTDnew->GetPhysicalAddrWithType());
+						pTD->_logicalNext = pTDnew;																// if (trace)printTD(pTD);
+					}
+				}
 				if (pTDnew == NULL)
 				{
 					status = kIOReturnNoMemory;
@@ -1805,14 +1850,13 @@ AppleUSBUHCI::AllocTDChain(AppleUHCIQueueHead* pQH, IOUSBCommand *command, IOMem
 				}
 				else
 				{
-					pTD->SetPhysicalLink(pTDnew->GetPhysicalAddrWithType());
-					pTD->_logicalNext = pTDnew;																	// if (trace)printTD(pTD);
 					pTD->GetSharedLogical()->ctrlStatus = HostToUSBLong(ctrlStatus);
 					pTD = pTDnew;
-					USBLog(7, "AppleUSBUHCI[%p]::AllocTDChain - got another TD - going to fill it up too (%d, %d)", this, (uint32_t)transferOffset, (uint32_t)bufferSize);
+					USBLog(7, "AppleUSBUHCI[%p]::AllocTDChain - got another TD - going to fill it up too (%d, %d)", this, (uint32_t)(planEntry.offset + planEntry.length), (uint32_t)bufferSize);
 				}
             }
         }
+		myToggle = planner.NextToggle() ? kUHCI_TD_D : 0;
     }
     else
     {
@@ -1830,6 +1874,13 @@ AppleUSBUHCI::AllocTDChain(AppleUHCIQueueHead* pQH, IOUSBCommand *command, IOMem
 		myToggle = myToggle ? 0 : (int)kUHCI_TD_D;
 	}
 	
+	// a reused chain can be longer than the planner turned out to need
+	if (pTD->_logicalNext)
+	{
+		FreeTDChain(OSDynamicCast(AppleUHCITransferDescriptor, pTD->_logicalNext));
+		pTD->_logicalNext = NULL;
+	}
+	
     pTDLast = pQH->lastTD;
 	
 	pTD->SetPhysicalLink(pTD1->GetPhysicalAddrWithType());
@@ -1879,6 +1930,7 @@ AppleUSBUHCI::AllocTDChain(AppleUHCIQueueHead* pQH, IOUSBCommand *command, IOMem
     pTD1->command = NULL;
     
     pQH->lastTD = pTD1;
+	ArmTDChain(pTDLast, pTD1);
     pTDLast->GetSharedLogical()->ctrlStatus = ctrlStatus;
 	USBLog(7, "AllocTDChain - TD list for QH %p firstTD %p lastTD %p ================================================", pQH, pQH->firstTD, pQH->lastTD);
 	pTD = pQH->firstTD;
@@ -1897,10 +1949,8 @@ AppleUSBUHCI::AllocTDChain(AppleUHCIQueueHead* pQH, IOUSBCommand *command, IOMem
 	{
 		if (!_controlBulkTransactionsOut)
 		{
-			UInt32 link;
-			link = _lastQH->GetPhysicalLink();
-			USBLog(7, "AppleUSBUHCI[%p]::AllocTDChain - first transaction - unblocking list (%p to %p)", this, (void*)link, (void*)(link & ~kUHCI_QH_T));
-			_lastQH->SetPhysicalLink(link & ~kUHCI_QH_T);
+			USBLog(7, "AppleUSBUHCI[%p]::AllocTDChain - first transaction", this);
+			FSBRAsyncWorkQueued();
 		}
 		_controlBulkTransactionsOut++;
 		USBLog(7, "AppleUSBUHCI[%p]::AllocTDChain - _controlBulkTransactionsOut(%p)", this, (void*)_controlBulkTransactionsOut);
@@ -6,6 +6,7 @@
 
 #include "AppleUSBUHCI.h"
 #include "UHCI.h"
+#include "UHCITDChainReservoir.h"
 
 
 /* Software queue head structure.
@@ -45,6 +46,8 @@ public:
         
     AppleUHCITransferDescriptor					*firstTD;				// Request queue.
     AppleUHCITransferDescriptor					*lastTD;
+	
+	UHCITDChainReservoir<AppleUHCITransferDescriptor>	tdReservoir;		// TDs of completed transfers, kept linked for the next one
     
 };
 
@@ -84,6 +87,19 @@ public:
 	UInt32										lastFrame;				// the lower 32 bits the last time we checked this TD
     UInt32										lastRemaining;			//the "remaining" count the last time we checked
 	UInt16										direction;
+	
+	// support for completion scanning
+	AppleUHCItdMemoryBlock						*memBlock;				// the memory block which holds my shared data
+	UInt32										memBlockIndex;			// my index within that block
+};
+
+
+// how UHCITDChainReservoir walks and links the TDs it keeps
+struct AppleUHCITDChainOps
+{
+	static AppleUHCITransferDescriptor *Next(AppleUHCITransferDescriptor *pTD)							{ return OSDynamicCast(AppleUHCITransferDescriptor, pTD->_logicalNext); }
+	static void Link(AppleUHCITransferDescriptor *pTD, AppleUHCITransferDescriptor *next)				{ pTD->SetPhysicalLink(next->GetPhysicalAddrWithType()); pTD->_logicalNext = next; }
+	static void Terminate(AppleUHCITransferDescriptor *pTD)												{ pTD->_logicalNext = NULL; }
 };
 
 
@@ -40,12 +40,15 @@ class AppleUHCItdMemoryBlock : public OSObject
     OSDeclareDefaultStructors(AppleUHCItdMemoryBlock);
     
 #define TDsPerBlock	(kUHCIPageSize / sizeof(UHCITransferDescriptorShared))
+#define TDArmedWordsPerBlock	(TDsPerBlock / 32)
 	
 private:
     IOPhysicalAddress							_sharedPhysical;
     UHCITransferDescriptorSharedPtr				_sharedLogical;
     AppleUHCItdMemoryBlock						*_nextBlock;
 	IOBufferMemoryDescriptor					*_buffer;
+	UInt32										_armedTDs[TDArmedWordsPerBlock];		// one bit per TD which has been handed to the controller as active
+	UInt32										_armedCount;
     
 public:
 		
@@ -55,6 +58,11 @@ public:
     UInt32										NumTDs(void);
     IOPhysicalAddress							GetPhysicalPtr(UInt32 index);
     UHCITransferDescriptorSharedPtr				GetLogicalPtr(UInt32 index);
+	
+	// completion scanning support
+	void										ArmTD(UInt32 index);
+	void										DisarmTD(UInt32 index);
+	bool										HasRetiredTDs(void);
     
 };
 
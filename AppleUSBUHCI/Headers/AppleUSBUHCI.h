@@ -49,6 +49,8 @@ extern "C" {
 #include <IOKit/usb/IOUSBControllerV3.h>
 
 #include "UHCI.h"
+#include "UHCIFSBRPolicy.h"
+#include "UHCIAlignmentBufferPool.h"
 #include "AppleUSBEHCI.h"
 
 // forward declarations
@@ -89,6 +91,159 @@ class AppleUSBUHCIDMACommand;
 #define kUHCI_VERTICAL_FLAG  (0)
 #endif
 
+/* Whether to check the active bits of armed TDs 8 at a time when looking for completions,
+ * or one TD at a time.
+ */
+#ifndef UHCI_USE_BATCHED_TD_SCAN
+#define UHCI_USE_BATCHED_TD_SCAN 1
+#endif
+
+#define USB_CONSTANT16(x)	(OSSwapHostToLittleConstInt16(x))
+#define MICROSECOND		(1)
+#define MILLISECOND		(1000)
+#define NANOSECOND_TO_MILLISECOND (1000000)
+
+#define kUHCI_RESET_DELAY 100   /* reset takes 100ms */
+
+/* The audio hack tries to copy unaligned data into isoc output buffers
+ * just before they are needed.  Currently unimplemented.
+ */
+#define AUDIO_HACK 0
+
+
+/* It is possible to use a shorter list of "virtual" frames to reduce the memory requirement
+ * of 1024 physical frames.
+ * This value should be a power of two that is less than or equal to kUHCI_FRAME_COUNT.
+ * Having more virtual frames will allow queueing more isochronous frames.
+ */
+
+#define kUHCI_NVFRAMES 1024
+#define kUHCI_NVFRAMES_MASK (kUHCI_NVFRAMES-1)
+
+// we will allocate 6 interrupt queue heads, representing polling intervals of up to 32 ms
+// intrQH[0] will appear in every frame list
+// intrQH[1] will appear in every 2nd frame list and point to intrQH[0]
+// intrQH[2] will appear in every 4th frame list and point to intrQH[1]
+// etc
+#define kUHCI_NINTR_QHS 6
+
+
+/* Minimum frame offset for scheduling an isochronous transaction. */
+enum {
+    kUHCI_MIN_FRAME_OFFSET = 1
+};
+
+/* Key for identifying isoc frames that span two TDs. */
+enum {
+    kUHCI_ISOC_SPAN_TD = (err_local|err_sub(0x99)|0x42)
+};
+
+/* Make a structure for transactions so we can queue them.
+*/
+
+// Transaction state
+enum {
+    kUHCI_TP_STATE_NULL,
+    kUHCI_TP_STATE_FREE,
+    kUHCI_TP_STATE_ACTIVE,
+    kUHCI_TP_STATE_COMPLETE,
+    kUHCI_TP_STATE_ABORTED
+};
+
+// Leave room for block descriptor at end of chunk
+// to round out to a nice IOMalloc allocation size.
+#define kNTransactionChunk 30
+
+/*
+ * Buffers for unaligned transaction.
+ * The size of the buffer is the maxPacketSize
+ * of the associated endpoint.
+ */
+class UHCIAlignmentBufferChunk;
+
+class UHCIAlignmentBuffer : public OSObject
+{
+	OSDeclareDefaultStructors(UHCIAlignmentBuffer)
+
+public:
+	
+	enum bufferType
+	{
+		kTypeCBI,
+		kTypeIsoch
+	};
+	
+    IOPhysicalAddress					paddr;
+    IOVirtualAddress					vaddr;
+	
+    IOMemoryDescriptor					*userBuffer;
+    IOByteCount							userOffset;
+	IOByteCount							actCount;
+	AppleUSBUHCI						*controller;
+	AppleUSBUHCIDMACommand				*dmaCommand;
+	bufferType							type;
+	UHCIAlignmentBufferChunk			*chunk;					// the page this buffer was carved from
+	
+    // Queue fields
+    queue_chain_t						chain;
+};
+
+
+/*
+ * One page of alignment buffers. Pools grow and shrink a chunk at a time.
+ */
+class UHCIAlignmentBufferChunk : public OSObject
+{
+	OSDeclareDefaultStructors(UHCIAlignmentBufferChunk)
+	
+public:
+	
+	IOBufferMemoryDescriptor			*buffer;
+	UInt32								bufferCount;			// how many buffers were carved from this chunk
+	UInt32								freeCount;				// how many of this chunk's buffers are on the pool's free queue
+	
+    // Queue fields
+    queue_chain_t						chain;
+};
+
+
+class AppleUSBUHCIDMACommand;
+
+// Convert USBLog to use kprintf debugging
+#ifndef UHCI_USE_KPRINTF
+#define UHCI_USE_KPRINTF 0
+#endif
+
+#if UHCI_USE_KPRINTF
+#undef USBLog
+#undef USBError
+	void kprintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+#define USBLog( LEVEL, FORMAT, ARGS... )  if ((LEVEL) <= UHCI_USE_KPRINTF) { kprintf( FORMAT "\n", ## ARGS ) ; }
+#define USBError( LEVEL, FORMAT, ARGS... )  { kprintf( FORMAT "\n", ## ARGS ) ; }
+#endif
+
+#ifdef __ppc__
+#define IOSync eieio
+#else
+#define IOSync() __asm__ __volatile__ ( "mfence" : : : "memory" )
+#endif
+
+/* Whether to use vertical TD queues, or fair queues. */
+#define UHCI_USE_VERTICAL_QUEUES 0
+
+#if UHCI_USE_VERTICAL_QUEUES
+#define kUHCI_VERTICAL_FLAG  (kUHCI_TD_VF)
+#else
+#define kUHCI_VERTICAL_FLAG  (0)
+#endif
+
+/* Whether to check the active bits of armed TDs 8 at a time when looking for completions,
+ * or one TD at a time.
+ */
+#ifndef UHCI_USE_BATCHED_TD_SCAN
+#define UHCI_USE_BATCHED_TD_SCAN 1
+#endif
+
 #define USB_CONSTANT16(x)	(OSSwapHostToLittleConstInt16(x))
 #define MICROSECOND		(1)
 #define MILLISECOND		(1000)
@@ -150,6 +305,8 @@ enum {
  * The size of the buffer is the maxPacketSize
  * of the associated endpoint.
  */
+class UHCIAlignmentBufferChunk;
+
 class UHCIAlignmentBuffer : public OSObject
 {
 	OSDeclareDefaultStructors(UHCIAlignmentBuffer)
@@ -171,12 +328,57 @@ public:
 	AppleUSBUHCI						*controller;
 	AppleUSBUHCIDMACommand				*dmaCommand;
 	bufferType							type;
+	UHCIAlignmentBufferChunk			*chunk;					// the page this buffer was carved from
+	
+    // Queue fields
+    queue_chain_t						chain;
+};
+
+
+/*
+ * One page of alignment buffers. Pools grow and shrink a chunk at a time.
+ */
+class UHCIAlignmentBufferChunk : public OSObject
+{
+	OSDeclareDefaultStructors(UHCIAlignmentBufferChunk)
+	
+public:
+	
+	IOBufferMemoryDescriptor			*buffer;
+	UInt32								bufferCount;			// how many buffers were carved from this chunk
+	UInt32								freeCount;				// how many of this chunk's buffers are on the pool's free queue
 	
     // Queue fields
     queue_chain_t						chain;
 };
 
 
+/*
+ * A pool of alignment buffers of a single size. When the free queue runs dry another page is
+ * carved up, and pages beyond the initial allotment are given back once they are completely free
+ * and the pool has gone a full timeout period without running dry.
+ */
+struct UHCIAlignmentBufferPool
+{
+	queue_head_t						freeBuffers;
+	queue_head_t						chunks;
+	UHCIAlignmentBuffer::bufferType		type;
+	UInt32								bufferSize;
+	UInt32								minChunks;				// never shrink below this many chunks
+	UInt32								maxChunks;				// never grow beyond this many chunks
+	UInt32								numChunks;
+	UInt32								buffersInUse;
+	
+	// statistics
+	UInt32								hits;					// buffers handed out from the free queue
+	UInt32								misses;					// requests which found the free queue empty
+	UInt32								grows;					// chunks added
+	UInt32								shrinks;				// chunks given back
+	UInt32								lastMisses;				// misses at the last idle check
+	UInt32								lastHits;				// hits at the last time the statistics were published
+};
+
+
 class AppleUSBUHCIDMACommand : public IODMACommand
 {
     OSDeclareDefaultStructors(AppleUSBUHCIDMACommand)
@@ -204,7 +406,30 @@ public:
 enum {
     kUHCI_BUFFER_CBI_ALIGN_SIZE		= 64,
 	kUHCI_BUFFER_ISOCH_ALIGN_SIZE	= 1024,
-	kUHCI_BUFFER_ISOCH_ALIGN_QTY	= 24
+	kUHCI_BUFFER_ISOCH_ALIGN_QTY	= 24,
+	kUHCI_BUFFER_CBI_MAX_CHUNKS		= 16,
+	kUHCI_BUFFER_ISOCH_MAX_CHUNKS	= 64
+};
+
+/* Full speed bandwidth reclamation.
+ * The reclamation loop is closed as soon as control or bulk work is queued, and is only opened again
+ * once the async schedule has been idle for kUHCIFSBRIdleWindowMS (or the "FSBRIdleWindowMS" property).
+ * When work keeps coming back right after the loop is opened, the window grows up to kUHCIFSBRMaxIdleWindowMS
+ * (or "FSBRMaxIdleWindowMS") - see UHCIFSBRPolicy.h. An idle window of 0 opens the loop as soon as the last
+ * transaction completes.
+ */
+enum
+{
+	kUHCIFSBRIdleWindowMS = 3,
+	kUHCIFSBRMaxIdleWindowMS = 24
+};
+
+/* Most TDs an endpoint keeps from its completed transfers for its next one - enough for a 64KB transfer
+ * with 64 byte packets. See UHCITDChainReservoir.h.
+ */
+enum
+{
+	kUHCITDChainReservoirLimit = 1024
 };
 
 /* Checking for idleness.
@@ -268,8 +493,6 @@ protected:
     IOPhysicalAddress				_ioPhysAddress;
     IOVirtualAddress				_ioVirtAddress;
 	IOBufferMemoryDescriptor		*_frameListBuffer;
-	IOBufferMemoryDescriptor		*_cbiAlignBuffer;
-	IOBufferMemoryDescriptor		*_isochAlignBuffer;
     UInt16							_ioBase;
     UInt16							_vendorID;
     UInt16							_deviceID;
@@ -280,8 +503,8 @@ protected:
     IOFilterInterruptEventSource	*_interruptSource;
     bool							_uimInitialized;
     
-	queue_head_t					_cbiAlignmentBuffers;			// alignment buffers for control/bulk/interrupt (64 byte buffers)
-	queue_head_t					_isochAlignmentBuffers;			// alignment buffers for isoch (1024 byte buffers)
+	UHCIAlignmentBufferPool			_cbiAlignmentBuffers;			// alignment buffers for control/bulk/interrupt (64 byte buffers)
+	UHCIAlignmentBufferPool			_isochAlignmentBuffers;			// alignment buffers for isoch (1024 byte buffers)
 	SInt32							_uhciAlignmentHighWaterMark;
 	SInt32							_uhciAlignmentBuffersInUse;
 	
@@ -349,6 +572,15 @@ protected:
     IOSimpleLock *						_wdhLock;
     UInt16								_outSlot;
 	UInt32								_controlBulkTransactionsOut;
+	
+	// Full speed bandwidth reclamation
+	IOTimerEventSource *				_fsbrIdleTimer;					// opens the reclamation loop once the async schedule has been idle long enough
+	UHCIFSBRPolicy						_fsbr;							// when to close and open the loop, and the counters
+	
+	// TD chain reservoir statistics (totals across all endpoints)
+	UInt32								_tdReservoirHits;				// transfers which reused TDs from their endpoint's reservoir
+	UInt32								_tdReservoirMisses;				// transfers which took their TDs from the free list
+	UInt32								_tdReservoirDiscards;			// completed transfers whose TDs went back to the free list
 
     IOReturn TDToUSBError(UInt32 error);
     void CompleteIsoc(IOUSBIsocCompletion completion, IOReturn status, void *pFrames);
@@ -421,6 +653,8 @@ protected:
     bool							FilterInterrupt(void);
     void							HandleInterrupt(void);
     void							ProcessCompletedTransactions(void);
+	bool							HaveRetiredTDs(void);
+	void							ArmTDChain(AppleUHCITransferDescriptor *pTD, AppleUHCITransferDescriptor *stopAt);
 	IOReturn						scavengeIsochTransactions(void);
 	IOReturn						scavengeAnIsochTD(AppleUHCIIsochTransferDescriptor *pTD);
 	IOReturn						scavengeQueueHeads(IOUSBControllerListElement *);
@@ -451,7 +685,18 @@ protected:
 
     IOReturn								AllocTDChain(AppleUHCIQueueHead* pQH, IOUSBCommand *command, IOMemoryDescriptor* CBP, UInt32 bufferSize, UInt16 direction, Boolean controlTransaction);
     
+    // Full speed bandwidth reclamation
+    void									FSBRAsyncWorkQueued(void);
+    void									FSBRAsyncWorkCompleted(void);
+    void									FSBRApplyActions(UInt32 actions);
+    void									FSBRPublishStatistics(void);
+    static void								FSBRIdleTimerFired(OSObject *owner, IOTimerEventSource *sender);
+    
     void									FreeTDChain(AppleUHCITransferDescriptor *td);
+    void									RecycleDoneTD(AppleUHCITransferDescriptor *pTD);
+    void									RecycleTDChain(AppleUHCIQueueHead *pQH, AppleUHCITransferDescriptor *head, AppleUHCITransferDescriptor *tail, UInt32 count);
+    void									FlushTDChainReservoir(AppleUHCIQueueHead *pQH);
+    void									CheckTDChainReservoirs(void);
 
 
     // Debugging
@@ -614,6 +859,8 @@ public:
 
     // method in 1.8.2
     virtual IOReturn					UIMCreateInterruptTransfer(IOUSBCommand* command);
+	
+	virtual IOReturn					UIMReservePolledTDs(short functionNumber, short endpointNumber, UInt32 maxBufferSize, bool reserve);
 
     // Isoch
     virtual IOReturn					UIMCreateIsochEndpoint( short				functionAddress,
@@ -701,6 +948,16 @@ public:
 
 	IOReturn									InitializeBufferMemory();
 	void										FreeBufferMemory();
+	
+	// alignment buffer pools
+	void										InitAlignmentBufferPool(UHCIAlignmentBufferPool *pool, UHCIAlignmentBuffer::bufferType type, UInt32 bufferSize, UInt32 minChunks, UInt32 maxChunks);
+	IOReturn									GrowAlignmentBufferPool(UHCIAlignmentBufferPool *pool);
+	void										ShrinkAlignmentBufferPool(UHCIAlignmentBufferPool *pool);
+	void										FreeAlignmentBufferPool(UHCIAlignmentBufferPool *pool);
+	UHCIAlignmentBuffer *						GetAlignmentBuffer(UHCIAlignmentBufferPool *pool);
+	void										ReleaseAlignmentBuffer(UHCIAlignmentBufferPool *pool, UHCIAlignmentBuffer *ap);
+	void										PublishAlignmentBufferPool(UHCIAlignmentBufferPool *pool, const char *key);
+	void										CheckAlignmentBufferPools(void);
 
     
 	virtual IOUSBControllerIsochEndpoint*			AllocateIsochEP();
@@ -0,0 +1,228 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_UHCIALIGNMENTBUFFERPOOL_H
+#define _IOKIT_UHCIALIGNMENTBUFFERPOOL_H
+
+#include <IOKit/IOTypes.h>
+#include <kern/queue.h>
+
+/*!
+ @header UHCIAlignmentBufferPool.h
+ @abstract The bookkeeping of AppleUSBUHCI's alignment buffer pools.
+ @discussion A pool hands out buffers of one size from a free queue. When the queue runs dry the controller carves up
+	another page (a chunk), up to maxChunks of them. Released buffers go back on the front of the queue, so the busy ones
+	come from as few chunks as possible; once a full timeout period passes without the queue running dry, chunks beyond
+	minChunks whose buffers are all free are given back.
+
+	These functions only do the queueing and the counting. Allocating and freeing the pages, and the buffer and chunk
+	objects themselves, is left to the controller. They are templates over the buffer type, which needs a queue_chain_t
+	chain and a chunk pointer, and the chunk type, which needs a queue_chain_t chain, bufferCount and freeCount. The
+	controller calls them on its workloop, so they take no lock.
+ */
+
+/*!
+ @struct UHCIAlignmentBufferPool
+ @field freeBuffers Buffers ready to be handed out, most recently released first.
+ @field chunks Every chunk the pool owns.
+ @field type The UHCIAlignmentBuffer::bufferType of the pool's buffers.
+ @field bufferSize Size of each buffer.
+ @field minChunks Never shrink below this many chunks.
+ @field maxChunks Never grow beyond this many chunks.
+ @field numChunks Chunks the pool owns.
+ @field buffersInUse Buffers handed out and not yet released.
+ @field hits Buffers handed out from the free queue.
+ @field misses Requests which found the free queue empty.
+ @field grows Chunks added.
+ @field shrinks Chunks given back.
+ @field lastMisses misses at the last idle check.
+ */
+struct UHCIAlignmentBufferPool
+{
+	queue_head_t			freeBuffers;
+	queue_head_t			chunks;
+	UInt32					type;
+	UInt32					bufferSize;
+	UInt32					minChunks;
+	UInt32					maxChunks;
+	UInt32					numChunks;
+	UInt32					buffersInUse;
+	UInt32					hits;
+	UInt32					misses;
+	UInt32					grows;
+	UInt32					shrinks;
+	UInt32					lastMisses;
+};
+
+
+
+static inline void
+UHCIAlignmentBufferPoolInit(UHCIAlignmentBufferPool *pool, UInt32 type, UInt32 bufferSize, UInt32 minChunks, UInt32 maxChunks)
+{
+	queue_init(&pool->freeBuffers);
+	queue_init(&pool->chunks);
+	pool->type = type;
+	pool->bufferSize = bufferSize;
+	pool->minChunks = minChunks;
+	pool->maxChunks = maxChunks;
+	pool->numChunks = 0;
+	pool->buffersInUse = 0;
+	pool->hits = 0;
+	pool->misses = 0;
+	pool->grows = 0;
+	pool->shrinks = 0;
+	pool->lastMisses = 0;
+}
+
+
+
+static inline bool
+UHCIAlignmentBufferPoolCanGrow(const UHCIAlignmentBufferPool *pool)
+{
+	return pool->numChunks < pool->maxChunks;
+}
+
+
+
+// Put a newly carved buffer of chunk on the free queue. The chunk is added with UHCIAlignmentBufferPoolAddChunk once all of its buffers are in
+template <class BufferT, class ChunkT>
+static inline void
+UHCIAlignmentBufferPoolAddBuffer(UHCIAlignmentBufferPool *pool, ChunkT *chunk, BufferT *buffer)
+{
+	buffer->chunk = chunk;
+	queue_enter(&pool->freeBuffers, buffer, BufferT *, chain);
+	chunk->bufferCount++;
+	chunk->freeCount++;
+}
+
+
+
+template <class ChunkT>
+static inline void
+UHCIAlignmentBufferPoolAddChunk(UHCIAlignmentBufferPool *pool, ChunkT *chunk)
+{
+	queue_enter(&pool->chunks, chunk, ChunkT *, chain);
+	pool->numChunks++;
+	pool->grows++;
+}
+
+
+
+// Take the buffer at the front of the free queue, or NULL if it is empty. Does not count a hit or a miss
+template <class BufferT>
+static inline BufferT *
+UHCIAlignmentBufferPoolTake(UHCIAlignmentBufferPool *pool)
+{
+	BufferT			*buffer;
+	
+	if (queue_empty(&pool->freeBuffers))
+		return NULL;
+	
+	queue_remove_first(&pool->freeBuffers, buffer, BufferT *, chain);
+	buffer->chunk->freeCount--;
+	pool->buffersInUse++;
+	return buffer;
+}
+
+
+
+// Hand out a buffer, counting a hit. If the free queue is empty, count a miss and return NULL - the caller grows the pool and takes one with UHCIAlignmentBufferPoolTake
+template <class BufferT>
+static inline BufferT *
+UHCIAlignmentBufferPoolGet(UHCIAlignmentBufferPool *pool)
+{
+	if (queue_empty(&pool->freeBuffers))
+	{
+		pool->misses++;
+		return NULL;
+	}
+	pool->hits++;
+	return UHCIAlignmentBufferPoolTake<BufferT>(pool);
+}
+
+
+
+template <class BufferT>
+static inline void
+UHCIAlignmentBufferPoolRelease(UHCIAlignmentBufferPool *pool, BufferT *buffer)
+{
+	// at the front, so that busy buffers come from as few chunks as possible and the rest can be given back
+	queue_enter_first(&pool->freeBuffers, buffer, BufferT *, chain);
+	buffer->chunk->freeCount++;
+	pool->buffersInUse--;
+}
+
+
+
+// Called once per timeout period. Returns true if the free queue has not run dry since the last call, so the pool may shrink
+static inline bool
+UHCIAlignmentBufferPoolIdleCheck(UHCIAlignmentBufferPool *pool)
+{
+	bool		idle = (pool->misses == pool->lastMisses);
+	
+	pool->lastMisses = pool->misses;
+	return idle;
+}
+
+
+
+// If the pool has more than minChunks, find a chunk whose buffers are all free, move those buffers from the free queue to
+// released and take the chunk out of the pool. Returns the chunk, for the caller to free along with the buffers, or NULL
+template <class BufferT, class ChunkT>
+static inline ChunkT *
+UHCIAlignmentBufferPoolRemoveIdleChunk(UHCIAlignmentBufferPool *pool, queue_head_t *released)
+{
+	ChunkT			*chunk;
+	BufferT			*buffer, *nextBuffer;
+	
+	if (pool->numChunks <= pool->minChunks)
+		return NULL;
+	
+	queue_iterate(&pool->chunks, chunk, ChunkT *, chain)
+	{
+		if (chunk->freeCount == chunk->bufferCount)
+			break;
+	}
+	if (queue_end(&pool->chunks, (queue_entry_t)chunk))
+		return NULL;
+	
+	buffer = (BufferT *)(void *)queue_first(&pool->freeBuffers);
+	while (!queue_end(&pool->freeBuffers, (queue_entry_t)buffer))
+	{
+		nextBuffer = (BufferT *)(void *)queue_next(&buffer->chain);
+		if (buffer->chunk == chunk)
+		{
+			queue_remove(&pool->freeBuffers, buffer, BufferT *, chain);
+			queue_enter(released, buffer, BufferT *, chain);
+			chunk->freeCount--;
+		}
+		buffer = nextBuffer;
+	}
+	queue_remove(&pool->chunks, chunk, ChunkT *, chain);
+	pool->numChunks--;
+	pool->shrinks++;
+	return chunk;
+}
+
+#endif /* _IOKIT_UHCIALIGNMENTBUFFERPOOL_H */
@@ -0,0 +1,235 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_UHCIFSBRPOLICY_H
+#define _IOKIT_UHCIFSBRPOLICY_H
+
+#include <IOKit/IOTypes.h>
+
+/*!
+ @header UHCIFSBRPolicy.h
+ @abstract When AppleUSBUHCI closes and opens the full speed bandwidth reclamation loop.
+ @discussion The loop from the last queue head back to the full speed control queue head is closed as soon as control or bulk
+	work is queued, and opened again once the async schedule has been idle for the current idle window. If work comes back
+	within one window of the loop being opened, the loop was opened too early, so the window doubles, up to maxIdleWindowMS.
+	Each idle period of at least the window brings it back down by half, to no less than idleWindowMS. An idle window of 0 opens
+	the loop as soon as the last transaction completes, with no hysteresis.
+
+	The policy only decides - it returns the actions the controller has to take (close or open the loop, arm or cancel the idle
+	timer) and keeps the counters. Times are in nanoseconds from any monotonic clock. The controller calls it on its workloop,
+	so it needs no lock.
+ */
+
+enum
+{
+	kUHCIFSBRActionEngage		= 0x01,			// close the reclamation loop
+	kUHCIFSBRActionDisengage	= 0x02,			// open it
+	kUHCIFSBRActionArmTimer		= 0x04,			// (re)start the idle timer for idleWindowCurrentMS
+	kUHCIFSBRActionCancelTimer	= 0x08			// stop the idle timer
+};
+
+/*!
+ @struct UHCIFSBRPolicy
+ @field idleWindowMS Shortest idle window - the one used when the loop is not thrashing.
+ @field maxIdleWindowMS Longest the idle window grows to.
+ @field idleWindowCurrentMS The idle window the timer is armed with.
+ @field engaged true while the loop is closed.
+ @field timerPending true while the idle timer is waiting out the window.
+ @field everDisengaged false until the loop has been opened once, so the first engagement is not taken for thrashing.
+ @field engagedSinceNS When the loop was last closed.
+ @field disengagedSinceNS When the loop was last opened.
+ @field totalEngagedNS Time spent with the loop closed, not counting the current period.
+ @field engagements Times the loop was closed.
+ @field disengagements Times the loop was opened.
+ @field idleWindowsCancelled Times work arrived while the idle timer was pending.
+ @field idleWindowIncreases Times the loop was closed again within one window of being opened, and the window grew.
+ */
+struct UHCIFSBRPolicy
+{
+	UInt32		idleWindowMS;
+	UInt32		maxIdleWindowMS;
+	UInt32		idleWindowCurrentMS;
+	bool		engaged;
+	bool		timerPending;
+	bool		everDisengaged;
+	UInt64		engagedSinceNS;
+	UInt64		disengagedSinceNS;
+	UInt64		totalEngagedNS;
+	UInt32		engagements;
+	UInt32		disengagements;
+	UInt32		idleWindowsCancelled;
+	UInt32		idleWindowIncreases;
+};
+
+
+static inline void
+UHCIFSBRPolicyInit(UHCIFSBRPolicy *policy, UInt32 idleWindowMS, UInt32 maxIdleWindowMS)
+{
+	policy->idleWindowMS = idleWindowMS;
+	policy->maxIdleWindowMS = (maxIdleWindowMS > idleWindowMS) ? maxIdleWindowMS : idleWindowMS;
+	policy->idleWindowCurrentMS = idleWindowMS;
+	policy->engaged = false;
+	policy->timerPending = false;
+	policy->everDisengaged = false;
+	policy->engagedSinceNS = 0;
+	policy->disengagedSinceNS = 0;
+	policy->totalEngagedNS = 0;
+	policy->engagements = 0;
+	policy->disengagements = 0;
+	policy->idleWindowsCancelled = 0;
+	policy->idleWindowIncreases = 0;
+}
+
+
+
+static inline void
+UHCIFSBRPolicyDisengaged(UHCIFSBRPolicy *policy, UInt64 nowNS)
+{
+	policy->totalEngagedNS += nowNS - policy->engagedSinceNS;
+	policy->disengagedSinceNS = nowNS;
+	policy->everDisengaged = true;
+	policy->engaged = false;
+	policy->disengagements++;
+}
+
+
+
+/*!
+ @function UHCIFSBRPolicyWorkQueued
+ @abstract The first control or bulk transaction was queued on an idle async schedule.
+ */
+static inline UInt32
+UHCIFSBRPolicyWorkQueued(UHCIFSBRPolicy *policy, UInt64 nowNS)
+{
+	UInt32		actions = 0;
+	
+	if (policy->timerPending)
+	{
+		// the loop is still closed - just stop waiting
+		policy->timerPending = false;
+		policy->idleWindowsCancelled++;
+		actions |= kUHCIFSBRActionCancelTimer;
+	}
+	
+	if (policy->engaged)
+		return actions;
+	
+	if (policy->idleWindowMS && policy->everDisengaged)
+	{
+		UInt64		idleNS = nowNS - policy->disengagedSinceNS;
+		UInt64		windowNS = (UInt64)policy->idleWindowCurrentMS * 1000000ULL;
+		
+		if (idleNS < windowNS)
+		{
+			// we opened the loop too early
+			if (policy->idleWindowCurrentMS < policy->maxIdleWindowMS)
+			{
+				policy->idleWindowCurrentMS *= 2;
+				if (policy->idleWindowCurrentMS > policy->maxIdleWindowMS)
+					policy->idleWindowCurrentMS = policy->maxIdleWindowMS;
+				policy->idleWindowIncreases++;
+			}
+		}
+		else if (policy->idleWindowCurrentMS > policy->idleWindowMS)
+		{
+			policy->idleWindowCurrentMS /= 2;
+			if (policy->idleWindowCurrentMS < policy->idleWindowMS)
+				policy->idleWindowCurrentMS = policy->idleWindowMS;
+		}
+	}
+	
+	policy->engaged = true;
+	policy->engagedSinceNS = nowNS;
+	policy->engagements++;
+	
+	return actions | kUHCIFSBRActionEngage;
+}
+
+
+
+/*!
+ @function UHCIFSBRPolicyWorkCompleted
+ @abstract The last outstanding control or bulk transaction completed.
+ */
+static inline UInt32
+UHCIFSBRPolicyWorkCompleted(UHCIFSBRPolicy *policy, UInt64 nowNS)
+{
+	if (!policy->engaged)
+		return 0;
+	
+	if (!policy->idleWindowMS)
+	{
+		UHCIFSBRPolicyDisengaged(policy, nowNS);
+		return kUHCIFSBRActionDisengage;
+	}
+	
+	policy->timerPending = true;
+	return kUHCIFSBRActionArmTimer;
+}
+
+
+
+/*!
+ @function UHCIFSBRPolicyIdleTimerFired
+ @abstract The idle timer went off. workOutstanding is the number of control and bulk transactions queued right now.
+ */
+static inline UInt32
+UHCIFSBRPolicyIdleTimerFired(UHCIFSBRPolicy *policy, UInt64 nowNS, UInt32 workOutstanding)
+{
+	if (!policy->timerPending)
+		return 0;
+	
+	policy->timerPending = false;
+	
+	// new work may have come in and gone again since the timer was set
+	if (!policy->engaged || workOutstanding)
+		return 0;
+	
+	UHCIFSBRPolicyDisengaged(policy, nowNS);
+	return kUHCIFSBRActionDisengage;
+}
+
+
+
+/*!
+ @function UHCIFSBRPolicyLoopReset
+ @abstract The controller was reset, which leaves the loop open.
+ */
+static inline void
+UHCIFSBRPolicyLoopReset(UHCIFSBRPolicy *policy, UInt64 nowNS)
+{
+	policy->timerPending = false;
+	if (policy->engaged)
+		UHCIFSBRPolicyDisengaged(policy, nowNS);
+}
+
+
+
+static inline UInt64
+UHCIFSBRPolicyEngagedNS(const UHCIFSBRPolicy *policy, UInt64 nowNS)
+{
+	return policy->totalEngagedNS + (policy->engaged ? (nowNS - policy->engagedSinceNS) : 0);
+}
+
+#endif /* _IOKIT_UHCIFSBRPOLICY_H */
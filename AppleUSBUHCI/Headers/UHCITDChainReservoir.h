@@ -0,0 +1,215 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_UHCITDCHAINRESERVOIR_H
+#define _IOKIT_UHCITDCHAINRESERVOIR_H
+
+#include <IOKit/IOTypes.h>
+
+/*!
+ @header UHCITDChainReservoir.h
+ @abstract The per endpoint TD chains which AppleUSBUHCI reuses for an endpoint's next transfer.
+ @discussion UHCI needs one TD per packet. When a transfer completes, its TDs stay linked, in order, on the endpoint's queue
+	head rather than going back one at a time to the controller wide free list. The next transfer on the endpoint takes the
+	number of TDs it needs off the front of that chain, already linked to each other, so that AllocTDChain only rewrites the
+	buffer pointer, token and status of each one. Since an endpoint only takes TDs from the free list when its reservoir is
+	short, the reservoir settles at the number of TDs the endpoint has in use at its busiest, up to limit. It is emptied when
+	the endpoint is aborted or deleted, and when a timeout period passes without a hit.
+
+	While a polled endpoint is registered on the queue, the controller fills the reservoir with reserved TDs, enough for a
+	polled read and its client's read together, and keeps them through idle periods and aborts, so that a polled read never
+	takes a TD from the free list. Only deleting the endpoint or unregistering it gives them back.
+
+	The functions are templates over the TD type and an Ops class with three static functions: Next(td) returns the TD after
+	td, Link(td, next) links td to next, logically and for the hardware, and Terminate(td) ends the chain at td. The
+	controller calls them on its workloop, so they take no lock.
+ */
+
+/*!
+ @struct UHCITDChainReservoir
+ @field head First TD of the chain.
+ @field tail Last TD of the chain.
+ @field count TDs in the chain.
+ @field limit Most TDs the chain may hold.
+ @field hits Transfers which took their TDs from the chain.
+ @field misses Transfers which found too few TDs in the chain.
+ @field discards Times TDs went back to the free list because the chain had no room for them.
+ @field lastHits hits at the last idle check.
+ @field reserved TDs kept for a polled endpoint, or 0.
+ */
+template <class TD>
+struct UHCITDChainReservoir
+{
+	TD				*head;
+	TD				*tail;
+	UInt32			count;
+	UInt32			limit;
+	UInt32			hits;
+	UInt32			misses;
+	UInt32			discards;
+	UInt32			lastHits;
+	UInt32			reserved;
+};
+
+
+
+template <class TD>
+static inline void
+UHCITDChainReservoirInit(UHCITDChainReservoir<TD> *reservoir, UInt32 limit)
+{
+	reservoir->head = NULL;
+	reservoir->tail = NULL;
+	reservoir->count = 0;
+	reservoir->limit = limit;
+	reservoir->hits = 0;
+	reservoir->misses = 0;
+	reservoir->discards = 0;
+	reservoir->lastHits = 0;
+	reservoir->reserved = 0;
+}
+
+
+
+// Pin reserved TDs in the reservoir for a polled endpoint, raising limit if it would not hold them, or with 0 unpin them.
+// The caller fills the reservoir with GiveBack
+template <class TD>
+static inline void
+UHCITDChainReservoirReserve(UHCITDChainReservoir<TD> *reservoir, UInt32 reserved, UInt32 limit)
+{
+	reservoir->reserved = reserved;
+	reservoir->limit = (reserved > limit) ? reserved : limit;
+}
+
+
+
+// The number of TDs a transfer of bufferSize bytes needs - one per packet, and one for a zero length transfer
+static inline UInt32
+UHCITDChainReservoirTDsNeeded(UInt32 bufferSize, UInt32 maxPacket)
+{
+	if ((bufferSize == 0) || (maxPacket == 0))
+		return 1;
+	return (bufferSize + maxPacket - 1) / maxPacket;
+}
+
+
+
+// Take needed TDs, linked in order and terminated after the last, off the front of the chain. Returns NULL, and counts a miss, if the chain is too short
+template <class Ops, class TD>
+static inline TD *
+UHCITDChainReservoirTake(UHCITDChainReservoir<TD> *reservoir, UInt32 needed)
+{
+	TD				*head, *last;
+	UInt32			i;
+	
+	if ((needed == 0) || (reservoir->count < needed))
+	{
+		reservoir->misses++;
+		return NULL;
+	}
+	
+	head = last = reservoir->head;
+	for (i = 1; i < needed; i++)
+		last = Ops::Next(last);
+	
+	if (last == reservoir->tail)
+	{
+		reservoir->head = NULL;
+		reservoir->tail = NULL;
+	}
+	else
+		reservoir->head = Ops::Next(last);
+	Ops::Terminate(last);
+	reservoir->count -= needed;
+	reservoir->hits++;
+	return head;
+}
+
+
+
+// Give back the count TDs of a completed transfer, linked in order from head to tail. If there is no room for them as well
+// as what the reservoir holds, the longer of the two chains is kept - a whole transfer's worth is more use than what a
+// shorter transfer left behind. Returns the chain which was not kept, terminated after its last TD, for the caller to free,
+// or NULL
+template <class Ops, class TD>
+static inline TD *
+UHCITDChainReservoirGiveBack(UHCITDChainReservoir<TD> *reservoir, TD *head, TD *tail, UInt32 count)
+{
+	TD				*discard;
+	
+	Ops::Terminate(tail);
+	if ((reservoir->count + count) <= reservoir->limit)
+	{
+		if (reservoir->tail)
+			Ops::Link(reservoir->tail, head);
+		else
+			reservoir->head = head;
+		reservoir->tail = tail;
+		reservoir->count += count;
+		return NULL;
+	}
+	
+	reservoir->discards++;
+	if ((count > reservoir->count) && (count <= reservoir->limit))
+	{
+		discard = reservoir->head;
+		reservoir->head = head;
+		reservoir->tail = tail;
+		reservoir->count = count;
+		return discard;
+	}
+	return head;
+}
+
+
+
+// Empty the reservoir. Returns the chain it held, terminated after the last TD, for the caller to free
+template <class Ops, class TD>
+static inline TD *
+UHCITDChainReservoirFlush(UHCITDChainReservoir<TD> *reservoir)
+{
+	TD				*head = reservoir->head;
+	
+	if (reservoir->tail)
+		Ops::Terminate(reservoir->tail);
+	reservoir->head = NULL;
+	reservoir->tail = NULL;
+	reservoir->count = 0;
+	return head;
+}
+
+
+
+// Called once per timeout period. Returns true if the reservoir holds TDs but has had no hit since the last call, so it should
+// be flushed. A reservoir pinned for a polled endpoint is never idle
+template <class TD>
+static inline bool
+UHCITDChainReservoirIdleCheck(UHCITDChainReservoir<TD> *reservoir)
+{
+	bool			idle = (reservoir->count != 0) && (reservoir->hits == reservoir->lastHits) && (reservoir->reserved == 0);
+	
+	reservoir->lastHits = reservoir->hits;
+	return idle;
+}
+
+#endif /* _IOKIT_UHCITDCHAINRESERVOIR_H */
@@ -26,7 +26,9 @@
 
 
 #include <libkern/OSDebug.h>
+#include <kern/cpu_number.h>
 #include <IOKit/IOLib.h>
+#include <IOKit/IOService.h>
 #include <IOKit/usb/IOUSBCommand.h>
 #include <IOKit/usb/IOUSBLog.h>
 
@@ -84,6 +86,70 @@ IOUSBCommand::free()
     super::free();
 }
 
+
+
+void
+IOUSBCommand::NewGeneration(void)
+{
+	UInt32		state;
+	
+#ifdef SUPPORTS_SS_USB
+	// UIMs compile SetStreamID and GetStreamID inline, so the stream ID can't take part in the generation scheme
+	_expansionData->_streamID = 0;
+#endif
+	if (++_expansionData->_generation == 0)
+	{
+		// wrapped - make sure nothing which was stamped long ago looks current
+		for (state = 0; state < kUSBCommandColdStates; state++)
+		{
+			_expansionData->_stateGeneration[state] = 1;
+			ClaimColdState(state);
+		}
+	}
+}
+
+
+
+// First write to a group of cold fields in this generation - clear the whole group before the caller sets its field
+void
+IOUSBCommand::ClaimColdState(UInt32 state)
+{
+	if (ColdStateValid(state))
+		return;
+	
+	switch (state)
+	{
+		case kUSBCommandControlState:
+			_request = NULL;
+			_dataRemaining = 0;
+			_stage = 0;
+			break;
+			
+		case kUSBCommandDisjointState:
+			_origBuffer = NULL;
+			bzero(&_disjointCompletion, sizeof(_disjointCompletion));
+			_dblBufLength = 0;
+			break;
+			
+		case kUSBCommandTransactionState:
+			_expansionData->_multiTransferTransaction = false;
+			_expansionData->_finalTransferInTransaction = false;
+			_expansionData->_useTimeStamp = false;
+			bzero(&_expansionData->_timeStamp, sizeof(_expansionData->_timeStamp));
+			break;
+			
+		case kUSBCommandScratchState:
+			bzero(_UIMScratch, sizeof(_UIMScratch));
+			break;
+			
+		default:
+			return;
+	}
+	_expansionData->_stateGeneration[state] = _expansionData->_generation;
+}
+
+
+
 // accessor methods
 void 
 IOUSBCommand::SetSelector(usbCommand sel) 
@@ -94,6 +160,7 @@ IOUSBCommand::SetSelector(usbCommand sel)
 void 
 IOUSBCommand::SetRequest(IOUSBDeviceRequestPtr req) 
 {
+	ClaimColdState(kUSBCommandControlState);
     _request = req;
 }
 
@@ -148,19 +215,19 @@ IOUSBCommand::SetClientCompletion(IOUSBCompletion completion)
 void 
 IOUSBCommand::SetDataRemaining(UInt32 dr) 
 {
-	if (_expansionData->_masterUSBCommand)
-		_expansionData->_masterUSBCommand->_dataRemaining = dr;
-	else
-		_dataRemaining = dr;
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	
+	target->ClaimColdState(kUSBCommandControlState);
+	target->_dataRemaining = dr;
 }
 
 void 
 IOUSBCommand::SetStage(UInt8 stage) 
 {
-	if (_expansionData->_masterUSBCommand)
-		_expansionData->_masterUSBCommand->_stage = stage;
-	else
-		_stage = stage;
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	
+	target->ClaimColdState(kUSBCommandControlState);
+	target->_stage = stage;
 }
 
 void 
@@ -175,18 +242,21 @@ IOUSBCommand::SetStatus(IOReturn stat)
 void 
 IOUSBCommand::SetOrigBuffer(IOMemoryDescriptor *buf) 
 {
+	ClaimColdState(kUSBCommandDisjointState);
     _origBuffer = buf;
 }
 
 void 
 IOUSBCommand::SetDisjointCompletion(IOUSBCompletion completion) 
 {
+	ClaimColdState(kUSBCommandDisjointState);
     _disjointCompletion = completion;
 }
 
 void 
 IOUSBCommand::SetDblBufLength(IOByteCount len) 
 {
+	ClaimColdState(kUSBCommandDisjointState);
     _dblBufLength = len;
 }
 
@@ -206,10 +276,12 @@ void
 IOUSBCommand::SetUIMScratch(UInt32 index, UInt32 value) 
 { 
     if (index < kUSBCommandScratchBuffers)
-		if (_expansionData->_masterUSBCommand)
-			_expansionData->_masterUSBCommand->_UIMScratch[index] = value;
-		else
-			_UIMScratch[index] = value;
+	{
+		IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+		
+		target->ClaimColdState(kUSBCommandScratchState);
+		target->_UIMScratch[index] = value;
+	}
 }
 
 void 
@@ -240,6 +312,7 @@ IOUSBCommand::SetBufferMemoryDescriptor(IOMemoryDescriptor *bufferMemoryDescript
 void
 IOUSBCommand::SetMultiTransferTransaction(bool multiTDTransaction)
 {
+	ClaimColdState(kUSBCommandTransactionState);
     _expansionData->_multiTransferTransaction = multiTDTransaction;
 }
 
@@ -247,6 +320,7 @@ IOUSBCommand::SetMultiTransferTransaction(bool multiTDTransaction)
 void
 IOUSBCommand::SetFinalTransferInTransaction(bool finalTDinTransaction)
 {
+	ClaimColdState(kUSBCommandTransactionState);
     _expansionData->_finalTransferInTransaction = finalTDinTransaction;
 }
 
@@ -254,6 +328,7 @@ IOUSBCommand::SetFinalTransferInTransaction(bool finalTDinTransaction)
 void
 IOUSBCommand::SetUseTimeStamp(bool useTimeStamp)
 {
+	ClaimColdState(kUSBCommandTransactionState);
     _expansionData->_useTimeStamp = useTimeStamp;
 }
 
@@ -261,6 +336,7 @@ IOUSBCommand::SetUseTimeStamp(bool useTimeStamp)
 void
 IOUSBCommand::SetTimeStamp(AbsoluteTime timeStamp)
 {
+	ClaimColdState(kUSBCommandTransactionState);
     _expansionData->_timeStamp = timeStamp;
 }
 
@@ -294,7 +370,9 @@ IOUSBCommand::GetSelector(void)
 IOUSBDeviceRequestPtr 
 IOUSBCommand::GetRequest(void) 
 {
-	return _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand->_request : _request;
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	
+	return target->ColdStateValid(kUSBCommandControlState) ? target->_request : NULL;
 }
 
 USBDeviceAddress 
@@ -348,13 +426,17 @@ IOUSBCommand::GetClientCompletion(void)
 UInt32 
 IOUSBCommand::GetDataRemaining(void) 
 { 
-	return _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand->_dataRemaining : _dataRemaining;
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	
+	return target->ColdStateValid(kUSBCommandControlState) ? target->_dataRemaining : 0;
 }
 
 UInt8 
 IOUSBCommand::GetStage(void) 
 { 
-	return _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand->_stage : _stage;
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	
+	return target->ColdStateValid(kUSBCommandControlState) ? target->_stage : 0;
 }
 
 IOReturn 
@@ -366,19 +448,30 @@ IOUSBCommand::GetStatus(void)
 IOMemoryDescriptor * 
 IOUSBCommand::GetOrigBuffer(void) 
 { 
-	return _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand->_origBuffer : _origBuffer;
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	
+	return target->ColdStateValid(kUSBCommandDisjointState) ? target->_origBuffer : NULL;
 }
 
 IOUSBCompletion 
 IOUSBCommand::GetDisjointCompletion(void) 
 { 
-	return _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand->_disjointCompletion : _disjointCompletion;
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	IOUSBCompletion	nullCompletion;
+	
+	if (target->ColdStateValid(kUSBCommandDisjointState))
+		return target->_disjointCompletion;
+	
+	bzero(&nullCompletion, sizeof(nullCompletion));
+	return nullCompletion;
 }
 
 IOByteCount 
 IOUSBCommand::GetDblBufLength(void) 
 { 
-	return _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand->_dblBufLength : _dblBufLength;
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	
+	return target->ColdStateValid(kUSBCommandDisjointState) ? target->_dblBufLength : 0;
 }
 
 UInt32 
@@ -395,8 +488,10 @@ IOUSBCommand::GetCompletionTimeout(void)
 
 UInt32 IOUSBCommand::GetUIMScratch(UInt32 index) 
 { 
-	if (index < kUSBCommandScratchBuffers)
-		return _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand->_UIMScratch[index] : _UIMScratch[index];
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	
+	if ((index < kUSBCommandScratchBuffers) && target->ColdStateValid(kUSBCommandScratchState))
+		return target->_UIMScratch[index];
 	else
 		return 0;
 }
@@ -424,26 +519,39 @@ IOUSBCommand::GetBufferMemoryDescriptor(void)
 bool 
 IOUSBCommand::GetMultiTransferTransaction(void)
 {
-	return _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand->_expansionData->_multiTransferTransaction : _expansionData->_multiTransferTransaction;
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	
+	return target->ColdStateValid(kUSBCommandTransactionState) ? target->_expansionData->_multiTransferTransaction : false;
 }
 
 
 bool 
 IOUSBCommand::GetFinalTransferInTransaction(void)
 {
-	return _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand->_expansionData->_finalTransferInTransaction : _expansionData->_finalTransferInTransaction;
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	
+	return target->ColdStateValid(kUSBCommandTransactionState) ? target->_expansionData->_finalTransferInTransaction : false;
 }
 
 bool 
 IOUSBCommand::GetUseTimeStamp(void)
 {
-	return _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand->_expansionData->_useTimeStamp : _expansionData->_useTimeStamp;
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	
+	return target->ColdStateValid(kUSBCommandTransactionState) ? target->_expansionData->_useTimeStamp : false;
 }
 
 AbsoluteTime 
 IOUSBCommand::GetTimeStamp(void)
 {
-	return _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand->_expansionData->_timeStamp : _expansionData->_timeStamp;
+	IOUSBCommand	*target = _expansionData->_masterUSBCommand ? _expansionData->_masterUSBCommand : this;
+	AbsoluteTime	nullTimeStamp;
+	
+	if (target->ColdStateValid(kUSBCommandTransactionState))
+		return target->_expansionData->_timeStamp;
+	
+	bzero(&nullTimeStamp, sizeof(nullTimeStamp));
+	return nullTimeStamp;
 }
 
 bool 
@@ -518,23 +626,383 @@ IOUSBCommandPool::withWorkLoop(IOWorkLoop * inWorkLoop)
 	return me;
 }
 
+bool
+IOUSBCommandPool::initWithWorkLoop(IOWorkLoop * inWorkLoop)
+{
+	int		i;
+	
+	_expansionData = (ExpansionData *)IOMalloc(sizeof(ExpansionData));
+	if (!_expansionData)
+		return false;
+	bzero(_expansionData, sizeof(ExpansionData));
+	
+	for (i=0; i < kUSBCommandPoolCaches; i++)
+	{
+		_expansionData->caches[i].lock = IOSimpleLockAlloc();
+		if (!_expansionData->caches[i].lock)
+			return false;
+	}
+	
+	return IOCommandPool::initWithWorkLoop(inWorkLoop);
+}
+
+void
+IOUSBCommandPool::free()
+{
+	int		i;
+	
+	if (_expansionData)
+	{
+		for (i=0; i < kUSBCommandPoolCaches; i++)
+		{
+			if (_expansionData->caches[i].count)
+			{
+				USBError(1,"IOUSBCommandPool[%p]::free - cache %d still holds %d commands", this, i, (int)_expansionData->caches[i].count);
+			}
+			if (_expansionData->caches[i].lock)
+				IOSimpleLockFree(_expansionData->caches[i].lock);
+		}
+		IOFree(_expansionData, sizeof(ExpansionData));
+		_expansionData = NULL;
+	}
+	IOCommandPool::free();
+}
+
+IOCommand *
+IOUSBCommandPool::getCommand(bool blockForCommand)
+{
+	CommandCache	*cache;
+	IOCommand		*command = NULL;
+	
+	if (!_expansionData)
+		return IOCommandPool::getCommand(blockForCommand);
+	
+	// we may migrate to another CPU after picking the cache - that only costs locality, since the cache has its own lock
+	cache = &_expansionData->caches[cpu_number() % kUSBCommandPoolCaches];
+	
+	command = IOUSBCommandCacheGet(cache);
+	if (!command)
+	{
+		fSerializer->runAction(gatedRefillCache, cache, &command);
+		if (!command && blockForCommand)
+		{
+			// while anyone waits here, returned commands are sent on to the pool so that the wakeup is not lost in a cache. Look once more
+			// after announcing ourselves, for a command which went into a cache before the returner could see us.
+			OSIncrementAtomic(&_expansionData->blockedGetters);
+			fSerializer->runAction(gatedRefillCache, cache, &command);
+			if (!command)
+				command = IOCommandPool::getCommand(true);
+			OSDecrementAtomic(&_expansionData->blockedGetters);
+		}
+	}
+	
+	// commands held in a cache are marked as queued, so that a double return is still caught by ScrubCommand
+	if (command)
+		IOUSBCommandHandOut(command);
+	
+	return command;
+}
+
+void
+IOUSBCommandPool::returnCommand(IOCommand * command)
+{
+	CommandCache	*cache;
+	
+	if (!_expansionData)
+	{
+		IOCommandPool::returnCommand(command);
+		return;
+	}
+	
+	if (ScrubCommand(command) != kIOReturnSuccess)
+		return;
+	
+	cache = &_expansionData->caches[cpu_number() % kUSBCommandPoolCaches];
+	if (IOUSBCommandCachePut(cache, &command, 1))
+		command = NULL;
+	
+	// the cache is full (or a getCommand(true) is waiting on the pool) - send a batch back to the pool along with this command
+	if (command || OSAddAtomic(0, &_expansionData->blockedGetters))
+		fSerializer->runAction(gatedDrainCache, cache, command);
+}
+
+void
+IOUSBCommandPool::returnCommands(IOCommand ** commands, UInt32 count)
+{
+	CommandCache	*cache;
+	UInt32			scrubbed = 0;
+	UInt32			i;
+	
+	if (!_expansionData)
+	{
+		for (i = 0; i < count; i++)
+			IOCommandPool::returnCommand(commands[i]);
+		return;
+	}
+	
+	// keep only the commands ScrubCommand accepts, packed at the front
+	for (i = 0; i < count; i++)
+		if (ScrubCommand(commands[i]) == kIOReturnSuccess)
+			commands[scrubbed++] = commands[i];
+	
+	cache = &_expansionData->caches[cpu_number() % kUSBCommandPoolCaches];
+	
+	i = IOUSBCommandCachePut(cache, commands, scrubbed);
+	
+	// whatever did not fit goes back to the pool together with a batch from the cache
+	if ((i < scrubbed) || OSAddAtomic(0, &_expansionData->blockedGetters))
+		fSerializer->runAction(gatedReturnCommands, cache, &commands[i], (void *)(uintptr_t)(scrubbed - i));
+}
+
+IOReturn
+IOUSBCommandPool::gatedRefillCache(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
+{
+#pragma unused (arg2, arg3)
+	IOUSBCommandPool	*me = (IOUSBCommandPool *)owner;
+	CommandCache		*cache = (CommandCache *)arg0;
+	IOCommand			**commandP = (IOCommand **)arg1;
+	IOCommand			*batch[kUSBCommandPoolCacheBatch];
+	UInt32				count = 0;
+	UInt32				cached;
+	int					i;
+	
+	if (me->gatedGetCommand(commandP, false) != kIOReturnSuccess)
+	{
+		// the queue is empty, but the caches of the other CPUs may not be - take a single command from one of them, since their owners
+		// are likely to want the rest
+		*commandP = NULL;
+		for (i=0; (i < kUSBCommandPoolCaches) && !*commandP; i++)
+			IOUSBCommandCacheTake(&me->_expansionData->caches[i], commandP, 1);
+		if (*commandP)
+		{
+			me->_expansionData->steals++;
+			return kIOReturnSuccess;
+		}
+		
+		// every free command is in use - the caller will grow the pool
+		me->_expansionData->growEvents++;
+		return kIOReturnNoResources;
+	}
+	
+	while ((count < (kUSBCommandPoolCacheBatch - 1)) && (me->gatedGetCommand(&batch[count], false) == kIOReturnSuccess))
+		count++;
+	
+	cached = IOUSBCommandCachePut(cache, batch, count);
+	
+	// another thread filled the cache while we were getting here
+	while (count > cached)
+	{
+		me->IOCommandPool::gatedReturnCommand(batch[--count]);
+		me->_expansionData->freeInPool++;
+	}
+	
+	return kIOReturnSuccess;
+}
+
+IOReturn
+IOUSBCommandPool::gatedDrainCache(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
+{
+#pragma unused (arg2, arg3)
+	IOUSBCommandPool	*me = (IOUSBCommandPool *)owner;
+	CommandCache		*cache = (CommandCache *)arg0;
+	IOCommand			*batch[kUSBCommandPoolCacheBatch + 1];
+	UInt32				count;
+	
+	count = IOUSBCommandCacheTake(cache, batch, kUSBCommandPoolCacheBatch);
+	if (arg1)
+		batch[count++] = (IOCommand *)arg1;
+	
+	while (count)
+	{
+		me->IOCommandPool::gatedReturnCommand(batch[--count]);
+		me->_expansionData->freeInPool++;
+	}
+	me->_expansionData->drains++;
+	
+	return kIOReturnSuccess;
+}
+
+IOReturn
+IOUSBCommandPool::gatedReturnCommands(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
+{
+#pragma unused (arg3)
+	IOUSBCommandPool	*me = (IOUSBCommandPool *)owner;
+	IOCommand			**commands = (IOCommand **)arg1;
+	UInt32				count = (UInt32)(uintptr_t)arg2;
+	
+	gatedDrainCache(owner, arg0, NULL, NULL, NULL);
+	
+	while (count)
+	{
+		me->IOCommandPool::gatedReturnCommand(commands[--count]);
+		me->_expansionData->freeInPool++;
+	}
+	
+	return kIOReturnSuccess;
+}
+
+IOReturn
+IOUSBCommandPool::gatedReleaseIdleCommands(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3)
+{
+#pragma unused (arg3)
+	IOUSBCommandPool	*me = (IOUSBCommandPool *)owner;
+	UInt32				allocated = (UInt32)(uintptr_t)arg0;
+	UInt32				keep = (UInt32)(uintptr_t)arg2;
+	UInt32				*freed = (UInt32 *)arg1;
+	UInt32				toFree;
+	IOCommand			*command;
+	int					i;
+	
+	// put everything which is sitting in a cache back on the queue
+	for (i=0; i < kUSBCommandPoolCaches; i++)
+	{
+		while (me->_expansionData->caches[i].count)
+			gatedDrainCache(owner, &me->_expansionData->caches[i], NULL, NULL, NULL);
+	}
+	
+	// only free commands can go, so a pool which is mostly in use shrinks by less than its excess
+	toFree = IOUSBCommandPoolTrimCount(allocated, keep, me->_expansionData->freeInPool);
+	
+	*freed = 0;
+	while ((*freed < toFree) && (me->gatedGetCommand(&command, false) == kIOReturnSuccess))
+	{
+		IOUSBCommand		*usbCommand = OSDynamicCast(IOUSBCommand, command);
+		IOUSBIsocCommand	*isocCommand = OSDynamicCast(IOUSBIsocCommand, command);
+		IODMACommand		*dmaCommand = usbCommand ? usbCommand->GetDMACommand() : (isocCommand ? isocCommand->GetDMACommand() : NULL);
+		
+		if (dmaCommand)
+		{
+			dmaCommand->release();
+			if (usbCommand)
+				usbCommand->SetDMACommand(NULL);
+			else
+				isocCommand->SetDMACommand(NULL);
+		}
+		command->release();
+		(*freed)++;
+	}
+	
+	return kIOReturnSuccess;
+}
+
+//
+// Called once a second from the controller's watchdog. If the pool has seen no traffic at all for kUSBCommandPoolIdleTicks calls, the
+// per-CPU caches are drained and free commands are released until no more than keep of the allocated commands remain.
+//
+UInt32
+IOUSBCommandPool::TrimIdleCaches(UInt32 allocated, UInt32 keep)
+{
+	UInt32		activity = 0;
+	UInt32		freed = 0;
+	int			i;
+	
+	if (!_expansionData)
+		return 0;
+	
+	for (i=0; i < kUSBCommandPoolCaches; i++)
+		activity += _expansionData->caches[i].hits + _expansionData->caches[i].misses;
+	
+	if (!IOUSBCommandPoolIdleCheck(activity, &_expansionData->lastActivity, &_expansionData->idleTicks))
+		return 0;
+	
+	if (allocated <= keep)
+		return 0;
+	
+	fSerializer->runAction(gatedReleaseIdleCommands, (void *)(uintptr_t)allocated, &freed, (void *)(uintptr_t)keep);
+	if (freed)
+	{
+		USBLog(5,"IOUSBCommandPool[%p]::TrimIdleCaches - released %d idle commands", this, (int)freed);
+	}
+	
+	return freed;
+}
+
+void
+IOUSBCommandPool::PublishStatistics(IOService * provider, const char * key)
+{
+	OSDictionary		*dict;
+	OSNumber			*num;
+	UInt32				values[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	const char *		names[8] = {"Cached", "CachedPeak", "CacheHits", "CacheMisses", "GrowEvents", "Drains", "FreeInPool", "Steals"};
+	int					i;
+	
+	if (!_expansionData || !provider)
+		return;
+	
+	for (i=0; i < kUSBCommandPoolCaches; i++)
+	{
+		values[0] += _expansionData->caches[i].count;
+		values[1] += _expansionData->caches[i].peak;
+		values[2] += _expansionData->caches[i].hits;
+		values[3] += _expansionData->caches[i].misses;
+	}
+	values[4] = _expansionData->growEvents;
+	values[5] = _expansionData->drains;
+	values[6] = _expansionData->freeInPool;
+	values[7] = _expansionData->steals;
+	
+	if ((values[2] == _expansionData->lastPublishedHits) && (values[3] == _expansionData->lastPublishedMisses))
+		return;
+	_expansionData->lastPublishedHits = values[2];
+	_expansionData->lastPublishedMisses = values[3];
+	
+	dict = OSDictionary::withCapacity(8);
+	if (!dict)
+		return;
+	
+	for (i=0; i < 8; i++)
+	{
+		num = OSNumber::withNumber(values[i], 32);
+		if (num)
+		{
+			dict->setObject(names[i], num);
+			num->release();
+		}
+	}
+	provider->setProperty(key, dict);
+	dict->release();
+}
+
 IOReturn
 IOUSBCommandPool::gatedGetCommand(IOCommand ** command, bool blockForCommand)
 {
 	IOReturn ret;
 	
 	ret = IOCommandPool::gatedGetCommand(command, blockForCommand);
+	if ((ret == kIOReturnSuccess) && _expansionData && _expansionData->freeInPool)
+		_expansionData->freeInPool--;
 	
 	return ret;
 }
 
 IOReturn
 IOUSBCommandPool::gatedReturnCommand(IOCommand * command)
+{
+	IOReturn	ret;
+	
+	ret = ScrubCommand(command);
+	if (ret != kIOReturnSuccess)
+		return ret;
+	
+	ret = IOCommandPool::gatedReturnCommand(command);
+	if ((ret == kIOReturnSuccess) && _expansionData)
+		_expansionData->freeInPool++;
+	
+	return ret;
+}
+
+//
+// Claims a command which is being returned and poisons the fields which must not be used again. Does not need the gate: a command
+// which is returned twice is caught because both a cache and the queue link fCommandChain, and two threads returning the same command
+// at the same moment are sorted out by the compare and swap in IOUSBCommandClaim, so only the one which wins touches the command.
+//
+IOReturn
+IOUSBCommandPool::ScrubCommand(IOCommand * command)
 {
 	IOUSBCommand		*usbCommand		= OSDynamicCast(IOUSBCommand, command);					// only one of these should be non-null
 	IOUSBIsocCommand	*isocCommand	= OSDynamicCast(IOUSBIsocCommand, command);
 
-	USBLog(7,"IOUSBCommandPool[%p]::gatedReturnCommand %p", this, command);
+	USBLog(7,"IOUSBCommandPool[%p]::ScrubCommand %p", this, command);
 	if (!command)
 	{
 #if DEBUG_LEVEL != DEBUG_LEVEL_PRODUCTION
@@ -543,9 +1011,7 @@ IOUSBCommandPool::gatedReturnCommand(IOCommand * command)
 		return kIOReturnBadArgument;
 	}
 	
-	if (command->fCommandChain.next &&
-	    (&command->fCommandChain != command->fCommandChain.next || 
-		 &command->fCommandChain != command->fCommandChain.prev))
+	if (!IOUSBCommandClaim(command, this))
 	{
 #if DEBUG_LEVEL != DEBUG_LEVEL_PRODUCTION
 		kprintf("WARNING: gatedReturnCommand(%p) already on queue [next=%p prev=%p]\n", command, command->fCommandChain.next, command->fCommandChain.prev);
@@ -594,7 +1060,6 @@ IOUSBCommandPool::gatedReturnCommand(IOCommand * command)
 		nullCompletion.parameter = (void *) POISONVALUE;
 				
 		usbCommand->SetSelector(INVALID_SELECTOR);
-		usbCommand->SetRequest((IOUSBDeviceRequestPtr) POISONVALUE);
 		usbCommand->SetAddress(0xFF);
 		usbCommand->SetEndpoint(0xFF);
 		usbCommand->SetDirection(0xFF);
@@ -603,24 +1068,14 @@ IOUSBCommandPool::gatedReturnCommand(IOCommand * command)
 		usbCommand->SetBuffer((IOMemoryDescriptor *) POISONVALUE);
 		usbCommand->SetUSLCompletion(nullCompletion);
 		usbCommand->SetClientCompletion(nullCompletion);
-		usbCommand->SetDataRemaining(POISONVALUE);
-		usbCommand->SetStage(0xFF);
 		usbCommand->SetStatus(POISONVALUE);
-		usbCommand->SetOrigBuffer((IOMemoryDescriptor *) POISONVALUE);
-		usbCommand->SetDisjointCompletion(nullCompletion);
-		usbCommand->SetDblBufLength(POISONVALUE);
 		usbCommand->SetNoDataTimeout(POISONVALUE);
 		usbCommand->SetCompletionTimeout(POISONVALUE);
 		usbCommand->SetReqCount(POISONVALUE);
-		usbCommand->SetMultiTransferTransaction(true);
-		usbCommand->SetFinalTransferInTransaction(true);
-		usbCommand->SetUseTimeStamp(true);
 		usbCommand->SetIsSyncTransfer(FALSE);
-		for ( int i=0; i < kUSBCommandScratchBuffers; i++)
-			usbCommand->SetUIMScratch(i, POISONVALUE);
-#ifdef SUPPORTS_SS_USB
-		usbCommand->SetStreamID(POISONVALUE);
-#endif
+		
+		// the control, disjoint, transaction and UIM scratch fields read back as zero from here on, and need no reset when the command is reused
+		usbCommand->NewGeneration();
 		
 		if ( usbCommand->GetBufferUSBCommand() != NULL )
 		{
@@ -659,7 +1114,7 @@ IOUSBCommandPool::gatedReturnCommand(IOCommand * command)
 			USBError(1,"IOUSBCommandPool[%p]::gatedReturnCommand - missing dmaCommand in IOUSBIsocCommand", this);
 		}
 	}
-	return IOCommandPool::gatedReturnCommand(command);
+	return kIOReturnSuccess;
 }
 
 
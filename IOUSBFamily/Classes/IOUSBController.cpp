@@ -34,6 +34,7 @@
 #include <libkern/OSByteOrder.h>
 #include <libkern/c++/OSDictionary.h>
 #include <libkern/c++/OSData.h>
+#include <libkern/c++/OSCollectionIterator.h>
 #include <libkern/version.h>
 
 #include <IOKit/assert.h>
@@ -43,6 +44,8 @@
 #include <IOKit/IOCommandPool.h>
 #include <IOKit/IOPlatformExpert.h>
 #include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 
 #include <IOKit/usb/IOUSBController.h>
 #include <IOKit/usb/IOUSBControllerV2.h>
@@ -52,6 +55,8 @@
 #include <IOKit/usb/IOUSBRootHubDevice.h>
 #include <IOKit/usb/IOUSBLog.h>
 #include <IOKit/usb/IOUSBWorkLoop.h>
+#include <IOKit/usb/IOUSBTransferStatistics.h>
+#include <IOKit/usb/IOUSBSyncWait.h>
 #include "USBTracepoints.h"
 #include "IOUSBFamilyInfoPlist.pch"
 
@@ -198,10 +203,101 @@ struct IOUSBSyncCompletionTarget
 {
     IOUSBController *	controller;		// Used to access our object in the completion
     void *		flag;					// Contains the variable used to sleep/wake the threads
+    IOLock *		waitLock;				// Non NULL if the thread waits in WaitForSyncTransfer rather than in the command gate
+    volatile UInt32	done;					// Set by the completion for WaitForSyncTransfer
 };
 
 typedef struct IOUSBSyncCompletionTarget IOUSBSyncCompletionTarget;
 
+struct IOUSBCompletionBatchEntry
+{
+	IOUSBCompletion				completion;			// the action is an IOUSBCompletionActionWithTimeStamp if useTimeStamp is set
+	IOReturn					status;
+	UInt32						bufferSizeRemaining;
+	AbsoluteTime				timeStamp;
+	bool						useTimeStamp;
+	bool						dispatched;
+};
+
+struct IOUSBCompletionBatchClient
+{
+	IOUSBCompletionAction		action;
+	IOUSBBatchCompletionAction	batchAction;
+};
+
+struct IOUSBCompletionHandoffGroup
+{
+	IOUSBBatchCompletionAction	batchAction;
+	void *						target;
+	UInt32						first;				// index of the group's first entry in results
+	UInt32						count;
+};
+
+// the batch action calls of one scavenge pass, handed from the workloop to the completion thread in a slot of the handoff ring
+struct IOUSBCompletionHandoff
+{
+	UInt32						groupCount;
+	UInt32						resultCount;
+	IOUSBCompletionHandoffGroup	groups[kUSBCompletionBatchMax];
+	IOUSBBatchCompletionResult	results[kUSBCompletionBatchMax];
+};
+
+struct IOUSBCompletionBatch
+{
+	UInt32						depth;				// nesting of BeginCompletionBatch
+	bool						flushing;
+	UInt32						entryCount;
+	UInt32						commandCount;
+	IOUSBCompletionBatchEntry	entries[kUSBCompletionBatchMax];
+	IOCommand *					commands[kUSBCompletionBatchMax * 2];		// a control transfer can bring a buffer command along
+	IOUSBBatchCompletionResult	results[kUSBCompletionBatchMax];
+	IOUSBCompletionBatchClient	clients[kUSBCompletionBatchMaxClients];
+	UInt32						clientCount;
+	UInt32						passes;				// flushes with at least one completion
+	UInt32						completions;
+	UInt32						maxBatch;
+	UInt32						batchCalls;			// calls to an IOUSBBatchCompletionAction
+	UInt32						batchCallResults;	// completions delivered through them
+	bool						changed;
+	IOWorkLoop *				completionWorkLoop;	// the completion thread, created when the first batch action registers
+	IOInterruptEventSource *	completionSource;
+	IOLock *					completionLock;		// protects the fields below
+	IOUSBCompletionHandoff *	handoffSlots;		// kUSBCompletionHandoffSlots, allocated with the completion thread
+	IOUSBHandoffRing			handoffRing;
+	UInt32						maxPendingHandoffs;
+	UInt32						handoffCount;
+	UInt32						handoffsRingFull;	// passes whose batch actions ran on the workloop because every slot was taken
+	bool						completionThreadBusy;
+	bool						completionThreadWaiters;
+	uint64_t					completionThreadBusyNS;
+	uint64_t					passStartTime;		// mach_absolute_time() at BeginCompletionBatch
+	uint64_t					workLoopBusyNS;		// time the workloop spent in scavenge passes
+	uint64_t					lastPublishTime;
+	uint64_t					lastWorkLoopBusyNS;
+	uint64_t					lastCompletionThreadBusyNS;
+	bool						reportedBusy;
+	bool						completionStopped;	// StopCompletionThread has run, so no new completion thread is started
+};
+
+// the resources RegisterPolledEndpoint sets aside for one endpoint
+struct IOUSBPolledEndpoint
+{
+	USBDeviceAddress			address;			// 0 if the slot is free
+	UInt8						endpoint;
+	volatile bool				busy;				// a polled read is queued on the endpoint
+	UInt32						bufferSize;
+	IOUSBCommand *				command;			// kept out of the command pool
+	IOBufferMemoryDescriptor *	buffer;				// set in the command's IODMACommand for as long as the endpoint is registered
+	IOMemoryDescriptor *		clientBuffer;		// not retained - the caller of PolledRead owns it until the completion
+};
+
+// how the descriptor cache gets memory for the descriptors it holds
+struct IOUSBDescriptorCacheOps
+{
+	static void *	Alloc(UInt32 size)				{ return IOMalloc(size); }
+	static void		Free(void *ptr, UInt32 size)	{ IOFree(ptr, size); }
+};
+
 #pragma mark Globals
 
 //================================================================================================
@@ -278,11 +374,28 @@ static SleepCurrentPerModel  gSleepCurrentInfo[] = {
 #define _currentSizeOfCommandPool		_expansionData->_currentSizeOfCommandPool
 #define _currentSizeOfIsocCommandPool	_expansionData->_currentSizeOfIsocCommandPool
 #define _controllerSpeed				_expansionData->_controllerSpeed
-#define _addressPending					_expansionData->_addressPending
+#define _addressMap					_expansionData->_addressMap
+#define _addressQuarantineMS			_expansionData->_addressQuarantineMS
+#define _addressLock					_expansionData->_addressLock
+#define _descriptorCache				_expansionData->_descriptorCache
+#define _descriptorCacheLock			_expansionData->_descriptorCacheLock
+#define _descriptorCacheChanged			_expansionData->_descriptorCacheChanged
+#define _syncWaitLock					_expansionData->_syncWaitLock
+#define _syncSpinUS						_expansionData->_syncSpinUS
+#define _completionBatch				_expansionData->_completionBatch
+#define _acpiPortTable					_expansionData->_acpiPortTable
+#define _acpiPortTableProvider			_expansionData->_acpiPortTableProvider
+#define _acpiPortTableLock				_expansionData->_acpiPortTableLock
+#define _acpiPortTableValid				_expansionData->_acpiPortTableValid
+#define _acpiPublishNotifier			_expansionData->_acpiPublishNotifier
+#define _acpiTerminateNotifier			_expansionData->_acpiTerminateNotifier
+#define _transferStatistics				_expansionData->_transferStatistics
+#define _polledEndpoints				_expansionData->_polledEndpoints
 #define _provider						_expansionData->_provider
 #define _controllerCanSleep				_expansionData->_controllerCanSleep
 #define _needToClose					_expansionData->_needToClose
 #define _isochMaxBusStall				_expansionData->_isochMaxBusStall
+#define _devZeroArbiter					_expansionData->_devZeroArbiter
 #ifdef SUPPORTS_SS_USB
 	#define _rootHubDeviceSS				_expansionData->_rootHubDeviceSS
 #endif
@@ -316,6 +429,21 @@ IOUSBSyncCompletion(void *	target, void * 	parameter, IOReturn	status, UInt32	bu
         return;
     }
     
+    if ( syncTarget->waitLock )
+    {
+        IOLock *	waitLock = syncTarget->waitLock;
+		
+        if (parameter != NULL) {
+            *(UInt32 *)parameter -= bufferSizeRemaining;
+        }
+		
+        // The thread is not in the command gate, so it doesn't need a commandWakeup.  Once done is set it may return
+        // (and its syncTarget go away) without sleeping, so only the address of the syncTarget is used after that
+        //
+        IOUSBSyncWaitSignal(waitLock, &syncTarget->done, syncTarget);
+        return;
+    }
+	
     commandGate = me->GetCommandGate();
     if ( !commandGate )
     {
@@ -401,6 +529,47 @@ IOUSBController::init(OSDictionary * propTable)
 		bzero(_expansionData, sizeof(ExpansionData));
     }
 	
+	if (!_addressLock)
+	{
+		_addressLock = IOSimpleLockAlloc();
+		if (!_addressLock)
+			return false;
+	}
+	_addressQuarantineMS = kUSBDefaultAddressQuarantineMS;
+	
+	if (!_descriptorCacheLock)
+	{
+		_descriptorCacheLock = IOLockAlloc();
+		if (!_descriptorCacheLock)
+			return false;
+	}
+	
+	if (!_syncWaitLock)
+	{
+		_syncWaitLock = IOLockAlloc();
+		if (!_syncWaitLock)
+			return false;
+	}
+	_syncSpinUS = kUSBDefaultSyncSpinUS;
+	
+	if (!_acpiPortTableLock)
+	{
+		_acpiPortTableLock = IOLockAlloc();
+		if (!_acpiPortTableLock)
+			return false;
+	}
+	
+	if (!_completionBatch)
+	{
+		_completionBatch = (IOUSBCompletionBatch *)IOMalloc(sizeof(IOUSBCompletionBatch));
+		if (!_completionBatch)
+			return false;
+		bzero(_completionBatch, sizeof(IOUSBCompletionBatch));
+		_completionBatch->completionLock = IOLockAlloc();
+		if (!_completionBatch->completionLock)
+			return false;
+	}
+	
     _watchdogTimerActive = false;
     
     // Use other controller INIT routine to override this.
@@ -517,10 +686,30 @@ IOUSBController::start( IOService * provider )
         }
 		
         
-        for (i = 1; i < kUSBMaxDevices; i++)
-        {
-            _addressPending[i] = false;
-        }
+		// the personality can override how long a released address stays out of circulation
+		OSNumber	*quarantine = OSDynamicCast(OSNumber, getProperty(kUSBAddressQuarantineMSKey));
+		if (quarantine)
+		{
+			_addressQuarantineMS = quarantine->unsigned32BitValue();
+			USBLog(5, "%s[%p]::start - address quarantine is %d ms", getName(), this, (int)_addressQuarantineMS);
+		}
+		
+		// and how long a short synchronous transfer polls for its completion (0 to always sleep)
+		OSNumber	*syncSpin = OSDynamicCast(OSNumber, getProperty(kUSBSyncSpinUSKey));
+		if (syncSpin)
+		{
+			_syncSpinUS = syncSpin->unsigned32BitValue();
+			USBLog(5, "%s[%p]::start - synchronous transfers poll for %d us", getName(), this, (int)_syncSpinUS);
+		}
+		
+		// the ACPI port table is built the first time a hub asks about a port, and thrown away when ACPI objects come or go
+		OSDictionary	*acpiMatching = serviceMatching("IOACPIPlatformDevice");
+		if (acpiMatching)
+		{
+			_acpiPublishNotifier = addMatchingNotification(gIOPublishNotification, acpiMatching, ACPIRegistryChanged, this);
+			_acpiTerminateNotifier = addMatchingNotification(gIOTerminatedNotification, acpiMatching, ACPIRegistryChanged, this);
+			acpiMatching->release();
+		}
 		
         PMinit();
         _provider->joinPMtree(this);
@@ -665,6 +854,17 @@ IOUSBController::start( IOService * provider )
 			_workLoop->removeEventSource( _watchdogUSBTimer );
     }
 	
+	if (_acpiPublishNotifier)
+	{
+		_acpiPublishNotifier->remove();
+		_acpiPublishNotifier = NULL;
+	}
+	if (_acpiTerminateNotifier)
+	{
+		_acpiTerminateNotifier->remove();
+		_acpiTerminateNotifier = NULL;
+	}
+	
 	if (_commandGate)	
 	{
 		if (commandGateAdded && _workLoop )
@@ -718,7 +918,15 @@ IOUSBController::CreateDevice(	IOUSBDevice 		*newDevice,
 		   deviceAddress, (speed == kUSBDeviceSpeedLow) ? "low" :  ((speed == kUSBDeviceSpeedFull) ? "full" : "high"), (int)powerAvailable*2);
 #endif
    
-    _addressPending[deviceAddress] = true;			// in case the INIT takes a long time
+	IOUSBDeviceTransferStatistics	*statistics;
+	
+    ClaimAddress(deviceAddress);					// in case the INIT takes a long time
+	
+	// count the transfers from the first GetDescriptor on
+	statistics = IOUSBDeviceTransferStatistics::withAddress(deviceAddress);
+	if (statistics)
+		SetTransferStatistics(deviceAddress, statistics);
+	
     do 
     {
         if (!newDevice->init(deviceAddress, powerAvailable, speed, maxPacketSize))
@@ -741,7 +949,18 @@ IOUSBController::CreateDevice(	IOUSBDevice 		*newDevice,
         }
 		
         USBLog(7, "%s[%p]::CreateDevice - releasing pend on address %d", getName(), this, deviceAddress);
-        _addressPending[deviceAddress] = false;
+		if (deviceAddress < kUSBMaxDevices)
+		{
+			IOSimpleLockLock(_addressLock);
+			IOUSBAddressMapAttach(&_addressMap, deviceAddress);
+			IOSimpleLockUnlock(_addressLock);
+		}
+		
+		if (statistics)
+		{
+			newDevice->setProperty("TransferStatistics", statistics);
+			statistics->release();
+		}
 		
         return(kIOReturnSuccess);
 		
@@ -750,7 +969,9 @@ IOUSBController::CreateDevice(	IOUSBDevice 		*newDevice,
     // What do we do with the pending address here?  We should clear it and then
     // make sure that the caller to CreateDevice disables the port
     //
-    _addressPending[deviceAddress] = false;
+    ReleaseAddress(deviceAddress);
+	if (statistics)
+		statistics->release();
 	
     return(kIOReturnNoMemory);
 }
@@ -779,62 +1000,299 @@ IOUSBController::DeviceRequest(IOUSBDevRequestDesc *request, IOUSBCompletion *	c
 
 
 
+#pragma mark Address Allocation
+//================================================================================================
+//
+//   Address Allocation
+//
+//   USB addresses are kept in three bitmaps: reserved (handed out by GetNewAddress but not yet a
+//   started IOUSBDevice), attached (a started IOUSBDevice) and quarantined (recently released).
+//   Allocation is a find-first-zero over the union of the three. A released address is quarantined
+//   for _addressQuarantineMS so that a stale completion or request for the old device does not
+//   reach a new device which happens to get the same address. When nothing else is free the
+//   address which has been quarantined the longest is reused. The maps themselves are in
+//   IOUSBAddressMap.h.
+//
+//================================================================================================
+//
+static inline UInt64
+CurrentTimeNS(void)
+{
+	uint64_t		now = mach_absolute_time();
+	uint64_t		nowNS;
+	
+	absolutetime_to_nanoseconds(*(AbsoluteTime *)&now, &nowNS);
+	return nowNS;
+}
+
 USBDeviceAddress 
 IOUSBController::GetNewAddress(void)
 {
-    int 	i;
-    bool 	assigned[kUSBMaxDevices+2];     // 2 for when we split the root hub
-    OSIterator * clients;
+    USBDeviceAddress	address;
 	
-    bzero(assigned, sizeof(assigned));
+	IOSimpleLockLock(_addressLock);
+	address = AllocateAddressLocked();
+	IOSimpleLockUnlock(_addressLock);
 	
-    clients = getClientIterator();
+	if (address == 0)
+	{
+		// every address is reserved or attached - make sure the maps have not drifted from our clients before giving up
+		USBLog(3, "%s[%p]::GetNewAddress - no free address, resyncing the address map", getName(), this);
+		ResyncAddressMap();
+		
+		IOSimpleLockLock(_addressLock);
+		address = AllocateAddressLocked();
+		IOSimpleLockUnlock(_addressLock);
+	}
+	
+	if (address == 0)
+	{
+		USBLog(1, "%s[%p]::GetNewAddress - ran out of new addresses!", getName(), this);
+		return (0);	// No free device addresses!
+	}
+	
+	USBLog(5, "%s[%p]::GetNewAddress - returning address: %d", getName(), this, address);
+	return address;
+}
+
+
+
+USBDeviceAddress 
+IOUSBController::AllocateAddressLocked(void)
+{
+	return IOUSBAddressMapAllocate(&_addressMap, CurrentTimeNS(), (UInt64)_addressQuarantineMS * 1000000ULL);
+}
+
+
+
+void 
+IOUSBController::ClaimAddress(USBDeviceAddress address)
+{
+	if ((address == 0) || (address >= kUSBMaxDevices))
+		return;
+	
+	// the address normally came from GetNewAddress and is already reserved, but the UIM may have picked its own
+	IOSimpleLockLock(_addressLock);
+	IOUSBAddressMapClaim(&_addressMap, address);
+	IOSimpleLockUnlock(_addressLock);
+}
+
+
+
+void 
+IOUSBController::ReleaseAddress(USBDeviceAddress address)
+{
+	if ((address == 0) || (address >= kUSBMaxDevices) || !_expansionData || !_addressLock)
+		return;
+	
+	IOSimpleLockLock(_addressLock);
+	IOUSBAddressMapRelease(&_addressMap, address, CurrentTimeNS(), (_addressQuarantineMS != 0));
+	IOSimpleLockUnlock(_addressLock);
+	
+	// the device keeps its counters through its property, but the next device at this address gets new ones
+	SetTransferStatistics(address, NULL);
 	
+	USBLog(6, "%s[%p]::ReleaseAddress - released address %d", getName(), this, address);
+}
+
+
+
+void 
+IOUSBController::ResyncAddressMap(void)
+{
+    UInt32			attached[kUSBAddressMapWords];
+    OSIterator		*clients;
+	
+    bzero(attached, sizeof(attached));
+	
+    clients = getClientIterator();
     if (clients)
     {
         OSObject *next;
         while( (next = clients->getNextObject()) )
         {
             IOUSBDevice *testIt = OSDynamicCast(IOUSBDevice, next);
-            if (testIt)
-            {
-				USBLog(6, "%s[%p]::GetNewAddress - Assigned address %d", getName(), this, testIt->GetAddress());
-				if (testIt->GetAddress() < kUSBMaxDevices)
-                	assigned[testIt->GetAddress()] = true;
-            }
+            if (testIt && !testIt->isInactive() && (testIt->GetAddress() > 0) && (testIt->GetAddress() < kUSBMaxDevices))
+			{
+				USBLog(6, "%s[%p]::ResyncAddressMap - Assigned address %d", getName(), this, testIt->GetAddress());
+				attached[testIt->GetAddress() / 32] |= (1U << (testIt->GetAddress() % 32));
+			}
         }
         clients->release();
     }
 	
-    // Add check to see if an address is pending attachment to the IOService
-    //
-    for (i = 1; i < kUSBMaxDevices; i++)
-    {
-        if ( _addressPending[i] == true )
-        {
-			USBLog(5, "%s[%p]::GetNewAddress - Assigned address pending at index: %d", getName(), this, i);
-            assigned[i] = true;
-        }
-    }
+	IOSimpleLockLock(_addressLock);
+	bcopy(attached, _addressMap.attached, sizeof(attached));
+	IOSimpleLockUnlock(_addressLock);
+}
+
+
+
+#pragma mark Transfer Statistics
+//================================================================================================
+//
+//   Transfer Statistics
+//
+//   Every address in use has an IOUSBDeviceTransferStatistics which the control, interrupt and bulk
+//   paths update as transfers are queued and completed. Both happen on the workloop, and so does
+//   every change to the table, so the completion path looks its counters up without a lock.
+//
+//================================================================================================
+//
+IOUSBDeviceTransferStatistics *
+IOUSBController::GetTransferStatistics(USBDeviceAddress address)
+{
+	if (!_expansionData || (address >= kUSBMaxDevices))
+		return NULL;
 	
-    // If you want addresses to start at the top (127) and decrease, use the following:
-    // for (i = kUSBMaxDevices-1; i > 0; i--)
-    //
-    for (i = 1; i < kUSBMaxDevices; i++)
-    {
-		if (!assigned[i])
-        {
- 			USBLog(5, "%s[%p]::GetNewAddress - returning address: %d", getName(), this, i);
-           	return i;
-        }
-    }
+	return _transferStatistics[address];
+}
+
+
+
+void
+IOUSBController::SetTransferStatistics(USBDeviceAddress address, IOUSBDeviceTransferStatistics *statistics)
+{
+	if ((address == 0) || (address >= kUSBMaxDevices) || !_expansionData)
+		return;
+	
+	if (_commandGate)
+		_commandGate->runAction(GatedSetTransferStatistics, (void *)(uintptr_t)address, (void *)statistics);
+	else
+		GatedSetTransferStatistics(this, (void *)(uintptr_t)address, (void *)statistics, NULL, NULL);
+}
+
+
+
+IOReturn
+IOUSBController::GatedSetTransferStatistics(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+#pragma unused (arg2, arg3)
+	IOUSBController					*me = (IOUSBController *)target;
+	USBDeviceAddress				address = (USBDeviceAddress)(uintptr_t)arg0;
+	IOUSBDeviceTransferStatistics	*statistics = (IOUSBDeviceTransferStatistics *)arg1;
+	IOUSBDeviceTransferStatistics	*old = me->_transferStatistics[address];
+	
+	if (statistics)
+		statistics->retain();
+	me->_transferStatistics[address] = statistics;
+	if (old)
+		old->release();
+	
+	return kIOReturnSuccess;
+}
+
+
+
+#pragma mark Descriptor Cache
+//================================================================================================
+//
+//   Descriptor Cache
+//
+//   Configuration and string descriptors of the devices we have enumerated, kept across the life
+//   of the IOUSBDevice objects so that a reset, a re-enumeration or a sleep/wake cycle does not
+//   have to fetch them over the bus again. The cache itself (keys, validation against the device
+//   descriptor, LRU eviction) is in IOUSBDescriptorCache.h - these wrap it in _descriptorCacheLock
+//   and hand descriptors out as OSData.
+//
+//================================================================================================
+//
+OSData *
+IOUSBController::CopyCachedDescriptor(const char *key, const IOUSBDeviceDescriptor *devDesc, UInt8 type, UInt8 index, UInt16 lang, UInt32 requestsSaved)
+{
+	const IOUSBCachedDescriptor		*cached = NULL;
+	OSData							*descriptor = NULL;
+	
+	if (!key || !devDesc || !_expansionData || !_descriptorCacheLock)
+		return NULL;
+	
+	IOLockLock(_descriptorCacheLock);
+	if (_descriptorCache)
+	{
+		cached = IOUSBDescriptorCacheLookup<IOUSBDescriptorCacheOps>(_descriptorCache, key, devDesc, type, index, lang, requestsSaved);
+		if (cached)
+			descriptor = OSData::withBytes(cached->bytes, cached->length);
+		_descriptorCacheChanged = true;
+	}
+	IOLockUnlock(_descriptorCacheLock);
+	
+	USBLog(6, "%s[%p]::CopyCachedDescriptor - %s %02x-%02x-%04x: %s", getName(), this, key, type, index, lang, cached ? "hit" : "miss");
+	return descriptor;
+}
+
+
+
+void
+IOUSBController::CacheDescriptor(const char *key, const IOUSBDeviceDescriptor *devDesc, UInt8 type, UInt8 index, UInt16 lang, const void *bytes, UInt32 length)
+{
+	if (!key || !devDesc || !bytes || !length || !_expansionData || !_descriptorCacheLock)
+		return;
+	
+	IOLockLock(_descriptorCacheLock);
+	if (!_descriptorCache)
+	{
+		_descriptorCache = (IOUSBDescriptorCache *)IOMalloc(sizeof(IOUSBDescriptorCache));
+		if (_descriptorCache)
+			bzero(_descriptorCache, sizeof(IOUSBDescriptorCache));
+	}
+	if (_descriptorCache)
+	{
+		IOUSBDescriptorCacheStore<IOUSBDescriptorCacheOps>(_descriptorCache, key, devDesc, type, index, lang, bytes, length);
+		_descriptorCacheChanged = true;
+	}
+	IOLockUnlock(_descriptorCacheLock);
+}
+
+
+
+void
+IOUSBController::PublishDescriptorCacheStatistics(void)
+{
+	OSDictionary		*dict;
+	OSNumber			*num;
+	UInt32				values[5];
+	const char *		names[5] = {"Entries", "Hits", "Misses", "RequestsSaved", "Evictions"};
+	int					i;
+	
+	bzero(values, sizeof(values));
+	IOLockLock(_descriptorCacheLock);
+	if (_descriptorCache)
+	{
+		values[0] = _descriptorCache->count;
+		values[1] = _descriptorCache->hits;
+		values[2] = _descriptorCache->misses;
+		values[3] = _descriptorCache->requestsSaved;
+		values[4] = _descriptorCache->evictions;
+	}
+	_descriptorCacheChanged = false;
+	IOLockUnlock(_descriptorCacheLock);
+	
+	dict = OSDictionary::withCapacity(5);
+	if (!dict)
+		return;
 	
-    USBLog(1, "%s[%p]::GetNewAddress - ran out of new addresses!", getName(), this);
-    return (0);	// No free device addresses!
+	for (i=0; i < 5; i++)
+	{
+		num = OSNumber::withNumber(values[i], 32);
+		if (num)
+		{
+			dict->setObject(names[i], num);
+			num->release();
+		}
+	}
+	setProperty("DescriptorCacheStatistics", dict);
+	dict->release();
 }
 
 
 
+#pragma mark Transactions
+//================================================================================================
+//
+//   Transactions
+//
+//================================================================================================
+//
 /*
  * ControlPacket:
  *   Send a USB control packet which consists of at least two stages: setup
@@ -939,6 +1397,15 @@ IOUSBController::ControlTransaction(IOUSBCommand *command)
             break;
         }
 		
+		// from here on the transaction comes back through ControlPacketHandler, which counts it as complete
+		if (completion.action == (IOUSBCompletionAction) &ControlPacketHandler)
+		{
+			IOUSBDeviceTransferStatistics	*statistics = GetTransferStatistics(command->GetAddress());
+			
+			if (statistics)
+				statistics->TransferQueued(endpoint, kUSBOut);
+		}
+		
         // Data Stage
         if (wLength && (request->pData != NULL))
         {
@@ -1029,6 +1496,7 @@ IOUSBController::ControlPacketHandler( OSObject * 	target,
 	IOUSBCompletion			theCompletion;
 	IOReturn				theStatus;
 	UInt32					theDataRemaining;
+	IOUSBDeviceTransferStatistics	*statistics;
 	
     if (command == 0)
         return;
@@ -1188,6 +1656,11 @@ IOUSBController::ControlPacketHandler( OSObject * 	target,
 		theStatus = command->GetStatus();
 		theDataRemaining = command->GetDataRemaining();
 		
+		// control transfers are counted against the OUT side of the endpoint, whatever the direction of the data stage
+		statistics = me->GetTransferStatistics(command->GetAddress());
+		if (statistics)
+			statistics->TransferCompleted(command->GetEndpoint(), kUSBOut, theStatus, request->wLength, theDataRemaining);
+		
 		// Only return the command if this is NOT a synchronous request.  For Sync requests, we return it later
 		//
 		if ( !isSyncTransfer )
@@ -1195,13 +1668,13 @@ IOUSBController::ControlPacketHandler( OSObject * 	target,
 			IOUSBCommand			*aBufferCommand = command->GetBufferUSBCommand();
 
 			command->SetBufferUSBCommand(NULL);
-			me->_freeUSBCommandPool->returnCommand(command);
+			me->ReturnCompletedCommand(command);
 			if (aBufferCommand)
-				me->_freeUSBCommandPool->returnCommand(aBufferCommand);
+				me->ReturnCompletedCommand(aBufferCommand);
 		}
 
-        // Call the clients handler
-        me->Complete(theCompletion, theStatus, theDataRemaining);
+        // Call the clients handler (at the end of the scavenge pass if the UIM is batching completions)
+        me->CompleteClient(theCompletion, theStatus, theDataRemaining);
 		
     }
     else
@@ -1260,6 +1733,13 @@ IOUSBController::InterruptTransaction(IOUSBCommand *command)
 	{
 		_activeInterruptTransfers--;
 	}
+	else
+	{
+		IOUSBDeviceTransferStatistics	*statistics = GetTransferStatistics(command->GetAddress());
+		
+		if (statistics)
+			statistics->TransferQueued(command->GetEndpoint(), command->GetDirection());
+	}
 	
 	USBTrace_End( kUSBTController, kTPInterruptTransaction, (uintptr_t)this, err, command->GetCompletionTimeout(), command->GetNoDataTimeout());
 	
@@ -1279,6 +1759,7 @@ IOUSBController::InterruptPacketHandler(OSObject * target, void * parameter, IOR
 	IOUSBCompletion		theCompletion;
 	AbsoluteTime		theTimeStamp;
     bool                useTimeStamp;
+	IOUSBDeviceTransferStatistics	*statistics;
 	
     if (command == 0)
         return;
@@ -1301,6 +1782,10 @@ IOUSBController::InterruptPacketHandler(OSObject * target, void * parameter, IOR
     //
     command->SetStatus(status);
 	
+	statistics = me->GetTransferStatistics(command->GetAddress());
+	if (statistics)
+		statistics->TransferCompleted(command->GetEndpoint(), command->GetDirection(), status, (UInt32)command->GetReqCount(), bufferSizeRemaining);
+	
 	if (dmaCommand && memDesc)
 	{
 		// need to clear the memory descriptor (which completes it as well) before we call the completion routine
@@ -1329,10 +1814,10 @@ IOUSBController::InterruptPacketHandler(OSObject * target, void * parameter, IOR
     IOUSBCompletion disjointCompletion = command->GetDisjointCompletion();
 	if ( !isSyncTransfer && (disjointCompletion.action == NULL))
 	{
-		me->_freeUSBCommandPool->returnCommand(command);
+		me->ReturnCompletedCommand(command);
 	}
 
-    // Call the clients handler
+    // Call the clients handler (at the end of the scavenge pass if the UIM is batching completions)
     if ( useTimeStamp )
     {
         IOUSBCompletionWithTimeStamp	completionWithTimeStamp;
@@ -1343,10 +1828,10 @@ IOUSBController::InterruptPacketHandler(OSObject * target, void * parameter, IOR
         completionWithTimeStamp.parameter = theCompletion.parameter;
         completionWithTimeStamp.action = (IOUSBCompletionActionWithTimeStamp) theCompletion.action;
         
-        me->CompleteWithTimeStamp( completionWithTimeStamp, status, bufferSizeRemaining, theTimeStamp);
+        me->CompleteClientWithTimeStamp( completionWithTimeStamp, status, bufferSizeRemaining, theTimeStamp);
     }
     else
-        me->Complete(theCompletion, status, bufferSizeRemaining);
+        me->CompleteClient(theCompletion, status, bufferSizeRemaining);
 	
 	me->_activeInterruptTransfers--;
 	
@@ -1396,6 +1881,13 @@ IOUSBController::BulkTransaction(IOUSBCommand *command)
 	{
         USBLog(3,"%s[%p]::BulkTransaction: error queueing bulk packet (0x%x)", getName(), this, err);
 	}
+	else
+	{
+		IOUSBDeviceTransferStatistics	*statistics = GetTransferStatistics(command->GetAddress());
+		
+		if (statistics)
+			statistics->TransferQueued(command->GetEndpoint(), command->GetDirection());
+	}
 	
 	USBTrace_End( kUSBTController, kTPBulkTransaction, (uintptr_t)this, err, command->GetCompletionTimeout(), command->GetNoDataTimeout());
 	
@@ -1413,6 +1905,7 @@ IOUSBController::BulkPacketHandler(OSObject *target, void *parameter, IOReturn	s
 	IOMemoryDescriptor *	memDesc = dmaCommand ? (IOMemoryDescriptor *)dmaCommand->getMemoryDescriptor() : NULL;
 	bool					isSyncTransfer;
 	IOUSBCompletion			theCompletion;
+	IOUSBDeviceTransferStatistics	*statistics;
     
     if (command == 0)
         return;
@@ -1450,6 +1943,10 @@ IOUSBController::BulkPacketHandler(OSObject *target, void *parameter, IOReturn	s
 	
 	command->SetStatus(status);
 	
+	statistics = me->GetTransferStatistics(command->GetAddress());
+	if (statistics)
+		statistics->TransferCompleted(command->GetEndpoint(), command->GetDirection(), status, (UInt32)command->GetReqCount(), bufferSizeRemaining);
+	
 	isSyncTransfer = command->GetIsSyncTransfer();
 	
 	theCompletion = command->GetClientCompletion();
@@ -1460,11 +1957,11 @@ IOUSBController::BulkPacketHandler(OSObject *target, void *parameter, IOReturn	s
     IOUSBCompletion disjointCompletion = command->GetDisjointCompletion();
 	if ( !isSyncTransfer && (disjointCompletion.action == NULL))
 	{
-		me->_freeUSBCommandPool->returnCommand(command);
+		me->ReturnCompletedCommand(command);
 	}
 
-	// Call the clients handler
-    me->Complete(theCompletion, status, bufferSizeRemaining);
+	// Call the clients handler (at the end of the scavenge pass if the UIM is batching completions)
+    me->CompleteClient(theCompletion, status, bufferSizeRemaining);
 	
 }
 
@@ -1504,6 +2001,8 @@ IOUSBController::DoIsocTransfer(OSObject *owner, void *cmd, void *, void *, void
         //
         syncTarget.controller = controller;
         syncTarget.flag = &inCommandSleep;
+        syncTarget.waitLock = NULL;
+        syncTarget.done = 0;
         completion.target = &syncTarget;
         command->SetCompletion(completion);
 		
@@ -1669,6 +2168,7 @@ void
 IOUSBController::WatchdogTimer(OSObject *target, IOTimerEventSource *source)
 {
     IOUSBController*	me = OSDynamicCast(IOUSBController, target);
+    IOUSBControllerV3*	v3Controller;
     IOReturn			err;
 	
     if (!me || !source )
@@ -1690,35 +2190,126 @@ IOUSBController::WatchdogTimer(OSObject *target, IOTimerEventSource *source)
     else
     {
         me->UIMCheckForTimeouts();
+		
+		// let idle command caches go back to their pools, and release commands which a burst left behind
+		IOUSBCommandPool	*pool = OSDynamicCast(IOUSBCommandPool, me->_freeUSBCommandPool);
+		if (pool)
+		{
+			me->_currentSizeOfCommandPool -= pool->TrimIdleCaches(me->_currentSizeOfCommandPool, kSizeOfCommandPool);
+			pool->PublishStatistics(me, "CommandPoolStatistics");
+		}
+		pool = OSDynamicCast(IOUSBCommandPool, me->_freeUSBIsocCommandPool);
+		if (pool)
+		{
+			me->_currentSizeOfIsocCommandPool -= pool->TrimIdleCaches(me->_currentSizeOfIsocCommandPool, kSizeOfIsocCommandPool);
+			pool->PublishStatistics(me, "IsocCommandPoolStatistics");
+		}
+		
+		if (me->_descriptorCacheChanged)
+			me->PublishDescriptorCacheStatistics();
+		
+		if (me->_completionBatch && (me->_completionBatch->changed || me->_completionBatch->reportedBusy))
+			me->PublishCompletionBatchStatistics();
+		
+		v3Controller = OSDynamicCast(IOUSBControllerV3, me);
+		if (v3Controller)
+			v3Controller->PublishRootHubPollingStatistics();
     }
     
 }
 
 
 
-IOReturn 
-IOUSBController::DoIOTransfer(OSObject *owner, void *cmd, void *, void *, void *)
+//================================================================================================
+//
+//   RunTransfer
+//
+//   Runs DoIOTransfer or DoControlTransfer for a command. A synchronous transfer is only queued inside the
+//   command gate, and the thread then waits for its completion in WaitForSyncTransfer, outside of the gate.
+//   That way the completion does not have to hand the gate back to a thread sleeping in commandSleep, and
+//   the thread doesn't have to take the gate again just to return.
+//
+//================================================================================================
+//
+IOReturn
+IOUSBController::RunTransfer(IOCommandGate::Action transferAction, IOUSBCommand *command)
 {
-    IOUSBController *		controller = (IOUSBController *)owner;
-    IOUSBCommand *			command = (IOUSBCommand *) cmd;
-    IOReturn				err = kIOReturnSuccess;
-    IOUSBCompletion			completion;
-    IOUSBCompletion			disjointCompletion;
-	IOCommandGate *			commandGate;
+	IOUSBSyncCompletionTarget	syncTarget;
+	IOReturn					err;
 	
-    if ( !controller || !command )
-    {
-        USBError(1,"IOUSBController[%p]::DoIOTransfer -- bad controller or command (%p,%p)", controller, controller, command);
-        return kIOReturnBadArgument;
-    }
+	// a sync request from a thread that already holds the gate (the workloop thread, or a nested runAction) has
+	// to go through commandSleep, which drops the gate so the completion can run. Sleeping on the IOLock with
+	// the gate held would deadlock, since the completion needs the gate too.
+	if ( !command->GetIsSyncTransfer() || !_expansionData || !_syncWaitLock || getWorkLoop()->inGate() )
+		return GetCommandGate()->runAction(transferAction, command);
 	
-	commandGate = controller->GetCommandGate();
+	syncTarget.controller = this;
+	syncTarget.flag = NULL;
+	syncTarget.waitLock = _syncWaitLock;
+	syncTarget.done = 0;
 	
-    // If we have a synchronous completion, then we need to sleep
-    // this thread.  A synchronous completion will have
-    //
-    // 1. IOUSBSyncCompletion as our completion action OR
-    // 2. IOUSBSyncCompletion as the disjointCompletion;
+	err = GetCommandGate()->runAction(transferAction, command, &syncTarget);
+	if ( err != kIOReturnSuccess )
+		return err;
+	
+	return WaitForSyncTransfer(&syncTarget, command);
+}
+
+
+
+IOReturn
+IOUSBController::WaitForSyncTransfer(IOUSBSyncCompletionTarget *syncTarget, IOUSBCommand *command)
+{
+	IOUSBCommand *	bufferCommand = command->GetBufferUSBCommand();
+	IOByteCount		length = bufferCommand ? bufferCommand->GetReqCount() : command->GetReqCount();
+	UInt32			spinUS = (length <= kUSBSyncSpinMaxBytes) ? _syncSpinUS : 0;
+	int				kr;
+	
+	// A short transfer can complete before we would even get to sleep, so poll for it for a little while first
+	//
+	kr = IOUSBSyncWait(_syncWaitLock, &syncTarget->done, syncTarget, spinUS, true);
+	if ( kr != THREAD_AWAKENED )
+	{
+		// Abort the endpoint so that the transfer completes now, and keep waiting for that completion -
+		// the command can't be returned while the controller still has it
+		//
+		USBLog(3,"%s[%p]::WaitForSyncTransfer woke up: IOLockSleep returned with a result of:  %d (%s)", getName(), this, kr, kr == THREAD_INTERRUPTED ? "THREAD_INTERRUPTED" : "THREAD_XXXX");
+		IOReturn ret = GetCommandGate()->runAction(DoAbortEP, (void *)(uintptr_t) command->GetAddress(), (void *)(uintptr_t) command->GetEndpoint(), (void *)(uintptr_t) command->GetDirection());
+		USBLog(7,"%s[%p]::WaitForSyncTransfer DoAbortEP returned:  0x%x", getName(), this, ret);
+		IOUSBSyncWait(_syncWaitLock, &syncTarget->done, syncTarget, 0, false);
+	}
+	
+	// We need to return the result of the transfer here, not the result of the wait
+	//
+	return command->GetStatus();
+}
+
+
+
+IOReturn 
+IOUSBController::DoIOTransfer(OSObject *owner, void *cmd, void *waiter, void *, void *)
+{
+    IOUSBController *		controller = (IOUSBController *)owner;
+    IOUSBCommand *			command = (IOUSBCommand *) cmd;
+    IOUSBSyncCompletionTarget *	waitingTarget = (IOUSBSyncCompletionTarget *) waiter;	// non NULL if RunTransfer waits for the completion outside of the gate
+    IOReturn				err = kIOReturnSuccess;
+    IOUSBCompletion			completion;
+    IOUSBCompletion			disjointCompletion;
+	IOCommandGate *			commandGate;
+	
+    if ( !controller || !command )
+    {
+        USBError(1,"IOUSBController[%p]::DoIOTransfer -- bad controller or command (%p,%p)", controller, controller, command);
+        return kIOReturnBadArgument;
+    }
+	
+	commandGate = controller->GetCommandGate();
+	
+    // If we have a synchronous completion, then we need to sleep
+    // this thread.  A synchronous completion will have
+    //
+    // 1. IOUSBSyncCompletion as our completion action OR
+    // 2. IOUSBSyncCompletion as the disjointCompletion;
     //
     completion = command->GetClientCompletion();
     disjointCompletion = command->GetDisjointCompletion();
@@ -1735,19 +2326,21 @@ IOUSBController::DoIOTransfer(OSObject *owner, void *cmd, void *, void *, void *
         //
         syncTarget.controller = controller;
         syncTarget.flag = &inCommandSleep;
+        syncTarget.waitLock = NULL;
+        syncTarget.done = 0;
 		
         if ( completion.action == &IOUSBSyncCompletion )
         {
-            completion.target = &syncTarget;
+            completion.target = waitingTarget ? waitingTarget : &syncTarget;
             command->SetClientCompletion(completion);
         }
         else
         {
-            disjointCompletion.target = &syncTarget;
+            disjointCompletion.target = waitingTarget ? waitingTarget : &syncTarget;
             command->SetDisjointCompletion(disjointCompletion);
         }
         
-        // Now, do the transaction and put the thread to sleep
+        // Now, do the transaction and put the thread to sleep (unless RunTransfer is going to wait for it)
         //
         switch (command->GetType())
         {
@@ -1756,7 +2349,7 @@ IOUSBController::DoIOTransfer(OSObject *owner, void *cmd, void *, void *, void *
 				
                 // If we didn't get an immediate error, then put the thread to sleep and wait for it to wake up
                 //
-                if ( err == kIOReturnSuccess )
+                if ( (err == kIOReturnSuccess) && !waitingTarget )
                 {
 					
                     //USBLog(6,"%s[%p]::DoIOTransfer(Interrupt) calling commandSleep (%p,%p,%p)", controller->getName(), controller, &syncTarget, syncTarget.controller, syncTarget.flag);
@@ -1782,7 +2375,7 @@ IOUSBController::DoIOTransfer(OSObject *owner, void *cmd, void *, void *, void *
 				
             case kUSBBulk:
                 err = controller->BulkTransaction(command);
-                if ( err == kIOReturnSuccess )
+                if ( (err == kIOReturnSuccess) && !waitingTarget )
                 {
                     //USBLog(6,"%s[%p]::DoIOTransfer(Bulk) calling commandSleep (%p,%p,%p)", controller->getName(), controller, &syncTarget, syncTarget.controller, syncTarget.flag);
 					USBTrace_Start( kUSBTController, kTPDoIOTransferBulkSync, (uintptr_t)controller, ((command->GetDirection() << 24) | (controller->_busNumber << 16 ) | ( command->GetAddress() << 8) | command->GetEndpoint()), command->GetCompletionTimeout(), command->GetNoDataTimeout());
@@ -1856,9 +2449,10 @@ IOUSBController::DoIOTransfer(OSObject *owner, void *cmd, void *, void *, void *
 IOReturn 
 IOUSBController::DoControlTransfer(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3)
 {
-#pragma unused (arg1, arg2, arg3)
+#pragma unused (arg2, arg3)
     IOUSBController			*controller = (IOUSBController *)owner;
     IOUSBCommand			*command = (IOUSBCommand *) arg0;
+    IOUSBSyncCompletionTarget	*waitingTarget = (IOUSBSyncCompletionTarget *) arg1;	// non NULL if RunTransfer waits for the completion outside of the gate
     IOUSBCompletion			completion;
     IOUSBCompletion			disjointCompletion;
     IOReturn				kr = kIOReturnSuccess;
@@ -1895,25 +2489,27 @@ IOUSBController::DoControlTransfer(OSObject *owner, void *arg0, void *arg1, void
         //
         syncTarget.controller = controller;
         syncTarget.flag = &inCommandSleep;
+        syncTarget.waitLock = NULL;
+        syncTarget.done = 0;
 		
         if ( completion.action == &IOUSBSyncCompletion )
         {
-            completion.target = &syncTarget;
+            completion.target = waitingTarget ? waitingTarget : &syncTarget;
             command->SetClientCompletion(completion);
         }
         else
         {
-            disjointCompletion.target = &syncTarget;
+            disjointCompletion.target = waitingTarget ? waitingTarget : &syncTarget;
             command->SetDisjointCompletion(disjointCompletion);
         }
 		
-        // Now, do the transaction and put the thread to sleep
+        // Now, do the transaction and put the thread to sleep (unless RunTransfer is going to wait for it)
         //
         kr = controller->ControlTransaction((IOUSBCommand *)arg0);
 		
         // If we didn't get an immediate error, then put the thread to sleep and wait for it to wake up
         //
-        if ( kr == kIOReturnSuccess )
+        if ( (kr == kIOReturnSuccess) && !waitingTarget )
         {
 			IOCommandGate * 	commandGate = controller->GetCommandGate();
 			
@@ -2035,7 +2631,12 @@ IOUSBController::DoCreateEP(OSObject *owner, void *arg0, void *arg1, void *arg2,
 // the _devZeroLock, it is safe. If we need it, we will do a commandSleep to release the workLoop lock
 // until another thread is done with the _devZeroLock
 //
-#define DEV_ZEROLOCK_DEADLINE_IN_SECS	30
+// The deadline is measured from the time the current holder took the lock, not from the time we started waiting. With many
+// ports enumerating at once a waiter can legitimately sit behind several devices, and it must not give up on a holder which
+// is making progress. Only behind a holder which has kept device zero for kUSBDeviceZeroDeadlineNS does a waiter fail with
+// kIOReturnNotPermitted. The lock is never taken over: a release carries no owner, so the stuck holder's eventual release would
+// free it under the new holder. The deadline and hold time bookkeeping is in IOUSBDeviceZeroArbiter.h.
+//
 IOReturn
 IOUSBController::ProtectedDevZeroLock(OSObject *target, void* lock, void* arg2, void* arg3, void* arg4)
 {
@@ -2043,6 +2644,8 @@ IOUSBController::ProtectedDevZeroLock(OSObject *target, void* lock, void* arg2,
     IOUSBController	*	me = (IOUSBController*)target;
 	IOCommandGate * 	commandGate = me->GetCommandGate();
 	IOReturn			retVal = kIOReturnSuccess;
+	UInt64				waitStart = CurrentTimeNS();
+	UInt64				heldNS;
   
     USBLog(5, "%s[%p]::ProtectedDevZeroLock - about to %s device zero lock", me->getName(), me, lock ? "obtain" : "release");
     if (lock)
@@ -2055,12 +2658,19 @@ IOUSBController::ProtectedDevZeroLock(OSObject *target, void* lock, void* arg2,
 		
 		while (me->_devZeroLock and (retVal == kIOReturnSuccess))
 		{
-			AbsoluteTime	deadline;
+			uint64_t		deadline;
+			
+			if (!IOUSBDeviceZeroMayWait(&me->_devZeroArbiter, CurrentTimeNS()))
+			{
+				USBError(1, "%s[%p]::ProtectedDevZeroLock - device zero has been held for more than %d seconds - giving up", me->getName(), me, (int)(kUSBDeviceZeroDeadlineNS / 1000000000ULL));
+				retVal = kIOReturnNotPermitted;
+				break;
+			}
+			nanoseconds_to_absolutetime(IOUSBDeviceZeroDeadline(&me->_devZeroArbiter), &deadline);
 			
 			USBLog(5, "%s[%p]::ProtectedDevZeroLock - somebody already has it - running commandSleep", me->getName(), me);
 			
-			clock_interval_to_deadline(DEV_ZEROLOCK_DEADLINE_IN_SECS, kSecondScale, &deadline);
-			IOReturn kr = commandGate->commandSleep(&me->_devZeroLock, deadline, THREAD_ABORTSAFE);
+			IOReturn kr = commandGate->commandSleep(&me->_devZeroLock, *(AbsoluteTime *)&deadline, THREAD_ABORTSAFE);
 			USBTrace( kUSBTController, kTPDevZeroLock, (uintptr_t)me, 0, 0, 1 );
 			switch (kr)
 			{
@@ -2070,9 +2680,9 @@ IOUSBController::ProtectedDevZeroLock(OSObject *target, void* lock, void* arg2,
 					break;
 					
 				case THREAD_TIMED_OUT:
+					// the holder may have changed while we slept - the top of the loop decides whether the current one is stuck
 					USBLog(3,"%s[%p]::ProtectedDevZeroLock commandSleep timeout out (THREAD_TIMED_OUT) _devZeroLock(%s)", me->getName(), me, me->_devZeroLock ? "true" : "false");
 					USBTrace( kUSBTController, kTPDevZeroLock, (uintptr_t)me, (uintptr_t)me->_devZeroLock, 0, 7 );
-					retVal = kIOReturnNotPermitted;
 					break;
 					
 				case THREAD_INTERRUPTED:
@@ -2116,11 +2726,21 @@ IOUSBController::ProtectedDevZeroLock(OSObject *target, void* lock, void* arg2,
 				retVal = kIOReturnSuccess;
 			}
 		}
+		
+		// remember when we got it, so that waiters can tell a stuck holder from a slow queue
+		if (retVal == kIOReturnSuccess)
+			IOUSBDeviceZeroAcquired(&me->_devZeroArbiter, waitStart, CurrentTimeNS());
     }
     else
     {
 		USBLog(5, "%s[%p]::ProtectedDevZeroLock - releasing lock", me->getName(), me);
 		USBTrace( kUSBTController, kTPDevZeroLock, (uintptr_t)me, 0, 0, 8 );
+		if (me->_devZeroLock)
+		{
+			heldNS = IOUSBDeviceZeroReleased(&me->_devZeroArbiter, CurrentTimeNS());
+			USBLog(5, "%s[%p]::ProtectedDevZeroLock - device zero was held for %d ms", me->getName(), me, (int)(heldNS / 1000000));
+			me->PublishDeviceZeroStatistics();
+		}
 		me->_devZeroLock = false;
 		commandGate->commandWakeup(&me->_devZeroLock, true);
 		USBLog(5, "%s[%p]::ProtectedDevZeroLock - wakeup done", me->getName(), me);
@@ -2131,6 +2751,34 @@ IOUSBController::ProtectedDevZeroLock(OSObject *target, void* lock, void* arg2,
 
 
 
+void
+IOUSBController::PublishDeviceZeroStatistics(void)
+{
+	OSDictionary		*dict;
+	OSNumber			*num;
+	UInt32				values[5] = {_devZeroArbiter.acquisitions, (UInt32)(_devZeroArbiter.totalHoldNS / 1000000), _devZeroArbiter.maxHoldMS, _devZeroArbiter.maxWaitMS, _devZeroArbiter.timeouts};
+	const char *		names[5] = {"Acquisitions", "TotalHoldMS", "MaxHoldMS", "MaxWaitMS", "Timeouts"};
+	int					i;
+	
+	dict = OSDictionary::withCapacity(5);
+	if (!dict)
+		return;
+	
+	for (i=0; i < 5; i++)
+	{
+		num = OSNumber::withNumber(values[i], 32);
+		if (num)
+		{
+			dict->setObject(names[i], num);
+			num->release();
+		}
+	}
+	setProperty("DeviceZeroStatistics", dict);
+	dict->release();
+}
+
+
+
 IOReturn 
 IOUSBController::AcquireDeviceZero()
 {
@@ -2138,9 +2786,9 @@ IOUSBController::AcquireDeviceZero()
 	IOCommandGate * 	commandGate = GetCommandGate();
 	
     USBLog(6,"%s[%p]::AcquireDeviceZero  Trying to acquire Device Zero", getName(), this);
-    commandGate->runAction(ProtectedDevZeroLock, (void*)true);
+    err = commandGate->runAction(ProtectedDevZeroLock, (void*)true);
 	
-    USBLog(5,"%s[%p]::AcquireDeviceZero  Acquired Device Zero", getName(), this);
+    USBLog(5,"%s[%p]::AcquireDeviceZero  %s Device Zero (0x%x)", getName(), this, err ? "could not acquire" : "Acquired", err);
 		
     return(err);
 }
@@ -2318,6 +2966,7 @@ IOUSBController::MakeDevice(USBDeviceAddress *	address)
     {
         USBLog(1, "%s[%p]::MakeDevice error setting address. err=0x%x device=%p - releasing device", getName(), this, err, newDev);
 		USBTrace( kUSBTController, kTPControllerMakeDevice, (uintptr_t)this, err, (uintptr_t)newDev, *address);
+		ReleaseAddress(*address);
         *address = 0;
 		newDev->release();
 		return NULL;
@@ -2335,6 +2984,11 @@ IOUSBController::MakeDevice(USBDeviceAddress *	address)
 		if (err == kIOReturnSuccess)
 		{
 			USBLog(5, "%s[%p]::MakeDevice  GetActualDeviceAddress returned address: %d", getName(), this, latestDeviceAddress);
+			if (latestDeviceAddress != *address)
+			{
+				ReleaseAddress(*address);
+				ClaimAddress(latestDeviceAddress);
+			}
 			*address = latestDeviceAddress;
 		}
 		else
@@ -2380,6 +3034,7 @@ IOUSBController::MakeHubDevice(USBDeviceAddress *	address)
     {
         USBLog(1, "%s[%p]::MakeHubDevice error setting address. err=0x%x device=%p - releasing device", getName(), this, err, newDev);
 		USBTrace( kUSBTController, kTPControllerMakeHubDevice, (uintptr_t)this, err, (uintptr_t)newDev, *address);
+		ReleaseAddress(*address);
         *address = 0;
 		newDev->release();
 		return NULL;
@@ -2394,6 +3049,11 @@ IOUSBController::MakeHubDevice(USBDeviceAddress *	address)
 		
 		if(latestDeviceAddress > 0)
 		{
+			if (latestDeviceAddress != *address)
+			{
+				ReleaseAddress(*address);
+				ClaimAddress(latestDeviceAddress);
+			}
 			*address = latestDeviceAddress;
 		}
 	}
@@ -2414,10 +3074,15 @@ IOUSBController::PolledRead(short					functionNumber,
 							bool					bufferRounding,
 							UInt32					bufferSize)
 {
-#pragma unused (bufferSize)
-   IOUSBCommand *		command = (IOUSBCommand *)_freeUSBCommandPool->getCommand(false);
+	IOUSBPolledEndpoint	*polled = FindPolledEndpoint(functionNumber, endpointNumber);
+	IOUSBCommand *		command;
     IOUSBCompletion 	uslCompletion;
-    int			i;
+	
+	// a registered endpoint has everything it needs set aside already
+	if (polled)
+		return PolledReadReserved(polled, clientCompletion, CBP, bufferRounding, bufferSize);
+	
+	command = (IOUSBCommand *)_freeUSBCommandPool->getCommand(false);
 	
     // If we couldn't get a command, increase the allocation and try again
     //
@@ -2435,21 +3100,14 @@ IOUSBController::PolledRead(short					functionNumber,
 	
     command->SetUseTimeStamp(true);
     command->SetSelector(READ);
-    command->SetRequest(0);            	// Not a device request
     command->SetAddress(functionNumber);
     command->SetEndpoint(endpointNumber);
-#ifdef SUPPORTS_SS_USB
-    command->SetStreamID(0);
-#endif
     command->SetDirection(kUSBIn);
     command->SetType(kUSBInterrupt);
     command->SetBuffer(CBP);
     command->SetClientCompletion(clientCompletion);
     command->SetBufferRounding(bufferRounding);
 	
-    for (i=0; i < 10; i++)
-		command->SetUIMScratch(i, 0);
-	
     uslCompletion.target    = (void *)this;
     uslCompletion.action    = (IOUSBCompletionAction) &IOUSBController::InterruptPacketHandler;
     uslCompletion.parameter = (void *)command;
@@ -2460,6 +3118,350 @@ IOUSBController::PolledRead(short					functionNumber,
 
 
 
+#pragma mark Polled Endpoints
+//================================================================================================
+//
+//   Polled Endpoints
+//
+//   PolledRead is used by the keyboard and serial consoles of the debugger, when interrupts and the
+//   workloop may not be available and taking a lock or allocating memory can hang the machine. An
+//   endpoint registered with RegisterPolledEndpoint owns a command and a DMA ready buffer, and the
+//   UIM sets aside the TDs for its reads (UIMReservePolledTDs), so a polled read only fills in the
+//   command and hands it to the UIM, and the completion copies the data to the caller and calls it
+//   directly. The slots are only changed through the command gate, and a registered slot is never
+//   moved, so PolledRead can look at them without a lock.
+//
+//================================================================================================
+//
+IOReturn
+IOUSBController::RegisterPolledEndpoint(USBDeviceAddress address, UInt8 endpoint, UInt32 maxBufferSize)
+{
+	IOUSBPolledEndpoint		polled;
+	IODMACommand			*dmaCommand;
+	IOReturn				err;
+	
+	if (!_expansionData || !_commandGate || !_freeUSBCommandPool)
+		return kIOReturnNotReady;
+	
+	if ((address == 0) || (maxBufferSize == 0))
+		return kIOReturnBadArgument;
+	
+	bzero(&polled, sizeof(polled));
+	polled.address = address;
+	polled.endpoint = endpoint;
+	polled.bufferSize = maxBufferSize;
+	
+	do
+	{
+		// contiguous and below 4GB, so that any UIM can move it in one piece
+		polled.buffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIODirectionIn | kIOMemoryPhysicallyContiguous, maxBufferSize, 0x00000000FFFFF000ULL);
+		if (!polled.buffer)
+		{
+			err = kIOReturnNoMemory;
+			break;
+		}
+		
+		polled.command = (IOUSBCommand *)_freeUSBCommandPool->getCommand(false);
+		if (!polled.command)
+		{
+			IncreaseCommandPool();
+			polled.command = (IOUSBCommand *)_freeUSBCommandPool->getCommand(false);
+		}
+		if (!polled.command)
+		{
+			err = kIOReturnNoResources;
+			break;
+		}
+		
+		dmaCommand = polled.command->GetDMACommand();
+		if (!dmaCommand)
+		{
+			err = kIOReturnNoResources;
+			break;
+		}
+		if (dmaCommand->getMemoryDescriptor())
+			dmaCommand->clearMemoryDescriptor();
+		
+		// this prepares the buffer, once, for as long as the endpoint is registered
+		err = dmaCommand->setMemoryDescriptor(polled.buffer);
+		if (err)
+			break;
+		
+		err = _commandGate->runAction(GatedSetPolledEndpoint, &polled, (void *)true);
+	} while (false);
+	
+	if (err)
+	{
+		USBLog(2, "%s[%p]::RegisterPolledEndpoint(%d:%d) - failed (0x%x)", getName(), this, address, endpoint, err);
+		FreePolledEndpoint(&polled);
+		return err;
+	}
+	
+	USBLog(5, "%s[%p]::RegisterPolledEndpoint(%d:%d) - %d bytes set aside", getName(), this, address, endpoint, (uint32_t)maxBufferSize);
+	return kIOReturnSuccess;
+}
+
+
+
+IOReturn
+IOUSBController::UnregisterPolledEndpoint(USBDeviceAddress address, UInt8 endpoint)
+{
+	IOUSBPolledEndpoint		polled;
+	IOReturn				err;
+	
+	if (!_expansionData || !_commandGate)
+		return kIOReturnNotReady;
+	
+	bzero(&polled, sizeof(polled));
+	polled.address = address;
+	polled.endpoint = endpoint;
+	
+	err = _commandGate->runAction(GatedSetPolledEndpoint, &polled, (void *)false);
+	if (err == kIOReturnSuccess)
+		FreePolledEndpoint(&polled);
+	
+	return err;
+}
+
+
+
+IOReturn
+IOUSBController::GatedSetPolledEndpoint(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+#pragma unused (arg2, arg3)
+	IOUSBController			*me = (IOUSBController *)target;
+	IOUSBControllerV3		*v3Controller = OSDynamicCast(IOUSBControllerV3, me);
+	IOUSBPolledEndpoint		*polled = (IOUSBPolledEndpoint *)arg0;
+	bool					add = (arg1 != NULL);
+	IOUSBPolledEndpoint		*slot;
+	IOReturn				err;
+	int						i;
+	
+	if (!me->_polledEndpoints)
+	{
+		if (!add)
+			return kIOReturnNotFound;
+		
+		me->_polledEndpoints = (IOUSBPolledEndpoint *)IOMalloc(kUSBMaxPolledEndpoints * sizeof(IOUSBPolledEndpoint));
+		if (!me->_polledEndpoints)
+			return kIOReturnNoMemory;
+		bzero(me->_polledEndpoints, kUSBMaxPolledEndpoints * sizeof(IOUSBPolledEndpoint));
+	}
+	
+	slot = me->FindPolledEndpoint(polled->address, polled->endpoint);
+	if (!add)
+	{
+		if (!slot)
+			return kIOReturnNotFound;
+		
+		// the caller has to abort the pipe before the buffer can go away
+		if (slot->busy)
+			return kIOReturnBusy;
+		
+		*polled = *slot;
+		slot->address = 0;
+		slot->command = NULL;
+		slot->buffer = NULL;
+		
+		// the endpoint may have been closed, and its TDs given back with it, already
+		if (v3Controller)
+			v3Controller->UIMReservePolledTDs(polled->address, polled->endpoint, polled->bufferSize, false);
+		return kIOReturnSuccess;
+	}
+	
+	if (slot)
+		return kIOReturnExclusiveAccess;
+	
+	for (i = 0; i < kUSBMaxPolledEndpoints; i++)
+	{
+		slot = &me->_polledEndpoints[i];
+		if (slot->address == 0)
+		{
+			// without TDs of its own a polled read could still make the UIM grow its free list
+			err = v3Controller ? v3Controller->UIMReservePolledTDs(polled->address, polled->endpoint, polled->bufferSize, true) : kIOReturnUnsupported;
+			if (err)
+			{
+				USBLog(2, "%s[%p]::GatedSetPolledEndpoint(%d:%d) - UIM could not reserve TDs (0x%x)", me->getName(), me, polled->address, polled->endpoint, err);
+				return err;
+			}
+			
+			slot->endpoint = polled->endpoint;
+			slot->busy = false;
+			slot->bufferSize = polled->bufferSize;
+			slot->command = polled->command;
+			slot->buffer = polled->buffer;
+			slot->clientBuffer = NULL;
+			slot->address = polled->address;			// last, the slot is live once it has an address
+			return kIOReturnSuccess;
+		}
+	}
+	
+	return kIOReturnNoResources;
+}
+
+
+
+IOUSBPolledEndpoint *
+IOUSBController::FindPolledEndpoint(USBDeviceAddress address, UInt8 endpoint)
+{
+	int			i;
+	
+	if (!_expansionData || !_polledEndpoints || (address == 0))
+		return NULL;
+	
+	for (i = 0; i < kUSBMaxPolledEndpoints; i++)
+	{
+		if ((_polledEndpoints[i].address == address) && (_polledEndpoints[i].endpoint == endpoint))
+			return &_polledEndpoints[i];
+	}
+	
+	return NULL;
+}
+
+
+
+void
+IOUSBController::FreePolledEndpoint(IOUSBPolledEndpoint *polled)
+{
+	if (polled->command)
+	{
+		IODMACommand	*dmaCommand = polled->command->GetDMACommand();
+		
+		if (dmaCommand && dmaCommand->getMemoryDescriptor())
+			dmaCommand->clearMemoryDescriptor();
+		if (_freeUSBCommandPool)
+			_freeUSBCommandPool->returnCommand(polled->command);
+		polled->command = NULL;
+	}
+	if (polled->buffer)
+	{
+		polled->buffer->release();
+		polled->buffer = NULL;
+	}
+	polled->address = 0;
+}
+
+
+
+IOReturn
+IOUSBController::PolledReadReserved(IOUSBPolledEndpoint *polled, IOUSBCompletion clientCompletion, IOMemoryDescriptor *CBP, bool bufferRounding, UInt32 bufferSize)
+{
+	IOUSBCommand		*command = polled->command;
+	IOUSBCompletion		uslCompletion;
+	IOUSBCompletion		nullCompletion;
+	UInt32				length = polled->bufferSize;
+	IOReturn			err;
+	
+	if (polled->busy)
+		return kIOReturnBusy;
+	
+	if (bufferSize && (bufferSize < length))
+		length = bufferSize;
+	if (CBP && (CBP->getLength() < length))
+		length = (UInt32)CBP->getLength();
+	
+	polled->busy = true;
+	polled->clientBuffer = CBP;
+	
+	nullCompletion.target = NULL;
+	nullCompletion.action = NULL;
+	nullCompletion.parameter = NULL;
+	
+	uslCompletion.target    = (void *)this;
+	uslCompletion.action    = (IOUSBCompletionAction) &IOUSBController::PolledPacketHandler;
+	uslCompletion.parameter = (void *)command;
+	
+	// the command never goes back through the pool between reads, so clear the request, stream ID and UIM scratch fields the
+	// last read left behind, the way gatedReturnCommand would have
+	command->NewGeneration();
+	command->SetIsSyncTransfer(false);
+	command->SetUseTimeStamp(true);
+	command->SetSelector(READ);
+	command->SetAddress(polled->address);
+	command->SetEndpoint(polled->endpoint);
+	command->SetDirection(kUSBIn);
+	command->SetType(kUSBInterrupt);
+	command->SetBuffer(polled->buffer);
+	command->SetReqCount(length);
+	command->SetClientCompletion(clientCompletion);
+	command->SetDisjointCompletion(nullCompletion);
+	command->SetBufferRounding(bufferRounding);
+	command->SetNoDataTimeout(0);
+	command->SetCompletionTimeout(0);
+	command->SetStatus(kIOReturnSuccess);
+	command->SetUSLCompletion(uslCompletion);
+	
+	err = UIMCreateInterruptTransfer(command);
+	if (err)
+	{
+		polled->clientBuffer = NULL;
+		polled->busy = false;
+	}
+	
+	return err;
+}
+
+
+
+void
+IOUSBController::PolledPacketHandler(OSObject *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining)
+{
+	IOUSBController			*me = (IOUSBController *)target;
+	IOUSBCommand			*command = (IOUSBCommand *)parameter;
+	IOUSBPolledEndpoint		*polled = NULL;
+	IOMemoryDescriptor		*clientBuffer;
+	IOUSBCompletion			completion;
+	UInt32					requested;
+	UInt32					actual = 0;
+	int						i;
+	
+	if (!me || !command || !me->_expansionData || !me->_polledEndpoints)
+		return;
+	
+	for (i = 0; i < kUSBMaxPolledEndpoints; i++)
+	{
+		if (me->_polledEndpoints[i].address && (me->_polledEndpoints[i].command == command))
+		{
+			polled = &me->_polledEndpoints[i];
+			break;
+		}
+	}
+	if (!polled)
+	{
+		USBError(1, "%s[%p]::PolledPacketHandler - command %p does not belong to a polled endpoint", me->getName(), me, command);
+		return;
+	}
+	
+	if (status == kIOUSBTransactionReturned)
+		status = kIOReturnAborted;
+	command->SetStatus(status);
+	
+	requested = (UInt32)command->GetReqCount();
+	if (bufferSizeRemaining < requested)
+		actual = requested - bufferSizeRemaining;
+	
+	clientBuffer = polled->clientBuffer;
+	if (clientBuffer)
+	{
+		if (actual)
+			clientBuffer->writeBytes(0, polled->buffer->getBytesNoCopy(), actual);
+		
+		// the caller measures what is left against its own buffer, not ours
+		bufferSizeRemaining = (UInt32)clientBuffer->getLength() - actual;
+	}
+	
+	completion = command->GetClientCompletion();
+	
+	// free the endpoint before calling the client, which usually queues the next read from its completion
+	polled->clientBuffer = NULL;
+	polled->busy = false;
+	
+	if (completion.action)
+		(*(IOUSBCompletionActionWithTimeStamp)completion.action)(completion.target, completion.parameter, status, bufferSizeRemaining, command->GetTimeStamp());
+}
+
+
+
 IOReturn 
 IOUSBController::message( UInt32 type, IOService * provider,  void * argument )
 {
@@ -2518,6 +3520,30 @@ IOUSBController::stop( IOService * provider )
     //
     UIMFinalize();
 	
+	// deliver whatever the completion thread still has before the clients go away
+	StopCompletionThread();
+	
+	// give back what the polled endpoints set aside, while we still have a command pool to give it to
+	if (_polledEndpoints)
+	{
+		for (i = 0; i < kUSBMaxPolledEndpoints; i++)
+		{
+			if (_polledEndpoints[i].address)
+				FreePolledEndpoint(&_polledEndpoints[i]);
+		}
+	}
+	
+	if (_acpiPublishNotifier)
+	{
+		_acpiPublishNotifier->remove();
+		_acpiPublishNotifier = NULL;
+	}
+	if (_acpiTerminateNotifier)
+	{
+		_acpiTerminateNotifier->remove();
+		_acpiTerminateNotifier = NULL;
+	}
+	
     // Indicate that this busID is no longer used
     //
     gUsedBusIDs[_busNumber] = false;
@@ -2572,136 +3598,779 @@ IOUSBController::stop( IOService * provider )
 		}
     }
 	
-    if ( _freeUSBCommandPool )
-    {
-        _freeUSBCommandPool->release();
-        _freeUSBCommandPool = NULL;
-    }
-    
-    if ( _freeUSBIsocCommandPool )
-    {
-        _freeUSBIsocCommandPool->release();
-        _freeUSBIsocCommandPool = NULL;
-    }
-    
-	if ( _workLoop && _commandGate)
-		_workLoop->removeEventSource( _commandGate );
+    if ( _freeUSBCommandPool )
+    {
+        _freeUSBCommandPool->release();
+        _freeUSBCommandPool = NULL;
+    }
+    
+    if ( _freeUSBIsocCommandPool )
+    {
+        _freeUSBIsocCommandPool->release();
+        _freeUSBIsocCommandPool = NULL;
+    }
+    
+	if ( _workLoop && _commandGate)
+		_workLoop->removeEventSource( _commandGate );
+	
+	USBLog(5,"-%s[%p]::stop (%p)", getName(), this, provider);
+    
+}
+
+
+
+bool 
+IOUSBController::finalize(IOOptionBits options)
+{
+	bool	ret;
+	
+    ret = super::finalize(options);
+
+	USBLog(5, "IOUSBController(%s)[%p]::finalize - _rootHubDevice(%p) isOpen(%s)", getName(), this, _rootHubDevice, _provider->isOpen(this) ? "true" : "false");
+
+	if ( _rootHubDevice )
+    {
+        _rootHubDevice->detachFromParent(getRegistryRoot(), gIOUSBPlane);
+        _rootHubDevice->release();
+        _rootHubDevice = NULL;	    
+    }
+	
+#ifdef SUPPORTS_SS_USB
+	if ( _rootHubDeviceSS )
+    {
+        _rootHubDeviceSS->detachFromParent(getRegistryRoot(), gIOUSBPlane);
+        _rootHubDeviceSS->release();
+        _rootHubDeviceSS = NULL;	    
+    }
+#endif
+	
+	if (_provider->isOpen(this))
+	{
+        _provider->close(this);
+    }
+	
+	return ret;
+}
+
+
+
+void
+IOUSBController::IncreaseCommandPool(void)
+{
+	IOUSBControllerV2*		me2 = OSDynamicCast(IOUSBControllerV2, this);
+    int i;
+	
+    USBLog(3,"%s[%p]::IncreaseCommandPool Adding (%d) to Command Pool", getName(), this, kSizeToIncrementCommandPool);
+	
+    for (i = 0; i < kSizeToIncrementCommandPool; i++)
+    {
+        IOUSBCommand *command = IOUSBCommand::NewCommand();
+        if (command)
+		{
+			if (me2)
+				command->SetDMACommand(me2->GetNewDMACommand());
+			_freeUSBCommandPool->returnCommand(command);
+		}
+    }
+    _currentSizeOfCommandPool += kSizeToIncrementCommandPool;
+	
+}
+
+
+
+void
+IOUSBController::IncreaseIsocCommandPool(void)
+{
+	IOUSBControllerV2*		me2 = OSDynamicCast(IOUSBControllerV2, this);
+    int i;
+	
+    USBLog(3,"%s[%p]::IncreaseIsocCommandPool Adding (%d) to Isoc Command Pool", getName(), this, kSizeToIncrementIsocCommandPool);
+    
+    for (i = 0; i < kSizeToIncrementIsocCommandPool; i++)
+    {
+        IOUSBIsocCommand *icommand = IOUSBIsocCommand::NewCommand();
+        if (icommand)
+		{
+			if (me2)
+				icommand->SetDMACommand(me2->GetNewDMACommand());
+			_freeUSBIsocCommandPool->returnCommand(icommand);
+		}
+    }
+    _currentSizeOfIsocCommandPool += kSizeToIncrementIsocCommandPool;
+}
+
+
+
+void
+IOUSBController::Complete(IOUSBCompletion	completion,
+                          IOReturn		status,
+                          UInt32		actualByteCount)
+{
+    if (completion.action)  
+	{
+		USBTrace( kUSBTController, kTPCompletionCall, (uintptr_t)this, (uintptr_t)(completion.action), status, 2 );
+		(*completion.action)(completion.target,
+                                                 completion.parameter,
+                                                 status,
+                                                 actualByteCount);
+	}
+}
+
+
+void
+IOUSBController::CompleteWithTimeStamp(IOUSBCompletionWithTimeStamp	completion,
+                                       IOReturn		status,
+                                       UInt32		actualByteCount,
+                                       AbsoluteTime	timeStamp)
+{
+    if (completion.action)  
+	{
+		USBTrace( kUSBTController, kTPCompletionCall, (uintptr_t)this, (uintptr_t)(completion.action), status, 3 );
+		(*completion.action)(completion.target, completion.parameter, status, actualByteCount, timeStamp);
+	}
+}
+
+
+
+#pragma mark Completion Batching
+//================================================================================================
+//
+//   Completion batching
+//
+//   A UIM brackets each pass over its finished transfers with BeginCompletionBatch/EndCompletionBatch. The
+//   packet handlers then park their commands and client completions in _completionBatch instead of handing
+//   them out one at a time, and the end of the pass returns the commands to the pool with a single call and
+//   runs the completions - one call per target for actions registered with RegisterBatchCompletion.
+//   Everything here runs on the workloop thread, so the batch needs no lock of its own.
+//
+//   The batch actions themselves run on a separate completion thread (its own IOWorkLoop), so that the time
+//   they take is not spent on the workloop. Submission is not affected: every transfer, including one queued
+//   from a batch action, still goes through the command gate. Each pass hands its batch action calls over in
+//   one slot of a ring allocated with the thread, so a flush never allocates. When all kUSBCompletionHandoffSlots
+//   slots are still waiting for the thread, the pass calls its batch actions on the workloop instead. The ring
+//   indices are protected by completionLock. Lock ordering:
+//
+//		workloop gate  ->  completionLock
+//
+//   completionLock is a leaf - it is never held while calling out, and the workloop never waits for the
+//   completion thread. The completion thread holds no lock while it calls a batch action, so the action
+//   may take the command gate (to queue its next transfer, for instance).
+//
+//================================================================================================
+//
+void
+IOUSBController::BeginCompletionBatch(void)
+{
+	if (!_expansionData || !_completionBatch || !_workLoop || !_workLoop->onThread())
+		return;
+	
+	if (_completionBatch->depth++ == 0)
+		_completionBatch->passStartTime = mach_absolute_time();
+}
+
+
+
+void
+IOUSBController::EndCompletionBatch(void)
+{
+	if (!_expansionData || !_completionBatch || !_workLoop || !_workLoop->onThread() || (_completionBatch->depth == 0))
+		return;
+	
+	if (--_completionBatch->depth == 0)
+	{
+		uint64_t	elapsed;
+		
+		FlushCompletionBatch();
+		
+		elapsed = mach_absolute_time() - _completionBatch->passStartTime;
+		absolutetime_to_nanoseconds(*(AbsoluteTime *)&elapsed, &elapsed);
+		_completionBatch->workLoopBusyNS += elapsed;
+	}
+}
+
+
+
+bool
+IOUSBController::CanBatchCompletion(void)
+{
+	// a completion which runs from inside a flush (or anywhere other than the workloop) goes out right away
+	return (_expansionData && _completionBatch && _completionBatch->depth && !_completionBatch->flushing && _workLoop && _workLoop->onThread());
+}
+
+
+
+void
+IOUSBController::ReturnCompletedCommand(IOUSBCommand *command)
+{
+	if (CanBatchCompletion() && (_completionBatch->commandCount < (kUSBCompletionBatchMax * 2)))
+	{
+		_completionBatch->commands[_completionBatch->commandCount++] = command;
+		return;
+	}
+	
+	_freeUSBCommandPool->returnCommand(command);
+}
+
+
+
+void
+IOUSBController::CompleteClient(IOUSBCompletion completion, IOReturn status, UInt32 bufferSizeRemaining)
+{
+	IOUSBCompletionBatchEntry	*entry;
+	
+	if (!completion.action)
+		return;
+	
+	if (!CanBatchCompletion())
+	{
+		Complete(completion, status, bufferSizeRemaining);
+		return;
+	}
+	
+	if (_completionBatch->entryCount == kUSBCompletionBatchMax)
+		FlushCompletionBatch();
+	
+	entry = &_completionBatch->entries[_completionBatch->entryCount++];
+	entry->completion = completion;
+	entry->status = status;
+	entry->bufferSizeRemaining = bufferSizeRemaining;
+	entry->useTimeStamp = false;
+	entry->dispatched = false;
+}
+
+
+
+void
+IOUSBController::CompleteClientWithTimeStamp(IOUSBCompletionWithTimeStamp completion, IOReturn status, UInt32 bufferSizeRemaining, AbsoluteTime timeStamp)
+{
+	IOUSBCompletionBatchEntry	*entry;
+	
+	if (!completion.action)
+		return;
+	
+	if (!CanBatchCompletion())
+	{
+		CompleteWithTimeStamp(completion, status, bufferSizeRemaining, timeStamp);
+		return;
+	}
+	
+	if (_completionBatch->entryCount == kUSBCompletionBatchMax)
+		FlushCompletionBatch();
+	
+	entry = &_completionBatch->entries[_completionBatch->entryCount++];
+	entry->completion.target = completion.target;
+	entry->completion.parameter = completion.parameter;
+	entry->completion.action = (IOUSBCompletionAction)completion.action;
+	entry->status = status;
+	entry->bufferSizeRemaining = bufferSizeRemaining;
+	entry->timeStamp = timeStamp;
+	entry->useTimeStamp = true;
+	entry->dispatched = false;
+}
+
+
+
+void
+IOUSBController::FlushCompletionBatch(void)
+{
+	IOUSBCompletionBatch	*batch = _completionBatch;
+	IOUSBCompletionHandoff	*handoff = NULL;
+	IOUSBCommandPool		*pool;
+	UInt32					count;
+	UInt32					slot;
+	bool					needHandoff = false;
+	UInt32					i, j, k;
+	
+	if (!batch || batch->flushing)
+		return;
+	
+	batch->flushing = true;
+	
+	// the commands go back first, as they did before, so that a client which queues its next transfer from the completion finds them
+	if (batch->commandCount)
+	{
+		pool = OSDynamicCast(IOUSBCommandPool, _freeUSBCommandPool);
+		if (pool)
+			pool->returnCommands(batch->commands, batch->commandCount);
+		else
+		{
+			for (i = 0; i < batch->commandCount; i++)
+				_freeUSBCommandPool->returnCommand(batch->commands[i]);
+		}
+		batch->commandCount = 0;
+	}
+	
+	count = batch->entryCount;
+	
+	// a slot for the batch action calls of this pass, which the completion thread will make
+	if (batch->completionSource && batch->handoffSlots && batch->clientCount)
+	{
+		for (i = 0; (i < count) && !needHandoff; i++)
+		{
+			if (batch->entries[i].useTimeStamp)
+				continue;
+			for (k = 0; k < batch->clientCount; k++)
+				if (batch->clients[k].action == batch->entries[i].completion.action)
+				{
+					needHandoff = true;
+					break;
+				}
+		}
+		if (needHandoff)
+		{
+			// if the thread is that far behind, the batch actions are called right here instead
+			IOLockLock(batch->completionLock);
+			if (IOUSBHandoffRingReserve(&batch->handoffRing, &slot))
+				handoff = &batch->handoffSlots[slot];
+			else
+				batch->handoffsRingFull++;
+			IOLockUnlock(batch->completionLock);
+			if (handoff)
+			{
+				handoff->groupCount = 0;
+				handoff->resultCount = 0;
+			}
+		}
+	}
+	
+	for (i = 0; i < count; i++)
+	{
+		IOUSBCompletionBatchEntry	*entry = &batch->entries[i];
+		IOUSBBatchCompletionAction	batchAction = NULL;
+		
+		if (entry->dispatched)
+			continue;
+		
+		if (!entry->useTimeStamp)
+		{
+			for (k = 0; k < batch->clientCount; k++)
+				if (batch->clients[k].action == entry->completion.action)
+				{
+					batchAction = batch->clients[k].batchAction;
+					break;
+				}
+		}
+		
+		if (batchAction)
+		{
+			IOUSBBatchCompletionResult	*resultArray = handoff ? &handoff->results[handoff->resultCount] : batch->results;
+			UInt32						results = 0;
+			
+			// everything for this target in the batch, in the order it finished
+			for (j = i; j < count; j++)
+			{
+				IOUSBCompletionBatchEntry	*other = &batch->entries[j];
+				
+				if (other->dispatched || other->useTimeStamp || (other->completion.action != entry->completion.action) || (other->completion.target != entry->completion.target))
+					continue;
+				
+				resultArray[results].parameter = other->completion.parameter;
+				resultArray[results].status = other->status;
+				resultArray[results].bufferSizeRemaining = other->bufferSizeRemaining;
+				results++;
+				other->dispatched = true;
+			}
+			
+			batch->batchCalls++;
+			batch->batchCallResults += results;
+			if (handoff)
+			{
+				IOUSBCompletionHandoffGroup		*group = &handoff->groups[handoff->groupCount++];
+				
+				group->batchAction = batchAction;
+				group->target = entry->completion.target;
+				group->first = handoff->resultCount;
+				group->count = results;
+				handoff->resultCount += results;
+			}
+			else
+			{
+				USBTrace( kUSBTController, kTPCompletionCall, (uintptr_t)this, (uintptr_t)batchAction, results, 4 );
+				(*batchAction)(entry->completion.target, batch->results, results);
+			}
+		}
+		else if (entry->useTimeStamp)
+		{
+			IOUSBCompletionWithTimeStamp	completionWithTimeStamp;
+			
+			completionWithTimeStamp.target = entry->completion.target;
+			completionWithTimeStamp.parameter = entry->completion.parameter;
+			completionWithTimeStamp.action = (IOUSBCompletionActionWithTimeStamp)entry->completion.action;
+			entry->dispatched = true;
+			CompleteWithTimeStamp(completionWithTimeStamp, entry->status, entry->bufferSizeRemaining, entry->timeStamp);
+		}
+		else
+		{
+			entry->dispatched = true;
+			Complete(entry->completion, entry->status, entry->bufferSizeRemaining);
+		}
+	}
+	batch->entryCount = 0;
+	
+	if (handoff)
+		QueueCompletionHandoff();
+	
+	if (count)
+	{
+		batch->passes++;
+		batch->completions += count;
+		if (count > batch->maxBatch)
+			batch->maxBatch = count;
+		batch->changed = true;
+	}
+	
+	batch->flushing = false;
+}
+
+
+
+IOReturn
+IOUSBController::RegisterBatchCompletion(IOUSBCompletionAction action, IOUSBBatchCompletionAction batchAction)
+{
+	if (!action || !batchAction)
+		return kIOReturnBadArgument;
+	
+	if (!_expansionData || !_completionBatch || !_commandGate)
+		return kIOReturnNotReady;
+	
+	return _commandGate->runAction(GatedRegisterBatchCompletion, (void*)action, (void*)batchAction);
+}
+
+
+
+IOReturn
+IOUSBController::UnregisterBatchCompletion(IOUSBCompletionAction action)
+{
+	IOReturn	err;
+	
+	if (!action)
+		return kIOReturnBadArgument;
+	
+	if (!_expansionData || !_completionBatch || !_commandGate)
+		return kIOReturnNotReady;
+	
+	err = _commandGate->runAction(GatedRegisterBatchCompletion, (void*)action, NULL);
+	
+	// the completion thread may still have calls to the old batch action
+	if (err == kIOReturnSuccess)
+		WaitForCompletionThread();
+	
+	return err;
+}
+
+
+
+IOReturn
+IOUSBController::GatedRegisterBatchCompletion(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+#pragma unused (arg2, arg3)
+	IOUSBController				*me = (IOUSBController *)target;
+	IOUSBCompletionBatch		*batch = me->_completionBatch;
+	IOUSBCompletionAction		action = (IOUSBCompletionAction)arg0;
+	IOUSBBatchCompletionAction	batchAction = (IOUSBBatchCompletionAction)arg1;
+	UInt32						i;
+	
+	for (i = 0; i < batch->clientCount; i++)
+		if (batch->clients[i].action == action)
+			break;
+	
+	if (!batchAction)
+	{
+		// unregister - completions already in a batch will go to action
+		if (i == batch->clientCount)
+			return kIOReturnNotFound;
+		batch->clients[i] = batch->clients[--batch->clientCount];
+		USBLog(5, "%s[%p]::UnregisterBatchCompletion - action %p", me->getName(), me, action);
+		return kIOReturnSuccess;
+	}
+	
+	// once the controller is going away, StopCompletionThread may already have run, and a new thread would never be stopped
+	if (batch->completionStopped || me->isInactive())
+	{
+		USBLog(2, "%s[%p]::RegisterBatchCompletion - controller is terminating, not registering action %p", me->getName(), me, action);
+		return kIOReturnNotReady;
+	}
+	
+	if (i == batch->clientCount)
+	{
+		if (batch->clientCount == kUSBCompletionBatchMaxClients)
+		{
+			USBLog(2, "%s[%p]::RegisterBatchCompletion - no room for action %p", me->getName(), me, action);
+			return kIOReturnNoResources;
+		}
+		batch->clientCount++;
+	}
+	
+	// without a completion thread the batch actions are called on the workloop, which still works
+	if (!me->StartCompletionThread())
+	{
+		USBLog(1, "%s[%p]::RegisterBatchCompletion - could not start the completion thread", me->getName(), me);
+	}
+	batch->clients[i].action = action;
+	batch->clients[i].batchAction = batchAction;
+	USBLog(5, "%s[%p]::RegisterBatchCompletion - action %p batchAction %p", me->getName(), me, action, batchAction);
+	
+	return kIOReturnSuccess;
+}
+
+
+
+bool
+IOUSBController::StartCompletionThread(void)
+{
+	IOUSBCompletionBatch	*batch = _completionBatch;
+	IOWorkLoop				*workLoop;
+	IOInterruptEventSource	*source;
+	
+	if (batch->completionWorkLoop)
+		return true;
+	
+	if (!batch->handoffSlots)
+	{
+		batch->handoffSlots = (IOUSBCompletionHandoff *)IOMalloc(kUSBCompletionHandoffSlots * sizeof(IOUSBCompletionHandoff));
+		if (!batch->handoffSlots)
+			return false;
+		IOLockLock(batch->completionLock);
+		IOUSBHandoffRingInit(&batch->handoffRing, kUSBCompletionHandoffSlots);
+		IOLockUnlock(batch->completionLock);
+	}
+	
+	workLoop = IOWorkLoop::workLoop();
+	if (!workLoop)
+		return false;
+	
+	source = IOInterruptEventSource::interruptEventSource(this, CompletionThreadAction);
+	if (!source)
+	{
+		workLoop->release();
+		return false;
+	}
+	
+	if (workLoop->addEventSource(source) != kIOReturnSuccess)
+	{
+		source->release();
+		workLoop->release();
+		return false;
+	}
+	
+	batch->completionWorkLoop = workLoop;
+	batch->completionSource = source;
+	USBLog(5, "%s[%p]::StartCompletionThread - completion workloop %p", getName(), this, workLoop);
 	
-	USBLog(5,"-%s[%p]::stop (%p)", getName(), this, provider);
-    
+	return true;
 }
 
 
 
-bool 
-IOUSBController::finalize(IOOptionBits options)
+void
+IOUSBController::StopCompletionThread(void)
 {
-	bool	ret;
+	IOWorkLoop				*workLoop = NULL;
+	IOInterruptEventSource	*source = NULL;
 	
-    ret = super::finalize(options);
+	if (!_expansionData || !_completionBatch)
+		return;
+	
+	// FlushCompletionBatch uses the source inside the gate, so it is taken away from the batch there too. From free() the gate
+	// is already gone, and so is anything which could flush.
+	if (_commandGate)
+		_commandGate->runAction(GatedStopCompletionThread, &workLoop, &source);
+	else
+		GatedStopCompletionThread(this, &workLoop, &source, NULL, NULL);
+	
+	if (!workLoop)
+		return;
+	
+	// removeEventSource waits for the action to finish if it is running right now. That has to happen outside of the gate, since
+	// a batch action may be waiting for the gate itself.
+	source->disable();
+	workLoop->removeEventSource(source);
+	source->release();
+	
+	// anything the thread had not gotten to yet is delivered from here
+	DispatchCompletionHandoffs();
+	
+	workLoop->release();
+}
 
-	USBLog(5, "IOUSBController(%s)[%p]::finalize - _rootHubDevice(%p) isOpen(%s)", getName(), this, _rootHubDevice, _provider->isOpen(this) ? "true" : "false");
 
-	if ( _rootHubDevice )
-    {
-        _rootHubDevice->detachFromParent(getRegistryRoot(), gIOUSBPlane);
-        _rootHubDevice->release();
-        _rootHubDevice = NULL;	    
-    }
+
+IOReturn
+IOUSBController::GatedStopCompletionThread(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3)
+{
+#pragma unused (arg2, arg3)
+	IOUSBController			*me = (IOUSBController *)target;
+	IOUSBCompletionBatch	*batch = me->_completionBatch;
 	
-#ifdef SUPPORTS_SS_USB
-	if ( _rootHubDeviceSS )
-    {
-        _rootHubDeviceSS->detachFromParent(getRegistryRoot(), gIOUSBPlane);
-        _rootHubDeviceSS->release();
-        _rootHubDeviceSS = NULL;	    
-    }
-#endif
+	batch->completionStopped = true;
 	
-	if (_provider->isOpen(this))
-	{
-        _provider->close(this);
-    }
+	*(IOWorkLoop **)arg0 = batch->completionWorkLoop;
+	*(IOInterruptEventSource **)arg1 = batch->completionSource;
+	batch->completionWorkLoop = NULL;
+	batch->completionSource = NULL;
 	
-	return ret;
+	return kIOReturnSuccess;
 }
 
 
 
+// publishes the slot FlushCompletionBatch reserved and filled in
 void
-IOUSBController::IncreaseCommandPool(void)
+IOUSBController::QueueCompletionHandoff(void)
 {
-	IOUSBControllerV2*		me2 = OSDynamicCast(IOUSBControllerV2, this);
-    int i;
-	
-    USBLog(3,"%s[%p]::IncreaseCommandPool Adding (%d) to Command Pool", getName(), this, kSizeToIncrementCommandPool);
+	IOUSBCompletionBatch	*batch = _completionBatch;
 	
-    for (i = 0; i < kSizeToIncrementCommandPool; i++)
-    {
-        IOUSBCommand *command = IOUSBCommand::NewCommand();
-        if (command)
-		{
-			if (me2)
-				command->SetDMACommand(me2->GetNewDMACommand());
-			_freeUSBCommandPool->returnCommand(command);
-		}
-    }
-    _currentSizeOfCommandPool += kSizeToIncrementCommandPool;
+	IOLockLock(batch->completionLock);
+	IOUSBHandoffRingPublish(&batch->handoffRing);
+	batch->handoffCount++;
+	if (IOUSBHandoffRingPending(&batch->handoffRing) > batch->maxPendingHandoffs)
+		batch->maxPendingHandoffs = IOUSBHandoffRingPending(&batch->handoffRing);
+	IOLockUnlock(batch->completionLock);
 	
+	batch->completionSource->interruptOccurred(NULL, NULL, 0);
 }
 
 
 
 void
-IOUSBController::IncreaseIsocCommandPool(void)
+IOUSBController::CompletionThreadAction(OSObject *owner, IOInterruptEventSource *source, int count)
 {
-	IOUSBControllerV2*		me2 = OSDynamicCast(IOUSBControllerV2, this);
-    int i;
+#pragma unused (source, count)
+	IOUSBController		*me = OSDynamicCast(IOUSBController, owner);
 	
-    USBLog(3,"%s[%p]::IncreaseIsocCommandPool Adding (%d) to Isoc Command Pool", getName(), this, kSizeToIncrementIsocCommandPool);
-    
-    for (i = 0; i < kSizeToIncrementIsocCommandPool; i++)
-    {
-        IOUSBIsocCommand *icommand = IOUSBIsocCommand::NewCommand();
-        if (icommand)
+	if (me)
+		me->DispatchCompletionHandoffs();
+}
+
+
+
+void
+IOUSBController::DispatchCompletionHandoffs(void)
+{
+	IOUSBCompletionBatch	*batch = _completionBatch;
+	IOUSBCompletionHandoff	*handoff;
+	uint64_t				start = mach_absolute_time();
+	uint64_t				elapsed;
+	UInt32					slot;
+	UInt32					i;
+	
+	IOLockLock(batch->completionLock);
+	batch->completionThreadBusy = true;
+	while (IOUSBHandoffRingFirst(&batch->handoffRing, &slot))
+	{
+		handoff = &batch->handoffSlots[slot];
+		IOLockUnlock(batch->completionLock);
+		
+		for (i = 0; i < handoff->groupCount; i++)
 		{
-			if (me2)
-				icommand->SetDMACommand(me2->GetNewDMACommand());
-			_freeUSBIsocCommandPool->returnCommand(icommand);
+			IOUSBCompletionHandoffGroup		*group = &handoff->groups[i];
+			
+			USBTrace( kUSBTController, kTPCompletionCall, (uintptr_t)this, (uintptr_t)group->batchAction, group->count, 5 );
+			(*group->batchAction)(group->target, &handoff->results[group->first], group->count);
 		}
-    }
-    _currentSizeOfIsocCommandPool += kSizeToIncrementIsocCommandPool;
+		
+		// the workloop may fill the slot in again as soon as it is released
+		IOLockLock(batch->completionLock);
+		IOUSBHandoffRingRelease(&batch->handoffRing);
+	}
+	batch->completionThreadBusy = false;
+	
+	elapsed = mach_absolute_time() - start;
+	absolutetime_to_nanoseconds(*(AbsoluteTime *)&elapsed, &elapsed);
+	batch->completionThreadBusyNS += elapsed;
+	
+	if (batch->completionThreadWaiters)
+	{
+		batch->completionThreadWaiters = false;
+		IOLockWakeup(batch->completionLock, &batch->handoffRing, false);
+	}
+	IOLockUnlock(batch->completionLock);
 }
 
 
 
 void
-IOUSBController::Complete(IOUSBCompletion	completion,
-                          IOReturn		status,
-                          UInt32		actualByteCount)
+IOUSBController::WaitForCompletionThread(void)
 {
-    if (completion.action)  
+	IOUSBCompletionBatch	*batch = _completionBatch;
+	IOWorkLoop				*completionWorkLoop = batch->completionWorkLoop;		// StopCompletionThread may clear it
+	
+	// the workloop can't wait (the completion thread may be waiting for the gate), and the completion thread would wait for itself
+	if (!completionWorkLoop || (_workLoop && _workLoop->onThread()) || completionWorkLoop->onThread())
+		return;
+	
+	IOLockLock(batch->completionLock);
+	while (IOUSBHandoffRingPending(&batch->handoffRing) || batch->completionThreadBusy)
 	{
-		USBTrace( kUSBTController, kTPCompletionCall, (uintptr_t)this, (uintptr_t)(completion.action), status, 2 );
-		(*completion.action)(completion.target,
-                                                 completion.parameter,
-                                                 status,
-                                                 actualByteCount);
+		batch->completionThreadWaiters = true;
+		IOLockSleep(batch->completionLock, &batch->handoffRing, THREAD_UNINT);
 	}
+	IOLockUnlock(batch->completionLock);
 }
 
 
+
 void
-IOUSBController::CompleteWithTimeStamp(IOUSBCompletionWithTimeStamp	completion,
-                                       IOReturn		status,
-                                       UInt32		actualByteCount,
-                                       AbsoluteTime	timeStamp)
+IOUSBController::PublishCompletionBatchStatistics(void)
 {
-    if (completion.action)  
+	IOUSBCompletionBatch	*batch = _completionBatch;
+	OSDictionary			*dict;
+	OSNumber				*num;
+	uint64_t				now = mach_absolute_time();
+	uint64_t				intervalNS;
+	uint64_t				workLoopBusyNS, completionThreadBusyNS;
+	UInt64					values[13];
+	const char *			names[13] = {"Passes", "Completions", "AverageBatch", "MaxBatch", "BatchCalls", "BatchCallCompletions",
+										 "Handoffs", "MaxPendingHandoffs", "WorkLoopBusyUS", "CompletionThreadBusyUS",
+										 "WorkLoopUtilization", "CompletionThreadUtilization", "HandoffsRingFull"};
+	int						i;
+	
+	intervalNS = now - batch->lastPublishTime;
+	absolutetime_to_nanoseconds(*(AbsoluteTime *)&intervalNS, &intervalNS);
+	batch->lastPublishTime = now;
+	
+	IOLockLock(batch->completionLock);
+	completionThreadBusyNS = batch->completionThreadBusyNS;
+	values[6] = batch->handoffCount;
+	values[7] = batch->maxPendingHandoffs;
+	values[12] = batch->handoffsRingFull;
+	IOLockUnlock(batch->completionLock);
+	workLoopBusyNS = batch->workLoopBusyNS;
+	
+	batch->changed = false;
+	values[0] = batch->passes;
+	values[1] = batch->completions;
+	values[2] = batch->passes ? (batch->completions / batch->passes) : 0;
+	values[3] = batch->maxBatch;
+	values[4] = batch->batchCalls;
+	values[5] = batch->batchCallResults;
+	values[8] = workLoopBusyNS / 1000;
+	values[9] = completionThreadBusyNS / 1000;
+	
+	// percent of the time since the last publish each thread spent on completions
+	values[10] = intervalNS ? (((workLoopBusyNS - batch->lastWorkLoopBusyNS) * 100) / intervalNS) : 0;
+	values[11] = intervalNS ? (((completionThreadBusyNS - batch->lastCompletionThreadBusyNS) * 100) / intervalNS) : 0;
+	batch->lastWorkLoopBusyNS = workLoopBusyNS;
+	batch->lastCompletionThreadBusyNS = completionThreadBusyNS;
+	
+	// publish once more after the controller goes idle, so that the utilization drops back to zero
+	batch->reportedBusy = (values[10] || values[11]);
+	
+	dict = OSDictionary::withCapacity(13);
+	if (!dict)
+		return;
+	
+	for (i=0; i < 13; i++)
 	{
-		USBTrace( kUSBTController, kTPCompletionCall, (uintptr_t)this, (uintptr_t)(completion.action), status, 3 );
-		(*completion.action)(completion.target, completion.parameter, status, actualByteCount, timeStamp);
+		num = OSNumber::withNumber(values[i], 64);
+		if (num)
+		{
+			dict->setObject(names[i], num);
+			num->release();
+		}
 	}
+	setProperty("CompletionBatchStatistics", dict);
+	dict->release();
 }
 
 
@@ -2895,7 +4564,6 @@ IOUSBController::DeviceRequest(IOUSBDevRequest *request, IOUSBCompletion *comple
 	IOUSBCommand			*bufferCommand = NULL;		// this is a command to get the DMACommand for the buffer
     IOReturn				err = kIOReturnSuccess; 
     IOUSBCompletion			nullCompletion;
-	int						i;
 	IOMemoryDescriptor		*bufferMemoryDescriptor = NULL;
     IOMemoryDescriptor		*requestMemoryDescriptor = NULL;
     UInt8					direction = (request->bmRequestType >> kUSBRqDirnShift) & kUSBRqDirnMask;
@@ -3087,7 +4755,6 @@ IOUSBController::DeviceRequest(IOUSBDevRequest *request, IOUSBCompletion *comple
 			isSyncTransfer = true;
 		
 		command->SetIsSyncTransfer(isSyncTransfer);
-		command->SetUseTimeStamp(false);
 		if (bufferCommand)
 			command->SetSelector(DEVICE_REQUEST_BUFFERCOMMAND);
 		else
@@ -3095,9 +4762,6 @@ IOUSBController::DeviceRequest(IOUSBDevRequest *request, IOUSBCompletion *comple
 		command->SetRequest(request);
 		command->SetAddress(address);
 		command->SetEndpoint(ep);
-#ifdef SUPPORTS_SS_USB
-    	command->SetStreamID(0);
-#endif
 		command->SetDirection(kUSBAnyDirn);
 		command->SetType(kUSBControl);
 		command->SetBuffer(0);											// no buffer for device requests
@@ -3110,14 +4774,8 @@ IOUSBController::DeviceRequest(IOUSBDevRequest *request, IOUSBCompletion *comple
 		nullCompletion.action = (IOUSBCompletionAction) NULL;
 		nullCompletion.parameter = (void *) NULL;
 		command->SetUSLCompletion(nullCompletion);
-		command->SetDisjointCompletion(nullCompletion);
-		command->SetMultiTransferTransaction(false);				// these will get set correctly in IOUSBCommand::ControlRequest
-		command->SetFinalTransferInTransaction(false);				// these will get set correctly in IOUSBCommand::ControlRequest
 		
-		for (i=0; i < 10; i++)
-			command->SetUIMScratch(i, 0);
-		
-		err = GetCommandGate()->runAction(DoControlTransfer, command);
+		err = RunTransfer(DoControlTransfer, command);
 	} while (false);
 
 	
@@ -3234,7 +4892,6 @@ IOUSBController::DeviceRequest(IOUSBDevRequestDesc *request, IOUSBCompletion *co
     IOUSBCompletion			nullCompletion;
 	IODMACommand			*dmaCommand = NULL;
 	UInt16					reqLength = request->wLength;
-	int						i;
 	bool					isSyncTransfer = false;
 	
 	USBLog(7,"%s[%p]::DeviceRequestDesc [%x,%x],[%x,%x],[%x,%p]",getName(),this, 
@@ -3385,7 +5042,6 @@ IOUSBController::DeviceRequest(IOUSBDevRequestDesc *request, IOUSBCompletion *co
 		
 		command->SetIsSyncTransfer(isSyncTransfer);
 		
-		command->SetUseTimeStamp(false);
 		
 		if (bufferCommand)
 		{
@@ -3416,9 +5072,6 @@ IOUSBController::DeviceRequest(IOUSBDevRequestDesc *request, IOUSBCompletion *co
 		command->SetRequest((IOUSBDevRequest *)request);
 		command->SetAddress(address);
 		command->SetEndpoint(ep);
-#ifdef SUPPORTS_SS_USB
-    	command->SetStreamID(0);
-#endif
 		command->SetDirection(kUSBAnyDirn);
 		command->SetType(kUSBControl);
 		command->SetClientCompletion(*completion);
@@ -3431,14 +5084,8 @@ IOUSBController::DeviceRequest(IOUSBDevRequestDesc *request, IOUSBCompletion *co
 		nullCompletion.action = (IOUSBCompletionAction) NULL;
 		nullCompletion.parameter = (void *) NULL;
 		command->SetUSLCompletion(nullCompletion);
-		command->SetDisjointCompletion(nullCompletion);
-		command->SetMultiTransferTransaction(false);				// these will get set correctly in IOUSBCommand::ControlRequest
-		command->SetFinalTransferInTransaction(false);				// these will get set correctly in IOUSBCommand::ControlRequest
 		
-		for (i=0; i < 10; i++)
-			command->SetUIMScratch(i, 0);
-		
-		err = GetCommandGate()->runAction(DoControlTransfer, command);
+		err = RunTransfer(DoControlTransfer, command);
 
 	} while (false);
 	
@@ -3557,6 +5204,60 @@ IOUSBController::free()
     //
     if (_expansionData)
     {
+		for (int i = 0; i < kUSBMaxDevices; i++)
+		{
+			if (_transferStatistics[i])
+			{
+				_transferStatistics[i]->release();
+				_transferStatistics[i] = NULL;
+			}
+		}
+		if (_polledEndpoints)
+		{
+			IOFree(_polledEndpoints, kUSBMaxPolledEndpoints * sizeof(IOUSBPolledEndpoint));
+			_polledEndpoints = NULL;
+		}
+		if (_addressLock)
+		{
+			IOSimpleLockFree(_addressLock);
+			_addressLock = NULL;
+		}
+		if (_descriptorCache)
+		{
+			IOUSBDescriptorCacheFlush<IOUSBDescriptorCacheOps>(_descriptorCache);
+			IOFree(_descriptorCache, sizeof(IOUSBDescriptorCache));
+			_descriptorCache = NULL;
+		}
+		if (_descriptorCacheLock)
+		{
+			IOLockFree(_descriptorCacheLock);
+			_descriptorCacheLock = NULL;
+		}
+		if (_syncWaitLock)
+		{
+			IOLockFree(_syncWaitLock);
+			_syncWaitLock = NULL;
+		}
+		if (_acpiPortTable)
+		{
+			_acpiPortTable->release();
+			_acpiPortTable = NULL;
+		}
+		if (_acpiPortTableLock)
+		{
+			IOLockFree(_acpiPortTableLock);
+			_acpiPortTableLock = NULL;
+		}
+		if (_completionBatch)
+		{
+			StopCompletionThread();
+			if (_completionBatch->completionLock)
+				IOLockFree(_completionBatch->completionLock);
+			if (_completionBatch->handoffSlots)
+				IOFree(_completionBatch->handoffSlots, kUSBCompletionHandoffSlots * sizeof(IOUSBCompletionHandoff));
+			IOFree(_completionBatch, sizeof(IOUSBCompletionBatch));
+			_completionBatch = NULL;
+		}
 		IOFree(_expansionData, sizeof(ExpansionData));
 		_expansionData = NULL;
     }
@@ -4484,9 +6185,15 @@ bool
 IOUSBController::IsPortMuxed(IORegistryEntry * provider, UInt32 portnum, UInt32 locationID, char *muxName)
 {
     IOACPIPlatformDevice *	acpiDevice;
+	IOUSBACPIPortEntry		portEntry;
+	bool					hasUPC;
 	bool					isMuxed = false;
 	
-	acpiDevice = CopyACPIDevice( provider );
+	// a port without a _UPC object in the port table can't be one of the muxed ports
+	if (FindACPIPortEntry(provider, portnum, locationID, kUSBACPIPortHasUPC, &portEntry, &hasUPC) && !hasUPC)
+		acpiDevice = NULL;
+	else
+		acpiDevice = CopyACPIDevice( provider );
 	if (acpiDevice)
 	{
 		isMuxed = CheckACPIUPCTableForMuxedMethods( acpiDevice, portnum, locationID, muxName );	
@@ -4504,14 +6211,23 @@ bool
 IOUSBController::GetInternalHubErrataBits(IORegistryEntry * provider, UInt32 portnum, UInt32 locationID, UInt32 *errataBits)
 {
     IOACPIPlatformDevice *	acpiDevice;
+	IOUSBACPIPortEntry		portEntry;
 	bool					found = false;
 	
-	acpiDevice = CopyACPIDevice( provider );
-	if (acpiDevice)
+	if (FindACPIPortEntry(provider, portnum, locationID, kUSBACPIPortHasHERB, &portEntry, &found))
 	{
-		found = CheckACPIUPCTableForInternalHubErrataBits( acpiDevice, portnum, locationID, errataBits );	
-		acpiDevice->release();
-		acpiDevice = NULL;
+		if (found)
+			*errataBits = portEntry.hubErrata;
+	}
+	else
+	{
+		acpiDevice = CopyACPIDevice( provider );
+		if (acpiDevice)
+		{
+			found = CheckACPIUPCTableForInternalHubErrataBits( acpiDevice, portnum, locationID, errataBits );	
+			acpiDevice->release();
+			acpiDevice = NULL;
+		}
 	}
 	
     USBLog(5, "IOUSBController(%s)[%p]::GetInternalHubErrataBits(%s) - provider(%p) portNum(%d) locationID(0x%x)", getName(), this, found?"true":"false", provider, (int)portnum, (int)locationID);
@@ -4535,10 +6251,14 @@ bool
 IOUSBController::IsPortInternal( IORegistryEntry * provider, UInt32 portnum, UInt32 locationID )
 {
 	IOACPIPlatformDevice *	acpiDevice;
+	IOUSBACPIPortEntry		portEntry;
 	bool					isInternal = false;
 	
 	USBLog(5, "IOUSBController(%s)[%p]::IsPortInternal - provider(%p) portNum(%d) locationID(0x%x)", getName(), this, provider, (int)portnum, (int)locationID);
 	
+	if (FindACPIPortEntry(provider, portnum, locationID, kUSBACPIPortInternal, &portEntry, &isInternal))
+		return isInternal;
+	
 	acpiDevice = CopyACPIDevice( provider );
 	if (acpiDevice)
 	{
@@ -4551,6 +6271,185 @@ IOUSBController::IsPortInternal( IORegistryEntry * provider, UInt32 portnum, UIn
 }
 
 
+//================================================================================================
+//
+//	BuildACPIPortTable
+//
+//	Walks the ACPI plane below the controller once and records every port object which has a _UPC or
+//	HERB method, so that the hubs' questions about their ports don't each walk the ACPI tree and
+//	evaluate its methods again. Called with _acpiPortTableLock held. The table stays valid until an
+//	ACPI object is published or terminated (see ACPIRegistryChanged).
+//
+//================================================================================================
+//
+bool
+IOUSBController::BuildACPIPortTable( IORegistryEntry * provider )
+{
+	IOACPIPlatformDevice *	acpiDevice;
+	const IORegistryPlane *	acpiPlane = NULL;
+	IORegistryIterator *	iter = NULL;
+	IORegistryEntry *		entry;
+	OSData *				table;
+	
+	table = OSData::withCapacity(8 * sizeof(IOUSBACPIPortEntry));
+	if (!table)
+		return false;
+	
+	acpiDevice = CopyACPIDevice( provider );
+	if (acpiDevice)
+	{
+		acpiPlane = acpiDevice->getPlane( "IOACPIPlane" );
+		if (acpiPlane)
+			iter = IORegistryIterator::iterateOver(acpiDevice, acpiPlane, kIORegistryIterateRecursively);
+	}
+	
+	if (iter)
+	{
+		while ((entry = iter->getNextObject()))
+		{
+			IOACPIPlatformDevice *	port;
+			IOUSBACPIPortEntry		portEntry;
+			OSObject *				theObject;
+			const char *			location;
+			
+			// USB port must be an IOACPIPlatformDevice.
+			if (!entry->metaCast("IOACPIPlatformDevice"))
+				continue;
+			
+			port = (IOACPIPlatformDevice *) entry;
+			bzero(&portEntry, sizeof(portEntry));
+			
+			if ((port->validateObject("_UPC") == kIOReturnSuccess) && (port->evaluateObject("_UPC", &theObject) == kIOReturnSuccess))
+			{
+				OSArray *	upcData = OSDynamicCast(OSArray, theObject);
+				
+				if (upcData)
+				{
+					OSNumber *	connectable = OSDynamicCast(OSNumber, upcData->getObject(0));
+					OSNumber *	connector = OSDynamicCast(OSNumber, upcData->getObject(1));		// 1 for connector look up
+					
+					IOUSBACPIPortEntrySetUPC(&portEntry, connectable != NULL, connectable ? connectable->unsigned8BitValue() : 0, connector != NULL, connector ? connector->unsigned8BitValue() : 0);
+				}
+				theObject->release();
+			}
+			
+			if ((port->validateObject("HERB") == kIOReturnSuccess) && (port->evaluateObject("HERB", &theObject) == kIOReturnSuccess))
+			{
+				OSNumber *	hubErrataBitObject = OSDynamicCast(OSNumber, theObject);
+				
+				if (hubErrataBitObject)
+					IOUSBACPIPortEntrySetHERB(&portEntry, hubErrataBitObject->unsigned32BitValue());
+				theObject->release();
+			}
+			
+			if (!portEntry.flags)
+				continue;
+			
+			location = entry->getLocation(acpiPlane);
+			portEntry.port = location ? strtoul(location, NULL, 10) : 0;
+			portEntry.acpiDepth = entry->getDepth(acpiPlane);
+			table->appendBytes(&portEntry, sizeof(portEntry));
+			
+			USBLog(6, "IOUSBController[%p]::BuildACPIPortTable - %s port %d acpiDepth %d flags 0x%x connector %d HERB 0x%x", this, entry->getName(acpiPlane), (int)portEntry.port, portEntry.acpiDepth, portEntry.flags, portEntry.connectorType, (uint32_t)portEntry.hubErrata);
+		}
+		iter->release();
+	}
+	
+	if (acpiDevice)
+		acpiDevice->release();
+	
+	if (_acpiPortTable)
+		_acpiPortTable->release();
+	_acpiPortTable = table;
+	_acpiPortTableProvider = provider;
+	_acpiPortTableValid = true;
+	
+	USBLog(5, "IOUSBController(%s)[%p]::BuildACPIPortTable - %d ACPI port objects", getName(), this, (int)(table->getLength() / sizeof(IOUSBACPIPortEntry)));
+	
+	return true;
+}
+
+
+
+//================================================================================================
+//
+//	FindACPIPortEntry
+//
+//	Looks up port portnum of the hub at locationID in the ACPI port table, building the table first if
+//	need be. Only entries which have all of flags set are considered, and the first one in ACPI order
+//	wins, as it did when each question walked the tree. Returns false if the table could not be built,
+//	in which case the caller walks the ACPI tree itself. *found says whether there was an entry.
+//
+//================================================================================================
+//
+bool
+IOUSBController::FindACPIPortEntry( IORegistryEntry * provider, UInt32 portnum, UInt32 locationID, UInt8 flags, IOUSBACPIPortEntry * portEntry, bool * found )
+{
+	const IOUSBACPIPortEntry *	entry;
+	int							hubPortACPIDepth;
+	
+	*found = false;
+	
+	if (!_expansionData || !_acpiPortTableLock)
+		return false;
+	
+	// the depth in the ACPI table of the ports of a hub at this USB depth
+	hubPortACPIDepth = calculateACPIDepth(calculateUSBDepth(locationID));
+	
+	IOLockLock(_acpiPortTableLock);
+	if (!_acpiPortTableValid || (_acpiPortTableProvider != provider))
+	{
+		if (!BuildACPIPortTable(provider))
+		{
+			IOLockUnlock(_acpiPortTableLock);
+			return false;
+		}
+	}
+	
+	entry = IOUSBACPIPortTableFind((const IOUSBACPIPortEntry *)_acpiPortTable->getBytesNoCopy(), _acpiPortTable->getLength() / sizeof(IOUSBACPIPortEntry), portnum, hubPortACPIDepth, flags);
+	if (entry)
+	{
+		*portEntry = *entry;
+		*found = true;
+	}
+	IOLockUnlock(_acpiPortTableLock);
+	
+	return true;
+}
+
+
+
+//================================================================================================
+//
+//	ACPIRegistryChanged
+//
+//	Matching notification for IOACPIPlatformDevice objects being published or terminated. The ACPI port
+//	table is thrown away and rebuilt on the next lookup.
+//
+//================================================================================================
+//
+bool
+IOUSBController::ACPIRegistryChanged( void * target, void * refCon, IOService * newService, IONotifier * notifier )
+{
+#pragma unused (refCon, newService, notifier)
+	IOUSBController *	me = (IOUSBController *)target;
+	
+	if (me && me->_expansionData && me->_acpiPortTableLock)
+	{
+		IOLockLock(me->_acpiPortTableLock);
+		if (me->_acpiPortTableValid)
+		{
+			USBLog(5, "IOUSBController(%s)[%p]::ACPIRegistryChanged - dropping the ACPI port table", me->getName(), me);
+		}
+		me->_acpiPortTableValid = false;
+		IOLockUnlock(me->_acpiPortTableLock);
+	}
+	
+	return true;
+}
+
+
+
 //================================================================================================
 //
 //	bool	CheckACPIUPCTable
@@ -240,7 +240,6 @@ IOUSBControllerV2::ClearTT(USBDeviceAddress fnAddress, UInt8 endpt, Boolean IN)
     short						hubAddress;
     IOUSBCommand				*clearCommand = NULL;
     IOUSBCompletion				completion;
-    int							i;
     IOReturn					err = kIOReturnSuccess;
 	IODMACommand				*dmaCommand = NULL;
 	
@@ -386,7 +385,6 @@ IOUSBControllerV2::ClearTT(USBDeviceAddress fnAddress, UInt8 endpt, Boolean IN)
 		completion.parameter = clearCommand;
 		clearCommand->SetUSLCompletion(completion);
 		
-		clearCommand->SetUseTimeStamp(false);
 		clearCommand->SetSelector(DEVICE_REQUEST);
 		clearCommand->SetRequest(clearRequest);
 		clearCommand->SetAddress(hubAddress);
@@ -396,13 +394,7 @@ IOUSBControllerV2::ClearTT(USBDeviceAddress fnAddress, UInt8 endpt, Boolean IN)
 		clearCommand->SetClientCompletion(completion);
 		clearCommand->SetNoDataTimeout(5000);
 		clearCommand->SetCompletionTimeout(0);
-		clearCommand->SetStage(0);
 		clearCommand->SetBufferUSBCommand(NULL);
-		clearCommand->SetMultiTransferTransaction(false);
-		clearCommand->SetFinalTransferInTransaction(false);
-		
-		for (i=0; i < 10; i++)
-			clearCommand->SetUIMScratch(i, 0);
 		
 		err = ControlTransaction(clearCommand);					// Wait for completion? Or just fire and forget?
 		
@@ -892,7 +884,6 @@ IOUSBControllerV2::ReadV2(IOMemoryDescriptor *buffer, USBDeviceAddress address,
     IOUSBCompletion			nullCompletion;
     IOUSBCompletion			theCompletion;
 	IODMACommand			*dmaCommand = NULL;
-    int						i;
 	bool					isSyncTransfer = false;
 	
     USBLog(7, "%s[%p]::ReadV2 - reqCount = %d", getName(), this, (uint32_t)reqCount);
@@ -991,12 +982,8 @@ IOUSBControllerV2::ReadV2(IOMemoryDescriptor *buffer, USBDeviceAddress address,
 	
     command->SetUseTimeStamp(true);
     command->SetSelector(READ);
-    command->SetRequest(0);            	// Not a device request
     command->SetAddress(address);
     command->SetEndpoint(endpoint->number);
-#ifdef SUPPORTS_SS_USB
-    command->SetStreamID(0);
-#endif
     command->SetDirection(kUSBIn);
     command->SetType(endpoint->transferType);
     command->SetBuffer(buffer);
@@ -1004,21 +991,12 @@ IOUSBControllerV2::ReadV2(IOMemoryDescriptor *buffer, USBDeviceAddress address,
     command->SetClientCompletion(theCompletion);
     command->SetNoDataTimeout(noDataTimeout);
     command->SetCompletionTimeout(completionTimeout);
- 	command->SetMultiTransferTransaction(false);
-	command->SetFinalTransferInTransaction(false);
-	for (i=0; i < 10; i++)
-        command->SetUIMScratch(i, 0);
-	
-    nullCompletion.target = (void *) NULL;
-    nullCompletion.action = (IOUSBCompletionAction) NULL;
-    nullCompletion.parameter = (void *) NULL;
-    command->SetDisjointCompletion(nullCompletion);
 	
     err = CheckForDisjointDescriptor(command, endpoint->maxPacketSize);
     if (kIOReturnSuccess == err)
 	{
 		
-        err = _commandGate->runAction(DoIOTransfer, command);
+        err = RunTransfer(DoIOTransfer, command);
 		
 		// If we have a sync request, then we always return the command after the DoIOTransfer.  If it's an async request, we only return it if 
 		// we get an immediate error
@@ -1496,7 +1474,6 @@ IOUSBControllerV2::ReadStream(UInt32 streamID, IOMemoryDescriptor *buffer, USBDe
     IOUSBCommand *		command = NULL;
 	IODMACommand *		dmaCommand = NULL;
     IOUSBCompletion 	nullCompletion;
-    int					i;
 	bool				isSyncTransfer = false;
     
     USBLog(7, "%s[%p]::Read - reqCount = %qd", getName(), this, (uint64_t)reqCount);
@@ -1594,9 +1571,7 @@ IOUSBControllerV2::ReadStream(UInt32 streamID, IOMemoryDescriptor *buffer, USBDe
 	{
         
 		command->SetIsSyncTransfer(isSyncTransfer);
-		command->SetUseTimeStamp(false);
 		command->SetSelector(READ);
-		command->SetRequest(0);            	// Not a device request
 		command->SetAddress(address);
 		command->SetEndpoint(endpoint->number);
 		command->SetDirection(kUSBIn);
@@ -1606,21 +1581,12 @@ IOUSBControllerV2::ReadStream(UInt32 streamID, IOMemoryDescriptor *buffer, USBDe
 		command->SetClientCompletion(*completion);
 		command->SetNoDataTimeout(noDataTimeout);
 		command->SetCompletionTimeout(completionTimeout);
-		command->SetMultiTransferTransaction(false);
-		command->SetFinalTransferInTransaction(false);
         command->SetStreamID(streamID);
-		for (i=0; i < 10; i++)
-			command->SetUIMScratch(i, 0);
-		
-		nullCompletion.target = (void *) NULL;
-		nullCompletion.action = (IOUSBCompletionAction) NULL;
-		nullCompletion.parameter = (void *) NULL;
-		command->SetDisjointCompletion(nullCompletion);
 		
 		err = CheckForDisjointDescriptor(command, endpoint->maxPacketSize);
 		if (!err)
 		{			
-			err = _commandGate->runAction(DoIOTransfer, command);
+			err = RunTransfer(DoIOTransfer, command);
 		}
 	}
     
@@ -1662,7 +1628,6 @@ IOUSBControllerV2::WriteStream(UInt32 streamID, IOMemoryDescriptor *buffer, USBD
     IOUSBCommand *			command = NULL;
 	IODMACommand *			dmaCommand = NULL;
     IOUSBCompletion			nullCompletion;
-    int						i;
 	bool					isSyncTransfer = false;
 	
     USBLog(7, "%s[%p]::Write - reqCount = %qd", getName(), this, (uint64_t)reqCount);
@@ -1752,9 +1717,7 @@ IOUSBControllerV2::WriteStream(UInt32 streamID, IOMemoryDescriptor *buffer, USBD
 	if (!err)
 	{
 		command->SetIsSyncTransfer(isSyncTransfer);
-		command->SetUseTimeStamp(false);
 		command->SetSelector(WRITE);
-		command->SetRequest(0);            // Not a device request
 		command->SetAddress(address);
 		command->SetEndpoint(endpoint->number);
 		command->SetDirection(kUSBOut);
@@ -1764,21 +1727,12 @@ IOUSBControllerV2::WriteStream(UInt32 streamID, IOMemoryDescriptor *buffer, USBD
 		command->SetClientCompletion(*completion);
 		command->SetNoDataTimeout(noDataTimeout); 
 		command->SetCompletionTimeout(completionTimeout);
-		command->SetMultiTransferTransaction(false);
-		command->SetFinalTransferInTransaction(false);
 		command->SetStreamID(streamID);
-		for (i=0; i < 10; i++)
-			command->SetUIMScratch(i, 0);
-		
-		nullCompletion.target = (void *) NULL;
-		nullCompletion.action = (IOUSBCompletionAction) NULL;
-		nullCompletion.parameter = (void *) NULL;
-		command->SetDisjointCompletion(nullCompletion);
 		
 		err = CheckForDisjointDescriptor(command, endpoint->maxPacketSize);
 		if (!err)
 		{			
-			err = _commandGate->runAction(DoIOTransfer, command);
+			err = RunTransfer(DoIOTransfer, command);
 		}
 	}
 	
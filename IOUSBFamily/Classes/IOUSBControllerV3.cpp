@@ -72,6 +72,7 @@ uint32_t *				IOUSBControllerV3::_gHibernateState;
 #define	_onThunderbolt					_v3ExpansionData->_onThunderbolt
 #define	_thunderboltModelID				_v3ExpansionData->_thunderboltModelID
 #define	_thunderboltVendorID			_v3ExpansionData->_thunderboltVendorID
+#define	_rootHubPolling					_v3ExpansionData->_rootHubPolling
 #ifdef SUPPORTS_SS_USB
 	#define	_rootHubNumPortsSS				_v3ExpansionData->_rootHubNumPortsSS
 	#define	_rootHubNumPortsHS				_v3ExpansionData->_rootHubNumPortsHS
@@ -1353,10 +1354,10 @@ IOUSBControllerV3::EnsureUsability(void)
 
 
 // static method
+// sender is NULL when we are called from RootHubPortChangeInterrupt rather than from the timer
 void 
 IOUSBControllerV3::RootHubTimerFired(OSObject *owner, IOTimerEventSource *sender)
 {
-#pragma unused (sender)
     IOUSBControllerV3		*me;
     
     me = OSDynamicCast(IOUSBControllerV3, owner);
@@ -1364,6 +1365,9 @@ IOUSBControllerV3::RootHubTimerFired(OSObject *owner, IOTimerEventSource *sender
     if (!me || me->isInactive() || !me->_controllerAvailable)
         return;
 	
+	if (sender)
+		IOUSBRootHubPollingTimerFired(&me->_rootHubPolling);
+	
 	if (me->_rootHubDevice && me->_rootHubDevice->GetPolicyMaker())
 	{
 		USBLog(7, "IOUSBControllerV3(%s)[%p]::RootHubTimerFired - PolicyMaker[%p] powerState[%d] _powerStateChangingTo[%d]", me->getName(), me, me->_rootHubDevice->GetPolicyMaker(), (int)me->_rootHubDevice->GetPolicyMaker()->getPowerState(),(int)me->_powerStateChangingTo);
@@ -1397,9 +1401,75 @@ IOUSBControllerV3::RootHubTimerFired(OSObject *owner, IOTimerEventSource *sender
 	USBTrace( kUSBTController, kTPControllerRootHubTimer, (uintptr_t)me, (uintptr_t)me->_rootHubDevice->GetPolicyMaker(), (uintptr_t)me->_rootHubDevice->GetPolicyMaker()->getPowerState(), 4 );
 	me->CheckForRootHubChanges();
 	
+	// backs off if the UIM tells us about port changes and this found nothing
+	IOUSBRootHubPollingNext(&me->_rootHubPolling, me->_rootHubPollingRate32, (sender != NULL), (me->_rootHubStatusChangedBitmap != 0));
+	
 	// fire it up again
     if (me->_rootHubPollingRate32 && !me->isInactive() && me->_controllerAvailable)
-		me->_rootHubTimer->setTimeoutMS(me->_rootHubPollingRate32);
+		me->_rootHubTimer->setTimeoutMS(me->_rootHubPolling.intervalMS);
+}
+
+
+
+//================================================================================================
+//
+//   RootHubPortChangeInterrupt
+//
+//   Called by a UIM on the workloop when its controller interrupts for a root hub port change. The change is looked for right
+//   away instead of at the next timer tick, and the timer goes back to the full polling rate.
+//
+//================================================================================================
+//
+void
+IOUSBControllerV3::RootHubPortChangeInterrupt(void)
+{
+	uint32_t	interval = _rootHubPolling.intervalMS;
+	
+	// nobody is listening to the root hub yet (or any more), so there is nothing to check
+	if (!IOUSBRootHubPollingPortChange(&_rootHubPolling, _rootHubPollingRate32) || !_rootHubTimer)
+		return;
+	
+	USBLog(6, "IOUSBControllerV3(%s)[%p]::RootHubPortChangeInterrupt - checking for root hub changes (interval was %d ms)", getName(), this, interval);
+	_rootHubTimer->cancelTimeout();
+	RootHubTimerFired(this, NULL);
+}
+
+
+
+void
+IOUSBControllerV3::PublishRootHubPollingStatistics(void)
+{
+	OSDictionary			*dict;
+	OSNumber				*num;
+	UInt64					values[4];
+	const char *			names[4] = {"TimerWakeups", "TimerWakeupsAvoided", "PortChangeInterrupts", "PollingIntervalMS"};
+	int						i;
+	
+	// called from the watchdog timer every second - only publish when something changed
+	if (!_v3ExpansionData || !_rootHubPolling.statisticsChanged)
+		return;
+	
+	_rootHubPolling.statisticsChanged = false;
+	values[0] = _rootHubPolling.timerWakeups;
+	values[1] = _rootHubPolling.timerWakeupsAvoided;
+	values[2] = _rootHubPolling.portChangeEvents;
+	values[3] = _rootHubPolling.intervalMS;
+	
+	dict = OSDictionary::withCapacity(4);
+	if (!dict)
+		return;
+	
+	for (i=0; i < 4; i++)
+	{
+		num = OSNumber::withNumber(values[i], 64);
+		if (num)
+		{
+			dict->setObject(names[i], num);
+			num->release();
+		}
+	}
+	setProperty("RootHubPollingStatistics", dict);
+	dict->release();
 }
 
 void 
@@ -1696,12 +1766,13 @@ IOUSBControllerV3::RootHubStartTimer32(uint32_t pollingRate)
 		return kIOReturnBadArgument;
 	}
 	_rootHubPollingRate32 = pollingRate;
+	IOUSBRootHubPollingStart(&_rootHubPolling, pollingRate);
 	
 	if (_rootHubTimer)
 	{
 		USBLog(6, "IOUSBControllerV3(%s)[%p]::RootHubStartTimer32", getName(), this);
 		
-		_rootHubTimer->setTimeoutMS(_rootHubPollingRate32);
+		_rootHubTimer->setTimeoutMS(_rootHubPolling.intervalMS);
 	}
 	else
 	{
@@ -2650,6 +2721,16 @@ IOUSBControllerV3::GetBandwidthAvailableForDevice(IOUSBDevice *forDevice,  UInt3
 
 #endif
 
+
+
+IOReturn
+IOUSBControllerV3::UIMReservePolledTDs(short functionNumber, short endpointNumber, UInt32 maxBufferSize, bool reserve)
+{
+#pragma unused (functionNumber, endpointNumber, maxBufferSize, reserve)
+	
+	return kIOReturnUnsupported;			// the UIM takes every TD from its free list
+}
+
 OSMetaClassDefineReservedUsed(IOUSBControllerV3,  0);
 OSMetaClassDefineReservedUsed(IOUSBControllerV3,  1);
 
@@ -2693,7 +2774,7 @@ OSMetaClassDefineReservedUnused(IOUSBControllerV3,  18);
 OSMetaClassDefineReservedUnused(IOUSBControllerV3,  19);
 #endif
 
-OSMetaClassDefineReservedUnused(IOUSBControllerV3,  20);
+OSMetaClassDefineReservedUsed(IOUSBControllerV3,  20);
 OSMetaClassDefineReservedUnused(IOUSBControllerV3,  21);
 OSMetaClassDefineReservedUnused(IOUSBControllerV3,  22);
 OSMetaClassDefineReservedUnused(IOUSBControllerV3,  23);
@@ -325,7 +325,6 @@ IOUSBController::Read(IOMemoryDescriptor *buffer, USBDeviceAddress address, Endp
     IOUSBCommand *		command = NULL;
 	IODMACommand *		dmaCommand = NULL;
     IOUSBCompletion 	nullCompletion;
-    int					i;
 	bool				isSyncTransfer = false;
 
     USBLog(7, "%s[%p]::Read - reqCount = %qd", getName(), this, (uint64_t)reqCount);
@@ -423,14 +422,9 @@ IOUSBController::Read(IOMemoryDescriptor *buffer, USBDeviceAddress address, Endp
 	{
 
 		command->SetIsSyncTransfer(isSyncTransfer);
-		command->SetUseTimeStamp(false);
 		command->SetSelector(READ);
-		command->SetRequest(0);            	// Not a device request
 		command->SetAddress(address);
 		command->SetEndpoint(endpoint->number);
-#ifdef SUPPORTS_SS_USB
-    	command->SetStreamID(0);
-#endif
 		command->SetDirection(kUSBIn);
 		command->SetType(endpoint->transferType);
 		command->SetBuffer(buffer);
@@ -438,20 +432,11 @@ IOUSBController::Read(IOMemoryDescriptor *buffer, USBDeviceAddress address, Endp
 		command->SetClientCompletion(*completion);
 		command->SetNoDataTimeout(noDataTimeout);
 		command->SetCompletionTimeout(completionTimeout);
-		command->SetMultiTransferTransaction(false);
-		command->SetFinalTransferInTransaction(false);
-		for (i=0; i < 10; i++)
-			command->SetUIMScratch(i, 0);
-		
-		nullCompletion.target = (void *) NULL;
-		nullCompletion.action = (IOUSBCompletionAction) NULL;
-		nullCompletion.parameter = (void *) NULL;
-		command->SetDisjointCompletion(nullCompletion);
 		
 		err = CheckForDisjointDescriptor(command, endpoint->maxPacketSize);
 		if (!err)
 		{			
-			err = _commandGate->runAction(DoIOTransfer, command);
+			err = RunTransfer(DoIOTransfer, command);
 		}
 	}
 
@@ -520,7 +505,6 @@ IOUSBController::Write(IOMemoryDescriptor *buffer, USBDeviceAddress address, End
     IOUSBCommand *			command = NULL;
 	IODMACommand *			dmaCommand = NULL;
     IOUSBCompletion			nullCompletion;
-    int						i;
 	bool					isSyncTransfer = false;
 	
     USBLog(7, "%s[%p]::Write - reqCount = %qd", getName(), this, (uint64_t)reqCount);
@@ -610,14 +594,9 @@ IOUSBController::Write(IOMemoryDescriptor *buffer, USBDeviceAddress address, End
 	if (!err)
 	{
 		command->SetIsSyncTransfer(isSyncTransfer);
-		command->SetUseTimeStamp(false);
 		command->SetSelector(WRITE);
-		command->SetRequest(0);            // Not a device request
 		command->SetAddress(address);
 		command->SetEndpoint(endpoint->number);
-#ifdef SUPPORTS_SS_USB
-    	command->SetStreamID(0);
-#endif
 		command->SetDirection(kUSBOut);
 		command->SetType(endpoint->transferType);
 		command->SetBuffer(buffer);
@@ -625,20 +604,11 @@ IOUSBController::Write(IOMemoryDescriptor *buffer, USBDeviceAddress address, End
 		command->SetClientCompletion(*completion);
 		command->SetNoDataTimeout(noDataTimeout); 
 		command->SetCompletionTimeout(completionTimeout);
-		command->SetMultiTransferTransaction(false);
-		command->SetFinalTransferInTransaction(false);
-		for (i=0; i < 10; i++)
-			command->SetUIMScratch(i, 0);
-
-		nullCompletion.target = (void *) NULL;
-		nullCompletion.action = (IOUSBCompletionAction) NULL;
-		nullCompletion.parameter = (void *) NULL;
-		command->SetDisjointCompletion(nullCompletion);
 
 		err = CheckForDisjointDescriptor(command, endpoint->maxPacketSize);
 		if (!err)
 		{			
-			err = _commandGate->runAction(DoIOTransfer, command);
+			err = RunTransfer(DoIOTransfer, command);
 		}
 	}
 	
@@ -44,6 +44,8 @@ extern "C" {
 #include <IOKit/IOTimerEventSource.h>
 #include <IOKit/usb/IOUSBControllerV3.h>
 #include <IOKit/usb/IOUSBDevice.h>
+#include <IOKit/usb/IOUSBDevRequestBatch.h>
+#include <IOKit/usb/IOUSBStringLanguage.h>
 #include <IOKit/usb/IOUSBInterface.h>
 #include <IOKit/usb/IOUSBLog.h>
 #include <IOKit/usb/IOUSBRootHubDevice.h>
@@ -90,6 +92,15 @@ extern "C" {
 #define _RESET_IN_PROGRESS				_expansionData->_resetInProgress
 #define _DO_PORT_REENUMERATE_THREAD		_expansionData->_doPortReEnumerateThread
 #define _STANDARD_PORT_POWER			_expansionData->_standardUSBPortPower
+#define _CONFIG_INDEX_LIST				_expansionData->_configIndexList
+#define _STRING_CACHE_LOCK				_expansionData->_stringCacheLock
+#define _STRING_CACHE					_expansionData->_stringCache
+#define _STRING_LANGUAGES				_expansionData->_stringLanguages
+#define _STRING_LANGUAGES_READ			_expansionData->_stringLanguagesRead
+#define _STRING_NEEDS_LENGTH_PROBE		_expansionData->_stringNeedsLengthProbe
+#define _STRING_CACHE_HITS				_expansionData->_stringCacheHits
+#define _STRING_CACHE_MISSES			_expansionData->_stringCacheMisses
+#define _STRING_BUS_REQUESTS			_expansionData->_stringBusRequests
 #ifdef SUPPORTS_SS_USB
 	#define _USINGEXTRA400MAFORUSB3			_expansionData->_usingExtra400mAforUSB3
 #endif
@@ -317,6 +328,13 @@ IOUSBDevice::start( IOService * provider )
         return kIOReturnNoMemory;
 	}
 	
+	_STRING_CACHE_LOCK = IOLockAlloc();
+    if (!_STRING_CACHE_LOCK)
+	{
+		USBError(1,"%s[%p]::start - unable to allocate _STRING_CACHE_LOCK", getName(), this);
+        goto ErrorExit;
+	}
+	
 	// Don't do this until we have a controller
     //
     _endpointZero.bLength = sizeof(_endpointZero);
@@ -424,6 +442,15 @@ IOUSBDevice::start( IOService * provider )
         if (!_configList)
 			goto ErrorExit;
         bzero(_configList, sizeof(IOBufferMemoryDescriptor*) * _descriptor.bNumConfigurations);
+		
+		_CONFIG_INDEX_LIST = IONew(IOUSBDescriptorIndex, _descriptor.bNumConfigurations);
+		if (_CONFIG_INDEX_LIST)
+		{
+			int		i;
+			
+			for (i = 0; i < _descriptor.bNumConfigurations; i++)
+				_CONFIG_INDEX_LIST[i].Init();
+		}
     }
     else
     {
@@ -441,6 +468,15 @@ IOUSBDevice::start( IOService * provider )
 	}
 	else 
 	{	
+		// get the serial number first - it is part of the identity under which the controller caches our other descriptors
+		if (_descriptor.iSerialNumber)
+		{
+			err = GetStringDescriptor(_descriptor.iSerialNumber, name, sizeof(name));
+			if (err == kIOReturnSuccess)
+			{
+				setProperty(kUSBSerialNumberString, name);
+			}
+		}
 		if (_descriptor.iProduct)
 		{
 			err = GetStringDescriptor(_descriptor.iProduct, name, sizeof(name));
@@ -478,14 +514,6 @@ IOUSBDevice::start( IOService * provider )
 				setProperty(kUSBVendorString, name);
 			}
 		}
-		if (_descriptor.iSerialNumber)
-		{
-			err = GetStringDescriptor(_descriptor.iSerialNumber, name, sizeof(name));
-			if (err == kIOReturnSuccess)
-			{
-				setProperty(kUSBSerialNumberString, name);
-			}
-		}
 	}
 	
     // these properties are used for matching (well, most of them are), and they come from the device descriptor
@@ -911,6 +939,10 @@ IOUSBDevice::stop( IOService * provider )
 		}
 	}
 	
+	// our address can go back to the controller - it keeps it out of circulation for a while
+	if (_controller && (_controller == provider))
+		_controller->ReleaseAddress(_address);
+	
 	USBLog(5, "%s[%p]::-stop isInactive = %d", getName(), this, isInactive());
 
 	super::stop(provider);
@@ -965,6 +997,14 @@ IOUSBDevice::free()
 		}
 		IODelete(_configList, IOBufferMemoryDescriptor*, _descriptor.bNumConfigurations);
 		_configList = NULL;
+		
+		if (_expansionData && _CONFIG_INDEX_LIST)
+		{
+			for(i=0; i<_descriptor.bNumConfigurations; i++)
+				_CONFIG_INDEX_LIST[i].Destroy();
+			IODelete(_CONFIG_INDEX_LIST, IOUSBDescriptorIndex, _descriptor.bNumConfigurations);
+			_CONFIG_INDEX_LIST = NULL;
+		}
     }
 	
     _currentConfigValue = 0;
@@ -994,6 +1034,24 @@ IOUSBDevice::free()
 			_INTERFACEARRAYLOCK = NULL;
 		}
 		
+		if ( _STRING_CACHE )
+		{
+			_STRING_CACHE->release();
+			_STRING_CACHE = NULL;
+		}
+		
+		if ( _STRING_LANGUAGES )
+		{
+			_STRING_LANGUAGES->release();
+			_STRING_LANGUAGES = NULL;
+		}
+		
+		if ( _STRING_CACHE_LOCK )
+		{
+			IOLockFree(_STRING_CACHE_LOCK);
+			_STRING_CACHE_LOCK = NULL;
+		}
+		
         IOFree(_expansionData, sizeof(ExpansionData));
         _expansionData = NULL;
     }
@@ -1502,6 +1560,14 @@ IOUSBDevice::FindNextDescriptor(const void *cur, UInt8 descType)
 		hdr = (IOUSBDescriptorHeader *)cur;
     }
 	
+	if (_CONFIG_INDEX_LIST)
+	{
+		const IOUSBDescriptorHeader	*next;
+		
+		if (_CONFIG_INDEX_LIST[configIndex].FindNext(hdr, descType, &next))
+			return next;
+	}
+	
     do 
     {
 		IOUSBDescriptorHeader 		*lasthdr = hdr;
@@ -1556,8 +1622,32 @@ IOUSBDevice::FindNextInterfaceDescriptor(const IOUSBConfigurationDescriptor *con
     {
 		if (((void*)intfDesc < (void*)configDesc) || (intfDesc->bDescriptorType != kUSBInterfaceDesc))
 			return kIOReturnBadArgument;
-		interface = (IOUSBInterfaceDescriptor *)NextDescriptor(intfDesc);
     }
+	
+	// with an index we only have to look at the interface descriptors
+	IOUSBDescriptorIndex	*index = DescriptorIndexFor(configDesc);
+	const IOUSBInterfaceDescriptor	*candidate;
+	
+	if (index && index->FindNextInterface(intfDesc ? (const void *)intfDesc : (const void *)configDesc, &candidate))
+	{
+		while (candidate && (candidate < end))
+		{
+			if (((request->bInterfaceClass == kIOUSBFindInterfaceDontCare) || (request->bInterfaceClass == candidate->bInterfaceClass)) &&
+				((request->bInterfaceSubClass == kIOUSBFindInterfaceDontCare)  || (request->bInterfaceSubClass == candidate->bInterfaceSubClass)) &&
+				((request->bInterfaceProtocol == kIOUSBFindInterfaceDontCare)  || (request->bInterfaceProtocol == candidate->bInterfaceProtocol)) &&
+				((request->bAlternateSetting == kIOUSBFindInterfaceDontCare)   || (request->bAlternateSetting == candidate->bAlternateSetting)))
+			{
+				*descOut = (IOUSBInterfaceDescriptor *)candidate;
+				return kIOReturnSuccess;
+			}
+			if (!index->FindNextInterface(candidate, &candidate))
+				break;
+		}
+		return kIOUSBInterfaceNotFound;
+	}
+	
+    if (intfDesc != NULL)
+		interface = (IOUSBInterfaceDescriptor *)NextDescriptor(intfDesc);
     else
 		interface = (IOUSBInterfaceDescriptor *)NextDescriptor(configDesc);
 	
@@ -1647,6 +1737,66 @@ IOUSBDevice::CreateInterfaceIterator(IOUSBFindInterfaceRequest *request)
 
 
 
+// The identity under which the controller caches our descriptors: VID, PID and bcdDevice, plus the serial number when the
+// device has one (it then follows the device from port to port) or the locationID when it does not. Until one of those
+// is known the cache is not used.
+//
+bool
+IOUSBDevice::GetDescriptorCacheKey(char *key, UInt32 keySize)
+{
+	OSObject *		propertyObj;
+	OSString *		serial;
+	bool			haveKey = false;
+	
+	if ( !_controller || !_expansionData || (_descriptor.bLength == 0) )
+		return false;
+	
+	propertyObj = copyProperty(kUSBSerialNumberString);
+	serial = OSDynamicCast(OSString, propertyObj);
+	if ( serial && serial->getLength() )
+	{
+		snprintf(key, keySize, "%04x-%04x-%04x-s-%s", USBToHostWord(_descriptor.idVendor), USBToHostWord(_descriptor.idProduct), USBToHostWord(_descriptor.bcdDevice), serial->getCStringNoCopy());
+		haveKey = true;
+	}
+	else if ( !_descriptor.iSerialNumber && _LOCATIONID )
+	{
+		snprintf(key, keySize, "%04x-%04x-%04x-l-%08x", USBToHostWord(_descriptor.idVendor), USBToHostWord(_descriptor.idProduct), USBToHostWord(_descriptor.bcdDevice), (uint32_t)_LOCATIONID);
+		haveKey = true;
+	}
+	
+	if (propertyObj)
+		propertyObj->release();
+	
+	return haveKey;
+}
+
+
+
+// The descriptor index of the cached configuration descriptor which contains descriptor, if it has been built
+//
+IOUSBDescriptorIndex *
+IOUSBDevice::DescriptorIndexFor(const void *descriptor)
+{
+	int		i;
+	
+	if ( !descriptor || !_configList || !_expansionData || !_CONFIG_INDEX_LIST )
+		return NULL;
+	
+	for (i = 0; i < _descriptor.bNumConfigurations; i++)
+	{
+		if ( _configList[i] && _CONFIG_INDEX_LIST[i].IsBuilt() )
+		{
+			const UInt8	*base = (const UInt8 *)_configList[i]->getBytesNoCopy();
+			
+			if ( ((const UInt8 *)descriptor >= base) && ((const UInt8 *)descriptor < (base + _configList[i]->getLength())) )
+				return &_CONFIG_INDEX_LIST[i];
+		}
+	}
+	return NULL;
+}
+
+
+
 const IOUSBConfigurationDescriptor*
 IOUSBDevice::GetFullConfigurationDescriptor(UInt8 index)
 {
@@ -1699,6 +1849,7 @@ IOUSBDevice::GetFullConfigurationDescriptor(UInt8 index)
     {
         int								len;
         IOUSBConfigurationDescHeader	temp;
+		char							cacheKey[kUSBDescriptorCacheKeySize];
         UInt16							idVendor = USBToHostWord(_descriptor.idVendor);
         UInt16							idProduct = USBToHostWord(_descriptor.idProduct);
 		OSObject *						propertyObj = NULL;
@@ -1755,6 +1906,29 @@ IOUSBDevice::GetFullConfigurationDescriptor(UInt8 index)
 			propertyObj->release();
 		} 
 		
+		// A device which has been enumerated before may already have given this descriptor to the controller
+		if ((_configList[index] == NULL) && GetDescriptorCacheKey(cacheKey, sizeof(cacheKey)))
+		{
+			OSData	*cachedConfig = _controller->CopyCachedDescriptor(cacheKey, &_descriptor, kUSBConfDesc, index, 0, 2);
+			
+			if (cachedConfig)
+			{
+				localConfigIOMD = IOBufferMemoryDescriptor::withBytes(cachedConfig->getBytesNoCopy(), cachedConfig->getLength(), kIODirectionIn, false);
+				if (localConfigIOMD)
+				{
+					USBLog(6, "%s[%p]::GetFullConfigurationDescriptor - Index (%x) - using the %d bytes cached by the controller", getName(), this, index, cachedConfig->getLength());
+					if ( index == 0 && overrideMaxPower > 0)
+					{
+						IOUSBConfigurationDescriptor *	myConfigDesc = (IOUSBConfigurationDescriptor *)localConfigIOMD->getBytesNoCopy();
+						
+						myConfigDesc->MaxPower = overrideMaxPower;
+					}
+					_configList[index] = localConfigIOMD;
+				}
+				cachedConfig->release();
+			}
+		}
+		
 		if (_configList[index] == NULL) 
 		{
 			// 2755742 - workaround for a ill behaved device
@@ -1852,6 +2026,10 @@ IOUSBDevice::GetFullConfigurationDescriptor(UInt8 index)
 			}
 			else
 			{
+				// remember what the device gave us (before any override) for the next time it is enumerated
+				if (GetDescriptorCacheKey(cacheKey, sizeof(cacheKey)))
+					_controller->CacheDescriptor(cacheKey, &_descriptor, kUSBConfDesc, index, 0, localConfigIOMD->getBytesNoCopy(), len);
+				
 				// If we get to this point and configList[index] is NOT NULL, then it means that another thread already got the config descriptor.
 				// In that case, let's just release our descriptor and return the already allocated one.
 				//
@@ -1875,6 +2053,10 @@ IOUSBDevice::GetFullConfigurationDescriptor(UInt8 index)
 		}
 	}
     configDescriptor = (IOUSBConfigurationDescriptor *)_configList[index]->getBytesNoCopy();
+	
+	// index the descriptors once, so that FindNextDescriptor and friends don't have to walk them on every call
+	if (_CONFIG_INDEX_LIST && !_CONFIG_INDEX_LIST[index].IsBuilt())
+		_CONFIG_INDEX_LIST[index].Build(configDescriptor, _configList[index]->getLength());
 
 Exit:
 	ReleaseGetConfigLock();
@@ -3160,179 +3342,409 @@ IOUSBDevice::_GetDeviceStatus(OSObject *target, void *arg0,  __unused void *arg1
     return(err);
 }
 
-IOReturn 
+//=============================================================================================
+//
+//  GetStringDescriptor
+//
+//	Strings are cached per device, already converted to UTF-8, under the string index and the LANGID they were read
+//	with. The LANGID table is read once, and if the caller gave no language and the device does not list 0x409, the first
+//	LANGID it does list is used instead (see IOUSBNegotiateStringLanguage).
+//	A string which is not cached is read with a single max length request, unless the device has shown that it needs to
+//	be asked for the length first.
+//
+//=============================================================================================
+//
+IOReturn
 IOUSBDevice::GetStringDescriptor(UInt8 index, char *utf8Buffer, int utf8BufferSize, UInt16 lang)
 {
     IOReturn 		err;
     UInt8 		desc[256]; // Max possible descriptor length
-    IOUSBDevRequest	request;
-    int			i, len;
-	
+    int			i;
+	char		cacheKey[16];
+	char		utf8String[3 * 127 + 1];	// 127 Unicode words at most 3 UTF-8 bytes each
+	OSData *	cachedString = NULL;
+
     USBLog(5, "%s[%p]::GetStringDescriptor address: %d _speed: %d", getName(), this, _address, _speed);
-	
+
     // The buffer needs to be > 5 (One UTF8 character could be 4 bytes long, plus length byte)
     //
     if ( utf8BufferSize < 6 )
         return kIOReturnBadArgument;
-	
+
     // Clear our buffer
     //
     bzero(utf8Buffer, utf8BufferSize);
-    
-    // First get actual length (lame devices don't like being asked for too much data)
-    //
+
+	// string descriptor 0 is the LANGID table itself
+	if (index != 0)
+		lang = NegotiateStringLanguage(lang);
+
+	snprintf(cacheKey, sizeof(cacheKey), "%02x-%04x", index, lang);
+	if (_expansionData && _STRING_CACHE_LOCK)
+	{
+		IOLockLock(_STRING_CACHE_LOCK);
+		if (_STRING_CACHE)
+		{
+			cachedString = OSDynamicCast(OSData, _STRING_CACHE->getObject(cacheKey));
+			if (cachedString)
+				cachedString->retain();
+		}
+		if (cachedString)
+			_STRING_CACHE_HITS++;
+		else
+			_STRING_CACHE_MISSES++;
+		IOLockUnlock(_STRING_CACHE_LOCK);
+	}
+
+	if (!cachedString)
+	{
+		err = ReadStringDescriptor(index, lang, desc);
+		if (err != kIOReturnSuccess)
+		{
+			PublishStringCacheStatistics();
+			return err;
+		}
+
+		// The string descriptor is in "Unicode".  We need to convert it to UTF-8.
+		//
+		UInt32              length = 0;
+		UInt32              byteCounter = 0;
+		SInt32              stringLength = (desc[0] < 2) ? 0 : desc[0] - 2;  // makes it neater
+		UInt8 		utf8Bytes[4];
+		UInt16		*uniCodeBytes = (UInt16	*)desc + 1;	// Just the Unicode words (i.e., no size byte or descriptor type byte)
+
+		// Endian swap the Unicode bytes
+		//
+		if (stringLength >= 2)
+			SwapUniWords (&uniCodeBytes, stringLength);
+
+		// Now pass each Unicode word (2 bytes) to the UTF-8 conversion routine
+		//
+		for (i = 0 ; i < stringLength / 2 ; i++)
+		{
+			// Convert the word
+			//
+			byteCounter = SimpleUnicodeToUTF8 (uniCodeBytes[i], utf8Bytes);
+			if (byteCounter == 0)
+				break;								// At the end
+
+			// Place the resulting byte(s) into our buffer and increment the buffer position
+			//
+			bcopy (utf8Bytes, &utf8String[length], byteCounter);
+			length += byteCounter;
+		}
+
+		cachedString = OSData::withBytes(utf8String, length);
+		if (!cachedString)
+			return kIOReturnNoMemory;
+
+		if (_expansionData && _STRING_CACHE_LOCK)
+		{
+			IOLockLock(_STRING_CACHE_LOCK);
+			if (!_STRING_CACHE)
+				_STRING_CACHE = OSDictionary::withCapacity(4);
+			if (_STRING_CACHE)
+				_STRING_CACHE->setObject(cacheKey, cachedString);
+			IOLockUnlock(_STRING_CACHE_LOCK);
+		}
+	}
+	else
+	{
+		USBLog(6, "%s[%p]::GetStringDescriptor (%d, 0x%x) - using the cached string", getName(), this, index, lang);
+	}
+
+	PublishStringCacheStatistics();
+
+	// Copy as much of the string as fits (leaving room for the NULL at the end), without splitting a character
+	//
+	IOUSBCopyUTF8String(utf8Buffer, utf8BufferSize, (const UInt8 *)cachedString->getBytesNoCopy(), cachedString->getLength());
+	cachedString->release();
+
+    return kIOReturnSuccess;
+}
+
+
+
+//=============================================================================================
+//
+//  ReadStringDescriptor
+//
+//	Gets string descriptor index in language lang into desc (which has room for 256 bytes), from the controller's
+//	descriptor cache or from the device. On success desc[0] is the (even) length of the descriptor, 0 for an empty string.
+//
+//=============================================================================================
+//
+IOReturn
+IOUSBDevice::ReadStringDescriptor(UInt8 index, UInt16 lang, UInt8 *desc)
+{
+    IOReturn 		err = kIOReturnSuccess;
+    IOUSBDevRequest	request;
+    int			len;
+	char		cacheKey[kUSBDescriptorCacheKeySize];
+	bool		useCache;
+	bool		probeLength = _STRING_NEEDS_LENGTH_PROBE;
+	OSData *	cachedString;
+
+	// The serial number is what tells two otherwise identical devices apart, so it always comes from the device
+	useCache = (index != _descriptor.iSerialNumber) && GetDescriptorCacheKey(cacheKey, sizeof(cacheKey));
+	if (useCache)
+	{
+		cachedString = _controller->CopyCachedDescriptor(cacheKey, &_descriptor, kUSBStringDesc, index, lang, probeLength ? 2 : 1);
+		if (cachedString)
+		{
+			bzero(desc, 256);
+			bcopy(cachedString->getBytesNoCopy(), desc, (cachedString->getLength() < 256) ? cachedString->getLength() : 256);
+			cachedString->release();
+			USBLog(6, "%s[%p]::ReadStringDescriptor (%d) - using the copy cached by the controller", getName(), this, index);
+			return kIOReturnSuccess;
+		}
+	}
+
     request.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBStandard, kUSBDevice);
     request.bRequest = kUSBRqGetDescriptor;
     request.wValue = (kUSBStringDesc << 8) | index;
     request.wIndex = lang;
+
+	if (!probeLength)
+	{
+		// Ask for the largest descriptor there can be - a string shorter than that just ends the data stage early
+		//
+		request.wLength = 255;
+		bzero(desc, 256);
+		request.pData = desc;
+		request.wLenDone = 0;
+
+		err = DeviceRequest(&request, 5000, 0);
+		_STRING_BUS_REQUESTS++;
+
+		if ( (err == kIOReturnSuccess) || (err == kIOReturnUnderrun) )
+		{
+			if ( request.wLenDone == 0 )
+			{
+				USBLog(5, "%s[%p]::ReadStringDescriptor (%d)  Length was zero", getName(), this, index);
+				desc[0] = 0;
+				return kIOReturnSuccess;
+			}
+			if ( (request.wLenDone >= 2) && (desc[1] == kUSBStringDesc) && (desc[0] <= request.wLenDone) )
+				goto GotString;
+		}
+
+        USBLog(5,"%s[%p]::ReadStringDescriptor max length read of string %d returned 0x%x, %d bytes - reading the length first",getName(), this, index, err, (uint32_t)request.wLenDone );
+	}
+
+    // First get actual length (lame devices don't like being asked for too much data)
+    //
     request.wLength = 2;
     bzero(desc, 2);
-    request.pData = &desc;
+    request.pData = desc;
 	request.wLenDone = 0;
-	
+
     err = DeviceRequest(&request, 5000, 0);
-	
+	_STRING_BUS_REQUESTS++;
+
 	if ( err == kIOReturnSuccess && request.wLenDone != 2 )
 	{
-        USBLog(1,"%s[%p]::GetStringDescriptor(%d)	requested 2 bytes, got %d", getName(), this,  (uint32_t)index, (uint32_t)request.wLenDone );
+        USBLog(1,"%s[%p]::ReadStringDescriptor(%d)	requested 2 bytes, got %d", getName(), this,  (uint32_t)index, (uint32_t)request.wLenDone );
 	}
-	
+
     if ( (err != kIOReturnSuccess) && (err != kIOReturnOverrun) )
     {
-        USBLog(5,"%s[%p]::GetStringDescriptor reading string length returned error (0x%x) - retrying with max length",getName(), this, err );
-		
+        USBLog(5,"%s[%p]::ReadStringDescriptor reading string length returned error (0x%x) - retrying with max length",getName(), this, err );
+
         // Let's try again full length.  Here's why:  On USB 2.0 controllers, we will not get an overrun error.  We just get a "babble" error
         // and no valid data.  So, if we ask for the max size, we will either get it, or we'll get an underrun.  It looks like we get it w/out an underrun
         //
-        request.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBStandard, kUSBDevice);
-        request.bRequest = kUSBRqGetDescriptor;
-        request.wValue = (kUSBStringDesc << 8) | index;
-        request.wIndex = lang;
         request.wLength = 256;
         bzero(desc, 256);
-        request.pData = &desc;
+        request.pData = desc;
 		request.wLenDone = 0;
-		
+
         err = DeviceRequest(&request, 5000, 0);
+		_STRING_BUS_REQUESTS++;
 		if ( err == kIOReturnSuccess && request.wLenDone != 256 )
 		{
-			USBLog(1,"%s[%p]::GetStringDescriptor(%d)	requested 256 bytes, got %d", getName(), this,  (uint32_t)index,  (uint32_t)request.wLenDone );
+			USBLog(1,"%s[%p]::ReadStringDescriptor(%d)	requested 256 bytes, got %d", getName(), this,  (uint32_t)index,  (uint32_t)request.wLenDone );
 		}
 
 		if ( (err != kIOReturnSuccess) && (err != kIOReturnUnderrun) )
         {
-            USBLog(3,"%s[%p]::GetStringDescriptor reading string length (256) returned error (0x%x)",getName(), this, err);
+            USBLog(3,"%s[%p]::ReadStringDescriptor reading string length (256) returned error (0x%x)",getName(), this, err);
             return err;
         }
     }
-	
-    request.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBStandard, kUSBDevice);
-    request.bRequest = kUSBRqGetDescriptor;
-    request.wValue = (kUSBStringDesc << 8) | index;
-    request.wIndex = lang;
+
     len = desc[0];
-    
+
     // If the length is 0 (empty string), just set the buffer to be 0.
     //
     if (len == 0)
     {
-        USBLog(5, "%s[%p]::GetStringDescriptor (%d)  Length was zero", getName(), this, index);
+        USBLog(5, "%s[%p]::ReadStringDescriptor (%d)  Length was zero", getName(), this, index);
         return kIOReturnSuccess;
     }
-    
-    // Make sure that desc[1] == kUSBStringDesc 
+
+    // Make sure that desc[1] == kUSBStringDesc
     //
     if ( desc[1] != kUSBStringDesc )
     {
-        USBLog(3,"%s[%p]::GetStringDescriptor descriptor is not a string (%d  kUSBStringDesc)", getName(), this, desc[1] );
+        USBLog(3,"%s[%p]::ReadStringDescriptor descriptor is not a string (%d  kUSBStringDesc)", getName(), this, desc[1] );
         return kIOReturnDeviceError;
     }
-	
+
     if ( (desc[0] & 1) != 0)
     {
         // Odd length for the string descriptor!  That is odd.  Truncate it to an even #
         //
-        USBLog(3,"%s[%p]::GetStringDescriptor descriptor length (%d) is odd, which is illegal", getName(), this, desc[0]);
+        USBLog(3,"%s[%p]::ReadStringDescriptor descriptor length (%d) is odd, which is illegal", getName(), this, desc[0]);
         desc[0] &= 0xfe;
     }
-    
+
     request.wLength = len;
     bzero(desc, len);
-    request.pData = &desc;
+    request.pData = desc;
 	request.wLenDone = 0;
-	
+
     err = DeviceRequest(&request, 5000, 0);
+	_STRING_BUS_REQUESTS++;
 
 	if ( err == kIOReturnSuccess && (SInt32)request.wLenDone != len )
 	{
-        USBLog(1,"%s[%p]::GetStringDescriptor(%d)	requested %d bytes, got %d", getName(), this,  (uint32_t)index, len,  (uint32_t)request.wLenDone );
+        USBLog(1,"%s[%p]::ReadStringDescriptor(%d)	requested %d bytes, got %d", getName(), this,  (uint32_t)index, len,  (uint32_t)request.wLenDone );
 	}
-	
+
     if (err != kIOReturnSuccess)
     {
-        USBLog(3,"%s[%p]::GetStringDescriptor reading entire string returned error (0x%x)",getName(), this, err);
+        USBLog(3,"%s[%p]::ReadStringDescriptor reading entire string returned error (0x%x)",getName(), this, err);
         return err;
     }
-	
+
+	if (!probeLength)
+	{
+		// the max length read failed where this one worked, so don't bother with it for the rest of this device's strings
+		USBLog(3, "%s[%p]::ReadStringDescriptor - device needs the string length read first", getName(), this);
+		_STRING_NEEDS_LENGTH_PROBE = true;
+	}
+
+GotString:
     // Make sure that desc[1] == kUSBStringDesc
     //
     if ( desc[1] != kUSBStringDesc )
     {
-        USBLog(3,"%s[%p]::GetStringDescriptor descriptor is not a string (%d  kUSBStringDesc)", getName(), this, desc[1] );
+        USBLog(3,"%s[%p]::ReadStringDescriptor descriptor is not a string (%d  kUSBStringDesc)", getName(), this, desc[1] );
         return kIOReturnDeviceError;
     }
-	
+
     if ( (desc[0] & 1) != 0)
     {
         // Odd length for the string descriptor!  That is odd.  Truncate it to an even #
         //
-        USBLog(3,"%s[%p]::GetStringDescriptor(2) descriptor length (%d) is odd, which is illegal", getName(), this, desc[0]);
+        USBLog(3,"%s[%p]::ReadStringDescriptor(2) descriptor length (%d) is odd, which is illegal", getName(), this, desc[0]);
         desc[0] &= 0xfe;
     }
-	
-    USBLog(5, "%s[%p]::GetStringDescriptor Got string descriptor %d, length %d, got %d", getName(), this,
-           index, desc[0], request.wLength);
-	
-    // The string descriptor is in "Unicode".  We need to convert it to UTF-8.
-    //
-    SInt32              length = 0;
-    UInt32              byteCounter = 0;
-    SInt32              stringLength = desc[0] - 2;  // makes it neater
-    UInt8 		utf8Bytes[4];
-    char *		temp = utf8Buffer;
-    UInt16		*uniCodeBytes = (UInt16	*)desc + 1;	// Just the Unicode words (i.e., no size byte or descriptor type byte)
-    
-    // Endian swap the Unicode bytes
-    //
-    SwapUniWords (&uniCodeBytes, stringLength);
-    
-    // Now pass each Unicode word (2 bytes) to the UTF-8 conversion routine
-    //
-    for (i = 0 ; i < stringLength / 2 ; i++)
-    {
-        // Convert the word
-        //
-        byteCounter = SimpleUnicodeToUTF8 (uniCodeBytes[i], utf8Bytes);	
-        if (byteCounter == 0) 
-            break;								// At the end
-        
-        //  Check to see if we have room in our buffer (leave room for NULL at the end)
-        //
-        length += byteCounter;			 
-        if ( length > (utf8BufferSize - 1) )
-            break;
-        
-        // Place the resulting byte(s) into our buffer and increment the buffer position
-        //
-        bcopy (utf8Bytes, temp, byteCounter);					// place resulting byte[s] in new buffer
-        temp += byteCounter;							// inc buffer
-    }
-    
+
+    USBLog(5, "%s[%p]::ReadStringDescriptor Got string descriptor %d, length %d, got %d", getName(), this,
+           index, desc[0], request.wLenDone);
+
+	if (useCache && desc[0])
+		_controller->CacheDescriptor(cacheKey, &_descriptor, kUSBStringDesc, index, lang, desc, desc[0]);
+
     return kIOReturnSuccess;
 }
 
 
 
+//=============================================================================================
+//
+//  NegotiateStringLanguage
+//
+//	Reads the LANGID table the first time the default language is asked for, and picks the language with
+//	IOUSBNegotiateStringLanguage. Any other language is returned as is, without reading the table.
+//
+//=============================================================================================
+//
+UInt16
+IOUSBDevice::NegotiateStringLanguage(UInt16 lang)
+{
+	OSData *		languages = NULL;
+	UInt16			newLang = lang;
+
+	if (!_expansionData || !_STRING_CACHE_LOCK || (lang != kUSBDefaultStringLanguage))
+		return lang;
+
+	if (!_STRING_LANGUAGES_READ)
+	{
+		UInt8		desc[256];
+
+		if ( (ReadStringDescriptor(0, 0, desc) == kIOReturnSuccess) && (desc[0] >= 4) )
+			languages = OSData::withBytes(&desc[2], desc[0] - 2);
+
+		IOLockLock(_STRING_CACHE_LOCK);
+		if (!_STRING_LANGUAGES_READ)
+		{
+			_STRING_LANGUAGES = languages;
+			_STRING_LANGUAGES_READ = true;
+			languages = NULL;
+		}
+		IOLockUnlock(_STRING_CACHE_LOCK);
+
+		if (languages)
+			languages->release();
+	}
+
+	IOLockLock(_STRING_CACHE_LOCK);
+	if (_STRING_LANGUAGES)
+		newLang = IOUSBNegotiateStringLanguage((const UInt16 *)_STRING_LANGUAGES->getBytesNoCopy(), _STRING_LANGUAGES->getLength() / sizeof(UInt16), lang);
+	IOLockUnlock(_STRING_CACHE_LOCK);
+
+	if (newLang != lang)
+	{
+		USBLog(5, "%s[%p]::NegotiateStringLanguage - LANGID 0x%x is not supported, using 0x%x", getName(), this, lang, newLang);
+	}
+	return newLang;
+}
+
+
+
+void
+IOUSBDevice::PublishStringCacheStatistics(void)
+{
+	OSDictionary		*dict;
+	OSNumber			*num;
+	UInt32				values[4];
+	const char *		names[4] = {"Hits", "Misses", "BusRequests", "RequestsAvoided"};
+	int					i;
+
+	if (!_expansionData || !_STRING_CACHE_LOCK)
+		return;
+
+	// requests avoided is counted against reading the length and then the string for every lookup, which is what
+	// GetStringDescriptor used to do
+	IOLockLock(_STRING_CACHE_LOCK);
+	values[0] = _STRING_CACHE_HITS;
+	values[1] = _STRING_CACHE_MISSES;
+	values[2] = _STRING_BUS_REQUESTS;
+	values[3] = (2 * (values[0] + values[1]) > values[2]) ? (2 * (values[0] + values[1]) - values[2]) : 0;
+	IOLockUnlock(_STRING_CACHE_LOCK);
+
+	dict = OSDictionary::withCapacity(4);
+	if (!dict)
+		return;
+
+	for (i=0; i < 4; i++)
+	{
+		num = OSNumber::withNumber(values[i], 32);
+		if (num)
+		{
+			dict->setObject(names[i], num);
+			num->release();
+		}
+	}
+	setProperty("StringCacheStatistics", dict);
+	dict->release();
+}
+
+
+
 void
 IOUSBDevice::DisplayNotEnoughPowerNotice()
 {
@@ -3962,6 +4374,212 @@ IOUSBDevice::_DeviceRequestDescWithTimeout(OSObject *target, void *arg0, void *a
 
 
 
+//=============================================================================================
+//
+//  DeviceRequestBatch
+//
+//	The requests go out one at a time on pipe zero. Each one is queued from the completion of the one before it, on the
+//	workloop, so the client only goes through the command gate once and only waits once. They are not all queued up front
+//	because a control pipe keeps going after a request fails, and the batch has to stop at the first error.
+//
+//=============================================================================================
+//
+IOReturn
+IOUSBDevice::DeviceRequestBatch(IOUSBDevRequest *requests, UInt32 count, IOReturn *statuses, UInt32 noDataTimeout, UInt32 completionTimeout, IOUSBCompletion *completion)
+{
+	IOUSBDevRequestBatch *	batch;
+	IOReturn				kr = kIOReturnSuccess;
+	
+	if ( !requests || (count == 0) || (completion && !completion->action) )
+		return kIOReturnBadArgument;
+	
+	if ( !(_expansionData && _COMMAND_GATE && _WORKLOOP) )
+		return kIOReturnNoDevice;
+	
+	if ( !completion && _WORKLOOP->onThread() )
+	{
+		USBError(1,"%s[%p]::DeviceRequestBatch sync request on workloop thread.  Use async!", getName(), this);
+		return kIOUSBSyncRequestOnWLThread;
+	}
+	
+	batch = (IOUSBDevRequestBatch *)IOMalloc(sizeof(IOUSBDevRequestBatch));
+	if ( !batch )
+		return kIOReturnNoMemory;
+	
+	bzero(batch, sizeof(IOUSBDevRequestBatch));
+	batch->requests = requests;
+	batch->statuses = statuses;
+	batch->count = count;
+	batch->noDataTimeout = noDataTimeout;
+	batch->completionTimeout = completionTimeout;
+	if ( completion )
+		batch->completion = *completion;
+	
+	IOCommandGate *	gate = _COMMAND_GATE;
+	IOWorkLoop *	workLoop = _WORKLOOP;
+	
+	retain();
+	workLoop->retain();
+	gate->retain();
+	
+	kr = gate->runAction(_DeviceRequestBatch, batch);
+	if ( kr != kIOReturnSuccess )
+	{
+		USBLog(2,"%s[%p]::DeviceRequestBatch _DeviceRequestBatch runAction() failed (0x%x)", getName(), this, kr);
+	}
+	
+	gate->release();
+	workLoop->release();
+	release();
+	
+	// an asynchronous batch which got going belongs to CompleteDeviceRequestBatch now
+	if ( !completion || (kr != kIOReturnSuccess) )
+		IOFree(batch, sizeof(IOUSBDevRequestBatch));
+	
+	return kr;
+}
+
+
+
+IOReturn
+IOUSBDevice::_DeviceRequestBatch(OSObject *target, void *arg0, __unused void *arg1, __unused void *arg2, __unused void *arg3)
+{
+	IOUSBDevice *			me		= OSDynamicCast(IOUSBDevice, target);
+	IOUSBDevRequestBatch *	batch	= (IOUSBDevRequestBatch *)arg0;
+	bool					sync	= (batch->completion.action == NULL);
+	UInt32					badIndex;
+	
+    if (me->isInactive())
+    {
+        USBLog(1, "%s[%p]::_DeviceRequestBatch - while terminating!", me->getName(), me);
+		USBTrace( kUSBTDevice, kTPDeviceDeviceRequest, (uintptr_t)me, kIOReturnNotResponding, batch->requests[0].wValue, 5 );
+        return kIOReturnNotResponding;
+    }
+	
+	if ( !me->_pipeZero )
+		return kIOUSBUnknownPipeErr;
+	
+	if ( IOUSBDevRequestBatchStart(batch, &badIndex) != kIOReturnSuccess )
+	{
+		USBLog(3, "%s[%p]:_DeviceRequestBatch request %d is a kSetAddress - not sending the batch", me->getName(), me, (uint32_t)badIndex);
+		return kIOReturnNotPermitted;
+	}
+	
+	batch->entryCompletion.target = me;
+	batch->entryCompletion.action = &IOUSBDevice::DeviceRequestBatchEntryComplete;
+	batch->entryCompletion.parameter = batch;
+	
+	// the device has to stay around until the last request has completed
+	me->retain();
+	if ( !me->SubmitDeviceRequestBatchEntry(batch) )
+	{
+		me->release();
+		return batch->status;
+	}
+	
+	if ( !sync )
+		return kIOReturnSuccess;
+	
+	while ( !batch->done )
+	{
+		IOReturn	kr = me->_COMMAND_GATE->commandSleep(batch, batch->stop ? THREAD_UNINT : THREAD_ABORTSAFE);
+		
+		if ( (kr != THREAD_AWAKENED) && !batch->stop )
+		{
+			// don't send anything else, and get the request on the bus back as soon as we can
+			USBLog(3, "%s[%p]::_DeviceRequestBatch woke up with %d at request %d of %d - aborting", me->getName(), me, kr, (uint32_t)batch->next, (uint32_t)batch->count);
+			batch->stop = true;
+			if ( me->_pipeZero )
+				me->_pipeZero->Abort();
+		}
+	}
+	
+	me->release();
+	return batch->status;
+}
+
+
+
+bool
+IOUSBDevice::SubmitDeviceRequestBatchEntry(IOUSBDevRequestBatch *batch)
+{
+	IOUSBDevRequest *	request = &batch->requests[batch->next];
+	IOReturn			err;
+	
+	if ( batch->stop )
+		err = kIOReturnAborted;
+	else if ( isInactive() )
+		err = kIOReturnNotResponding;
+	else if ( !_pipeZero )
+		err = kIOUSBUnknownPipeErr;
+	else
+		err = _pipeZero->ControlRequest(request, batch->noDataTimeout, batch->completionTimeout, &batch->entryCompletion);
+	
+	if ( err == kIOReturnSuccess )
+		return true;
+	
+	USBLog(3, "%s[%p]::SubmitDeviceRequestBatchEntry - request %d of %d could not be sent (0x%x)", getName(), this, (uint32_t)batch->next, (uint32_t)batch->count, err);
+	IOUSBDevRequestBatchSendFailed(batch, err);
+	return false;
+}
+
+
+
+void
+IOUSBDevice::DeviceRequestBatchEntryComplete(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining)
+{
+	IOUSBDevice *			me		= (IOUSBDevice *)target;
+	IOUSBDevRequestBatch *	batch	= (IOUSBDevRequestBatch *)parameter;
+	IOUSBDevRequest *		request	= &batch->requests[batch->next];
+	
+	if ( status == kIOReturnSuccess )
+	{
+		if ( ((request->bRequest << 8) | request->bmRequestType) == kSetConfiguration )
+		{
+			USBLog(6, "%s[%p]::DeviceRequestBatchEntryComplete kSetConfiguration to %d", me->getName(), me, request->wValue);
+			me->_currentConfigValue = request->wValue;
+		}
+	}
+	else if ( status == kIOUSBTransactionTimeout )
+	{
+		USBLog(1, "%s[%p]::DeviceRequestBatchEntryComplete - Location: 0x%x returned a kIOUSBTransactionTimeout", me->getName(), me, (uint32_t)me->_LOCATIONID);
+	}
+	else
+	{
+		USBLog(3, "%s[%p]::DeviceRequestBatchEntryComplete - request %d of %d failed (0x%x)", me->getName(), me, (uint32_t)batch->next, (uint32_t)batch->count, status);
+	}
+	
+	if ( IOUSBDevRequestBatchEntryDone(batch, status, bufferSizeRemaining) && me->SubmitDeviceRequestBatchEntry(batch) )
+		return;
+	
+	me->CompleteDeviceRequestBatch(batch);
+}
+
+
+
+void
+IOUSBDevice::CompleteDeviceRequestBatch(IOUSBDevRequestBatch *batch)
+{
+	IOUSBCompletion		completion = batch->completion;
+	IOReturn			status = batch->status;
+	UInt32				remaining = batch->count - batch->completed;
+	
+	batch->done = true;
+	
+	if ( completion.action == NULL )
+	{
+		// _DeviceRequestBatch is sleeping on the batch, and still holds its reference on us
+		_COMMAND_GATE->commandWakeup(batch, true);
+		return;
+	}
+	
+	IOFree(batch, sizeof(IOUSBDevRequestBatch));
+	(*completion.action)(completion.target, completion.parameter, status, remaining);
+	release();
+}
+
+
+
 //=============================================================================================
 //
 //  SuspendDevice
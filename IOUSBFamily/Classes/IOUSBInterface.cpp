@@ -30,6 +30,7 @@
 //================================================================================================
 //
 #include <libkern/OSByteOrder.h>
+#include <libkern/OSAtomic.h>
 #include <libkern/c++/OSDictionary.h>
 #include <libkern/c++/OSData.h>
 #include <libkern/version.h>
@@ -64,6 +65,7 @@ extern KernelDebugLevel	    gKernelDebugLevel;
 #define _WORKLOOP		_expansionData->_workLoop
 #define _NEED_TO_CLOSE	_expansionData->_needToClose
 #define _OPEN_CLIENTS	_expansionData->_openClients
+#define _PIPETABLE		_expansionData->_pipeTable
 #ifdef SUPPORTS_SS_USB
 	#define _REMEBEREDSTREAMS	_expansionData->_RememberedStreams
 #endif
@@ -1148,13 +1150,24 @@ IOReturn
 IOUSBInterface::ClosePipesGated(bool close)
 {
 	IOUSBPipe*	pipe;
+	IOUSBPipe*	closedPipes[kUSBMaxPipes];
     IOReturn	ret = kIOReturnSuccess;
 	
 	USBLog(6,"+%s[%p]::ClosePipesGated (close: %d)", getName(), this, close);
 	
+	// take the pipes out of the published table before they are released, so that lookups outside the gate can't find them
+	for( unsigned int i=0; i < kUSBMaxPipes; i++)
+	{
+		closedPipes[i] = _pipeList[i];
+		if (close)
+			_pipeList[i] = NULL;
+	}
+	if (close)
+		PublishPipeTableGated();
+	
     for( unsigned int i=0; i < kUSBMaxPipes; i++) 
     {
-        if ( (pipe = OSDynamicCast(IOUSBPipe,_pipeList[i]))) 
+        if ( (pipe = OSDynamicCast(IOUSBPipe,closedPipes[i]))) 
         {
             USBLog(6,"+%s[%p]::ClosePipesGated, close pipe: %d (%p)", getName(), this, i, pipe);
             pipe->Abort(); 
@@ -1163,7 +1176,6 @@ IOUSBInterface::ClosePipesGated(bool close)
             {
                 USBLog(6,"+%s[%p]::ClosePipesGated, release pipe: %d", getName(), this, i);
                 pipe->release();
-                _pipeList[i] = NULL;
             }
         }
     }
@@ -1209,8 +1221,9 @@ IOUSBInterface::ReopenPipesGated()
             USBLog(6,"+%s[%p]::ReopenPipesGated - reopen pipe: %d (%p)", getName(), this, i, pipe);
             if ( !pipe->InitToEndpoint(pipe->_descriptor, pipe->_sscd, _device->GetSpeed(), _device->GetAddress(), _device->_controller, _device, this) ) 
             {
-                pipe->release();
                 _pipeList[i] = NULL;
+                PublishPipeTableGated();
+                pipe->release();
             }
         }
     }
@@ -1325,6 +1338,8 @@ IOUSBInterface::CreatePipes(void)
             USBLog(3, "%s[%p]: NOTE: Interface descriptor defines less endpoints (bNumEndpoints = %d, descriptors = %d) than endpoint descriptors", getName(), this, _bNumEndpoints, i);
 		}
     }
+	
+	PublishPipeTable();
 
     if ( makePipeFailed )
     {
@@ -1364,6 +1379,10 @@ IOUSBInterface::FindNextPipe(IOUSBPipe *current,
 {
 	IOUSBPipe *							pipe;
 	
+	// the caller doesn't get a retain, so the published table will do
+	if (FindNextPipeInTable(current, request, &pipe))
+		return pipe;
+	
 	//	For backwards compatibility, release the retained pipe before returning to the caller.
 	pipe = FindNextPipe(current, request, true);
 	if (pipe)
@@ -1382,6 +1401,10 @@ IOUSBInterface::FindNextPipe(IOUSBPipe *current,
 	IOUSBPipe *	thePipeObj = NULL;
 	IOReturn	err = kIOReturnSuccess;
 	
+	// a retain has to be taken under the gate, where the pipe can't be released under us
+	if (!withRetain && FindNextPipeInTable(current, request, &thePipeObj))
+		return thePipeObj;
+	
     if (_expansionData && _GATE && _WORKLOOP)
     {
 		IOCommandGate *	gate = _GATE;
@@ -1437,75 +1460,153 @@ IOUSBInterface::FindNextPipeGated(IOUSBPipe *current,
 							 IOUSBFindEndpointRequest *request,
 							 bool withRetain)
 {
-	const IOUSBController::Endpoint *	endpoint;
 	IOUSBPipe *							pipe = NULL;
-	int									numEndpoints;
-	int									i;
 	
-	numEndpoints = _bNumEndpoints;
-	
-	if (request == 0)
+	// the table is only rewritten under the gate, so this can't fail here
+	if (!FindNextPipeInTable(current, request, &pipe))
 		return NULL;
 	
-	if (current != 0)
-	{
-		for(i=0; (i < numEndpoints) && (i < kUSBMaxPipes) ; i++)
+	if (pipe && withRetain)
+		pipe->retain();				// caller will release
+	
+	return pipe;
+}
+
+
+
+//================================================================================================
+//
+//   Pipe table
+//
+//	GetPipeObj and FindNextPipe are called for every transfer by the user clients. Rather than taking the command gate each
+//	time, they read a copy of _pipeList and the endpoint parameters which is only rewritten, under the gate, when the pipes
+//	are created, reopened or closed. A generation count which is odd while the table is being rewritten tells a reader that
+//	it has to try again (or take the gate), so a lookup is a handful of loads and never writes shared memory.
+//
+//================================================================================================
+//
+void
+IOUSBInterface::PublishPipeTable(void)
+{
+    if (_expansionData && _GATE && _WORKLOOP)
+    {
+		IOCommandGate *	gate = _GATE;
+		IOWorkLoop *	workLoop = _WORKLOOP;
+		IOReturn		err;
+		
+		retain();
+		workLoop->retain();
+		gate->retain();
+		
+		err = gate->runAction(_PublishPipeTable, (void *)NULL, (void *)NULL, (void *)NULL, (void *)NULL);
+		if ( err != kIOReturnSuccess )
 		{
-			if (_pipeList[i] == current)
-			{
-				i++; // Skip the one we just did
-				break;
-			}
+			USBLog(2,"%s[%p]:PublishPipeTable _PublishPipeTable runAction failed (0x%x)", getName(), this, err);
 		}
+		
+		gate->release();
+		workLoop->release();
+		release();
 	}
-	else
+	else if (_expansionData)
 	{
-		i = 0;	// Start at beginning.
+		// not started yet - nobody else can be looking
+		PublishPipeTableGated();
 	}
+}
+
+
+
+IOReturn
+IOUSBInterface::_PublishPipeTable(OSObject *target, void *param1, void *param2, void *param3, void *param4)
+{
+#pragma unused (param1, param2, param3, param4)
+	
+    IOUSBInterface*				me	= OSDynamicCast(IOUSBInterface, target);
+	
+    if (!me)
+    {
+        USBLog(1, "IOUSBInterface::_PublishPipeTable - invalid target");
+        return kIOReturnBadArgument;
+    }
+	
+    me->PublishPipeTableGated();
+	
+    return kIOReturnSuccess;
+}
+
+
+
+void
+IOUSBInterface::PublishPipeTableGated(void)
+{
+	const IOUSBController::Endpoint *	endpoint;
+	IOUSBPipe *							pipe;
 	
-	for ( ; (i < numEndpoints) && (i < kUSBMaxPipes) ; i++) 
+	IOUSBPipeTableBeginUpdate(&_PIPETABLE);
+	
+	_PIPETABLE.count = (_bNumEndpoints < kUSBMaxPipes) ? _bNumEndpoints : kUSBMaxPipes;
+	for ( unsigned int i = 0; i < kUSBMaxPipes; i++ )
 	{
-		pipe = OSDynamicCast(IOUSBPipe,_pipeList[i]);
-		USBLog(6,"%s[%p]::FindNextPipeGated created pipe %p", getName(), this, pipe);
-		if (!pipe)
-			continue;
+		pipe = OSDynamicCast(IOUSBPipe, _pipeList[i]);
 		
-		endpoint = pipe->GetEndpoint();
-		
-		// check the request parameters
-		if (request->type != kUSBAnyType && request->type != endpoint->transferType)
-		{
-			pipe = NULL;								// this is not it
-		}
-		else if (request->direction != kUSBAnyDirn && request->direction != endpoint->direction)
+		bzero(&_PIPETABLE.entries[i], sizeof(IOUSBInterfacePipeTableEntry));
+		if (pipe)
 		{
-			pipe = NULL;								// this is not it
+			endpoint = pipe->GetEndpoint();
+			_PIPETABLE.entries[i].pipe = pipe;
+			_PIPETABLE.entries[i].maxPacketSize = endpoint->maxPacketSize;
+			_PIPETABLE.entries[i].transferType = endpoint->transferType;
+			_PIPETABLE.entries[i].direction = endpoint->direction;
+			_PIPETABLE.entries[i].interval = endpoint->interval;
 		}
-		
-		if (pipe == NULL)
-			continue;
-		
-		request->type = endpoint->transferType;
-		request->direction = endpoint->direction;
-		request->maxPacketSize = endpoint->maxPacketSize;
-		request->interval = endpoint->interval;
-		break;
 	}
 	
-	if (pipe && withRetain)
-		pipe->retain();				// caller will release
+	IOUSBPipeTableEndUpdate(&_PIPETABLE);
+}
+
+
+
+bool
+IOUSBInterface::LookupPipeTable(UInt8 index, IOUSBPipe **pipe)
+{
+	if (!_expansionData)
+		return false;
 	
-	return pipe;
+	return IOUSBPipeTableLookup(&_PIPETABLE, index, pipe);
+}
+
+
+
+bool
+IOUSBInterface::FindNextPipeInTable(IOUSBPipe *current, IOUSBFindEndpointRequest *request, IOUSBPipe **pipe)
+{
+	if (!_expansionData)
+		return false;
+	
+	if (request == 0)
+	{
+		*pipe = NULL;
+		return true;
+	}
+	
+	return IOUSBPipeTableFindNext(&_PIPETABLE, current, request, pipe);
 }
 
 const IOUSBDescriptorHeader *
 IOUSBInterface::FindNextAssociatedDescriptor(const void *current, UInt8 type)
 {
     const IOUSBDescriptorHeader *next;
+	IOUSBDescriptorIndex		*index;
 
     if (current == NULL)
         current = _interfaceDesc;
 
+	// the device indexes its configuration descriptors - use that if it knows where current is
+	index = _device->DescriptorIndexFor(current);
+	if (index && index->FindNextAssociated(current, type, _bInterfaceNumber, &next))
+		return next;
+	
     next = (const IOUSBDescriptorHeader *)current;
 
     while (true) 
@@ -2005,6 +2106,9 @@ IOUSBInterface::GetPipeObj(UInt8 index)
 	IOUSBPipe *	thePipeObj = NULL;
 	IOReturn	err = kIOReturnSuccess;
 	
+	if (LookupPipeTable(index, &thePipeObj))
+		return thePipeObj;
+	
     if (_expansionData && _GATE && _WORKLOOP)
     {
 		IOCommandGate *	gate = _GATE;
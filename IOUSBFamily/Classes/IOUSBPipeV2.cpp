@@ -29,9 +29,11 @@
 //================================================================================================
 //
 #include <libkern/OSByteOrder.h>
+#include <kern/queue.h>
 
 #include <IOKit/IOService.h>
 #include <IOKit/IOKitKeys.h>
+#include <IOKit/IOLocks.h>
 
 
 #include <IOKit/usb/IOUSBController.h>
@@ -77,6 +79,32 @@
 	#define USBError( LEVEL, FORMAT, ARGS... )  { kprintf( FORMAT "\n", ## ARGS ) ; }
 #endif
 
+#ifdef SUPPORTS_SS_USB
+//================================================================================================
+//
+//   Stream scheduler
+//
+//	An asynchronous request on a stream, while the stream scheduler has it. See IOUSBStreamScheduler.h.
+//
+//================================================================================================
+//
+struct IOUSBStreamRequest
+{
+	queue_chain_t			link;
+	UInt32					streamID;
+	bool					isRead;
+	bool					outstanding;				// with the controller
+	IOMemoryDescriptor *	buffer;
+	UInt32					noDataTimeout;
+	UInt32					completionTimeout;
+	IOByteCount				reqCount;
+	IOUSBCompletion			clientCompletion;
+	IOUSBCompletion			completion;					// ours, handed to the controller
+	uint64_t				queuedTime;
+};
+
+#endif
+
 //================================================================================================
 //
 //  IOUSBPipeV2 Methods
@@ -114,6 +142,21 @@ IOUSBPipeV2::InitToEndpoint(const IOUSBEndpointDescriptor *ed, IOUSBSuperSpeedEn
         bzero(_expansionData, sizeof(ExpansionData));
     }
 	
+    if (!_v2PipeExpansionData)
+    {
+        _v2PipeExpansionData = (V2PipeExpansionData *)IOMalloc(sizeof(V2PipeExpansionData));
+        if (!_v2PipeExpansionData)
+            return false;
+        bzero(_v2PipeExpansionData, sizeof(V2PipeExpansionData));
+    }
+	
+	if (!_v2PipeExpansionData->_streamLock)
+	{
+		_v2PipeExpansionData->_streamLock = IOLockAlloc();
+		if (!_v2PipeExpansionData->_streamLock)
+			return false;
+	}
+	
     _controller = controller;
     controllerV3 = OSDynamicCast(IOUSBControllerV3, _controller);
     if ( controllerV3 == NULL )
@@ -310,6 +353,30 @@ IOUSBPipeV2::ToEndpoint(const IOUSBEndpointDescriptor *ed, IOUSBSuperSpeedEndpoi
 
 
 
+//================================================================================================
+//
+//   free
+//
+//================================================================================================
+//
+void
+IOUSBPipeV2::free()
+{
+    if (_v2PipeExpansionData)
+    {
+		FreeStreamScheduler();
+		if (_v2PipeExpansionData->_streamLock)
+			IOLockFree(_v2PipeExpansionData->_streamLock);
+        IOFree(_v2PipeExpansionData, sizeof(V2PipeExpansionData));
+        _v2PipeExpansionData = NULL;
+    }
+	
+	// super is #defined to ourselves in this file
+	IOUSBPipe::free();
+}
+
+
+
 #pragma mark IOUSBPipeV2 State
 
 //================================================================================================
@@ -359,6 +426,8 @@ IOUSBPipeV2::Abort(UInt32 streamID)
 	}
     if ( streamID != 0 )
     {
+		// requests still waiting in the pipe never reached the controller, so its abort won't complete them
+		AbortStreamRequests(streamID);
 		return controllerV3->AbortPipe(streamID, _address, &_endpoint);
 	}
 	else
@@ -369,6 +438,21 @@ IOUSBPipeV2::Abort(UInt32 streamID)
 }
 
 
+
+//================================================================================================
+//
+//   Abort
+//
+//================================================================================================
+//
+IOReturn
+IOUSBPipeV2::Abort(void)
+{
+	AbortStreamRequests(kUSBAllStreams);
+	return IOUSBPipe::Abort();
+}
+
+
 #pragma mark Bulk Read
 
 //================================================================================================
@@ -473,7 +557,7 @@ IOUSBPipeV2::Read(UInt32 streamID, IOMemoryDescriptor *buffer, UInt32 noDataTime
 		}
  		if(streamID != 0)
 		{
-			err = controllerV3->Read(streamID, buffer, _address, &_endpoint, completion, noDataTimeout, completionTimeout, reqCount);
+			err = QueueStreamRequest(true, streamID, buffer, noDataTimeout, completionTimeout, reqCount, completion);
 		}
 		else
 		{
@@ -585,7 +669,7 @@ IOUSBPipeV2::Write(UInt32 streamID, IOMemoryDescriptor *buffer, UInt32 noDataTim
 		}
 		if ( streamID != 0 )
 		{
-			err = controllerV3->Write(streamID, buffer, _address, &_endpoint, completion, noDataTimeout, completionTimeout, reqCount);
+			err = QueueStreamRequest(false, streamID, buffer, noDataTimeout, completionTimeout, reqCount, completion);
 		}
 		else
 		{
@@ -619,15 +703,520 @@ IOUSBPipeV2::CreateStreams(UInt32 maxStreams)
 		USBLog(2,"IOUSBPipeV2[%p]:CreateStreams -- Requested stream creation, but this IOUSBController does not support it", this);
         return kIOReturnUnsupported;
     }
+	
+	// the stream table can't change under requests which are queued or outstanding
+	ret = FreeStreamScheduler();
+	if (ret != kIOReturnSuccess)
+	{
+		USBLog(2,"IOUSBPipeV2[%p]:CreateStreams -- stream requests still in progress, returning 0x%x", this, ret);
+		return ret;
+	}
+	
     ret = controllerV3->CreateStreams(_address, _endpoint.number, _endpoint.direction, maxStreams);
     if(ret == kIOReturnSuccess)
     {
         _configuredStreams = maxStreams;
+		if ((maxStreams > 0) && (maxStreams <= kUSBStreamSchedulerMaxStreams))
+		{
+			if (CreateStreamScheduler(maxStreams) != kIOReturnSuccess)
+			{
+				USBLog(2,"IOUSBPipeV2[%p]:CreateStreams -- could not create the stream scheduler, stream requests go straight to the controller", this);
+			}
+		}
     }
     return(ret);
 }
 
 
+
+#pragma mark Stream Scheduler
+
+//================================================================================================
+//
+//   CreateStreamScheduler
+//
+//================================================================================================
+//
+IOReturn
+IOUSBPipeV2::CreateStreamScheduler(UInt32 maxStreams)
+{
+	IOUSBStreamScheduler	*scheduler;
+	IOUSBStreamState		*streams;
+	
+	if (!_v2PipeExpansionData || !_v2PipeExpansionData->_streamLock)
+		return kIOReturnNotReady;
+	
+	scheduler = (IOUSBStreamScheduler *)IOMalloc(sizeof(IOUSBStreamScheduler));
+	if (!scheduler)
+		return kIOReturnNoMemory;
+	bzero(scheduler, sizeof(IOUSBStreamScheduler));
+	
+	streams = (IOUSBStreamState *)IOMalloc((maxStreams + 1) * sizeof(IOUSBStreamState));
+	if (!streams)
+	{
+		IOFree(scheduler, sizeof(IOUSBStreamScheduler));
+		return kIOReturnNoMemory;
+	}
+	bzero(streams, (maxStreams + 1) * sizeof(IOUSBStreamState));
+	IOUSBStreamSchedulerInit(scheduler, streams, maxStreams);
+	
+	IOLockLock(_v2PipeExpansionData->_streamLock);
+	_v2PipeExpansionData->_streamScheduler = scheduler;
+	IOLockUnlock(_v2PipeExpansionData->_streamLock);
+	
+	USBLog(5, "IOUSBPipeV2[%p]::CreateStreamScheduler - scheduling %d streams", this, (uint32_t)maxStreams);
+	return kIOReturnSuccess;
+}
+
+
+
+//================================================================================================
+//
+//   FreeStreamScheduler
+//
+//	The busy check and taking the scheduler off the pipe happen under the stream lock, which every other user of the
+//	scheduler takes to find it, so nothing can look the scheduler up, or still be using it, once it is freed.
+//
+//================================================================================================
+//
+IOReturn
+IOUSBPipeV2::FreeStreamScheduler(void)
+{
+	IOUSBStreamScheduler	*scheduler;
+	IOUSBStreamRequest		*request;
+	
+	if (!_v2PipeExpansionData || !_v2PipeExpansionData->_streamLock)
+		return kIOReturnSuccess;
+	
+	IOLockLock(_v2PipeExpansionData->_streamLock);
+	scheduler = _v2PipeExpansionData->_streamScheduler;
+	if (scheduler)
+	{
+		// every request holds a retain on the pipe, so this can only fail from CreateStreams
+		if (IOUSBStreamSchedulerBusyLocked(scheduler))
+		{
+			IOLockUnlock(_v2PipeExpansionData->_streamLock);
+			return kIOReturnBusy;
+		}
+		_v2PipeExpansionData->_streamScheduler = NULL;
+	}
+	IOLockUnlock(_v2PipeExpansionData->_streamLock);
+	
+	if (!scheduler)
+		return kIOReturnSuccess;
+	
+	while (!queue_empty(&scheduler->freeRequests))
+	{
+		queue_remove_first(&scheduler->freeRequests, request, IOUSBStreamRequest *, link);
+		IOFree(request, sizeof(IOUSBStreamRequest));
+	}
+	IOFree(scheduler->streams, (scheduler->streamCount + 1) * sizeof(IOUSBStreamState));
+	IOFree(scheduler, sizeof(IOUSBStreamScheduler));
+	return kIOReturnSuccess;
+}
+
+
+
+//================================================================================================
+//
+//   RetainStreamScheduler / ReleaseStreamScheduler
+//
+//	The scheduler, if the pipe has one, counted as in use until ReleaseStreamScheduler so that FreeStreamScheduler
+//	leaves it alone.
+//
+//================================================================================================
+//
+IOUSBStreamScheduler *
+IOUSBPipeV2::RetainStreamScheduler(void)
+{
+	IOUSBStreamScheduler	*scheduler;
+	
+	if (!_v2PipeExpansionData || !_v2PipeExpansionData->_streamLock)
+		return NULL;
+	
+	IOLockLock(_v2PipeExpansionData->_streamLock);
+	scheduler = _v2PipeExpansionData->_streamScheduler;
+	if (scheduler)
+		scheduler->users++;
+	IOLockUnlock(_v2PipeExpansionData->_streamLock);
+	return scheduler;
+}
+
+
+
+void
+IOUSBPipeV2::ReleaseStreamScheduler(IOUSBStreamScheduler *scheduler)
+{
+	IOLockLock(_v2PipeExpansionData->_streamLock);
+	scheduler->users--;
+	IOLockUnlock(_v2PipeExpansionData->_streamLock);
+}
+
+
+
+//================================================================================================
+//
+//   QueueStreamRequest
+//
+//	Starts an asynchronous stream request now, or leaves it with the scheduler until its stream gets a turn.
+//
+//================================================================================================
+//
+IOReturn
+IOUSBPipeV2::QueueStreamRequest(bool isRead, UInt32 streamID, IOMemoryDescriptor *buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, IOUSBCompletion *completion)
+{
+	IOUSBControllerV3		*controllerV3 = OSDynamicCast(IOUSBControllerV3, _controller);
+	IOUSBStreamScheduler	*scheduler;
+	IOUSBStreamRequest		*request = NULL;
+	bool					submit;
+	IOReturn				err;
+	
+	if (!controllerV3)
+		return kIOReturnUnsupported;
+	
+	scheduler = RetainStreamScheduler();
+	if (!scheduler || (streamID > scheduler->streamCount))
+	{
+		if (scheduler)
+			ReleaseStreamScheduler(scheduler);
+		if (isRead)
+			return controllerV3->Read(streamID, buffer, _address, &_endpoint, completion, noDataTimeout, completionTimeout, reqCount);
+		else
+			return controllerV3->Write(streamID, buffer, _address, &_endpoint, completion, noDataTimeout, completionTimeout, reqCount);
+	}
+	
+	IOLockLock(_v2PipeExpansionData->_streamLock);
+	if (!queue_empty(&scheduler->freeRequests))
+		queue_remove_first(&scheduler->freeRequests, request, IOUSBStreamRequest *, link);
+	IOLockUnlock(_v2PipeExpansionData->_streamLock);
+	
+	if (!request)
+	{
+		request = (IOUSBStreamRequest *)IOMalloc(sizeof(IOUSBStreamRequest));
+		if (!request)
+		{
+			ReleaseStreamScheduler(scheduler);
+			return kIOReturnNoMemory;
+		}
+	}
+	bzero(request, sizeof(IOUSBStreamRequest));
+	
+	request->streamID = streamID;
+	request->isRead = isRead;
+	request->buffer = buffer;
+	request->noDataTimeout = noDataTimeout;
+	request->completionTimeout = completionTimeout;
+	request->reqCount = reqCount;
+	request->clientCompletion = *completion;
+	request->queuedTime = mach_absolute_time();
+	
+	// the buffer and the pipe have to stay around while the request waits in the pipe
+	buffer->retain();
+	retain();
+	
+	IOLockLock(_v2PipeExpansionData->_streamLock);
+	submit = IOUSBStreamSchedulerQueueLocked(scheduler, request);
+	IOLockUnlock(_v2PipeExpansionData->_streamLock);
+	
+	err = kIOReturnSuccess;
+	if (submit)
+	{
+		err = SubmitStreamRequest(request);
+		if (err != kIOReturnSuccess)
+		{
+			// the caller gets the error back, so its completion is not called
+			FinishStreamRequest(scheduler, request, err, reqCount, false);
+			DispatchStreamRequests(scheduler);
+			release();
+		}
+	}
+	ReleaseStreamScheduler(scheduler);
+	return err;
+}
+
+
+
+//================================================================================================
+//
+//   SubmitStreamRequest
+//
+//================================================================================================
+//
+IOReturn
+IOUSBPipeV2::SubmitStreamRequest(IOUSBStreamRequest *request)
+{
+	IOUSBControllerV3		*controllerV3 = OSDynamicCast(IOUSBControllerV3, _controller);
+	IOReturn				err;
+	
+	if (!controllerV3)
+		return kIOReturnUnsupported;
+	
+	request->completion.target = this;
+	request->completion.action = &IOUSBPipeV2::StreamRequestComplete;
+	request->completion.parameter = request;
+	
+	if (request->isRead)
+		err = controllerV3->Read(request->streamID, request->buffer, _address, &_endpoint, &request->completion, request->noDataTimeout, request->completionTimeout, request->reqCount);
+	else
+		err = controllerV3->Write(request->streamID, request->buffer, _address, &_endpoint, &request->completion, request->noDataTimeout, request->completionTimeout, request->reqCount);
+	
+	if (err == kIOUSBPipeStalled)
+	{
+		USBLog(2, "IOUSBPipeV2[%p]::SubmitStreamRequest - controller returned stalled pipe, changing status", this);
+		_CORRECTSTATUS = kIOUSBPipeStalled;
+	}
+	return err;
+}
+
+
+
+//================================================================================================
+//
+//   DispatchStreamRequests
+//
+//	Starts waiting requests while the limits allow. The caller has the scheduler retained, or a request counted in it.
+//
+//================================================================================================
+//
+void
+IOUSBPipeV2::DispatchStreamRequests(IOUSBStreamScheduler *scheduler)
+{
+	IOUSBStreamRequest		*request;
+	uint64_t				waited;
+	IOReturn				err;
+	
+	// a failed request drops its retain on the pipe below
+	retain();
+	for (;;)
+	{
+		IOLockLock(_v2PipeExpansionData->_streamLock);
+		request = IOUSBStreamSchedulerNextLocked<IOUSBStreamRequest>(scheduler);
+		if (request)
+		{
+			waited = mach_absolute_time() - request->queuedTime;
+			absolutetime_to_nanoseconds(*(AbsoluteTime *)&waited, &waited);
+			IOUSBStreamSchedulerWaitedLocked(scheduler, request->streamID, waited / 1000);
+		}
+		IOLockUnlock(_v2PipeExpansionData->_streamLock);
+		
+		if (!request)
+			break;
+		
+		err = SubmitStreamRequest(request);
+		if (err != kIOReturnSuccess)
+		{
+			USBLog(3, "IOUSBPipeV2[%p]::DispatchStreamRequests - stream %d request failed to start (0x%x)", this, (uint32_t)request->streamID, err);
+			FinishStreamRequest(scheduler, request, err, request->reqCount, true);
+			release();
+		}
+	}
+	release();
+}
+
+
+
+//================================================================================================
+//
+//   FinishStreamRequest
+//
+//	Accounts for a request which is done, calls the client's completion if asked to, and recycles the request. The caller
+//	has the scheduler retained, and drops the request's retain on the pipe.
+//
+//================================================================================================
+//
+void
+IOUSBPipeV2::FinishStreamRequest(IOUSBStreamScheduler *scheduler, IOUSBStreamRequest *request, IOReturn status, UInt32 bufferSizeRemaining, bool callClient)
+{
+	IOUSBCompletion			clientCompletion = request->clientCompletion;
+	IOMemoryDescriptor		*buffer = request->buffer;
+	
+	IOLockLock(_v2PipeExpansionData->_streamLock);
+	IOUSBStreamSchedulerFinishLocked(scheduler, request, status, bufferSizeRemaining);
+	IOLockUnlock(_v2PipeExpansionData->_streamLock);
+	
+	if (callClient)
+		(*clientCompletion.action)(clientCompletion.target, clientCompletion.parameter, status, bufferSizeRemaining);
+	
+	buffer->release();
+}
+
+
+
+//================================================================================================
+//
+//   AbortStreamRequests
+//
+//	Completes the requests of a stream (or of all streams) which are still waiting in the pipe with kIOReturnAborted.
+//
+//================================================================================================
+//
+void
+IOUSBPipeV2::AbortStreamRequests(UInt32 streamID)
+{
+	IOUSBStreamScheduler	*scheduler = RetainStreamScheduler();
+	IOUSBStreamRequest		*request;
+	queue_head_t			aborted;
+	UInt32					first, last;
+	
+	if (!scheduler)
+		return;
+	
+	if (streamID == kUSBAllStreams)
+	{
+		first = 1;
+		last = scheduler->streamCount;
+	}
+	else if (streamID <= scheduler->streamCount)
+	{
+		first = last = streamID;
+	}
+	else
+	{
+		ReleaseStreamScheduler(scheduler);
+		return;
+	}
+	
+	queue_init(&aborted);
+	
+	IOLockLock(_v2PipeExpansionData->_streamLock);
+	IOUSBStreamSchedulerAbortLocked<IOUSBStreamRequest>(scheduler, first, last, &aborted);
+	IOLockUnlock(_v2PipeExpansionData->_streamLock);
+	
+	while (!queue_empty(&aborted))
+	{
+		queue_remove_first(&aborted, request, IOUSBStreamRequest *, link);
+		FinishStreamRequest(scheduler, request, kIOReturnAborted, request->reqCount, true);
+		release();
+	}
+	ReleaseStreamScheduler(scheduler);
+}
+
+
+
+//================================================================================================
+//
+//   StreamRequestComplete
+//
+//================================================================================================
+//
+void
+IOUSBPipeV2::StreamRequestComplete(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining)
+{
+	IOUSBPipeV2				*me = (IOUSBPipeV2 *)target;
+	IOUSBStreamRequest		*request = (IOUSBStreamRequest *)parameter;
+	IOUSBStreamScheduler	*scheduler;
+	
+	if (!me || !request)
+		return;
+	
+	// the request is still counted as outstanding, so the scheduler is there to retain
+	scheduler = me->RetainStreamScheduler();
+	if (!scheduler)
+		return;
+	
+	me->FinishStreamRequest(scheduler, request, status, bufferSizeRemaining, true);
+	
+	// the completion freed up room with the controller
+	me->DispatchStreamRequests(scheduler);
+	me->ReleaseStreamScheduler(scheduler);
+	me->release();
+}
+
+
+
+//================================================================================================
+//
+//   SetStreamWeight
+//
+//================================================================================================
+//
+IOReturn
+IOUSBPipeV2::SetStreamWeight(UInt32 streamID, UInt32 weight)
+{
+	IOUSBStreamScheduler	*scheduler = RetainStreamScheduler();
+	IOReturn				err = kIOReturnSuccess;
+	
+	if (!scheduler)
+		return kIOReturnNotReady;
+	
+	if ((streamID == 0) || (streamID > scheduler->streamCount) || (weight == 0))
+		err = kIOReturnBadArgument;
+	else
+	{
+		IOLockLock(_v2PipeExpansionData->_streamLock);
+		scheduler->streams[streamID].stats.weight = weight;
+		IOLockUnlock(_v2PipeExpansionData->_streamLock);
+	}
+	
+	ReleaseStreamScheduler(scheduler);
+	return err;
+}
+
+
+
+//================================================================================================
+//
+//   SetStreamOutstandingLimits
+//
+//================================================================================================
+//
+IOReturn
+IOUSBPipeV2::SetStreamOutstandingLimits(UInt32 maxOutstandingPerStream, UInt32 maxOutstanding)
+{
+	IOUSBStreamScheduler	*scheduler = RetainStreamScheduler();
+	
+	if (!scheduler)
+		return kIOReturnNotReady;
+	
+	if ((maxOutstandingPerStream == 0) || (maxOutstanding == 0))
+	{
+		ReleaseStreamScheduler(scheduler);
+		return kIOReturnBadArgument;
+	}
+	
+	IOLockLock(_v2PipeExpansionData->_streamLock);
+	scheduler->maxOutstandingPerStream = maxOutstandingPerStream;
+	scheduler->maxOutstanding = maxOutstanding;
+	IOLockUnlock(_v2PipeExpansionData->_streamLock);
+	
+	// raising a limit may let waiting requests go
+	DispatchStreamRequests(scheduler);
+	ReleaseStreamScheduler(scheduler);
+	
+	return kIOReturnSuccess;
+}
+
+
+
+//================================================================================================
+//
+//   GetStreamStatistics
+//
+//================================================================================================
+//
+IOReturn
+IOUSBPipeV2::GetStreamStatistics(UInt32 streamID, IOUSBStreamStatistics *statistics)
+{
+	IOUSBStreamScheduler	*scheduler = RetainStreamScheduler();
+	IOReturn				err = kIOReturnSuccess;
+	
+	if (!scheduler)
+		return kIOReturnNotReady;
+	
+	if ((streamID == 0) || (streamID > scheduler->streamCount) || !statistics)
+		err = kIOReturnBadArgument;
+	else
+	{
+		IOLockLock(_v2PipeExpansionData->_streamLock);
+		*statistics = scheduler->streams[streamID].stats;
+		IOLockUnlock(_v2PipeExpansionData->_streamLock);
+	}
+	
+	ReleaseStreamScheduler(scheduler);
+	return err;
+}
+
+
 #pragma mark Accessors
 
 //================================================================================================
@@ -0,0 +1,144 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * Copyright (c) 1998-2012 Apple Inc.  All Rights Reserved.
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <libkern/c++/OSDictionary.h>
+#include <libkern/c++/OSNumber.h>
+
+#include <IOKit/IOLib.h>
+
+#include <IOKit/usb/IOUSBTransferStatistics.h>
+
+OSDefineMetaClassAndStructors(IOUSBDeviceTransferStatistics, OSObject)
+
+IOUSBDeviceTransferStatistics *
+IOUSBDeviceTransferStatistics::withAddress(USBDeviceAddress address)
+{
+	IOUSBDeviceTransferStatistics	*statistics = new IOUSBDeviceTransferStatistics;
+	
+	if (statistics && !statistics->init())
+	{
+		statistics->release();
+		statistics = NULL;
+	}
+	
+	if (statistics)
+	{
+		statistics->_address = address;
+		bzero(statistics->_endpoints, sizeof(statistics->_endpoints));
+	}
+	
+	return statistics;
+}
+
+
+
+void
+IOUSBDeviceTransferStatistics::Snapshot(IOUSBTransferSnapshot *snapshot) const
+{
+	AbsoluteTime	now;
+	
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now, &snapshot->timeStampNS);
+	bcopy(_endpoints, snapshot->endpoints, sizeof(snapshot->endpoints));
+}
+
+
+
+static void
+SetNumber(OSDictionary *dictionary, const char *name, UInt64 value)
+{
+	OSNumber	*number = OSNumber::withNumber(value, 64);
+	
+	if (!number)
+		return;
+	
+	dictionary->setObject(name, number);
+	number->release();
+}
+
+
+
+bool
+IOUSBDeviceTransferStatistics::serialize(OSSerialize *s) const
+{
+	IOUSBTransferSnapshot	*snapshot;
+	OSDictionary			*dictionary;
+	OSDictionary			*endpoints;
+	bool					ok = false;
+	UInt32					i;
+	
+	// the snapshot is too big for the stack of whoever is serializing us
+	snapshot = (IOUSBTransferSnapshot *)IOMalloc(sizeof(IOUSBTransferSnapshot));
+	if (!snapshot)
+		return false;
+	
+	Snapshot(snapshot);
+	
+	dictionary = OSDictionary::withCapacity(3);
+	endpoints = OSDictionary::withCapacity(4);
+	if (dictionary && endpoints)
+	{
+		SetNumber(dictionary, "Address", _address);
+		SetNumber(dictionary, "TimeStampNS", snapshot->timeStampNS);
+		
+		// only the endpoints which have been used - the key is the endpoint address, e.g. 0x81 for endpoint 1 IN
+		for (i = 0; i < kUSBTransferStatisticsEndpoints; i++)
+		{
+			IOUSBEndpointTransferCounters	*counters = &snapshot->endpoints[i];
+			OSDictionary					*endpoint;
+			char							key[8];
+			
+			if (!counters->transfers && !counters->maxQueueDepth)
+				continue;
+			
+			endpoint = OSDictionary::withCapacity(8);
+			if (!endpoint)
+				continue;
+			
+			SetNumber(endpoint, "Transfers", counters->transfers);
+			SetNumber(endpoint, "Bytes", counters->bytes);
+			SetNumber(endpoint, "Errors", counters->errors);
+			SetNumber(endpoint, "Stalls", counters->stalls);
+			SetNumber(endpoint, "Timeouts", counters->timeouts);
+			SetNumber(endpoint, "ShortPackets", counters->shortPackets);
+			SetNumber(endpoint, "QueueDepth", counters->queueDepth);
+			SetNumber(endpoint, "MaxQueueDepth", counters->maxQueueDepth);
+			
+			snprintf(key, sizeof(key), "0x%02x", (unsigned int)((i & 0x0F) | ((i & 16) ? 0x80 : 0)));
+			endpoints->setObject(key, endpoint);
+			endpoint->release();
+		}
+		dictionary->setObject("Endpoints", endpoints);
+		
+		ok = dictionary->serialize(s);
+	}
+	
+	if (endpoints)
+		endpoints->release();
+	if (dictionary)
+		dictionary->release();
+	IOFree(snapshot, sizeof(IOUSBTransferSnapshot));
+	
+	return ok;
+}
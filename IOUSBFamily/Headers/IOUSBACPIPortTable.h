@@ -0,0 +1,92 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _IOKIT_IOUSBACPIPORTTABLE_H
+#define _IOKIT_IOUSBACPIPORTTABLE_H
+
+#include <IOKit/usb/USB.h>
+
+//
+// The controller's table of what the ACPI plane says about the USB port objects below it, built by one walk of the plane
+// (IOUSBController::BuildACPIPortTable) so that each hub port question doesn't walk it and evaluate _UPC and HERB again.
+//
+
+enum
+{
+	kUSBACPIPortHasUPC				= 0x01,
+	kUSBACPIPortInternal			= 0x02,				// _UPC says proprietary connector
+	kUSBACPIPortConnectable			= 0x04,				// _UPC says the port is user visible and connectable
+	kUSBACPIPortHasHERB				= 0x08
+};
+
+// what the ACPI tables say about one port object
+struct IOUSBACPIPortEntry
+{
+	UInt32						port;				// from the location of the object in the ACPI plane
+	int							acpiDepth;
+	UInt8						flags;
+	UInt8						connectorType;
+	UInt32						hubErrata;			// the HERB value if kUSBACPIPortHasHERB is set
+};
+
+// Records a _UPC package: element 0 is the connectable flag and element 1 the connector type, either may be missing
+static inline void
+IOUSBACPIPortEntrySetUPC(IOUSBACPIPortEntry *entry, bool hasConnectable, UInt8 connectable, bool hasConnector, UInt8 connector)
+{
+	if ( hasConnector )
+	{
+		entry->flags |= kUSBACPIPortHasUPC;
+		entry->connectorType = connector;
+		
+		// express card slots are connectable to external devices, only a proprietary connector is internal
+		if ( connector == kUSBProprietaryConnector )
+			entry->flags |= kUSBACPIPortInternal;
+	}
+	if ( hasConnectable && connectable )
+		entry->flags |= kUSBACPIPortConnectable;
+}
+
+static inline void
+IOUSBACPIPortEntrySetHERB(IOUSBACPIPortEntry *entry, UInt32 hubErrata)
+{
+	entry->flags |= kUSBACPIPortHasHERB;
+	entry->hubErrata = hubErrata;
+}
+
+// The first entry in ACPI order for this port at this ACPI depth which has all of flags set, as the walks of the ACPI plane
+// this table replaces would have found it
+static inline const IOUSBACPIPortEntry *
+IOUSBACPIPortTableFind(const IOUSBACPIPortEntry *entries, UInt32 count, UInt32 port, int acpiDepth, UInt8 flags)
+{
+	UInt32		i;
+	
+	for (i = 0; i < count; i++)
+		if ( (entries[i].port == port) && (entries[i].acpiDepth == acpiDepth) && ((entries[i].flags & flags) == flags) )
+			return &entries[i];
+	
+	return NULL;
+}
+
+#endif /* _IOKIT_IOUSBACPIPORTTABLE_H */
@@ -0,0 +1,148 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _IOKIT_IOUSBADDRESSMAP_H
+#define _IOKIT_IOUSBADDRESSMAP_H
+
+#include <IOKit/usb/USB.h>
+
+//
+// The USB address maps of a controller, kept as three bitmaps: reserved (handed out but not yet a started IOUSBDevice), attached (a
+// started IOUSBDevice) and quarantined (recently released). Allocation is a find-first-zero over the union of the three. A released
+// address stays quarantined for a while so that a stale completion or request for the old device does not reach a new device which
+// happens to get the same address, and when nothing else is free the address which has been quarantined the longest is reused.
+//
+// The controller serializes these calls under its address lock. Times are in nanoseconds.
+//
+
+enum
+{
+	kUSBAddressMapWords				= kUSBMaxDevices / 32
+};
+
+struct IOUSBAddressMap
+{
+	UInt32				reserved[kUSBAddressMapWords];
+	UInt32				attached[kUSBAddressMapWords];
+	UInt32				quarantined[kUSBAddressMapWords];
+	UInt64				releasedTime[kUSBMaxDevices];		// when each quarantined address was released
+};
+
+static inline UInt32
+IOUSBAddressMapBit(USBDeviceAddress address)
+{
+	return 1U << (address % 32);
+}
+
+// returns a free address, now reserved, or 0 if every address is reserved or attached
+static inline USBDeviceAddress
+IOUSBAddressMapAllocate(IOUSBAddressMap *map, UInt64 now, UInt64 quarantineNS)
+{
+	UInt64				oldestTime = 0;
+	USBDeviceAddress	oldest = 0;
+	int					word;
+	
+	// let go of the quarantined addresses whose time is up, and remember the oldest one in case nothing else is free
+	for (word = 0; word < kUSBAddressMapWords; word++)
+	{
+		UInt32		quarantined = map->quarantined[word];
+		
+		while (quarantined)
+		{
+			int			bit = __builtin_ctz(quarantined);
+			int			index = (word * 32) + bit;
+			
+			quarantined &= ~(1U << bit);
+			if ((now - map->releasedTime[index]) >= quarantineNS)
+				map->quarantined[word] &= ~(1U << bit);
+			else if (!oldest || (map->releasedTime[index] < oldestTime))
+			{
+				oldest = index;
+				oldestTime = map->releasedTime[index];
+			}
+		}
+	}
+	
+	for (word = 0; word < kUSBAddressMapWords; word++)
+	{
+		UInt32		busy = map->reserved[word] | map->attached[word] | map->quarantined[word];
+		
+		if (word == 0)
+			busy |= 1;										// address 0 is never assigned
+		
+		if (busy != 0xFFFFFFFF)
+		{
+			USBDeviceAddress	address = (word * 32) + __builtin_ctz(~busy);
+			
+			map->reserved[word] |= IOUSBAddressMapBit(address);
+			return address;
+		}
+	}
+	
+	if (oldest)
+	{
+		map->quarantined[oldest / 32] &= ~IOUSBAddressMapBit(oldest);
+		map->reserved[oldest / 32] |= IOUSBAddressMapBit(oldest);
+	}
+	
+	return oldest;
+}
+
+// reserves an address which the caller picked itself (it is normally reserved already)
+static inline void
+IOUSBAddressMapClaim(IOUSBAddressMap *map, USBDeviceAddress address)
+{
+	map->quarantined[address / 32] &= ~IOUSBAddressMapBit(address);
+	map->reserved[address / 32] |= IOUSBAddressMapBit(address);
+}
+
+// the IOUSBDevice at a reserved address has started
+static inline void
+IOUSBAddressMapAttach(IOUSBAddressMap *map, USBDeviceAddress address)
+{
+	map->reserved[address / 32] &= ~IOUSBAddressMapBit(address);
+	map->attached[address / 32] |= IOUSBAddressMapBit(address);
+}
+
+// frees a reserved or attached address, quarantining it unless quarantine is false - returns false if the address was not in use
+static inline bool
+IOUSBAddressMapRelease(IOUSBAddressMap *map, USBDeviceAddress address, UInt64 now, bool quarantine)
+{
+	UInt32		mask = IOUSBAddressMapBit(address);
+	
+	if (!((map->reserved[address / 32] | map->attached[address / 32]) & mask))
+		return false;
+	
+	map->reserved[address / 32] &= ~mask;
+	map->attached[address / 32] &= ~mask;
+	if (quarantine)
+	{
+		map->quarantined[address / 32] |= mask;
+		map->releasedTime[address] = now;
+	}
+	return true;
+}
+
+#endif /* _IOKIT_IOUSBADDRESSMAP_H */
@@ -28,7 +28,9 @@
 #include <IOKit/IOCommandPool.h>
 #include <IOKit/IOMemoryDescriptor.h>
 #include <IOKit/IODMACommand.h>
+#include <IOKit/IOLocks.h>
 #include <IOKit/usb/USB.h>
+#include <IOKit/usb/IOUSBCommandCache.h>
 
 /*
  * USB Command
@@ -54,6 +56,17 @@ typedef enum {
 
 #define 	kUSBCommandScratchBuffers	10
 
+// Groups of IOUSBCommand fields which only some transfers use. Each group carries the generation in which it was last written, and a group
+// from an older generation reads back as zero, so returning a command to the pool (which starts a new generation) resets them all at once.
+enum
+{
+	kUSBCommandControlState				= 0,			// request, data remaining, stage
+	kUSBCommandDisjointState			= 1,			// original buffer, disjoint completion, double buffer length
+	kUSBCommandTransactionState			= 2,			// multi transfer flags, time stamp
+	kUSBCommandScratchState				= 3,			// UIM scratch
+	kUSBCommandColdStates				= 4
+};
+
 /*!
  @class IOUSBCommand
  @abstract A subclass of IOCommand that is used to add USB specific data.
@@ -100,6 +113,8 @@ protected:
 		UInt32				_streamID;
 #endif
 		void *				_backTrace[kUSBCommandScratchBuffers];
+		UInt32				_generation;							// advanced each time the command goes back to the pool
+		UInt32				_stateGeneration[kUSBCommandColdStates];	// generation in which each group of cold fields was last written
     };
     ExpansionData * 		_expansionData;
     
@@ -107,10 +122,16 @@ protected:
     virtual bool init();
     virtual void free();
 
+	void					ClaimColdState(UInt32 state);
+	inline bool				ColdStateValid(UInt32 state)					{ return _expansionData->_stateGeneration[state] == _expansionData->_generation; }
+
 public:
 
     // static constructor
     static IOUSBCommand *	NewCommand(void);
+	
+	// invalidates all of the cold field groups in one step, and clears the stream ID (which the inline accessors read directly)
+	void					NewGeneration(void);
 
     // Manipulators
     void					SetSelector(usbCommand sel);
@@ -264,16 +285,63 @@ public:
 	bool					GetLowLatency(void)								{ return _expansionData->_lowLatency; }
 };
 
+class IOService;
+
+/*!
+ @class IOUSBCommandPool
+ @abstract An IOCommandPool with small per-CPU caches in front of it.
+ @discussion getCommand and returnCommand are satisfied from the cache of the current CPU under a per-cache spin lock without
+	taking the command gate. A miss refills the cache with kUSBCommandPoolCacheBatch commands from the pool in a single gated call, and a
+	full cache returns a batch to the pool the same way. When the pool itself is empty a miss takes a command from another CPU's cache,
+	so getCommand(false) returns NULL (and the caller grows the pool) only when every free command is in use. While a getCommand(true) is
+	waiting, returned commands go straight to the pool so that they wake it.
+ */
 class IOUSBCommandPool : public IOCommandPool
 {
     OSDeclareDefaultStructors( IOUSBCommandPool )
 	
 protected:
+	typedef IOUSBCommandCache	CommandCache;
+	
+	struct ExpansionData
+	{
+		CommandCache		caches[kUSBCommandPoolCaches];
+		UInt32				freeInPool;						// commands on the gated queue (not counting the caches)
+		UInt32				growEvents;						// misses which found the pool and every cache empty as well
+		UInt32				drains;							// full caches returned to the pool
+		UInt32				idleTicks;
+		UInt32				lastActivity;					// cache hits plus misses at the last call to TrimIdleCaches
+		UInt32				lastPublishedHits;
+		UInt32				lastPublishedMisses;
+		UInt32				steals;							// misses satisfied from another CPU's cache
+		volatile SInt32		blockedGetters;					// getCommand(true) callers waiting on the pool
+	};
+	ExpansionData *			_expansionData;
+	
     virtual IOReturn gatedReturnCommand(IOCommand * command);
 	virtual IOReturn gatedGetCommand(IOCommand ** command, bool blockForCommand);
+	virtual void	free();
+	
+	IOReturn				ScrubCommand(IOCommand * command);
+	static IOReturn			gatedRefillCache(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+	static IOReturn			gatedDrainCache(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+	static IOReturn			gatedReturnCommands(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+	static IOReturn			gatedReleaseIdleCommands(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
 	
 public:
     static IOCommandPool * withWorkLoop(IOWorkLoop * inWorkLoop);
+	
+	virtual bool			initWithWorkLoop(IOWorkLoop * inWorkLoop);
+	virtual IOCommand *		getCommand(bool blockForCommand = true);
+	virtual void			returnCommand(IOCommand * command);
+	
+	// returns a batch of commands, taking the cache lock once and the command gate at most once
+	void					returnCommands(IOCommand ** commands, UInt32 count);
+	
+	// called periodically by the controller with the number of commands it has allocated to the pool - releases free commands until
+	// no more than keep are allocated, and returns the number released (which the caller must account for)
+	UInt32					TrimIdleCaches(UInt32 allocated, UInt32 keep);
+	void					PublishStatistics(IOService * provider, const char * key);
 };
 
 
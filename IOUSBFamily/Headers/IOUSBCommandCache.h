@@ -0,0 +1,158 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _IOKIT_IOUSBCOMMANDCACHE_H
+#define _IOKIT_IOUSBCOMMANDCACHE_H
+
+#include <IOKit/IOCommand.h>
+#include <IOKit/IOLocks.h>
+#include <libkern/OSAtomic.h>
+
+//
+// The per-CPU command caches of IOUSBCommandPool, and the checks it makes when a command comes back. Kept apart from the pool (which
+// needs the command gate) so that the cache and claim rules can be exercised on their own.
+//
+
+enum
+{
+	kUSBCommandPoolCaches				= 8,			// number of per-CPU command caches (CPUs beyond this share a cache)
+	kUSBCommandPoolCacheDepth			= 16,			// commands a single cache can hold
+	kUSBCommandPoolCacheBatch			= 8,			// commands moved between a cache and the pool at a time
+	kUSBCommandPoolIdleTicks			= 30			// idle calls to TrimIdleCaches before the caches are drained
+};
+
+struct IOUSBCommandCache
+{
+	IOSimpleLock *		lock;
+	UInt32				count;
+	UInt32				peak;
+	UInt32				hits;
+	UInt32				misses;
+	IOCommand *			commands[kUSBCommandPoolCacheDepth];
+};
+
+//
+// A command which has been handed out has a self-linked fCommandChain (or a NULL one, if it was never in the pool). Returning it swaps
+// fCommandChain.next from either of those to owner in a single compare and swap, so that of two threads returning the same command at
+// the same moment exactly one gets it back. A command which is in a cache or on the pool's queue has its chain pointing elsewhere and
+// cannot be claimed at all.
+//
+static inline void
+IOUSBCommandHandOut(IOCommand *command)
+{
+	queue_init(&command->fCommandChain);
+}
+
+static inline bool
+IOUSBCommandClaim(IOCommand *command, void *owner)
+{
+	void * volatile		*next = (void * volatile *)&command->fCommandChain.next;
+	
+	if (!OSCompareAndSwapPtr(&command->fCommandChain, owner, next) && !OSCompareAndSwapPtr(NULL, owner, next))
+		return false;
+	
+	command->fCommandChain.prev = (queue_entry_t)owner;
+	return true;
+}
+
+static inline IOCommand *
+IOUSBCommandCacheGet(IOUSBCommandCache *cache)
+{
+	IOCommand		*command = NULL;
+	
+	IOSimpleLockLock(cache->lock);
+	if (cache->count)
+	{
+		command = cache->commands[--cache->count];
+		cache->hits++;
+	}
+	else
+		cache->misses++;
+	IOSimpleLockUnlock(cache->lock);
+	
+	return command;
+}
+
+// puts as many of the commands as fit in the cache, marking each one as cached - returns the number which went in
+static inline UInt32
+IOUSBCommandCachePut(IOUSBCommandCache *cache, IOCommand **commands, UInt32 count)
+{
+	UInt32			i;
+	
+	IOSimpleLockLock(cache->lock);
+	for (i = 0; (i < count) && (cache->count < kUSBCommandPoolCacheDepth); i++)
+	{
+		commands[i]->fCommandChain.next = commands[i]->fCommandChain.prev = (queue_entry_t)cache;
+		cache->commands[cache->count++] = commands[i];
+	}
+	if (cache->count > cache->peak)
+		cache->peak = cache->count;
+	IOSimpleLockUnlock(cache->lock);
+	
+	return i;
+}
+
+// takes up to max commands out of the cache without counting a hit (for draining the cache, or stealing from it)
+static inline UInt32
+IOUSBCommandCacheTake(IOUSBCommandCache *cache, IOCommand **commands, UInt32 max)
+{
+	UInt32			count = 0;
+	
+	IOSimpleLockLock(cache->lock);
+	while (cache->count && (count < max))
+		commands[count++] = cache->commands[--cache->count];
+	IOSimpleLockUnlock(cache->lock);
+	
+	return count;
+}
+
+// counts an idle call, returning true when the caches have seen no gets or returns for kUSBCommandPoolIdleTicks calls in a row
+static inline bool
+IOUSBCommandPoolIdleCheck(UInt32 activity, UInt32 *lastActivity, UInt32 *idleTicks)
+{
+	if (activity != *lastActivity)
+	{
+		*lastActivity = activity;
+		*idleTicks = 0;
+		return false;
+	}
+	
+	if (++(*idleTicks) < kUSBCommandPoolIdleTicks)
+		return false;
+	
+	*idleTicks = 0;
+	return true;
+}
+
+// how many free commands to release so that no more than keep remain allocated (commands in use are never released)
+static inline UInt32
+IOUSBCommandPoolTrimCount(UInt32 allocated, UInt32 keep, UInt32 freeCount)
+{
+	UInt32			excess = (allocated > keep) ? (allocated - keep) : 0;
+	
+	return (excess < freeCount) ? excess : freeCount;
+}
+
+#endif /* _IOKIT_IOUSBCOMMANDCACHE_H */
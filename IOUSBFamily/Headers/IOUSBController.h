@@ -44,9 +44,20 @@
 #include <IOKit/usb/IOUSBNub.h>
 #include <IOKit/usb/IOUSBCommand.h>
 #include <IOKit/usb/IOUSBWorkLoop.h>
+#include <IOKit/usb/USBErrata.h>
+#include <IOKit/usb/IOUSBDeviceZeroArbiter.h>
+#include <IOKit/usb/IOUSBAddressMap.h>
+#include <IOKit/usb/IOUSBDescriptorCache.h>
+#include <IOKit/usb/IOUSBHandoffRing.h>
+#include <IOKit/usb/IOUSBACPIPortTable.h>
 
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 
+struct IOUSBSyncCompletionTarget;
+struct IOUSBCompletionBatch;
+struct IOUSBPolledEndpoint;
+class IOInterruptEventSource;
+class IOUSBDeviceTransferStatistics;
 
 //================================================================================================
 //
@@ -90,31 +101,51 @@ enum
     kUSBWatchdogTimeoutMS = 1000
 };
 
+enum
+{
+	kUSBDefaultAddressQuarantineMS	= 1000					// a freed address is not handed out again for this long unless we run out
+};
 
-/*!
-    @struct
-    @discussion This table contains the list of errata that are necessary for known problems with particular devices.
-    The format is vendorID, product ID, lowest revisionID needing errata, highest rev needing errata, errataBits.
-    The result of all matches is ORed together, so more than one entry may match.
-    Typically for a given errata a list of revisions that this applies to is supplied.
-     @field vendID      The Vendor ID of the device
-     @field deviceID    Product ID of device
-     @field revisionLo  Lowest product revsion to apply errata to
-     @field revisionHi  Highest product revision to apply errata to
-     @field errata      Bit field flagging which errata to apply to device.
-*/
+enum
+{
+	kUSBDefaultSyncSpinUS			= 20,					// how long a synchronous transfer polls for its completion before it sleeps
+	kUSBSyncSpinMaxBytes			= 64					// only transfers up to this size poll at all
+};
+
+enum
+{
+	kUSBCompletionBatchMax			= 64,					// completions held back during one scavenge pass before they are flushed anyway
+	kUSBCompletionBatchMaxClients	= 8,					// completion actions which can register a batch completion
+	kUSBCompletionHandoffSlots		= 8						// scavenge passes which can wait for the completion thread
+};
 
-struct ErrataListEntryStruct
+enum
 {
-    UInt16 				vendID;
-    UInt16 				deviceID;
-    UInt16 				revisionLo;
-    UInt16 				revisionHi;
-    UInt32 				errata;
+	kUSBMaxPolledEndpoints			= 4						// endpoints which can have resources set aside for PolledRead
 };
 
-typedef struct ErrataListEntryStruct  ErrataListEntry, *ErrataListEntryPtr;
+/*!
+ @struct IOUSBBatchCompletionResult
+ @abstract One finished transfer, as handed to an IOUSBBatchCompletionAction.
+ @field parameter The parameter of the IOUSBCompletion the transfer was queued with.
+ @field status Completion status of the transfer.
+ @field bufferSizeRemaining Bytes left over in the buffer, as passed to an IOUSBCompletionAction.
+ */
+struct IOUSBBatchCompletionResult
+{
+	void *			parameter;
+	IOReturn		status;
+	UInt32			bufferSizeRemaining;
+};
 
+/*!
+ @typedef IOUSBBatchCompletionAction
+ @abstract Called once with every transfer for the same target which finished in one scavenge pass, in the order they finished.
+ @param target The target of the IOUSBCompletion the transfers were queued with.
+ @param results The finished transfers. The array is only valid for the duration of the call.
+ @param count Number of entries in results.
+ */
+typedef void (*IOUSBBatchCompletionAction)(void * target, IOUSBBatchCompletionResult * results, UInt32 count);
 
 struct SleepCurrentPerModelStruct
 {
@@ -200,7 +231,7 @@ protected:
         UInt32				_currentSizeOfIsocCommandPool;
         UInt8				_controllerSpeed;					// Controller speed, passed down for splits
         thread_call_t		_terminatePCCardThread;				// Obsolete
-        bool				_addressPending[kUSBMaxDevices+2];
+        bool				_addressPending[kUSBMaxDevices+2];	// Obsolete - replaced by the address maps below, kept so that the fields after it do not move
 		SInt32				_activeIsochTransfers;				// isochronous transfers in the queue
 		IOService			*_provider;							// common name for our provider
 		bool				_controllerCanSleep;				// true iff the controller is able to support sleep/wake
@@ -210,6 +241,24 @@ protected:
 #ifdef SUPPORTS_SS_USB
 		IOUSBRootHubDevice	*_rootHubDeviceSS;
 #endif
+		IOUSBDeviceZeroArbiter	_devZeroArbiter;				// deadline and hold time bookkeeping for _devZeroLock
+		IOSimpleLock		*_addressLock;						// protects _addressMap
+		IOUSBAddressMap		_addressMap;
+		UInt32				_addressQuarantineMS;
+		IOUSBDescriptorCache	*_descriptorCache;				// descriptors of devices seen before, keyed by IOUSBDevice::GetDescriptorCacheKey
+		IOLock				*_descriptorCacheLock;
+		bool				_descriptorCacheChanged;
+		IOLock				*_syncWaitLock;						// synchronous transfers sleep on this instead of the command gate
+		UInt32				_syncSpinUS;
+		IOUSBCompletionBatch	*_completionBatch;				// completions and commands held back until the end of a scavenge pass
+		OSData				*_acpiPortTable;					// IOUSBACPIPortEntry for every ACPI port object under _acpiPortTableProvider
+		IORegistryEntry		*_acpiPortTableProvider;			// not retained - only compared against
+		IOLock				*_acpiPortTableLock;
+		bool				_acpiPortTableValid;
+		IONotifier			*_acpiPublishNotifier;				// ACPI objects coming and going invalidate the table
+		IONotifier			*_acpiTerminateNotifier;
+		IOUSBDeviceTransferStatistics	*_transferStatistics[kUSBMaxDevices];	// per address, only changed on the workloop
+		IOUSBPolledEndpoint	*_polledEndpoints;					// kUSBMaxPolledEndpoints slots, allocated by the first RegisterPolledEndpoint
     };
     ExpansionData *_expansionData;
 	
@@ -226,6 +275,36 @@ public:
 	
     void 				ReturnUSBCommand( IOUSBCommand *  command );
 	
+	/*!
+	 @function ReleaseAddress
+	 @abstract Gives a USB address back to the controller when the device using it goes away.
+	 @discussion The address is quarantined for a while before GetNewAddress hands it out again, so that late completions
+		or stale requests for the old device do not reach a new one.
+	 @param address The address to release.
+	 */
+	void				ReleaseAddress( USBDeviceAddress address );
+	
+	/*!
+	 @function CopyCachedDescriptor
+	 @abstract Looks up a descriptor which a device with the same identity returned earlier on this controller.
+	 @discussion The cache outlives IOUSBDevice objects, so it covers resets, re-enumeration and sleep/wake. An entry is only used
+		while the device descriptor it was stored with is identical to devDesc.
+	 @param key Identity of the device, from IOUSBDevice::GetDescriptorCacheKey.
+	 @param devDesc The full device descriptor the device just returned.
+	 @param type Descriptor type (kUSBConfDesc or kUSBStringDesc).
+	 @param index Descriptor index.
+	 @param lang Language ID for string descriptors, 0 otherwise.
+	 @param requestsSaved Number of bus requests a hit saves, for the statistics.
+	 @result The descriptor (retained) or NULL.
+	 */
+	OSData *			CopyCachedDescriptor( const char *key, const IOUSBDeviceDescriptor *devDesc, UInt8 type, UInt8 index, UInt16 lang, UInt32 requestsSaved );
+	
+	/*!
+	 @function CacheDescriptor
+	 @abstract Remembers a descriptor fetched over the bus for CopyCachedDescriptor.
+	 */
+	void				CacheDescriptor( const char *key, const IOUSBDeviceDescriptor *devDesc, UInt8 type, UInt8 index, UInt16 lang, const void *bytes, UInt32 length );
+	
 protected:
 		
     IOReturn			getNubResources( IOService *  regEntry );
@@ -327,9 +406,38 @@ protected:
     static void 		TerminatePCCard(OSObject *target);
 
     static IOReturn		ProtectedDevZeroLock(OSObject *target, void* lock, void *, void *, void*);
+	void				PublishDeviceZeroStatistics(void);
+	void				PublishDescriptorCacheStatistics(void);
+	IOReturn			RunTransfer( IOCommandGate::Action transferAction, IOUSBCommand *command );
+	IOReturn			WaitForSyncTransfer( IOUSBSyncCompletionTarget *syncTarget, IOUSBCommand *command );
+	bool				CanBatchCompletion( void );
+	void				ReturnCompletedCommand( IOUSBCommand *command );
+	void				CompleteClient( IOUSBCompletion completion, IOReturn status, UInt32 bufferSizeRemaining );
+	void				CompleteClientWithTimeStamp( IOUSBCompletionWithTimeStamp completion, IOReturn status, UInt32 bufferSizeRemaining, AbsoluteTime timeStamp );
+	void				FlushCompletionBatch( void );
+	void				PublishCompletionBatchStatistics( void );
+	static IOReturn		GatedRegisterBatchCompletion( OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3 );
+	bool				StartCompletionThread( void );
+	void				StopCompletionThread( void );
+	static IOReturn		GatedStopCompletionThread( OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3 );
+	void				QueueCompletionHandoff( void );
+	void				DispatchCompletionHandoffs( void );
+	void				WaitForCompletionThread( void );
+	IOUSBDeviceTransferStatistics *	GetTransferStatistics( USBDeviceAddress address );
+	void				SetTransferStatistics( USBDeviceAddress address, IOUSBDeviceTransferStatistics *statistics );
+	static IOReturn		GatedSetTransferStatistics( OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3 );
+	IOUSBPolledEndpoint *	FindPolledEndpoint( USBDeviceAddress address, UInt8 endpoint );
+	IOReturn			PolledReadReserved( IOUSBPolledEndpoint *polled, IOUSBCompletion clientCompletion, IOMemoryDescriptor *CBP, bool bufferRounding, UInt32 bufferSize );
+	void				FreePolledEndpoint( IOUSBPolledEndpoint *polled );
+	static void			PolledPacketHandler( OSObject *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining );
+	static IOReturn		GatedSetPolledEndpoint( OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3 );
+	static void			CompletionThreadAction( OSObject *owner, IOInterruptEventSource *source, int count );
 
 
     USBDeviceAddress		GetNewAddress( void );
+	USBDeviceAddress		AllocateAddressLocked( void );
+	void					ClaimAddress( USBDeviceAddress address );
+	void					ResyncAddressMap( void );
     
     IOReturn    		ControlTransaction( IOUSBCommand *  command );
     
@@ -569,6 +677,58 @@ public:
 	
     IOCommandGate *		GetCommandGate(void);
 
+/*!
+	@function BeginCompletionBatch
+	@abstract Called by a UIM on the workloop before it scavenges its finished transfers.
+	@discussion Until the matching EndCompletionBatch, the completions of control, interrupt and bulk transfers are held back
+				and their commands are not returned to the pool. EndCompletionBatch returns all of the commands in one go and then
+				calls the held completions in the order those transfers finished. Isochronous completions are not held, so within
+				one pass they can be delivered ahead of control, interrupt and bulk completions which finished earlier. Completions
+				of actions registered with RegisterBatchCompletion are grouped by target and are not ordered with respect to any
+				other completion. Calls nest, and do nothing off the workloop thread.
+*/
+	void				BeginCompletionBatch(void);
+	void				EndCompletionBatch(void);
+
+/*!
+	@function RegisterBatchCompletion
+	@abstract Asks for the completions of a batch to be delivered with one call per target.
+	@discussion Transfers queued with an IOUSBCompletion whose action is action are completed by calling batchAction once for each
+				target with all of that target's transfers which finished in the same batch, instead of calling action for each.
+				Transfers which finish outside of a batch still call action.
+				batchAction is called on the controller's completion thread, not on the workloop, so that a client with a lot of
+				completion work does not hold up transfers which other clients are queueing. It must not assume that the
+				command gate is held. Within one call the results are in the order the target's transfers finished, and the
+				calls are only ordered with respect to other calls of the same batchAction - not with respect to isochronous
+				completions or to transfers which complete through action.
+				UnregisterBatchCompletion waits until the completion thread has delivered everything it was handed, unless it
+				is called on the workloop or on the completion thread.
+	@param action The IOUSBCompletionAction the transfers are queued with.
+	@param batchAction The function to call instead.
+	@result kIOReturnNoResources if kUSBCompletionBatchMaxClients actions are registered already.
+*/
+	IOReturn			RegisterBatchCompletion(IOUSBCompletionAction action, IOUSBBatchCompletionAction batchAction);
+	IOReturn			UnregisterBatchCompletion(IOUSBCompletionAction action);
+
+/*!
+	@function RegisterPolledEndpoint
+	@abstract Sets aside the command, the buffer and the transfer descriptors PolledRead uses to read from an interrupt IN endpoint.
+	@discussion A command is taken out of the command pool, a buffer of maxBufferSize bytes is allocated and prepared for DMA,
+				and the UIM sets aside the TDs for a read of that size on the endpoint's queue (UIMReservePolledTDs). All of them
+				stay reserved until UnregisterPolledEndpoint. PolledRead on a registered endpoint then reads into the reserved
+				buffer and copies the data into the caller's memory descriptor before completing, so the read neither allocates
+				nor takes a lock, and finding the endpoint costs at most kUSBMaxPolledEndpoints compares. Only one polled read can
+				be outstanding per endpoint - a second one returns kIOReturnBusy. The pipe has to be open; closing it, or changing
+				its polling interval, gives the TDs back, and the endpoint should be registered again.
+	@param address Address of the device.
+	@param endpoint Number of the interrupt IN endpoint.
+	@param maxBufferSize Largest read which will be made - usually the endpoint's max packet size.
+	@result kIOReturnNoResources if kUSBMaxPolledEndpoints endpoints are registered already, kIOReturnExclusiveAccess if this one is,
+			kIOReturnUnsupported if the UIM cannot reserve TDs.
+*/
+	IOReturn			RegisterPolledEndpoint(USBDeviceAddress address, UInt8 endpoint, UInt32 maxBufferSize);
+	IOReturn			UnregisterPolledEndpoint(USBDeviceAddress address, UInt8 endpoint);
+
     /*!
 	@struct Endpoint
         Describes an endpoint of a device.
@@ -853,6 +1013,13 @@ public:
     // Debugger polled mode
     virtual void 		PollInterrupts( IOUSBCompletionAction safeAction = 0 ) = 0;
  
+    /*!
+        @function PolledRead
+        Reads from an interrupt IN endpoint while the debugger runs the controller with PollInterrupts. On an endpoint
+        registered with RegisterPolledEndpoint the command, the buffer and the transfer descriptors are reserved, and the
+        read does not allocate. On any other endpoint a command comes from the command pool, which may grow, and the UIM
+        takes the TDs from its free list, which may grow too.
+    */
     virtual IOReturn 		PolledRead(
                                             short			functionNumber,
                                             short			endpointNumber,
@@ -1115,6 +1282,9 @@ private:
     bool                            CheckACPIUPCTableForInternalHubErrataBits( IORegistryEntry* acpiDevice, UInt32 portnum, UInt32 locationID, UInt32* errataBits );
 	int 							calculateUSBDepth(UInt32 locationID);
 	int 							calculateACPIDepth(int hubUSBDepth);
+	bool							BuildACPIPortTable( IORegistryEntry * provider );
+	bool							FindACPIPortEntry( IORegistryEntry * provider, UInt32 portnum, UInt32 locationID, UInt8 flags, IOUSBACPIPortEntry * portEntry, bool * found );
+	static bool						ACPIRegistryChanged( void * target, void * refCon, IOService * newService, IONotifier * notifier );
 };
 
 //================================================================================================
@@ -28,6 +28,7 @@
 
 #include <IOKit/usb/IOUSBControllerV2.h>
 #include <IOKit/usb/IOUSBHubDevice.h>
+#include <IOKit/usb/IOUSBRootHubPolling.h>
 
 // Constants that define the different power states in the setPowerState call
 enum
@@ -135,6 +136,7 @@ class IOUSBControllerV3 : public IOUSBControllerV2
 			UInt8					_rootHubPortsSSStartRange;
 			IOUSBRootHubInterruptTransaction	_outstandingSSRHTrans[4];		// Transactions for the Root Hub.  We need 2, one for the current transaction and one for the next.  This is declared as 4 for binary compatibility
 #endif
+			IOUSBRootHubPolling		_rootHubPolling;					// root hub timer back off and its counters
 		};
 		V3ExpansionData *_v3ExpansionData;
 
@@ -245,6 +247,8 @@ class IOUSBControllerV3 : public IOUSBControllerV2
 		virtual IOReturn				HandlePowerChange(unsigned long powerStateOrdinal);
 		virtual	UInt32					AllocateExtraRootHubPortPower(UInt32 extraPowerRequested);		// DEPRECATED
 		virtual	void					ReturnExtraRootHubPortPower(UInt32 extraPowerReturned);			// DEPRECATED
+		void							RootHubPortChangeInterrupt(void);
+		void							PublishRootHubPollingStatistics(void);
 	
 	OSMetaClassDeclareReservedUsed(IOUSBControllerV3,  0);
 	virtual IOReturn				RootHubStartTimer32(uint32_t pollingRate);
@@ -482,7 +486,21 @@ class IOUSBControllerV3 : public IOUSBControllerV2
  	OSMetaClassDeclareReservedUnused(IOUSBControllerV3,  18);
 	OSMetaClassDeclareReservedUnused(IOUSBControllerV3,  19);
 #endif   
-	OSMetaClassDeclareReservedUnused(IOUSBControllerV3,  20);
+	OSMetaClassDeclareReservedUsed(IOUSBControllerV3,  20);
+	/*!
+	 @function UIMReservePolledTDs
+	 @abstract UIM function, sets aside (or gives back) the transfer descriptors for polled reads on an interrupt IN endpoint
+	 @discussion Called by RegisterPolledEndpoint and UnregisterPolledEndpoint on the workloop. While the reservation stands, the
+				 transfers on the endpoint take their TDs from it first and give them back to it, so a polled read of up to
+				 maxBufferSize bytes never grows the UIM's TD free list. Deleting the endpoint gives the TDs back too.
+	 @param functionNumber USB device ID of device
+	 @param endpointNumber endpoint number of the interrupt IN endpoint
+	 @param maxBufferSize largest read which will be made
+	 @param reserve true to set the TDs aside, false to give them back
+	 @result kIOReturnUnsupported if the UIM cannot reserve TDs, kIOUSBEndpointNotFound if the endpoint is not open
+	 */
+	virtual IOReturn			UIMReservePolledTDs(short functionNumber, short endpointNumber, UInt32 maxBufferSize, bool reserve);
+	
 	OSMetaClassDeclareReservedUnused(IOUSBControllerV3,  21);
 	OSMetaClassDeclareReservedUnused(IOUSBControllerV3,  22);
 	OSMetaClassDeclareReservedUnused(IOUSBControllerV3,  23);
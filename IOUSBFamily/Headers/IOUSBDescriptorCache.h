@@ -0,0 +1,230 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _IOKIT_IOUSBDESCRIPTORCACHE_H
+#define _IOKIT_IOUSBDESCRIPTORCACHE_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include <IOKit/usb/USB.h>
+
+//
+// The controller wide descriptor cache: configuration and string descriptors of the devices a controller has enumerated, kept across
+// the life of the IOUSBDevice objects so that a reset, a re-enumeration or a sleep/wake cycle does not have to fetch them over the bus
+// again. Entries are keyed by IOUSBDevice::GetDescriptorCacheKey, and each one remembers the 18 byte device descriptor it was filled
+// with - if the device returns anything else the entry is thrown away. At most kUSBDescriptorCacheMaxEntries devices are remembered,
+// least recently used first out.
+//
+// The caller serializes access. Descriptors are allocated with Ops::Alloc(size) and freed with Ops::Free(ptr, size).
+//
+
+enum
+{
+	kUSBDescriptorCacheMaxEntries	= 32,					// devices remembered by the controller wide descriptor cache
+	kUSBDescriptorCacheKeySize		= 160
+};
+
+struct IOUSBCachedDescriptor
+{
+	IOUSBCachedDescriptor *		next;
+	UInt8						type;
+	UInt8						index;
+	UInt16						lang;
+	UInt32						length;
+	UInt8						bytes[1];					// length bytes
+};
+
+struct IOUSBDescriptorCacheEntry
+{
+	char						key[kUSBDescriptorCacheKeySize];	// empty if the entry is unused
+	IOUSBDeviceDescriptor		deviceDescriptor;
+	UInt32						lastUsed;
+	IOUSBCachedDescriptor *		descriptors;
+};
+
+struct IOUSBDescriptorCache
+{
+	IOUSBDescriptorCacheEntry	entries[kUSBDescriptorCacheMaxEntries];
+	UInt32						count;
+	UInt32						clock;						// bumped on every use, for LRU eviction
+	UInt32						hits;
+	UInt32						misses;
+	UInt32						requestsSaved;				// bus requests which a hit made unnecessary
+	UInt32						evictions;
+};
+
+static inline UInt32
+IOUSBCachedDescriptorSize(UInt32 length)
+{
+	return (UInt32)(offsetof(IOUSBCachedDescriptor, bytes) + length);
+}
+
+static inline bool
+IOUSBDescriptorCacheKeyMatches(const IOUSBDescriptorCacheEntry *entry, const char *key)
+{
+	return entry->key[0] && !strncmp(entry->key, key, kUSBDescriptorCacheKeySize);
+}
+
+template<class Ops>
+static inline void
+IOUSBDescriptorCacheDropEntry(IOUSBDescriptorCache *cache, IOUSBDescriptorCacheEntry *entry)
+{
+	while (entry->descriptors)
+	{
+		IOUSBCachedDescriptor	*descriptor = entry->descriptors;
+		
+		entry->descriptors = descriptor->next;
+		Ops::Free(descriptor, IOUSBCachedDescriptorSize(descriptor->length));
+	}
+	entry->key[0] = 0;
+	cache->count--;
+}
+
+// the entry for key, if it was filled by a device with the same device descriptor - otherwise NULL, or a new empty entry if create
+template<class Ops>
+static inline IOUSBDescriptorCacheEntry *
+IOUSBDescriptorCacheFindEntry(IOUSBDescriptorCache *cache, const char *key, const IOUSBDeviceDescriptor *devDesc, bool create)
+{
+	IOUSBDescriptorCacheEntry	*entry = NULL;
+	IOUSBDescriptorCacheEntry	*unused = NULL;
+	IOUSBDescriptorCacheEntry	*oldest = NULL;
+	int							i;
+	
+	for (i = 0; i < kUSBDescriptorCacheMaxEntries; i++)
+	{
+		IOUSBDescriptorCacheEntry	*candidate = &cache->entries[i];
+		
+		if (!candidate->key[0])
+		{
+			if (!unused)
+				unused = candidate;
+		}
+		else if (IOUSBDescriptorCacheKeyMatches(candidate, key))
+			entry = candidate;
+		else if (!oldest || ((SInt32)(candidate->lastUsed - oldest->lastUsed) < 0))
+			oldest = candidate;
+	}
+	
+	if (entry && memcmp(&entry->deviceDescriptor, devDesc, sizeof(IOUSBDeviceDescriptor)))
+	{
+		IOUSBDescriptorCacheDropEntry<Ops>(cache, entry);
+		unused = entry;
+		entry = NULL;
+	}
+	
+	if (!entry && create)
+	{
+		if (!unused)
+		{
+			IOUSBDescriptorCacheDropEntry<Ops>(cache, oldest);
+			cache->evictions++;
+			unused = oldest;
+		}
+		entry = unused;
+		for (i = 0; (i < (kUSBDescriptorCacheKeySize - 1)) && key[i]; i++)
+			entry->key[i] = key[i];
+		entry->key[i] = 0;
+		memcpy(&entry->deviceDescriptor, devDesc, sizeof(IOUSBDeviceDescriptor));
+		entry->descriptors = NULL;
+		cache->count++;
+	}
+	
+	if (entry)
+		entry->lastUsed = ++cache->clock;
+	
+	return entry;
+}
+
+// looks a descriptor up, counting a hit (which saved requestsSaved bus requests) or a miss
+template<class Ops>
+static inline const IOUSBCachedDescriptor *
+IOUSBDescriptorCacheLookup(IOUSBDescriptorCache *cache, const char *key, const IOUSBDeviceDescriptor *devDesc, UInt8 type, UInt8 index, UInt16 lang, UInt32 requestsSaved)
+{
+	IOUSBDescriptorCacheEntry	*entry = IOUSBDescriptorCacheFindEntry<Ops>(cache, key, devDesc, false);
+	IOUSBCachedDescriptor		*descriptor = entry ? entry->descriptors : NULL;
+	
+	while (descriptor && ((descriptor->type != type) || (descriptor->index != index) || (descriptor->lang != lang)))
+		descriptor = descriptor->next;
+	
+	if (descriptor)
+	{
+		cache->hits++;
+		cache->requestsSaved += requestsSaved;
+	}
+	else
+		cache->misses++;
+	
+	return descriptor;
+}
+
+// remembers a descriptor fetched over the bus, replacing any earlier copy - returns false if there was no memory for it
+template<class Ops>
+static inline bool
+IOUSBDescriptorCacheStore(IOUSBDescriptorCache *cache, const char *key, const IOUSBDeviceDescriptor *devDesc, UInt8 type, UInt8 index, UInt16 lang, const void *bytes, UInt32 length)
+{
+	IOUSBDescriptorCacheEntry	*entry;
+	IOUSBCachedDescriptor		**link;
+	IOUSBCachedDescriptor		*descriptor;
+	
+	descriptor = (IOUSBCachedDescriptor *)Ops::Alloc(IOUSBCachedDescriptorSize(length));
+	if (!descriptor)
+		return false;
+	descriptor->type = type;
+	descriptor->index = index;
+	descriptor->lang = lang;
+	descriptor->length = length;
+	memcpy(descriptor->bytes, bytes, length);
+	
+	entry = IOUSBDescriptorCacheFindEntry<Ops>(cache, key, devDesc, true);
+	for (link = &entry->descriptors; *link; link = &(*link)->next)
+	{
+		IOUSBCachedDescriptor	*old = *link;
+		
+		if ((old->type == type) && (old->index == index) && (old->lang == lang))
+		{
+			*link = old->next;
+			Ops::Free(old, IOUSBCachedDescriptorSize(old->length));
+			break;
+		}
+	}
+	descriptor->next = entry->descriptors;
+	entry->descriptors = descriptor;
+	
+	return true;
+}
+
+template<class Ops>
+static inline void
+IOUSBDescriptorCacheFlush(IOUSBDescriptorCache *cache)
+{
+	int		i;
+	
+	for (i = 0; i < kUSBDescriptorCacheMaxEntries; i++)
+		if (cache->entries[i].key[0])
+			IOUSBDescriptorCacheDropEntry<Ops>(cache, &cache->entries[i]);
+}
+
+#endif /* _IOKIT_IOUSBDESCRIPTORCACHE_H */
@@ -0,0 +1,295 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_IOUSBDESCRIPTORINDEX_H
+#define _IOKIT_IOUSBDESCRIPTORINDEX_H
+
+#include <IOKit/usb/USB.h>
+
+#ifdef KERNEL
+#include <IOKit/IOLib.h>
+#else
+#include <stdlib.h>
+#endif
+
+/*!
+ @header IOUSBDescriptorIndex.h
+ @abstract A compact index over the descriptors of a cached configuration descriptor.
+ @discussion FindNextDescriptor and friends used to follow the bLength chain of the raw configuration descriptor from the
+	starting descriptor on every call. The index is built once, when the configuration descriptor is cached, and records where
+	every descriptor starts, its type, the interface it belongs to and the next interface, endpoint and interface boundary
+	(interface or interface association descriptor) after it. Looking for the next interface or the next endpoint of an
+	interface is then a table lookup, and any other search walks the small entry table instead of the descriptor bytes.
+	The same header is used by the kernel (IOUSBDevice, IOUSBInterface) and by IOUSBLib.
+ */
+
+/*!
+ @struct IOUSBDescriptorIndexEntry
+ @field offset Offset of the descriptor from the start of the configuration descriptor.
+ @field type bDescriptorType of the descriptor.
+ @field interfaceNumber bInterfaceNumber of the interface descriptor this descriptor follows (0xFF before the first one).
+ @field nextInterface Entry of the first interface descriptor after this one, or the entry count.
+ @field nextEndpoint Entry of the first endpoint descriptor after this one, or the entry count.
+ @field nextBoundary Entry of the first interface or interface association descriptor after this one, or the entry count.
+ */
+struct IOUSBDescriptorIndexEntry
+{
+	UInt16		offset;
+	UInt8		type;
+	UInt8		interfaceNumber;
+	UInt16		nextInterface;
+	UInt16		nextEndpoint;
+	UInt16		nextBoundary;
+};
+
+/*!
+ @class IOUSBDescriptorIndex
+ @abstract Index over one configuration descriptor. The owner of the configuration descriptor owns the index and must call
+	Destroy before the descriptor goes away. An index which has not been built (or failed to build) answers every lookup with
+	false, and the caller falls back to walking the descriptor itself.
+ */
+class IOUSBDescriptorIndex
+{
+public:
+	void		Init(void)							{ _base = NULL; _length = 0; _entries = NULL; _count = 0; _capacity = 0; }
+	bool		IsBuilt(void) const					{ return (_count != 0); }
+	UInt32		Count(void) const					{ return _count; }
+
+	bool		Build(const void *config, UInt32 length);
+	void		Destroy(void);
+
+	// All of the lookups return false if current is not the start of a descriptor in this index, in which case *next is untouched
+	bool		FindNext(const void *current, UInt8 type, const IOUSBDescriptorHeader **next) const;
+	bool		FindNextAssociated(const void *current, UInt8 type, UInt8 interfaceNumber, const IOUSBDescriptorHeader **next) const;
+	bool		FindNextInterface(const void *current, const IOUSBInterfaceDescriptor **next) const;
+
+private:
+	SInt32		EntryFor(const void *descriptor) const;
+	const IOUSBDescriptorHeader *	Descriptor(UInt32 entry) const	{ return (entry < _count) ? (const IOUSBDescriptorHeader *)(_base + _entries[entry].offset) : NULL; }
+
+	const UInt8					*_base;
+	UInt32						_length;
+	IOUSBDescriptorIndexEntry	*_entries;
+	UInt32						_count;
+	UInt32						_capacity;
+};
+
+
+inline bool
+IOUSBDescriptorIndex::Build(const void *config, UInt32 length)
+{
+	const UInt8		*bytes = (const UInt8 *)config;
+	UInt32			offset;
+	UInt32			count = 0;
+	UInt32			i;
+	UInt16			nextInterface, nextEndpoint, nextBoundary;
+	UInt8			interfaceNumber = 0xFF;
+
+	Destroy();
+
+	if (!config || (length == 0) || (length > 0xFFFF))
+		return false;
+
+	// the same walk FindNextDescriptor does - a descriptor is part of the configuration if it starts inside it, and a
+	// zero length descriptor is the last one
+	for (offset = 0; offset < length; offset += bytes[offset])
+	{
+		count++;
+		if (bytes[offset] == 0)
+			break;
+	}
+
+#ifdef KERNEL
+	_entries = (IOUSBDescriptorIndexEntry *)IOMalloc(count * sizeof(IOUSBDescriptorIndexEntry));
+#else
+	_entries = (IOUSBDescriptorIndexEntry *)malloc(count * sizeof(IOUSBDescriptorIndexEntry));
+#endif
+	if (!_entries)
+		return false;
+	_capacity = count;
+
+	for (i = 0, offset = 0; i < count; offset += bytes[offset], i++)
+	{
+		_entries[i].offset = offset;
+		_entries[i].type = ((offset + 1) < length) ? bytes[offset + 1] : 0;
+		if ((_entries[i].type == kUSBInterfaceDesc) && ((offset + 2) < length))
+			interfaceNumber = bytes[offset + 2];
+		_entries[i].interfaceNumber = interfaceNumber;
+	}
+
+	// fill in the forward links from the back
+	nextInterface = nextEndpoint = nextBoundary = count;
+	for (i = count; i-- > 0; )
+	{
+		_entries[i].nextInterface = nextInterface;
+		_entries[i].nextEndpoint = nextEndpoint;
+		_entries[i].nextBoundary = nextBoundary;
+
+		if (_entries[i].type == kUSBInterfaceDesc)
+			nextInterface = nextBoundary = i;
+		else if (_entries[i].type == kUSBInterfaceAssociationDesc)
+			nextBoundary = i;
+		else if (_entries[i].type == kUSBEndpointDesc)
+			nextEndpoint = i;
+	}
+
+	_base = bytes;
+	_length = length;
+	_count = count;							// last, so that a concurrent reader sees either nothing or the whole index
+	return true;
+}
+
+
+
+inline void
+IOUSBDescriptorIndex::Destroy(void)
+{
+	_count = 0;
+	if (_entries)
+	{
+#ifdef KERNEL
+		IOFree(_entries, _capacity * sizeof(IOUSBDescriptorIndexEntry));
+#else
+		free(_entries);
+#endif
+	}
+	_entries = NULL;
+	_capacity = 0;
+	_base = NULL;
+	_length = 0;
+}
+
+
+
+inline SInt32
+IOUSBDescriptorIndex::EntryFor(const void *descriptor) const
+{
+	UInt32		offset;
+	UInt32		low = 0;
+	UInt32		high = _count;
+
+	if (!_count || ((const UInt8 *)descriptor < _base) || ((UInt32)((const UInt8 *)descriptor - _base) >= _length))
+		return -1;
+
+	offset = (UInt32)((const UInt8 *)descriptor - _base);
+	while (low < high)
+	{
+		UInt32		middle = (low + high) / 2;
+
+		if (_entries[middle].offset == offset)
+			return middle;
+		if (_entries[middle].offset < offset)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return -1;
+}
+
+
+
+inline bool
+IOUSBDescriptorIndex::FindNext(const void *current, UInt8 type, const IOUSBDescriptorHeader **next) const
+{
+	SInt32		entry = EntryFor(current ? current : _base);
+	UInt32		i;
+
+	if (entry < 0)
+		return false;
+
+	if (type == kUSBInterfaceDesc)
+		i = _entries[entry].nextInterface;
+	else if (type == kUSBEndpointDesc)
+		i = _entries[entry].nextEndpoint;
+	else
+	{
+		for (i = entry + 1; i < _count; i++)
+			if ((type == kUSBAnyDesc) || (_entries[i].type == type))
+				break;
+	}
+
+	*next = Descriptor(i);
+	return true;
+}
+
+
+
+inline bool
+IOUSBDescriptorIndex::FindNextAssociated(const void *current, UInt8 type, UInt8 interfaceNumber, const IOUSBDescriptorHeader **next) const
+{
+	SInt32		entry = EntryFor(current);
+	UInt32		i;
+
+	if (entry < 0)
+		return false;
+
+	*next = NULL;
+
+	// the descriptors of an interface end at an interface association descriptor, at an interface descriptor unless we are
+	// looking for the alternate settings, or at an interface descriptor of another interface
+	if (type == kUSBInterfaceDesc)
+	{
+		i = _entries[entry].nextBoundary;
+		if ((i < _count) && (_entries[i].type == kUSBInterfaceDesc) && (_entries[i].interfaceNumber == interfaceNumber))
+			*next = Descriptor(i);
+	}
+	else if (type == kUSBEndpointDesc)
+	{
+		i = _entries[entry].nextEndpoint;
+		if (i < _entries[entry].nextBoundary)
+			*next = Descriptor(i);
+	}
+	else
+	{
+		i = entry + 1;
+		if ((i < _entries[entry].nextBoundary) && (type == kUSBAnyDesc))
+			*next = Descriptor(i);
+		else
+		{
+			for ( ; i < _entries[entry].nextBoundary; i++)
+				if (_entries[i].type == type)
+				{
+					*next = Descriptor(i);
+					break;
+				}
+		}
+	}
+	return true;
+}
+
+
+
+inline bool
+IOUSBDescriptorIndex::FindNextInterface(const void *current, const IOUSBInterfaceDescriptor **next) const
+{
+	SInt32		entry = EntryFor(current ? current : _base);
+
+	if (entry < 0)
+		return false;
+
+	*next = (const IOUSBInterfaceDescriptor *)Descriptor(_entries[entry].nextInterface);
+	return true;
+}
+
+#endif /* _IOKIT_IOUSBDESCRIPTORINDEX_H */
@@ -0,0 +1,107 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _IOKIT_IOUSBDEVREQUESTBATCH_H
+#define _IOKIT_IOUSBDEVREQUESTBATCH_H
+
+#include <IOKit/usb/USB.h>
+
+//
+// The bookkeeping of one IOUSBDevice::DeviceRequestBatch, from the call until the last request completes. The device sends
+// batch->requests[batch->next] on pipe zero, and from its completion asks IOUSBDevRequestBatchEntryDone whether to send the next
+// one. The batch stops at the first request which fails, either on the bus or when it is queued.
+//
+// All of these run in the device's command gate.
+//
+
+struct IOUSBDevRequestBatch
+{
+	IOUSBDevRequest *	requests;
+	IOReturn *			statuses;
+	UInt32				count;
+	UInt32				next;						// the request in flight, or the one which failed to go out
+	UInt32				completed;					// requests which completed successfully
+	UInt32				noDataTimeout;
+	UInt32				completionTimeout;
+	IOReturn			status;						// first error, if any
+	IOUSBCompletion		completion;					// the client's completion, action is NULL for a synchronous batch
+	IOUSBCompletion		entryCompletion;			// our completion for each request
+	bool				done;
+	bool				stop;						// the synchronous caller was interrupted - don't send any more requests
+};
+
+// Checks the batch before anything is sent, and marks every request as not sent. A SET_ADDRESS anywhere in the batch
+// rejects the whole batch, and *badIndex says which request it was.
+static inline IOReturn
+IOUSBDevRequestBatchStart(IOUSBDevRequestBatch *batch, UInt32 *badIndex)
+{
+	UInt32		i;
+	
+	for (i = 0; i < batch->count; i++)
+	{
+		if ( ((batch->requests[i].bRequest << 8) | batch->requests[i].bmRequestType) == kSetAddress )
+		{
+			*badIndex = i;
+			return kIOReturnNotPermitted;
+		}
+	}
+	
+	if ( batch->statuses )
+		for (i = 0; i < batch->count; i++)
+			batch->statuses[i] = kIOReturnAborted;
+	
+	return kIOReturnSuccess;
+}
+
+// The request at batch->next could not be queued
+static inline void
+IOUSBDevRequestBatchSendFailed(IOUSBDevRequestBatch *batch, IOReturn err)
+{
+	if ( batch->statuses )
+		batch->statuses[batch->next] = err;
+	batch->status = err;
+}
+
+// The request at batch->next completed. Returns true if batch->next is now a request to send, false if the batch is over.
+static inline bool
+IOUSBDevRequestBatchEntryDone(IOUSBDevRequestBatch *batch, IOReturn status, UInt32 bufferSizeRemaining)
+{
+	IOUSBDevRequest *	request = &batch->requests[batch->next];
+	
+	request->wLenDone = (bufferSizeRemaining < request->wLength) ? (request->wLength - bufferSizeRemaining) : 0;
+	if ( batch->statuses )
+		batch->statuses[batch->next] = status;
+	
+	if ( status != kIOReturnSuccess )
+	{
+		batch->status = status;
+		return false;
+	}
+	
+	batch->completed++;
+	return (++batch->next < batch->count);
+}
+
+#endif /* _IOKIT_IOUSBDEVREQUESTBATCH_H */
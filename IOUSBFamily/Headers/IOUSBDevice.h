@@ -28,6 +28,7 @@
 #include <IOKit/usb/IOUSBPipe.h>
 #include <IOKit/usb/IOUSBPipeV2.h>
 #include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/usb/IOUSBDescriptorIndex.h>
 #include <IOKit/IOWorkLoop.h>
 #include <IOKit/IOCommandGate.h>
 
@@ -50,6 +51,7 @@ class IOUSBController;
 class IOUSBControllerV2;
 class IOUSBInterface;
 class IOUSBHubPolicyMaker;
+struct IOUSBDevRequestBatch;
 /*!
     @class IOUSBDevice
     @abstract The IOService object representing a device on the USB bus.
@@ -128,11 +130,24 @@ protected:
 #else
 		UInt32					_standardUSBPortPower;				// Largest amount of current that this port can provide (e.g. 500mA)
 #endif		
+		IOUSBDescriptorIndex *	_configIndexList;					// one per _configList entry, built when the configuration descriptor is cached
+		IOLock *				_stringCacheLock;
+		OSDictionary *			_stringCache;						// UTF-8 strings keyed by string index and LANGID
+		OSData *				_stringLanguages;					// LANGID table (string descriptor 0), read once
+		bool					_stringLanguagesRead;
+		bool					_stringNeedsLengthProbe;			// the device fails a max length string request - read the length first
+		UInt32					_stringCacheHits;
+		UInt32					_stringCacheMisses;
+		UInt32					_stringBusRequests;
     };	
     ExpansionData * _expansionData;
 
     const IOUSBConfigurationDescriptor *FindConfig(UInt8 configValue, UInt8 *configIndex=0);
 
+	bool	GetDescriptorCacheKey(char *key, UInt32 keySize);
+	
+	IOUSBDescriptorIndex *	DescriptorIndexFor(const void *descriptor);
+
     virtual IOUSBInterface * GetInterface(const IOUSBInterfaceDescriptor *interface);
 
 public:
@@ -398,6 +413,32 @@ public:
 				    UInt32 completionTimeout,
 				    IOUSBCompletion	*completion = 0);
 
+    /*!
+	 @function DeviceRequestBatch
+	 @abstract execute a series of control requests on the default control pipe (pipe zero)
+	 @discussion The requests are sent one after the other, each one being queued from the completion of the previous one, so
+	 the caller goes through the command gate and waits only once for the whole series. The batch stops at the first request
+	 which fails. This is a non-virtual function so that we don't have to take up a binary compatibility slot.
+	 @param requests Array of count parameter blocks to send to the device. The wLenDone of each one is updated as it completes.
+	 @param count Number of requests in the array.
+	 @param statuses Optional array of count entries which receives the status of each request. Requests which were not sent
+	 because an earlier one failed are set to kIOReturnAborted.
+	 @param noDataTimeout Specifies an amount of time (in ms) after which each request will be aborted
+	 if no data has been transferred on the bus.
+	 @param completionTimeout Specifies an amount of time (in ms) after which each request will be aborted if it has
+	 not been completed.
+	 @param completion Function to call when the batch completes, with the status of the first request which failed (or
+	 kIOReturnSuccess) and the number of requests which did not complete successfully in place of the bytes remaining. If omitted
+	 then DeviceRequestBatch() executes synchronously, blocking until the batch is complete. If the batch is asynchronous, the
+	 client must make sure that the requests, their buffers and the statuses array are not released until the callback has occurred.
+	 */
+    IOReturn DeviceRequestBatch(IOUSBDevRequest	*requests,
+				UInt32 count,
+				IOReturn *statuses,
+				UInt32 noDataTimeout,
+				UInt32 completionTimeout,
+				IOUSBCompletion	*completion = 0);
+
     OSMetaClassDeclareReservedUsed(IOUSBDevice,  2);
     /*!
 	@function SuspendDevice
@@ -578,6 +619,9 @@ private:
     
     UInt32              SimpleUnicodeToUTF8(UInt16 uChar, UInt8 utf8Bytes[4]);
     void                SwapUniWords (UInt16  **unicodeString, UInt32 uniSize);
+	IOReturn			ReadStringDescriptor(UInt8 index, UInt16 lang, UInt8 *desc);
+	UInt16				NegotiateStringLanguage(UInt16 lang);
+	void				PublishStringCacheStatistics(void);
 
     IOReturn			TakeGetConfigLock(void);
     IOReturn			ReleaseGetConfigLock(void);
@@ -593,6 +637,10 @@ private:
 	static IOReturn		_GetDeviceStatus(OSObject *target, void *arg0,  __unused void *arg1, __unused void *arg2, __unused void *arg3);
 	static IOReturn		_DeviceRequestWithTimeout(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
 	static IOReturn		_DeviceRequestDescWithTimeout(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+	static IOReturn		_DeviceRequestBatch(OSObject *target, void *arg0, __unused void *arg1, __unused void *arg2, __unused void *arg3);
+	static void			DeviceRequestBatchEntryComplete(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining);
+	bool				SubmitDeviceRequestBatchEntry(IOUSBDevRequestBatch *batch);
+	void				CompleteDeviceRequestBatch(IOUSBDevRequestBatch *batch);
 
 };
 
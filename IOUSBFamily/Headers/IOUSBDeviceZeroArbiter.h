@@ -0,0 +1,94 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _IOKIT_IOUSBDEVICEZEROARBITER_H
+#define _IOKIT_IOUSBDEVICEZEROARBITER_H
+
+#include <IOKit/IOTypes.h>
+
+//
+// Bookkeeping for the controller's device zero lock. A hub port holds device zero from the reset of a new device until the device has
+// recovered from SET_ADDRESS, and every other port which has a new device waits for it. Address 0 is shared by the whole bus, so there
+// is one of these per controller, not per hub. All times are in nanoseconds.
+//
+// A waiter gives up only behind a holder which has kept device zero for kUSBDeviceZeroDeadlineNS, measured from that holder's
+// acquisition. A port at the end of a long queue of devices which each enumerate normally keeps waiting, however long that takes.
+//
+
+#define kUSBDeviceZeroDeadlineNS		(30ULL * 1000000000ULL)
+
+struct IOUSBDeviceZeroArbiter
+{
+	UInt64				acquiredTime;					// when the current holder got device zero
+	UInt64				totalHoldNS;					// total time device zero has been held
+	UInt32				acquisitions;
+	UInt32				maxHoldMS;
+	UInt32				maxWaitMS;
+	UInt32				timeouts;						// waiters which gave up behind a holder that kept device zero past the deadline
+};
+
+// the time at which the current holder becomes stuck, which is as long as a waiter sleeps before looking again
+static inline UInt64
+IOUSBDeviceZeroDeadline(const IOUSBDeviceZeroArbiter *arbiter)
+{
+	return arbiter->acquiredTime + kUSBDeviceZeroDeadlineNS;
+}
+
+// called by a waiter which finds device zero held - returns false (and counts a timeout) if the holder is stuck, and the waiter must fail
+static inline bool
+IOUSBDeviceZeroMayWait(IOUSBDeviceZeroArbiter *arbiter, UInt64 now)
+{
+	if (now < IOUSBDeviceZeroDeadline(arbiter))
+		return true;
+	
+	arbiter->timeouts++;
+	return false;
+}
+
+static inline void
+IOUSBDeviceZeroAcquired(IOUSBDeviceZeroArbiter *arbiter, UInt64 waitStart, UInt64 now)
+{
+	UInt64		waitMS = (now - waitStart) / 1000000;
+	
+	if (waitMS > arbiter->maxWaitMS)
+		arbiter->maxWaitMS = (UInt32)waitMS;
+	arbiter->acquiredTime = now;
+	arbiter->acquisitions++;
+}
+
+// returns how long the holder kept device zero
+static inline UInt64
+IOUSBDeviceZeroReleased(IOUSBDeviceZeroArbiter *arbiter, UInt64 now)
+{
+	UInt64		heldNS = now - arbiter->acquiredTime;
+	
+	arbiter->totalHoldNS += heldNS;
+	if ((heldNS / 1000000) > arbiter->maxHoldMS)
+		arbiter->maxHoldMS = (UInt32)(heldNS / 1000000);
+	
+	return heldNS;
+}
+
+#endif /* _IOKIT_IOUSBDEVICEZEROARBITER_H */
@@ -0,0 +1,93 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _IOKIT_IOUSBHANDOFFRING_H
+#define _IOKIT_IOUSBHANDOFFRING_H
+
+#include <IOKit/IOTypes.h>
+
+//
+// The indices of a ring of preallocated slots handed from one producer to one consumer. The producer reserves the slot
+// at the tail, fills it in and publishes it; the consumer takes the slot at the head, uses it and releases it. The
+// producer only writes a slot the consumer does not own, so the slots themselves need no lock, but these calls have to
+// be serialized by the caller (the controller uses its completionLock). head and tail only ever grow, and wrap.
+//
+
+struct IOUSBHandoffRing
+{
+	UInt32		slots;
+	UInt32		head;				// next slot for the consumer
+	UInt32		tail;				// next slot for the producer
+};
+
+static inline void
+IOUSBHandoffRingInit(IOUSBHandoffRing *ring, UInt32 slots)
+{
+	ring->slots = slots;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+static inline UInt32
+IOUSBHandoffRingPending(const IOUSBHandoffRing *ring)
+{
+	return ring->tail - ring->head;
+}
+
+// The slot the producer may fill, or false if every slot is still with the consumer
+static inline bool
+IOUSBHandoffRingReserve(const IOUSBHandoffRing *ring, UInt32 *slot)
+{
+	if ( (ring->slots == 0) || (IOUSBHandoffRingPending(ring) == ring->slots) )
+		return false;
+	
+	*slot = ring->tail % ring->slots;
+	return true;
+}
+
+static inline void
+IOUSBHandoffRingPublish(IOUSBHandoffRing *ring)
+{
+	ring->tail++;
+}
+
+// The oldest published slot, or false if there is none
+static inline bool
+IOUSBHandoffRingFirst(const IOUSBHandoffRing *ring, UInt32 *slot)
+{
+	if ( IOUSBHandoffRingPending(ring) == 0 )
+		return false;
+	
+	*slot = ring->head % ring->slots;
+	return true;
+}
+
+static inline void
+IOUSBHandoffRingRelease(IOUSBHandoffRing *ring)
+{
+	ring->head++;
+}
+
+#endif /* _IOKIT_IOUSBHANDOFFRING_H */
@@ -30,6 +30,7 @@
 #include <IOKit/usb/USB.h>
 #include <IOKit/usb/IOUSBNub.h>
 #include <IOKit/usb/IOUSBDevice.h>
+#include <IOKit/usb/IOUSBPipeTable.h>
 
 /*!
     @class IOUSBInterface
@@ -69,6 +70,7 @@ protected:
 #ifdef SUPPORTS_SS_USB
         UInt32              _RememberedStreams[kUSBMaxPipes];
 #endif
+		IOUSBInterfacePipeTable			_pipeTable;						// copy of _pipeList, rewritten only under the gate
     };
     ExpansionData * _expansionData;
 
@@ -82,6 +84,10 @@ protected:
     IOReturn 			ClosePipesGated(bool close);	// Abort and close or unlink all pipes (except pipe zero) (not virtual)
 	IOUSBPipe*			FindNextPipeGated(IOUSBPipe *current, IOUSBFindEndpointRequest *request, bool withRetain);
 	IOUSBPipe*			GetPipeObjGated(UInt8 index);
+	void				PublishPipeTableGated(void);
+	void				PublishPipeTable(void);
+	bool				LookupPipeTable(UInt8 index, IOUSBPipe **pipe);
+	bool				FindNextPipeInTable(IOUSBPipe *current, IOUSBFindEndpointRequest *request, IOUSBPipe **pipe);
 #ifdef SUPPORTS_SS_USB
     IOReturn 			ReopenPipesGated();             // relink all pipes (except pipe zero) (not virtual)
 	void	 			RememberStreamsGated(void);
@@ -98,6 +104,7 @@ public:
 	static IOReturn 			_ClosePipes(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
 	static IOReturn 			_FindNextPipe(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
 	static IOReturn 			_GetPipeObj(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
+	static IOReturn 			_PublishPipeTable(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
 #ifdef SUPPORTS_SS_USB
 	static IOReturn 			_ReopenPipes(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
 	static IOReturn 			_RememberStreams(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
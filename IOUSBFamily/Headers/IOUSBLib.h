@@ -731,6 +731,39 @@ __BEGIN_DECLS
 #define kIOUSBInterfaceInterfaceID500 CFUUIDGetConstantUUIDWithBytes(kCFAllocatorSystemDefault, \
 	0x6C, 0x0D, 0x38, 0xC3, 0xB0, 0x93, 0x4E, 0xA7, 											\
 	0x80, 0x9B, 0x09, 0xFB, 0x5D, 0xDD, 0xAC, 0x16)
+
+// 10EE6D41-958C-4705-ACC1-A345CD1FD04D
+/*!
+ @defined kIOUSBInterfaceInterfaceID550
+ @discussion This UUID constant is used to obtain a device interface corresponding to
+ an IOUSBInterface user client in the kernel. The type of this device interface is
+ IOUSBInterfaceInterface550. This device interface is obtained after the device interface
+ for the service itself has been obtained.
+ 
+ <b>Note:</b> The IOUSBInterfaceInterface550 is returned only by version 5.5.0 or above of
+ the IOUSBFamily. It adds registered buffers (RegisterBuffer, UnregisterBuffer, ReadPipeRegisteredAsync and
+ WritePipeRegisteredAsync) to the IOUSBInterfaceInterface500. If your software is running on an earlier version of
+ the IOUSBFamily you will need to use kIOUSBInterfaceInterfaceID500 or one of the earlier UUIDs and you will not have
+ access to these functions.
+ 
+ Example:
+ <pre>
+ @textblock
+ IOCFPluginInterface             **iodev; 	// obtained earlier
+ 
+ IOUSBInterfaceInterface550      **intf;     // fetching this now
+ IOReturn                        err;
+ 
+ err = (*iodev)->QueryInterface(iodev,
+ CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID550),
+ (LPVoid)&intf);
+ @/textblock
+ </pre>
+ */
+
+#define kIOUSBInterfaceInterfaceID550 CFUUIDGetConstantUUIDWithBytes(kCFAllocatorSystemDefault, \
+	0x10, 0xEE, 0x6D, 0x41, 0x95, 0x8C, 0x47, 0x05, 											\
+	0xAC, 0xC1, 0xA3, 0x45, 0xCD, 0x1F, 0xD0, 0x4D)
 #endif
 
 /*!
@@ -3209,6 +3242,170 @@ typedef struct IOUSBInterfaceStruct500{
 } IOUSBInterfaceInterface500;
 #endif
 
+
+#ifdef SUPPORTS_SS_USB
+typedef struct IOUSBInterfaceStruct550{
+    IUNKNOWN_C_GUTS;
+    IOReturn (*CreateInterfaceAsyncEventSource)(void *self, CFRunLoopSourceRef *source);
+    CFRunLoopSourceRef (*GetInterfaceAsyncEventSource)(void *self);
+    IOReturn (*CreateInterfaceAsyncPort)(void *self, mach_port_t *port);
+    mach_port_t (*GetInterfaceAsyncPort)(void *self);
+    IOReturn (*USBInterfaceOpen)(void *self);
+    IOReturn (*USBInterfaceClose)(void *self);
+    IOReturn (*GetInterfaceClass)(void *self, UInt8 *intfClass);
+    IOReturn (*GetInterfaceSubClass)(void *self, UInt8 *intfSubClass);
+    IOReturn (*GetInterfaceProtocol)(void *self, UInt8 *intfProtocol);
+    IOReturn (*GetDeviceVendor)(void *self, UInt16 *devVendor);
+    IOReturn (*GetDeviceProduct)(void *self, UInt16 *devProduct);
+    IOReturn (*GetDeviceReleaseNumber)(void *self, UInt16 *devRelNum);
+    IOReturn (*GetConfigurationValue)(void *self, UInt8 *configVal);
+    IOReturn (*GetInterfaceNumber)(void *self, UInt8 *intfNumber);
+    IOReturn (*GetAlternateSetting)(void *self, UInt8 *intfAltSetting);
+    IOReturn (*GetNumEndpoints)(void *self, UInt8 *intfNumEndpoints);
+    IOReturn (*GetLocationID)(void *self, UInt32 *locationID);
+    IOReturn (*GetDevice)(void *self, io_service_t *device);
+    IOReturn (*SetAlternateInterface)(void *self, UInt8 alternateSetting);
+    IOReturn (*GetBusFrameNumber)(void *self, UInt64 *frame, AbsoluteTime *atTime);
+    IOReturn (*ControlRequest)(void *self, UInt8 pipeRef, IOUSBDevRequest *req);
+    IOReturn (*ControlRequestAsync)(void *self, UInt8 pipeRef, IOUSBDevRequest *req, IOAsyncCallback1 callback, void *refCon);
+    IOReturn (*GetPipeProperties)(void *self, UInt8 pipeRef, UInt8 *direction, UInt8 *number, UInt8 *transferType, UInt16 *maxPacketSize, UInt8 *interval);
+    IOReturn (*GetPipeStatus)(void *self, UInt8 pipeRef);
+    IOReturn (*AbortPipe)(void *self, UInt8 pipeRef);
+    IOReturn (*ResetPipe)(void *self, UInt8 pipeRef);
+    IOReturn (*ClearPipeStall)(void *self, UInt8 pipeRef);
+    IOReturn (*ReadPipe)(void *self, UInt8 pipeRef, void *buf, UInt32 *size);
+    IOReturn (*WritePipe)(void *self, UInt8 pipeRef, void *buf, UInt32 size);
+    IOReturn (*ReadPipeAsync)(void *self, UInt8 pipeRef, void *buf, UInt32 size, IOAsyncCallback1 callback, void *refcon);
+    IOReturn (*WritePipeAsync)(void *self, UInt8 pipeRef, void *buf, UInt32 size, IOAsyncCallback1 callback, void *refcon);
+    IOReturn (*ReadIsochPipeAsync)(void *self, UInt8 pipeRef, void *buf, UInt64 frameStart, UInt32 numFrames, IOUSBIsocFrame *frameList,
+                                   IOAsyncCallback1 callback, void *refcon);
+    IOReturn (*WriteIsochPipeAsync)(void *self, UInt8 pipeRef, void *buf, UInt64 frameStart, UInt32 numFrames, IOUSBIsocFrame *frameList,
+                                    IOAsyncCallback1 callback, void *refcon);
+    IOReturn (*ControlRequestTO)(void *self, UInt8 pipeRef, IOUSBDevRequestTO *req);
+    IOReturn (*ControlRequestAsyncTO)(void *self, UInt8 pipeRef, IOUSBDevRequestTO *req, IOAsyncCallback1 callback, void *refCon);
+    IOReturn (*ReadPipeTO)(void *self, UInt8 pipeRef, void *buf, UInt32 *size, UInt32 noDataTimeout, UInt32 completionTimeout);
+    IOReturn (*WritePipeTO)(void *self, UInt8 pipeRef, void *buf, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout);
+    IOReturn (*ReadPipeAsyncTO)(void *self, UInt8 pipeRef, void *buf, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refcon);
+    IOReturn (*WritePipeAsyncTO)(void *self, UInt8 pipeRef, void *buf, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refcon);
+    IOReturn (*USBInterfaceGetStringIndex)(void *self, UInt8 *si);
+    IOReturn (*USBInterfaceOpenSeize)(void *self);
+    IOReturn (*ClearPipeStallBothEnds)(void *self, UInt8 pipeRef);
+    IOReturn (*SetPipePolicy)(void *self, UInt8 pipeRef, UInt16 maxPacketSize, UInt8 maxInterval);
+    IOReturn (*GetBandwidthAvailable)(void *self, UInt32 *bandwidth);
+    IOReturn (*GetEndpointProperties)(void *self, UInt8 alternateSetting, UInt8 endpointNumber, UInt8 direction, UInt8 *transferType, UInt16 *maxPacketSize, UInt8 *interval);
+    IOReturn (*LowLatencyReadIsochPipeAsync)(void *self, UInt8 pipeRef, void *buf, UInt64 frameStart, UInt32 numFrames, UInt32 updateFrequency, IOUSBLowLatencyIsocFrame *frameList,
+                                             IOAsyncCallback1 callback, void *refcon);
+    IOReturn (*LowLatencyWriteIsochPipeAsync)(void *self, UInt8 pipeRef, void *buf, UInt64 frameStart, UInt32 numFrames, UInt32 updateFrequency, IOUSBLowLatencyIsocFrame *frameList,
+                                              IOAsyncCallback1 callback, void *refcon);
+    IOReturn (*LowLatencyCreateBuffer)(void * self, void **buffer, IOByteCount size, UInt32 bufferType);
+    IOReturn (*LowLatencyDestroyBuffer) (void * self, void * buffer );
+    IOReturn (*GetBusMicroFrameNumber)(void *self, UInt64 *microFrame, AbsoluteTime *atTime);
+    IOReturn (*GetFrameListTime)(void *self, UInt32 *microsecondsInFrame);
+    IOReturn (*GetIOUSBLibVersion)(void *self, NumVersion *ioUSBLibVersion, NumVersion *usbFamilyVersion);
+    IOUSBDescriptorHeader * (*FindNextAssociatedDescriptor)(void *self, const void *currentDescriptor, UInt8 descriptorType);
+    IOUSBDescriptorHeader * (*FindNextAltInterface)(void *self, const void *current, IOUSBFindInterfaceRequest *request);
+    IOReturn (*GetBusFrameNumberWithTime)(void *self, UInt64 *frame, AbsoluteTime *atTime);
+	
+#ifdef SUPPORTS_SS_USB
+    /*!
+	 @function GetPipePropertiesV2
+	 @abstract   Gets the properties for a pipe, including the USB SuperSpeed endpoint companion properties.
+	 @discussion Once an interface is opened, all of the pipes in that interface get created by the kernel. The number
+	 of pipes can be retrieved by GetNumEndpoints. The client can then get the properties of any pipe 
+	 using an index of 1 to GetNumEndpoints. Pipe 0 is the default control pipe in the device.
+	 @param      self Pointer to the IOUSBInterfaceInterface.
+	 @param      pipeRef Index for the desired pipe (1 - GetNumEndpoints).
+	 @param      direction Pointer to an UInt8 to get the direction of the pipe.
+	 @param      number Pointer to an UInt8 to get the pipe number.
+	 @param      transferType Pointer to an UInt8 to get the transfer type of the pipe.
+	 @param      maxPacketSize Pointer to an UInt16 to get the maxPacketSize of the pipe.
+	 @param      interval Pointer to an UInt8 to get the interval for polling the pipe for data (in milliseconds).
+	 @param      maxBurst Pointer to an UInt8 to get the bMaxBurst value of the SuperSpeed Endpoint Companion descriptor
+	 @param      mult Pointer to an UInt8 to get the mult value of the bmAttributes field of the SuperSpeed Endpoint Companion descriptor, valid only for an isochronous endpoint
+	 @param      bytesPerInterval Pointer to an UInt16 to get the wBytesPerInterval value of the SuperSpeed Endpoint Companion descriptor, valid only for periodic endpoints
+	 @result     Returns kIOReturnSuccess if successful, kIOReturnNoDevice if there is no connection to an IOService,
+	 or kIOReturnNotOpen if the interface is not open for exclusive access.
+	 */
+    IOReturn (*GetPipePropertiesV2)(void *self, UInt8 pipeRef, UInt8 *direction, UInt8 *number, UInt8 *transferType, UInt16 *maxPacketSize, UInt8 *interval, UInt8 *maxBurst, UInt8 *mult, UInt16 *bytesPerInterval);
+#endif
+	
+    /*!
+	 @function RegisterBuffer
+	 @abstract   Registers a buffer for use with ReadPipeRegisteredAsync and WritePipeRegisteredAsync.
+	 @discussion The buffer is wired down once, when it is registered, and stays wired until it is unregistered
+	 or the interface is closed. Transfers to and from a registered buffer are then started without wiring or
+	 describing the memory again, which makes a difference for clients issuing many small transfers.
+	 @availability This function is only available with IOUSBInterfaceInterface550 and above.
+	 @param      self Pointer to the IOUSBInterfaceInterface.
+	 @param      buffer Buffer to register.
+	 @param      size Size of the buffer, in bytes.
+	 @param      direction kUSBIn if the buffer will only be read into, kUSBOut if it will only be written from, or kUSBAnyDirn.
+	 @param      bufferHandle Pointer to a UInt64 to get the handle of the registered buffer.
+	 @result     Returns kIOReturnSuccess if successful, kIOReturnNoDevice if there is no connection to an IOService,
+	 kIOReturnNotOpen if the interface is not open for exclusive access, or kIOReturnNoResources if the interface
+	 has as many buffers, or as much memory, registered as it allows.
+	 */
+    IOReturn (*RegisterBuffer)(void *self, void *buffer, UInt64 size, UInt32 direction, UInt64 *bufferHandle);
+	
+    /*!
+	 @function UnregisterBuffer
+	 @abstract   Unregisters a buffer registered with RegisterBuffer.
+	 @discussion The buffer is unwired once any transfers still using it have completed.
+	 @availability This function is only available with IOUSBInterfaceInterface550 and above.
+	 @param      self Pointer to the IOUSBInterfaceInterface.
+	 @param      bufferHandle Handle returned by RegisterBuffer.
+	 @result     Returns kIOReturnSuccess if successful, kIOReturnNoDevice if there is no connection to an IOService,
+	 kIOReturnNotOpen if the interface is not open for exclusive access, or kIOReturnBadArgument if there is no
+	 buffer registered with that handle.
+	 */
+    IOReturn (*UnregisterBuffer)(void *self, UInt64 bufferHandle);
+	
+    /*!
+	 @function ReadPipeRegisteredAsync
+	 @abstract   Performs an asynchronous read on a BULK IN or an INTERRUPT pipe into a registered buffer.
+	 @discussion The interface must be open for the pipe to exist.
+	 @availability This function is only available with IOUSBInterfaceInterface550 and above.
+	 @param      self Pointer to the IOUSBInterfaceInterface.
+	 @param      pipeRef Index for the desired pipe (1 - GetNumEndpoints).
+	 @param      bufferHandle Handle of a buffer registered with RegisterBuffer for kUSBIn or kUSBAnyDirn.
+	 @param      offset Offset in the registered buffer at which to put the data.
+	 @param      size Number of bytes to read. offset + size must not be larger than the registered buffer.
+	 @param      noDataTimeout Specifies a time value in milliseconds. Once the request is queued on the bus, if no data is transferred 
+	 in this amount of time, the request will be aborted and returned.
+	 @param      completionTimeout Specifies a time value in milliseconds. Once the request is queued on the bus, if the entire request is not 
+	 completed in this amount of time, the request will be aborted and returned.
+	 @param      callback An IOAsyncCallback1 method. Upon completion, the arg0 argument of the AsyncCallback1 will contain the number of bytes that were actually read.
+	 @param      refcon Arbitrary pointer which is passed as a parameter to the callback routine.
+	 @result     Returns kIOReturnSuccess if successful, kIOReturnNoDevice if there is no connection to an IOService,
+	 kIOReturnNotOpen if the interface is not open for exclusive access, kIOUSBNoAsyncPortErr if no
+	 Async port has been created for this interface, or kIOReturnBadArgument if the handle, offset or size are not valid.
+	 */
+    IOReturn (*ReadPipeRegisteredAsync)(void *self, UInt8 pipeRef, UInt64 bufferHandle, UInt64 offset, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refcon);
+	
+    /*!
+	 @function WritePipeRegisteredAsync
+	 @abstract   Performs an asynchronous write on a BULK OUT or an INTERRUPT pipe from a registered buffer.
+	 @discussion The interface must be open for the pipe to exist.
+	 @availability This function is only available with IOUSBInterfaceInterface550 and above.
+	 @param      self Pointer to the IOUSBInterfaceInterface.
+	 @param      pipeRef Index for the desired pipe (1 - GetNumEndpoints).
+	 @param      bufferHandle Handle of a buffer registered with RegisterBuffer for kUSBOut or kUSBAnyDirn.
+	 @param      offset Offset in the registered buffer of the data to write.
+	 @param      size Number of bytes to write. offset + size must not be larger than the registered buffer.
+	 @param      noDataTimeout Specifies a time value in milliseconds. Once the request is queued on the bus, if no data is transferred 
+	 in this amount of time, the request will be aborted and returned.
+	 @param      completionTimeout Specifies a time value in milliseconds. Once the request is queued on the bus, if the entire request is not 
+	 completed in this amount of time, the request will be aborted and returned.
+	 @param      callback An IOAsyncCallback1 method. Upon completion, the arg0 argument of the AsyncCallback1 will contain the number of bytes that were actually written.
+	 @param      refcon Arbitrary pointer which is passed as a parameter to the callback routine.
+	 @result     Returns kIOReturnSuccess if successful, kIOReturnNoDevice if there is no connection to an IOService,
+	 kIOReturnNotOpen if the interface is not open for exclusive access, kIOUSBNoAsyncPortErr if no
+	 Async port has been created for this interface, or kIOReturnBadArgument if the handle, offset or size are not valid.
+	 */
+    IOReturn (*WritePipeRegisteredAsync)(void *self, UInt8 pipeRef, UInt64 bufferHandle, UInt64 offset, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refcon);
+} IOUSBInterfaceInterface550;
+#endif
+
 #define kIOUSBDeviceClassName		"IOUSBDevice"
 #define kIOUSBInterfaceClassName	"IOUSBInterface"
 
@@ -0,0 +1,182 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_IOUSBPIPETABLE_H
+#define _IOKIT_IOUSBPIPETABLE_H
+
+#include <IOKit/usb/USB.h>
+
+#include <libkern/OSAtomic.h>
+
+//
+// The pipe table of an IOUSBInterface: a copy of its pipe list and of the endpoint parameters which FindNextPipe matches
+// on, which GetPipeObj and FindNextPipe read without the command gate. The interface rewrites it under the gate, between
+// IOUSBPipeTableBeginUpdate and IOUSBPipeTableEndUpdate, when the pipes of an alternate setting are created, reopened or
+// closed. The generation count is odd while a rewrite is under way, and a reader whose copy straddled a rewrite throws it
+// away and tries again. After kUSBPipeTableReadRetries tries the lookups give up and the caller takes the gate.
+//
+
+class IOUSBPipe;
+
+enum
+{
+	kUSBPipeTableReadRetries	= 4
+};
+
+/*!
+ @struct IOUSBInterfacePipeTableEntry
+ @abstract One pipe of the current alternate setting, as published for lookups which don't take the command gate.
+ */
+struct IOUSBInterfacePipeTableEntry
+{
+	IOUSBPipe *		pipe;
+	UInt16			maxPacketSize;
+	UInt8			transferType;
+	UInt8			direction;
+	UInt8			interval;
+};
+
+struct IOUSBInterfacePipeTable
+{
+	volatile UInt32					generation;					// odd while the table is being rewritten
+	UInt32							count;						// entries which FindNext looks at
+	IOUSBInterfacePipeTableEntry	entries[kUSBMaxPipes];
+};
+
+
+
+static inline void
+IOUSBPipeTableBeginUpdate(IOUSBInterfacePipeTable *table)
+{
+	OSIncrementAtomic((volatile SInt32 *)&table->generation);			// odd - readers back off
+	OSMemoryBarrier();
+}
+
+static inline void
+IOUSBPipeTableEndUpdate(IOUSBInterfacePipeTable *table)
+{
+	OSMemoryBarrier();
+	OSIncrementAtomic((volatile SInt32 *)&table->generation);			// even - the table is consistent again
+}
+
+
+
+// The pipe at index. Returns false if a rewrite kept getting in the way
+static inline bool
+IOUSBPipeTableLookup(const IOUSBInterfacePipeTable *table, UInt8 index, IOUSBPipe **pipe)
+{
+	UInt32		generation;
+	IOUSBPipe	*found;
+	
+	for ( int tries = 0; tries < kUSBPipeTableReadRetries; tries++ )
+	{
+		generation = table->generation;
+		if (generation & 1)
+			continue;
+		OSMemoryBarrier();
+		
+		found = (index < kUSBMaxPipes) ? table->entries[index].pipe : NULL;
+		
+		OSMemoryBarrier();
+		if (generation == table->generation)
+		{
+			*pipe = found;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+
+// The first pipe after current (or the first one, if current is NULL) which matches the type and direction of request, the
+// way IOUSBInterface::FindNextPipe matches them, with request updated from its endpoint. Returns false if a rewrite kept
+// getting in the way
+static inline bool
+IOUSBPipeTableFindNext(const IOUSBInterfacePipeTable *table, IOUSBPipe *current, IOUSBFindEndpointRequest *request, IOUSBPipe **pipe)
+{
+	IOUSBInterfacePipeTableEntry		entry;
+	UInt32								generation;
+	UInt32								count;
+	UInt32								i;
+	
+	for ( int tries = 0; tries < kUSBPipeTableReadRetries; tries++ )
+	{
+		generation = table->generation;
+		if (generation & 1)
+			continue;
+		OSMemoryBarrier();
+		
+		count = table->count;
+		if (count > kUSBMaxPipes)
+			count = kUSBMaxPipes;								// only possible in a torn copy
+		
+		i = 0;	// Start at beginning.
+		if (current != 0)
+		{
+			for ( ; i < count; i++)
+			{
+				if (table->entries[i].pipe == current)
+				{
+					i++; // Skip the one we just did
+					break;
+				}
+			}
+		}
+		
+		entry.pipe = NULL;
+		for ( ; i < count; i++)
+		{
+			entry = table->entries[i];
+			if (!entry.pipe)
+				continue;
+			
+			// check the request parameters
+			if ((request->type != kUSBAnyType) && (request->type != entry.transferType))
+				continue;
+			if ((request->direction != kUSBAnyDirn) && (request->direction != entry.direction))
+				continue;
+			break;
+		}
+		if (i >= count)
+			entry.pipe = NULL;
+		
+		OSMemoryBarrier();
+		if (generation != table->generation)
+			continue;
+		
+		if (entry.pipe)
+		{
+			request->type = entry.transferType;
+			request->direction = entry.direction;
+			request->maxPacketSize = entry.maxPacketSize;
+			request->interval = entry.interval;
+		}
+		*pipe = entry.pipe;
+		return true;
+	}
+	return false;
+}
+
+#endif /* _IOKIT_IOUSBPIPETABLE_H */
@@ -31,6 +31,12 @@
 #include <IOKit/usb/IOUSBControllerV2.h>
 #include <IOKit/usb/IOUSBPipe.h>
 
+#ifdef SUPPORTS_SS_USB
+#include <IOKit/usb/IOUSBStreamScheduler.h>
+
+struct IOUSBStreamRequest;
+#endif
+
 
 /*!
     @class IOUSBPipeV2
@@ -55,12 +61,28 @@ protected:
 
     struct V2PipeExpansionData
     {
+		IOUSBStreamScheduler *		_streamScheduler;		// set while streams are configured, see CreateStreams
+		IOLock *					_streamLock;			// guards _streamScheduler and everything in it, lives as long as the pipe
     };
     V2PipeExpansionData * _v2PipeExpansionData;
     	
     static IOUSBPipeV2 *ToEndpoint(const IOUSBEndpointDescriptor *endpoint, IOUSBSuperSpeedEndpointCompanionDescriptor *sscd,
                                  IOUSBDevice * device, IOUSBController * controller, IOUSBInterface *interface);
 	
+	virtual void free();
+	
+	// stream scheduler
+	IOReturn		CreateStreamScheduler(UInt32 maxStreams);
+	IOReturn		FreeStreamScheduler(void);
+	IOUSBStreamScheduler *	RetainStreamScheduler(void);
+	void			ReleaseStreamScheduler(IOUSBStreamScheduler *scheduler);
+	IOReturn		QueueStreamRequest(bool isRead, UInt32 streamID, IOMemoryDescriptor *buffer, UInt32 noDataTimeout, UInt32 completionTimeout, IOByteCount reqCount, IOUSBCompletion *completion);
+	IOReturn		SubmitStreamRequest(IOUSBStreamRequest *request);
+	void			DispatchStreamRequests(IOUSBStreamScheduler *scheduler);
+	void			FinishStreamRequest(IOUSBStreamScheduler *scheduler, IOUSBStreamRequest *request, IOReturn status, UInt32 bufferSizeRemaining, bool callClient);
+	void			AbortStreamRequests(UInt32 streamID);
+	static void		StreamRequestComplete(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining);
+	
 public:
     using IOUSBPipe::Read;
     using IOUSBPipe::Write;
@@ -128,7 +150,13 @@ public:
 	 toggle bit on the endpoint in the controller.  If you wish to clear the toggle bit, see ClearPipeStall
      @param streamID ID of the stream to abort
 	 */
-    virtual IOReturn Abort(UInt32 streamID);
+virtual IOReturn Abort(UInt32 streamID);
+    
+	/*!
+	 @function Abort
+	 Aborts all outstanding I/O on the pipe, including stream requests which are still waiting in the pipe's stream scheduler.
+	 */
+    virtual IOReturn Abort(void);
     
 	/*!
 	 @function GetConfiguredStreams
@@ -160,6 +188,30 @@ public:
 	 */
     virtual UInt16 GetBytesPerInterval();
 	
+	/*!
+	 @function SetStreamWeight
+	 Asynchronous stream requests which cannot go to the controller right away wait in the pipe, and the streams with waiting
+	 requests take turns (weighted round robin). A stream with weight N starts up to N requests in a row before the next stream
+	 gets its turn. The default is kUSBStreamDefaultWeight.
+	 @param streamID ID of the stream
+	 @param weight number of requests per turn, at least 1
+	 */
+	IOReturn SetStreamWeight(UInt32 streamID, UInt32 weight);
+	
+	/*!
+	 @function SetStreamOutstandingLimits
+	 Sets how many requests of one stream, and of all streams of the pipe, may be with the controller at once. Requests over
+	 either limit wait in the pipe. The defaults are kUSBStreamDefaultMaxOutstandingPerStream and kUSBStreamDefaultMaxOutstanding.
+	 */
+	IOReturn SetStreamOutstandingLimits(UInt32 maxOutstandingPerStream, UInt32 maxOutstanding);
+	
+	/*!
+	 @function GetStreamStatistics
+	 Returns the stream scheduler's counters for a stream.
+	 @result kIOReturnNotReady if the pipe has no stream scheduler (no streams created, or more than kUSBStreamSchedulerMaxStreams).
+	 */
+	IOReturn GetStreamStatistics(UInt32 streamID, IOUSBStreamStatistics *statistics);
+	
 #endif	
 	OSMetaClassDeclareReservedUnused(IOUSBPipeV2,  0);
 	OSMetaClassDeclareReservedUnused(IOUSBPipeV2,  1);
@@ -0,0 +1,129 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _IOKIT_IOUSBPOLLEDTDRESERVE_H
+#define _IOKIT_IOUSBPOLLEDTDRESERVE_H
+
+#include <IOKit/IOTypes.h>
+
+//
+// The transfer descriptors a UIM sets aside on the queue of an endpoint registered with RegisterPolledEndpoint, so that a
+// polled read on it never has to grow the TD free list. The UIM fills the reserve up to target from its free list when the
+// endpoint is registered, takes the TDs of every transfer on the queue from the reserve first, and gives back a TD freed
+// from the queue while the reserve is short of target. The reserve is drained when the endpoint is unregistered or its
+// queue goes away.
+//
+// The functions are templates over the TD type and an Ops class with two static functions: Next(td) returns the TD after
+// td in the reserve, and SetNext(td, next) sets it. The UIM calls them on its workloop, or from PollInterrupts when that
+// is the only thing running, so they take no lock.
+//
+
+template <class TD>
+struct IOUSBPolledTDReserve
+{
+	TD			*head;
+	UInt32		count;
+	UInt32		target;				// 0 unless a polled endpoint is registered on the queue
+	UInt32		hits;				// TDs a transfer took from the reserve
+	UInt32		misses;				// TDs a transfer had to take from the free list
+};
+
+// The TDs a read of maxBufferSize bytes needs when one TD carries bytesPerTD. The reserve holds twice that: one read for
+// the polled endpoint and one for its client's own interrupt read, which is usually queued on the same endpoint
+static inline UInt32
+IOUSBPolledTDReserveTarget(UInt32 maxBufferSize, UInt32 bytesPerTD)
+{
+	UInt32		needed = 1;
+	
+	if (maxBufferSize && bytesPerTD)
+		needed = (maxBufferSize + bytesPerTD - 1) / bytesPerTD;
+	return 2 * needed;
+}
+
+template <class TD>
+static inline void
+IOUSBPolledTDReserveSetTarget(IOUSBPolledTDReserve<TD> *reserve, UInt32 target)
+{
+	reserve->target = target;
+}
+
+template <class TD>
+static inline bool
+IOUSBPolledTDReserveShort(const IOUSBPolledTDReserve<TD> *reserve)
+{
+	return reserve->count < reserve->target;
+}
+
+// A TD for a transfer on the queue, or NULL if the queue has no reserve or it is empty, when the caller takes one from the
+// free list
+template <class Ops, class TD>
+static inline TD *
+IOUSBPolledTDReserveTake(IOUSBPolledTDReserve<TD> *reserve)
+{
+	TD			*td = reserve->head;
+	
+	if (reserve->target == 0)
+		return NULL;
+	
+	if (!td)
+	{
+		reserve->misses++;
+		return NULL;
+	}
+	reserve->head = Ops::Next(td);
+	Ops::SetNext(td, NULL);
+	reserve->count--;
+	reserve->hits++;
+	return td;
+}
+
+// Keeps td if the reserve is short of its target. Returns false if the caller should put it on the free list
+template <class Ops, class TD>
+static inline bool
+IOUSBPolledTDReserveGive(IOUSBPolledTDReserve<TD> *reserve, TD *td)
+{
+	if (!IOUSBPolledTDReserveShort(reserve))
+		return false;
+	
+	Ops::SetNext(td, reserve->head);
+	reserve->head = td;
+	reserve->count++;
+	return true;
+}
+
+// Empties the reserve and sets its target to 0. Returns the TDs it held, linked with SetNext, for the caller to free
+template <class TD>
+static inline TD *
+IOUSBPolledTDReserveDrain(IOUSBPolledTDReserve<TD> *reserve)
+{
+	TD			*head = reserve->head;
+	
+	reserve->head = NULL;
+	reserve->count = 0;
+	reserve->target = 0;
+	return head;
+}
+
+#endif /* _IOKIT_IOUSBPOLLEDTDRESERVE_H */
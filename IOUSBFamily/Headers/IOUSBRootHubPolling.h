@@ -0,0 +1,103 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _IOKIT_IOUSBROOTHUBPOLLING_H
+#define _IOKIT_IOUSBROOTHUBPOLLING_H
+
+#include <IOKit/IOTypes.h>
+
+//
+// How often the root hub timer looks for port changes. A UIM whose controller interrupts for every root hub port change
+// says so in portChangeInterrupts and calls RootHubPortChangeInterrupt, which looks right away. The timer is then only a
+// safety net, and its interval doubles from the root hub polling rate up to kUSBRootHubMaxPollingInterval for as long as
+// it finds nothing. Without the interrupt the timer stays at the polling rate. The caller serializes these on the workloop.
+//
+
+enum
+{
+	kUSBRootHubMaxPollingInterval	= 1024
+};
+
+struct IOUSBRootHubPolling
+{
+	bool		portChangeInterrupts;		// T if the UIM calls RootHubPortChangeInterrupt for every root hub port change
+	bool		statisticsChanged;			// T if the counters below changed since they were last published
+	uint32_t	intervalMS;					// current root hub timer interval
+	UInt64		timerWakeups;				// number of times the root hub timer fired
+	UInt64		timerWakeupsAvoided;		// number of wakeups at the polling rate the back off saved
+	UInt64		portChangeEvents;			// number of port change interrupts reported by the UIM
+};
+
+// A new listener (RootHubStartTimer32) starts out at the full rate
+static inline uint32_t
+IOUSBRootHubPollingStart(IOUSBRootHubPolling *polling, uint32_t rate)
+{
+	polling->intervalMS = rate;
+	return polling->intervalMS;
+}
+
+static inline void
+IOUSBRootHubPollingTimerFired(IOUSBRootHubPolling *polling)
+{
+	polling->timerWakeups++;
+	polling->statisticsChanged = true;
+}
+
+// Counts a port change interrupt. Returns true if the root hub should be checked now, which also puts the timer back at the
+// full rate; false if nobody is listening to the root hub (rate is 0)
+static inline bool
+IOUSBRootHubPollingPortChange(IOUSBRootHubPolling *polling, uint32_t rate)
+{
+	polling->portChangeEvents++;
+	polling->statisticsChanged = true;
+	if ( rate == 0 )
+		return false;
+	
+	polling->intervalMS = rate;
+	return true;
+}
+
+// The interval until the next timer check, after a check from the timer (fromTimer) or from an interrupt, which found
+// changes or not
+static inline uint32_t
+IOUSBRootHubPollingNext(IOUSBRootHubPolling *polling, uint32_t rate, bool fromTimer, bool foundChanges)
+{
+	if ( !polling->intervalMS || !polling->portChangeInterrupts || foundChanges )
+	{
+		polling->intervalMS = rate;
+	}
+	else if ( fromTimer && rate )
+	{
+		// a poll which found nothing lets the next one wait twice as long. This one stood in for (interval / rate) polls at
+		// the fixed rate
+		polling->timerWakeupsAvoided += (polling->intervalMS / rate) - 1;
+		polling->intervalMS *= 2;
+		if ( polling->intervalMS > kUSBRootHubMaxPollingInterval )
+			polling->intervalMS = (rate > kUSBRootHubMaxPollingInterval) ? rate : (uint32_t)kUSBRootHubMaxPollingInterval;
+	}
+	return polling->intervalMS;
+}
+
+#endif /* _IOKIT_IOUSBROOTHUBPOLLING_H */
@@ -0,0 +1,285 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_IOUSBSTREAMSCHEDULER_H
+#define _IOKIT_IOUSBSTREAMSCHEDULER_H
+
+#include <IOKit/IOTypes.h>
+
+#include <kern/queue.h>
+
+//
+// The stream scheduler of an IOUSBPipeV2. Asynchronous requests on a pipe with streams go straight to the controller as long
+// as their stream has nothing waiting and neither the stream nor the pipe is over its outstanding limit. Otherwise they wait
+// in a per stream queue, and the streams with waiting requests are served weighted round robin as requests complete: the
+// stream at the head of the active list starts up to <weight> requests, then moves to the tail.
+//
+// The functions ending in Locked are called with the pipe's stream lock held. The same lock guards the pipe's pointer to
+// the scheduler, and users counts the callers which looked the scheduler up and are still using it without the lock, so
+// that the scheduler is only freed when nothing is queued, outstanding or on its way in.
+//
+// The request functions are templates over the request type, which has a queue_chain_t link, a UInt32 streamID, a bool
+// outstanding and an IOByteCount reqCount.
+//
+
+enum
+{
+	kUSBStreamDefaultWeight						= 1,		// requests a stream may start in a row while others are waiting
+	kUSBStreamDefaultMaxOutstandingPerStream	= 4,		// requests of one stream which may be with the controller at once
+	kUSBStreamDefaultMaxOutstanding				= 32,		// requests of all streams of a pipe which may be with the controller at once
+	kUSBStreamSchedulerMaxStreams				= 1024		// pipes with more streams than this go straight to the controller
+};
+
+/*!
+ @struct IOUSBStreamStatistics
+ @abstract What the stream scheduler of an IOUSBPipeV2 has seen on one stream.
+ @field requests Asynchronous requests the pipe accepted for the stream.
+ @field completed Requests which have completed, including those which failed or were aborted.
+ @field bytes Bytes moved by the completed requests.
+ @field errors Requests which completed with an error other than kIOReturnAborted.
+ @field totalQueueTimeUS Time the requests spent waiting in the pipe before they went to the controller.
+ @field maxQueueTimeUS Longest time a request waited in the pipe.
+ @field pending Requests waiting in the pipe now.
+ @field maxPending High-water mark of pending.
+ @field outstanding Requests with the controller now.
+ @field maxOutstanding High-water mark of outstanding.
+ @field weight The weight of the stream (see SetStreamWeight).
+ */
+struct IOUSBStreamStatistics
+{
+	UInt64		requests;
+	UInt64		completed;
+	UInt64		bytes;
+	UInt64		errors;
+	UInt64		totalQueueTimeUS;
+	UInt32		maxQueueTimeUS;
+	UInt32		pending;
+	UInt32		maxPending;
+	UInt32		outstanding;
+	UInt32		maxOutstanding;
+	UInt32		weight;
+};
+
+struct IOUSBStreamState
+{
+	queue_head_t			pending;
+	queue_chain_t			activeLink;					// on the scheduler's active list while pending is not empty
+	bool					active;
+	UInt32					credit;						// requests left in the current turn
+	IOUSBStreamStatistics	stats;
+};
+
+struct IOUSBStreamScheduler
+{
+	UInt32					streamCount;				// streams 1 through streamCount are scheduled
+	UInt32					maxOutstandingPerStream;
+	UInt32					maxOutstanding;
+	UInt32					outstanding;
+	UInt32					pending;
+	UInt32					users;						// callers using the scheduler outside the lock
+	queue_head_t			activeStreams;
+	UInt32					activeCount;
+	queue_head_t			freeRequests;
+	IOUSBStreamState *		streams;					// indexed by stream ID, entry 0 unused
+};
+
+
+
+// streams has room for streamCount + 1 entries, all zero
+static inline void
+IOUSBStreamSchedulerInit(IOUSBStreamScheduler *scheduler, IOUSBStreamState *streams, UInt32 streamCount)
+{
+	UInt32		i;
+	
+	scheduler->streams = streams;
+	scheduler->streamCount = streamCount;
+	scheduler->maxOutstandingPerStream = kUSBStreamDefaultMaxOutstandingPerStream;
+	scheduler->maxOutstanding = kUSBStreamDefaultMaxOutstanding;
+	queue_init(&scheduler->activeStreams);
+	queue_init(&scheduler->freeRequests);
+	for (i = 0; i <= streamCount; i++)
+	{
+		queue_init(&streams[i].pending);
+		streams[i].stats.weight = kUSBStreamDefaultWeight;
+	}
+}
+
+
+
+// Whether the scheduler may not be freed yet
+static inline bool
+IOUSBStreamSchedulerBusyLocked(const IOUSBStreamScheduler *scheduler)
+{
+	return (scheduler->outstanding != 0) || (scheduler->pending != 0) || (scheduler->users != 0);
+}
+
+
+
+// Accepts a request. Returns true if it is counted as outstanding and the caller should start it now, false if it waits
+template <class Request>
+static inline bool
+IOUSBStreamSchedulerQueueLocked(IOUSBStreamScheduler *scheduler, Request *request)
+{
+	IOUSBStreamState	*state = &scheduler->streams[request->streamID];
+	
+	state->stats.requests++;
+	if (queue_empty(&state->pending) && (state->stats.outstanding < scheduler->maxOutstandingPerStream) && (scheduler->outstanding < scheduler->maxOutstanding))
+	{
+		request->outstanding = true;
+		if (++state->stats.outstanding > state->stats.maxOutstanding)
+			state->stats.maxOutstanding = state->stats.outstanding;
+		scheduler->outstanding++;
+		return true;
+	}
+	
+	request->outstanding = false;
+	queue_enter(&state->pending, request, Request *, link);
+	if (++state->stats.pending > state->stats.maxPending)
+		state->stats.maxPending = state->stats.pending;
+	scheduler->pending++;
+	if (!state->active)
+	{
+		state->active = true;
+		state->credit = state->stats.weight;
+		queue_enter(&scheduler->activeStreams, state, IOUSBStreamState *, activeLink);
+		scheduler->activeCount++;
+	}
+	return false;
+}
+
+
+
+// Takes the next request from the stream whose turn it is, and counts it as outstanding. Returns NULL if nothing is waiting
+// or every stream with waiting requests is at a limit
+template <class Request>
+static inline Request *
+IOUSBStreamSchedulerNextLocked(IOUSBStreamScheduler *scheduler)
+{
+	IOUSBStreamState	*state;
+	Request				*request;
+	UInt32				tries;
+	
+	if (scheduler->outstanding >= scheduler->maxOutstanding)
+		return NULL;
+	
+	for (tries = scheduler->activeCount; tries > 0; tries--)
+	{
+		state = (IOUSBStreamState *)(void *)queue_first(&scheduler->activeStreams);
+		
+		if ((state->credit == 0) || (state->stats.outstanding >= scheduler->maxOutstandingPerStream))
+		{
+			// its turn is over, or it can't take more right now - let the next stream go
+			queue_remove(&scheduler->activeStreams, state, IOUSBStreamState *, activeLink);
+			queue_enter(&scheduler->activeStreams, state, IOUSBStreamState *, activeLink);
+			state->credit = state->stats.weight;
+			continue;
+		}
+		
+		queue_remove_first(&state->pending, request, Request *, link);
+		state->stats.pending--;
+		scheduler->pending--;
+		state->credit--;
+		
+		request->outstanding = true;
+		if (++state->stats.outstanding > state->stats.maxOutstanding)
+			state->stats.maxOutstanding = state->stats.outstanding;
+		scheduler->outstanding++;
+		
+		if (queue_empty(&state->pending))
+		{
+			queue_remove(&scheduler->activeStreams, state, IOUSBStreamState *, activeLink);
+			state->active = false;
+			scheduler->activeCount--;
+		}
+		return request;
+	}
+	return NULL;
+}
+
+
+
+// Accounts for the time a request which NextLocked returned spent waiting
+static inline void
+IOUSBStreamSchedulerWaitedLocked(IOUSBStreamScheduler *scheduler, UInt32 streamID, UInt64 waitedUS)
+{
+	IOUSBStreamStatistics	*stats = &scheduler->streams[streamID].stats;
+	
+	stats->totalQueueTimeUS += waitedUS;
+	if (waitedUS > stats->maxQueueTimeUS)
+		stats->maxQueueTimeUS = (waitedUS > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (UInt32)waitedUS;
+}
+
+
+
+// Accounts for a request which is done, and puts it on the free list
+template <class Request>
+static inline void
+IOUSBStreamSchedulerFinishLocked(IOUSBStreamScheduler *scheduler, Request *request, IOReturn status, UInt32 bufferSizeRemaining)
+{
+	IOUSBStreamState	*state = &scheduler->streams[request->streamID];
+	
+	if (request->outstanding)
+	{
+		state->stats.outstanding--;
+		scheduler->outstanding--;
+	}
+	state->stats.completed++;
+	if ((status != kIOReturnSuccess) && (status != kIOReturnAborted))
+		state->stats.errors++;
+	if (bufferSizeRemaining < request->reqCount)
+		state->stats.bytes += request->reqCount - bufferSizeRemaining;
+	queue_enter(&scheduler->freeRequests, request, Request *, link);
+}
+
+
+
+// Moves the waiting requests of streams first through last onto aborted, for the caller to finish with kIOReturnAborted
+template <class Request>
+static inline void
+IOUSBStreamSchedulerAbortLocked(IOUSBStreamScheduler *scheduler, UInt32 first, UInt32 last, queue_head_t *aborted)
+{
+	IOUSBStreamState	*state;
+	Request				*request;
+	UInt32				i;
+	
+	for (i = first; i <= last; i++)
+	{
+		state = &scheduler->streams[i];
+		while (!queue_empty(&state->pending))
+		{
+			queue_remove_first(&state->pending, request, Request *, link);
+			state->stats.pending--;
+			scheduler->pending--;
+			queue_enter(aborted, request, Request *, link);
+		}
+		if (state->active)
+		{
+			queue_remove(&scheduler->activeStreams, state, IOUSBStreamState *, activeLink);
+			state->active = false;
+			scheduler->activeCount--;
+		}
+	}
+}
+
+#endif /* _IOKIT_IOUSBSTREAMSCHEDULER_H */
@@ -0,0 +1,81 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _IOKIT_IOUSBSTRINGLANGUAGE_H
+#define _IOKIT_IOUSBSTRINGLANGUAGE_H
+
+#include <IOKit/usb/USB.h>
+
+//
+// The string language and UTF-8 copy rules of IOUSBDevice::GetStringDescriptor.
+//
+
+enum
+{
+	kUSBDefaultStringLanguage		= 0x409			// what GetStringDescriptor uses when the caller gives no LANGID
+};
+
+// The LANGID to read a string with, given the device's LANGID table (string descriptor 0, in bus order, count may be 0 when the
+// device has no usable table). Only the default language is ever substituted, by the first LANGID in the table, since a caller
+// which did not pick a language only wants a readable string. A caller which asked for a particular language keeps it, listed
+// or not, and gets the device's own answer.
+static inline UInt16
+IOUSBNegotiateStringLanguage(const UInt16 *langIDs, UInt32 count, UInt16 lang)
+{
+	UInt32		i;
+	
+	if ( (lang != kUSBDefaultStringLanguage) || (count == 0) )
+		return lang;
+	
+	for (i = 0; i < count; i++)
+		if ( USBToHostWord(langIDs[i]) == lang )
+			return lang;
+	
+	return USBToHostWord(langIDs[0]) ? USBToHostWord(langIDs[0]) : lang;
+}
+
+// Copies as much of a UTF-8 string as fits in a buffer of bufferSize bytes, leaving room for the NUL, without splitting a
+// character. Returns the number of bytes copied.
+static inline UInt32
+IOUSBCopyUTF8String(char *buffer, UInt32 bufferSize, const UInt8 *utf8Bytes, UInt32 length)
+{
+	UInt32		i;
+	
+	if ( bufferSize == 0 )
+		return 0;
+	
+	if ( length > (bufferSize - 1) )
+	{
+		length = bufferSize - 1;
+		while ( (length > 0) && ((utf8Bytes[length] & 0xC0) == 0x80) )
+			length--;
+	}
+	for (i = 0; i < length; i++)
+		buffer[i] = (char)utf8Bytes[i];
+	
+	return length;
+}
+
+#endif /* _IOKIT_IOUSBSTRINGLANGUAGE_H */
@@ -0,0 +1,78 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _IOKIT_IOUSBSYNCWAIT_H
+#define _IOKIT_IOUSBSYNCWAIT_H
+
+#include <IOKit/IOLib.h>
+#include <libkern/OSAtomic.h>
+
+//
+// How a synchronous transfer waits for its completion outside of the command gate. The waiting thread owns a done word and
+// uses its address as the sleep event; the completion sets the word and wakes the event under the controller's sync wait lock.
+// Once done is set the waiter may return without ever sleeping, so the completion must not touch the word's owner afterwards.
+//
+
+// The completion side
+static inline void
+IOUSBSyncWaitSignal(IOLock *lock, volatile UInt32 *done, void *event)
+{
+	IOLockLock(lock);
+	OSCompareAndSwap(0, 1, done);
+	IOLockWakeup(lock, event, true);
+	IOLockUnlock(lock);
+}
+
+// Polls for done for up to spinUS microseconds, then sleeps for it. Returns THREAD_AWAKENED once done is set. An
+// interruptible wait returns the sleep result instead if it is interrupted first; the caller then has to make the transfer
+// complete (by aborting it) and wait again, uninterruptibly, since the command still belongs to the controller.
+static inline int
+IOUSBSyncWait(IOLock *lock, volatile UInt32 *done, void *event, UInt32 spinUS, bool interruptible)
+{
+	UInt32		i;
+	int			kr = THREAD_AWAKENED;
+	
+	for (i = 0; (i < spinUS) && !*done; i++)
+		IODelay(1);
+	
+	if ( !*done )
+	{
+		IOLockLock(lock);
+		while ( !*done && (kr == THREAD_AWAKENED) )
+			kr = IOLockSleep(lock, event, interruptible ? THREAD_ABORTSAFE : THREAD_UNINT);
+		IOLockUnlock(lock);
+	}
+	
+	if ( *done )
+	{
+		// done was set after the transfer's status - make sure we see the status the completion saw
+		OSMemoryBarrier();
+		return THREAD_AWAKENED;
+	}
+	
+	return kr;
+}
+
+#endif /* _IOKIT_IOUSBSYNCWAIT_H */
@@ -0,0 +1,325 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_IOUSBTRANSFERPLANNER_H
+#define _IOKIT_IOUSBTRANSFERPLANNER_H
+
+#include <IOKit/IOTypes.h>
+#include <IOKit/IODMACommand.h>
+
+/*!
+ @header IOUSBTransferPlanner.h
+ @abstract Controller independent splitting of a general (bulk, interrupt or control data phase) transfer into transfer descriptors.
+ @discussion Every UIM has to walk the DMA segments of a transfer and decide where each of its transfer descriptors begins and ends,
+	which physical fragments it covers, when a bounce buffer is needed and which data toggle it starts with. The rules differ only
+	in a handful of parameters (page size, page pointers per descriptor, bytes per descriptor, one packet per descriptor), so the
+	walk is done here once and the UIM only encodes each planned entry into its own descriptor format. The planner produces one entry
+	at a time so that no per-transfer storage is needed in the kernel.
+ */
+
+enum
+{
+	kUSBTransferPlanMaxFragments		= 5					// the most page pointers any controller descriptor holds (EHCI qTD)
+};
+
+enum
+{
+	kUSBTransferPlanEntryLast			= 0x00000001,		// this entry completes the transfer
+	kUSBTransferPlanEntryNeedsBounce	= 0x00000002		// the data for this entry cannot be described in place - the UIM must use a bounce buffer
+};
+
+/*!
+ @struct IOUSBTransferPlanConstraints
+ @abstract Describes what a single transfer descriptor of a given controller can address.
+ @field pageSize Page size used by the controller's buffer pointers.
+ @field maxPagesPerDescriptor Number of buffer page pointers in one descriptor. Every pointer after the first must start on a page boundary.
+ @field maxBytesPerDescriptor Largest number of bytes one descriptor may move.
+ @field onePacketPerDescriptor true if each descriptor carries exactly one packet (UHCI).
+ @field addressLimit32 true if the controller can only reach the low 4GB of physical memory.
+ */
+struct IOUSBTransferPlanConstraints
+{
+	UInt32		pageSize;
+	UInt32		maxPagesPerDescriptor;
+	UInt32		maxBytesPerDescriptor;
+	bool		onePacketPerDescriptor;
+	bool		addressLimit32;
+};
+
+static const IOUSBTransferPlanConstraints	kUSBUHCITransferPlanConstraints = { 4096, 1, 1280, true, true };
+static const IOUSBTransferPlanConstraints	kUSBOHCITransferPlanConstraints = { 4096, 2, 8192, false, true };
+static const IOUSBTransferPlanConstraints	kUSBEHCITransferPlanConstraints = { 4096, 5, 20480, false, false };
+
+/*!
+ @struct IOUSBTransferPlanFragment
+ @abstract A physically contiguous piece of one planned descriptor.
+ */
+struct IOUSBTransferPlanFragment
+{
+	UInt64		address;
+	UInt32		length;
+};
+
+/*!
+ @struct IOUSBTransferPlanEntry
+ @abstract One transfer descriptor as planned by IOUSBTransferPlanner.
+ @field offset Offset of the entry's data within the transfer.
+ @field length Number of bytes the entry moves.
+ @field toggle Data toggle (0 or 1) of the first packet of the entry.
+ @field flags kUSBTransferPlanEntryLast and/or kUSBTransferPlanEntryNeedsBounce.
+ @field fragmentCount Number of valid entries in fragments. When kUSBTransferPlanEntryNeedsBounce is set the first fragment holds the
+	start of the unusable segment and the UIM substitutes its bounce buffer.
+ */
+struct IOUSBTransferPlanEntry
+{
+	UInt32						offset;
+	UInt32						length;
+	UInt32						toggle;
+	UInt32						flags;
+	UInt32						fragmentCount;
+	IOUSBTransferPlanFragment	fragments[kUSBTransferPlanMaxFragments];
+};
+
+/*!
+ @class IOUSBDMACommandSegmentSource
+ @abstract Supplies the physical segments of a transfer to IOUSBTransferPlanner from a prepared IODMACommand.
+ @discussion Any class with a matching GetSegment method can be used in its place, which lets the planner run against a
+	synthetic segment list.
+ */
+class IOUSBDMACommandSegmentSource
+{
+public:
+	IOUSBDMACommandSegmentSource(IODMACommand *dmaCommand) : _dmaCommand(dmaCommand) {}
+
+	IOReturn	GetSegment(UInt64 offset, UInt64 *address, UInt64 *length)
+	{
+		IODMACommand::Segment64		segment;
+		UInt32						numSegments = 1;
+		IOReturn					err;
+
+		if (!_dmaCommand)
+			return kIOReturnNotReady;
+
+		err = _dmaCommand->gen64IOVMSegments(&offset, &segment, &numSegments);
+		if (err)
+			return err;
+		if (numSegments != 1)
+			return kIOReturnInternalError;
+
+		*address = segment.fIOVMAddr;
+		*length = segment.fLength;
+		return kIOReturnSuccess;
+	}
+
+private:
+	IODMACommand	*_dmaCommand;
+};
+
+/*!
+ @class IOUSBTransferPlanner
+ @abstract Walks the segments of a transfer and plans it one transfer descriptor at a time.
+ @discussion Usage:
+ <pre>
+	IOUSBDMACommandSegmentSource							source(dmaCommand);
+	IOUSBTransferPlanner<IOUSBDMACommandSegmentSource>		planner(source, kUSBEHCITransferPlanConstraints, length, maxPacket, toggle);
+	IOUSBTransferPlanEntry									entry;
+
+	while (!planner.Done())
+	{
+		if ((err = planner.Next(&entry)))
+			break;
+		// encode entry into a controller descriptor
+	}
+ </pre>
+	A zero length transfer yields a single zero length entry. Every entry except the last is a whole number of maxPacket sized
+	packets, so that a short packet always means the end of the transfer.
+ */
+template <class SegmentSource>
+class IOUSBTransferPlanner
+{
+public:
+	IOUSBTransferPlanner(SegmentSource &source, const IOUSBTransferPlanConstraints &constraints, UInt32 transferLength, UInt32 maxPacket, UInt32 toggle) :
+		_source(source), _constraints(constraints), _length(transferLength), _maxPacket(maxPacket), _offset(0), _toggle(toggle ? 1 : 0), _entries(0)
+	{
+	}
+
+	bool		Done(void) const					{ return (_entries > 0) && (_offset >= _length); }
+	UInt32		NextToggle(void) const				{ return _toggle; }
+	UInt32		EntriesPlanned(void) const			{ return _entries; }
+
+	IOReturn	Next(IOUSBTransferPlanEntry *entry);
+
+private:
+	void		TrimToPackets(IOUSBTransferPlanEntry *entry);
+
+	SegmentSource						&_source;
+	const IOUSBTransferPlanConstraints	&_constraints;
+	UInt32								_length;
+	UInt32								_maxPacket;
+	UInt32								_offset;
+	UInt32								_toggle;
+	UInt32								_entries;
+};
+
+
+template <class SegmentSource>
+IOReturn
+IOUSBTransferPlanner<SegmentSource>::Next(IOUSBTransferPlanEntry *entry)
+{
+	UInt32			pageMask = _constraints.pageSize - 1;
+	UInt32			pagesUsed = 0;
+	UInt32			limit;
+	UInt32			packets;
+
+	if (Done())
+		return kIOReturnNoResources;
+
+	if (_length && !_maxPacket)
+		return kIOReturnBadArgument;
+
+	entry->offset = _offset;
+	entry->length = 0;
+	entry->toggle = _toggle;
+	entry->flags = 0;
+	entry->fragmentCount = 0;
+
+	limit = _length - _offset;
+	if (limit > _constraints.maxBytesPerDescriptor)
+		limit = _constraints.maxBytesPerDescriptor;
+	if (_constraints.onePacketPerDescriptor && (limit > _maxPacket))
+		limit = _maxPacket;
+
+	while (entry->length < limit)
+	{
+		UInt64		address;
+		UInt64		segmentLength;
+		UInt32		pageOffset;
+		UInt32		chunk;
+		IOReturn	err;
+
+		err = _source.GetSegment(_offset + entry->length, &address, &segmentLength);
+		if (err)
+			return err;
+		if (segmentLength == 0)
+			return kIOReturnInternalError;
+
+		pageOffset = (UInt32)address & pageMask;
+
+		// every page pointer after the first has to start on a page boundary
+		if (entry->fragmentCount && pageOffset)
+			break;
+
+		chunk = limit - entry->length;
+		if (_constraints.onePacketPerDescriptor)
+		{
+			// a single buffer pointer - the packet only has to be physically contiguous
+			if (segmentLength < chunk)
+				entry->flags |= kUSBTransferPlanEntryNeedsBounce;
+			else if (_constraints.addressLimit32 && ((address + chunk - 1) >> 32))
+				return kIOReturnInternalError;
+			entry->fragments[0].address = address;
+			entry->fragments[0].length = (segmentLength < chunk) ? (UInt32)segmentLength : chunk;
+			entry->fragmentCount = 1;
+			entry->length = chunk;
+			break;
+		}
+
+		if (segmentLength < chunk)
+			chunk = (UInt32)segmentLength;
+
+		if (chunk > ((_constraints.maxPagesPerDescriptor - pagesUsed) * _constraints.pageSize) - pageOffset)
+			chunk = ((_constraints.maxPagesPerDescriptor - pagesUsed) * _constraints.pageSize) - pageOffset;
+
+		if (_constraints.addressLimit32 && ((address + chunk - 1) >> 32))
+			return kIOReturnInternalError;
+
+		entry->fragments[entry->fragmentCount].address = address;
+		entry->fragments[entry->fragmentCount].length = chunk;
+		entry->fragmentCount++;
+		entry->length += chunk;
+		pagesUsed += (pageOffset + chunk + pageMask) / _constraints.pageSize;
+
+		// a fragment which ends in the middle of a page can't be followed by another one in this descriptor
+		if ((pagesUsed >= _constraints.maxPagesPerDescriptor) || ((pageOffset + chunk) & pageMask))
+			break;
+	}
+
+	if ((_offset + entry->length) < _length)
+		TrimToPackets(entry);
+
+	_offset += entry->length;
+	_entries++;
+	if (_offset >= _length)
+		entry->flags |= kUSBTransferPlanEntryLast;
+
+	// a zero length entry is still one packet on the bus
+	if (_constraints.onePacketPerDescriptor || (entry->length == 0))
+		packets = 1;
+	else
+		packets = (entry->length + _maxPacket - 1) / _maxPacket;
+	if (packets & 1)
+		_toggle ^= 1;
+
+	return kIOReturnSuccess;
+}
+
+
+
+template <class SegmentSource>
+void
+IOUSBTransferPlanner<SegmentSource>::TrimToPackets(IOUSBTransferPlanEntry *entry)
+{
+	UInt32		excess = entry->length % _maxPacket;
+
+	if (excess == 0)
+		return;
+
+	if (entry->length == excess)
+	{
+		// not even one full packet is contiguous here - hand the UIM a single packet to bounce
+		entry->flags |= kUSBTransferPlanEntryNeedsBounce;
+		entry->length = ((_length - _offset) > _maxPacket) ? _maxPacket : (_length - _offset);
+		entry->fragmentCount = 1;
+		return;
+	}
+
+	entry->length -= excess;
+	while (excess)
+	{
+		IOUSBTransferPlanFragment	*fragment = &entry->fragments[entry->fragmentCount - 1];
+
+		if (fragment->length > excess)
+		{
+			fragment->length -= excess;
+			excess = 0;
+		}
+		else
+		{
+			excess -= fragment->length;
+			entry->fragmentCount--;
+		}
+	}
+}
+
+#endif /* _IOKIT_IOUSBTRANSFERPLANNER_H */
@@ -0,0 +1,193 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+#ifndef _IOKIT_IOUSBTRANSFERSTATISTICS_H
+#define _IOKIT_IOUSBTRANSFERSTATISTICS_H
+
+#include <IOKit/usb/USB.h>
+
+#ifdef KERNEL
+#include <libkern/c++/OSObject.h>
+#include <libkern/c++/OSSerialize.h>
+#endif
+
+/*!
+ @header IOUSBTransferStatistics.h
+ @abstract Per endpoint transfer counters for a USB device.
+ @discussion IOUSBController counts the control, interrupt and bulk transfers of every device as they are queued and as they
+	complete, and publishes the counters as the "TransferStatistics" property of the IOUSBDevice. The counters are only written on
+	the controller's workloop, so they need no lock; a reader may see one transfer half counted. Rates are computed by taking two
+	snapshots and diffing them - the snapshot carries its own time stamp. The structures and IOUSBTransferSnapshotDiff are also
+	usable from user space.
+ */
+
+enum
+{
+	kUSBTransferStatisticsEndpoints		= 32			// 16 endpoint numbers, OUT (and control) in 0-15 and IN in 16-31
+};
+
+/*!
+ @struct IOUSBEndpointTransferCounters
+ @field transfers Transfers completed, whatever their status.
+ @field bytes Bytes moved by the completed transfers.
+ @field errors Transfers which completed with an error, including stalls and timeouts but not aborts.
+ @field stalls Transfers which completed with kIOUSBPipeStalled.
+ @field timeouts Transfers which completed with kIOUSBTransactionTimeout.
+ @field shortPackets Transfers which moved less than was requested without an error.
+ @field queueDepth Transfers queued and not yet completed. Not a counter - a diff keeps the newer value.
+ @field maxQueueDepth High-water mark of queueDepth. Not a counter - a diff keeps the newer value.
+ */
+struct IOUSBEndpointTransferCounters
+{
+	UInt64		transfers;
+	UInt64		bytes;
+	UInt64		errors;
+	UInt64		stalls;
+	UInt64		timeouts;
+	UInt64		shortPackets;
+	UInt32		queueDepth;
+	UInt32		maxQueueDepth;
+};
+
+/*!
+ @struct IOUSBTransferSnapshot
+ @field timeStampNS Uptime in nanoseconds at which the snapshot was taken (the interval, in a diff).
+ @field endpoints Counters indexed by IOUSBTransferStatisticsIndex.
+ */
+struct IOUSBTransferSnapshot
+{
+	UInt64							timeStampNS;
+	IOUSBEndpointTransferCounters	endpoints[kUSBTransferStatisticsEndpoints];
+};
+
+
+static inline UInt32
+IOUSBTransferStatisticsIndex(UInt8 endpoint, UInt8 direction)
+{
+	return (endpoint & 0x0F) | ((direction == kUSBIn) ? 16 : 0);
+}
+
+
+
+static inline void
+IOUSBTransferSnapshotDiff(const IOUSBTransferSnapshot *now, const IOUSBTransferSnapshot *then, IOUSBTransferSnapshot *delta)
+{
+	UInt32		i;
+	
+	delta->timeStampNS = now->timeStampNS - then->timeStampNS;
+	for (i = 0; i < kUSBTransferStatisticsEndpoints; i++)
+	{
+		delta->endpoints[i].transfers = now->endpoints[i].transfers - then->endpoints[i].transfers;
+		delta->endpoints[i].bytes = now->endpoints[i].bytes - then->endpoints[i].bytes;
+		delta->endpoints[i].errors = now->endpoints[i].errors - then->endpoints[i].errors;
+		delta->endpoints[i].stalls = now->endpoints[i].stalls - then->endpoints[i].stalls;
+		delta->endpoints[i].timeouts = now->endpoints[i].timeouts - then->endpoints[i].timeouts;
+		delta->endpoints[i].shortPackets = now->endpoints[i].shortPackets - then->endpoints[i].shortPackets;
+		delta->endpoints[i].queueDepth = now->endpoints[i].queueDepth;
+		delta->endpoints[i].maxQueueDepth = now->endpoints[i].maxQueueDepth;
+	}
+}
+
+
+#ifdef KERNEL
+/*!
+ @class IOUSBDeviceTransferStatistics
+ @abstract The transfer counters of one device, published as a property of its IOUSBDevice.
+ @discussion The controller keeps a reference for as long as the device has its address, and the IOUSBDevice keeps one through
+	its property, so the counters of a device which has gone away stay readable until the IOUSBDevice is freed.
+ */
+class IOUSBDeviceTransferStatistics : public OSObject
+{
+	OSDeclareDefaultStructors(IOUSBDeviceTransferStatistics)
+	
+public:
+	static IOUSBDeviceTransferStatistics *	withAddress( USBDeviceAddress address );
+	virtual bool							serialize( OSSerialize * s ) const;
+	
+	void			Snapshot( IOUSBTransferSnapshot * snapshot ) const;
+	
+	// called on the controller's workloop only
+	inline void		TransferQueued( UInt8 endpoint, UInt8 direction );
+	inline void		TransferCompleted( UInt8 endpoint, UInt8 direction, IOReturn status, UInt32 requested, UInt32 remaining );
+	
+private:
+	USBDeviceAddress				_address;
+	IOUSBEndpointTransferCounters	_endpoints[kUSBTransferStatisticsEndpoints];
+};
+
+
+inline void
+IOUSBDeviceTransferStatistics::TransferQueued(UInt8 endpoint, UInt8 direction)
+{
+	IOUSBEndpointTransferCounters	*counters = &_endpoints[IOUSBTransferStatisticsIndex(endpoint, direction)];
+	
+	if (++counters->queueDepth > counters->maxQueueDepth)
+		counters->maxQueueDepth = counters->queueDepth;
+}
+
+
+
+inline void
+IOUSBDeviceTransferStatistics::TransferCompleted(UInt8 endpoint, UInt8 direction, IOReturn status, UInt32 requested, UInt32 remaining)
+{
+	IOUSBEndpointTransferCounters	*counters = &_endpoints[IOUSBTransferStatisticsIndex(endpoint, direction)];
+	
+	// a transfer queued for the previous owner of a recycled address can complete after we took over
+	if (counters->queueDepth)
+		counters->queueDepth--;
+	
+	counters->transfers++;
+	if (remaining < requested)
+		counters->bytes += requested - remaining;
+	
+	switch (status)
+	{
+		case kIOReturnSuccess:
+		case kIOReturnUnderrun:
+			if (remaining)
+				counters->shortPackets++;
+			break;
+			
+		case kIOReturnAborted:
+			break;
+			
+		case kIOUSBPipeStalled:
+			counters->stalls++;
+			counters->errors++;
+			break;
+			
+		case kIOUSBTransactionTimeout:
+			counters->timeouts++;
+			counters->errors++;
+			break;
+			
+		default:
+			counters->errors++;
+			break;
+	}
+}
+#endif /* KERNEL */
+
+#endif /* _IOKIT_IOUSBTRANSFERSTATISTICS_H */
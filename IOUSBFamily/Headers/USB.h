@@ -1145,6 +1145,8 @@ enum {
 #define kUSBHubDontAllowLowPower				"kUSBHubDontAllowLowPower"
 #define kUSBDeviceResumeRecoveryTime			"kUSBDeviceResumeRecoveryTime"
 #define kUSBOutOfSpecMPSOK						"Out of spec MPS OK"
+#define kUSBAddressQuarantineMSKey				"kUSBAddressQuarantineMS"
+#define kUSBSyncSpinUSKey						"kUSBSyncSpinUS"
 #define kConfigurationDescriptorOverride		"ConfigurationDescriptorOverride"
 #define kOverrideIfAtLocationID					"OverrideIfAtLocationID"
 
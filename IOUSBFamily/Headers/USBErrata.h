@@ -0,0 +1,109 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_USBERRATA_H
+#define _IOKIT_USBERRATA_H
+
+#include <IOKit/IOTypes.h>
+
+/*!
+ @header USBErrata.h
+ @abstract The errata list entry and the lookup which the controller and hub errata tables share.
+ */
+
+/*!
+    @struct
+    @discussion This table contains the list of errata that are necessary for known problems with particular devices.
+    The format is vendorID, product ID, lowest revisionID needing errata, highest rev needing errata, errataBits.
+    The result of all matches is ORed together, so more than one entry may match.
+    Typically for a given errata a list of revisions that this applies to is supplied.
+     @field vendID      The Vendor ID of the device
+     @field deviceID    Product ID of device
+     @field revisionLo  Lowest product revsion to apply errata to
+     @field revisionHi  Highest product revision to apply errata to
+     @field errata      Bit field flagging which errata to apply to device.
+*/
+
+struct ErrataListEntryStruct
+{
+    UInt16 				vendID;
+    UInt16 				deviceID;
+    UInt16 				revisionLo;
+    UInt16 				revisionHi;
+    UInt32 				errata;
+};
+
+typedef struct ErrataListEntryStruct  ErrataListEntry, *ErrataListEntryPtr;
+
+/*!
+    @function USBErrataListIsSorted
+    @abstract Checks that an errata list is in the order USBFindErrataBits needs - by vendID, then deviceID.
+*/
+static inline bool
+USBErrataListIsSorted(const ErrataListEntry *list, UInt32 count)
+{
+	UInt32		i;
+	
+	for (i = 1; i < count; i++)
+	{
+		if ((list[i].vendID < list[i-1].vendID) || ((list[i].vendID == list[i-1].vendID) && (list[i].deviceID < list[i-1].deviceID)))
+			return false;
+	}
+	return true;
+}
+
+/*!
+    @function USBFindErrataBits
+    @abstract Returns the errata of every entry in a sorted errata list which matches a device, ORed together.
+    @discussion The first entry for vendID/deviceID is found with a binary search, and the entries for that device (there may
+				be several, for different revision ranges) are then checked in order.
+*/
+static inline UInt32
+USBFindErrataBits(const ErrataListEntry *list, UInt32 count, UInt16 vendID, UInt16 deviceID, UInt16 revisionID)
+{
+	UInt32		key = ((UInt32)vendID << 16) | deviceID;
+	UInt32		low = 0;
+	UInt32		high = count;
+	UInt32		errata = 0;
+	
+	while (low < high)
+	{
+		UInt32		middle = (low + high) / 2;
+		
+		if ((((UInt32)list[middle].vendID << 16) | list[middle].deviceID) < key)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	
+	for ( ; (low < count) && (list[low].vendID == vendID) && (list[low].deviceID == deviceID); low++)
+	{
+		if ((revisionID >= list[low].revisionLo) && (revisionID <= list[low].revisionHi))
+			errata |= list[low].errata;
+	}
+	
+	return errata;
+}
+
+#endif /* _IOKIT_USBERRATA_H */
@@ -0,0 +1,345 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Builds the ACPI port table from a synthetic ACPI plane the way IOUSBController::BuildACPIPortTable does, and checks every
+// IsPortInternal and GetInternalHubErrataBits answer it gives against the tree walks it replaced (CheckACPIUPCTable and
+// CheckACPIUPCTableForInternalHubErrataBits), counting the ACPI method evaluations each needs. Then the plane changes, and
+// only a rebuilt table agrees with the walk again.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <IOKit/usb/IOUSBACPIPortTable.h>
+
+#include "USBTestSupport.h"
+
+// an object in the ACPI plane
+struct TestACPIObject
+{
+	std::string					name;
+	std::string					location;
+	bool						platformDevice;		// an IOACPIPlatformDevice
+	bool						hasUPC;
+	std::vector<int>			upc;				// the _UPC package, -1 for an element which is not a number
+	bool						hasHERB;
+	bool						herbIsNumber;
+	UInt32						herb;
+	std::vector<TestACPIObject>	children;
+};
+
+static TestACPIObject
+Port(const char *name, const char *location)
+{
+	TestACPIObject	object;
+	
+	object.name = name;
+	object.location = location;
+	object.platformDevice = true;
+	object.hasUPC = false;
+	object.hasHERB = false;
+	object.herbIsNumber = true;
+	object.herb = 0;
+	return object;
+}
+
+static TestACPIObject
+WithUPC(TestACPIObject object, int connectable, int connector)
+{
+	object.hasUPC = true;
+	object.upc.push_back(connectable);
+	if ( connector != -2 )
+		object.upc.push_back(connector);
+	return object;
+}
+
+static TestACPIObject
+WithHERB(TestACPIObject object, UInt32 herb, bool isNumber = true)
+{
+	object.hasHERB = true;
+	object.herbIsNumber = isNumber;
+	object.herb = herb;
+	return object;
+}
+
+static UInt32	gEvaluations = 0;
+
+// IORegistryIterator with kIORegistryIterateRecursively: every object below the start, parents first, with its plane depth
+static void
+Walk(const TestACPIObject &object, int depth, std::vector<std::pair<const TestACPIObject *, int> > *out)
+{
+	size_t	i;
+	
+	for (i = 0; i < object.children.size(); i++)
+	{
+		out->push_back(std::make_pair(&object.children[i], depth + 1));
+		Walk(object.children[i], depth + 1, out);
+	}
+}
+
+// EHC1 is at depth 5: root :: acpi :: _SB :: PCI0 :: EHC1
+static std::vector<std::pair<const TestACPIObject *, int> >
+Iterate(const TestACPIObject &controller)
+{
+	std::vector<std::pair<const TestACPIObject *, int> >	objects;
+	
+	Walk(controller, 5, &objects);
+	return objects;
+}
+
+// what calculateUSBDepth and calculateACPIDepth do
+static int
+HubPortACPIDepth(UInt32 locationID)
+{
+	int		shift, depth = 0;
+	
+	for (shift = 20; shift >= 0; shift -= 4)
+	{
+		if ( (locationID & (0x0f << shift)) == 0 )
+			break;
+		depth++;
+	}
+	return (depth == 0) ? 7 : (6 + (2 * depth));
+}
+
+// what CheckACPIUPCTable does
+static bool
+WalkIsPortInternal(const TestACPIObject &controller, UInt32 portnum, UInt32 locationID)
+{
+	std::vector<std::pair<const TestACPIObject *, int> >	objects = Iterate(controller);
+	size_t													i;
+	
+	for (i = 0; i < objects.size(); i++)
+	{
+		const TestACPIObject	*object = objects[i].first;
+		
+		if ( !object->platformDevice || !object->hasUPC )
+			continue;
+		gEvaluations++;
+		if ( (object->upc.size() > 1) && (object->upc[1] == kUSBProprietaryConnector) &&
+			 (strtoul(object->location.c_str(), NULL, 10) == portnum) && (objects[i].second == HubPortACPIDepth(locationID)) )
+			return true;
+	}
+	return false;
+}
+
+// what CheckACPIUPCTableForInternalHubErrataBits does
+static bool
+WalkHubErrataBits(const TestACPIObject &controller, UInt32 portnum, UInt32 locationID, UInt32 *errataBits)
+{
+	std::vector<std::pair<const TestACPIObject *, int> >	objects = Iterate(controller);
+	size_t													i;
+	
+	for (i = 0; i < objects.size(); i++)
+	{
+		const TestACPIObject	*object = objects[i].first;
+		
+		if ( !object->platformDevice || !object->hasHERB )
+			continue;
+		if ( (strtoul(object->location.c_str(), NULL, 10) == portnum) && (objects[i].second == HubPortACPIDepth(locationID)) )
+		{
+			gEvaluations++;
+			if ( object->herbIsNumber )
+			{
+				*errataBits = object->herb;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// what BuildACPIPortTable does
+static std::vector<IOUSBACPIPortEntry>
+BuildACPIPortTable(const TestACPIObject &controller)
+{
+	std::vector<std::pair<const TestACPIObject *, int> >	objects = Iterate(controller);
+	std::vector<IOUSBACPIPortEntry>							table;
+	size_t													i;
+	
+	for (i = 0; i < objects.size(); i++)
+	{
+		const TestACPIObject	*object = objects[i].first;
+		IOUSBACPIPortEntry		portEntry;
+		
+		if ( !object->platformDevice )
+			continue;
+		memset(&portEntry, 0, sizeof(portEntry));
+		if ( object->hasUPC )
+		{
+			gEvaluations++;
+			IOUSBACPIPortEntrySetUPC(&portEntry, (object->upc.size() > 0) && (object->upc[0] >= 0), (UInt8)object->upc[0],
+									 (object->upc.size() > 1) && (object->upc[1] >= 0), (object->upc.size() > 1) ? (UInt8)object->upc[1] : 0);
+		}
+		if ( object->hasHERB )
+		{
+			gEvaluations++;
+			if ( object->herbIsNumber )
+				IOUSBACPIPortEntrySetHERB(&portEntry, object->herb);
+		}
+		if ( !portEntry.flags )
+			continue;
+		portEntry.port = strtoul(object->location.c_str(), NULL, 10);
+		portEntry.acpiDepth = objects[i].second;
+		table.push_back(portEntry);
+	}
+	return table;
+}
+
+static const IOUSBACPIPortEntry *
+Find(const std::vector<IOUSBACPIPortEntry> &table, UInt32 portnum, UInt32 locationID, UInt8 flags)
+{
+	return IOUSBACPIPortTableFind(table.empty() ? NULL : &table[0], table.size(), portnum, HubPortACPIDepth(locationID), flags);
+}
+
+// a root hub with an internal hub on port 1, as on most Macs, and the odd things firmware does
+static TestACPIObject
+MakeController(void)
+{
+	TestACPIObject	controller = Port("EHC1", "1d");
+	TestACPIObject	rootHub = Port("HUB1", "0");
+	TestACPIObject	internalHub = WithUPC(Port("PRT1", "1"), 1, kUSBProprietaryConnector);
+	TestACPIObject	notADevice = WithUPC(Port("PRT4", "4"), 1, kUSBProprietaryConnector);
+	
+	internalHub.children.push_back(WithHERB(WithUPC(Port("PRT1", "1"), 1, kUSBProprietaryConnector), 0x12));		// camera
+	internalHub.children.push_back(WithUPC(Port("PRT2", "2"), 1, kUSBProprietaryConnector));						// bluetooth
+	internalHub.children.push_back(WithHERB(WithUPC(Port("PRT3", "3"), 1, 0x00), 0x4));							// a type A port on the hub
+	internalHub.children.push_back(WithHERB(Port("PRT4", "4"), 0x8));
+	rootHub.children.push_back(internalHub);
+	rootHub.children.push_back(WithHERB(WithUPC(Port("PRT2", "2"), 1, 0x00), 0x1));							// type A
+	rootHub.children.push_back(WithUPC(Port("PRT3", "3"), 1, -2));												// _UPC without a connector type
+	notADevice.platformDevice = false;
+	rootHub.children.push_back(notADevice);
+	rootHub.children.push_back(WithUPC(Port("PRT5", "5"), 0, kUSBProprietaryConnector));						// proprietary but not connectable
+	rootHub.children.push_back(WithHERB(Port("PRT6", "6"), 0, false));										// HERB which is not a number
+	rootHub.children.push_back(WithUPC(Port("PRT7", "7"), 1, kUSBTypeExpressCard));
+	rootHub.children.push_back(WithHERB(WithUPC(Port("PRT7", "7"), 1, kUSBProprietaryConnector), 0x20));		// a second object for port 7
+	rootHub.children.push_back(WithHERB(WithUPC(Port("PRT8", "8"), 1, -1), 0x40));							// connector type is not a number
+	controller.children.push_back(rootHub);
+	return controller;
+}
+
+static const UInt32		kTestHubs[] = { 0x1d000000, 0x1d100000, 0x1d200000, 0x1d110000, 0x1d000000 | 0x00300000 };
+
+// every question both ways, returns the number of questions
+static UInt32
+Compare(const TestACPIObject &controller, const std::vector<IOUSBACPIPortEntry> &table, UInt32 *walkEvaluations)
+{
+	UInt32		questions = 0;
+	UInt32		h, port;
+	
+	*walkEvaluations = 0;
+	for (h = 0; h < sizeof(kTestHubs) / sizeof(kTestHubs[0]); h++)
+	{
+		for (port = 0; port <= 10; port++)
+		{
+			const IOUSBACPIPortEntry	*entry;
+			UInt32						walkBits = 0;
+			bool						walkFound;
+			UInt32						before = gEvaluations;
+			
+			USBTestCheckEqual(Find(table, port, kTestHubs[h], kUSBACPIPortInternal) != NULL, WalkIsPortInternal(controller, port, kTestHubs[h]));
+			
+			walkFound = WalkHubErrataBits(controller, port, kTestHubs[h], &walkBits);
+			entry = Find(table, port, kTestHubs[h], kUSBACPIPortHasHERB);
+			USBTestCheckEqual(entry != NULL, walkFound);
+			if ( entry && walkFound )
+				USBTestCheckEqual(entry->hubErrata, walkBits);
+			
+			*walkEvaluations += gEvaluations - before;
+			questions += 2;
+		}
+	}
+	return questions;
+}
+
+static void
+TestAgainstWalk(void)
+{
+	TestACPIObject					controller = MakeController();
+	std::vector<IOUSBACPIPortEntry>	table;
+	UInt32							tableEvaluations, walkEvaluations, questions;
+	
+	printf("  the table answers as the tree walks did\n");
+	
+	gEvaluations = 0;
+	table = BuildACPIPortTable(controller);
+	tableEvaluations = gEvaluations;
+	questions = Compare(controller, table, &walkEvaluations);
+	
+	// spot checks, so that the comparison isn't of two wrong answers
+	USBTestCheck(Find(table, 1, 0x1d000000, kUSBACPIPortInternal) != NULL);
+	USBTestCheck(Find(table, 2, 0x1d100000, kUSBACPIPortInternal) != NULL);
+	USBTestCheck(Find(table, 3, 0x1d100000, kUSBACPIPortInternal) == NULL);
+	USBTestCheck(Find(table, 3, 0x1d000000, kUSBACPIPortHasUPC) == NULL);
+	USBTestCheck(Find(table, 4, 0x1d000000, kUSBACPIPortInternal) == NULL);
+	USBTestCheck(Find(table, 5, 0x1d000000, kUSBACPIPortInternal | kUSBACPIPortConnectable) == NULL);
+	USBTestCheck(Find(table, 5, 0x1d000000, kUSBACPIPortInternal) != NULL);
+	USBTestCheck(Find(table, 6, 0x1d000000, kUSBACPIPortHasHERB) == NULL);
+	USBTestCheckEqual(Find(table, 7, 0x1d000000, kUSBACPIPortInternal)->hubErrata, 0x20);
+	USBTestCheckEqual(Find(table, 7, 0x1d000000, kUSBACPIPortHasUPC)->connectorType, kUSBTypeExpressCard);
+	USBTestCheckEqual(Find(table, 8, 0x1d000000, kUSBACPIPortHasHERB)->hubErrata, 0x40);
+	USBTestCheckEqual(Find(table, 1, 0x1d100000, kUSBACPIPortHasHERB)->hubErrata, 0x12);
+	
+	printf("    %u questions: %u method evaluations walking the plane each time, %u building the table\n",
+		   (unsigned)questions, (unsigned)walkEvaluations, (unsigned)tableEvaluations);
+}
+
+static void
+TestPlaneChanges(void)
+{
+	TestACPIObject					controller = MakeController();
+	std::vector<IOUSBACPIPortEntry>	table = BuildACPIPortTable(controller);
+	TestACPIObject					*rootHub = &controller.children[0];
+	UInt32							walkEvaluations;
+	
+	printf("  a change to the plane needs a new table\n");
+	
+	// a port object published late (the notifier's case): the old table does not know it
+	rootHub->children.push_back(WithHERB(WithUPC(Port("PRT9", "9"), 1, kUSBProprietaryConnector), 0x80));
+	USBTestCheck(WalkIsPortInternal(controller, 9, 0x1d000000));
+	USBTestCheck(Find(table, 9, 0x1d000000, kUSBACPIPortInternal) == NULL);
+	
+	// ACPIRegistryChanged drops the table, and the next question builds it again
+	table = BuildACPIPortTable(controller);
+	Compare(controller, table, &walkEvaluations);
+	
+	// and one terminated
+	rootHub->children.erase(rootHub->children.begin());
+	USBTestCheck(!WalkIsPortInternal(controller, 1, 0x1d000000));
+	USBTestCheck(Find(table, 1, 0x1d000000, kUSBACPIPortInternal) != NULL);
+	table = BuildACPIPortTable(controller);
+	Compare(controller, table, &walkEvaluations);
+	USBTestCheck(Find(table, 2, 0x1d100000, kUSBACPIPortInternal) == NULL);
+}
+
+int
+main(void)
+{
+	TestAgainstWalk();
+	TestPlaneChanges();
+	return USBTestResult("IOUSBACPIPortTableTests");
+}
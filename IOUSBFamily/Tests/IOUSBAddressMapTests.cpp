@@ -0,0 +1,216 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Exercises the controller's USB address bitmaps: exhaustion, the order in which addresses are handed out and reused, and the
+// release quarantine
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <IOKit/usb/IOUSBAddressMap.h>
+
+#include "USBTestSupport.h"
+
+#define kTestQuarantineNS		(1000ULL * 1000000ULL)			// kUSBDefaultAddressQuarantineMS
+
+static void
+MapInit(IOUSBAddressMap *map)
+{
+	memset(map, 0, sizeof(*map));
+}
+
+static void
+TestExhaustion(void)
+{
+	IOUSBAddressMap		map;
+	USBDeviceAddress	address;
+	int					i;
+	
+	printf("  every address once, then none\n");
+	
+	MapInit(&map);
+	for (i = 1; i < kUSBMaxDevices; i++)
+	{
+		address = IOUSBAddressMapAllocate(&map, 0, kTestQuarantineNS);
+		USBTestCheckEqual(address, i);								// lowest first, and never 0
+		if (i & 1)
+			IOUSBAddressMapAttach(&map, address);
+	}
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 0, kTestQuarantineNS), 0);
+	
+	// neither a reserved nor an attached address comes back until it is released
+	USBTestCheck(IOUSBAddressMapRelease(&map, 64, 10, true));
+	USBTestCheck(!IOUSBAddressMapRelease(&map, 64, 10, true));		// twice
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 20, kTestQuarantineNS), 64);	// nothing else is free, so the quarantine gives
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 20, kTestQuarantineNS), 0);
+}
+
+static void
+TestQuarantine(void)
+{
+	IOUSBAddressMap		map;
+	int					i;
+	
+	printf("  released addresses are quarantined\n");
+	
+	MapInit(&map);
+	for (i = 1; i <= 10; i++)
+		IOUSBAddressMapAllocate(&map, 0, kTestQuarantineNS);
+	
+	IOUSBAddressMapRelease(&map, 3, 100, true);
+	IOUSBAddressMapRelease(&map, 5, 200, true);
+	
+	// a free address is preferred to a quarantined one, even a higher one
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 300, kTestQuarantineNS), 11);
+	
+	// after the quarantine, 3 is the lowest free address again - 5 is still quarantined a moment longer
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 100 + kTestQuarantineNS, kTestQuarantineNS), 3);
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 100 + kTestQuarantineNS, kTestQuarantineNS), 12);
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 200 + kTestQuarantineNS, kTestQuarantineNS), 5);
+	
+	// with no quarantine an address is reused at once
+	IOUSBAddressMapRelease(&map, 7, 1000, false);
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 1000, kTestQuarantineNS), 7);
+	
+	// an address the UIM claims for itself leaves the quarantine
+	IOUSBAddressMapRelease(&map, 8, 2000, true);
+	IOUSBAddressMapClaim(&map, 8);
+	USBTestCheck(!(map.quarantined[0] & IOUSBAddressMapBit(8)));
+	USBTestCheck(map.reserved[0] & IOUSBAddressMapBit(8));
+	USBTestCheck(IOUSBAddressMapRelease(&map, 8, 2000, true));
+}
+
+// with every address in use, quarantined addresses are reused oldest first, not lowest first
+static void
+TestReuseOrder(void)
+{
+	IOUSBAddressMap		map;
+	int					i;
+	
+	printf("  quarantined addresses are reused oldest first\n");
+	
+	MapInit(&map);
+	for (i = 1; i < kUSBMaxDevices; i++)
+		IOUSBAddressMapAllocate(&map, 0, kTestQuarantineNS);
+	
+	IOUSBAddressMapRelease(&map, 90, 1000, true);
+	IOUSBAddressMapRelease(&map, 2, 2000, true);
+	IOUSBAddressMapRelease(&map, 40, 3000, true);
+	IOUSBAddressMapRelease(&map, 127, 1500, true);
+	
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 4000, kTestQuarantineNS), 90);
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 4000, kTestQuarantineNS), 127);
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 4000, kTestQuarantineNS), 2);
+	
+	// 40's quarantine runs out before it is needed, and it goes back to being an ordinary free address
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 3000 + kTestQuarantineNS, kTestQuarantineNS), 40);
+	USBTestCheck(!map.quarantined[1]);
+	USBTestCheckEqual(IOUSBAddressMapAllocate(&map, 3000 + kTestQuarantineNS, kTestQuarantineNS), 0);
+}
+
+// devices come and go at random against a model of which addresses are in use and when each was released
+static void
+TestChurn(void)
+{
+	IOUSBAddressMap		map;
+	bool				inUse[kUSBMaxDevices];
+	UInt64				released[kUSBMaxDevices];
+	UInt64				now = 0;
+	UInt32				early = 0;
+	unsigned int		seed = 34;
+	int					i, step;
+	
+	printf("  devices coming and going\n");
+	
+	MapInit(&map);
+	memset(inUse, 0, sizeof(inUse));
+	for (i = 0; i < kUSBMaxDevices; i++)
+		released[i] = 0;
+	
+	for (step = 0; step < 200000; step++)
+	{
+		int		inUseCount = 0;
+		
+		now += (rand_r(&seed) % 50) * 1000000ULL;						// up to 50 ms between events
+		for (i = 1; i < kUSBMaxDevices; i++)
+			inUseCount += inUse[i];
+		
+		// alternate between filling the bus up and emptying it
+		if (!inUseCount || ((rand_r(&seed) % 100) < (((step / 20000) & 1) ? 35 : 80)))
+		{
+			USBDeviceAddress	address = IOUSBAddressMapAllocate(&map, now, kTestQuarantineNS);
+			bool				anyFree = false;
+			
+			for (i = 1; i < kUSBMaxDevices; i++)
+				if (!inUse[i] && (!released[i] || ((now - released[i]) >= kTestQuarantineNS)))
+					anyFree = true;
+			
+			if (inUseCount == (kUSBMaxDevices - 1))
+			{
+				USBTestCheckEqual(address, 0);
+				continue;
+			}
+			USBTestCheck((address > 0) && (address < kUSBMaxDevices));
+			USBTestCheck(!inUse[address]);
+			
+			// a quarantined address is handed out only when nothing else is free, and then the one released longest ago
+			if (released[address] && ((now - released[address]) < kTestQuarantineNS))
+			{
+				USBTestCheck(!anyFree);
+				for (i = 1; i < kUSBMaxDevices; i++)
+					if (!inUse[i] && (i != address))
+						USBTestCheck(released[i] >= released[address]);
+				early++;
+			}
+			inUse[address] = true;
+			if (rand_r(&seed) & 1)
+				IOUSBAddressMapAttach(&map, address);
+		}
+		else
+		{
+			int		which = rand_r(&seed) % inUseCount;
+			
+			for (i = 1; i < kUSBMaxDevices; i++)
+				if (inUse[i] && (which-- == 0))
+					break;
+			USBTestCheck(IOUSBAddressMapRelease(&map, i, now, true));
+			inUse[i] = false;
+			released[i] = now;
+		}
+	}
+	
+	for (i = 1; i < kUSBMaxDevices; i++)
+		USBTestCheckEqual(((map.reserved[i / 32] | map.attached[i / 32]) & IOUSBAddressMapBit(i)) != 0, inUse[i]);
+	printf("    %u addresses reused before their quarantine was over\n", (unsigned)early);
+}
+
+int
+main(void)
+{
+	TestExhaustion();
+	TestQuarantine();
+	TestReuseOrder();
+	TestChurn();
+	return USBTestResult("IOUSBAddressMapTests");
+}
@@ -0,0 +1,587 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Runs IOUSBCommandPool's per-CPU caches from several threads at once - getting and returning commands, growing the pool, trimming it
+// and returning the same command from two threads together - with a mutex standing in for the command gate, and checks that every
+// command is accounted for exactly once.
+//
+// The two threads which return the same command use a pool of their own. The claim decides between returns which overlap, but a second
+// return which comes after the command has been handed out again looks just like the new owner's return, and no pool can catch that.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <IOKit/usb/IOUSBCommandCache.h>
+
+#include "USBTestSupport.h"
+
+enum
+{
+	kTestPoolSize				= 32,			// kSizeOfCommandPool
+	kTestPoolIncrement			= 8,			// kSizeToIncrementCommandPool
+	kTestWorkers				= 6,
+	kTestWorkerHeld				= 24,			// most commands a worker has outstanding
+	kTestWorkerIterations		= 200000,
+	kTestRaceRounds				= 20000
+};
+
+struct TestCommand : public IOCommand
+{
+	volatile SInt32		inUse;
+	bool				released;				// freed by a trim - must never be seen again
+};
+
+// IOUSBCommandPool, with the IOCommandPool queue it sits on and the controller's count of allocated commands
+struct TestPool
+{
+	pthread_mutex_t				gate;
+	queue_head_t				queue;
+	UInt32						freeInPool;
+	UInt32						allocated;
+	UInt32						released;
+	UInt32						grows;
+	UInt32						steals;
+	IOUSBCommandCache			caches[kUSBCommandPoolCaches];
+	UInt32						lastActivity;
+	UInt32						idleTicks;
+	std::vector<TestCommand *>	all;
+	volatile SInt32				errors;
+};
+
+static void
+PoolInit(TestPool *pool)
+{
+	int		i;
+	
+	pthread_mutex_init(&pool->gate, NULL);
+	queue_init(&pool->queue);
+	pool->freeInPool = pool->allocated = pool->released = pool->grows = pool->steals = 0;
+	pool->lastActivity = pool->idleTicks = 0;
+	pool->errors = 0;
+	for (i = 0; i < kUSBCommandPoolCaches; i++)
+	{
+		pool->caches[i].lock = IOSimpleLockAlloc();
+		pool->caches[i].count = pool->caches[i].peak = pool->caches[i].hits = pool->caches[i].misses = 0;
+	}
+}
+
+static void
+PoolFree(TestPool *pool)
+{
+	size_t	i;
+	
+	for (i = 0; i < kUSBCommandPoolCaches; i++)
+		IOSimpleLockFree(pool->caches[i].lock);
+	for (i = 0; i < pool->all.size(); i++)
+		delete pool->all[i];
+	pthread_mutex_destroy(&pool->gate);
+}
+
+// IOCommandPool::gatedGetCommand and gatedReturnCommand - gate held
+static IOCommand *
+GatedDequeue(TestPool *pool)
+{
+	IOCommand	*command;
+	
+	if (queue_empty(&pool->queue))
+		return NULL;
+	queue_remove_first(&pool->queue, command, IOCommand *, fCommandChain);
+	pool->freeInPool--;
+	return command;
+}
+
+static void
+GatedEnqueue(TestPool *pool, IOCommand *command)
+{
+	queue_enter(&pool->queue, command, IOCommand *, fCommandChain);
+	pool->freeInPool++;
+}
+
+// what gatedDrainCache does
+static void
+GatedDrainCache(TestPool *pool, IOUSBCommandCache *cache, IOCommand *command)
+{
+	IOCommand	*batch[kUSBCommandPoolCacheBatch + 1];
+	UInt32		count;
+	
+	count = IOUSBCommandCacheTake(cache, batch, kUSBCommandPoolCacheBatch);
+	if (command)
+		batch[count++] = command;
+	while (count)
+		GatedEnqueue(pool, batch[--count]);
+}
+
+// what gatedRefillCache does
+static IOCommand *
+GatedRefillCache(TestPool *pool, IOUSBCommandCache *cache)
+{
+	IOCommand	*command = GatedDequeue(pool);
+	IOCommand	*batch[kUSBCommandPoolCacheBatch];
+	UInt32		count = 0;
+	UInt32		cached;
+	int			i;
+	
+	if (!command)
+	{
+		for (i = 0; (i < kUSBCommandPoolCaches) && !command; i++)
+			IOUSBCommandCacheTake(&pool->caches[i], &command, 1);
+		if (command)
+			pool->steals++;
+		else
+			pool->grows++;
+		return command;
+	}
+	
+	while ((count < (kUSBCommandPoolCacheBatch - 1)) && ((batch[count] = GatedDequeue(pool)) != NULL))
+		count++;
+	cached = IOUSBCommandCachePut(cache, batch, count);
+	while (count > cached)
+		GatedEnqueue(pool, batch[--count]);
+	
+	return command;
+}
+
+// what IOUSBCommandPool::returnCommand does, with ScrubCommand reduced to its claim
+static bool
+ReturnCommand(TestPool *pool, int cpu, IOCommand *command)
+{
+	IOUSBCommandCache	*cache = &pool->caches[cpu % kUSBCommandPoolCaches];
+	
+	if (!IOUSBCommandClaim(command, pool))
+		return false;
+	
+	if (!IOUSBCommandCachePut(cache, &command, 1))
+	{
+		pthread_mutex_lock(&pool->gate);
+		GatedDrainCache(pool, cache, command);
+		pthread_mutex_unlock(&pool->gate);
+	}
+	return true;
+}
+
+// what IOUSBCommandPool::getCommand(false) does, growing the pool on a miss the way the controller's GetCommand does
+static TestCommand *
+GetCommand(TestPool *pool, int cpu)
+{
+	IOUSBCommandCache	*cache = &pool->caches[cpu % kUSBCommandPoolCaches];
+	IOCommand			*command;
+	int					i;
+	
+	while ((command = IOUSBCommandCacheGet(cache)) == NULL)
+	{
+		pthread_mutex_lock(&pool->gate);
+		command = GatedRefillCache(pool, cache);
+		pthread_mutex_unlock(&pool->gate);
+		if (command)
+			break;
+		
+		// IncreaseCommandPool - the new commands have never been in the pool, so their chains are NULL
+		for (i = 0; i < kTestPoolIncrement; i++)
+		{
+			TestCommand	*newCommand = new TestCommand;
+			
+			newCommand->fCommandChain.next = newCommand->fCommandChain.prev = NULL;
+			newCommand->inUse = 0;
+			newCommand->released = false;
+			pthread_mutex_lock(&pool->gate);
+			pool->all.push_back(newCommand);
+			pool->allocated++;
+			pthread_mutex_unlock(&pool->gate);
+			if (!ReturnCommand(pool, cpu, newCommand))
+				OSIncrementAtomic(&pool->errors);
+		}
+	}
+	IOUSBCommandHandOut(command);
+	
+	TestCommand	*testCommand = (TestCommand *)command;
+	if (testCommand->released || !__sync_bool_compare_and_swap(&testCommand->inUse, 0, 1))
+		OSIncrementAtomic(&pool->errors);
+	
+	return testCommand;
+}
+
+static void
+PutCommand(TestPool *pool, int cpu, TestCommand *command)
+{
+	command->inUse = 0;
+	if (!ReturnCommand(pool, cpu, command))
+		OSIncrementAtomic(&pool->errors);
+}
+
+// what TrimIdleCaches and gatedReleaseIdleCommands do (the idle check is skipped when force is set) - returns the number released
+static UInt32
+TrimIdleCaches(TestPool *pool, UInt32 keep, bool force)
+{
+	UInt32		activity = 0;
+	UInt32		toFree;
+	UInt32		freed = 0;
+	IOCommand	*command;
+	int			i;
+	
+	for (i = 0; i < kUSBCommandPoolCaches; i++)
+	{
+		IOSimpleLockLock(pool->caches[i].lock);
+		activity += pool->caches[i].hits + pool->caches[i].misses;
+		IOSimpleLockUnlock(pool->caches[i].lock);
+	}
+	if (!IOUSBCommandPoolIdleCheck(activity, &pool->lastActivity, &pool->idleTicks) && !force)
+		return 0;
+	
+	pthread_mutex_lock(&pool->gate);
+	for (i = 0; i < kUSBCommandPoolCaches; i++)
+		while (pool->caches[i].count)
+			GatedDrainCache(pool, &pool->caches[i], NULL);
+	
+	toFree = IOUSBCommandPoolTrimCount(pool->allocated, keep, pool->freeInPool);
+	while ((freed < toFree) && ((command = GatedDequeue(pool)) != NULL))
+	{
+		((TestCommand *)command)->released = true;
+		freed++;
+	}
+	pool->allocated -= freed;
+	pool->released += freed;
+	pthread_mutex_unlock(&pool->gate);
+	
+	return freed;
+}
+
+// every command which was not released is free, in the pool exactly once, and there are as many as the controller thinks
+static void
+CheckAccounting(TestPool *pool)
+{
+	IOCommand		*entry;
+	UInt32			inQueue = 0;
+	UInt32			live = 0;
+	size_t			i;
+	int				c;
+	
+	for (c = 0; c < kUSBCommandPoolCaches; c++)
+		while (pool->caches[c].count)
+			GatedDrainCache(pool, &pool->caches[c], NULL);
+	
+	for (i = 0; i < pool->all.size(); i++)
+		pool->all[i]->inUse = 0;
+	queue_iterate(&pool->queue, entry, IOCommand *, fCommandChain)
+	{
+		TestCommand	*command = (TestCommand *)entry;
+		
+		USBTestCheck(!command->released);
+		USBTestCheckEqual(command->inUse, 0);
+		command->inUse = 1;
+		inQueue++;
+	}
+	for (i = 0; i < pool->all.size(); i++)
+		if (!pool->all[i]->released)
+			live++;
+	
+	USBTestCheckEqual(inQueue, pool->freeInPool);
+	USBTestCheckEqual(inQueue, pool->allocated);
+	USBTestCheckEqual(live, pool->allocated);
+	USBTestCheckEqual(pool->all.size(), pool->allocated + pool->released);
+}
+
+static void
+TestClaim(void)
+{
+	TestPool	pool;
+	TestCommand	*command;
+	TestCommand	*other;
+	
+	printf("  claiming a returned command\n");
+	
+	PoolInit(&pool);
+	command = GetCommand(&pool, 0);							// grows the pool
+	USBTestCheckEqual(pool.allocated, kTestPoolIncrement);
+	
+	// a handed out command can be claimed once
+	command->inUse = 0;
+	USBTestCheck(ReturnCommand(&pool, 0, command));
+	USBTestCheck(!ReturnCommand(&pool, 0, command));		// it is in a cache now
+	
+	// a command on the pool's queue cannot be claimed either
+	command = GetCommand(&pool, 0);
+	pthread_mutex_lock(&pool.gate);
+	GatedDrainCache(&pool, &pool.caches[0], NULL);
+	pthread_mutex_unlock(&pool.gate);
+	other = GetCommand(&pool, 1);							// from the queue, leaving the rest in cache 1
+	USBTestCheckEqual(pool.caches[1].count, kTestPoolIncrement - 2);
+	PutCommand(&pool, 1, other);
+	pthread_mutex_lock(&pool.gate);
+	GatedDrainCache(&pool, &pool.caches[1], NULL);
+	GatedDrainCache(&pool, &pool.caches[1], NULL);
+	pthread_mutex_unlock(&pool.gate);
+	USBTestCheck(!ReturnCommand(&pool, 0, other));
+	
+	PutCommand(&pool, 0, command);
+	USBTestCheckEqual(pool.errors, 0);
+	CheckAccounting(&pool);
+	PoolFree(&pool);
+}
+
+static void
+TestTrimCount(void)
+{
+	UInt32	lastActivity = 0;
+	UInt32	idleTicks = 0;
+	int		i;
+	
+	printf("  trim count and idle check\n");
+	
+	// the excess over keep comes from the allocation, and only free commands can be released
+	USBTestCheckEqual(IOUSBCommandPoolTrimCount(200, 100, 150), 100);
+	USBTestCheckEqual(IOUSBCommandPoolTrimCount(200, 100, 60), 60);
+	USBTestCheckEqual(IOUSBCommandPoolTrimCount(120, 100, 60), 20);
+	USBTestCheckEqual(IOUSBCommandPoolTrimCount(100, 100, 100), 0);
+	USBTestCheckEqual(IOUSBCommandPoolTrimCount(80, 100, 80), 0);
+	
+	// any activity restarts the count
+	USBTestCheck(!IOUSBCommandPoolIdleCheck(5, &lastActivity, &idleTicks));
+	for (i = 1; i < kUSBCommandPoolIdleTicks; i++)
+		USBTestCheck(!IOUSBCommandPoolIdleCheck(5, &lastActivity, &idleTicks));
+	USBTestCheck(!IOUSBCommandPoolIdleCheck(6, &lastActivity, &idleTicks));
+	for (i = 1; i < kUSBCommandPoolIdleTicks; i++)
+		USBTestCheck(!IOUSBCommandPoolIdleCheck(6, &lastActivity, &idleTicks));
+	USBTestCheck(IOUSBCommandPoolIdleCheck(6, &lastActivity, &idleTicks));
+	USBTestCheckEqual(idleTicks, 0);
+}
+
+// trimming a pool which grew while most of it was in use
+static void
+TestTrimAfterBurst(void)
+{
+	TestPool					pool;
+	std::vector<TestCommand *>	held;
+	UInt32						i;
+	
+	printf("  trimming after a burst\n");
+	
+	PoolInit(&pool);
+	for (i = 0; i < 3 * kTestPoolSize; i++)
+		held.push_back(GetCommand(&pool, i));
+	USBTestCheckEqual(pool.allocated, 3 * kTestPoolSize);
+	
+	// with 80 of the 96 commands still in use, 16 are free and all of them go (the old free count against kSizeOfCommandPool kept them)
+	for (i = 0; i < 16; i++)
+	{
+		PutCommand(&pool, i, held.back());
+		held.pop_back();
+	}
+	USBTestCheckEqual(TrimIdleCaches(&pool, kTestPoolSize, true), 16);
+	USBTestCheckEqual(pool.allocated, 80);
+	
+	// once everything is back, the pool comes down to kSizeOfCommandPool and no further
+	while (!held.empty())
+	{
+		PutCommand(&pool, 0, held.back());
+		held.pop_back();
+	}
+	USBTestCheckEqual(TrimIdleCaches(&pool, kTestPoolSize, true), 80 - kTestPoolSize);
+	USBTestCheckEqual(pool.allocated, kTestPoolSize);
+	USBTestCheckEqual(TrimIdleCaches(&pool, kTestPoolSize, true), 0);
+	
+	USBTestCheckEqual(pool.errors, 0);
+	CheckAccounting(&pool);
+	PoolFree(&pool);
+}
+
+struct TestBarrier
+{
+	volatile SInt32		arrived;
+	volatile SInt32		generation;
+};
+
+static void
+BarrierWait(TestBarrier *barrier, SInt32 parties)
+{
+	SInt32	generation = __atomic_load_n(&barrier->generation, __ATOMIC_ACQUIRE);
+	
+	if (OSIncrementAtomic(&barrier->arrived) + 1 == parties)
+	{
+		__atomic_store_n(&barrier->arrived, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&barrier->generation, generation + 1, __ATOMIC_RELEASE);
+	}
+	else
+		while (__atomic_load_n(&barrier->generation, __ATOMIC_ACQUIRE) == generation)
+			sched_yield();
+}
+
+struct TestThread
+{
+	pthread_t			thread;
+	TestPool			*pool;
+	int					index;
+	
+	// the two threads which return the same command together
+	TestBarrier			*barrier;
+	TestCommand * volatile	*shared;
+	volatile SInt32		*claims;
+	UInt32				badRounds;
+};
+
+static void *
+WorkerThread(void *arg)
+{
+	TestThread					*me = (TestThread *)arg;
+	std::vector<TestCommand *>	held;
+	unsigned int				seed = 0x1234 + me->index;
+	int							i;
+	
+	for (i = 0; i < kTestWorkerIterations; i++)
+	{
+		// threads move between CPUs, and there are more threads than caches
+		int		cpu = me->index + (i / 97);
+		
+		if (held.empty() || ((held.size() < kTestWorkerHeld) && (rand_r(&seed) & 1)))
+			held.push_back(GetCommand(me->pool, cpu));
+		else
+		{
+			size_t	which = rand_r(&seed) % held.size();
+			
+			PutCommand(me->pool, cpu, held[which]);
+			held[which] = held.back();
+			held.pop_back();
+		}
+	}
+	while (!held.empty())
+	{
+		PutCommand(me->pool, me->index, held.back());
+		held.pop_back();
+	}
+	return NULL;
+}
+
+static void *
+RacerThread(void *arg)
+{
+	TestThread		*me = (TestThread *)arg;
+	int				round;
+	
+	for (round = 0; round < kTestRaceRounds; round++)
+	{
+		if (me->index == 0)
+		{
+			*me->shared = GetCommand(me->pool, 0);
+			(*me->shared)->inUse = 0;
+			*me->claims = 0;
+		}
+		BarrierWait(me->barrier, 2);
+		
+		if (ReturnCommand(me->pool, me->index + round, *me->shared))
+			OSIncrementAtomic(me->claims);
+		BarrierWait(me->barrier, 2);
+		
+		if ((me->index == 0) && (*me->claims != 1))
+			me->badRounds++;
+		BarrierWait(me->barrier, 2);
+	}
+	return NULL;
+}
+
+static void *
+TrimmerThread(void *arg)
+{
+	TestThread		*me = (TestThread *)arg;
+	volatile SInt32	*done = me->claims;
+	
+	while (!__atomic_load_n(done, __ATOMIC_ACQUIRE))
+	{
+		TrimIdleCaches(me->pool, kTestPoolSize, true);
+		sched_yield();
+	}
+	return NULL;
+}
+
+static void
+TestStress(void)
+{
+	TestPool		pool;
+	TestPool		racePool;
+	TestThread		workers[kTestWorkers];
+	TestThread		racers[2];
+	TestThread		trimmer;
+	TestBarrier		barrier = {0, 0};
+	TestCommand		*shared = NULL;
+	volatile SInt32	claims = 0;
+	volatile SInt32	done = 0;
+	int				i;
+	
+	printf("  %d threads getting, returning, double returning and trimming\n", kTestWorkers + 3);
+	
+	PoolInit(&pool);
+	PoolInit(&racePool);
+	for (i = 0; i < kTestWorkers; i++)
+	{
+		workers[i].pool = &pool;
+		workers[i].index = i;
+		pthread_create(&workers[i].thread, NULL, WorkerThread, &workers[i]);
+	}
+	for (i = 0; i < 2; i++)
+	{
+		racers[i].pool = &racePool;
+		racers[i].index = i;
+		racers[i].barrier = &barrier;
+		racers[i].shared = &shared;
+		racers[i].claims = &claims;
+		racers[i].badRounds = 0;
+		pthread_create(&racers[i].thread, NULL, RacerThread, &racers[i]);
+	}
+	trimmer.pool = &pool;
+	trimmer.claims = &done;
+	pthread_create(&trimmer.thread, NULL, TrimmerThread, &trimmer);
+	
+	for (i = 0; i < kTestWorkers; i++)
+		pthread_join(workers[i].thread, NULL);
+	for (i = 0; i < 2; i++)
+		pthread_join(racers[i].thread, NULL);
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+	pthread_join(trimmer.thread, NULL);
+	
+	USBTestCheckEqual(racers[0].badRounds, 0);
+	USBTestCheckEqual(racePool.errors, 0);
+	CheckAccounting(&racePool);
+	PoolFree(&racePool);
+	
+	USBTestCheckEqual(pool.errors, 0);
+	CheckAccounting(&pool);
+	USBTestCheck(pool.released > 0);
+	printf("    %u commands allocated, %u released, %u grows, %u steals\n", (unsigned)pool.all.size(), (unsigned)pool.released, (unsigned)pool.grows, (unsigned)pool.steals);
+	
+	// nothing is in use, so a last trim takes the pool back to its initial size
+	TrimIdleCaches(&pool, kTestPoolSize, true);
+	USBTestCheck(pool.allocated <= kTestPoolSize);
+	CheckAccounting(&pool);
+	PoolFree(&pool);
+}
+
+int
+main(void)
+{
+	TestClaim();
+	TestTrimCount();
+	TestTrimAfterBurst();
+	TestStress();
+	return USBTestResult("IOUSBCommandPoolCacheTests");
+}
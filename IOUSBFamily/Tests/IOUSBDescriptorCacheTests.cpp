@@ -0,0 +1,358 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Enumerates and re-enumerates simulated devices through the controller wide descriptor cache, counting the control requests each
+// device sees: a device which comes back after a reset is described from the cache, a changed one is not, and the cache holds no
+// more than kUSBDescriptorCacheMaxEntries devices
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <IOKit/usb/IOUSBDescriptorCache.h>
+
+#include "USBTestSupport.h"
+
+static long		gTestAllocated = 0;
+
+struct TestCacheOps
+{
+	static void *	Alloc(UInt32 size)				{ gTestAllocated += size; return malloc(size); }
+	static void		Free(void *ptr, UInt32 size)	{ gTestAllocated -= size; free(ptr); }
+};
+
+enum
+{
+	kTestLangID			= 0x0409,
+	kTestConfigLength	= 34
+};
+
+// a device which answers GET_DESCRIPTOR and counts every request
+struct TestDevice
+{
+	IOUSBDeviceDescriptor	descriptor;
+	UInt32					locationID;
+	const char				*serial;				// NULL if iSerialNumber is 0
+	UInt32					requests;
+};
+
+static void
+DeviceInit(TestDevice *device, UInt16 vid, UInt16 pid, UInt16 bcd, const char *serial, UInt32 locationID)
+{
+	memset(device, 0, sizeof(*device));
+	device->descriptor.bLength = sizeof(IOUSBDeviceDescriptor);
+	device->descriptor.bDescriptorType = kUSBDeviceDesc;
+	device->descriptor.bMaxPacketSize0 = 64;
+	device->descriptor.idVendor = HostToUSBWord(vid);
+	device->descriptor.idProduct = HostToUSBWord(pid);
+	device->descriptor.bcdDevice = HostToUSBWord(bcd);
+	device->descriptor.iManufacturer = 1;
+	device->descriptor.iProduct = 2;
+	device->descriptor.iSerialNumber = serial ? 3 : 0;
+	device->descriptor.bNumConfigurations = 2;
+	device->serial = serial;
+	device->locationID = locationID;
+}
+
+// GET_DESCRIPTOR - returns the number of bytes sent
+static UInt32
+DeviceGetDescriptor(TestDevice *device, UInt8 type, UInt8 index, UInt16 lang, UInt8 *buffer, UInt32 length)
+{
+	UInt8		data[256];
+	UInt32		size = 0;
+	UInt32		i;
+	
+	device->requests++;
+	memset(data, 0, sizeof(data));
+	if (type == kUSBDeviceDesc)
+	{
+		memcpy(data, &device->descriptor, sizeof(IOUSBDeviceDescriptor));
+		size = sizeof(IOUSBDeviceDescriptor);
+	}
+	else if (type == kUSBConfDesc)
+	{
+		data[0] = 9;
+		data[1] = kUSBConfDesc;
+		data[2] = kTestConfigLength;
+		data[5] = index + 1;
+		for (i = 9; i < kTestConfigLength; i++)
+			data[i] = (UInt8)(i + index + USBToHostWord(device->descriptor.idProduct));
+		size = kTestConfigLength;
+	}
+	else if (type == kUSBStringDesc)
+	{
+		const char	*text = (index == 3) ? device->serial : ((index == 1) ? "Maker" : "Widget");
+		
+		data[1] = kUSBStringDesc;
+		for (i = 0; text[i]; i++)
+			data[2 + (2 * i)] = text[i];
+		data[0] = (UInt8)(2 + (2 * i));
+		data[2 + (2 * i)] = (UInt8)lang;
+		size = data[0];
+	}
+	
+	if (size > length)
+		size = length;
+	memcpy(buffer, data, size);
+	return size;
+}
+
+// an IOUSBDevice enumerating a TestDevice on a controller
+struct TestEnumeration
+{
+	IOUSBDescriptorCache	*cache;
+	TestDevice				*device;
+	IOUSBDeviceDescriptor	descriptor;
+	char					serial[64];
+	UInt8					configs[2][kTestConfigLength];
+	UInt8					strings[3][256];
+};
+
+// what IOUSBDevice::GetDescriptorCacheKey does
+static bool
+GetDescriptorCacheKey(TestEnumeration *e, char *key, UInt32 keySize)
+{
+	if (e->serial[0])
+	{
+		snprintf(key, keySize, "%04x-%04x-%04x-s-%s", USBToHostWord(e->descriptor.idVendor), USBToHostWord(e->descriptor.idProduct), USBToHostWord(e->descriptor.bcdDevice), e->serial);
+		return true;
+	}
+	if (!e->descriptor.iSerialNumber && e->device->locationID)
+	{
+		snprintf(key, keySize, "%04x-%04x-%04x-l-%08x", USBToHostWord(e->descriptor.idVendor), USBToHostWord(e->descriptor.idProduct), USBToHostWord(e->descriptor.bcdDevice), (unsigned)e->device->locationID);
+		return true;
+	}
+	return false;
+}
+
+// what GetFullConfigurationDescriptor does: the cache, or the 9 byte header and then the whole descriptor
+static void
+GetFullConfigurationDescriptor(TestEnumeration *e, UInt8 index)
+{
+	char							key[kUSBDescriptorCacheKeySize];
+	const IOUSBCachedDescriptor		*cached = NULL;
+	UInt8							header[9];
+	
+	if (GetDescriptorCacheKey(e, key, sizeof(key)))
+		cached = IOUSBDescriptorCacheLookup<TestCacheOps>(e->cache, key, &e->descriptor, kUSBConfDesc, index, 0, 2);
+	if (cached)
+	{
+		memcpy(e->configs[index], cached->bytes, cached->length);
+		return;
+	}
+	
+	DeviceGetDescriptor(e->device, kUSBConfDesc, index, 0, header, sizeof(header));
+	DeviceGetDescriptor(e->device, kUSBConfDesc, index, 0, e->configs[index], header[2]);
+	if (GetDescriptorCacheKey(e, key, sizeof(key)))
+		IOUSBDescriptorCacheStore<TestCacheOps>(e->cache, key, &e->descriptor, kUSBConfDesc, index, 0, e->configs[index], header[2]);
+}
+
+// what ReadStringDescriptor does, for a device which needs no length probe - the serial number always comes from the device
+static void
+ReadStringDescriptor(TestEnumeration *e, UInt8 index, UInt8 *desc)
+{
+	char							key[kUSBDescriptorCacheKeySize];
+	const IOUSBCachedDescriptor		*cached = NULL;
+	bool							useCache;
+	
+	useCache = (index != e->descriptor.iSerialNumber) && GetDescriptorCacheKey(e, key, sizeof(key));
+	if (useCache)
+		cached = IOUSBDescriptorCacheLookup<TestCacheOps>(e->cache, key, &e->descriptor, kUSBStringDesc, index, kTestLangID, 1);
+	if (cached)
+	{
+		memset(desc, 0, 256);
+		memcpy(desc, cached->bytes, cached->length);
+		return;
+	}
+	
+	DeviceGetDescriptor(e->device, kUSBStringDesc, index, kTestLangID, desc, 255);
+	if (useCache && desc[0])
+		IOUSBDescriptorCacheStore<TestCacheOps>(e->cache, key, &e->descriptor, kUSBStringDesc, index, kTestLangID, desc, desc[0]);
+}
+
+// the device descriptor, then (as IOUSBDevice::start does) the serial number first, the strings and the configurations
+static UInt32
+Enumerate(IOUSBDescriptorCache *cache, TestDevice *device, TestEnumeration *e)
+{
+	UInt32		before = device->requests;
+	int			i;
+	
+	memset(e, 0, sizeof(*e));
+	e->cache = cache;
+	e->device = device;
+	DeviceGetDescriptor(device, kUSBDeviceDesc, 0, 0, (UInt8 *)&e->descriptor, sizeof(IOUSBDeviceDescriptor));
+	if (e->descriptor.iSerialNumber)
+	{
+		ReadStringDescriptor(e, e->descriptor.iSerialNumber, e->strings[2]);
+		for (i = 0; (2 + (2 * i)) < e->strings[2][0]; i++)
+			e->serial[i] = e->strings[2][2 + (2 * i)];
+	}
+	ReadStringDescriptor(e, e->descriptor.iManufacturer, e->strings[0]);
+	ReadStringDescriptor(e, e->descriptor.iProduct, e->strings[1]);
+	for (i = 0; i < e->descriptor.bNumConfigurations; i++)
+		GetFullConfigurationDescriptor(e, i);
+	
+	return device->requests - before;
+}
+
+static bool
+SameDescriptors(const TestEnumeration *a, const TestEnumeration *b)
+{
+	return !memcmp(a->configs, b->configs, sizeof(a->configs)) && !memcmp(a->strings, b->strings, sizeof(a->strings));
+}
+
+static void
+TestReEnumeration(void)
+{
+	IOUSBDescriptorCache	*cache = (IOUSBDescriptorCache *)calloc(1, sizeof(IOUSBDescriptorCache));
+	TestDevice				device;
+	TestEnumeration			first, second;
+	
+	printf("  a reset device is described from the cache\n");
+	
+	DeviceInit(&device, 0x05ac, 0x1234, 0x0100, "A1B2C3", 0x1d100000);
+	
+	// device, serial, 2 strings and 2 configurations of 2 requests each
+	USBTestCheckEqual(Enumerate(cache, &device, &first), 8);
+	USBTestCheckEqual(cache->hits, 0);
+	USBTestCheckEqual(cache->count, 1);
+	
+	// after ResetDevice only the device descriptor and the serial number go over the bus
+	USBTestCheckEqual(Enumerate(cache, &device, &second), 2);
+	USBTestCheck(SameDescriptors(&first, &second));
+	USBTestCheckEqual(cache->hits, 4);
+	USBTestCheckEqual(cache->requestsSaved, 6);
+	
+	// the serial number follows the device to another port
+	device.locationID = 0x1d200000;
+	USBTestCheckEqual(Enumerate(cache, &device, &second), 2);
+	
+	IOUSBDescriptorCacheFlush<TestCacheOps>(cache);
+	USBTestCheckEqual(gTestAllocated, 0);
+	free(cache);
+}
+
+static void
+TestChangedDevice(void)
+{
+	IOUSBDescriptorCache	*cache = (IOUSBDescriptorCache *)calloc(1, sizeof(IOUSBDescriptorCache));
+	TestDevice				device;
+	TestEnumeration			e;
+	
+	printf("  a changed device is described from the bus\n");
+	
+	DeviceInit(&device, 0x05ac, 0x1234, 0x0100, "A1B2C3", 0x1d100000);
+	Enumerate(cache, &device, &e);
+	
+	// a firmware update which leaves bcdDevice alone but changes the device descriptor throws the entry away
+	device.descriptor.bMaxPacketSize0 = 8;
+	USBTestCheckEqual(Enumerate(cache, &device, &e), 8);
+	USBTestCheckEqual(cache->count, 1);
+	USBTestCheckEqual(Enumerate(cache, &device, &e), 2);
+	
+	// a new bcdDevice is a new identity
+	device.descriptor.bcdDevice = HostToUSBWord(0x0200);
+	USBTestCheckEqual(Enumerate(cache, &device, &e), 8);
+	USBTestCheckEqual(cache->count, 2);
+	
+	// a device without a serial number is known by its port, and is a stranger on any other
+	DeviceInit(&device, 0x046d, 0xc077, 0x7200, NULL, 0x1d110000);
+	USBTestCheckEqual(Enumerate(cache, &device, &e), 7);
+	USBTestCheckEqual(Enumerate(cache, &device, &e), 1);
+	device.locationID = 0x1d120000;
+	USBTestCheckEqual(Enumerate(cache, &device, &e), 7);
+	
+	// storing a descriptor again replaces the old copy
+	{
+		char	key[kUSBDescriptorCacheKeySize];
+		long	allocated = gTestAllocated;
+		
+		GetDescriptorCacheKey(&e, key, sizeof(key));
+		USBTestCheck(IOUSBDescriptorCacheStore<TestCacheOps>(cache, key, &e.descriptor, kUSBConfDesc, 0, 0, e.configs[0], kTestConfigLength));
+		USBTestCheckEqual(gTestAllocated, allocated);
+	}
+	
+	IOUSBDescriptorCacheFlush<TestCacheOps>(cache);
+	USBTestCheckEqual(cache->count, 0);
+	USBTestCheckEqual(gTestAllocated, 0);
+	free(cache);
+}
+
+// more devices than the cache holds, with a few used again and again
+static void
+TestEviction(void)
+{
+	IOUSBDescriptorCache	*cache = (IOUSBDescriptorCache *)calloc(1, sizeof(IOUSBDescriptorCache));
+	std::vector<TestDevice>	devices(kUSBDescriptorCacheMaxEntries + 8);
+	TestEnumeration			e;
+	char					serial[kUSBDescriptorCacheMaxEntries + 8][16];
+	UInt32					i;
+	
+	printf("  the least recently used device is evicted\n");
+	
+	for (i = 0; i < devices.size(); i++)
+	{
+		snprintf(serial[i], sizeof(serial[i]), "SN%04u", (unsigned)i);
+		DeviceInit(&devices[i], 0x0781, 0x5500 + i, 0x0100, serial[i], 0x1d100000 + (i << 16));
+	}
+	
+	// fill the cache, keeping devices 0 to 3 in use
+	for (i = 0; i < kUSBDescriptorCacheMaxEntries; i++)
+	{
+		Enumerate(cache, &devices[i], &e);
+		Enumerate(cache, &devices[i % 4], &e);
+	}
+	USBTestCheckEqual(cache->count, kUSBDescriptorCacheMaxEntries);
+	USBTestCheckEqual(cache->evictions, 0);
+	
+	// eight more push out the eight least recently used, which are 4 to 11
+	for (i = kUSBDescriptorCacheMaxEntries; i < devices.size(); i++)
+		USBTestCheckEqual(Enumerate(cache, &devices[i], &e), 8);
+	USBTestCheckEqual(cache->count, kUSBDescriptorCacheMaxEntries);
+	USBTestCheckEqual(cache->evictions, 8);
+	
+	for (i = 0; i < 4; i++)
+		USBTestCheckEqual(Enumerate(cache, &devices[i], &e), 2);
+	for (i = 12; i < devices.size(); i++)
+		USBTestCheckEqual(Enumerate(cache, &devices[i], &e), 2);
+	USBTestCheckEqual(cache->evictions, 8);
+	
+	for (i = 4; i < 12; i++)
+		USBTestCheckEqual(Enumerate(cache, &devices[i], &e), 8);
+	USBTestCheckEqual(cache->evictions, 16);
+	printf("    %u hits, %u misses, %u requests saved, %u evictions\n", (unsigned)cache->hits, (unsigned)cache->misses, (unsigned)cache->requestsSaved, (unsigned)cache->evictions);
+	
+	IOUSBDescriptorCacheFlush<TestCacheOps>(cache);
+	USBTestCheckEqual(gTestAllocated, 0);
+	free(cache);
+}
+
+int
+main(void)
+{
+	TestReEnumeration();
+	TestChangedDevice();
+	TestEviction();
+	return USBTestResult("IOUSBDescriptorCacheTests");
+}
@@ -0,0 +1,214 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+// Checks every IOUSBDescriptorIndex lookup against the plain bLength walk it replaces, on well formed and malformed
+// configuration descriptors
+
+#include <IOKit/usb/IOUSBDescriptorIndex.h>
+#pragma pack()								// GCC ignores USB.h's "#pragma options align=reset"
+
+#include <string.h>
+
+#include "USBTestSupport.h"
+
+// IOUSBDevice::FindNextDescriptor without the index
+static const IOUSBDescriptorHeader *
+WalkNextDescriptor(const UInt8 *config, UInt32 length, const void *current, UInt8 type)
+{
+	const IOUSBDescriptorHeader		*hdr;
+
+	if (!current)
+		hdr = (const IOUSBDescriptorHeader *)config;
+	else
+	{
+		if (((const UInt8 *)current < config) || ((UInt32)((const UInt8 *)current - config) >= length))
+			return NULL;
+		hdr = (const IOUSBDescriptorHeader *)current;
+	}
+
+	while (true)
+	{
+		const IOUSBDescriptorHeader		*lasthdr = hdr;
+
+		hdr = (const IOUSBDescriptorHeader *)((const UInt8 *)hdr + hdr->bLength);
+		if (lasthdr == hdr)
+			return NULL;
+		if ((UInt32)((const UInt8 *)hdr - config) >= length)
+			return NULL;
+		if ((type == kUSBAnyDesc) || (hdr->bDescriptorType == type))
+			return hdr;
+	}
+}
+
+// IOUSBInterface::FindNextAssociatedDescriptor without the index
+static const IOUSBDescriptorHeader *
+WalkNextAssociatedDescriptor(const UInt8 *config, UInt32 length, const void *current, UInt8 type, UInt8 interfaceNumber)
+{
+	const IOUSBDescriptorHeader		*next = (const IOUSBDescriptorHeader *)current;
+
+	while (true)
+	{
+		next = WalkNextDescriptor(config, length, next, kUSBAnyDesc);
+		if (!next || (next->bDescriptorType == kUSBInterfaceAssociationDesc) || ((next->bDescriptorType == kUSBInterfaceDesc) && (type != kUSBInterfaceDesc)))
+			return NULL;
+		if ((next->bDescriptorType == kUSBInterfaceDesc) && (((const IOUSBInterfaceDescriptor *)next)->bInterfaceNumber != interfaceNumber))
+			return NULL;
+		if ((next->bDescriptorType == type) || (type == kUSBAnyDesc))
+			return next;
+	}
+}
+
+static const UInt8	kTypes[] = { kUSBAnyDesc, kUSBConfDesc, kUSBInterfaceDesc, kUSBEndpointDesc, kUSBInterfaceAssociationDesc, kUSBHIDDesc, 0x24, 0x25, 0x77 };
+
+static void
+CheckIndex(const char *name, const UInt8 *config, UInt32 length, UInt32 expectedCount)
+{
+	IOUSBDescriptorIndex			index;
+	const IOUSBDescriptorHeader		*starts[256];
+	UInt32							startCount = 0;
+	UInt32							offset;
+	UInt32							s, t, n;
+
+	printf("  %s\n", name);
+
+	index.Init();
+	USBTestCheck(index.Build(config, length));
+	USBTestCheckEqual(index.Count(), expectedCount);
+
+	// every place a lookup may start from: NULL (the configuration descriptor) and the start of every descriptor
+	starts[startCount++] = NULL;
+	for (offset = 0; (offset < length) && (startCount < 256); offset += config[offset])
+	{
+		starts[startCount++] = (const IOUSBDescriptorHeader *)(config + offset);
+		if (config[offset] == 0)
+			break;
+	}
+	USBTestCheckEqual(startCount - 1, expectedCount);
+
+	for (s = 0; s < startCount; s++)
+	{
+		const IOUSBInterfaceDescriptor	*nextInterface = (const IOUSBInterfaceDescriptor *)0x1;
+
+		for (t = 0; t < sizeof(kTypes); t++)
+		{
+			const IOUSBDescriptorHeader		*next = (const IOUSBDescriptorHeader *)0x1;
+
+			USBTestCheck(index.FindNext(starts[s], kTypes[t], &next));
+			USBTestCheck(next == WalkNextDescriptor(config, length, starts[s], kTypes[t]));
+
+			// interface numbers which are present, and one which is not
+			for (n = 0; n < 4; n++)
+			{
+				if (!starts[s])
+					continue;
+				next = (const IOUSBDescriptorHeader *)0x1;
+				USBTestCheck(index.FindNextAssociated(starts[s], kTypes[t], (n < 3) ? n : 0x42, &next));
+				USBTestCheck(next == WalkNextAssociatedDescriptor(config, length, starts[s], kTypes[t], (n < 3) ? n : 0x42));
+			}
+		}
+
+		USBTestCheck(index.FindNextInterface(starts[s], &nextInterface));
+		USBTestCheck((const void *)nextInterface == (const void *)WalkNextDescriptor(config, length, starts[s], kUSBInterfaceDesc));
+	}
+
+	// a pointer which is not the start of a descriptor, or is outside the configuration, is left to the caller's own walk
+	{
+		const IOUSBDescriptorHeader		*next = NULL;
+
+		USBTestCheck(!index.FindNext(config + 1, kUSBAnyDesc, &next));
+		USBTestCheck(!index.FindNext(config + length, kUSBAnyDesc, &next));
+		USBTestCheck(!index.FindNextAssociated(config + 3, kUSBEndpointDesc, 0, &next));
+		USBTestCheck(next == NULL);
+	}
+
+	index.Destroy();
+	USBTestCheck(!index.IsBuilt());
+}
+
+// configuration, an association for interfaces 0 and 1, a class specific interface descriptor, two alternate settings on
+// interface 1, and an interface 2 outside the association with a HID and a class specific endpoint descriptor
+static const UInt8	kWellFormed[] = {
+	9, kUSBConfDesc, 0, 0, 3, 1, 0, 0x80, 50,
+	8, kUSBInterfaceAssociationDesc, 0, 2, 1, 1, 0, 0,
+	9, kUSBInterfaceDesc, 0, 0, 1, 1, 1, 0, 0,
+	5, 0x24, 1, 0, 1,
+	7, kUSBEndpointDesc, 0x83, 3, 8, 0, 10,
+	9, kUSBInterfaceDesc, 1, 0, 0, 1, 2, 0, 0,
+	9, kUSBInterfaceDesc, 1, 1, 2, 1, 2, 0, 0,
+	7, kUSBEndpointDesc, 0x81, 2, 64, 0, 0,
+	7, kUSBEndpointDesc, 0x02, 2, 64, 0, 0,
+	9, kUSBInterfaceDesc, 2, 0, 1, 3, 0, 0, 0,
+	9, kUSBHIDDesc, 0x11, 1, 0, 1, 0x22, 50, 0,
+	7, kUSBEndpointDesc, 0x84, 3, 8, 0, 10,
+	3, 0x25, 1,
+};
+
+// a zero bLength in the middle - the walk stops there, so the rest is not part of the configuration
+static const UInt8	kZeroLength[] = {
+	9, kUSBConfDesc, 0, 0, 1, 1, 0, 0x80, 50,
+	9, kUSBInterfaceDesc, 0, 0, 1, 0xFF, 0, 0, 0,
+	0, kUSBEndpointDesc, 0x81, 2, 64, 0, 0,
+	9, kUSBInterfaceDesc, 1, 0, 1, 0xFF, 0, 0, 0,
+};
+
+// the last descriptor claims to run past the end of the configuration
+static const UInt8	kOverrun[] = {
+	9, kUSBConfDesc, 0, 0, 1, 1, 0, 0x80, 50,
+	9, kUSBInterfaceDesc, 0, 0, 1, 0xFF, 0, 0, 0,
+	40, kUSBEndpointDesc, 0x81, 2, 64, 0, 0,
+};
+
+// a descriptor which runs past the end, followed by what would have been further descriptors in a longer configuration
+static const UInt8	kTruncated[] = {
+	9, kUSBConfDesc, 0, 0, 1, 1, 0, 0x80, 50,
+	9, kUSBInterfaceDesc, 0, 0, 2, 0xFF, 0, 0, 0,
+	7, kUSBEndpointDesc, 0x81, 2, 64, 0, 0,
+	7, kUSBEndpointDesc, 0x02, 2, 64, 0, 0,
+};
+
+int
+main(void)
+{
+	IOUSBDescriptorIndex	index;
+
+	CheckIndex("well formed", kWellFormed, sizeof(kWellFormed), 13);
+	CheckIndex("zero bLength", kZeroLength, sizeof(kZeroLength), 3);
+	CheckIndex("last descriptor overruns", kOverrun, sizeof(kOverrun), 3);
+	CheckIndex("truncated in a descriptor", kTruncated, sizeof(kTruncated) - 4, 4);
+	CheckIndex("only the configuration", kWellFormed, 9, 1);
+
+	printf("  not built\n");
+	index.Init();
+	USBTestCheck(!index.Build(NULL, 10));
+	USBTestCheck(!index.Build(kWellFormed, 0));
+	USBTestCheck(!index.IsBuilt());
+	{
+		const IOUSBDescriptorHeader		*next = NULL;
+
+		USBTestCheck(!index.FindNext(NULL, kUSBAnyDesc, &next));
+	}
+
+	return USBTestResult("IOUSBDescriptorIndexTests");
+}
@@ -0,0 +1,334 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Runs DeviceRequestBatch against a simulated control endpoint, checking that the batch stops at the first error with the right
+// per-request statuses, and comparing it with a loop of synchronous DeviceRequests on a simulated clock.
+//
+// The clock charges each control transfer its turnaround on the bus and each wakeup of a sleeping caller a fixed latency. Both
+// are parameters: the real cost of the command gate handoff is only measurable in the kernel, so what this shows is how many
+// times each path pays it, and how long the endpoint sits idle while the caller is being woken.
+
+#include <stdio.h>
+#include <string.h>
+#include <deque>
+
+#include <IOKit/usb/IOUSBDevRequestBatch.h>
+
+#include "USBTestSupport.h"
+
+// pipe zero of a device: requests run one at a time, in order, each taking the turnaround time
+struct TestControlEndpoint
+{
+	struct Pending
+	{
+		IOUSBDevRequest		*request;
+		IOUSBCompletion		completion;
+	};
+	
+	std::deque<Pending>		queue;
+	UInt64					now;					// ns
+	UInt64					busyUntil;
+	UInt64					turnaroundNS;
+	UInt64					wakeupNS;				// from the completion to a sleeping caller running again
+	UInt32					transfers;
+	UInt32					gateEntries;
+	UInt32					wakeups;
+	UInt32					stallAt;				// the transfer number which stalls, or 0
+	UInt32					refuseAt;				// the transfer number which can not be queued, or 0
+	UInt32					interruptAfter;			// the transfer number after which the caller is interrupted, or 0
+	bool					*interrupt;
+};
+
+static void
+EndpointInit(TestControlEndpoint *ep, UInt64 turnaroundNS, UInt64 wakeupNS)
+{
+	ep->queue.clear();
+	ep->now = ep->busyUntil = 0;
+	ep->turnaroundNS = turnaroundNS;
+	ep->wakeupNS = wakeupNS;
+	ep->transfers = ep->gateEntries = ep->wakeups = 0;
+	ep->stallAt = ep->refuseAt = ep->interruptAfter = 0;
+	ep->interrupt = NULL;
+}
+
+// IOUSBPipe::ControlRequest with a completion
+static IOReturn
+EndpointControlRequest(TestControlEndpoint *ep, IOUSBDevRequest *request, IOUSBCompletion *completion)
+{
+	TestControlEndpoint::Pending	pending;
+	
+	if ( ep->refuseAt && (ep->transfers + ep->queue.size() + 1 == ep->refuseAt) )
+		return kIOReturnNoResources;
+	
+	pending.request = request;
+	pending.completion = *completion;
+	ep->queue.push_back(pending);
+	return kIOReturnSuccess;
+}
+
+// the workloop: completes what is queued, in order, until nothing is left. A completion may queue the next request.
+static void
+EndpointRun(TestControlEndpoint *ep)
+{
+	while ( !ep->queue.empty() )
+	{
+		TestControlEndpoint::Pending	pending = ep->queue.front();
+		IOReturn						status = kIOReturnSuccess;
+		UInt32							remaining = 0;
+		
+		ep->queue.pop_front();
+		if ( ep->busyUntil < ep->now )
+			ep->busyUntil = ep->now;
+		ep->busyUntil += ep->turnaroundNS;
+		ep->now = ep->busyUntil;
+		ep->transfers++;
+		if ( ep->transfers == ep->stallAt )
+		{
+			status = kIOUSBPipeStalled;
+			remaining = pending.request->wLength;
+		}
+		if ( ep->interrupt && (ep->transfers == ep->interruptAfter) )
+			*ep->interrupt = true;
+		(*pending.completion.action)(pending.completion.target, pending.completion.parameter, status, remaining);
+	}
+}
+
+// what DeviceRequest does for a synchronous request: into the gate, queue it, sleep until the completion wakes us
+static void
+SyncComplete(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining)
+{
+	IOReturn			*result = (IOReturn *)target;
+	IOUSBDevRequest		*request = (IOUSBDevRequest *)parameter;
+	
+	request->wLenDone = request->wLength - bufferSizeRemaining;
+	*result = status;
+}
+
+static IOReturn
+DeviceRequest(TestControlEndpoint *ep, IOUSBDevRequest *request)
+{
+	IOUSBCompletion		completion;
+	IOReturn			result = kIOReturnError;
+	IOReturn			err;
+	
+	ep->gateEntries++;
+	completion.target = &result;
+	completion.action = SyncComplete;
+	completion.parameter = request;
+	err = EndpointControlRequest(ep, request, &completion);
+	if ( err != kIOReturnSuccess )
+		return err;
+	EndpointRun(ep);
+	ep->wakeups++;
+	ep->now += ep->wakeupNS;
+	return result;
+}
+
+// what IOUSBDevice::_DeviceRequestBatch, SubmitDeviceRequestBatchEntry and DeviceRequestBatchEntryComplete do
+static TestControlEndpoint	*gEndpoint;
+
+static bool
+SubmitEntry(IOUSBDevRequestBatch *batch)
+{
+	IOReturn	err;
+	
+	if ( batch->stop )
+		err = kIOReturnAborted;
+	else
+		err = EndpointControlRequest(gEndpoint, &batch->requests[batch->next], &batch->entryCompletion);
+	if ( err == kIOReturnSuccess )
+		return true;
+	IOUSBDevRequestBatchSendFailed(batch, err);
+	return false;
+}
+
+static void
+EntryComplete(void *target, void *parameter, IOReturn status, UInt32 bufferSizeRemaining)
+{
+	IOUSBDevRequestBatch	*batch = (IOUSBDevRequestBatch *)parameter;
+	
+	(void)target;
+	if ( IOUSBDevRequestBatchEntryDone(batch, status, bufferSizeRemaining) && SubmitEntry(batch) )
+		return;
+	batch->done = true;
+}
+
+static IOReturn
+DeviceRequestBatch(TestControlEndpoint *ep, IOUSBDevRequest *requests, UInt32 count, IOReturn *statuses, UInt32 *completed)
+{
+	IOUSBDevRequestBatch	batch;
+	UInt32					badIndex;
+	IOReturn				err;
+	
+	memset(&batch, 0, sizeof(batch));
+	batch.requests = requests;
+	batch.statuses = statuses;
+	batch.count = count;
+	batch.entryCompletion.action = EntryComplete;
+	batch.entryCompletion.parameter = &batch;
+	gEndpoint = ep;
+	ep->interrupt = &batch.stop;
+	
+	ep->gateEntries++;
+	err = IOUSBDevRequestBatchStart(&batch, &badIndex);
+	if ( err != kIOReturnSuccess )
+		return err;
+	if ( !SubmitEntry(&batch) )
+		return batch.status;
+	EndpointRun(ep);
+	USBTestCheck(batch.done);
+	ep->wakeups++;
+	ep->now += ep->wakeupNS;
+	ep->interrupt = NULL;
+	if ( completed )
+		*completed = batch.completed;
+	return batch.status;
+}
+
+static void
+FillRegisterWrites(IOUSBDevRequest *requests, UInt8 *data, UInt32 count)
+{
+	UInt32		i;
+	
+	memset(requests, 0, count * sizeof(IOUSBDevRequest));
+	for (i = 0; i < count; i++)
+	{
+		requests[i].bmRequestType = USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBDevice);
+		requests[i].bRequest = 0x01;
+		requests[i].wIndex = (UInt16)i;
+		requests[i].wLength = 2;
+		requests[i].pData = &data[2 * i];
+	}
+}
+
+static void
+TestStopOnFirstError(void)
+{
+	TestControlEndpoint		ep;
+	IOUSBDevRequest			requests[8];
+	UInt8					data[16];
+	IOReturn				statuses[8];
+	UInt32					completed = 0;
+	UInt32					i;
+	
+	printf("  a batch stops at the first error\n");
+	
+	EndpointInit(&ep, 125000, 0);
+	FillRegisterWrites(requests, data, 8);
+	USBTestCheckEqual(DeviceRequestBatch(&ep, requests, 8, statuses, &completed), kIOReturnSuccess);
+	USBTestCheckEqual(completed, 8);
+	for (i = 0; i < 8; i++)
+	{
+		USBTestCheckEqual(statuses[i], kIOReturnSuccess);
+		USBTestCheckEqual(requests[i].wLenDone, 2);
+	}
+	
+	// the fourth request stalls: nothing after it goes out
+	EndpointInit(&ep, 125000, 0);
+	ep.stallAt = 4;
+	FillRegisterWrites(requests, data, 8);
+	USBTestCheckEqual(DeviceRequestBatch(&ep, requests, 8, statuses, &completed), kIOUSBPipeStalled);
+	USBTestCheckEqual(completed, 3);
+	USBTestCheckEqual(ep.transfers, 4);
+	USBTestCheckEqual(statuses[2], kIOReturnSuccess);
+	USBTestCheckEqual(statuses[3], kIOUSBPipeStalled);
+	USBTestCheckEqual(requests[3].wLenDone, 0);
+	for (i = 4; i < 8; i++)
+		USBTestCheckEqual(statuses[i], kIOReturnAborted);
+	
+	// the sixth can not be queued
+	EndpointInit(&ep, 125000, 0);
+	ep.refuseAt = 6;
+	USBTestCheckEqual(DeviceRequestBatch(&ep, requests, 8, statuses, &completed), kIOReturnNoResources);
+	USBTestCheckEqual(completed, 5);
+	USBTestCheckEqual(statuses[5], kIOReturnNoResources);
+	USBTestCheckEqual(statuses[6], kIOReturnAborted);
+	
+	// the caller is interrupted while the second request is on the bus
+	EndpointInit(&ep, 125000, 0);
+	ep.interruptAfter = 2;
+	USBTestCheckEqual(DeviceRequestBatch(&ep, requests, 8, statuses, &completed), kIOReturnAborted);
+	USBTestCheckEqual(completed, 2);
+	USBTestCheckEqual(ep.transfers, 2);
+	USBTestCheckEqual(statuses[2], kIOReturnAborted);
+	
+	// SET_ADDRESS anywhere means nothing is sent
+	EndpointInit(&ep, 125000, 0);
+	FillRegisterWrites(requests, data, 8);
+	requests[5].bmRequestType = USBmakebmRequestType(kUSBOut, kUSBStandard, kUSBDevice);
+	requests[5].bRequest = kUSBRqSetAddress;
+	USBTestCheckEqual(DeviceRequestBatch(&ep, requests, 8, statuses, NULL), kIOReturnNotPermitted);
+	USBTestCheckEqual(ep.transfers, 0);
+}
+
+// a register programming sequence, as a loop of DeviceRequests and as one batch
+static void
+TestBenchmark(void)
+{
+	static const UInt64		turnarounds[] = { 125000, 1000000 };		// a high speed microframe, a full speed frame
+	static const UInt64		wakeups[] = { 10000, 50000 };
+	enum { kRequests = 1000 };
+	static IOUSBDevRequest	requests[kRequests];
+	static UInt8			data[2 * kRequests];
+	TestControlEndpoint		ep;
+	UInt64					serialNS, batchNS;
+	UInt32					t, w, i;
+	
+	printf("  %d register writes, one at a time and batched\n", kRequests);
+	
+	for (t = 0; t < sizeof(turnarounds) / sizeof(turnarounds[0]); t++)
+	{
+		for (w = 0; w < sizeof(wakeups) / sizeof(wakeups[0]); w++)
+		{
+			EndpointInit(&ep, turnarounds[t], wakeups[w]);
+			FillRegisterWrites(requests, data, kRequests);
+			for (i = 0; i < kRequests; i++)
+				USBTestCheckEqual(DeviceRequest(&ep, &requests[i]), kIOReturnSuccess);
+			serialNS = ep.now;
+			USBTestCheckEqual(ep.gateEntries, kRequests);
+			USBTestCheckEqual(ep.wakeups, kRequests);
+			USBTestCheckEqual(serialNS, kRequests * (turnarounds[t] + wakeups[w]));
+			
+			EndpointInit(&ep, turnarounds[t], wakeups[w]);
+			FillRegisterWrites(requests, data, kRequests);
+			USBTestCheckEqual(DeviceRequestBatch(&ep, requests, kRequests, NULL, NULL), kIOReturnSuccess);
+			batchNS = ep.now;
+			USBTestCheckEqual(ep.gateEntries, 1);
+			USBTestCheckEqual(ep.wakeups, 1);
+			USBTestCheckEqual(batchNS, (kRequests * turnarounds[t]) + wakeups[w]);
+			
+			printf("    turnaround %4llu us, wakeup %2llu us: %llu us one at a time, %llu us batched\n",
+				   (unsigned long long)turnarounds[t] / 1000, (unsigned long long)wakeups[w] / 1000,
+				   (unsigned long long)serialNS / 1000, (unsigned long long)batchNS / 1000);
+		}
+	}
+}
+
+int
+main(void)
+{
+	TestStopOnFirstError();
+	TestBenchmark();
+	return USBTestResult("IOUSBDevRequestBatchTests");
+}
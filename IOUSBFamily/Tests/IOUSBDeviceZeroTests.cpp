@@ -0,0 +1,425 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Enumerates simulated hub trees of fast, slow and stuck devices through the controller's device zero bookkeeping. Each port does
+// what AppleUSBHubPort::AddDevice and AddDeviceResetChangeHandler do: take device zero, reset the device, read its device descriptor
+// at address 0, SET_ADDRESS, wait out the 2 ms recovery and release device zero, then read descriptors and strings and configure the
+// device at its own address while other ports use device zero. Waiters queue the way ProtectedDevZeroLock's commandSleep does, and a
+// released lock goes to the next waiter.
+
+#include <queue>
+#include <deque>
+#include <vector>
+
+#include <IOKit/usb/IOUSBDeviceZeroArbiter.h>
+
+#include "USBTestSupport.h"
+
+enum
+{
+	kTestSetAddressRecoveryMS	= 2,			// USB 2.0 9.2.6.3
+	kTestHubPowerOnMS			= 100,			// from a hub's configuration to its ports seeing their devices
+	kTestHubPorts				= 7
+};
+
+struct TestDevice
+{
+	UInt32				resetMS;				// reset and the descriptor read at address 0
+	UInt32				postMS;					// descriptors, strings and configuration at the new address
+	UInt32				stuckMS;				// non zero for a device which never takes an address, and has device zero this long
+	std::vector<int>	children;				// the devices on a hub's ports
+	
+	// results
+	bool				waiting;
+	UInt32				generation;				// invalidates the timeout of a waiter which has since got device zero
+	UInt64				waitStart;
+	UInt64				holdMS;
+	UInt64				configuredAt;
+	bool				configured;
+	bool				failed;
+};
+
+enum TestEventKind
+{
+	kTestConnect,								// the port sees the device and starts AddDevice
+	kTestWaiterTimeout,							// the commandSleep deadline of a waiter
+	kTestRelease,								// SET_ADDRESS recovery over (or a stuck port gives up)
+	kTestConfigured
+};
+
+struct TestEvent
+{
+	UInt64				time;
+	UInt32				seq;
+	int					device;
+	TestEventKind		kind;
+	UInt32				generation;
+	
+	bool operator>(const TestEvent &other) const	{ return (time != other.time) ? (time > other.time) : (seq > other.seq); }
+};
+
+struct TestBus
+{
+	std::vector<TestDevice>		devices;
+	std::priority_queue<TestEvent, std::vector<TestEvent>, std::greater<TestEvent> >	events;
+	UInt32						seq;
+	UInt64						now;					// ms
+	
+	IOUSBDeviceZeroArbiter		arbiter;
+	bool						locked;					// _devZeroLock
+	int							holder;
+	std::deque<int>				waiters;
+	
+	UInt32						inPostAddress;
+	UInt32						maxInPostAddress;
+	UInt32						overlaps;
+};
+
+static UInt64	NS(UInt64 ms)	{ return ms * 1000000ULL; }
+
+static void
+BusInit(TestBus *bus)
+{
+	bus->devices.clear();
+	bus->seq = 0;
+	bus->now = 0;
+	bus->arbiter = IOUSBDeviceZeroArbiter();
+	bus->locked = false;
+	bus->holder = -1;
+	bus->waiters.clear();
+	bus->inPostAddress = bus->maxInPostAddress = bus->overlaps = 0;
+}
+
+static int
+AddDevice(TestBus *bus, UInt32 resetMS, UInt32 postMS, UInt32 stuckMS = 0)
+{
+	TestDevice	device = TestDevice();
+	
+	device.resetMS = resetMS;
+	device.postMS = postMS;
+	device.stuckMS = stuckMS;
+	bus->devices.push_back(device);
+	return (int)bus->devices.size() - 1;
+}
+
+static void
+Schedule(TestBus *bus, UInt64 time, int device, TestEventKind kind, UInt32 generation = 0)
+{
+	TestEvent	event = {time, bus->seq++, device, kind, generation};
+	
+	bus->events.push(event);
+}
+
+static UInt32
+WindowMS(const TestDevice *device)
+{
+	return device->stuckMS ? device->stuckMS : device->resetMS + kTestSetAddressRecoveryMS;
+}
+
+static void
+Grant(TestBus *bus, int index)
+{
+	TestDevice	*device = &bus->devices[index];
+	
+	if (bus->locked)
+		bus->overlaps++;
+	bus->locked = true;
+	bus->holder = index;
+	device->waiting = false;
+	device->generation++;
+	IOUSBDeviceZeroAcquired(&bus->arbiter, NS(device->waitStart), NS(bus->now));
+	Schedule(bus, bus->now + WindowMS(device), index, kTestRelease);
+}
+
+// the waiter sleeps until the current holder's deadline, rounded up to the next ms
+static void
+ScheduleWaiterTimeout(TestBus *bus, int index)
+{
+	UInt64		deadline = IOUSBDeviceZeroDeadline(&bus->arbiter);
+	
+	Schedule(bus, (deadline + 999999) / 1000000, index, kTestWaiterTimeout, bus->devices[index].generation);
+}
+
+static void
+HandleEvent(TestBus *bus, const TestEvent &event)
+{
+	TestDevice	*device = &bus->devices[event.device];
+	size_t		i;
+	
+	switch (event.kind)
+	{
+		case kTestConnect:
+			device->waitStart = bus->now;
+			if (!bus->locked)
+			{
+				Grant(bus, event.device);
+				break;
+			}
+			device->waiting = true;
+			bus->waiters.push_back(event.device);
+			ScheduleWaiterTimeout(bus, event.device);
+			break;
+			
+		case kTestWaiterTimeout:
+			if (!device->waiting || (event.generation != device->generation))
+				break;
+			if (IOUSBDeviceZeroMayWait(&bus->arbiter, NS(bus->now)))
+			{
+				// the lock has changed hands since we went to sleep - wait for the new holder's deadline
+				ScheduleWaiterTimeout(bus, event.device);
+				break;
+			}
+			// FatalError(kIOReturnCannotLock, "acquiring device zero")
+			device->waiting = false;
+			device->failed = true;
+			for (i = 0; i < bus->waiters.size(); i++)
+				if (bus->waiters[i] == event.device)
+				{
+					bus->waiters.erase(bus->waiters.begin() + i);
+					break;
+				}
+			break;
+			
+		case kTestRelease:
+			device->holdMS = IOUSBDeviceZeroReleased(&bus->arbiter, NS(bus->now)) / 1000000;
+			bus->locked = false;
+			bus->holder = -1;
+			if (device->stuckMS)
+				device->failed = true;
+			else
+			{
+				Schedule(bus, bus->now + device->postMS, event.device, kTestConfigured);
+				if (++bus->inPostAddress > bus->maxInPostAddress)
+					bus->maxInPostAddress = bus->inPostAddress;
+			}
+			
+			// commandWakeup - the next waiter takes device zero
+			if (!bus->waiters.empty())
+			{
+				int		next = bus->waiters.front();
+				
+				bus->waiters.pop_front();
+				Grant(bus, next);
+			}
+			break;
+			
+		case kTestConfigured:
+			bus->inPostAddress--;
+			device->configured = true;
+			device->configuredAt = bus->now;
+			for (i = 0; i < device->children.size(); i++)
+				Schedule(bus, bus->now + kTestHubPowerOnMS, device->children[i], kTestConnect);
+			break;
+	}
+}
+
+static void
+Run(TestBus *bus)
+{
+	while (!bus->events.empty())
+	{
+		TestEvent	event = bus->events.top();
+		
+		bus->events.pop();
+		bus->now = event.time;
+		HandleEvent(bus, event);
+	}
+}
+
+// a hub tree behind the four root hub ports: each root port has a hub with two more hubs and five devices on it, and each of those
+// hubs has seven devices - every fifth device is slow to describe and configure itself
+static void
+TestHubTree(void)
+{
+	TestBus			bus;
+	std::vector<int>	roots;
+	UInt32			deviceCount = 0;
+	UInt64			windows = 0;
+	UInt64			serialized = 0;
+	UInt64			finished = 0;
+	UInt32			maxWindow = 0;
+	int				r, h, d;
+	size_t			i;
+	
+	printf("  a hub tree of fast and slow devices\n");
+	
+	BusInit(&bus);
+	for (r = 0; r < 4; r++)
+	{
+		int		hub = AddDevice(&bus, 30, 300);
+		
+		roots.push_back(hub);
+		for (h = 0; h < 2; h++)
+		{
+			int		subHub = AddDevice(&bus, 30, 300);
+			
+			bus.devices[hub].children.push_back(subHub);
+			for (d = 0; d < kTestHubPorts; d++)
+			{
+				int		device = AddDevice(&bus, 20 + (d * 3), (d == 4) ? 3000 : 200);
+				
+				bus.devices[subHub].children.push_back(device);
+			}
+		}
+		for (d = 0; d < kTestHubPorts - 2; d++)
+		{
+			int		device = AddDevice(&bus, 25, (d == 2) ? 4000 : 250);
+			
+			bus.devices[hub].children.push_back(device);
+		}
+	}
+	for (i = 0; i < roots.size(); i++)
+		Schedule(&bus, 0, roots[i], kTestConnect);
+	Run(&bus);
+	
+	for (i = 0; i < bus.devices.size(); i++)
+	{
+		TestDevice	*device = &bus.devices[i];
+		
+		USBTestCheck(device->configured);
+		USBTestCheck(!device->failed);
+		USBTestCheckEqual(device->holdMS, WindowMS(device));
+		windows += WindowMS(device);
+		serialized += WindowMS(device) + device->postMS;
+		if (WindowMS(device) > maxWindow)
+			maxWindow = WindowMS(device);
+		if (device->configuredAt > finished)
+			finished = device->configuredAt;
+		deviceCount++;
+	}
+	USBTestCheck(deviceCount >= 60);
+	USBTestCheckEqual(bus.overlaps, 0);
+	USBTestCheckEqual(bus.arbiter.acquisitions, deviceCount);
+	USBTestCheckEqual(bus.arbiter.timeouts, 0);
+	USBTestCheckEqual(bus.arbiter.totalHoldNS, NS(windows));
+	USBTestCheckEqual(bus.arbiter.maxHoldMS, maxWindow);
+	
+	// device zero is the only thing the ports share, so the tree takes no longer than every window back to back plus the slowest
+	// device's own work at each of its three levels
+	USBTestCheck(finished <= windows + 3 * (kTestHubPowerOnMS + 300) + 4000);
+	USBTestCheck(bus.maxInPostAddress >= 10);
+	printf("    %u devices configured after %u ms (%u ms holding device zero, %u ms one at a time), %u configuring at once\n",
+		   (unsigned)deviceCount, (unsigned)finished, (unsigned)windows, (unsigned)serialized, (unsigned)bus.maxInPostAddress);
+}
+
+// forty devices which each take a second to reset, all connected at once - the last one waits 39 seconds, but behind holders which
+// are each making progress, so nobody gives up
+static void
+TestLongQueue(void)
+{
+	TestBus		bus;
+	int			hub;
+	int			d;
+	size_t		i;
+	
+	printf("  a queue longer than the deadline\n");
+	
+	BusInit(&bus);
+	hub = AddDevice(&bus, 30, 100);
+	for (d = 0; d < 40; d++)
+	{
+		int		device = AddDevice(&bus, 1000 - kTestSetAddressRecoveryMS, 500);
+		
+		bus.devices[hub].children.push_back(device);
+	}
+	Schedule(&bus, 0, hub, kTestConnect);
+	Run(&bus);
+	
+	for (i = 0; i < bus.devices.size(); i++)
+		USBTestCheck(bus.devices[i].configured);
+	USBTestCheckEqual(bus.arbiter.timeouts, 0);
+	USBTestCheckEqual(bus.arbiter.maxWaitMS, 39 * 1000);
+	USBTestCheckEqual(bus.arbiter.maxHoldMS, 1000);
+}
+
+// a device which never takes an address keeps device zero for 45 seconds - the ports queued behind it give up 30 seconds after it took
+// device zero, however recently they started waiting, and a port which comes along after it has let go enumerates normally
+static void
+TestStuckDevice(void)
+{
+	TestBus		bus;
+	int			stuck, late, after;
+	int			early[4];
+	int			d;
+	
+	printf("  a stuck device\n");
+	
+	BusInit(&bus);
+	stuck = AddDevice(&bus, 0, 0, 45000);
+	for (d = 0; d < 4; d++)
+		early[d] = AddDevice(&bus, 20, 200);
+	late = AddDevice(&bus, 20, 200);
+	after = AddDevice(&bus, 20, 200);
+	
+	Schedule(&bus, 0, stuck, kTestConnect);
+	for (d = 0; d < 4; d++)
+		Schedule(&bus, 10 + d, early[d], kTestConnect);
+	Schedule(&bus, 29000, late, kTestConnect);
+	Schedule(&bus, 50000, after, kTestConnect);
+	Run(&bus);
+	
+	USBTestCheck(bus.devices[stuck].failed);
+	USBTestCheckEqual(bus.devices[stuck].holdMS, 45000);
+	for (d = 0; d < 4; d++)
+	{
+		USBTestCheck(bus.devices[early[d]].failed);
+		USBTestCheck(!bus.devices[early[d]].configured);
+	}
+	USBTestCheck(bus.devices[late].failed);
+	USBTestCheck(bus.devices[after].configured);
+	USBTestCheckEqual(bus.arbiter.timeouts, 5);
+	USBTestCheckEqual(bus.arbiter.acquisitions, 2);
+	USBTestCheckEqual(bus.overlaps, 0);
+}
+
+// the deadline follows the holder: a waiter which has been waiting 30 seconds keeps waiting once device zero has changed hands
+static void
+TestDeadlineFollowsHolder(void)
+{
+	IOUSBDeviceZeroArbiter	arbiter = IOUSBDeviceZeroArbiter();
+	
+	printf("  the deadline is the holder's\n");
+	
+	IOUSBDeviceZeroAcquired(&arbiter, 0, 0);
+	USBTestCheckEqual(IOUSBDeviceZeroDeadline(&arbiter), kUSBDeviceZeroDeadlineNS);
+	USBTestCheck(IOUSBDeviceZeroMayWait(&arbiter, kUSBDeviceZeroDeadlineNS - 1));
+	USBTestCheckEqual(IOUSBDeviceZeroReleased(&arbiter, NS(25000)), NS(25000));
+	
+	IOUSBDeviceZeroAcquired(&arbiter, NS(5), NS(25000));
+	USBTestCheckEqual(arbiter.maxWaitMS, 24995);
+	USBTestCheck(IOUSBDeviceZeroMayWait(&arbiter, kUSBDeviceZeroDeadlineNS + NS(1)));
+	USBTestCheck(!IOUSBDeviceZeroMayWait(&arbiter, NS(25000) + kUSBDeviceZeroDeadlineNS));
+	USBTestCheckEqual(arbiter.timeouts, 1);
+	USBTestCheckEqual(arbiter.acquisitions, 2);
+}
+
+int
+main(void)
+{
+	TestDeadlineFollowsHolder();
+	TestHubTree();
+	TestLongQueue();
+	TestStuckDevice();
+	return USBTestResult("IOUSBDeviceZeroTests");
+}
@@ -0,0 +1,268 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Drives the completion handoff ring the way FlushCompletionBatch (the producer, on the workloop) and DispatchCompletionHandoffs
+// (the consumer, on the completion thread) do: slots come back in order, a full ring sends the pass back to the workloop instead
+// of losing it, the consumer never sees a slot the producer is still filling in, and the indices survive wrapping
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+
+#include <IOKit/IOLib.h>
+#include <IOKit/usb/IOUSBHandoffRing.h>
+
+#include "USBTestSupport.h"
+
+enum
+{
+	kTestSlots			= 8,						// kUSBCompletionHandoffSlots
+	kTestResults		= 64						// kUSBCompletionBatchMax
+};
+
+// an IOUSBCompletionHandoff: every result of a pass carries the pass number
+struct TestHandoff
+{
+	UInt32		pass;
+	UInt32		resultCount;
+	UInt32		results[kTestResults];
+};
+
+static void
+TestSingleThread(void)
+{
+	IOUSBHandoffRing	ring;
+	UInt32				slot = 0, i;
+	
+	printf("  slots come back in order, and a full ring says so\n");
+	
+	IOUSBHandoffRingInit(&ring, kTestSlots);
+	USBTestCheck(!IOUSBHandoffRingFirst(&ring, &slot));
+	for (i = 0; i < kTestSlots; i++)
+	{
+		USBTestCheck(IOUSBHandoffRingReserve(&ring, &slot));
+		USBTestCheckEqual(slot, i);
+		IOUSBHandoffRingPublish(&ring);
+	}
+	USBTestCheck(!IOUSBHandoffRingReserve(&ring, &slot));
+	USBTestCheckEqual(IOUSBHandoffRingPending(&ring), kTestSlots);
+	
+	USBTestCheck(IOUSBHandoffRingFirst(&ring, &slot));
+	USBTestCheckEqual(slot, 0);
+	IOUSBHandoffRingRelease(&ring);
+	USBTestCheck(IOUSBHandoffRingReserve(&ring, &slot));
+	USBTestCheckEqual(slot, 0);
+	
+	// a reserved slot is not the consumer's until it is published
+	for (i = 1; i < kTestSlots; i++)
+	{
+		USBTestCheck(IOUSBHandoffRingFirst(&ring, &slot));
+		USBTestCheckEqual(slot, i);
+		IOUSBHandoffRingRelease(&ring);
+	}
+	USBTestCheck(!IOUSBHandoffRingFirst(&ring, &slot));
+	IOUSBHandoffRingPublish(&ring);
+	USBTestCheck(IOUSBHandoffRingFirst(&ring, &slot));
+	USBTestCheckEqual(slot, 0);
+	IOUSBHandoffRingRelease(&ring);
+	
+	// an uninitialized ring (no completion thread yet) has no slots
+	IOUSBHandoffRingInit(&ring, 0);
+	USBTestCheck(!IOUSBHandoffRingReserve(&ring, &slot));
+	
+	// the counters wrap
+	printf("  the indices wrap\n");
+	IOUSBHandoffRingInit(&ring, 6);
+	ring.head = ring.tail = 0xFFFFFFFC;
+	for (i = 0; i < 6; i++)
+	{
+		USBTestCheck(IOUSBHandoffRingReserve(&ring, &slot));
+		USBTestCheckEqual(slot, (0xFFFFFFFC + i) % 6);
+		IOUSBHandoffRingPublish(&ring);
+	}
+	USBTestCheck(!IOUSBHandoffRingReserve(&ring, &slot));
+	USBTestCheckEqual(IOUSBHandoffRingPending(&ring), 6);
+	for (i = 0; i < 6; i++)
+	{
+		USBTestCheck(IOUSBHandoffRingFirst(&ring, &slot));
+		USBTestCheckEqual(slot, (0xFFFFFFFC + i) % 6);
+		IOUSBHandoffRingRelease(&ring);
+	}
+	USBTestCheckEqual(IOUSBHandoffRingPending(&ring), 0);
+	USBTestCheckEqual(ring.tail, 2);
+}
+
+// the completion batch, as far as the ring is concerned
+struct TestCompletionBatch
+{
+	IOLock				*completionLock;
+	IOUSBHandoffRing	handoffRing;
+	TestHandoff			handoffSlots[kTestSlots];
+	std::vector<UInt8>	delivered;					// per pass: 1 by the completion thread, 2 on the workloop
+	UInt32				lastPass;
+	UInt32				maxPending;
+	UInt32				ringFull;
+	UInt32				torn;
+	UInt32				outOfOrder;
+	bool				stop;
+};
+
+static void
+CheckHandoff(TestCompletionBatch *batch, const TestHandoff *handoff)
+{
+	UInt32		i;
+	
+	for (i = 0; i < handoff->resultCount; i++)
+		if ( handoff->results[i] != handoff->pass )
+			batch->torn++;
+	if ( handoff->pass <= batch->lastPass )
+		batch->outOfOrder++;
+	batch->lastPass = handoff->pass;
+	batch->delivered[handoff->pass] += 1;
+}
+
+// what DispatchCompletionHandoffs does
+static void *
+CompletionThread(void *arg)
+{
+	TestCompletionBatch		*batch = (TestCompletionBatch *)arg;
+	UInt32					slot;
+	bool					stop;
+	
+	do
+	{
+		IOLockLock(batch->completionLock);
+		while ( !IOUSBHandoffRingPending(&batch->handoffRing) && !batch->stop )
+			IOLockSleep(batch->completionLock, &batch->handoffRing, THREAD_UNINT);
+		while ( IOUSBHandoffRingFirst(&batch->handoffRing, &slot) )
+		{
+			TestHandoff		*handoff = &batch->handoffSlots[slot];
+			
+			IOLockUnlock(batch->completionLock);
+			CheckHandoff(batch, handoff);
+			IOLockLock(batch->completionLock);
+			IOUSBHandoffRingRelease(&batch->handoffRing);
+		}
+		stop = batch->stop;
+		IOLockUnlock(batch->completionLock);
+	} while ( !stop );
+	
+	return NULL;
+}
+
+// what FlushCompletionBatch and QueueCompletionHandoff do
+static void
+Flush(TestCompletionBatch *batch, UInt32 pass)
+{
+	TestHandoff		*handoff = NULL;
+	UInt32			slot, i;
+	
+	IOLockLock(batch->completionLock);
+	if ( IOUSBHandoffRingReserve(&batch->handoffRing, &slot) )
+		handoff = &batch->handoffSlots[slot];
+	else
+		batch->ringFull++;
+	IOLockUnlock(batch->completionLock);
+	
+	if ( !handoff )
+	{
+		// the batch actions run right here; the thread's order is only kept among handed off passes
+		batch->delivered[pass] += 2;
+		return;
+	}
+	
+	handoff->pass = pass;
+	handoff->resultCount = 1 + (pass % kTestResults);
+	for (i = 0; i < handoff->resultCount; i++)
+		handoff->results[i] = pass;
+	
+	IOLockLock(batch->completionLock);
+	IOUSBHandoffRingPublish(&batch->handoffRing);
+	if ( IOUSBHandoffRingPending(&batch->handoffRing) > batch->maxPending )
+		batch->maxPending = IOUSBHandoffRingPending(&batch->handoffRing);
+	IOLockWakeup(batch->completionLock, &batch->handoffRing, false);
+	IOLockUnlock(batch->completionLock);
+}
+
+static void
+TestThreads(void)
+{
+	enum { kPasses = 200000 };
+	TestCompletionBatch		*batch = new TestCompletionBatch;
+	pthread_t				thread;
+	UInt32					pass, once = 0, twice = 0;
+	
+	printf("  a workloop and a completion thread\n");
+	
+	batch->completionLock = IOLockAlloc();
+	IOUSBHandoffRingInit(&batch->handoffRing, kTestSlots);
+	batch->delivered.assign(kPasses + 1, 0);
+	batch->lastPass = 0;
+	batch->maxPending = batch->ringFull = batch->torn = batch->outOfOrder = 0;
+	batch->stop = false;
+	pthread_create(&thread, NULL, CompletionThread, batch);
+	
+	// the workloop gives the thread a chance now and then, as it would between interrupts
+	for (pass = 1; pass <= kPasses; pass++)
+	{
+		Flush(batch, pass);
+		if ( (pass % 12) == 0 )
+			sched_yield();
+	}
+	
+	IOLockLock(batch->completionLock);
+	batch->stop = true;
+	IOLockWakeup(batch->completionLock, &batch->handoffRing, false);
+	IOLockUnlock(batch->completionLock);
+	pthread_join(thread, NULL);
+	
+	for (pass = 1; pass <= kPasses; pass++)
+	{
+		if ( batch->delivered[pass] == 1 )
+			once++;
+		else if ( batch->delivered[pass] == 2 )
+			twice++;
+	}
+	USBTestCheckEqual(once + twice, kPasses);
+	USBTestCheckEqual(twice, batch->ringFull);
+	USBTestCheckEqual(batch->torn, 0);
+	USBTestCheckEqual(batch->outOfOrder, 0);
+	USBTestCheck(batch->maxPending <= kTestSlots);
+	USBTestCheckEqual(IOUSBHandoffRingPending(&batch->handoffRing), 0);
+	printf("    %u passes: %u through the ring, %u on the workloop with the ring full, at most %u waiting\n",
+		   (unsigned)kPasses, (unsigned)once, (unsigned)twice, (unsigned)batch->maxPending);
+	
+	IOLockFree(batch->completionLock);
+	delete batch;
+}
+
+int
+main(void)
+{
+	TestSingleThread();
+	TestThreads();
+	return USBTestResult("IOUSBHandoffRingTests");
+}
@@ -0,0 +1,420 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Reads an IOUSBInterface pipe table from several threads while another thread keeps switching it between two alternate
+// settings, the way PublishPipeTableGated rewrites it under the command gate, and checks that every lookup which succeeds
+// saw one setting or the other and never a mix: a pipe from FindNext always comes with its own endpoint's parameters, and
+// GetPipeObj's index lookup returns what one of the settings has at that index. A table nobody rewrites must match the
+// gated linear scan it stands in for, for every type and direction.
+//
+// With one CPU a reader only meets a half written table when it is preempted inside the rewrite, so there the contention
+// run catches a missing generation check only some of the time. The check that nothing succeeds while a rewrite is under
+// way does not depend on the scheduler.
+//
+// The contention numbers compare the lookup against a scan under a pthread mutex, standing in for the command gate. They
+// are host pthread numbers - the gate in the kernel also switches to the work loop's context - and only mean something
+// relative to each other on the same machine.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <IOKit/usb/IOUSBPipeTable.h>
+
+#include "USBTestSupport.h"
+
+// the table only stores the pointers
+class IOUSBPipe
+{
+public:
+	UInt8		index;
+	UInt8		transferType;
+	UInt8		direction;
+	UInt8		interval;
+	UInt16		maxPacketSize;
+};
+
+enum
+{
+	kTestSettings			= 2,
+	kTestEndpoints			= 6,
+	kTestReaders			= 4,
+	kTestContentionMS		= 200,
+	kTestBenchmarkMS		= 100
+};
+
+// alternate setting 0 has six endpoints with a hole at index 2, alternate setting 1 has four different ones
+static IOUSBPipe		gPipes[kTestSettings][kUSBMaxPipes];
+static UInt32			gEndpointCount[kTestSettings] = {kTestEndpoints, 4};
+
+static void
+InitPipes(void)
+{
+	static const UInt8	kTypes[kTestEndpoints] = {kUSBBulk, kUSBBulk, kUSBInterrupt, kUSBIsoc, kUSBInterrupt, kUSBBulk};
+	
+	for (UInt32 setting = 0; setting < kTestSettings; setting++)
+	{
+		for (UInt32 i = 0; i < gEndpointCount[setting]; i++)
+		{
+			if ((setting == 0) && (i == 2))
+				continue;
+			gPipes[setting][i].index = (UInt8)i;
+			gPipes[setting][i].transferType = (setting == 0) ? kTypes[i] : kTypes[kTestEndpoints - 1 - i];
+			gPipes[setting][i].direction = (i & 1) ? kUSBIn : kUSBOut;
+			gPipes[setting][i].interval = (UInt8)(setting * 16 + i + 1);
+			gPipes[setting][i].maxPacketSize = (UInt16)(setting ? 1024 : 64) + (UInt16)i;
+		}
+	}
+}
+
+static IOUSBPipe *
+SettingPipe(UInt32 setting, UInt32 index)
+{
+	return gPipes[setting][index].maxPacketSize ? &gPipes[setting][index] : NULL;
+}
+
+// what PublishPipeTableGated does when SetAlternateInterface has created the pipes of a setting
+static void
+PublishSetting(IOUSBInterfacePipeTable *table, UInt32 setting)
+{
+	IOUSBPipe	*pipe;
+	
+	IOUSBPipeTableBeginUpdate(table);
+	table->count = gEndpointCount[setting];
+	for ( unsigned int i = 0; i < kUSBMaxPipes; i++ )
+	{
+		pipe = SettingPipe(setting, i);
+		memset(&table->entries[i], 0, sizeof(IOUSBInterfacePipeTableEntry));
+		if (pipe)
+		{
+			table->entries[i].pipe = pipe;
+			table->entries[i].maxPacketSize = pipe->maxPacketSize;
+			table->entries[i].transferType = pipe->transferType;
+			table->entries[i].direction = pipe->direction;
+			table->entries[i].interval = pipe->interval;
+		}
+	}
+	IOUSBPipeTableEndUpdate(table);
+}
+
+// what FindNextPipeGated does, on the pipe list of a setting
+static IOUSBPipe *
+GatedFindNext(UInt32 setting, IOUSBPipe *current, IOUSBFindEndpointRequest *request)
+{
+	UInt32		i = 0;
+	IOUSBPipe	*pipe;
+	
+	if (current)
+	{
+		for ( ; i < gEndpointCount[setting]; i++)
+			if (SettingPipe(setting, i) == current)
+			{
+				i++;
+				break;
+			}
+	}
+	for ( ; i < gEndpointCount[setting]; i++)
+	{
+		pipe = SettingPipe(setting, i);
+		if (!pipe)
+			continue;
+		if ((request->type != kUSBAnyType) && (request->type != pipe->transferType))
+			continue;
+		if ((request->direction != kUSBAnyDirn) && (request->direction != pipe->direction))
+			continue;
+		request->type = pipe->transferType;
+		request->direction = pipe->direction;
+		request->maxPacketSize = pipe->maxPacketSize;
+		request->interval = pipe->interval;
+		return pipe;
+	}
+	return NULL;
+}
+
+static bool
+RequestMatchesPipe(const IOUSBFindEndpointRequest *request, const IOUSBPipe *pipe)
+{
+	return (request->type == pipe->transferType) && (request->direction == pipe->direction) &&
+		   (request->maxPacketSize == pipe->maxPacketSize) && (request->interval == pipe->interval);
+}
+
+static double
+NowMS(void)
+{
+	struct timespec		now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+
+
+static void
+TestMatchesGatedScan(void)
+{
+	static const UInt8		kTypes[] = {kUSBAnyType, kUSBControl, kUSBIsoc, kUSBBulk, kUSBInterrupt};
+	static const UInt8		kDirections[] = {kUSBAnyDirn, kUSBOut, kUSBIn};
+	IOUSBInterfacePipeTable	table;
+	IOUSBFindEndpointRequest	request, gatedRequest;
+	IOUSBPipe				*pipe, *gatedPipe;
+	
+	printf("  FindNext and the index lookup against the gated scan, on both settings\n");
+	memset(&table, 0, sizeof(table));
+	for (UInt32 setting = 0; setting < kTestSettings; setting++)
+	{
+		PublishSetting(&table, setting);
+		USBTestCheckEqual(table.generation, 2 * (setting + 1));
+		
+		for (UInt32 i = 0; i < kUSBMaxPipes + 2; i++)
+		{
+			pipe = (IOUSBPipe *)1;
+			USBTestCheck(IOUSBPipeTableLookup(&table, (UInt8)i, &pipe));
+			USBTestCheck(pipe == ((i < kUSBMaxPipes) ? SettingPipe(setting, i) : NULL));
+		}
+		
+		for (UInt32 t = 0; t < sizeof(kTypes); t++)
+		{
+			for (UInt32 d = 0; d < sizeof(kDirections); d++)
+			{
+				pipe = gatedPipe = NULL;
+				do
+				{
+					memset(&request, 0, sizeof(request));
+					request.type = kTypes[t];
+					request.direction = kDirections[d];
+					gatedRequest = request;
+					USBTestCheck(IOUSBPipeTableFindNext(&table, pipe, &request, &pipe));
+					gatedPipe = GatedFindNext(setting, gatedPipe, &gatedRequest);
+					USBTestCheck(pipe == gatedPipe);
+					USBTestCheck(!memcmp(&request, &gatedRequest, sizeof(request)));
+				} while (pipe && gatedPipe);
+			}
+		}
+	}
+	
+	// a reader never succeeds while a rewrite is under way
+	IOUSBPipeTableBeginUpdate(&table);
+	USBTestCheck(!IOUSBPipeTableLookup(&table, 0, &pipe));
+	memset(&request, 0, sizeof(request));
+	request.type = kUSBAnyType;
+	request.direction = kUSBAnyDirn;
+	USBTestCheck(!IOUSBPipeTableFindNext(&table, NULL, &request, &pipe));
+	IOUSBPipeTableEndUpdate(&table);
+	USBTestCheck(IOUSBPipeTableLookup(&table, 0, &pipe));
+	USBTestCheck(pipe == SettingPipe(1, 0));
+}
+
+
+
+// Readers against a writer which switches the setting as fast as it can
+struct ContentionState
+{
+	IOUSBInterfacePipeTable		table;
+	volatile bool				stop;
+	UInt64						switches;
+};
+
+struct ReaderResult
+{
+	ContentionState *	state;
+	UInt64				lookups;
+	UInt64				fallbacks;						// lookups which would have taken the gate
+	UInt64				mixed;							// lookups which saw something neither setting has
+};
+
+static void *
+ContentionWriter(void *arg)
+{
+	ContentionState		*state = (ContentionState *)arg;
+	
+	while (!state->stop)
+	{
+		PublishSetting(&state->table, (UInt32)(state->switches & 1));
+		state->switches++;
+	}
+	return NULL;
+}
+
+static void *
+ContentionReader(void *arg)
+{
+	ReaderResult				*result = (ReaderResult *)arg;
+	ContentionState				*state = result->state;
+	IOUSBFindEndpointRequest	request;
+	IOUSBPipe					*pipe;
+	UInt32						index = 0;
+	
+	while (!state->stop)
+	{
+		index = (index + 1) % kTestEndpoints;
+		result->lookups += 2;
+		
+		if (!IOUSBPipeTableLookup(&state->table, (UInt8)index, &pipe))
+			result->fallbacks++;
+		else if ((pipe != SettingPipe(0, index)) && (pipe != SettingPipe(1, index)))
+			result->mixed++;
+		
+		// walk from the pipe one setting has at this index - it may be gone, which starts the walk over
+		memset(&request, 0, sizeof(request));
+		request.type = kUSBAnyType;
+		request.direction = kUSBAnyDirn;
+		if (!IOUSBPipeTableFindNext(&state->table, SettingPipe(index & 1, index), &request, &pipe))
+			result->fallbacks++;
+		else if (pipe && !RequestMatchesPipe(&request, pipe))
+			result->mixed++;
+	}
+	return NULL;
+}
+
+static void
+TestReadersAgainstWriter(void)
+{
+	ContentionState		state;
+	ReaderResult		results[kTestReaders];
+	pthread_t			readers[kTestReaders];
+	pthread_t			writer;
+	UInt64				lookups = 0, fallbacks = 0, mixed = 0;
+	
+	printf("  %d readers while a writer switches the alternate setting without pause\n", kTestReaders);
+	memset(&state, 0, sizeof(state));
+	PublishSetting(&state.table, 0);
+	
+	for (int i = 0; i < kTestReaders; i++)
+	{
+		memset(&results[i], 0, sizeof(results[i]));
+		results[i].state = &state;
+		pthread_create(&readers[i], NULL, ContentionReader, &results[i]);
+	}
+	pthread_create(&writer, NULL, ContentionWriter, &state);
+	usleep(kTestContentionMS * 1000);
+	state.stop = true;
+	pthread_join(writer, NULL);
+	for (int i = 0; i < kTestReaders; i++)
+	{
+		pthread_join(readers[i], NULL);
+		lookups += results[i].lookups;
+		fallbacks += results[i].fallbacks;
+		mixed += results[i].mixed;
+	}
+	
+	USBTestCheckEqual(mixed, 0);
+	USBTestCheck(lookups > fallbacks);
+	USBTestCheckEqual(state.table.generation, 2 + 2 * state.switches);
+	printf("    %llu switches, %llu lookups, %llu (%.2f%%) fell back to the gate, none saw a mix of settings\n",
+		   (unsigned long long)state.switches, (unsigned long long)lookups, (unsigned long long)fallbacks,
+		   lookups ? 100.0 * fallbacks / lookups : 0.0);
+}
+
+
+
+// Lookups per second for 1 to 8 threads, through the table and through a mutex standing in for the gate
+struct BenchmarkState
+{
+	IOUSBInterfacePipeTable		table;
+	pthread_mutex_t				gate;
+	bool						gated;
+	volatile bool				stop;
+	volatile UInt64				lookups;
+};
+
+static void *
+BenchmarkReader(void *arg)
+{
+	BenchmarkState	*state = (BenchmarkState *)arg;
+	IOUSBPipe		*pipe;
+	UInt64			lookups = 0;
+	UInt32			index = 0;
+	UInt32			found = 0;
+	
+	while (!state->stop)
+	{
+		index = (index + 1) % kTestEndpoints;
+		if (state->gated)
+		{
+			// what GetPipeObjGated does
+			pthread_mutex_lock(&state->gate);
+			pipe = state->table.entries[index].pipe;
+			pthread_mutex_unlock(&state->gate);
+		}
+		else if (!IOUSBPipeTableLookup(&state->table, (UInt8)index, &pipe))
+			pipe = NULL;
+		found += (pipe != NULL);
+		lookups++;
+	}
+	__sync_fetch_and_add(&state->lookups, lookups);
+	USBTestCheck(found > 0);
+	return NULL;
+}
+
+static double
+BenchmarkLookups(bool gated, int threads)
+{
+	BenchmarkState		state;
+	pthread_t			readers[8];
+	double				start, elapsed;
+	
+	memset(&state, 0, sizeof(state));
+	pthread_mutex_init(&state.gate, NULL);
+	state.gated = gated;
+	PublishSetting(&state.table, 0);
+	
+	start = NowMS();
+	for (int i = 0; i < threads; i++)
+		pthread_create(&readers[i], NULL, BenchmarkReader, &state);
+	usleep(kTestBenchmarkMS * 1000);
+	state.stop = true;
+	for (int i = 0; i < threads; i++)
+		pthread_join(readers[i], NULL);
+	elapsed = NowMS() - start;
+	pthread_mutex_destroy(&state.gate);
+	return state.lookups / (elapsed / 1000.0);
+}
+
+static void
+BenchmarkContention(void)
+{
+	printf("  GetPipeObj lookups per second on %ld CPUs, table against a mutex standing in for the gate\n", sysconf(_SC_NPROCESSORS_ONLN));
+	for (int threads = 1; threads <= 8; threads *= 2)
+	{
+		double	table = BenchmarkLookups(false, threads);
+		double	gated = BenchmarkLookups(true, threads);
+		
+		printf("    %d threads: %12.0f with the table, %12.0f with the mutex (%.1fx)\n", threads, table, gated, gated ? table / gated : 0.0);
+	}
+}
+
+
+
+int
+main(void)
+{
+	InitPipes();
+	TestMatchesGatedScan();
+	TestReadersAgainstWriter();
+	BenchmarkContention();
+	return USBTestResult("IOUSBPipeTableTests");
+}
@@ -0,0 +1,459 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Runs polled reads against a simulated UIM whose TD free list grows a memory block at a time, with the glue which
+// AppleUSBEHCI puts around IOUSBPolledTDReserve (AllocateQueueTD, DeallocateTD, DeallocateED and UIMReservePolledTDs) and
+// which AppleUSBUHCI puts around its pinned TD chain reservoir: once the endpoint is registered, a thousand polled reads
+// next to the client's own read never grow the free list, even with the free list empty, and unregistering or deleting
+// the endpoint gives every TD back.
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include <IOKit/usb/IOUSBPolledTDReserve.h>
+#include "UHCITDChainReservoir.h"
+
+#include "USBTestSupport.h"
+
+enum
+{
+	kTestTDsPerBlock		= 64,						// TDs in one memory block, as AppleEHCItdMemoryBlock has
+	kTestBytesPerTD			= 4 * 4096,					// (kEHCIPagesPerTD-1) * kEHCIPageSize
+	kTestPolledReads		= 1000
+};
+
+struct TestQH;
+
+struct TestTD
+{
+	TestTD			*next;						// pLogicalNext
+	TestQH			*qh;						// pQH - set by allocateTDs, cleared by AllocateTD
+	bool			inUse;
+};
+
+struct TestTDOps
+{
+	static TestTD *Next(TestTD *td)						{ return td->next; }
+	static void SetNext(TestTD *td, TestTD *next)		{ td->next = next; }
+};
+
+struct TestQH
+{
+	IOUSBPolledTDReserve<TestTD>	polledTDs;
+};
+
+struct TestUIM
+{
+	TestTD							*freeTD;
+	UInt32							freeCount;
+	UInt32							blocks;				// memory blocks allocated
+	std::vector<TestTD *>			blockList;
+};
+
+static void
+Init(TestUIM *uim)
+{
+	uim->freeTD = NULL;
+	uim->freeCount = 0;
+	uim->blocks = 0;
+	uim->blockList.clear();
+}
+
+static void
+Free(TestUIM *uim)
+{
+	for (size_t i = 0; i < uim->blockList.size(); i++)
+		delete [] uim->blockList[i];
+	uim->blockList.clear();
+}
+
+// what AllocateTD does - a new memory block when the free list is empty
+static TestTD *
+AllocateTD(TestUIM *uim)
+{
+	TestTD		*td;
+	
+	if (!uim->freeTD)
+	{
+		TestTD		*block = new TestTD[kTestTDsPerBlock];
+		
+		memset(block, 0, sizeof(TestTD) * kTestTDsPerBlock);
+		uim->blockList.push_back(block);
+		uim->blocks++;
+		for (int i = 0; i < kTestTDsPerBlock; i++)
+		{
+			block[i].next = uim->freeTD;
+			uim->freeTD = &block[i];
+			uim->freeCount++;
+		}
+	}
+	td = uim->freeTD;
+	uim->freeTD = td->next;
+	uim->freeCount--;
+	td->next = NULL;
+	td->qh = NULL;
+	return td;
+}
+
+// what DeallocateTD does - a queue with a polled endpoint keeps the TD while its reserve is short
+static void
+DeallocateTD(TestUIM *uim, TestTD *td)
+{
+	USBTestCheck(!td->inUse);
+	if (td->qh && IOUSBPolledTDReserveGive<TestTDOps>(&td->qh->polledTDs, td))
+		return;
+	td->next = uim->freeTD;
+	uim->freeTD = td;
+	uim->freeCount++;
+}
+
+static void
+DeallocateChain(TestUIM *uim, TestTD *td)
+{
+	TestTD		*next;
+	
+	while (td)
+	{
+		next = td->next;
+		DeallocateTD(uim, td);
+		td = next;
+	}
+}
+
+// what DeallocateED does
+static void
+DeallocateED(TestUIM *uim, TestQH *qh)
+{
+	DeallocateChain(uim, IOUSBPolledTDReserveDrain(&qh->polledTDs));
+}
+
+// what AllocateQueueTD does
+static TestTD *
+AllocateQueueTD(TestUIM *uim, TestQH *qh)
+{
+	TestTD		*td = IOUSBPolledTDReserveTake<TestTDOps>(&qh->polledTDs);
+	
+	if (!td)
+		return AllocateTD(uim);
+	td->qh = NULL;
+	return td;
+}
+
+// what UIMReservePolledTDs does
+static bool
+ReservePolledTDs(TestUIM *uim, TestQH *qh, UInt32 maxBufferSize, bool reserve)
+{
+	TestTD		*td;
+	
+	if (reserve)
+	{
+		IOUSBPolledTDReserveSetTarget(&qh->polledTDs, IOUSBPolledTDReserveTarget(maxBufferSize, kTestBytesPerTD));
+		while (IOUSBPolledTDReserveShort(&qh->polledTDs))
+		{
+			td = AllocateTD(uim);
+			IOUSBPolledTDReserveGive<TestTDOps>(&qh->polledTDs, td);
+		}
+		return true;
+	}
+	DeallocateChain(uim, IOUSBPolledTDReserveDrain(&qh->polledTDs));
+	return true;
+}
+
+// what allocateTDs does for a read of bufferSize - the TDs are marked in use until the read completes
+static std::vector<TestTD *>
+QueueRead(TestUIM *uim, TestQH *qh, UInt32 bufferSize)
+{
+	std::vector<TestTD *>	read;
+	UInt32					needed = bufferSize ? (bufferSize + kTestBytesPerTD - 1) / kTestBytesPerTD : 1;
+	
+	for (UInt32 i = 0; i < needed; i++)
+	{
+		TestTD		*td = AllocateQueueTD(uim, qh);
+		
+		USBTestCheck(!td->inUse);
+		td->inUse = true;
+		td->qh = qh;
+		read.push_back(td);
+	}
+	return read;
+}
+
+// what the done queue does when the read completes
+static void
+CompleteRead(TestUIM *uim, std::vector<TestTD *> &read)
+{
+	for (size_t i = 0; i < read.size(); i++)
+	{
+		read[i]->inUse = false;
+		DeallocateTD(uim, read[i]);
+	}
+	read.clear();
+}
+
+// takes every TD off the free list, as other endpoints would when the debugger stops the machine
+static std::vector<TestTD *>
+EmptyFreeList(TestUIM *uim)
+{
+	std::vector<TestTD *>	held;
+	
+	while (uim->freeTD)
+	{
+		TestTD		*td = AllocateTD(uim);
+		
+		td->inUse = true;
+		held.push_back(td);
+	}
+	return held;
+}
+
+static void
+GiveBack(TestUIM *uim, std::vector<TestTD *> &held)
+{
+	CompleteRead(uim, held);
+}
+
+
+
+static void
+TestPolledReadsDoNotAllocate(UInt32 maxBufferSize)
+{
+	TestUIM					uim;
+	TestQH					keyboard, mouse;
+	std::vector<TestTD *>	clientRead, mouseRead, held;
+	UInt32					blocks, i;
+	
+	printf("  %d polled reads of %d bytes next to the client's read, with the free list empty\n", kTestPolledReads, (int)maxBufferSize);
+	Init(&uim);
+	memset(&keyboard, 0, sizeof(keyboard));
+	memset(&mouse, 0, sizeof(mouse));
+	
+	// the HID driver registers the keyboard while its client read is queued
+	clientRead = QueueRead(&uim, &keyboard, maxBufferSize);
+	USBTestCheck(ReservePolledTDs(&uim, &keyboard, maxBufferSize, true));
+	USBTestCheckEqual(keyboard.polledTDs.count, IOUSBPolledTDReserveTarget(maxBufferSize, kTestBytesPerTD));
+	
+	// the mouse is busy, and everything else has the rest of the free list
+	mouseRead = QueueRead(&uim, &mouse, 64);
+	held = EmptyFreeList(&uim);
+	USBTestCheckEqual(uim.freeCount, 0);
+	blocks = uim.blocks;
+	
+	for (i = 0; i < kTestPolledReads; i++)
+	{
+		std::vector<TestTD *>	polledRead = QueueRead(&uim, &keyboard, maxBufferSize);
+		
+		// now and then the client's read completes and is requeued between polled reads
+		if ((i % 7) == 0)
+		{
+			CompleteRead(&uim, clientRead);
+			clientRead = QueueRead(&uim, &keyboard, maxBufferSize);
+		}
+		CompleteRead(&uim, polledRead);
+	}
+	USBTestCheckEqual(uim.blocks, blocks);
+	USBTestCheckEqual(uim.freeCount, 0);
+	USBTestCheckEqual(keyboard.polledTDs.misses, 0);
+	USBTestCheck(keyboard.polledTDs.hits >= kTestPolledReads);
+	
+	// the mouse's TDs, which have no reserve, still go back to the free list
+	CompleteRead(&uim, mouseRead);
+	USBTestCheckEqual(uim.freeCount, 1);
+	
+	GiveBack(&uim, held);
+	CompleteRead(&uim, clientRead);
+	Free(&uim);
+}
+
+
+
+static void
+TestUnregisteredReadsAllocate(void)
+{
+	TestUIM					uim;
+	TestQH					keyboard;
+	std::vector<TestTD *>	held, polledRead;
+	UInt32					blocks;
+	
+	printf("  without the reservation the same polled read grows the free list\n");
+	Init(&uim);
+	memset(&keyboard, 0, sizeof(keyboard));
+	held = EmptyFreeList(&uim);
+	blocks = uim.blocks;
+	polledRead = QueueRead(&uim, &keyboard, 8);
+	USBTestCheckEqual(uim.blocks, blocks + 1);
+	CompleteRead(&uim, polledRead);
+	GiveBack(&uim, held);
+	Free(&uim);
+}
+
+
+
+static void
+TestReleaseAndDelete(void)
+{
+	TestUIM					uim;
+	TestQH					keyboard;
+	std::vector<TestTD *>	read;
+	UInt32					total;
+	
+	printf("  unregistering and deleting the queue give every TD back\n");
+	Init(&uim);
+	memset(&keyboard, 0, sizeof(keyboard));
+	
+	ReservePolledTDs(&uim, &keyboard, 40000, true);
+	total = uim.blocks * kTestTDsPerBlock;
+	USBTestCheckEqual(keyboard.polledTDs.count, 6);
+	USBTestCheckEqual(uim.freeCount + keyboard.polledTDs.count, total);
+	
+	// a read completing while the reserve is full goes to the free list
+	read = QueueRead(&uim, &keyboard, 8);
+	read.push_back(AllocateTD(&uim));
+	read.back()->inUse = true;
+	read.back()->qh = &keyboard;
+	CompleteRead(&uim, read);
+	USBTestCheckEqual(keyboard.polledTDs.count, 6);
+	USBTestCheckEqual(uim.freeCount + keyboard.polledTDs.count, total);
+	
+	// UnregisterPolledEndpoint
+	ReservePolledTDs(&uim, &keyboard, 40000, false);
+	USBTestCheckEqual(keyboard.polledTDs.count, 0);
+	USBTestCheckEqual(keyboard.polledTDs.target, 0);
+	USBTestCheckEqual(uim.freeCount, total);
+	
+	// after which TDs of the queue go straight back to the free list
+	read = QueueRead(&uim, &keyboard, 8);
+	CompleteRead(&uim, read);
+	USBTestCheckEqual(keyboard.polledTDs.count, 0);
+	USBTestCheckEqual(uim.freeCount, total);
+	
+	// closing the pipe deletes the queue with the reservation standing
+	ReservePolledTDs(&uim, &keyboard, 8, true);
+	USBTestCheckEqual(keyboard.polledTDs.count, 2);
+	DeallocateED(&uim, &keyboard);
+	USBTestCheckEqual(keyboard.polledTDs.count, 0);
+	USBTestCheckEqual(uim.freeCount, total);
+	
+	// and a TD of the deleted queue which completes late is not kept
+	read = QueueRead(&uim, &keyboard, 8);
+	DeallocateED(&uim, &keyboard);
+	CompleteRead(&uim, read);
+	USBTestCheckEqual(uim.freeCount, total);
+	Free(&uim);
+}
+
+
+
+//================================================================================================
+//
+//   UHCI - the endpoint's TD chain reservoir, pinned
+//
+//================================================================================================
+//
+struct TestUHCITD
+{
+	TestUHCITD		*next;
+};
+
+struct TestUHCITDOps
+{
+	static TestUHCITD *Next(TestUHCITD *td)							{ return td->next; }
+	static void Link(TestUHCITD *td, TestUHCITD *next)				{ td->next = next; }
+	static void Terminate(TestUHCITD *td)							{ td->next = NULL; }
+};
+
+static UInt32
+ChainLength(TestUHCITD *td)
+{
+	UInt32		n = 0;
+	
+	for (; td; td = td->next)
+		n++;
+	return n;
+}
+
+static void
+TestUHCIPinnedReservoir(void)
+{
+	UHCITDChainReservoir<TestUHCITD>	reservoir;
+	TestUHCITD							tds[16];
+	TestUHCITD							*read;
+	UInt32								reserved, allocated = 0, i;
+	
+	printf("  a pinned UHCI reservoir survives idle periods and aborts\n");
+	memset(tds, 0, sizeof(tds));
+	UHCITDChainReservoirInit(&reservoir, 1024);
+	
+	// UIMReservePolledTDs - an 8 byte report with 8 byte packets, prefilled one TD at a time from the free list
+	reserved = 2 * UHCITDChainReservoirTDsNeeded(8, 8);
+	UHCITDChainReservoirReserve(&reservoir, reserved, 1024);
+	while (reservoir.count < reserved)
+	{
+		USBTestCheck(UHCITDChainReservoirGiveBack<TestUHCITDOps>(&reservoir, &tds[allocated], &tds[allocated], 1) == NULL);
+		allocated++;
+	}
+	USBTestCheckEqual(reservoir.count, 2);
+	
+	// CheckTDChainReservoirs - no hits for many timeout periods, and no flush
+	for (i = 0; i < 10; i++)
+		USBTestCheck(!UHCITDChainReservoirIdleCheck(&reservoir));
+	
+	// HandleEndpointAbort skips FlushTDChainReservoir while reserved, so a polled read after the abort still hits
+	if (!reservoir.reserved)
+		UHCITDChainReservoirFlush<TestUHCITDOps>(&reservoir);
+	for (i = 0; i < kTestPolledReads; i++)
+	{
+		read = UHCITDChainReservoirTake<TestUHCITDOps>(&reservoir, UHCITDChainReservoirTDsNeeded(8, 8));
+		USBTestCheck(read != NULL);
+		if (!read)
+			break;
+		USBTestCheck(UHCITDChainReservoirGiveBack<TestUHCITDOps>(&reservoir, read, read, 1) == NULL);
+	}
+	USBTestCheckEqual(reservoir.misses, 0);
+	
+	// a reservation bigger than the limit raises it
+	UHCITDChainReservoirReserve(&reservoir, 2048, 1024);
+	USBTestCheckEqual(reservoir.limit, 2048);
+	
+	// the release puts the limit back, and the reservoir is flushed with all its TDs
+	UHCITDChainReservoirReserve(&reservoir, 0, 1024);
+	USBTestCheckEqual(reservoir.limit, 1024);
+	USBTestCheckEqual(ChainLength(UHCITDChainReservoirFlush<TestUHCITDOps>(&reservoir)), allocated);
+	
+	// and, unpinned, an idle reservoir is flushed again
+	USBTestCheck(UHCITDChainReservoirGiveBack<TestUHCITDOps>(&reservoir, &tds[0], &tds[0], 1) == NULL);
+	UHCITDChainReservoirIdleCheck(&reservoir);
+	USBTestCheck(UHCITDChainReservoirIdleCheck(&reservoir));
+}
+
+int
+main(void)
+{
+	TestPolledReadsDoNotAllocate(8);
+	TestPolledReadsDoNotAllocate(40000);
+	TestUnregisteredReadsAllocate();
+	TestReleaseAndDelete();
+	TestUHCIPinnedReservoir();
+	return USBTestResult("IOUSBPolledTDReserveTests");
+}
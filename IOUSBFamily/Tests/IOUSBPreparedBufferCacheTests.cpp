@@ -0,0 +1,532 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Runs the prepared buffer cache of IOUSBInterfaceUserClientV2 against a simulated task address space, with the glue
+// which the user client puts around IOUSBPreparedBufferCache.h (CopyPreparedBuffer, ReturnPreparedBuffer and
+// FlushPreparedBufferCache) and the page by page mapping check of IOUSBPreparedBufferCacheOps. A client streaming through
+// the same buffers wires them once. A buffer which was unmapped and replaced at the same address, even by one page, is
+// prepared again and its old pages are unwired once nothing uses them. The entry count and wired byte budgets hold, and
+// in a long random run every descriptor handed out has exactly the pages the client has mapped at that moment.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <vector>
+
+#include "IOUSBPreparedBufferCache.h"
+
+#include "USBTestSupport.h"
+
+enum
+{
+	kTestPageSize		= 4096,
+	kTestDirectionIn	= 1,
+	kTestDirectionOut	= 2
+};
+
+// a task's VM map and pmap: virtual page to physical page
+struct TestAddressSpace
+{
+	std::map<UInt64, UInt32>	pages;
+	UInt32						nextPhysicalPage;
+};
+
+// the pages a descriptor wired when it was prepared
+class IOMemoryDescriptor
+{
+public:
+	std::vector<UInt32>		physicalPages;
+	int						retainCount;
+	bool					prepared;
+};
+
+static UInt32		gPrepares = 0;
+static UInt32		gCompletes = 0;
+static UInt32		gLiveDescriptors = 0;
+
+static void
+MapRange(TestAddressSpace *space, mach_vm_address_t address, mach_vm_size_t size)
+{
+	for (UInt64 page = address / kTestPageSize; page <= (address + size - 1) / kTestPageSize; page++)
+		space->pages[page] = space->nextPhysicalPage++;
+}
+
+static void
+UnmapRange(TestAddressSpace *space, mach_vm_address_t address, mach_vm_size_t size)
+{
+	for (UInt64 page = address / kTestPageSize; page <= (address + size - 1) / kTestPageSize; page++)
+		space->pages.erase(page);
+}
+
+static bool
+MatchesSpace(const IOMemoryDescriptor *mem, const TestAddressSpace *space, mach_vm_address_t address)
+{
+	std::map<UInt64, UInt32>::const_iterator	it;
+	
+	for (size_t i = 0; i < mem->physicalPages.size(); i++)
+	{
+		it = space->pages.find(address / kTestPageSize + i);
+		if ((it == space->pages.end()) || (it->second != mem->physicalPages[i]))
+			return false;
+	}
+	return true;
+}
+
+// what IOUSBPreparedBufferCacheOps does with getPhysicalSegment and pmap_find_phys
+struct TestCacheOps
+{
+	static bool
+	SameMapping(const IOUSBPreparedBufferCacheEntry *entry, void *context)
+	{
+		return MatchesSpace(entry->mem, (const TestAddressSpace *)context, entry->address);
+	}
+};
+
+// withAddressRange and prepare
+static IOMemoryDescriptor *
+PrepareRange(TestAddressSpace *space, mach_vm_address_t address, mach_vm_size_t size)
+{
+	IOMemoryDescriptor	*mem = new IOMemoryDescriptor;
+	
+	mem->retainCount = 1;
+	mem->prepared = true;
+	for (UInt64 page = address / kTestPageSize; page <= (address + size - 1) / kTestPageSize; page++)
+		mem->physicalPages.push_back(space->pages[page]);
+	gPrepares++;
+	gLiveDescriptors++;
+	return mem;
+}
+
+static void
+Complete(IOMemoryDescriptor *mem)
+{
+	USBTestCheck(mem->prepared);
+	mem->prepared = false;
+	gCompletes++;
+}
+
+static void
+Release(IOMemoryDescriptor *mem)
+{
+	USBTestCheck(mem->retainCount > 0);
+	if (--mem->retainCount == 0)
+	{
+		USBTestCheck(!mem->prepared);
+		gLiveDescriptors--;
+		delete mem;
+	}
+}
+
+// a user client: its task's address space, which the VM map pointer identifies, and its cache
+struct TestClient
+{
+	TestAddressSpace *			space;
+	IOUSBPreparedBufferCache	cache;
+};
+
+static void
+InitClient(TestClient *client, TestAddressSpace *space)
+{
+	client->space = space;
+	memset(&client->cache, 0, sizeof(client->cache));
+	client->cache.lock = IOLockAlloc();
+	queue_init(&client->cache.entries);
+}
+
+// what ReleasePreparedBufferCacheEntries does
+static void
+ReleaseEntries(queue_head_t *released)
+{
+	IOUSBPreparedBufferCacheEntry	*entry;
+	
+	while (!queue_empty(released))
+	{
+		queue_remove_first(released, entry, IOUSBPreparedBufferCacheEntry *, link);
+		Complete(entry->mem);
+		Release(entry->mem);
+		free(entry);
+	}
+}
+
+// what CopyPreparedBuffer does
+static IOMemoryDescriptor *
+CopyPreparedBuffer(TestClient *client, mach_vm_address_t address, mach_vm_size_t size, IOOptionBits direction)
+{
+	IOUSBPreparedBufferCache		*cache = &client->cache;
+	IOUSBPreparedBufferCacheEntry	*entry;
+	IOMemoryDescriptor				*mem;
+	queue_head_t					released;
+	
+	queue_init(&released);
+	
+	IOLockLock(cache->lock);
+	entry = IOUSBPreparedBufferCacheLookupLocked<TestCacheOps>(cache, client->space, address, size, direction, client->space, &released);
+	if (entry)
+	{
+		mem = entry->mem;
+		mem->retainCount++;
+		IOLockUnlock(cache->lock);
+		return mem;
+	}
+	IOLockUnlock(cache->lock);
+	ReleaseEntries(&released);
+	
+	mem = PrepareRange(client->space, address, size);
+	if (size > kUSBPreparedBufferCacheMaxWiredBytes)
+		return mem;
+	
+	entry = (IOUSBPreparedBufferCacheEntry *)calloc(1, sizeof(IOUSBPreparedBufferCacheEntry));
+	entry->map = client->space;
+	entry->address = address;
+	entry->size = size;
+	entry->direction = direction;
+	entry->mem = mem;
+	entry->useCount = 1;
+	
+	IOLockLock(cache->lock);
+	if (IOUSBPreparedBufferCacheInsertLocked(cache, entry, &released))
+	{
+		mem->retainCount++;
+		entry = NULL;
+	}
+	IOLockUnlock(cache->lock);
+	
+	if (entry)
+		free(entry);
+	ReleaseEntries(&released);
+	return mem;
+}
+
+// what ReturnPreparedBuffer does, from ReqComplete
+static void
+ReturnPreparedBuffer(TestClient *client, IOMemoryDescriptor *mem)
+{
+	queue_head_t	released;
+	bool			cached;
+	
+	queue_init(&released);
+	IOLockLock(client->cache.lock);
+	cached = IOUSBPreparedBufferCacheReturnLocked(&client->cache, mem, &released);
+	IOLockUnlock(client->cache.lock);
+	ReleaseEntries(&released);
+	
+	if (!cached)
+		Complete(mem);
+	Release(mem);
+}
+
+// what FlushPreparedBufferCache does, from close
+static void
+FlushPreparedBufferCache(TestClient *client)
+{
+	queue_head_t	released;
+	
+	queue_init(&released);
+	IOLockLock(client->cache.lock);
+	IOUSBPreparedBufferCacheFlushLocked(&client->cache, &released);
+	IOLockUnlock(client->cache.lock);
+	ReleaseEntries(&released);
+}
+
+static UInt64
+SumOfEntries(IOUSBPreparedBufferCache *cache, UInt32 *count)
+{
+	IOUSBPreparedBufferCacheEntry	*entry;
+	UInt64							bytes = 0;
+	
+	*count = 0;
+	queue_iterate(&cache->entries, entry, IOUSBPreparedBufferCacheEntry *, link)
+	{
+		bytes += entry->size;
+		(*count)++;
+	}
+	return bytes;
+}
+
+static void
+ResetCounts(void)
+{
+	gPrepares = gCompletes = 0;
+}
+
+
+
+static void
+TestStreaming(void)
+{
+	TestAddressSpace	space = {std::map<UInt64, UInt32>(), 1};
+	TestClient			client;
+	IOMemoryDescriptor	*mem[4];
+	
+	printf("  a client streaming 1000 times through 4 buffers\n");
+	ResetCounts();
+	InitClient(&client, &space);
+	for (int i = 0; i < 4; i++)
+		MapRange(&space, 0x100000 + i * 0x10000, 16384);
+	
+	for (int round = 0; round < 1000; round++)
+	{
+		// two requests in flight at a time, reads and writes on different buffers
+		for (int i = 0; i < 4; i++)
+			mem[i] = CopyPreparedBuffer(&client, 0x100000 + i * 0x10000, 16384, (i & 1) ? kTestDirectionOut : kTestDirectionIn);
+		for (int i = 0; i < 4; i++)
+		{
+			USBTestCheck(MatchesSpace(mem[i], &space, 0x100000 + i * 0x10000));
+			ReturnPreparedBuffer(&client, mem[i]);
+		}
+	}
+	USBTestCheckEqual(gPrepares, 4);
+	USBTestCheckEqual(gCompletes, 0);
+	USBTestCheckEqual(client.cache.hits, 3996);
+	USBTestCheckEqual(client.cache.misses, 4);
+	USBTestCheckEqual(client.cache.wiredBytes, 4 * 16384);
+	
+	// the same range the other way is another entry
+	mem[0] = CopyPreparedBuffer(&client, 0x100000, 16384, kTestDirectionOut);
+	ReturnPreparedBuffer(&client, mem[0]);
+	USBTestCheckEqual(gPrepares, 5);
+	
+	FlushPreparedBufferCache(&client);
+	USBTestCheckEqual(gCompletes, 5);
+	USBTestCheckEqual(client.cache.entryCount, 0);
+	USBTestCheckEqual(client.cache.wiredBytes, 0);
+	USBTestCheckEqual(gLiveDescriptors, 0);
+}
+
+
+
+static void
+TestRemappedBuffer(void)
+{
+	TestAddressSpace	space = {std::map<UInt64, UInt32>(), 1};
+	TestAddressSpace	execed = {std::map<UInt64, UInt32>(), 1000};
+	TestClient			client;
+	IOMemoryDescriptor	*old, *mem;
+	
+	printf("  buffers unmapped and replaced at the same address, idle and in use\n");
+	ResetCounts();
+	InitClient(&client, &space);
+	MapRange(&space, 0x200000, 3 * kTestPageSize);
+	
+	mem = CopyPreparedBuffer(&client, 0x200000, 3 * kTestPageSize, kTestDirectionIn);
+	ReturnPreparedBuffer(&client, mem);
+	
+	// an idle entry for memory which is gone is a miss, and is unwired
+	UnmapRange(&space, 0x200000, 3 * kTestPageSize);
+	MapRange(&space, 0x200000, 3 * kTestPageSize);
+	mem = CopyPreparedBuffer(&client, 0x200000, 3 * kTestPageSize, kTestDirectionIn);
+	USBTestCheck(MatchesSpace(mem, &space, 0x200000));
+	USBTestCheckEqual(client.cache.stale, 1);
+	USBTestCheckEqual(gPrepares, 2);
+	USBTestCheckEqual(gCompletes, 1);
+	USBTestCheckEqual(client.cache.entryCount, 1);
+	ReturnPreparedBuffer(&client, mem);
+	
+	// replacing only the last page is caught too
+	UnmapRange(&space, 0x200000 + 2 * kTestPageSize, kTestPageSize);
+	MapRange(&space, 0x200000 + 2 * kTestPageSize, kTestPageSize);
+	mem = CopyPreparedBuffer(&client, 0x200000, 3 * kTestPageSize, kTestDirectionIn);
+	USBTestCheck(MatchesSpace(mem, &space, 0x200000));
+	USBTestCheckEqual(client.cache.stale, 2);
+	USBTestCheckEqual(gCompletes, 2);
+	
+	// an entry a request still has is retired, and unwired when the request is done with it
+	old = mem;
+	UnmapRange(&space, 0x200000, 3 * kTestPageSize);
+	MapRange(&space, 0x200000, 3 * kTestPageSize);
+	mem = CopyPreparedBuffer(&client, 0x200000, 3 * kTestPageSize, kTestDirectionIn);
+	USBTestCheck(mem != old);
+	USBTestCheck(MatchesSpace(mem, &space, 0x200000));
+	USBTestCheckEqual(client.cache.stale, 3);
+	USBTestCheckEqual(client.cache.entryCount, 2);
+	USBTestCheckEqual(gCompletes, 2);
+	ReturnPreparedBuffer(&client, old);
+	USBTestCheckEqual(gCompletes, 3);
+	USBTestCheckEqual(client.cache.entryCount, 1);
+	ReturnPreparedBuffer(&client, mem);
+	
+	// the same address in a new VM map is a different buffer, whatever its pages
+	client.space = &execed;
+	MapRange(&execed, 0x200000, 3 * kTestPageSize);
+	mem = CopyPreparedBuffer(&client, 0x200000, 3 * kTestPageSize, kTestDirectionIn);
+	USBTestCheck(MatchesSpace(mem, &execed, 0x200000));
+	USBTestCheckEqual(client.cache.stale, 3);
+	USBTestCheckEqual(client.cache.entryCount, 2);
+	ReturnPreparedBuffer(&client, mem);
+	
+	FlushPreparedBufferCache(&client);
+	USBTestCheckEqual(gCompletes, gPrepares);
+	USBTestCheckEqual(gLiveDescriptors, 0);
+}
+
+
+
+static void
+TestBudgets(void)
+{
+	TestAddressSpace	space = {std::map<UInt64, UInt32>(), 1};
+	TestClient			client;
+	IOMemoryDescriptor	*mem[kUSBPreparedBufferCacheMaxEntries + 1];
+	IOMemoryDescriptor	*big[3];
+	UInt32				count;
+	
+	printf("  the entry count and wired byte budgets, with and without requests in flight\n");
+	ResetCounts();
+	InitClient(&client, &space);
+	MapRange(&space, 0x1000000, 64 * kTestPageSize);
+	MapRange(&space, 0x4000000, 3 * 3 * 1024 * 1024);
+	
+	// one buffer more than fits: the least recently used idle one goes
+	for (int i = 0; i <= kUSBPreparedBufferCacheMaxEntries; i++)
+		ReturnPreparedBuffer(&client, CopyPreparedBuffer(&client, 0x1000000 + i * kTestPageSize, kTestPageSize, kTestDirectionIn));
+	USBTestCheckEqual(client.cache.entryCount, kUSBPreparedBufferCacheMaxEntries);
+	USBTestCheckEqual(client.cache.evictions, 1);
+	USBTestCheckEqual(gCompletes, 1);
+	ReturnPreparedBuffer(&client, CopyPreparedBuffer(&client, 0x1000000 + kTestPageSize, kTestPageSize, kTestDirectionIn));
+	USBTestCheckEqual(client.cache.hits, 1);
+	ReturnPreparedBuffer(&client, CopyPreparedBuffer(&client, 0x1000000, kTestPageSize, kTestDirectionIn));
+	USBTestCheckEqual(client.cache.misses, kUSBPreparedBufferCacheMaxEntries + 2);
+	FlushPreparedBufferCache(&client);
+	
+	// with every entry in use, one more is prepared uncached and unwired when it returns
+	for (int i = 0; i <= kUSBPreparedBufferCacheMaxEntries; i++)
+		mem[i] = CopyPreparedBuffer(&client, 0x1000000 + i * kTestPageSize, kTestPageSize, kTestDirectionOut);
+	USBTestCheckEqual(client.cache.entryCount, kUSBPreparedBufferCacheMaxEntries);
+	USBTestCheckEqual(client.cache.uncached, 1);
+	count = gCompletes;
+	ReturnPreparedBuffer(&client, mem[kUSBPreparedBufferCacheMaxEntries]);
+	USBTestCheckEqual(gCompletes, count + 1);
+	for (int i = 0; i < kUSBPreparedBufferCacheMaxEntries; i++)
+		ReturnPreparedBuffer(&client, mem[i]);
+	USBTestCheckEqual(gCompletes, count + 1);
+	FlushPreparedBufferCache(&client);
+	
+	// three 3MB buffers don't fit in 8MB
+	for (int i = 0; i < 3; i++)
+		big[i] = CopyPreparedBuffer(&client, 0x4000000 + i * 3 * 1024 * 1024, 3 * 1024 * 1024, kTestDirectionIn);
+	USBTestCheckEqual(client.cache.entryCount, 2);
+	USBTestCheckEqual(client.cache.wiredBytes, 6 * 1024 * 1024);
+	for (int i = 0; i < 3; i++)
+		ReturnPreparedBuffer(&client, big[i]);
+	big[2] = CopyPreparedBuffer(&client, 0x4000000 + 2 * 3 * 1024 * 1024, 3 * 1024 * 1024, kTestDirectionIn);
+	USBTestCheckEqual(client.cache.entryCount, 2);
+	USBTestCheck(client.cache.wiredBytes <= kUSBPreparedBufferCacheMaxWiredBytes);
+	USBTestCheckEqual(SumOfEntries(&client.cache, &count), client.cache.wiredBytes);
+	ReturnPreparedBuffer(&client, big[2]);
+	
+	FlushPreparedBufferCache(&client);
+	USBTestCheckEqual(gCompletes, gPrepares);
+	USBTestCheckEqual(gLiveDescriptors, 0);
+}
+
+
+
+// Random requests, completions, remaps and closes on 12 buffers of up to 32 pages, read and written - with the buffers
+// a client streams through fitting the budgets, and enough requests in flight to run out of entries now and then
+static void
+TestRandomModel(void)
+{
+	enum { kBuffers = 12, kSteps = 200000, kMaxInFlight = 40 };
+	TestAddressSpace			space = {std::map<UInt64, UInt32>(), 1};
+	TestClient					client;
+	std::vector<IOMemoryDescriptor *>	inFlight;
+	mach_vm_size_t				sizes[kBuffers];
+	UInt32						count;
+	UInt32						seed = 12345;
+	UInt32						bad = 0;
+	
+	printf("  %d random steps on %d buffers\n", kSteps, kBuffers);
+	ResetCounts();
+	InitClient(&client, &space);
+	for (int i = 0; i < kBuffers; i++)
+	{
+		sizes[i] = (1 + (i * 7) % 32) * kTestPageSize - (i & 3) * 100;
+		MapRange(&space, 0x10000000 + (mach_vm_address_t)i * 0x100000, sizes[i]);
+	}
+	
+	for (int step = 0; step < kSteps; step++)
+	{
+		seed = seed * 1103515245 + 12345;
+		UInt32	r = (seed >> 8) % 100;
+		int		i = (seed >> 16) % kBuffers;
+		mach_vm_address_t	address = 0x10000000 + (mach_vm_address_t)i * 0x100000;
+		
+		if ((r < 55) && (inFlight.size() < kMaxInFlight))
+		{
+			IOMemoryDescriptor	*mem = CopyPreparedBuffer(&client, address, sizes[i], (r & 1) ? kTestDirectionIn : kTestDirectionOut);
+			
+			if (!MatchesSpace(mem, &space, address))
+				bad++;
+			inFlight.push_back(mem);
+		}
+		else if ((r < 93) && !inFlight.empty())
+		{
+			size_t	which = (seed >> 4) % inFlight.size();
+			
+			ReturnPreparedBuffer(&client, inFlight[which]);
+			inFlight.erase(inFlight.begin() + which);
+		}
+		else if (r < 99)
+		{
+			UnmapRange(&space, address, sizes[i]);
+			MapRange(&space, address, sizes[i]);
+		}
+		else
+		{
+			FlushPreparedBufferCache(&client);
+		}
+		
+		if (SumOfEntries(&client.cache, &count) != client.cache.wiredBytes)
+			bad++;
+		if ((count != client.cache.entryCount) || (count > kUSBPreparedBufferCacheMaxEntries + kMaxInFlight))
+			bad++;
+	}
+	USBTestCheckEqual(bad, 0);
+	
+	while (!inFlight.empty())
+	{
+		ReturnPreparedBuffer(&client, inFlight.back());
+		inFlight.pop_back();
+	}
+	FlushPreparedBufferCache(&client);
+	USBTestCheckEqual(gCompletes, gPrepares);
+	USBTestCheckEqual(gLiveDescriptors, 0);
+	USBTestCheck(client.cache.hits > client.cache.misses);
+	printf("    %llu hits, %llu misses (%llu stale), %llu evictions, %llu uncached, %u prepares\n",
+		   (unsigned long long)client.cache.hits, (unsigned long long)client.cache.misses, (unsigned long long)client.cache.stale,
+		   (unsigned long long)client.cache.evictions, (unsigned long long)client.cache.uncached, (unsigned)gPrepares);
+}
+
+
+
+int
+main(void)
+{
+	TestStreaming();
+	TestRemappedBuffer();
+	TestBudgets();
+	TestRandomModel();
+	return USBTestResult("IOUSBPreparedBufferCacheTests");
+}
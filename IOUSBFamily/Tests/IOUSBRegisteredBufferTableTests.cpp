@@ -0,0 +1,477 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Runs the registered buffer table of IOUSBInterfaceUserClientV2 with the glue which the user client puts around
+// IOUSBRegisteredBufferTable.h (RegisterBuffer, UnregisterBuffer, CopyRegisteredBuffer, ReturnRegisteredBuffer,
+// FreeRegisteredBuffer and UnregisterAllBuffers): handles are never reused and a stale one finds nothing, the count and
+// wired byte budgets hold, a buffer unregistered while in use is freed by its last return, the handles a client keeps
+// stay spread over the buckets whichever ones it unregisters, and with clients using buffers on several threads while
+// another registers and unregisters them, every buffer found is the one asked for and every buffer is freed once.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "IOUSBRegisteredBufferTable.h"
+
+#include "USBTestSupport.h"
+
+enum
+{
+	kTestDirectionIn		= 1,
+	kTestDirectionOut		= 2,
+	kTestUsers				= 3,
+	kTestUserLookups		= 200000
+};
+
+static volatile SInt32	gLiveBuffers = 0;
+
+static void
+InitTable(IOUSBRegisteredBufferTable *table)
+{
+	memset(table, 0, sizeof(*table));
+	table->lock = IOLockAlloc();
+}
+
+// the size a test buffer gets, so that a lookup can tell it has the buffer it asked for
+static mach_vm_size_t
+SizeForHandle(uint64_t handle)
+{
+	return (handle % 16 + 1) * 4096;
+}
+
+// what RegisterBuffer does once the buffer is prepared. Returns the handle, 0 if the table is full
+static uint64_t
+RegisterBuffer(IOUSBRegisteredBufferTable *table, mach_vm_size_t size, IOOptionBits direction)
+{
+	IOUSBRegisteredBuffer	*buffer = (IOUSBRegisteredBuffer *)calloc(1, sizeof(IOUSBRegisteredBuffer));
+	uint64_t				handle = 0;
+	
+	buffer->size = size;
+	buffer->direction = direction;
+	IOLockLock(table->lock);
+	if (IOUSBRegisteredBufferTableInsertLocked(table, buffer))
+		handle = buffer->handle;
+	IOLockUnlock(table->lock);
+	
+	if (!handle)
+		free(buffer);
+	else
+		__sync_fetch_and_add(&gLiveBuffers, 1);
+	return handle;
+}
+
+// what FreeRegisteredBuffer does - the memory is scribbled over so that a later use of the buffer trips
+static void
+FreeBuffer(IOUSBRegisteredBufferTable *table, IOUSBRegisteredBuffer *buffer)
+{
+	IOLockLock(table->lock);
+	IOUSBRegisteredBufferTableForgetLocked(table, buffer);
+	IOLockUnlock(table->lock);
+	memset(buffer, 0xA5, sizeof(*buffer));
+	free(buffer);
+	__sync_fetch_and_sub(&gLiveBuffers, 1);
+}
+
+// what UnregisterBuffer does
+static IOReturn
+UnregisterBuffer(IOUSBRegisteredBufferTable *table, uint64_t handle)
+{
+	IOUSBRegisteredBuffer	*buffer;
+	bool					freeIt = false;
+	
+	IOLockLock(table->lock);
+	buffer = IOUSBRegisteredBufferTableRemoveLocked(table, handle);
+	if (buffer)
+		freeIt = (buffer->useCount == 0);
+	IOLockUnlock(table->lock);
+	
+	if (!buffer)
+		return kIOReturnBadArgument;
+	if (freeIt)
+		FreeBuffer(table, buffer);
+	return kIOReturnSuccess;
+}
+
+// what CopyRegisteredBuffer does, without the sub range descriptors
+static IOUSBRegisteredBuffer *
+CopyBuffer(IOUSBRegisteredBufferTable *table, uint64_t handle, mach_vm_size_t offset, mach_vm_size_t length, IOOptionBits direction)
+{
+	IOUSBRegisteredBuffer	*buffer;
+	
+	IOLockLock(table->lock);
+	buffer = IOUSBRegisteredBufferTableFindLocked(table, handle);
+	if (buffer && !IOUSBRegisteredBufferAllows(buffer, offset, length, direction))
+		buffer = NULL;
+	if (buffer)
+		buffer->useCount++;
+	IOLockUnlock(table->lock);
+	return buffer;
+}
+
+// what ReturnRegisteredBuffer does
+static void
+ReturnBuffer(IOUSBRegisteredBufferTable *table, IOUSBRegisteredBuffer *buffer)
+{
+	bool	freeIt;
+	
+	IOLockLock(table->lock);
+	freeIt = IOUSBRegisteredBufferReturnLocked(buffer);
+	IOLockUnlock(table->lock);
+	if (freeIt)
+		FreeBuffer(table, buffer);
+}
+
+// what UnregisterAllBuffers does
+static void
+UnregisterAllBuffers(IOUSBRegisteredBufferTable *table)
+{
+	IOUSBRegisteredBuffer	*buffer;
+	IOUSBRegisteredBuffer	*unused;
+	
+	IOLockLock(table->lock);
+	unused = IOUSBRegisteredBufferTableRemoveAllLocked(table);
+	IOLockUnlock(table->lock);
+	
+	while ((buffer = unused) != NULL)
+	{
+		unused = buffer->next;
+		FreeBuffer(table, buffer);
+	}
+}
+
+static UInt32
+LongestChain(const IOUSBRegisteredBufferTable *table)
+{
+	UInt32		longest = 0;
+	
+	for (int i = 0; i < kUSBRegisteredBufferHashBuckets; i++)
+	{
+		UInt32	length = 0;
+		
+		for (IOUSBRegisteredBuffer *buffer = table->buckets[i]; buffer; buffer = buffer->next)
+			length++;
+		if (length > longest)
+			longest = length;
+	}
+	return longest;
+}
+
+// the longest chain the same handles would make if the bucket were the handle's low bits
+static UInt32
+LowBitsLongestChain(const IOUSBRegisteredBufferTable *table)
+{
+	UInt32		lengths[kUSBRegisteredBufferHashBuckets] = {0};
+	UInt32		longest = 0;
+	
+	for (int i = 0; i < kUSBRegisteredBufferHashBuckets; i++)
+		for (IOUSBRegisteredBuffer *buffer = table->buckets[i]; buffer; buffer = buffer->next)
+		{
+			UInt32	length = ++lengths[buffer->handle & (kUSBRegisteredBufferHashBuckets - 1)];
+			
+			if (length > longest)
+				longest = length;
+		}
+	return longest;
+}
+
+
+
+static void
+TestHandlesAndBudgets(void)
+{
+	IOUSBRegisteredBufferTable	table;
+	std::vector<uint64_t>		handles;
+	IOUSBRegisteredBuffer		*buffer;
+	uint64_t					handle;
+	
+	printf("  registering up to the budgets, and handles which are gone\n");
+	InitTable(&table);
+	
+	for (int i = 0; i < kUSBRegisteredBufferMaxCount; i++)
+	{
+		handle = RegisterBuffer(&table, 4096, kTestDirectionIn);
+		USBTestCheckEqual(handle, i + 1);
+		handles.push_back(handle);
+	}
+	USBTestCheckEqual(RegisterBuffer(&table, 4096, kTestDirectionIn), 0);
+	USBTestCheckEqual(table.count, kUSBRegisteredBufferMaxCount);
+	for (size_t i = 0; i < handles.size(); i++)
+	{
+		buffer = CopyBuffer(&table, handles[i], 0, 0, kTestDirectionIn);
+		USBTestCheck(buffer && (buffer->handle == handles[i]));
+		if (buffer)
+			ReturnBuffer(&table, buffer);
+	}
+	USBTestCheck(CopyBuffer(&table, 0, 0, 0, kTestDirectionIn) == NULL);
+	USBTestCheck(CopyBuffer(&table, kUSBRegisteredBufferMaxCount + 1, 0, 0, kTestDirectionIn) == NULL);
+	
+	// a handle which was unregistered never finds anything again, even in a bucket which fills up again
+	USBTestCheckEqual(UnregisterBuffer(&table, handles[10]), kIOReturnSuccess);
+	USBTestCheckEqual(UnregisterBuffer(&table, handles[10]), kIOReturnBadArgument);
+	for (int i = 0; i < 1000; i++)
+	{
+		handle = RegisterBuffer(&table, 4096, kTestDirectionIn);
+		USBTestCheck(handle > kUSBRegisteredBufferMaxCount);
+		USBTestCheck(CopyBuffer(&table, handles[10], 0, 0, kTestDirectionIn) == NULL);
+		UnregisterBuffer(&table, handle);
+	}
+	UnregisterAllBuffers(&table);
+	USBTestCheckEqual(table.count, 0);
+	USBTestCheckEqual(table.wiredBytes, 0);
+	
+	// 64MB of wired memory at most, however few buffers
+	USBTestCheck(RegisterBuffer(&table, 40 * 1024 * 1024, kTestDirectionOut) != 0);
+	USBTestCheckEqual(RegisterBuffer(&table, 30 * 1024 * 1024, kTestDirectionOut), 0);
+	USBTestCheck(RegisterBuffer(&table, 24 * 1024 * 1024, kTestDirectionOut) != 0);
+	USBTestCheckEqual(table.wiredBytes, kUSBRegisteredBufferMaxWiredBytes);
+	UnregisterAllBuffers(&table);
+	USBTestCheckEqual(gLiveBuffers, 0);
+}
+
+
+
+static void
+TestRangesAndDirections(void)
+{
+	IOUSBRegisteredBufferTable	table;
+	IOUSBRegisteredBuffer		*buffer;
+	uint64_t					in, both;
+	
+	printf("  ranges and directions a request may use\n");
+	InitTable(&table);
+	in = RegisterBuffer(&table, 8192, kTestDirectionIn);
+	both = RegisterBuffer(&table, 8192, kTestDirectionIn | kTestDirectionOut);
+	
+	USBTestCheck(CopyBuffer(&table, in, 0, 0, kTestDirectionOut) == NULL);
+	USBTestCheck((buffer = CopyBuffer(&table, both, 0, 0, kTestDirectionOut)) != NULL);
+	ReturnBuffer(&table, buffer);
+	USBTestCheck((buffer = CopyBuffer(&table, in, 4096, 4096, kTestDirectionIn)) != NULL);
+	ReturnBuffer(&table, buffer);
+	USBTestCheck((buffer = CopyBuffer(&table, in, 8192, 0, kTestDirectionIn)) != NULL);
+	ReturnBuffer(&table, buffer);
+	USBTestCheck(CopyBuffer(&table, in, 4096, 4097, kTestDirectionIn) == NULL);
+	USBTestCheck(CopyBuffer(&table, in, 8193, 0, kTestDirectionIn) == NULL);
+	USBTestCheck(CopyBuffer(&table, in, 8191, ~0ULL, kTestDirectionIn) == NULL);
+	USBTestCheck(CopyBuffer(&table, in, ~0ULL, 2, kTestDirectionIn) == NULL);
+	
+	UnregisterAllBuffers(&table);
+	USBTestCheckEqual(gLiveBuffers, 0);
+}
+
+
+
+static void
+TestUnregisterInUse(void)
+{
+	IOUSBRegisteredBufferTable	table;
+	IOUSBRegisteredBuffer		*first, *second, *third;
+	uint64_t					a, b, c;
+	
+	printf("  unregistering buffers requests are still using\n");
+	InitTable(&table);
+	a = RegisterBuffer(&table, 4096, kTestDirectionIn);
+	b = RegisterBuffer(&table, 4096, kTestDirectionIn);
+	c = RegisterBuffer(&table, 4096, kTestDirectionIn);
+	
+	first = CopyBuffer(&table, a, 0, 0, kTestDirectionIn);
+	second = CopyBuffer(&table, a, 0, 0, kTestDirectionIn);
+	USBTestCheckEqual(UnregisterBuffer(&table, a), kIOReturnSuccess);
+	USBTestCheck(CopyBuffer(&table, a, 0, 0, kTestDirectionIn) == NULL);
+	USBTestCheckEqual(gLiveBuffers, 3);
+	USBTestCheckEqual(table.count, 3);
+	ReturnBuffer(&table, first);
+	USBTestCheckEqual(gLiveBuffers, 3);
+	ReturnBuffer(&table, second);
+	USBTestCheckEqual(gLiveBuffers, 2);
+	USBTestCheckEqual(table.count, 2);
+	
+	// closing frees the idle buffers now and the busy ones when they come back
+	third = CopyBuffer(&table, c, 0, 0, kTestDirectionIn);
+	UnregisterAllBuffers(&table);
+	USBTestCheckEqual(gLiveBuffers, 1);
+	USBTestCheck(CopyBuffer(&table, b, 0, 0, kTestDirectionIn) == NULL);
+	USBTestCheck(CopyBuffer(&table, c, 0, 0, kTestDirectionIn) == NULL);
+	ReturnBuffer(&table, third);
+	USBTestCheckEqual(gLiveBuffers, 0);
+	USBTestCheckEqual(table.count, 0);
+	USBTestCheckEqual(table.wiredBytes, 0);
+}
+
+
+
+// A client keeps every stride'th buffer it registers. With the handle's low bits as the bucket, as the table had it, a
+// stride of 64 put every buffer in one bucket and made each lookup walk all of them
+static void
+TestSpread(void)
+{
+	static const UInt32			kStrides[] = {1, 2, 8, 64, 4096};
+	IOUSBRegisteredBufferTable	table;
+	uint64_t					handle;
+	UInt32						longest, lowBitsLongest;
+	
+	printf("  buckets when a client keeps every 1st, 2nd, 8th, 64th or 4096th buffer it registers\n");
+	for (size_t s = 0; s < sizeof(kStrides) / sizeof(kStrides[0]); s++)
+	{
+		InitTable(&table);
+		while (table.count < kUSBRegisteredBufferMaxCount)
+		{
+			handle = RegisterBuffer(&table, 4096, kTestDirectionIn);
+			if ((handle % kStrides[s]) != 0)
+				UnregisterBuffer(&table, handle);
+		}
+		
+		longest = LongestChain(&table);
+		lowBitsLongest = LowBitsLongestChain(&table);
+		USBTestCheck(longest <= 3 * kUSBRegisteredBufferMaxCount / kUSBRegisteredBufferHashBuckets);
+		printf("    every %u: longest chain %u (%u with the low bits)\n", (unsigned)kStrides[s], (unsigned)longest, (unsigned)lowBitsLongest);
+		UnregisterAllBuffers(&table);
+	}
+	USBTestCheckEqual(gLiveBuffers, 0);
+}
+
+
+
+// Clients use buffers on several threads while another thread registers and unregisters them and closes now and then
+struct StressState
+{
+	IOUSBRegisteredBufferTable	table;
+	volatile bool				stop;
+	volatile UInt32				usersRunning;
+	UInt64						found;
+	UInt64						wrong;
+};
+
+static void *
+StressUser(void *arg)
+{
+	StressState				*state = (StressState *)arg;
+	IOUSBRegisteredBuffer	*buffer;
+	uint64_t				last, handle;
+	UInt32					seed = (UInt32)(uintptr_t)&buffer;
+	UInt64					found = 0, wrong = 0;
+	
+	for (int i = 0; i < kTestUserLookups; i++)
+	{
+		IOLockLock(state->table.lock);
+		last = state->table.lastHandle;
+		IOLockUnlock(state->table.lock);
+		
+		seed = seed * 1103515245 + 12345;
+		handle = (last > 300) ? last - (seed >> 8) % 300 : 1 + (seed >> 8) % 300;
+		buffer = CopyBuffer(&state->table, handle, 0, 0, kTestDirectionIn);
+		if (!buffer)
+			continue;
+		found++;
+		if ((buffer->handle != handle) || (buffer->size != SizeForHandle(handle)))
+			wrong++;
+		if ((i & 7) == 0)
+			sched_yield();
+		if ((buffer->handle != handle) || (buffer->size != SizeForHandle(handle)))
+			wrong++;
+		ReturnBuffer(&state->table, buffer);
+	}
+	__sync_fetch_and_add(&state->found, found);
+	__sync_fetch_and_add(&state->wrong, wrong);
+	__sync_fetch_and_sub(&state->usersRunning, 1);
+	return NULL;
+}
+
+static void *
+StressChurn(void *arg)
+{
+	StressState				*state = (StressState *)arg;
+	std::vector<uint64_t>	handles;
+	uint64_t				next;
+	UInt32					rounds = 0;
+	
+	while (state->usersRunning)
+	{
+		IOLockLock(state->table.lock);
+		next = state->table.lastHandle + 1;
+		IOLockUnlock(state->table.lock);
+		
+		// this thread is the only one registering, so the next handle is known up front
+		if (RegisterBuffer(&state->table, SizeForHandle(next), kTestDirectionIn) == next)
+			handles.push_back(next);
+		if (handles.size() > 200)
+		{
+			UnregisterBuffer(&state->table, handles.front());
+			handles.erase(handles.begin());
+		}
+		if ((++rounds % 5000) == 0)
+		{
+			UnregisterAllBuffers(&state->table);
+			handles.clear();
+		}
+		sched_yield();
+	}
+	UnregisterAllBuffers(&state->table);
+	return NULL;
+}
+
+static void
+TestConcurrentUse(void)
+{
+	StressState		state;
+	pthread_t		users[kTestUsers];
+	pthread_t		churn;
+	
+	printf("  %d threads using buffers while another registers, unregisters and closes\n", kTestUsers);
+	InitTable(&state.table);
+	state.stop = false;
+	state.usersRunning = kTestUsers;
+	state.found = state.wrong = 0;
+	
+	pthread_create(&churn, NULL, StressChurn, &state);
+	for (int i = 0; i < kTestUsers; i++)
+		pthread_create(&users[i], NULL, StressUser, &state);
+	for (int i = 0; i < kTestUsers; i++)
+		pthread_join(users[i], NULL);
+	pthread_join(churn, NULL);
+	
+	USBTestCheck(state.found > 0);
+	USBTestCheckEqual(state.wrong, 0);
+	USBTestCheckEqual(gLiveBuffers, 0);
+	USBTestCheckEqual(state.table.count, 0);
+	USBTestCheckEqual(state.table.wiredBytes, 0);
+	printf("    %llu of %d lookups found a buffer, %llu handles registered\n", (unsigned long long)state.found,
+		   kTestUsers * kTestUserLookups, (unsigned long long)state.table.lastHandle);
+}
+
+
+
+int
+main(void)
+{
+	TestHandlesAndBudgets();
+	TestRangesAndDirections();
+	TestUnregisterInUse();
+	TestSpread();
+	TestConcurrentUse();
+	return USBTestResult("IOUSBRegisteredBufferTableTests");
+}
@@ -0,0 +1,363 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Runs the root hub timer back off against a simulated EHCI port register file on a simulated millisecond clock, with the
+// glue which RootHubStartTimer32, RootHubTimerFired, RootHubPortChangeInterrupt and the hub driver put around it: an idle
+// root hub backs off to kUSBRootHubMaxPollingInterval, a port change interrupt is seen at once and puts the timer back at
+// the polling rate, a lost interrupt is still seen within the longest interval, and a controller without the interrupt
+// polls at the fixed rate.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <IOKit/usb/IOUSBRootHubPolling.h>
+
+#include "USBTestSupport.h"
+
+enum
+{
+	kTestPorts				= 6,
+	kTestRate				= 32,						// the polling rate AppleUSBHub asks for
+	kTestIdleMS				= 60000,
+	
+	// the PORTSC bits that matter here
+	kTestPortConnect		= 0x01,
+	kTestPortConnectChange	= 0x02,
+	kTestPortEnableChange	= 0x08,
+	kTestPortChangeBits		= kTestPortConnectChange | kTestPortEnableChange
+};
+
+struct TestRootHub
+{
+	// the controller
+	UInt32				portsc[kTestPorts];
+	bool				sendsInterrupts;				// the hardware interrupts for port changes
+	
+	// the controller's root hub state
+	IOUSBRootHubPolling	polling;
+	uint32_t			rate;							// _rootHubPollingRate32
+	UInt32				statusChangedBitmap;			// _rootHubStatusChangedBitmap
+	bool				readOutstanding;				// the hub has an interrupt read queued
+	bool				timerArmed;
+	UInt64				deadline;
+	
+	// the simulation
+	UInt64				now;
+	UInt64				lastTimerFire;
+	UInt64				changedAt[kTestPorts];
+	UInt64				maxLatency;
+	UInt32				changesSeen;
+	UInt32				checks;
+};
+
+static void
+Init(TestRootHub *hub, bool sendsInterrupts, bool portChangeInterrupts)
+{
+	memset(hub, 0, sizeof(*hub));
+	hub->sendsInterrupts = sendsInterrupts;
+	hub->polling.portChangeInterrupts = portChangeInterrupts;
+}
+
+// what RootHubStartTimer32 does
+static void
+StartTimer(TestRootHub *hub, uint32_t rate)
+{
+	hub->rate = rate;
+	hub->timerArmed = true;
+	hub->deadline = hub->now + IOUSBRootHubPollingStart(&hub->polling, rate);
+}
+
+// what the hub driver does when its interrupt read completes: clear the change bits of the ports in the bitmap, and read again
+static void
+HubHandleChanges(TestRootHub *hub, UInt32 bitmap)
+{
+	int		port;
+	
+	for (port = 0; port < kTestPorts; port++)
+	{
+		if ( !(bitmap & (1 << (port + 1))) )
+			continue;
+		if ( hub->now - hub->changedAt[port] > hub->maxLatency )
+			hub->maxLatency = hub->now - hub->changedAt[port];
+		hub->changesSeen++;
+		hub->portsc[port] &= ~kTestPortChangeBits;
+	}
+	hub->readOutstanding = true;
+	StartTimer(hub, kTestRate);
+}
+
+// what CheckForRootHubChanges does, with EHCI's UIMRootHubStatusChange and RHCompleteTransaction
+static void
+CheckForRootHubChanges(TestRootHub *hub)
+{
+	int		port;
+	
+	hub->checks++;
+	hub->statusChangedBitmap = 0;
+	for (port = 0; port < kTestPorts; port++)
+		if ( hub->portsc[port] & kTestPortChangeBits )
+			hub->statusChangedBitmap |= (1 << (port + 1));
+	
+	if ( hub->statusChangedBitmap && hub->readOutstanding )
+	{
+		hub->timerArmed = false;								// RootHubStopTimer
+		hub->readOutstanding = false;
+		HubHandleChanges(hub, hub->statusChangedBitmap);
+	}
+}
+
+// what RootHubTimerFired does
+static void
+RootHubTimerFired(TestRootHub *hub, bool fromTimer)
+{
+	if ( fromTimer )
+	{
+		IOUSBRootHubPollingTimerFired(&hub->polling);
+		hub->lastTimerFire = hub->now;
+	}
+	CheckForRootHubChanges(hub);
+	IOUSBRootHubPollingNext(&hub->polling, hub->rate, fromTimer, (hub->statusChangedBitmap != 0));
+	if ( hub->rate )
+	{
+		hub->timerArmed = true;
+		hub->deadline = hub->now + hub->polling.intervalMS;
+	}
+}
+
+// what RootHubPortChangeInterrupt does
+static void
+RootHubPortChangeInterrupt(TestRootHub *hub)
+{
+	if ( !IOUSBRootHubPollingPortChange(&hub->polling, hub->rate) )
+		return;
+	hub->timerArmed = false;
+	RootHubTimerFired(hub, false);
+}
+
+// a device comes or goes: the controller latches the change, and interrupts unless it can't or the interrupt is lost
+static void
+PortChange(TestRootHub *hub, int port, bool interruptLost = false)
+{
+	hub->portsc[port] ^= kTestPortConnect;
+	hub->portsc[port] |= kTestPortConnectChange;
+	hub->changedAt[port] = hub->now;
+	if ( hub->sendsInterrupts && !interruptLost )
+		RootHubPortChangeInterrupt(hub);
+}
+
+static void
+RunUntil(TestRootHub *hub, UInt64 when)
+{
+	while ( hub->timerArmed && (hub->deadline <= when) )
+	{
+		hub->now = hub->deadline;
+		hub->timerArmed = false;
+		RootHubTimerFired(hub, true);
+	}
+	hub->now = when;
+}
+
+static void
+Connect(TestRootHub *hub)
+{
+	hub->readOutstanding = true;
+	StartTimer(hub, kTestRate);
+}
+
+static void
+TestIdleBackOff(void)
+{
+	TestRootHub		hub;
+	uint32_t		expected = kTestRate;
+	UInt64			fire = 0;
+	
+	printf("  an idle root hub backs off, and the counters add up\n");
+	
+	Init(&hub, true, true);
+	Connect(&hub);
+	
+	// 32, 64, ... 1024, and then 1024 for good
+	while ( fire + expected <= kTestIdleMS )
+	{
+		fire += expected;
+		RunUntil(&hub, fire);
+		USBTestCheckEqual(hub.lastTimerFire, fire);
+		expected = (expected * 2 > kUSBRootHubMaxPollingInterval) ? (uint32_t)kUSBRootHubMaxPollingInterval : expected * 2;
+		USBTestCheckEqual(hub.polling.intervalMS, expected);
+	}
+	RunUntil(&hub, kTestIdleMS);
+	
+	// each wakeup stood in for interval / rate wakeups at the fixed rate
+	USBTestCheckEqual(hub.polling.timerWakeups + hub.polling.timerWakeupsAvoided, hub.lastTimerFire / kTestRate);
+	USBTestCheck(hub.polling.timerWakeups <= (kTestIdleMS / kUSBRootHubMaxPollingInterval) + 6);
+	USBTestCheckEqual(hub.polling.portChangeEvents, 0);
+	USBTestCheckEqual(hub.changesSeen, 0);
+	
+	printf("    %u ms idle: %llu timer wakeups, %llu avoided, %u at the fixed rate\n", (unsigned)kTestIdleMS,
+		   (unsigned long long)hub.polling.timerWakeups, (unsigned long long)hub.polling.timerWakeupsAvoided, (unsigned)(kTestIdleMS / kTestRate));
+}
+
+static void
+TestInterruptResets(void)
+{
+	TestRootHub		hub;
+	UInt64			wakeups;
+	
+	printf("  a port change interrupt is seen at once and resets the back off\n");
+	
+	Init(&hub, true, true);
+	Connect(&hub);
+	RunUntil(&hub, 10000);
+	USBTestCheckEqual(hub.polling.intervalMS, kUSBRootHubMaxPollingInterval);
+	
+	wakeups = hub.polling.timerWakeups;
+	PortChange(&hub, 2);
+	USBTestCheckEqual(hub.changesSeen, 1);
+	USBTestCheckEqual(hub.maxLatency, 0);
+	USBTestCheckEqual(hub.polling.portChangeEvents, 1);
+	USBTestCheckEqual(hub.polling.timerWakeups, wakeups);			// the interrupt is not a timer wakeup
+	USBTestCheckEqual(hub.polling.intervalMS, kTestRate);
+	USBTestCheck(hub.timerArmed);
+	USBTestCheckEqual(hub.deadline, hub.now + kTestRate);
+	USBTestCheckEqual(hub.portsc[2], kTestPortConnect);
+	
+	// and it backs off again from the polling rate
+	RunUntil(&hub, hub.now + kTestRate);
+	USBTestCheckEqual(hub.polling.intervalMS, 2 * kTestRate);
+	
+	// several ports at once are one bitmap
+	hub.now += 5;
+	hub.portsc[0] |= kTestPortEnableChange;
+	hub.changedAt[0] = hub.now;
+	PortChange(&hub, 4);
+	USBTestCheckEqual(hub.changesSeen, 3);
+	USBTestCheckEqual(hub.checks, hub.polling.timerWakeups + 2);
+	USBTestCheckEqual(hub.maxLatency, 0);
+}
+
+static void
+TestLostInterrupt(void)
+{
+	TestRootHub		hub;
+	UInt64			when;
+	
+	printf("  a lost interrupt is still seen by the timer\n");
+	
+	Init(&hub, true, true);
+	Connect(&hub);
+	for (when = 3000; when < 30000; when += 2777)
+	{
+		RunUntil(&hub, when);
+		PortChange(&hub, (int)(when % kTestPorts), true);
+		USBTestCheckEqual(hub.portsc[when % kTestPorts] & kTestPortConnectChange, kTestPortConnectChange);
+	}
+	RunUntil(&hub, 31000);
+	USBTestCheckEqual(hub.changesSeen, 10);
+	USBTestCheck(hub.maxLatency <= kUSBRootHubMaxPollingInterval);
+	USBTestCheckEqual(hub.polling.portChangeEvents, 0);
+	
+	printf("    10 changes without their interrupt: seen at most %llu ms late\n", (unsigned long long)hub.maxLatency);
+}
+
+static void
+TestNoInterrupts(void)
+{
+	TestRootHub		hub;
+	
+	printf("  without port change interrupts the timer keeps the polling rate\n");
+	
+	// UHCI
+	Init(&hub, false, false);
+	Connect(&hub);
+	RunUntil(&hub, kTestIdleMS);
+	USBTestCheckEqual(hub.polling.timerWakeups, kTestIdleMS / kTestRate);
+	USBTestCheckEqual(hub.polling.timerWakeupsAvoided, 0);
+	USBTestCheckEqual(hub.polling.intervalMS, kTestRate);
+	PortChange(&hub, 1);
+	USBTestCheckEqual(hub.changesSeen, 0);
+	RunUntil(&hub, kTestIdleMS + kTestRate);
+	USBTestCheckEqual(hub.changesSeen, 1);
+	USBTestCheck(hub.maxLatency <= kTestRate);
+	
+	// EHCI with kErrataMissingPortChangeInt: the interrupts which do come are used, but the timer can't count on them
+	Init(&hub, true, false);
+	Connect(&hub);
+	RunUntil(&hub, 5000);
+	USBTestCheckEqual(hub.polling.intervalMS, kTestRate);
+	PortChange(&hub, 3);
+	USBTestCheckEqual(hub.changesSeen, 1);
+	USBTestCheckEqual(hub.maxLatency, 0);
+	RunUntil(&hub, 10000);
+	USBTestCheckEqual(hub.polling.intervalMS, kTestRate);
+	USBTestCheckEqual(hub.polling.timerWakeupsAvoided, 0);
+}
+
+static void
+TestEdges(void)
+{
+	TestRootHub		hub;
+	
+	printf("  an interrupt before anyone listens, and a polling rate above the limit\n");
+	
+	// the interrupt comes before the hub driver starts the timer: counted, and left for the first poll
+	Init(&hub, true, true);
+	PortChange(&hub, 0);
+	USBTestCheckEqual(hub.polling.portChangeEvents, 1);
+	USBTestCheckEqual(hub.checks, 0);
+	USBTestCheck(!hub.timerArmed);
+	hub.now = 200;
+	Connect(&hub);
+	RunUntil(&hub, 200 + kTestRate);
+	USBTestCheckEqual(hub.changesSeen, 1);
+	USBTestCheckEqual(hub.polling.intervalMS, kTestRate);
+	
+	// a change the timer finds puts it back at the polling rate too
+	RunUntil(&hub, 5000);
+	USBTestCheckEqual(hub.polling.intervalMS, kUSBRootHubMaxPollingInterval);
+	PortChange(&hub, 1, true);
+	while ( (hub.changesSeen < 2) && (hub.now < 5000 + kUSBRootHubMaxPollingInterval) )
+		RunUntil(&hub, hub.deadline);
+	USBTestCheckEqual(hub.changesSeen, 2);
+	USBTestCheckEqual(hub.polling.intervalMS, kTestRate);
+	
+	// a rate above the limit is never shortened
+	Init(&hub, true, true);
+	hub.readOutstanding = true;
+	StartTimer(&hub, 2 * kUSBRootHubMaxPollingInterval);
+	RunUntil(&hub, 20000);
+	USBTestCheckEqual(hub.polling.intervalMS, 2 * kUSBRootHubMaxPollingInterval);
+	USBTestCheckEqual(hub.polling.timerWakeups, 20000 / (2 * kUSBRootHubMaxPollingInterval));
+	USBTestCheckEqual(hub.polling.timerWakeupsAvoided, 0);
+}
+
+int
+main(void)
+{
+	TestIdleBackOff();
+	TestInterruptResets();
+	TestLostInterrupt();
+	TestNoInterrupts();
+	TestEdges();
+	return USBTestResult("IOUSBRootHubPollingTests");
+}
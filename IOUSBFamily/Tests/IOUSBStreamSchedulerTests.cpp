@@ -0,0 +1,662 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Runs the stream scheduler of IOUSBPipeV2 against a mock controller, with the glue which IOUSBPipeV2 puts around
+// IOUSBStreamScheduler.h (CreateStreamScheduler, FreeStreamScheduler, RetainStreamScheduler, QueueStreamRequest,
+// DispatchStreamRequests, StreamRequestComplete and AbortStreamRequests): streams are served in proportion to their
+// weights, no stream has more than its cap with the controller, aborting a stream completes only its waiting requests,
+// and the scheduler is not freed while a request or a caller still needs it, even with clients queueing, the controller
+// completing and the pipe recreating its streams from three threads at once.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vector>
+
+#include <IOKit/IOLocks.h>
+#include <IOKit/usb/IOUSBStreamScheduler.h>
+
+#include "USBTestSupport.h"
+
+enum
+{
+	kTestAllStreams		= 0xFFFFFFFF
+};
+
+struct TestRequest
+{
+	queue_chain_t		link;
+	UInt32				streamID;
+	bool				outstanding;
+	IOByteCount			reqCount;
+	UInt32				tag;
+};
+
+// what the controller has been given, in order, and what the client has got back
+struct TestPipe
+{
+	IOLock *							lock;						// the pipe's stream lock
+	IOUSBStreamScheduler *				scheduler;
+	
+	pthread_mutex_t						mutex;						// guards the rest
+	std::vector<TestRequest *>			withController;				// scheduled requests, oldest first
+	std::vector<UInt32>					started;					// streams of the scheduled requests, as they started
+	UInt32								direct;						// requests which went straight to the controller
+	std::vector<UInt32>					completedTags;
+	std::vector<IOReturn>				completedStatus;
+	bool								failNextStart;
+};
+
+static void
+TestPipeInit(TestPipe *pipe)
+{
+	pipe->lock = IOLockAlloc();
+	pipe->scheduler = NULL;
+	pthread_mutex_init(&pipe->mutex, NULL);
+	pipe->direct = 0;
+	pipe->failNextStart = false;
+}
+
+// what CreateStreamScheduler does
+static IOReturn
+CreateScheduler(TestPipe *pipe, UInt32 streamCount)
+{
+	IOUSBStreamScheduler	*scheduler = (IOUSBStreamScheduler *)calloc(1, sizeof(IOUSBStreamScheduler));
+	IOUSBStreamState		*streams = (IOUSBStreamState *)calloc(streamCount + 1, sizeof(IOUSBStreamState));
+	
+	IOUSBStreamSchedulerInit(scheduler, streams, streamCount);
+	IOLockLock(pipe->lock);
+	pipe->scheduler = scheduler;
+	IOLockUnlock(pipe->lock);
+	return kIOReturnSuccess;
+}
+
+// what FreeStreamScheduler does - the memory is scribbled over before it goes, so that a caller still using it trips
+static IOReturn
+FreeScheduler(TestPipe *pipe)
+{
+	IOUSBStreamScheduler	*scheduler;
+	TestRequest				*request;
+	
+	IOLockLock(pipe->lock);
+	scheduler = pipe->scheduler;
+	if (scheduler)
+	{
+		if (IOUSBStreamSchedulerBusyLocked(scheduler))
+		{
+			IOLockUnlock(pipe->lock);
+			return kIOReturnBusy;
+		}
+		pipe->scheduler = NULL;
+	}
+	IOLockUnlock(pipe->lock);
+	
+	if (!scheduler)
+		return kIOReturnSuccess;
+	
+	while (!queue_empty(&scheduler->freeRequests))
+	{
+		queue_remove_first(&scheduler->freeRequests, request, TestRequest *, link);
+		memset(request, 0xA5, sizeof(TestRequest));
+		free(request);
+	}
+	memset(scheduler->streams, 0xA5, (scheduler->streamCount + 1) * sizeof(IOUSBStreamState));
+	free(scheduler->streams);
+	memset(scheduler, 0xA5, sizeof(IOUSBStreamScheduler));
+	free(scheduler);
+	return kIOReturnSuccess;
+}
+
+// what RetainStreamScheduler and ReleaseStreamScheduler do
+static IOUSBStreamScheduler *
+RetainScheduler(TestPipe *pipe)
+{
+	IOUSBStreamScheduler	*scheduler;
+	
+	IOLockLock(pipe->lock);
+	scheduler = pipe->scheduler;
+	if (scheduler)
+		scheduler->users++;
+	IOLockUnlock(pipe->lock);
+	return scheduler;
+}
+
+static void
+ReleaseScheduler(TestPipe *pipe, IOUSBStreamScheduler *scheduler)
+{
+	IOLockLock(pipe->lock);
+	scheduler->users--;
+	IOLockUnlock(pipe->lock);
+}
+
+// the controller's Read
+static IOReturn
+ControllerStart(TestPipe *pipe, TestRequest *request)
+{
+	IOReturn	err = kIOReturnSuccess;
+	
+	pthread_mutex_lock(&pipe->mutex);
+	if (pipe->failNextStart)
+	{
+		pipe->failNextStart = false;
+		err = kIOReturnNoResources;
+	}
+	else
+	{
+		pipe->withController.push_back(request);
+		pipe->started.push_back(request->streamID);
+	}
+	pthread_mutex_unlock(&pipe->mutex);
+	return err;
+}
+
+// the client's completion
+static void
+ClientComplete(TestPipe *pipe, UInt32 tag, IOReturn status)
+{
+	pthread_mutex_lock(&pipe->mutex);
+	pipe->completedTags.push_back(tag);
+	pipe->completedStatus.push_back(status);
+	pthread_mutex_unlock(&pipe->mutex);
+}
+
+// what FinishStreamRequest does
+static void
+FinishRequest(TestPipe *pipe, IOUSBStreamScheduler *scheduler, TestRequest *request, IOReturn status, UInt32 bufferSizeRemaining, bool callClient)
+{
+	UInt32		tag = request->tag;
+	
+	IOLockLock(pipe->lock);
+	IOUSBStreamSchedulerFinishLocked(scheduler, request, status, bufferSizeRemaining);
+	IOLockUnlock(pipe->lock);
+	
+	if (callClient)
+		ClientComplete(pipe, tag, status);
+}
+
+// what DispatchStreamRequests does
+static void
+DispatchRequests(TestPipe *pipe, IOUSBStreamScheduler *scheduler)
+{
+	TestRequest		*request;
+	
+	for (;;)
+	{
+		IOLockLock(pipe->lock);
+		request = IOUSBStreamSchedulerNextLocked<TestRequest>(scheduler);
+		if (request)
+			IOUSBStreamSchedulerWaitedLocked(scheduler, request->streamID, 1);
+		IOLockUnlock(pipe->lock);
+		
+		if (!request)
+			break;
+		
+		if (ControllerStart(pipe, request) != kIOReturnSuccess)
+			FinishRequest(pipe, scheduler, request, kIOReturnNoResources, (UInt32)request->reqCount, true);
+	}
+}
+
+// what QueueStreamRequest does
+static IOReturn
+QueueRequest(TestPipe *pipe, UInt32 streamID, IOByteCount reqCount, UInt32 tag)
+{
+	IOUSBStreamScheduler	*scheduler;
+	TestRequest				*request = NULL;
+	bool					submit;
+	IOReturn				err;
+	
+	scheduler = RetainScheduler(pipe);
+	if (!scheduler || (streamID > scheduler->streamCount))
+	{
+		if (scheduler)
+			ReleaseScheduler(pipe, scheduler);
+		pthread_mutex_lock(&pipe->mutex);
+		pipe->direct++;
+		pthread_mutex_unlock(&pipe->mutex);
+		ClientComplete(pipe, tag, kIOReturnSuccess);
+		return kIOReturnSuccess;
+	}
+	
+	IOLockLock(pipe->lock);
+	if (!queue_empty(&scheduler->freeRequests))
+		queue_remove_first(&scheduler->freeRequests, request, TestRequest *, link);
+	IOLockUnlock(pipe->lock);
+	
+	if (!request)
+		request = (TestRequest *)malloc(sizeof(TestRequest));
+	memset(request, 0, sizeof(TestRequest));
+	request->streamID = streamID;
+	request->reqCount = reqCount;
+	request->tag = tag;
+	
+	IOLockLock(pipe->lock);
+	submit = IOUSBStreamSchedulerQueueLocked(scheduler, request);
+	IOLockUnlock(pipe->lock);
+	
+	err = kIOReturnSuccess;
+	if (submit)
+	{
+		err = ControllerStart(pipe, request);
+		if (err != kIOReturnSuccess)
+		{
+			FinishRequest(pipe, scheduler, request, err, (UInt32)reqCount, false);
+			DispatchRequests(pipe, scheduler);
+		}
+	}
+	ReleaseScheduler(pipe, scheduler);
+	return err;
+}
+
+// what StreamRequestComplete does, for the oldest request with the controller (or the oldest of a stream)
+static bool
+ControllerComplete(TestPipe *pipe, IOReturn status, UInt32 bufferSizeRemaining, UInt32 streamID = 0)
+{
+	IOUSBStreamScheduler	*scheduler;
+	TestRequest				*request = NULL;
+	size_t					i;
+	
+	pthread_mutex_lock(&pipe->mutex);
+	for (i = 0; i < pipe->withController.size(); i++)
+	{
+		if ((streamID == 0) || (pipe->withController[i]->streamID == streamID))
+		{
+			request = pipe->withController[i];
+			pipe->withController.erase(pipe->withController.begin() + i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pipe->mutex);
+	if (!request)
+		return false;
+	
+	scheduler = RetainScheduler(pipe);
+	USBTestCheck(scheduler != NULL);
+	if (!scheduler)
+		return false;
+	
+	FinishRequest(pipe, scheduler, request, status, bufferSizeRemaining, true);
+	DispatchRequests(pipe, scheduler);
+	ReleaseScheduler(pipe, scheduler);
+	return true;
+}
+
+// what AbortStreamRequests does
+static void
+AbortRequests(TestPipe *pipe, UInt32 streamID)
+{
+	IOUSBStreamScheduler	*scheduler = RetainScheduler(pipe);
+	TestRequest				*request;
+	queue_head_t			aborted;
+	UInt32					first, last;
+	
+	if (!scheduler)
+		return;
+	
+	if (streamID == kTestAllStreams)
+	{
+		first = 1;
+		last = scheduler->streamCount;
+	}
+	else
+	{
+		first = last = streamID;
+	}
+	
+	queue_init(&aborted);
+	IOLockLock(pipe->lock);
+	IOUSBStreamSchedulerAbortLocked<TestRequest>(scheduler, first, last, &aborted);
+	IOLockUnlock(pipe->lock);
+	
+	while (!queue_empty(&aborted))
+	{
+		queue_remove_first(&aborted, request, TestRequest *, link);
+		FinishRequest(pipe, scheduler, request, kIOReturnAborted, (UInt32)request->reqCount, true);
+	}
+	ReleaseScheduler(pipe, scheduler);
+}
+
+
+
+// With one request at a time allowed, streams of weights 1, 2 and 4 take turns of 1, 2 and 4 requests
+static void
+TestWeightedRoundRobin(void)
+{
+	TestPipe	pipe;
+	UInt32		tag = 0;
+	UInt32		i, round;
+	UInt32		counts[4] = {0, 0, 0, 0};
+	static const UInt32	kRound[7] = {1, 2, 2, 3, 3, 3, 3};
+	
+	printf("  streams of weights 1, 2 and 4 with one request at a time\n");
+	TestPipeInit(&pipe);
+	CreateScheduler(&pipe, 3);
+	pipe.scheduler->maxOutstanding = 1;
+	pipe.scheduler->streams[1].stats.weight = 1;
+	pipe.scheduler->streams[2].stats.weight = 2;
+	pipe.scheduler->streams[3].stats.weight = 4;
+	
+	// the first request goes straight to the controller, and holds the others back
+	QueueRequest(&pipe, 3, 512, tag++);
+	USBTestCheckEqual(pipe.withController.size(), 1);
+	for (i = 0; i < 10; i++)
+		QueueRequest(&pipe, 1, 512, tag++);
+	for (i = 0; i < 20; i++)
+		QueueRequest(&pipe, 2, 512, tag++);
+	for (i = 0; i < 40; i++)
+		QueueRequest(&pipe, 3, 512, tag++);
+	USBTestCheckEqual(pipe.withController.size(), 1);
+	USBTestCheckEqual(pipe.scheduler->pending, 70);
+	USBTestCheckEqual(pipe.scheduler->activeCount, 3);
+	
+	while (ControllerComplete(&pipe, kIOReturnSuccess, 0))
+		USBTestCheck(pipe.withController.size() <= 1);
+	
+	USBTestCheckEqual(pipe.started.size(), 71);
+	for (round = 0; round < 10; round++)
+		for (i = 0; i < 7; i++)
+			USBTestCheckEqual(pipe.started[1 + round * 7 + i], kRound[i]);
+	
+	// half way through, every stream had had its share
+	for (i = 1; i < 36; i++)
+		counts[pipe.started[i]]++;
+	USBTestCheckEqual(counts[1], 5);
+	USBTestCheckEqual(counts[2], 10);
+	USBTestCheckEqual(counts[3], 20);
+	
+	USBTestCheckEqual(pipe.completedTags.size(), 71);
+	USBTestCheckEqual(pipe.scheduler->streams[3].stats.completed, 41);
+	USBTestCheckEqual(pipe.scheduler->streams[3].stats.bytes, 41 * 512);
+	USBTestCheckEqual(pipe.scheduler->streams[2].stats.totalQueueTimeUS, 20);
+	USBTestCheckEqual(pipe.scheduler->activeCount, 0);
+	USBTestCheckEqual(FreeScheduler(&pipe), kIOReturnSuccess);
+}
+
+
+
+// A stream never has more than maxOutstandingPerStream requests with the controller, and a stream under its cap is not held
+// back by one at its cap
+static void
+TestPerStreamCap(void)
+{
+	TestPipe	pipe;
+	UInt32		tag = 0;
+	UInt32		i;
+	
+	printf("  six requests on a stream with a cap of two, next to a second stream\n");
+	TestPipeInit(&pipe);
+	CreateScheduler(&pipe, 2);
+	pipe.scheduler->maxOutstandingPerStream = 2;
+	
+	for (i = 0; i < 6; i++)
+		QueueRequest(&pipe, 1, 1024, tag++);
+	USBTestCheckEqual(pipe.withController.size(), 2);
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.outstanding, 2);
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.pending, 4);
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.maxPending, 4);
+	
+	QueueRequest(&pipe, 2, 1024, tag++);
+	USBTestCheckEqual(pipe.withController.size(), 3);
+	USBTestCheckEqual(pipe.started.back(), 2);
+	
+	// a completion on stream 1 lets the next of stream 1 go, and no more
+	ControllerComplete(&pipe, kIOReturnSuccess, 0, 1);
+	USBTestCheckEqual(pipe.withController.size(), 3);
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.outstanding, 2);
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.pending, 3);
+	
+	// a completion on stream 2 frees nothing for stream 1
+	ControllerComplete(&pipe, kIOReturnSuccess, 0, 2);
+	USBTestCheckEqual(pipe.withController.size(), 2);
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.pending, 3);
+	
+	// a short transfer and an error count as they should
+	ControllerComplete(&pipe, kIOReturnSuccess, 24, 1);
+	ControllerComplete(&pipe, kIOReturnOverrun, 1024, 1);
+	while (ControllerComplete(&pipe, kIOReturnSuccess, 0))
+		USBTestCheck(pipe.scheduler->streams[1].stats.outstanding <= 2);
+	
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.maxOutstanding, 2);
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.completed, 6);
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.errors, 1);
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.bytes, 4 * 1024 + 1000);
+	USBTestCheckEqual(pipe.scheduler->outstanding, 0);
+	USBTestCheckEqual(pipe.completedTags.size(), 7);
+	
+	// with the controller refusing, the request comes back to the caller and the next one still goes
+	pipe.failNextStart = true;
+	USBTestCheckEqual(QueueRequest(&pipe, 1, 1024, tag++), kIOReturnNoResources);
+	USBTestCheckEqual(pipe.scheduler->outstanding, 0);
+	USBTestCheckEqual(QueueRequest(&pipe, 1, 1024, tag++), kIOReturnSuccess);
+	USBTestCheckEqual(pipe.scheduler->outstanding, 1);
+	ControllerComplete(&pipe, kIOReturnSuccess, 0);
+	USBTestCheckEqual(FreeScheduler(&pipe), kIOReturnSuccess);
+}
+
+
+
+// Aborting a stream completes its waiting requests with kIOReturnAborted, and leaves what is with the controller and the
+// other streams alone. The scheduler can't go while any of it is outstanding, waiting, or in a caller's hands
+static void
+TestAbortAndLifetime(void)
+{
+	TestPipe				pipe;
+	IOUSBStreamScheduler	*scheduler;
+	UInt32					tag = 0;
+	UInt32					i, stream;
+	UInt32					aborted;
+	
+	printf("  aborting one stream, then all of them, then freeing the scheduler\n");
+	TestPipeInit(&pipe);
+	CreateScheduler(&pipe, 2);
+	pipe.scheduler->maxOutstandingPerStream = 2;
+	
+	// tags 0-4 on stream 1, 5-9 on stream 2, the first two of each with the controller
+	for (stream = 1; stream <= 2; stream++)
+		for (i = 0; i < 5; i++)
+			QueueRequest(&pipe, stream, 64, tag++);
+	USBTestCheckEqual(pipe.withController.size(), 4);
+	USBTestCheckEqual(pipe.scheduler->pending, 6);
+	
+	AbortRequests(&pipe, 1);
+	USBTestCheckEqual(pipe.completedTags.size(), 3);
+	for (i = 0; i < pipe.completedTags.size(); i++)
+	{
+		USBTestCheckEqual(pipe.completedTags[i], 2 + i);
+		USBTestCheckEqual(pipe.completedStatus[i], kIOReturnAborted);
+	}
+	USBTestCheckEqual(pipe.withController.size(), 4);
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.pending, 0);
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.outstanding, 2);
+	USBTestCheckEqual(pipe.scheduler->streams[1].stats.errors, 0);
+	USBTestCheckEqual(pipe.scheduler->streams[2].stats.pending, 3);
+	USBTestCheckEqual(pipe.scheduler->activeCount, 1);
+	
+	// busy while anything is waiting or with the controller
+	USBTestCheckEqual(FreeScheduler(&pipe), kIOReturnBusy);
+	
+	AbortRequests(&pipe, kTestAllStreams);
+	USBTestCheckEqual(pipe.completedTags.size(), 6);
+	for (i = 3; i < 6; i++)
+	{
+		USBTestCheckEqual(pipe.completedTags[i], 4 + i);
+		USBTestCheckEqual(pipe.completedStatus[i], kIOReturnAborted);
+	}
+	USBTestCheckEqual(pipe.scheduler->pending, 0);
+	USBTestCheckEqual(pipe.scheduler->activeCount, 0);
+	USBTestCheckEqual(FreeScheduler(&pipe), kIOReturnBusy);
+	
+	// the outstanding requests complete normally, and start nothing
+	while (ControllerComplete(&pipe, kIOReturnSuccess, 0))
+		;
+	USBTestCheckEqual(pipe.started.size(), 4);
+	USBTestCheckEqual(pipe.completedTags.size(), 10);
+	aborted = 0;
+	for (i = 0; i < pipe.completedStatus.size(); i++)
+		if (pipe.completedStatus[i] == kIOReturnAborted)
+			aborted++;
+	USBTestCheckEqual(aborted, 6);
+	
+	// a caller holding the scheduler keeps it
+	scheduler = RetainScheduler(&pipe);
+	USBTestCheck(scheduler != NULL);
+	USBTestCheckEqual(FreeScheduler(&pipe), kIOReturnBusy);
+	ReleaseScheduler(&pipe, scheduler);
+	USBTestCheckEqual(FreeScheduler(&pipe), kIOReturnSuccess);
+	
+	// and once it is gone, requests go straight to the controller
+	USBTestCheck(RetainScheduler(&pipe) == NULL);
+	QueueRequest(&pipe, 1, 64, tag++);
+	USBTestCheckEqual(pipe.direct, 1);
+	AbortRequests(&pipe, kTestAllStreams);
+	USBTestCheckEqual(pipe.completedTags.size(), 11);
+}
+
+
+
+// Clients queue and the controller completes on their own threads while the pipe keeps freeing and recreating its
+// scheduler. The clients wait for everything to come back after every burst, so that the scheduler goes idle and the
+// free races the next burst. A free which let a caller keep using the scheduler would hand it scribbled memory
+enum
+{
+	kStressClients		= 2,
+	kStressRequests		= 20000,
+	kStressBurst		= 8
+};
+
+struct StressState
+{
+	TestPipe *			pipe;
+	volatile bool		clientsDone;
+	volatile UInt32		queued;
+	UInt32				frees;
+};
+
+static void *
+StressClient(void *arg)
+{
+	StressState		*state = (StressState *)arg;
+	UInt32			i;
+	size_t			completed;
+	
+	for (i = 0; i < kStressRequests; i++)
+	{
+		__sync_fetch_and_add(&state->queued, 1);
+		QueueRequest(state->pipe, 1 + (i % 4), 256, i);
+		if ((i % kStressBurst) != (kStressBurst - 1))
+			continue;
+		do
+		{
+			sched_yield();
+			pthread_mutex_lock(&state->pipe->mutex);
+			completed = state->pipe->completedTags.size();
+			pthread_mutex_unlock(&state->pipe->mutex);
+		} while (completed < state->queued);
+	}
+	return NULL;
+}
+
+static void *
+StressController(void *arg)
+{
+	StressState		*state = (StressState *)arg;
+	
+	// the clients wait for their requests, so nothing is left with the controller once they are done
+	while (!state->clientsDone)
+	{
+		if (!ControllerComplete(state->pipe, kIOReturnSuccess, 0))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void *
+StressRecreate(void *arg)
+{
+	StressState		*state = (StressState *)arg;
+	
+	while (!state->clientsDone)
+	{
+		if (FreeScheduler(state->pipe) == kIOReturnSuccess)
+		{
+			state->frees++;
+			CreateScheduler(state->pipe, 4);
+		}
+		sched_yield();
+	}
+	return NULL;
+}
+
+static void
+TestFreeWhileQueueing(void)
+{
+	TestPipe		pipe;
+	StressState		state;
+	pthread_t		clients[kStressClients];
+	pthread_t		controller, recreate;
+	UInt32			i;
+	
+	printf("  %d clients queueing %d requests each while the scheduler is freed and recreated\n", kStressClients, kStressRequests);
+	TestPipeInit(&pipe);
+	CreateScheduler(&pipe, 4);
+	
+	state.pipe = &pipe;
+	state.clientsDone = false;
+	state.queued = 0;
+	state.frees = 0;
+	
+	pthread_create(&controller, NULL, StressController, &state);
+	pthread_create(&recreate, NULL, StressRecreate, &state);
+	for (i = 0; i < kStressClients; i++)
+		pthread_create(&clients[i], NULL, StressClient, &state);
+	for (i = 0; i < kStressClients; i++)
+		pthread_join(clients[i], NULL);
+	state.clientsDone = true;
+	pthread_join(recreate, NULL);
+	pthread_join(controller, NULL);
+	
+	// every request came back exactly once, and nothing is left behind
+	USBTestCheckEqual(pipe.completedTags.size(), kStressClients * kStressRequests);
+	for (i = 0; i < pipe.completedStatus.size(); i++)
+		USBTestCheckEqual(pipe.completedStatus[i], kIOReturnSuccess);
+	USBTestCheckEqual(pipe.scheduler->outstanding, 0);
+	USBTestCheckEqual(pipe.scheduler->pending, 0);
+	USBTestCheckEqual(pipe.scheduler->users, 0);
+	USBTestCheckEqual(FreeScheduler(&pipe), kIOReturnSuccess);
+	USBTestCheck(state.frees > 0);
+	printf("    the scheduler was recreated %u times, and %u requests went straight to the controller in between\n", (unsigned)state.frees, (unsigned)pipe.direct);
+}
+
+
+
+int
+main(void)
+{
+	TestWeightedRoundRobin();
+	TestPerStreamCap();
+	TestAbortAndLifetime();
+	TestFreeWhileQueueing();
+	return USBTestResult("IOUSBStreamSchedulerTests");
+}
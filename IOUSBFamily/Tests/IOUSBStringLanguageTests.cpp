@@ -0,0 +1,299 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Reads strings from simulated devices the way IOUSBDevice::GetStringDescriptor does, checking which LANGID each request goes out
+// with: only the default language is replaced when the device does not list it, an explicit LANGID always reaches the device, the
+// LANGID table is read at most once, and cached strings cost no bus requests
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <IOKit/usb/IOUSBStringLanguage.h>
+
+#include "USBTestSupport.h"
+
+// a device which has string 1 in some languages, and answers anything else with a STALL
+struct TestStringDevice
+{
+	std::vector<UInt16>				languages;			// its LANGID table, empty if it STALLs string descriptor 0
+	std::map<UInt16, std::string>	strings;			// string 1 by LANGID, in Latin-1
+	UInt32							requests;
+	UInt32							tableRequests;
+	UInt16							lastLang;
+};
+
+static IOReturn
+DeviceReadString(TestStringDevice *device, UInt8 index, UInt16 lang, UInt8 *desc)
+{
+	UInt32		i;
+	
+	device->requests++;
+	device->lastLang = lang;
+	if ( index == 0 )
+	{
+		device->tableRequests++;
+		if ( device->languages.empty() )
+			return kIOUSBPipeStalled;
+		desc[0] = (UInt8)(2 + (2 * device->languages.size()));
+		desc[1] = kUSBStringDesc;
+		for (i = 0; i < device->languages.size(); i++)
+		{
+			desc[2 + (2 * i)] = (UInt8)device->languages[i];
+			desc[3 + (2 * i)] = (UInt8)(device->languages[i] >> 8);
+		}
+		return kIOReturnSuccess;
+	}
+	
+	if ( (index != 1) || !device->strings.count(lang) )
+		return kIOUSBPipeStalled;
+	
+	const std::string	&text = device->strings[lang];
+	
+	desc[0] = (UInt8)(2 + (2 * text.size()));
+	desc[1] = kUSBStringDesc;
+	for (i = 0; i < text.size(); i++)
+	{
+		desc[2 + (2 * i)] = (UInt8)text[i];
+		desc[3 + (2 * i)] = 0;
+	}
+	return kIOReturnSuccess;
+}
+
+// the per device state GetStringDescriptor keeps
+struct TestStringCache
+{
+	TestStringDevice					*device;
+	bool								languagesRead;
+	std::vector<UInt16>					languages;			// bus order
+	std::map<std::string, std::string>	strings;			// UTF-8, by "index-lang"
+	UInt32								hits;
+};
+
+// what NegotiateStringLanguage does
+static UInt16
+NegotiateStringLanguage(TestStringCache *cache, UInt16 lang)
+{
+	UInt8		desc[256];
+	UInt32		i;
+	
+	if ( lang != kUSBDefaultStringLanguage )
+		return lang;
+	
+	if ( !cache->languagesRead )
+	{
+		if ( (DeviceReadString(cache->device, 0, 0, desc) == kIOReturnSuccess) && (desc[0] >= 4) )
+			for (i = 2; i + 1 < desc[0]; i += 2)
+				cache->languages.push_back((UInt16)(desc[i] | (desc[i + 1] << 8)));
+		cache->languagesRead = true;
+	}
+	
+	return IOUSBNegotiateStringLanguage(cache->languages.empty() ? NULL : &cache->languages[0], cache->languages.size(), lang);
+}
+
+// what GetStringDescriptor does, with a Latin-1 only UTF-8 conversion
+static IOReturn
+GetStringDescriptor(TestStringCache *cache, UInt8 index, char *buffer, UInt32 bufferSize, UInt16 lang = kUSBDefaultStringLanguage)
+{
+	char		key[16];
+	UInt8		desc[256];
+	IOReturn	err;
+	UInt32		i;
+	
+	memset(buffer, 0, bufferSize);
+	if ( index != 0 )
+		lang = NegotiateStringLanguage(cache, lang);
+	
+	snprintf(key, sizeof(key), "%02x-%04x", index, lang);
+	if ( cache->strings.count(key) )
+		cache->hits++;
+	else
+	{
+		std::string		utf8;
+		
+		err = DeviceReadString(cache->device, index, lang, desc);
+		if ( err != kIOReturnSuccess )
+			return err;
+		for (i = 2; i + 1 < desc[0]; i += 2)
+		{
+			UInt16	uChar = (UInt16)(desc[i] | (desc[i + 1] << 8));
+			
+			if ( uChar < 0x80 )
+				utf8 += (char)uChar;
+			else
+			{
+				utf8 += (char)(0xC0 | (uChar >> 6));
+				utf8 += (char)(0x80 | (uChar & 0x3F));
+			}
+		}
+		cache->strings[key] = utf8;
+	}
+	
+	const std::string	&utf8 = cache->strings[key];
+	
+	IOUSBCopyUTF8String(buffer, bufferSize, (const UInt8 *)utf8.data(), utf8.size());
+	return kIOReturnSuccess;
+}
+
+static void
+TestDefaultLanguage(void)
+{
+	TestStringDevice	device;
+	TestStringCache		cache;
+	char				buffer[64];
+	int					i;
+	
+	printf("  the default language falls back to the first listed LANGID\n");
+	
+	// a German only device
+	device.languages.push_back(0x0407);
+	device.strings[0x0407] = "Tastatur";
+	device.requests = device.tableRequests = 0;
+	cache.device = &device;
+	cache.languagesRead = false;
+	cache.hits = 0;
+	
+	for (i = 0; i < 10; i++)
+	{
+		USBTestCheckEqual(GetStringDescriptor(&cache, 1, buffer, sizeof(buffer)), kIOReturnSuccess);
+		USBTestCheck(!strcmp(buffer, "Tastatur"));
+	}
+	USBTestCheckEqual(device.tableRequests, 1);
+	USBTestCheckEqual(device.requests, 2);
+	USBTestCheckEqual(device.lastLang, 0x0407);
+	USBTestCheckEqual(cache.hits, 9);
+	
+	// a device which lists 0x409 is asked in 0x409
+	TestStringDevice	english;
+	TestStringCache		englishCache;
+	
+	english.languages.push_back(0x0407);
+	english.languages.push_back(0x0409);
+	english.strings[0x0407] = "Tastatur";
+	english.strings[0x0409] = "Keyboard";
+	english.requests = english.tableRequests = 0;
+	englishCache.device = &english;
+	englishCache.languagesRead = false;
+	englishCache.hits = 0;
+	USBTestCheckEqual(GetStringDescriptor(&englishCache, 1, buffer, sizeof(buffer)), kIOReturnSuccess);
+	USBTestCheck(!strcmp(buffer, "Keyboard"));
+	USBTestCheckEqual(english.lastLang, 0x0409);
+	
+	// and a device with no LANGID table too
+	TestStringDevice	noTable;
+	TestStringCache		noTableCache;
+	
+	noTable.strings[0x0409] = "Mouse";
+	noTable.requests = noTable.tableRequests = 0;
+	noTableCache.device = &noTable;
+	noTableCache.languagesRead = false;
+	noTableCache.hits = 0;
+	for (i = 0; i < 3; i++)
+		USBTestCheckEqual(GetStringDescriptor(&noTableCache, 1, buffer, sizeof(buffer)), kIOReturnSuccess);
+	USBTestCheck(!strcmp(buffer, "Mouse"));
+	USBTestCheckEqual(noTable.tableRequests, 1);
+	USBTestCheckEqual(noTable.lastLang, 0x0409);
+}
+
+static void
+TestExplicitLanguage(void)
+{
+	TestStringDevice	device;
+	TestStringCache		cache;
+	char				buffer[64];
+	
+	printf("  an explicit LANGID reaches the device\n");
+	
+	device.languages.push_back(0x0407);
+	device.languages.push_back(0x0409);
+	device.strings[0x0407] = "Tastatur";
+	device.strings[0x0409] = "Keyboard";
+	device.requests = device.tableRequests = 0;
+	cache.device = &device;
+	cache.languagesRead = false;
+	cache.hits = 0;
+	
+	// listed: read in that language, and the table is never needed
+	USBTestCheckEqual(GetStringDescriptor(&cache, 1, buffer, sizeof(buffer), 0x0407), kIOReturnSuccess);
+	USBTestCheck(!strcmp(buffer, "Tastatur"));
+	USBTestCheckEqual(device.tableRequests, 0);
+	
+	// not listed: the device says no, rather than the caller getting a string in another language
+	USBTestCheckEqual(GetStringDescriptor(&cache, 1, buffer, sizeof(buffer), 0x040c), kIOUSBPipeStalled);
+	USBTestCheckEqual(device.lastLang, 0x040c);
+	USBTestCheckEqual(buffer[0], 0);
+	USBTestCheckEqual(device.tableRequests, 0);
+	
+	// and the failure is not cached as a string
+	USBTestCheckEqual(GetStringDescriptor(&cache, 1, buffer, sizeof(buffer), 0x040c), kIOUSBPipeStalled);
+	USBTestCheckEqual(device.requests, 3);
+	
+	// the two languages are cached apart
+	USBTestCheckEqual(GetStringDescriptor(&cache, 1, buffer, sizeof(buffer)), kIOReturnSuccess);
+	USBTestCheck(!strcmp(buffer, "Keyboard"));
+	USBTestCheckEqual(GetStringDescriptor(&cache, 1, buffer, sizeof(buffer), 0x0407), kIOReturnSuccess);
+	USBTestCheck(!strcmp(buffer, "Tastatur"));
+	USBTestCheckEqual(device.tableRequests, 1);
+	USBTestCheckEqual(device.requests, 5);
+}
+
+static void
+TestTruncation(void)
+{
+	TestStringDevice	device;
+	TestStringCache		cache;
+	char				buffer[64];
+	
+	printf("  a short buffer does not split a character\n");
+	
+	device.languages.push_back(0x040c);
+	device.strings[0x040c] = "Cl\xe9 \xe9l\xe9gante";			// each \xe9 is two UTF-8 bytes
+	device.requests = device.tableRequests = 0;
+	cache.device = &device;
+	cache.languagesRead = false;
+	cache.hits = 0;
+	
+	USBTestCheckEqual(GetStringDescriptor(&cache, 1, buffer, sizeof(buffer)), kIOReturnSuccess);
+	USBTestCheckEqual(strlen(buffer), 15);
+	
+	// "Cl" and the first byte of the \xe9 would fit in 4 with the NUL, but the \xe9 is left out whole
+	USBTestCheckEqual(GetStringDescriptor(&cache, 1, buffer, 4), kIOReturnSuccess);
+	USBTestCheck(!strcmp(buffer, "Cl"));
+	USBTestCheckEqual(GetStringDescriptor(&cache, 1, buffer, 5), kIOReturnSuccess);
+	USBTestCheckEqual(strlen(buffer), 4);
+	USBTestCheckEqual(GetStringDescriptor(&cache, 1, buffer, 7), kIOReturnSuccess);
+	USBTestCheckEqual(strlen(buffer), 5);
+	USBTestCheckEqual(device.requests, 2);
+}
+
+int
+main(void)
+{
+	TestDefaultLanguage();
+	TestExplicitLanguage();
+	TestTruncation();
+	return USBTestResult("IOUSBStringLanguageTests");
+}
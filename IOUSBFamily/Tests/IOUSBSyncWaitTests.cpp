@@ -0,0 +1,321 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Runs synchronous transfers through IOUSBSyncWait against a simulated UIM thread: the waiter never misses its completion,
+// whether that comes before it waits, while it polls or while it sleeps; an interrupted wait still waits for the aborted
+// transfer; and many threads can share the controller's wait lock. Then it times 1-byte synchronous transfers with and
+// without the poll.
+//
+// The times are of pthreads on the host, not of the command gate in the kernel, and on a host with one CPU the UIM thread can
+// not complete a transfer while the waiter polls, so there the poll can only cost time. They are printed, never checked.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <IOKit/usb/IOUSBSyncWait.h>
+#include <IOKit/usb/USB.h>
+
+#include "USBTestSupport.h"
+
+// what RunTransfer puts on its stack
+struct TestSyncTarget
+{
+	volatile UInt32		done;
+	IOReturn			status;
+	UInt32				turnaroundUS;
+	IOReturn			result;				// what the UIM completes it with
+};
+
+// the UIM: completes transfers in order, each after its turnaround, with IOUSBSyncCompletion's signal
+struct TestUIM
+{
+	IOLock							*waitLock;			// the controller's _syncWaitLock
+	pthread_mutex_t					mutex;
+	pthread_cond_t					work;
+	std::deque<TestSyncTarget *>	queue;
+	TestSyncTarget					*current;
+	bool							abortCurrent;
+	bool							stop;
+	pthread_t						thread;
+};
+
+static void *
+UIMThread(void *arg)
+{
+	TestUIM			*uim = (TestUIM *)arg;
+	TestSyncTarget	*target;
+	UInt32			i;
+	
+	pthread_mutex_lock(&uim->mutex);
+	for (;;)
+	{
+		while ( uim->queue.empty() && !uim->stop )
+			pthread_cond_wait(&uim->work, &uim->mutex);
+		if ( uim->queue.empty() )
+			break;
+		target = uim->queue.front();
+		uim->queue.pop_front();
+		uim->current = target;
+		uim->abortCurrent = false;
+		pthread_mutex_unlock(&uim->mutex);
+		
+		// on the bus, until the turnaround is over or the endpoint is aborted
+		for (i = 0; (i < target->turnaroundUS) && !uim->abortCurrent; i++)
+			IODelay(1);
+		
+		pthread_mutex_lock(&uim->mutex);
+		target->status = uim->abortCurrent ? kIOReturnAborted : target->result;
+		uim->current = NULL;
+		pthread_mutex_unlock(&uim->mutex);
+		IOUSBSyncWaitSignal(uim->waitLock, &target->done, target);
+		pthread_mutex_lock(&uim->mutex);
+	}
+	pthread_mutex_unlock(&uim->mutex);
+	return NULL;
+}
+
+static void
+UIMStart(TestUIM *uim)
+{
+	uim->waitLock = IOLockAlloc();
+	pthread_mutex_init(&uim->mutex, NULL);
+	pthread_cond_init(&uim->work, NULL);
+	uim->current = NULL;
+	uim->abortCurrent = false;
+	uim->stop = false;
+	pthread_create(&uim->thread, NULL, UIMThread, uim);
+}
+
+static void
+UIMStop(TestUIM *uim)
+{
+	pthread_mutex_lock(&uim->mutex);
+	uim->stop = true;
+	pthread_cond_signal(&uim->work);
+	pthread_mutex_unlock(&uim->mutex);
+	pthread_join(uim->thread, NULL);
+	IOLockFree(uim->waitLock);
+}
+
+// DoAbortEP: a transfer on the bus stops early, one still queued completes at once
+static void
+UIMAbort(TestUIM *uim, TestSyncTarget *target)
+{
+	std::deque<TestSyncTarget *>::iterator	queued;
+	
+	pthread_mutex_lock(&uim->mutex);
+	if ( uim->current == target )
+		uim->abortCurrent = true;
+	queued = std::find(uim->queue.begin(), uim->queue.end(), target);
+	if ( queued != uim->queue.end() )
+	{
+		uim->queue.erase(queued);
+		target->status = kIOReturnAborted;
+		pthread_mutex_unlock(&uim->mutex);
+		IOUSBSyncWaitSignal(uim->waitLock, &target->done, target);
+		return;
+	}
+	pthread_mutex_unlock(&uim->mutex);
+}
+
+// what RunTransfer and WaitForSyncTransfer do
+static IOReturn
+SyncTransfer(TestUIM *uim, UInt32 turnaroundUS, IOReturn result, UInt32 spinUS)
+{
+	TestSyncTarget	target;
+	
+	target.done = 0;
+	target.status = kIOReturnError;
+	target.turnaroundUS = turnaroundUS;
+	target.result = result;
+	
+	pthread_mutex_lock(&uim->mutex);
+	uim->queue.push_back(&target);
+	pthread_cond_signal(&uim->work);
+	pthread_mutex_unlock(&uim->mutex);
+	
+	if ( IOUSBSyncWait(uim->waitLock, &target.done, &target, spinUS, true) != THREAD_AWAKENED )
+	{
+		UIMAbort(uim, &target);
+		USBTestCheckEqual(IOUSBSyncWait(uim->waitLock, &target.done, &target, 0, false), THREAD_AWAKENED);
+	}
+	
+	USBTestCheckEqual(target.done, 1);
+	return target.status;
+}
+
+static void
+TestWaits(void)
+{
+	TestUIM			uim;
+	IOLock			*lock = IOLockAlloc();
+	volatile UInt32	done = 1;
+	long			sleeps;
+	
+	printf("  a waiter never misses its completion\n");
+	
+	// already complete: no poll and no sleep
+	sleeps = gIOLockSleeps;
+	USBTestCheckEqual(IOUSBSyncWait(lock, &done, (void *)&done, 20, true), THREAD_AWAKENED);
+	USBTestCheckEqual(gIOLockSleeps, sleeps);
+	IOLockFree(lock);
+	
+	UIMStart(&uim);
+	
+	// completes while polling, or after
+	USBTestCheckEqual(SyncTransfer(&uim, 0, kIOReturnSuccess, 1000), kIOReturnSuccess);
+	USBTestCheckEqual(SyncTransfer(&uim, 2000, kIOUSBPipeStalled, 0), kIOUSBPipeStalled);
+	USBTestCheckEqual(SyncTransfer(&uim, 2000, kIOReturnSuccess, 20), kIOReturnSuccess);
+	
+	// interrupted while the transfer is on the bus: the transfer is aborted, and the waiter still waits for it
+	printf("  an interrupted waiter waits for the aborted transfer\n");
+	gIOLockInterruptNextSleep = true;
+	USBTestCheckEqual(SyncTransfer(&uim, 1000000, kIOReturnSuccess, 0), kIOReturnAborted);
+	USBTestCheck(!gIOLockInterruptNextSleep);
+	
+	// an interruption during the uninterruptible wait is not taken
+	{
+		TestSyncTarget	target;
+		
+		target.done = 0;
+		target.turnaroundUS = 5000;
+		target.result = kIOReturnSuccess;
+		pthread_mutex_lock(&uim.mutex);
+		uim.queue.push_back(&target);
+		pthread_cond_signal(&uim.work);
+		pthread_mutex_unlock(&uim.mutex);
+		gIOLockInterruptNextSleep = true;
+		USBTestCheckEqual(IOUSBSyncWait(uim.waitLock, &target.done, &target, 0, false), THREAD_AWAKENED);
+		USBTestCheckEqual(target.status, kIOReturnSuccess);
+		gIOLockInterruptNextSleep = false;
+	}
+	
+	UIMStop(&uim);
+}
+
+// several clients doing synchronous transfers on one controller
+struct TestClient
+{
+	TestUIM		*uim;
+	int			id;
+	int			transfers;
+	int			failures;
+};
+
+static void *
+ClientThread(void *arg)
+{
+	TestClient	*client = (TestClient *)arg;
+	int			i;
+	
+	for (i = 0; i < client->transfers; i++)
+	{
+		IOReturn	result = (IOReturn)((client->id << 16) | i);
+		
+		if ( SyncTransfer(client->uim, i % 8, result, (i & 1) ? 20 : 0) != result )
+			client->failures++;
+	}
+	return NULL;
+}
+
+static void
+TestSharedLock(void)
+{
+	enum { kClients = 4, kTransfers = 2000 };
+	TestUIM			uim;
+	TestClient		clients[kClients];
+	pthread_t		threads[kClients];
+	int				i;
+	
+	printf("  %d threads share the wait lock\n", kClients);
+	
+	UIMStart(&uim);
+	for (i = 0; i < kClients; i++)
+	{
+		clients[i].uim = &uim;
+		clients[i].id = i + 1;
+		clients[i].transfers = kTransfers;
+		clients[i].failures = 0;
+		pthread_create(&threads[i], NULL, ClientThread, &clients[i]);
+	}
+	for (i = 0; i < kClients; i++)
+	{
+		pthread_join(threads[i], NULL);
+		USBTestCheckEqual(clients[i].failures, 0);
+	}
+	UIMStop(&uim);
+}
+
+static UInt64
+NowNS(void)
+{
+	struct timespec		now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((UInt64)now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+// 1-byte synchronous control transfers with a short turnaround, sleeping at once and polling first
+static void
+TestLatency(void)
+{
+	enum { kTransfers = 2000 };
+	static const UInt32		spins[] = { 0, 20 };				// 20 is kUSBDefaultSyncSpinUS
+	TestUIM					uim;
+	std::vector<UInt64>		latencies(kTransfers);
+	UInt32					s;
+	int						i;
+	long					sleeps;
+	
+	printf("  1-byte synchronous transfers, %ld CPUs\n", sysconf(_SC_NPROCESSORS_ONLN));
+	
+	UIMStart(&uim);
+	for (s = 0; s < sizeof(spins) / sizeof(spins[0]); s++)
+	{
+		sleeps = gIOLockSleeps;
+		for (i = 0; i < kTransfers; i++)
+		{
+			UInt64	start = NowNS();
+			
+			USBTestCheckEqual(SyncTransfer(&uim, 2, kIOReturnSuccess, spins[s]), kIOReturnSuccess);
+			latencies[i] = NowNS() - start;
+		}
+		std::sort(latencies.begin(), latencies.end());
+		printf("    poll %2u us: median %llu ns, 99th percentile %llu ns, %ld sleeps\n", (unsigned)spins[s],
+			   (unsigned long long)latencies[kTransfers / 2], (unsigned long long)latencies[(kTransfers * 99) / 100], gIOLockSleeps - sleeps);
+	}
+	UIMStop(&uim);
+}
+
+int
+main(void)
+{
+	TestWaits();
+	TestSharedLock();
+	TestLatency();
+	return USBTestResult("IOUSBSyncWaitTests");
+}
@@ -0,0 +1,235 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+// Golden plans for IOUSBTransferPlanner with the UHCI, OHCI and EHCI constraints, run against synthetic segment lists
+
+#include <IOKit/usb/IOUSBTransferPlanner.h>
+
+#include "USBTestSupport.h"
+
+struct TestSegment
+{
+	UInt64		address;
+	UInt64		length;
+};
+
+// Maps transfer offsets onto a list of physical segments, the way a prepared IODMACommand would
+class TestSegmentSource
+{
+public:
+	TestSegmentSource(const TestSegment *segments, UInt32 count) : _segments(segments), _count(count) {}
+
+	IOReturn	GetSegment(UInt64 offset, UInt64 *address, UInt64 *length)
+	{
+		UInt32		i;
+
+		for (i = 0; i < _count; i++)
+		{
+			if (offset < _segments[i].length)
+			{
+				*address = _segments[i].address + offset;
+				*length = _segments[i].length - offset;
+				return kIOReturnSuccess;
+			}
+			offset -= _segments[i].length;
+		}
+		return kIOReturnOverrun;
+	}
+
+private:
+	const TestSegment	*_segments;
+	UInt32				_count;
+};
+
+struct GoldenEntry
+{
+	UInt32						offset;
+	UInt32						length;
+	UInt32						toggle;
+	UInt32						flags;
+	UInt32						fragmentCount;
+	IOUSBTransferPlanFragment	fragments[kUSBTransferPlanMaxFragments];
+};
+
+#define	LAST		kUSBTransferPlanEntryLast
+#define	BOUNCE		kUSBTransferPlanEntryNeedsBounce
+#define	COUNT(A)	(sizeof(A) / sizeof(A[0]))
+
+static void
+CheckPlan(const char *name, const IOUSBTransferPlanConstraints &constraints, const TestSegment *segments, UInt32 segmentCount,
+		  UInt32 length, UInt32 maxPacket, UInt32 toggle, const GoldenEntry *golden, UInt32 goldenCount, UInt32 nextToggle)
+{
+	TestSegmentSource							source(segments, segmentCount);
+	IOUSBTransferPlanner<TestSegmentSource>		planner(source, constraints, length, maxPacket, toggle);
+	IOUSBTransferPlanEntry						entry;
+	UInt32										count = 0;
+	UInt32										i;
+
+	printf("  %s\n", name);
+	while (!planner.Done() && (count < goldenCount))
+	{
+		USBTestCheckEqual(planner.Next(&entry), kIOReturnSuccess);
+		USBTestCheckEqual(entry.offset, golden[count].offset);
+		USBTestCheckEqual(entry.length, golden[count].length);
+		USBTestCheckEqual(entry.toggle, golden[count].toggle);
+		USBTestCheckEqual(entry.flags, golden[count].flags);
+		USBTestCheckEqual(entry.fragmentCount, golden[count].fragmentCount);
+		for (i = 0; (i < entry.fragmentCount) && (i < golden[count].fragmentCount); i++)
+		{
+			USBTestCheckEqual(entry.fragments[i].address, golden[count].fragments[i].address);
+			USBTestCheckEqual(entry.fragments[i].length, golden[count].fragments[i].length);
+		}
+
+		// rules every controller depends on, whatever the layout
+		if (!(entry.flags & kUSBTransferPlanEntryLast))
+			USBTestCheckEqual(entry.length % maxPacket, 0);
+		USBTestCheck(entry.length <= constraints.maxBytesPerDescriptor);
+		count++;
+	}
+	USBTestCheck(planner.Done());
+	USBTestCheckEqual(count, goldenCount);
+	USBTestCheckEqual(planner.EntriesPlanned(), goldenCount);
+	USBTestCheckEqual(planner.NextToggle(), nextToggle);
+}
+
+static void
+CheckPlanFails(const char *name, const IOUSBTransferPlanConstraints &constraints, const TestSegment *segments, UInt32 segmentCount,
+			   UInt32 length, UInt32 maxPacket, IOReturn expected)
+{
+	TestSegmentSource							source(segments, segmentCount);
+	IOUSBTransferPlanner<TestSegmentSource>		planner(source, constraints, length, maxPacket, 0);
+	IOUSBTransferPlanEntry						entry;
+
+	printf("  %s\n", name);
+	USBTestCheckEqual(planner.Next(&entry), expected);
+}
+
+// one contiguous buffer which starts half way into a page
+static const TestSegment	kContiguous[] = { { 0x10000800, 0x10000 } };
+
+static const GoldenEntry	kContiguousEHCI[] = {
+	{ 0,		18432,	0,	0,		1,	{ { 0x10000800, 18432 } } },
+	{ 18432,	2048,	0,	LAST,	1,	{ { 0x10005000, 2048 } } },
+};
+
+static const GoldenEntry	kContiguousOHCI[] = {
+	{ 0,		6144,	0,	0,		1,	{ { 0x10000800, 6144 } } },
+	{ 6144,		8192,	0,	0,		1,	{ { 0x10002000, 8192 } } },
+	{ 14336,	6144,	0,	LAST,	1,	{ { 0x10004000, 6144 } } },
+};
+
+// the tail of one page, then whole pages, then a segment which starts inside its page
+static const TestSegment	kScattered[] = { { 0x20000F00, 0x100 }, { 0x30000000, 0x1000 }, { 0x40000000, 0x2000 }, { 0x50000200, 0x1000 } };
+
+static const GoldenEntry	kScatteredEHCI[] = {
+	{ 0,		12544,	0,	0,		3,	{ { 0x20000F00, 256 }, { 0x30000000, 4096 }, { 0x40000000, 8192 } } },
+	{ 12544,	4096,	0,	LAST,	1,	{ { 0x50000200, 4096 } } },
+};
+
+static const GoldenEntry	kScatteredOHCI[] = {
+	{ 0,		4352,	0,	0,		2,	{ { 0x20000F00, 256 }, { 0x30000000, 4096 } } },
+	{ 4352,		8192,	0,	0,		1,	{ { 0x40000000, 8192 } } },
+	{ 12544,	4096,	0,	LAST,	1,	{ { 0x50000200, 4096 } } },
+};
+
+// the first packet straddles a page break, and the next page starts on its boundary
+static const TestSegment	kStraddle[] = { { 0x60000FE0, 0x20 }, { 0x70000000, 0x1000 } };
+
+static const GoldenEntry	kStraddleUHCI[] = {
+	{ 0,		64,		1,	BOUNCE,	1,	{ { 0x60000FE0, 32 } } },
+	{ 64,		64,		0,	0,		1,	{ { 0x70000020, 64 } } },
+	{ 128,		64,		1,	0,		1,	{ { 0x70000060, 64 } } },
+	{ 192,		8,		0,	LAST,	1,	{ { 0x700000A0, 8 } } },
+};
+
+static const GoldenEntry	kStraddleOHCIandEHCI[] = {
+	{ 0,		200,	1,	LAST,	2,	{ { 0x60000FE0, 32 }, { 0x70000000, 168 } } },
+};
+
+// as above, but the next page does not start on its boundary, so the first packet can't be described in place by anyone
+static const TestSegment	kBounce[] = { { 0x60000FE0, 0x20 }, { 0x70000010, 0x1000 } };
+
+static const GoldenEntry	kBounceUHCI[] = {
+	{ 0,		64,		0,	BOUNCE,	1,	{ { 0x60000FE0, 32 } } },
+	{ 64,		64,		1,	0,		1,	{ { 0x70000030, 64 } } },
+	{ 128,		64,		0,	0,		1,	{ { 0x70000070, 64 } } },
+	{ 192,		64,		1,	0,		1,	{ { 0x700000B0, 64 } } },
+	{ 256,		44,		0,	LAST,	1,	{ { 0x700000F0, 44 } } },
+};
+
+static const GoldenEntry	kBounceOHCIandEHCI[] = {
+	{ 0,		64,		0,	BOUNCE,	1,	{ { 0x60000FE0, 32 } } },
+	{ 64,		236,	1,	LAST,	1,	{ { 0x70000030, 236 } } },
+};
+
+// a max packet size which does not divide the page size - every TD but the last must still end on a packet boundary
+static const TestSegment	kOddPacket[] = { { 0x10000000, 0x10000 } };
+
+static const GoldenEntry	kOddPacketEHCI[] = {
+	{ 0,		20400,	0,	0,		1,	{ { 0x10000000, 20400 } } },
+	{ 20400,	9600,	0,	LAST,	1,	{ { 0x10004FB0, 9600 } } },
+};
+
+static const GoldenEntry	kZeroLength[] = {
+	{ 0,		0,		0,	LAST,	0,	{ } },
+};
+
+static const TestSegment	kAbove4GB[] = { { 0x100000000ULL, 0x2000 } };
+
+static const GoldenEntry	kAbove4GBEHCI[] = {
+	{ 0,		1024,	0,	LAST,	1,	{ { 0x100000000ULL, 1024 } } },
+};
+
+int
+main(void)
+{
+	CheckPlan("EHCI contiguous", kUSBEHCITransferPlanConstraints, kContiguous, COUNT(kContiguous), 20480, 512, 0, kContiguousEHCI, COUNT(kContiguousEHCI), 0);
+	CheckPlan("OHCI contiguous", kUSBOHCITransferPlanConstraints, kContiguous, COUNT(kContiguous), 20480, 512, 0, kContiguousOHCI, COUNT(kContiguousOHCI), 0);
+
+	CheckPlan("EHCI scattered", kUSBEHCITransferPlanConstraints, kScattered, COUNT(kScattered), 16640, 64, 0, kScatteredEHCI, COUNT(kScatteredEHCI), 0);
+	CheckPlan("OHCI scattered", kUSBOHCITransferPlanConstraints, kScattered, COUNT(kScattered), 16640, 64, 0, kScatteredOHCI, COUNT(kScatteredOHCI), 0);
+
+	CheckPlan("UHCI straddle", kUSBUHCITransferPlanConstraints, kStraddle, COUNT(kStraddle), 200, 64, 1, kStraddleUHCI, COUNT(kStraddleUHCI), 1);
+	CheckPlan("OHCI straddle", kUSBOHCITransferPlanConstraints, kStraddle, COUNT(kStraddle), 200, 64, 1, kStraddleOHCIandEHCI, COUNT(kStraddleOHCIandEHCI), 1);
+	CheckPlan("EHCI straddle", kUSBEHCITransferPlanConstraints, kStraddle, COUNT(kStraddle), 200, 64, 1, kStraddleOHCIandEHCI, COUNT(kStraddleOHCIandEHCI), 1);
+
+	CheckPlan("UHCI bounce", kUSBUHCITransferPlanConstraints, kBounce, COUNT(kBounce), 300, 64, 0, kBounceUHCI, COUNT(kBounceUHCI), 1);
+	CheckPlan("OHCI bounce", kUSBOHCITransferPlanConstraints, kBounce, COUNT(kBounce), 300, 64, 0, kBounceOHCIandEHCI, COUNT(kBounceOHCIandEHCI), 1);
+	CheckPlan("EHCI bounce", kUSBEHCITransferPlanConstraints, kBounce, COUNT(kBounce), 300, 64, 0, kBounceOHCIandEHCI, COUNT(kBounceOHCIandEHCI), 1);
+
+	CheckPlan("EHCI odd max packet", kUSBEHCITransferPlanConstraints, kOddPacket, COUNT(kOddPacket), 30000, 600, 0, kOddPacketEHCI, COUNT(kOddPacketEHCI), 0);
+
+	CheckPlan("UHCI zero length", kUSBUHCITransferPlanConstraints, NULL, 0, 0, 64, 0, kZeroLength, COUNT(kZeroLength), 1);
+	CheckPlan("OHCI zero length", kUSBOHCITransferPlanConstraints, NULL, 0, 0, 64, 0, kZeroLength, COUNT(kZeroLength), 1);
+	CheckPlan("EHCI zero length", kUSBEHCITransferPlanConstraints, NULL, 0, 0, 64, 0, kZeroLength, COUNT(kZeroLength), 1);
+
+	CheckPlanFails("UHCI above 4GB", kUSBUHCITransferPlanConstraints, kAbove4GB, COUNT(kAbove4GB), 1024, 64, kIOReturnInternalError);
+	CheckPlanFails("OHCI above 4GB", kUSBOHCITransferPlanConstraints, kAbove4GB, COUNT(kAbove4GB), 1024, 64, kIOReturnInternalError);
+	CheckPlan("EHCI above 4GB", kUSBEHCITransferPlanConstraints, kAbove4GB, COUNT(kAbove4GB), 1024, 64, 0, kAbove4GBEHCI, COUNT(kAbove4GBEHCI), 0);
+
+	CheckPlanFails("no max packet size", kUSBEHCITransferPlanConstraints, kContiguous, COUNT(kContiguous), 1024, 0, kIOReturnBadArgument);
+
+	return USBTestResult("IOUSBTransferPlannerTests");
+}
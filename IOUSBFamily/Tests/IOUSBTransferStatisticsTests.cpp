@@ -0,0 +1,206 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Checks IOUSBTransferSnapshotDiff, including counters and time stamps which wrapped between the two snapshots
+
+#include <IOKit/usb/IOUSBTransferStatistics.h>
+#pragma pack()								// GCC ignores USB.h's "#pragma options align=reset"
+
+#include <string.h>
+
+#include "USBTestSupport.h"
+
+static const UInt64		kMax64 = 0xFFFFFFFFFFFFFFFFULL;
+
+static void
+FillCounters(IOUSBEndpointTransferCounters *counters, UInt64 base, UInt32 queueDepth, UInt32 maxQueueDepth)
+{
+	counters->transfers = base;
+	counters->bytes = base * 64;
+	counters->errors = base + 1;
+	counters->stalls = base + 2;
+	counters->timeouts = base + 3;
+	counters->shortPackets = base + 4;
+	counters->queueDepth = queueDepth;
+	counters->maxQueueDepth = maxQueueDepth;
+}
+
+static void
+TestIndex(void)
+{
+	printf("  index\n");
+	USBTestCheckEqual(IOUSBTransferStatisticsIndex(0, kUSBOut), 0);
+	USBTestCheckEqual(IOUSBTransferStatisticsIndex(0, kUSBAnyDirn), 0);
+	USBTestCheckEqual(IOUSBTransferStatisticsIndex(1, kUSBIn), 17);
+	USBTestCheckEqual(IOUSBTransferStatisticsIndex(15, kUSBOut), 15);
+	USBTestCheckEqual(IOUSBTransferStatisticsIndex(15, kUSBIn), 31);
+	USBTestCheckEqual(IOUSBTransferStatisticsIndex(0x81, kUSBIn), 17);			// the direction bit of an address is ignored
+}
+
+static void
+TestNoChange(void)
+{
+	IOUSBTransferSnapshot	snapshot, delta;
+	UInt32					i;
+
+	printf("  no change\n");
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.timeStampNS = 5000000000ULL;
+	for (i = 0; i < kUSBTransferStatisticsEndpoints; i++)
+		FillCounters(&snapshot.endpoints[i], 1000 + i, i, i + 1);
+
+	memset(&delta, 0xA5, sizeof(delta));
+	IOUSBTransferSnapshotDiff(&snapshot, &snapshot, &delta);
+	USBTestCheckEqual(delta.timeStampNS, 0);
+	for (i = 0; i < kUSBTransferStatisticsEndpoints; i++)
+	{
+		USBTestCheckEqual(delta.endpoints[i].transfers, 0);
+		USBTestCheckEqual(delta.endpoints[i].bytes, 0);
+		USBTestCheckEqual(delta.endpoints[i].errors, 0);
+		USBTestCheckEqual(delta.endpoints[i].stalls, 0);
+		USBTestCheckEqual(delta.endpoints[i].timeouts, 0);
+		USBTestCheckEqual(delta.endpoints[i].shortPackets, 0);
+		USBTestCheckEqual(delta.endpoints[i].queueDepth, i);
+		USBTestCheckEqual(delta.endpoints[i].maxQueueDepth, i + 1);
+	}
+}
+
+static void
+TestCounting(void)
+{
+	IOUSBTransferSnapshot	then, now, delta;
+	UInt32					i;
+
+	printf("  counting\n");
+	memset(&then, 0, sizeof(then));
+	memset(&now, 0, sizeof(now));
+	then.timeStampNS = 1000000000ULL;
+	now.timeStampNS = 3500000000ULL;
+	for (i = 0; i < kUSBTransferStatisticsEndpoints; i++)
+	{
+		FillCounters(&then.endpoints[i], 10 * i, 3, 7);
+		FillCounters(&now.endpoints[i], 10 * i + i, 1, 9);
+	}
+
+	IOUSBTransferSnapshotDiff(&now, &then, &delta);
+	USBTestCheckEqual(delta.timeStampNS, 2500000000ULL);
+	for (i = 0; i < kUSBTransferStatisticsEndpoints; i++)
+	{
+		USBTestCheckEqual(delta.endpoints[i].transfers, i);
+		USBTestCheckEqual(delta.endpoints[i].bytes, i * 64);
+		USBTestCheckEqual(delta.endpoints[i].errors, i);
+		USBTestCheckEqual(delta.endpoints[i].stalls, i);
+		USBTestCheckEqual(delta.endpoints[i].timeouts, i);
+		USBTestCheckEqual(delta.endpoints[i].shortPackets, i);
+
+		// the gauges are the newer values, even where they went down
+		USBTestCheckEqual(delta.endpoints[i].queueDepth, 1);
+		USBTestCheckEqual(delta.endpoints[i].maxQueueDepth, 9);
+	}
+}
+
+static void
+TestWraparound(void)
+{
+	IOUSBTransferSnapshot	then, now, delta;
+	UInt32					i;
+
+	printf("  wraparound\n");
+	memset(&then, 0, sizeof(then));
+	memset(&now, 0, sizeof(now));
+
+	// the time stamp and every counter wrapped between the snapshots
+	then.timeStampNS = kMax64 - 499;
+	now.timeStampNS = 500;
+	for (i = 0; i < kUSBTransferStatisticsEndpoints; i++)
+	{
+		IOUSBEndpointTransferCounters	*before = &then.endpoints[i];
+		IOUSBEndpointTransferCounters	*after = &now.endpoints[i];
+
+		before->transfers = kMax64 - i;
+		after->transfers = i;
+		before->bytes = kMax64 - 4095;
+		after->bytes = 4096 * i;
+		before->errors = kMax64;
+		after->errors = 0;
+		before->stalls = kMax64;
+		after->stalls = kMax64;
+		before->timeouts = kMax64 - 1;
+		after->timeouts = 1;
+		before->shortPackets = 0x00000000FFFFFFFFULL;
+		after->shortPackets = 0x0000000100000001ULL;				// crossing 32 bits is no wrap for a 64 bit counter
+		before->queueDepth = 0xFFFFFFFF;
+		after->queueDepth = 0;
+		before->maxQueueDepth = 0xFFFFFFFF;
+		after->maxQueueDepth = 0xFFFFFFFF;
+	}
+
+	IOUSBTransferSnapshotDiff(&now, &then, &delta);
+	USBTestCheckEqual(delta.timeStampNS, 1000);
+	for (i = 0; i < kUSBTransferStatisticsEndpoints; i++)
+	{
+		USBTestCheckEqual(delta.endpoints[i].transfers, 2 * i + 1);
+		USBTestCheckEqual(delta.endpoints[i].bytes, 4096 * (i + 1));
+		USBTestCheckEqual(delta.endpoints[i].errors, 1);
+		USBTestCheckEqual(delta.endpoints[i].stalls, 0);
+		USBTestCheckEqual(delta.endpoints[i].timeouts, 3);
+		USBTestCheckEqual(delta.endpoints[i].shortPackets, 2);
+		USBTestCheckEqual(delta.endpoints[i].queueDepth, 0);
+		USBTestCheckEqual(delta.endpoints[i].maxQueueDepth, 0xFFFFFFFF);
+	}
+}
+
+static void
+TestOneEndpoint(void)
+{
+	IOUSBTransferSnapshot	then, now, delta;
+	UInt32					index = IOUSBTransferStatisticsIndex(2, kUSBIn);
+	UInt32					i;
+
+	printf("  one endpoint\n");
+	memset(&then, 0, sizeof(then));
+	memset(&now, 0, sizeof(now));
+	now.timeStampNS = 1;
+	FillCounters(&now.endpoints[index], 5, 2, 4);
+
+	IOUSBTransferSnapshotDiff(&now, &then, &delta);
+	for (i = 0; i < kUSBTransferStatisticsEndpoints; i++)
+	{
+		USBTestCheckEqual(delta.endpoints[i].transfers, (i == index) ? 5 : 0);
+		USBTestCheckEqual(delta.endpoints[i].bytes, (i == index) ? 320 : 0);
+		USBTestCheckEqual(delta.endpoints[i].queueDepth, (i == index) ? 2 : 0);
+	}
+}
+
+int
+main(void)
+{
+	TestIndex();
+	TestNoChange();
+	TestCounting();
+	TestWraparound();
+	TestOneEndpoint();
+
+	return USBTestResult("IOUSBTransferStatisticsTests");
+}
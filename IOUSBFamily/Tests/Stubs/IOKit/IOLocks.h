@@ -0,0 +1,128 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+// Host build stand-in for <IOKit/IOLocks.h>: a simple lock is a pthread mutex, and a mutex lock is a pthread mutex with
+// one condition variable for all of its events. A test can make the next interruptible sleep on any lock return
+// THREAD_INTERRUPTED with gIOLockInterruptNextSleep, and count sleeps with gIOLockSleeps.
+
+#ifndef __IOKIT_IOLOCKS_H
+#define __IOKIT_IOLOCKS_H
+
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef pthread_mutex_t		IOSimpleLock;
+
+static inline IOSimpleLock *
+IOSimpleLockAlloc(void)
+{
+	IOSimpleLock	*lock = (IOSimpleLock *)malloc(sizeof(IOSimpleLock));
+	
+	if (lock)
+		pthread_mutex_init(lock, NULL);
+	return lock;
+}
+
+static inline void
+IOSimpleLockFree(IOSimpleLock *lock)
+{
+	pthread_mutex_destroy(lock);
+	free(lock);
+}
+
+static inline void	IOSimpleLockLock(IOSimpleLock *lock)		{ pthread_mutex_lock(lock); }
+static inline void	IOSimpleLockUnlock(IOSimpleLock *lock)		{ pthread_mutex_unlock(lock); }
+
+enum
+{
+	THREAD_AWAKENED		= 0,
+	THREAD_TIMED_OUT	= 1,
+	THREAD_INTERRUPTED	= 2
+};
+
+enum
+{
+	THREAD_UNINT		= 0,
+	THREAD_INTERRUPTIBLE	= 1,
+	THREAD_ABORTSAFE	= 2
+};
+
+struct IOLock
+{
+	pthread_mutex_t		mutex;
+	pthread_cond_t		events;
+};
+
+static volatile bool	gIOLockInterruptNextSleep = false;
+static volatile long	gIOLockSleeps = 0;
+
+static inline IOLock *
+IOLockAlloc(void)
+{
+	IOLock	*lock = (IOLock *)malloc(sizeof(IOLock));
+	
+	if (lock)
+	{
+		pthread_mutex_init(&lock->mutex, NULL);
+		pthread_cond_init(&lock->events, NULL);
+	}
+	return lock;
+}
+
+static inline void
+IOLockFree(IOLock *lock)
+{
+	pthread_cond_destroy(&lock->events);
+	pthread_mutex_destroy(&lock->mutex);
+	free(lock);
+}
+
+static inline void	IOLockLock(IOLock *lock)		{ pthread_mutex_lock(&lock->mutex); }
+static inline void	IOLockUnlock(IOLock *lock)		{ pthread_mutex_unlock(&lock->mutex); }
+
+// every sleeper wakes up on every event, which the callers' loops allow for
+static inline int
+IOLockSleep(IOLock *lock, void *event, int interType)
+{
+	(void)event;
+	if ((interType != THREAD_UNINT) && gIOLockInterruptNextSleep)
+	{
+		gIOLockInterruptNextSleep = false;
+		return THREAD_INTERRUPTED;
+	}
+	__sync_fetch_and_add(&gIOLockSleeps, 1);
+	pthread_cond_wait(&lock->events, &lock->mutex);
+	return THREAD_AWAKENED;
+}
+
+static inline void
+IOLockWakeup(IOLock *lock, void *event, bool oneThread)
+{
+	(void)event;
+	(void)oneThread;
+	pthread_cond_broadcast(&lock->events);
+}
+
+#endif /* __IOKIT_IOLOCKS_H */
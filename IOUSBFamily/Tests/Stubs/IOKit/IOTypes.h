@@ -0,0 +1,79 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+// Host build stand-in for <IOKit/IOTypes.h>, with just what the shared USB headers use
+
+#ifndef __IOKIT_IOTYPES_H
+#define __IOKIT_IOTYPES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t				UInt8;
+typedef uint16_t			UInt16;
+typedef uint32_t			UInt32;
+typedef uint64_t			UInt64;
+typedef int8_t				SInt8;
+typedef int16_t				SInt16;
+typedef int32_t				SInt32;
+typedef int64_t				SInt64;
+typedef unsigned char		Boolean;
+
+typedef int					IOReturn;
+typedef UInt32				IOOptionBits;
+typedef UInt64				IOByteCount;
+typedef UInt32				IOPhysicalAddress;
+typedef UInt64				mach_vm_address_t;
+typedef UInt64				mach_vm_size_t;
+
+struct UnsignedWide
+{
+	UInt32		lo;
+	UInt32		hi;
+};
+typedef struct UnsignedWide	AbsoluteTime;
+
+#define	iokit_common_err(return)	((IOReturn)(0xe0000000 | (return)))
+
+// for USB.h's iokit_usb_err
+#define err_system(x)				(((x) & 0x3f) << 26)
+#define err_sub(x)					(((x) & 0xfff) << 14)
+#define sys_iokit					err_system(0x38)
+#define sub_iokit_usb				err_sub(1)
+
+#define kIOReturnSuccess			0
+#define kIOReturnError				iokit_common_err(0x2bc)
+#define kIOReturnNoMemory			iokit_common_err(0x2bd)
+#define kIOReturnNoResources		iokit_common_err(0x2be)
+#define kIOReturnBadArgument		iokit_common_err(0x2c2)
+#define kIOReturnUnsupported		iokit_common_err(0x2c7)
+#define kIOReturnInternalError		iokit_common_err(0x2c9)
+#define kIOReturnBusy				iokit_common_err(0x2d5)
+#define kIOReturnNotReady			iokit_common_err(0x2d8)
+#define kIOReturnNotPermitted		iokit_common_err(0x2e2)
+#define kIOReturnOverrun			iokit_common_err(0x2e8)
+#define kIOReturnAborted			iokit_common_err(0x2eb)
+
+#endif /* __IOKIT_IOTYPES_H */
@@ -0,0 +1,110 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+// Host build stand-in for <kern/queue.h>: the doubly linked element queues (chain embedded in the element) which the
+// kernel code in the policy headers uses, with the same macro names and semantics
+
+#ifndef _KERN_QUEUE_H_
+#define _KERN_QUEUE_H_
+
+struct queue_entry
+{
+	struct queue_entry	*next;
+	struct queue_entry	*prev;
+};
+
+typedef struct queue_entry	*queue_t;
+typedef	struct queue_entry	queue_head_t;
+typedef	struct queue_entry	queue_chain_t;
+typedef	struct queue_entry	*queue_entry_t;
+
+#define queue_init(q)				((q)->next = (q)->prev = (q))
+#define queue_first(q)				((q)->next)
+#define queue_next(qc)				((qc)->next)
+#define queue_last(q)				((q)->prev)
+#define queue_prev(qc)				((qc)->prev)
+#define queue_end(q, qe)			((q) == (qe))
+#define queue_empty(q)				queue_end((q), queue_first(q))
+
+#define queue_enter(head, elt, type, field)										\
+do {																			\
+	queue_entry_t __prev = (head)->prev;										\
+	if ((head) == __prev)														\
+		(head)->next = (queue_entry_t)(elt);									\
+	else																		\
+		((type)(void *)__prev)->field.next = (queue_entry_t)(elt);				\
+	(elt)->field.prev = __prev;													\
+	(elt)->field.next = (head);													\
+	(head)->prev = (queue_entry_t)(elt);										\
+} while (0)
+
+#define queue_enter_first(head, elt, type, field)								\
+do {																			\
+	queue_entry_t __next = (head)->next;										\
+	if ((head) == __next)														\
+		(head)->prev = (queue_entry_t)(elt);									\
+	else																		\
+		((type)(void *)__next)->field.prev = (queue_entry_t)(elt);				\
+	(elt)->field.next = __next;													\
+	(elt)->field.prev = (head);													\
+	(head)->next = (queue_entry_t)(elt);										\
+} while (0)
+
+#define queue_remove(head, elt, type, field)									\
+do {																			\
+	queue_entry_t __next = (elt)->field.next;									\
+	queue_entry_t __prev = (elt)->field.prev;									\
+	if ((head) == __next)														\
+		(head)->prev = __prev;													\
+	else																		\
+		((type)(void *)__next)->field.prev = __prev;							\
+	if ((head) == __prev)														\
+		(head)->next = __next;													\
+	else																		\
+		((type)(void *)__prev)->field.next = __next;							\
+	(elt)->field.next = NULL;													\
+	(elt)->field.prev = NULL;													\
+} while (0)
+
+#define queue_remove_first(head, entry, type, field)							\
+do {																			\
+	queue_entry_t __next;														\
+	(entry) = (type)(void *)((head)->next);										\
+	__next = (entry)->field.next;												\
+	if ((head) == __next)														\
+		(head)->prev = (head);													\
+	else																		\
+		((type)(void *)(__next))->field.prev = (head);							\
+	(head)->next = __next;														\
+	(entry)->field.next = NULL;													\
+	(entry)->field.prev = NULL;													\
+} while (0)
+
+#define queue_iterate(head, elt, type, field)									\
+	for ((elt) = (type)(void *)queue_first(head);								\
+		 !queue_end((head), (queue_entry_t)(elt));								\
+		 (elt) = (type)(void *)queue_next(&(elt)->field))
+
+#endif /* _KERN_QUEUE_H_ */
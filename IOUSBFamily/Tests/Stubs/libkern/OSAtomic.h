@@ -0,0 +1,51 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+// Host build stand-in for <libkern/OSAtomic.h>, on the compiler's atomic builtins
+
+#ifndef _OS_OSATOMIC_H
+#define _OS_OSATOMIC_H
+
+#include <IOKit/IOTypes.h>
+
+static inline bool
+OSCompareAndSwapPtr(void *oldValue, void *newValue, void * volatile *address)
+{
+	return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+static inline bool
+OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32 *address)
+{
+	return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+static inline void	OSMemoryBarrier(void)		{ __sync_synchronize(); }
+
+static inline SInt32	OSIncrementAtomic(volatile SInt32 *address)		{ return __sync_fetch_and_add(address, 1); }
+static inline SInt32	OSDecrementAtomic(volatile SInt32 *address)		{ return __sync_fetch_and_sub(address, 1); }
+static inline SInt32	OSAddAtomic(SInt32 amount, volatile SInt32 *address)	{ return __sync_fetch_and_add(address, amount); }
+
+#endif /* _OS_OSATOMIC_H */
@@ -0,0 +1,44 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+// Host build stand-in for <libkern/OSByteOrder.h> - the tests run on little endian hosts, as USB itself is
+
+#ifndef _OS_OSBYTEORDER_H
+#define _OS_OSBYTEORDER_H
+
+#include <stdint.h>
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+#error "the host tests assume a little endian host"
+#endif
+
+#define OSSwapLittleToHostInt16(x)		((uint16_t)(x))
+#define OSSwapHostToLittleInt16(x)		((uint16_t)(x))
+#define OSSwapLittleToHostInt32(x)		((uint32_t)(x))
+#define OSSwapHostToLittleInt32(x)		((uint32_t)(x))
+#define OSSwapLittleToHostInt64(x)		((uint64_t)(x))
+#define OSSwapHostToLittleInt64(x)		((uint64_t)(x))
+
+#endif /* _OS_OSBYTEORDER_H */
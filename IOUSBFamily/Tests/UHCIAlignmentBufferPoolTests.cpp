@@ -0,0 +1,326 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Drives the UHCI alignment buffer pool bookkeeping through random bursts of gets and releases, growing and shrinking it the
+// way AppleUSBUHCI does, and checks its counts against the buffers actually handed out
+
+#include <stdlib.h>
+#include <vector>
+
+#include "UHCIAlignmentBufferPool.h"
+
+#include "USBTestSupport.h"
+
+struct TestChunk;
+
+struct TestBuffer
+{
+	TestChunk			*chunk;
+	bool				inUse;
+	queue_chain_t		chain;
+};
+
+struct TestChunk
+{
+	UInt32				bufferCount;
+	UInt32				freeCount;
+	bool				freed;
+	TestBuffer			*buffers;
+	queue_chain_t		chain;
+};
+
+static const UInt32		kBuffersPerChunk = 8;
+
+// what AppleUSBUHCI::GrowAlignmentBufferPool does, minus the page
+static bool
+Grow(UHCIAlignmentBufferPool *pool, std::vector<TestChunk *> *allChunks)
+{
+	TestChunk		*chunk;
+	UInt32			i;
+	
+	if (!UHCIAlignmentBufferPoolCanGrow(pool))
+		return false;
+	chunk = new TestChunk();
+	chunk->buffers = new TestBuffer[kBuffersPerChunk]();
+	for (i = 0; i < kBuffersPerChunk; i++)
+		UHCIAlignmentBufferPoolAddBuffer(pool, chunk, &chunk->buffers[i]);
+	UHCIAlignmentBufferPoolAddChunk(pool, chunk);
+	allChunks->push_back(chunk);
+	return true;
+}
+
+// what AppleUSBUHCI::GetAlignmentBuffer does
+static TestBuffer *
+Get(UHCIAlignmentBufferPool *pool, std::vector<TestChunk *> *allChunks)
+{
+	TestBuffer		*buffer = UHCIAlignmentBufferPoolGet<TestBuffer>(pool);
+	
+	if (!buffer)
+	{
+		if (!Grow(pool, allChunks))
+			return NULL;
+		buffer = UHCIAlignmentBufferPoolTake<TestBuffer>(pool);
+	}
+	return buffer;
+}
+
+// what AppleUSBUHCI::ShrinkAlignmentBufferPool does. Chunks are marked freed rather than deleted so later use is caught
+static void
+Shrink(UHCIAlignmentBufferPool *pool)
+{
+	TestChunk		*chunk;
+	TestBuffer		*buffer;
+	queue_head_t	released;
+	UInt32			count;
+	
+	queue_init(&released);
+	while ((chunk = UHCIAlignmentBufferPoolRemoveIdleChunk<TestBuffer, TestChunk>(pool, &released)))
+	{
+		count = 0;
+		while (!queue_empty(&released))
+		{
+			queue_remove_first(&released, buffer, TestBuffer *, chain);
+			USBTestCheck(buffer->chunk == chunk);
+			USBTestCheck(!buffer->inUse);
+			count++;
+		}
+		USBTestCheckEqual(count, chunk->bufferCount);
+		chunk->freed = true;
+	}
+}
+
+static void
+CheckPool(UHCIAlignmentBufferPool *pool, const std::vector<TestBuffer *> &outstanding)
+{
+	TestBuffer		*buffer;
+	TestChunk		*chunk;
+	UInt32			freeBuffers = 0, chunkFree = 0, chunks = 0;
+	
+	queue_iterate(&pool->freeBuffers, buffer, TestBuffer *, chain)
+	{
+		USBTestCheck(!buffer->inUse);
+		USBTestCheck(!buffer->chunk->freed);
+		freeBuffers++;
+	}
+	queue_iterate(&pool->chunks, chunk, TestChunk *, chain)
+	{
+		USBTestCheck(!chunk->freed);
+		USBTestCheck(chunk->freeCount <= chunk->bufferCount);
+		chunkFree += chunk->freeCount;
+		chunks++;
+	}
+	for (size_t i = 0; i < outstanding.size(); i++)
+		USBTestCheck(!outstanding[i]->chunk->freed);
+	
+	USBTestCheckEqual(chunks, pool->numChunks);
+	USBTestCheckEqual(freeBuffers, chunkFree);
+	USBTestCheckEqual(pool->buffersInUse, outstanding.size());
+	USBTestCheckEqual(freeBuffers + pool->buffersInUse, pool->numChunks * kBuffersPerChunk);
+	USBTestCheck(pool->numChunks <= pool->maxChunks);
+	USBTestCheckEqual(pool->grows - pool->shrinks, pool->numChunks);
+}
+
+static void
+FreeChunks(std::vector<TestChunk *> *allChunks)
+{
+	for (size_t i = 0; i < allChunks->size(); i++)
+	{
+		delete [] (*allChunks)[i]->buffers;
+		delete (*allChunks)[i];
+	}
+	allChunks->clear();
+}
+
+static void
+TestExhaustion(void)
+{
+	UHCIAlignmentBufferPool		pool;
+	std::vector<TestChunk *>	allChunks;
+	std::vector<TestBuffer *>	outstanding;
+	TestBuffer					*buffer;
+	UInt32						i;
+
+	printf("  growth stops at maxChunks\n");
+	UHCIAlignmentBufferPoolInit(&pool, 0, 64, 1, 3);
+	USBTestCheck(Grow(&pool, &allChunks));
+	for (i = 0; i < 3 * kBuffersPerChunk; i++)
+	{
+		buffer = Get(&pool, &allChunks);
+		USBTestCheck(buffer != NULL);
+		buffer->inUse = true;
+		outstanding.push_back(buffer);
+	}
+	USBTestCheckEqual(pool.numChunks, 3);
+	USBTestCheckEqual(pool.misses, 2);
+	USBTestCheckEqual(pool.hits, 3 * kBuffersPerChunk - 2);
+	USBTestCheck(Get(&pool, &allChunks) == NULL);
+	USBTestCheckEqual(pool.misses, 3);
+	CheckPool(&pool, outstanding);
+	
+	// nothing is free, so an idle pool still cannot give anything back
+	Shrink(&pool);
+	USBTestCheckEqual(pool.numChunks, 3);
+	
+	for (i = 0; i < outstanding.size(); i++)
+	{
+		outstanding[i]->inUse = false;
+		UHCIAlignmentBufferPoolRelease(&pool, outstanding[i]);
+	}
+	outstanding.clear();
+	CheckPool(&pool, outstanding);
+	FreeChunks(&allChunks);
+}
+
+static void
+TestReleaseOrder(void)
+{
+	UHCIAlignmentBufferPool		pool;
+	std::vector<TestChunk *>	allChunks;
+	TestBuffer					*a, *b;
+
+	printf("  released buffers are reused first\n");
+	UHCIAlignmentBufferPoolInit(&pool, 0, 64, 0, 4);
+	a = Get(&pool, &allChunks);
+	b = Get(&pool, &allChunks);
+	USBTestCheck((a != NULL) && (b != NULL) && (a != b));
+	UHCIAlignmentBufferPoolRelease(&pool, a);
+	UHCIAlignmentBufferPoolRelease(&pool, b);
+	USBTestCheck(UHCIAlignmentBufferPoolTake<TestBuffer>(&pool) == b);
+	USBTestCheck(UHCIAlignmentBufferPoolTake<TestBuffer>(&pool) == a);
+	UHCIAlignmentBufferPoolRelease(&pool, a);
+	UHCIAlignmentBufferPoolRelease(&pool, b);
+	FreeChunks(&allChunks);
+}
+
+static void
+TestIdleCheck(void)
+{
+	UHCIAlignmentBufferPool		pool;
+	std::vector<TestChunk *>	allChunks;
+	TestBuffer					*buffer;
+
+	printf("  only a pool which has not run dry shrinks\n");
+	UHCIAlignmentBufferPoolInit(&pool, 0, 64, 0, 4);
+	buffer = Get(&pool, &allChunks);
+	USBTestCheck(!UHCIAlignmentBufferPoolIdleCheck(&pool));
+	USBTestCheck(UHCIAlignmentBufferPoolIdleCheck(&pool));
+	UHCIAlignmentBufferPoolRelease(&pool, buffer);
+	
+	// minChunks of 0 lets the last chunk go too
+	Shrink(&pool);
+	USBTestCheckEqual(pool.numChunks, 0);
+	USBTestCheck(queue_empty(&pool.freeBuffers));
+	FreeChunks(&allChunks);
+}
+
+static void
+TestStress(void)
+{
+	UHCIAlignmentBufferPool		pool;
+	std::vector<TestChunk *>	allChunks;
+	std::vector<TestBuffer *>	outstanding;
+	TestBuffer					*buffer;
+	UInt32						round, op, burst, failures = 0;
+	size_t						i;
+
+	printf("  random bursts with idle checks\n");
+	srand(0x5542);
+	UHCIAlignmentBufferPoolInit(&pool, 0, 64, 2, 8);
+	USBTestCheck(Grow(&pool, &allChunks));
+	USBTestCheck(Grow(&pool, &allChunks));
+	
+	for (round = 0; round < 2000; round++)
+	{
+		// mostly small loads, now and then a burst which runs the pool out of chunks
+		burst = ((rand() % 16) == 0) ? (rand() % (20 * kBuffersPerChunk)) : (rand() % (2 * kBuffersPerChunk));
+		for (op = 0; op < burst; op++)
+		{
+			if (outstanding.empty() || (rand() % 3))
+			{
+				buffer = Get(&pool, &allChunks);
+				if (!buffer)
+				{
+					USBTestCheckEqual(pool.numChunks, pool.maxChunks);
+					USBTestCheckEqual(outstanding.size(), pool.maxChunks * kBuffersPerChunk);
+					failures++;
+					continue;
+				}
+				USBTestCheck(!buffer->inUse);
+				USBTestCheck(!buffer->chunk->freed);
+				buffer->inUse = true;
+				outstanding.push_back(buffer);
+			}
+			else
+			{
+				i = rand() % outstanding.size();
+				buffer = outstanding[i];
+				outstanding[i] = outstanding.back();
+				outstanding.pop_back();
+				buffer->inUse = false;
+				UHCIAlignmentBufferPoolRelease(&pool, buffer);
+			}
+		}
+		
+		// give most of it back before the timeout check, as completions would
+		while (outstanding.size() > (size_t)(rand() % (kBuffersPerChunk + 1)))
+		{
+			buffer = outstanding.back();
+			outstanding.pop_back();
+			buffer->inUse = false;
+			UHCIAlignmentBufferPoolRelease(&pool, buffer);
+		}
+		
+		if (UHCIAlignmentBufferPoolIdleCheck(&pool))
+			Shrink(&pool);
+		CheckPool(&pool, outstanding);
+		USBTestCheck(pool.numChunks >= pool.minChunks);
+	}
+	USBTestCheck(pool.grows > 2);
+	USBTestCheck(pool.shrinks > 0);
+	USBTestCheck(failures > 0);
+	
+	// once everything comes back and a quiet period passes, the pool is back to its minimum
+	while (!outstanding.empty())
+	{
+		outstanding.back()->inUse = false;
+		UHCIAlignmentBufferPoolRelease(&pool, outstanding.back());
+		outstanding.pop_back();
+	}
+	UHCIAlignmentBufferPoolIdleCheck(&pool);
+	Shrink(&pool);
+	CheckPool(&pool, outstanding);
+	USBTestCheckEqual(pool.numChunks, pool.minChunks);
+	printf("    %u hits, %u misses, %u grows, %u shrinks, %u failed gets\n", (unsigned)pool.hits, (unsigned)pool.misses, (unsigned)pool.grows, (unsigned)pool.shrinks, (unsigned)failures);
+	FreeChunks(&allChunks);
+}
+
+int
+main(void)
+{
+	TestExhaustion();
+	TestReleaseOrder();
+	TestIdleCheck();
+	TestStress();
+	return USBTestResult("UHCIAlignmentBufferPoolTests");
+}
@@ -0,0 +1,205 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Runs the UHCI bandwidth reclamation policy through simulated submission, completion and idle timer sequences
+
+#include "UHCIFSBRPolicy.h"
+
+#include "USBTestSupport.h"
+
+static const UInt64		kMS = 1000000ULL;
+
+static void
+TestEngageAndIdle(void)
+{
+	UHCIFSBRPolicy		policy;
+
+	printf("  engage, idle, disengage\n");
+	UHCIFSBRPolicyInit(&policy, 3, 24);
+	USBTestCheck(!policy.engaged);
+
+	USBTestCheckEqual(UHCIFSBRPolicyWorkQueued(&policy, 10 * kMS), kUHCIFSBRActionEngage);
+	USBTestCheck(policy.engaged);
+	USBTestCheckEqual(UHCIFSBRPolicyWorkCompleted(&policy, 12 * kMS), kUHCIFSBRActionArmTimer);
+	USBTestCheck(policy.engaged);
+	USBTestCheck(policy.timerPending);
+	USBTestCheckEqual(policy.idleWindowCurrentMS, 3);
+
+	USBTestCheckEqual(UHCIFSBRPolicyIdleTimerFired(&policy, 15 * kMS, 0), kUHCIFSBRActionDisengage);
+	USBTestCheck(!policy.engaged);
+	USBTestCheck(!policy.timerPending);
+	USBTestCheckEqual(policy.engagements, 1);
+	USBTestCheckEqual(policy.disengagements, 1);
+	USBTestCheckEqual(UHCIFSBRPolicyEngagedNS(&policy, 100 * kMS), 5 * kMS);
+
+	// a timer which fires after it was cancelled does nothing
+	USBTestCheckEqual(UHCIFSBRPolicyIdleTimerFired(&policy, 16 * kMS, 0), 0);
+	USBTestCheckEqual(UHCIFSBRPolicyWorkCompleted(&policy, 17 * kMS), 0);
+}
+
+static void
+TestBackToBack(void)
+{
+	UHCIFSBRPolicy		policy;
+	int					i;
+
+	printf("  back to back work keeps the loop closed\n");
+	UHCIFSBRPolicyInit(&policy, 3, 24);
+	USBTestCheckEqual(UHCIFSBRPolicyWorkQueued(&policy, 0), kUHCIFSBRActionEngage);
+	for (i = 0; i < 100; i++)
+	{
+		USBTestCheckEqual(UHCIFSBRPolicyWorkCompleted(&policy, (2 * i + 1) * kMS), kUHCIFSBRActionArmTimer);
+		USBTestCheckEqual(UHCIFSBRPolicyWorkQueued(&policy, (2 * i + 2) * kMS), kUHCIFSBRActionCancelTimer);
+	}
+	USBTestCheck(policy.engaged);
+	USBTestCheckEqual(policy.engagements, 1);
+	USBTestCheckEqual(policy.disengagements, 0);
+	USBTestCheckEqual(policy.idleWindowsCancelled, 100);
+	USBTestCheckEqual(UHCIFSBRPolicyEngagedNS(&policy, 250 * kMS), 250 * kMS);
+}
+
+static void
+TestWorkOutstandingAtTimer(void)
+{
+	UHCIFSBRPolicy		policy;
+
+	printf("  work outstanding when the timer fires\n");
+	UHCIFSBRPolicyInit(&policy, 3, 24);
+	UHCIFSBRPolicyWorkQueued(&policy, 0);
+	UHCIFSBRPolicyWorkCompleted(&policy, 1 * kMS);
+
+	// work came in without going through WorkQueued (the count was never zero as far as the controller saw)
+	USBTestCheckEqual(UHCIFSBRPolicyIdleTimerFired(&policy, 4 * kMS, 2), 0);
+	USBTestCheck(policy.engaged);
+	USBTestCheck(!policy.timerPending);
+	USBTestCheckEqual(UHCIFSBRPolicyWorkCompleted(&policy, 5 * kMS), kUHCIFSBRActionArmTimer);
+	USBTestCheckEqual(UHCIFSBRPolicyIdleTimerFired(&policy, 8 * kMS, 0), kUHCIFSBRActionDisengage);
+}
+
+static void
+TestNoIdleWindow(void)
+{
+	UHCIFSBRPolicy		policy;
+	int					i;
+
+	printf("  no idle window\n");
+	UHCIFSBRPolicyInit(&policy, 0, 0);
+	for (i = 0; i < 10; i++)
+	{
+		USBTestCheckEqual(UHCIFSBRPolicyWorkQueued(&policy, (2 * i) * kMS), kUHCIFSBRActionEngage);
+		USBTestCheckEqual(UHCIFSBRPolicyWorkCompleted(&policy, (2 * i) * kMS + 1), kUHCIFSBRActionDisengage);
+	}
+	USBTestCheckEqual(policy.engagements, 10);
+	USBTestCheckEqual(policy.disengagements, 10);
+	USBTestCheckEqual(policy.idleWindowIncreases, 0);
+	USBTestCheckEqual(policy.idleWindowCurrentMS, 0);
+}
+
+// opens the loop at nowNS through a full idle window, and returns when that was
+static UInt64
+RunBurst(UHCIFSBRPolicy *policy, UInt64 nowNS)
+{
+	UHCIFSBRPolicyWorkQueued(policy, nowNS);
+	UHCIFSBRPolicyWorkCompleted(policy, nowNS + kMS);
+	nowNS += kMS + policy->idleWindowCurrentMS * kMS;
+	USBTestCheckEqual(UHCIFSBRPolicyIdleTimerFired(policy, nowNS, 0), kUHCIFSBRActionDisengage);
+	return nowNS;
+}
+
+static void
+TestHysteresis(void)
+{
+	UHCIFSBRPolicy		policy;
+	UInt64				now = 0;
+	UInt32				expected[] = { 6, 12, 24, 24, 24 };
+	int					i;
+
+	printf("  hysteresis\n");
+	UHCIFSBRPolicyInit(&policy, 3, 24);
+
+	// the first engagement is not thrashing, however soon it comes
+	now = RunBurst(&policy, now);
+	USBTestCheckEqual(policy.idleWindowCurrentMS, 3);
+
+	// work coming back within a window of the loop opening grows the window, up to the maximum
+	for (i = 0; i < 5; i++)
+	{
+		now = RunBurst(&policy, now + kMS);
+		USBTestCheckEqual(policy.idleWindowCurrentMS, expected[i]);
+	}
+	USBTestCheckEqual(policy.idleWindowIncreases, 3);
+
+	// quiet periods of at least the window shrink it again, down to the minimum
+	now = RunBurst(&policy, now + 24 * kMS);
+	USBTestCheckEqual(policy.idleWindowCurrentMS, 12);
+	now = RunBurst(&policy, now + 100 * kMS);
+	USBTestCheckEqual(policy.idleWindowCurrentMS, 6);
+	now = RunBurst(&policy, now + 6 * kMS);
+	USBTestCheckEqual(policy.idleWindowCurrentMS, 3);
+	now = RunBurst(&policy, now + 1000 * kMS);
+	USBTestCheckEqual(policy.idleWindowCurrentMS, 3);
+
+	// the timer is armed with the grown window
+	UHCIFSBRPolicyWorkQueued(&policy, now + kMS);
+	USBTestCheckEqual(policy.idleWindowCurrentMS, 6);
+	USBTestCheckEqual(UHCIFSBRPolicyWorkCompleted(&policy, now + 2 * kMS), kUHCIFSBRActionArmTimer);
+
+	// a maximum below the minimum is the minimum
+	UHCIFSBRPolicyInit(&policy, 8, 2);
+	USBTestCheckEqual(policy.maxIdleWindowMS, 8);
+}
+
+static void
+TestReset(void)
+{
+	UHCIFSBRPolicy		policy;
+
+	printf("  controller reset\n");
+	UHCIFSBRPolicyInit(&policy, 3, 24);
+	UHCIFSBRPolicyWorkQueued(&policy, 10 * kMS);
+	UHCIFSBRPolicyWorkCompleted(&policy, 11 * kMS);
+	UHCIFSBRPolicyLoopReset(&policy, 12 * kMS);
+	USBTestCheck(!policy.engaged);
+	USBTestCheck(!policy.timerPending);
+	USBTestCheckEqual(UHCIFSBRPolicyEngagedNS(&policy, 50 * kMS), 2 * kMS);
+	USBTestCheckEqual(UHCIFSBRPolicyIdleTimerFired(&policy, 14 * kMS, 0), 0);
+
+	// a reset with the loop open changes nothing
+	UHCIFSBRPolicyLoopReset(&policy, 20 * kMS);
+	USBTestCheckEqual(policy.disengagements, 1);
+	USBTestCheckEqual(UHCIFSBRPolicyWorkQueued(&policy, 30 * kMS), kUHCIFSBRActionEngage);
+}
+
+int
+main(void)
+{
+	TestEngageAndIdle();
+	TestBackToBack();
+	TestWorkOutstandingAtTimer();
+	TestNoIdleWindow();
+	TestHysteresis();
+	TestReset();
+
+	return USBTestResult("UHCIFSBRPolicyTests");
+}
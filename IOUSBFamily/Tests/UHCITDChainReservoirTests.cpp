@@ -0,0 +1,403 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Runs the UHCI TD chain reservoir through the submissions, completions, aborts and deletes of simulated endpoints, with TDs
+// taken from and returned to a free list as AppleUSBUHCI does, and checks that no TD is lost or handed out twice
+
+#include <stdlib.h>
+#include <vector>
+
+#include "UHCITDChainReservoir.h"
+
+#include "USBTestSupport.h"
+
+struct TestTD
+{
+	TestTD			*next;					// _logicalNext
+	TestTD			*physicalNext;			// what SetPhysicalLink was last given
+	bool			inUse;
+};
+
+struct TestTDOps
+{
+	static TestTD *Next(TestTD *td)						{ return td->next; }
+	static void Link(TestTD *td, TestTD *next)			{ td->physicalNext = next; td->next = next; }
+	static void Terminate(TestTD *td)					{ td->next = NULL; }
+};
+
+// the controller wide free list
+struct TestController
+{
+	std::vector<TestTD *>		freeList;
+	std::vector<TestTD *>		all;
+	UInt32						freeListTakes;
+	UInt32						hits;
+	UInt32						misses;
+};
+
+static TestTD *
+AllocateTD(TestController *controller)
+{
+	TestTD		*td;
+	
+	controller->freeListTakes++;
+	if (controller->freeList.empty())
+	{
+		td = new TestTD();
+		controller->all.push_back(td);
+	}
+	else
+	{
+		td = controller->freeList.back();
+		controller->freeList.pop_back();
+	}
+	td->next = NULL;
+	td->physicalNext = NULL;
+	return td;
+}
+
+static void
+FreeTDChain(TestController *controller, TestTD *td)
+{
+	TestTD		*next;
+	
+	while (td)
+	{
+		next = td->next;
+		USBTestCheck(!td->inUse);
+		td->next = NULL;
+		controller->freeList.push_back(td);
+		td = next;
+	}
+}
+
+// what AllocTDChain does: take a whole chain if the reservoir has one, else link TDs from the free list one at a time,
+// and give back any TDs of a reused chain the transfer did not use
+static std::vector<TestTD *>
+Submit(TestController *controller, UHCITDChainReservoir<TestTD> *reservoir, UInt32 bufferSize, UInt32 maxPacket, UInt32 planned)
+{
+	std::vector<TestTD *>	transfer;
+	TestTD					*td, *next;
+	UInt32					i;
+	
+	td = UHCITDChainReservoirTake<TestTDOps>(reservoir, UHCITDChainReservoirTDsNeeded(bufferSize, maxPacket));
+	if (td)
+		controller->hits++;
+	else
+	{
+		controller->misses++;
+		td = AllocateTD(controller);
+	}
+	
+	for (i = 0; i < planned; i++)
+	{
+		USBTestCheck(!td->inUse);
+		td->inUse = true;
+		transfer.push_back(td);
+		if (i + 1 == planned)
+			break;
+		next = td->next;
+		if (next)
+			USBTestCheck(td->physicalNext == next);				// a reused chain is already linked for the hardware
+		else
+		{
+			next = AllocateTD(controller);
+			TestTDOps::Link(td, next);
+		}
+		td = next;
+	}
+	if (td->next)
+	{
+		FreeTDChain(controller, td->next);
+		td->next = NULL;
+	}
+	return transfer;
+}
+
+// what UHCIUIMDoDoneQueueProcessing does with the TDs of a completed transfer
+static void
+Complete(TestController *controller, UHCITDChainReservoir<TestTD> *reservoir, std::vector<TestTD *> *transfer)
+{
+	size_t		i;
+	
+	for (i = 0; i < transfer->size(); i++)
+		(*transfer)[i]->inUse = false;
+	FreeTDChain(controller, UHCITDChainReservoirGiveBack<TestTDOps>(reservoir, transfer->front(), transfer->back(), (UInt32)transfer->size()));
+	transfer->clear();
+}
+
+static UInt32
+ChainLength(UHCITDChainReservoir<TestTD> *reservoir)
+{
+	UInt32		count = 0;
+	TestTD		*td;
+	
+	for (td = reservoir->head; td; td = td->next)
+	{
+		USBTestCheck(!td->inUse);
+		if (td->next)
+			USBTestCheck(td->physicalNext == td->next);
+		if (!td->next)
+			USBTestCheck(td == reservoir->tail);
+		count++;
+	}
+	return count;
+}
+
+static void
+CheckConservation(TestController *controller, UHCITDChainReservoir<TestTD> *reservoirs, UInt32 numReservoirs, const std::vector<TestTD *> *inFlight, UInt32 numInFlight)
+{
+	size_t		held = controller->freeList.size();
+	UInt32		i;
+	
+	for (i = 0; i < numReservoirs; i++)
+	{
+		USBTestCheckEqual(ChainLength(&reservoirs[i]), reservoirs[i].count);
+		USBTestCheck(reservoirs[i].count <= reservoirs[i].limit);
+		held += reservoirs[i].count;
+	}
+	for (i = 0; i < numInFlight; i++)
+		held += inFlight[i].size();
+	USBTestCheckEqual(held, controller->all.size());
+}
+
+static void
+FreeAll(TestController *controller)
+{
+	for (size_t i = 0; i < controller->all.size(); i++)
+		delete controller->all[i];
+}
+
+static void
+TestTDsNeeded(void)
+{
+	printf("  TDs needed\n");
+	USBTestCheckEqual(UHCITDChainReservoirTDsNeeded(0, 64), 1);
+	USBTestCheckEqual(UHCITDChainReservoirTDsNeeded(1, 64), 1);
+	USBTestCheckEqual(UHCITDChainReservoirTDsNeeded(64, 64), 1);
+	USBTestCheckEqual(UHCITDChainReservoirTDsNeeded(65, 64), 2);
+	USBTestCheckEqual(UHCITDChainReservoirTDsNeeded(65536, 64), 1024);
+	USBTestCheckEqual(UHCITDChainReservoirTDsNeeded(8, 0), 1);
+}
+
+static void
+TestWholeChainReuse(void)
+{
+	TestController					controller = TestController();
+	UHCITDChainReservoir<TestTD>	reservoir;
+	std::vector<TestTD *>			transfer, again;
+
+	printf("  a completed transfer's chain is reused whole\n");
+	UHCITDChainReservoirInit(&reservoir, 128);
+	transfer = Submit(&controller, &reservoir, 4096, 64, 64);
+	USBTestCheckEqual(controller.freeListTakes, 64);
+	USBTestCheckEqual(reservoir.misses, 1);
+	Complete(&controller, &reservoir, &transfer);
+	USBTestCheckEqual(reservoir.count, 64);
+	
+	again = Submit(&controller, &reservoir, 4096, 64, 64);
+	USBTestCheckEqual(controller.freeListTakes, 64);						// no TD came from the free list
+	USBTestCheckEqual(reservoir.hits, 1);
+	USBTestCheckEqual(reservoir.count, 0);
+	USBTestCheck(reservoir.head == NULL);
+	USBTestCheck(again.back()->next == NULL);
+	
+	// a shorter transfer takes what it needs from the front and leaves the rest
+	Complete(&controller, &reservoir, &again);
+	transfer = Submit(&controller, &reservoir, 1000, 64, 16);
+	USBTestCheckEqual(reservoir.count, 48);
+	USBTestCheckEqual(controller.freeListTakes, 64);
+	CheckConservation(&controller, &reservoir, 1, &transfer, 1);
+	
+	// a longer one than the reservoir holds is a miss, and the chain stays put
+	again = Submit(&controller, &reservoir, 8192, 64, 128);
+	USBTestCheckEqual(reservoir.misses, 2);
+	USBTestCheckEqual(reservoir.count, 48);
+	std::vector<TestTD *>	both[2] = {transfer, again};
+	CheckConservation(&controller, &reservoir, 1, both, 2);
+	Complete(&controller, &reservoir, &transfer);
+	USBTestCheckEqual(reservoir.count, 64);
+	
+	// there is no room for the longer transfer's TDs on top of what is there, so its chain replaces the shorter one
+	Complete(&controller, &reservoir, &again);
+	USBTestCheckEqual(reservoir.count, 128);
+	USBTestCheckEqual(reservoir.discards, 1);
+	USBTestCheckEqual(controller.freeList.size(), 64);
+	
+	// and a shorter chain which does not fit goes to the free list
+	transfer = Submit(&controller, &reservoir, 64 * 100, 64, 100);
+	again = Submit(&controller, &reservoir, 64 * 100, 64, 100);
+	Complete(&controller, &reservoir, &transfer);
+	USBTestCheckEqual(reservoir.count, 28 + 100);
+	Complete(&controller, &reservoir, &again);
+	USBTestCheckEqual(reservoir.count, 128);
+	USBTestCheckEqual(reservoir.discards, 2);
+	FreeAll(&controller);
+}
+
+static void
+TestShortPlan(void)
+{
+	TestController					controller = TestController();
+	UHCITDChainReservoir<TestTD>	reservoir;
+	std::vector<TestTD *>			transfer;
+
+	printf("  TDs the planner did not use go back to the free list\n");
+	UHCITDChainReservoirInit(&reservoir, 1024);
+	transfer = Submit(&controller, &reservoir, 640, 64, 10);
+	Complete(&controller, &reservoir, &transfer);
+	transfer = Submit(&controller, &reservoir, 640, 64, 7);
+	USBTestCheckEqual(transfer.size(), 7);
+	USBTestCheckEqual(controller.freeList.size(), 3);
+	CheckConservation(&controller, &reservoir, 1, &transfer, 1);
+	Complete(&controller, &reservoir, &transfer);
+	FreeAll(&controller);
+}
+
+static void
+TestLimitAndFlush(void)
+{
+	TestController					controller = TestController();
+	UHCITDChainReservoir<TestTD>	reservoir;
+	std::vector<TestTD *>			transfer;
+	TestTD							*chain;
+
+	printf("  limit, flush and idle check\n");
+	UHCITDChainReservoirInit(&reservoir, 32);
+	transfer = Submit(&controller, &reservoir, 64 * 40, 64, 40);
+	Complete(&controller, &reservoir, &transfer);
+	USBTestCheckEqual(reservoir.count, 0);									// longer than the limit, so it went to the free list
+	USBTestCheckEqual(reservoir.discards, 1);
+	USBTestCheckEqual(controller.freeList.size(), 40);
+	
+	transfer = Submit(&controller, &reservoir, 64 * 20, 64, 20);
+	Complete(&controller, &reservoir, &transfer);
+	USBTestCheckEqual(reservoir.count, 20);
+	
+	// the reservoir had no hits since it was filled, so the first idle check after that empties it
+	USBTestCheck(UHCITDChainReservoirIdleCheck(&reservoir));
+	chain = UHCITDChainReservoirFlush<TestTDOps>(&reservoir);
+	FreeTDChain(&controller, chain);
+	USBTestCheckEqual(reservoir.count, 0);
+	USBTestCheckEqual(controller.freeList.size(), controller.all.size());
+	USBTestCheck(!UHCITDChainReservoirIdleCheck(&reservoir));				// an empty reservoir has nothing to give back
+	
+	// one in use is not idle
+	transfer = Submit(&controller, &reservoir, 64, 64, 1);
+	Complete(&controller, &reservoir, &transfer);
+	UHCITDChainReservoirIdleCheck(&reservoir);
+	transfer = Submit(&controller, &reservoir, 64, 64, 1);
+	Complete(&controller, &reservoir, &transfer);
+	USBTestCheck(!UHCITDChainReservoirIdleCheck(&reservoir));
+	FreeTDChain(&controller, UHCITDChainReservoirFlush<TestTDOps>(&reservoir));
+	FreeAll(&controller);
+}
+
+static void
+TestEndpoints(void)
+{
+	enum { kEndpoints = 4, kTransfersInFlight = 3 };
+	static const UInt32				sizes[kEndpoints] = {8, 64 * 16, 4096, 65536};
+	TestController					controller = TestController();
+	UHCITDChainReservoir<TestTD>	reservoirs[kEndpoints];
+	std::vector<TestTD *>			inFlight[kEndpoints * kTransfersInFlight];
+	UInt32							round, ep, slot, planned, size, needed;
+
+	printf("  endpoints submitting, completing, aborting and being deleted\n");
+	srand(0x029);
+	for (ep = 0; ep < kEndpoints; ep++)
+		UHCITDChainReservoirInit(&reservoirs[ep], 1024);
+	
+	for (round = 0; round < 20000; round++)
+	{
+		ep = rand() % kEndpoints;
+		slot = ep * kTransfersInFlight + (rand() % kTransfersInFlight);
+		switch (rand() % 512)
+		{
+			case 0:
+				// abort: everything in flight on the endpoint completes, then the reservoir is emptied
+				for (UInt32 i = 0; i < kTransfersInFlight; i++)
+					if (!inFlight[ep * kTransfersInFlight + i].empty())
+						Complete(&controller, &reservoirs[ep], &inFlight[ep * kTransfersInFlight + i]);
+				FreeTDChain(&controller, UHCITDChainReservoirFlush<TestTDOps>(&reservoirs[ep]));
+				USBTestCheckEqual(reservoirs[ep].count, 0);
+				break;
+				
+			case 1:
+				// delete, and a new endpoint in the same queue head
+				for (UInt32 i = 0; i < kTransfersInFlight; i++)
+					if (!inFlight[ep * kTransfersInFlight + i].empty())
+						Complete(&controller, &reservoirs[ep], &inFlight[ep * kTransfersInFlight + i]);
+				FreeTDChain(&controller, UHCITDChainReservoirFlush<TestTDOps>(&reservoirs[ep]));
+				UHCITDChainReservoirInit(&reservoirs[ep], 1024);
+				break;
+				
+			default:
+				// a completion, after which the client mostly queues its next transfer at once
+				if (!inFlight[slot].empty())
+				{
+					Complete(&controller, &reservoirs[ep], &inFlight[slot]);
+					if (rand() % 4)
+						break;
+				}
+				// mostly the endpoint's usual size, sometimes a short one
+				size = (rand() % 8) ? sizes[ep] : (rand() % (sizes[ep] + 1));
+				needed = UHCITDChainReservoirTDsNeeded(size, 64);
+				planned = ((needed > 1) && !(rand() % 8)) ? needed - 1 : needed;
+				inFlight[slot] = Submit(&controller, &reservoirs[ep], size, 64, planned);
+				break;
+		}
+		
+		if ((round % 1000) == 999)
+		{
+			for (ep = 0; ep < kEndpoints; ep++)
+				if (UHCITDChainReservoirIdleCheck(&reservoirs[ep]))
+					FreeTDChain(&controller, UHCITDChainReservoirFlush<TestTDOps>(&reservoirs[ep]));
+		}
+		CheckConservation(&controller, reservoirs, kEndpoints, inFlight, kEndpoints * kTransfersInFlight);
+	}
+	
+	// with transfers mostly of one size per endpoint, most of them reuse a chain
+	printf("    %u hits, %u misses - %u%% of transfers reused a chain\n", (unsigned)controller.hits, (unsigned)controller.misses, (unsigned)((100 * controller.hits) / (controller.hits + controller.misses)));
+	USBTestCheck(controller.hits > 2 * controller.misses);
+	
+	for (slot = 0; slot < kEndpoints * kTransfersInFlight; slot++)
+		if (!inFlight[slot].empty())
+			Complete(&controller, &reservoirs[slot / kTransfersInFlight], &inFlight[slot]);
+	for (ep = 0; ep < kEndpoints; ep++)
+		FreeTDChain(&controller, UHCITDChainReservoirFlush<TestTDOps>(&reservoirs[ep]));
+	USBTestCheckEqual(controller.freeList.size(), controller.all.size());
+	FreeAll(&controller);
+}
+
+int
+main(void)
+{
+	TestTDsNeeded();
+	TestWholeChainReuse();
+	TestShortPlan();
+	TestLimitAndFlush();
+	TestEndpoints();
+	return USBTestResult("UHCITDChainReservoirTests");
+}
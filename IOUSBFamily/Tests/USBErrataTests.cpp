@@ -0,0 +1,196 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// Checks USBFindErrataBits against a linear scan of the errata tables the controller and the hub search with it. The tables
+// are read from their source files, so a table which is edited out of order fails here as well as at run time.
+
+#include <IOKit/usb/USBErrata.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "USBTestSupport.h"
+
+#ifndef USB_TEST_SOURCE_ROOT
+#define USB_TEST_SOURCE_ROOT	"../.."
+#endif
+
+enum
+{
+	kMaxErrataEntries	= 256
+};
+
+// the loop in IOUSBController::GetErrataBits for an unsorted list
+static UInt32
+LinearErrataBits(const ErrataListEntry *list, UInt32 count, UInt16 vendID, UInt16 deviceID, UInt16 revisionID)
+{
+	UInt32		i, errata = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		if ((list[i].vendID == vendID) && (list[i].deviceID == deviceID) && (revisionID >= list[i].revisionLo) && (revisionID <= list[i].revisionHi))
+			errata |= list[i].errata;
+	}
+	return errata;
+}
+
+// Reads the vendID, deviceID, revisionLo and revisionHi of every entry of "static ErrataListEntry <name>[] = {". Each entry
+// gets its own errata bit (modulo 32), so that a lookup which finds the wrong entries shows up in the result.
+static UInt32
+ReadErrataTable(const char *path, const char *name, ErrataListEntry *list)
+{
+	char		line[1024];
+	char		start[128];
+	bool		inTable = false;
+	UInt32		count = 0;
+	FILE		*file = fopen(path, "r");
+
+	if (!file)
+	{
+		printf("can't open %s\n", path);
+		return 0;
+	}
+
+	snprintf(start, sizeof(start), "%s[] = {", name);
+	while (fgets(line, sizeof(line), file))
+	{
+		const char		*p = line;
+		unsigned int	vendID, deviceID, revisionLo, revisionHi;
+
+		if (!inTable)
+		{
+			inTable = (strstr(line, "ErrataListEntry") && strstr(line, start));
+			continue;
+		}
+
+		while ((*p == ' ') || (*p == '\t'))
+			p++;
+		if (!strncmp(p, "};", 2))
+			break;
+		if (*p != '{')
+			continue;
+		if (sscanf(p, "{%x , %x , %x , %x ,", &vendID, &deviceID, &revisionLo, &revisionHi) != 4)
+		{
+			printf("%s: can't parse %s", path, line);
+			gUSBTestFailures++;
+			continue;
+		}
+		if (count == kMaxErrataEntries)
+			break;
+		list[count].vendID = vendID;
+		list[count].deviceID = deviceID;
+		list[count].revisionLo = revisionLo;
+		list[count].revisionHi = revisionHi;
+		list[count].errata = 1U << (count % 32);
+		count++;
+	}
+	fclose(file);
+	return count;
+}
+
+static void
+CheckLookup(const ErrataListEntry *list, UInt32 count, UInt16 vendID, UInt16 deviceID, UInt16 revisionID)
+{
+	UInt32		found = USBFindErrataBits(list, count, vendID, deviceID, revisionID);
+	UInt32		expected = LinearErrataBits(list, count, vendID, deviceID, revisionID);
+
+	if (found != expected)
+	{
+		printf("  %04x/%04x rev %04x: ", vendID, deviceID, revisionID);
+		USBTestCheckEqual(found, expected);
+	}
+}
+
+// every entry's device at and around its revision range, the devices next to it, and devices before and after the table
+static void
+CheckTable(const char *file, const char *name)
+{
+	static ErrataListEntry	list[kMaxErrataEntries];
+	char					path[1024];
+	UInt32					count, i;
+
+	snprintf(path, sizeof(path), "%s/%s", USB_TEST_SOURCE_ROOT, file);
+	printf("  %s %s\n", file, name);
+	count = ReadErrataTable(path, name, list);
+	USBTestCheck(count > 0);
+	USBTestCheck(USBErrataListIsSorted(list, count));
+
+	for (i = 0; i < count; i++)
+	{
+		const ErrataListEntry	*entry = &list[i];
+		UInt16					revisions[] = { 0, entry->revisionLo, entry->revisionHi, (UInt16)(entry->revisionLo - 1), (UInt16)(entry->revisionHi + 1), 0xffff };
+		UInt32					r;
+
+		for (r = 0; r < sizeof(revisions) / sizeof(revisions[0]); r++)
+		{
+			CheckLookup(list, count, entry->vendID, entry->deviceID, revisions[r]);
+			CheckLookup(list, count, entry->vendID, (UInt16)(entry->deviceID - 1), revisions[r]);
+			CheckLookup(list, count, entry->vendID, (UInt16)(entry->deviceID + 1), revisions[r]);
+			CheckLookup(list, count, (UInt16)(entry->vendID + 1), entry->deviceID, revisions[r]);
+		}
+	}
+	CheckLookup(list, count, 0x0000, 0x0000, 0);
+	CheckLookup(list, count, 0xffff, 0xffff, 0xffff);
+
+	// the shorter lists a lookup sees at the edges of its search
+	for (i = 0; i <= count; i++)
+	{
+		CheckLookup(list, i, list[0].vendID, list[0].deviceID, list[0].revisionLo);
+		if (i)
+			CheckLookup(list, i, list[i - 1].vendID, list[i - 1].deviceID, list[i - 1].revisionHi);
+	}
+}
+
+static void
+TestSortCheck(void)
+{
+	ErrataListEntry		list[] = {
+		{ 0x1000, 0x0001, 0, 0xffff, 1 },
+		{ 0x1000, 0x0001, 0, 0x0000, 2 },
+		{ 0x1000, 0x0002, 0, 0xffff, 4 },
+		{ 0x2000, 0x0000, 0, 0xffff, 8 }
+	};
+	ErrataListEntry		swapped;
+
+	printf("  sort check\n");
+	USBTestCheck(USBErrataListIsSorted(list, 4));
+	USBTestCheck(USBErrataListIsSorted(list, 0));
+	USBTestCheckEqual(USBFindErrataBits(list, 4, 0x1000, 0x0001, 0), 3);
+	USBTestCheckEqual(USBFindErrataBits(list, 4, 0x1000, 0x0001, 1), 1);
+
+	swapped = list[2];
+	list[2] = list[3];
+	list[3] = swapped;
+	USBTestCheck(!USBErrataListIsSorted(list, 4));
+}
+
+int
+main(void)
+{
+	TestSortCheck();
+	CheckTable("IOUSBFamily/Classes/IOUSBController_Errata.cpp", "errataList");
+	CheckTable("AppleUSBHub/Classes/AppleUSBHub.cpp", "errataList");
+
+	return USBTestResult("USBErrataTests");
+}
@@ -0,0 +1,62 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+// Minimal checking for the host unit tests - every failure is printed, and the test returns non zero if there was one
+
+#ifndef _USBTESTSUPPORT_H
+#define _USBTESTSUPPORT_H
+
+#include <stdio.h>
+
+static int	gUSBTestFailures = 0;
+
+#define USBTestCheck(COND)																		\
+	do {																						\
+		if (!(COND))																			\
+		{																						\
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND);						\
+			gUSBTestFailures++;																	\
+		}																						\
+	} while (0)
+
+#define USBTestCheckEqual(A, B)																	\
+	do {																						\
+		unsigned long long	_a = (unsigned long long)(A);										\
+		unsigned long long	_b = (unsigned long long)(B);										\
+		if (_a != _b)																			\
+		{																						\
+			printf("%s:%d: %s (0x%llx) != %s (0x%llx)\n", __FILE__, __LINE__, #A, _a, #B, _b);	\
+			gUSBTestFailures++;																	\
+		}																						\
+	} while (0)
+
+static inline int
+USBTestResult(const char *name)
+{
+	printf("%s: %s (%d failures)\n", name, gUSBTestFailures ? "FAILED" : "passed", gUSBTestFailures);
+	return gUSBTestFailures ? 1 : 0;
+}
+
+#endif /* _USBTESTSUPPORT_H */
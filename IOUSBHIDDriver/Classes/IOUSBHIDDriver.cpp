@@ -39,6 +39,7 @@
 #include <IOKit/usb/IOUSBInterface.h>
 #include <IOKit/usb/IOUSBLog.h>
 #include <IOKit/usb/IOUSBPipe.h>
+#include <IOKit/usb/IOUSBController.h>
 #include <IOKit/usb/IOUSBHIDDriver.h>
 #include <IOKit/usb/IOUSBHubPolicyMaker.h>
 #import "USBTracepoints.h"
@@ -86,6 +87,9 @@ __attribute__((format(printf, 1, 2)));
 #define	_PENDINGREAD							_usbHIDExpansionData->_pendingRead
 #define _DEAD_DEVICE_CHECK_LOCK					_usbHIDExpansionData->_deviceDeadCheckLock
 #define _HANDLEREPORTTIMESTAMP					_usbHIDExpansionData->_handleReportTimeStamp
+#define _POLLED_CONTROLLER						_usbHIDExpansionData->_polledController
+#define _POLLED_ADDRESS							_usbHIDExpansionData->_polledAddress
+#define _POLLED_ENDPOINT						_usbHIDExpansionData->_polledEndpoint
 
 #define ABORTEXPECTED                       _deviceIsDead
 
@@ -526,6 +530,10 @@ IOUSBHIDDriver::start(IOService *provider)
     _gate = commandGate;
     _WORKLOOP = workLoop;
 
+	// A boot keyboard is what the debugger reads with PolledRead, so have its reads set aside now
+	//
+	RegisterPolledKeyboard();
+
 	err = InitializeUSBHIDPowerManagement(provider);
 	
 	if (err)
@@ -717,6 +725,9 @@ IOUSBHIDDriver::willTerminate( IOService * provider, IOOptionBits options )
     //
     USBLog(3, "IOUSBHIDDriver(%s)[%p]::willTerminate isInactive (%d) _outstandingIO(%d)", getName(), this, isInactive(), (int)_outstandingIO);
     
+	// the debugger should not read from a keyboard which is going away
+	UnregisterPolledKeyboard();
+	
 	if (_outstandingIO)
 	{
 		if (_interruptPipe)
@@ -1054,6 +1065,9 @@ IOUSBHIDDriver::handleStop(IOService * provider)
 {
     USBLog(7, "IOUSBHIDDriver(%s)[%p]::handleStop", getName(), this);
 
+	// before the interface, and with it the interrupt pipe, is closed
+	UnregisterPolledKeyboard();
+	
     if (_deviceDeadCheckThread)
     {
         thread_call_cancel(_deviceDeadCheckThread);
@@ -2699,6 +2713,67 @@ IOUSBHIDDriver::IsPortSuspended()
 }
 
 
+
+//================================================================================================
+//
+//  RegisterPolledKeyboard
+//
+//  The debugger's keyboard console reads a boot keyboard with IOUSBController::PolledRead, when
+//  nothing else runs and memory cannot be allocated. Registering the interrupt pipe with the
+//  controller sets aside the command, the buffer and the TDs those reads use.
+//
+//================================================================================================
+//
+void
+IOUSBHIDDriver::RegisterPolledKeyboard(void)
+{
+	IOUSBController *	controller;
+	IOReturn			err;
+	
+	if (!_usbHIDExpansionData || _POLLED_CONTROLLER || !_interface || !_device || !_interruptPipe)
+		return;
+	
+    if ( (_interface->GetInterfaceClass() != kUSBHIDClass) ||
+         (_interface->GetInterfaceSubClass() != kUSBHIDBootInterfaceSubClass) ||
+         (_interface->GetInterfaceProtocol() != kHIDKeyboardInterfaceProtocol) )
+		return;
+	
+	controller = _device->GetBus();
+	if (!controller)
+		return;
+	
+	err = controller->RegisterPolledEndpoint(_device->GetAddress(), _interruptPipe->GetEndpointNumber(), _interruptPipe->GetMaxPacketSize());
+	if (err != kIOReturnSuccess)
+	{
+		// the keyboard works as before - only a polled read on it may allocate
+		USBLog(3, "IOUSBHIDDriver(%s)[%p]::RegisterPolledKeyboard - RegisterPolledEndpoint returned 0x%x", getName(), this, err);
+		return;
+	}
+	
+	controller->retain();
+	_POLLED_CONTROLLER = controller;
+	_POLLED_ADDRESS = _device->GetAddress();
+	_POLLED_ENDPOINT = _interruptPipe->GetEndpointNumber();
+	USBLog(5, "IOUSBHIDDriver(%s)[%p]::RegisterPolledKeyboard - registered %d:%d", getName(), this, _POLLED_ADDRESS, _POLLED_ENDPOINT);
+}
+
+
+
+void
+IOUSBHIDDriver::UnregisterPolledKeyboard(void)
+{
+	IOUSBController *	controller;
+	
+	if (!_usbHIDExpansionData || !_POLLED_CONTROLLER)
+		return;
+	
+	controller = _POLLED_CONTROLLER;
+	_POLLED_CONTROLLER = NULL;
+	controller->UnregisterPolledEndpoint(_POLLED_ADDRESS, _POLLED_ENDPOINT);
+	controller->release();
+}
+
+
 #pragma mark  Bookkeeping Methods 
 //================================================================================================
 //
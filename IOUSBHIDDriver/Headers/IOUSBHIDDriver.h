@@ -141,6 +141,9 @@ class IOUSBHIDDriver : public IOHIDDevice
 		bool							_pendingRead;
 		UInt32							_deviceDeadCheckLock;			// "Lock" to prevent us from executing the device dead check while in progress
 		uint64_t						_handleReportTimeStamp;
+		IOUSBController *				_polledController;				// retained while a boot keyboard's interrupt pipe is registered for PolledRead
+		USBDeviceAddress				_polledAddress;
+		UInt8							_polledEndpoint;
     };
     IOUSBHIDDriverExpansionData *_usbHIDExpansionData;
     
@@ -237,6 +240,8 @@ private:
 	IOReturn			SetProtocol(UInt32 protocolType);
 	char				GetHexChar(char hexChar);
 	IOReturn			AbortAndSuspend( bool suspend );
+	void				RegisterPolledKeyboard(void);
+	void				UnregisterPolledKeyboard(void);
 	
         
 
@@ -108,6 +108,7 @@ IOUSBInterfaceClass::IOUSBInterfaceClass()
 	fConfigLength(0),
 	fInterfaceDescriptor(NULL),
 	fConfigurations(NULL),
+	fConfigIndexes(NULL),
 	fConfigDescCacheValid(false),
 	fCurrentConfigIndex(0),
 	fNeedContiguousMemoryForLowLatencyIsoch(0),
@@ -121,7 +122,7 @@ IOUSBInterfaceClass::IOUSBInterfaceClass()
 	
 	DEBUGPRINT("IOUSBInterfaceClass[%p]::IOUSBInterfaceClass\n", this);
 #ifdef SUPPORTS_SS_USB
-    fUSBInterface.pseudoVTable = (IUnknownVTbl *)  &sUSBInterfaceInterfaceV500;
+    fUSBInterface.pseudoVTable = (IUnknownVTbl *)  &sUSBInterfaceInterfaceV550;
 #else
     fUSBInterface.pseudoVTable = (IUnknownVTbl *)  &sUSBInterfaceInterfaceV300;
 #endif
@@ -144,6 +145,16 @@ IOUSBInterfaceClass::~IOUSBInterfaceClass()
         fConfigurations = NULL;
 		fConfigDescCacheValid = false;
     }
+	
+	if (fConfigIndexes)
+	{
+		int i;
+		for (i=0; i< fNumConfigurations; i++)
+			fConfigIndexes[i].Destroy();
+		
+		free(fConfigIndexes);
+		fConfigIndexes = NULL;
+	}
 
     if (fConnection) 
 	{
@@ -200,6 +211,7 @@ IOUSBInterfaceClass::queryInterface(REFIID iid, void **ppv)
              || CFEqual(uuid, kIOUSBInterfaceInterfaceID)
 #ifdef SUPPORTS_SS_USB
 			 || CFEqual(uuid, kIOUSBInterfaceInterfaceID500)
+			 || CFEqual(uuid, kIOUSBInterfaceInterfaceID550)
 #endif
 			 )
     {
@@ -466,6 +478,14 @@ IOUSBInterfaceClass::GetPropertyInfo(void)
 			{
 				fConfigurations = (IOUSBConfigurationDescriptorPtr*) malloc(fNumConfigurations * sizeof(IOUSBConfigurationDescriptorPtr));
 				bzero(fConfigurations, fNumConfigurations * sizeof(IOUSBConfigurationDescriptorPtr));
+				
+				fConfigIndexes = (IOUSBDescriptorIndex *) malloc(fNumConfigurations * sizeof(IOUSBDescriptorIndex));
+				if (fConfigIndexes)
+				{
+					int i;
+					for (i = 0; i < fNumConfigurations; i++)
+						fConfigIndexes[i].Init();
+				}
 			}
 			
 			val = CFDictionaryGetValue(entryProperties, CFSTR(kUSBControllerNeedsContiguousMemoryForIsoch));
@@ -1573,6 +1593,157 @@ IOUSBInterfaceClass::GetPipePropertiesV2(UInt8 pipeRef, UInt8 *direction, UInt8
 }
 #endif
 
+#ifdef SUPPORTS_SS_USB
+IOReturn
+IOUSBInterfaceClass::RegisterBuffer(void *buffer, UInt64 size, UInt32 direction, UInt64 *bufferHandle)
+{
+    uint64_t			input[3];
+    uint64_t			output[1];
+    uint32_t			outLen = 1;
+    IOReturn			ret;
+	
+	DEBUGPRINT("IOUSBInterfaceClass[%p]::RegisterBuffer  buffer: %p, size: %" PRIu64 ", direction: %" PRIu32 "\n", this, buffer, (uint64_t) size, (uint32_t) direction);
+	
+	if (!bufferHandle)
+		return kIOReturnBadArgument;
+	*bufferHandle = 0;
+	
+    ALLCHECKS();
+	
+	input[0] = (uint64_t) buffer;
+	input[1] = (uint64_t) size;
+	input[2] = (uint64_t) direction;
+	output[0] = 0;
+	
+	ret = IOConnectCallScalarMethod( fConnection, kUSBInterfaceUserClientRegisterBuffer, input, 3, output, &outLen);
+    if (ret == kIOReturnSuccess)
+    {
+		*bufferHandle = (UInt64) output[0];
+    }
+    else if (ret == MACH_SEND_INVALID_DEST)
+    {
+		fIsOpen = false;
+		fInterfaceIsAttached = false;
+		ret = kIOReturnNoDevice;
+    }
+	
+	DEBUGPRINT("IOUSBInterfaceClass[%p]::RegisterBuffer returning 0x%x, handle: %" PRIu64 "\n", this, ret, (uint64_t) *bufferHandle);
+	
+	return ret;
+}
+
+
+
+IOReturn
+IOUSBInterfaceClass::UnregisterBuffer(UInt64 bufferHandle)
+{
+    uint64_t			input[1];
+    IOReturn			ret;
+	
+	DEBUGPRINT("IOUSBInterfaceClass[%p]::UnregisterBuffer  handle: %" PRIu64 "\n", this, (uint64_t) bufferHandle);
+	
+    ALLCHECKS();
+	
+	input[0] = (uint64_t) bufferHandle;
+	
+	ret = IOConnectCallScalarMethod( fConnection, kUSBInterfaceUserClientUnregisterBuffer, input, 1, 0, 0);
+    if (ret == MACH_SEND_INVALID_DEST)
+    {
+		fIsOpen = false;
+		fInterfaceIsAttached = false;
+		ret = kIOReturnNoDevice;
+    }
+	
+	DEBUGPRINT("IOUSBInterfaceClass[%p]::UnregisterBuffer returning 0x%x\n", this, ret);
+	
+	return ret;
+}
+
+
+
+IOReturn
+IOUSBInterfaceClass::ReadPipeRegisteredAsync(UInt8 pipeRef, UInt64 bufferHandle, UInt64 offset, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refCon)
+{
+	io_async_ref64_t    asyncRef;
+    IOReturn			ret;
+    uint64_t			input[6];
+	
+    if (!fAsyncPort)
+	{
+		DEBUGPRINT("IOUSBInterfaceClass[%p]::ReadPipeRegisteredAsync  NO async port\n", this);
+        return kIOUSBNoAsyncPortErr;
+	}
+	
+	DEBUGPRINT("IOUSBInterfaceClass[%p]::ReadPipeRegisteredAsync to pipe %d, handle: %" PRIu64 ", offset: %" PRIu64 ", length %" PRIu32 ", noDataTimeout: %" PRIu32 ", completionTimeout %" PRIu32 ", refCon: %p\n", this, pipeRef, (uint64_t) bufferHandle, (uint64_t) offset, (uint32_t) size, (uint32_t) noDataTimeout, (uint32_t) completionTimeout, refCon);
+	
+    ALLCHECKS();
+	
+	input[0] = (uint64_t) pipeRef;
+	input[1] = (uint64_t) noDataTimeout;
+	input[2] = (uint64_t) completionTimeout;
+	input[3] = (uint64_t) bufferHandle;
+	input[4] = (uint64_t) offset;
+	input[5] = (uint64_t) size;
+	
+    asyncRef[kIOAsyncCalloutFuncIndex] = (uint64_t) callback;
+    asyncRef[kIOAsyncCalloutRefconIndex] = (uint64_t) refCon;
+	
+	ret = IOConnectCallAsyncScalarMethod( fConnection, kUSBInterfaceUserClientReadPipeRegistered, IONotificationPortGetMachPort(fAsyncPort), asyncRef, kIOAsyncCalloutCount, input, 6, 0, 0);
+    if (ret == MACH_SEND_INVALID_DEST)
+    {
+		fIsOpen = false;
+		fInterfaceIsAttached = false;
+		ret = kIOReturnNoDevice;
+    }
+	
+	DEBUGPRINT("IOUSBInterfaceClass[%p]::ReadPipeRegisteredAsync returning 0x%x\n", this, ret);
+	
+	return ret;
+}
+
+
+
+IOReturn
+IOUSBInterfaceClass::WritePipeRegisteredAsync(UInt8 pipeRef, UInt64 bufferHandle, UInt64 offset, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refCon)
+{
+	io_async_ref64_t    asyncRef;
+    IOReturn			ret;
+    uint64_t			input[6];
+	
+    if (!fAsyncPort)
+	{
+		DEBUGPRINT("IOUSBInterfaceClass[%p]::WritePipeRegisteredAsync  NO async port\n", this);
+        return kIOUSBNoAsyncPortErr;
+	}
+	
+	DEBUGPRINT("IOUSBInterfaceClass[%p]::WritePipeRegisteredAsync to pipe %d, handle: %" PRIu64 ", offset: %" PRIu64 ", length %" PRIu32 ", noDataTimeout: %" PRIu32 ", completionTimeout %" PRIu32 ", refCon: %p\n", this, pipeRef, (uint64_t) bufferHandle, (uint64_t) offset, (uint32_t) size, (uint32_t) noDataTimeout, (uint32_t) completionTimeout, refCon);
+	
+    ALLCHECKS();
+	
+	input[0] = (uint64_t) pipeRef;
+	input[1] = (uint64_t) noDataTimeout;
+	input[2] = (uint64_t) completionTimeout;
+	input[3] = (uint64_t) bufferHandle;
+	input[4] = (uint64_t) offset;
+	input[5] = (uint64_t) size;
+	
+    asyncRef[kIOAsyncCalloutFuncIndex] = (uint64_t) callback;
+    asyncRef[kIOAsyncCalloutRefconIndex] = (uint64_t) refCon;
+	
+	ret = IOConnectCallAsyncScalarMethod( fConnection, kUSBInterfaceUserClientWritePipeRegistered, IONotificationPortGetMachPort(fAsyncPort), asyncRef, kIOAsyncCalloutCount, input, 6, 0, 0);
+    if (ret == MACH_SEND_INVALID_DEST)
+    {
+		fIsOpen = false;
+		fInterfaceIsAttached = false;
+		ret = kIOReturnNoDevice;
+    }
+	
+	DEBUGPRINT("IOUSBInterfaceClass[%p]::WritePipeRegisteredAsync returning 0x%x\n", this, ret);
+	
+	return ret;
+}
+#endif
+
 IOReturn
 IOUSBInterfaceClass::GetPipeStatus(UInt8 pipeRef)
 {
@@ -2465,6 +2636,10 @@ IOUSBInterfaceClass::CacheConfigDescriptor()
         *((char*)configPtr + configSize) = 0;
         *((char*)configPtr + configSize + 1) = 0;
         fConfigurations[i] = configPtr;
+		
+		// and index it, so that FindNextDescriptor and FindNextAssociatedDescriptor don't have to walk it every time
+		if (fConfigIndexes)
+			fConfigIndexes[i].Build(configPtr, configSize);
     }
 	
     if ( kr == kIOReturnSuccess )
@@ -2555,6 +2730,15 @@ IOUSBInterfaceClass::FindNextDescriptor(const void * startDescriptor, UInt8 desc
 		// OK, we have a descritpor within our configuration descriptor
         descriptorHeader = (IOUSBDescriptorHeader *)startDescriptor;
     }
+	
+	// If the configuration has been indexed, the index knows where the next one is
+	if (fConfigIndexes)
+	{
+		const IOUSBDescriptorHeader *	next;
+		
+		if (fConfigIndexes[fCurrentConfigIndex].FindNext(descriptorHeader, descType, &next))
+			return next;
+	}
 
 	// Now, look through all the descriptors in this configuration, looking for the next one after the starting one
     do
@@ -2641,6 +2825,18 @@ IOUSBInterfaceClass::FindNextAssociatedDescriptor(const void * currentDescriptor
 
     next = ( const IOUSBDescriptorHeader *) currentDescriptor;
 
+	// If the configuration has been indexed, the index knows where this interface's descriptors end
+	if (fConfigIndexes && (currentDescriptor != NULL))
+	{
+		const IOUSBDescriptorHeader *	indexed;
+		
+		if (fConfigIndexes[fCurrentConfigIndex].FindNextAssociated(currentDescriptor, descriptorType, fInterfaceNumber, &indexed))
+		{
+			DEBUGPRINT("IOUSBInterfaceClass::FindNextAssociatedDescriptor returning %p from the index\n", indexed);
+			return (IOUSBDescriptorHeader *)indexed;
+		}
+	}
+	
     while (true)
     {
         next = FindNextDescriptor(next, kUSBAnyDesc);
@@ -2694,8 +2890,8 @@ IOUSBInterfaceClass::sIOCFPlugInInterfaceV1 = {
 
 
 #ifdef SUPPORTS_SS_USB
-IOUSBInterfaceStruct500 
-IOUSBInterfaceClass::sUSBInterfaceInterfaceV500 = {
+IOUSBInterfaceStruct550 
+IOUSBInterfaceClass::sUSBInterfaceInterfaceV550 = {
 #else
 	IOUSBInterfaceStruct300 
 	IOUSBInterfaceClass::sUSBInterfaceInterfaceV300 = {
@@ -2768,7 +2964,12 @@ IOUSBInterfaceClass::sUSBInterfaceInterfaceV500 = {
     &IOUSBInterfaceClass::interfaceGetBusFrameNumberWithTime,
 #ifdef SUPPORTS_SS_USB
     // ---------- new with 5.0.0
-    &IOUSBInterfaceClass::interfaceGetPipePropertiesV2
+    &IOUSBInterfaceClass::interfaceGetPipePropertiesV2,
+    // ---------- new with 5.5.0
+    &IOUSBInterfaceClass::interfaceRegisterBuffer,
+    &IOUSBInterfaceClass::interfaceUnregisterBuffer,
+    &IOUSBInterfaceClass::interfaceReadPipeRegisteredAsync,
+    &IOUSBInterfaceClass::interfaceWritePipeRegisteredAsync
 #endif
 };
 
@@ -3048,6 +3249,23 @@ IOReturn
 IOUSBInterfaceClass::interfaceGetPipePropertiesV2(void *self, UInt8 pipeRef, UInt8 *direction, UInt8 *address, UInt8 *attributes, 
 												UInt16 *maxpacketSize, UInt8 *interval, UInt8 *maxBurst, UInt8 *mult, UInt16 *bytesPerInterval)
 { return getThis(self)->GetPipePropertiesV2(pipeRef, direction, address, attributes, maxpacketSize, interval, maxBurst, mult, bytesPerInterval); }
+
+//--------------- added in 5.5.0
+IOReturn
+IOUSBInterfaceClass::interfaceRegisterBuffer(void *self, void *buffer, UInt64 size, UInt32 direction, UInt64 *bufferHandle)
+{ return getThis(self)->RegisterBuffer(buffer, size, direction, bufferHandle); }
+
+IOReturn
+IOUSBInterfaceClass::interfaceUnregisterBuffer(void *self, UInt64 bufferHandle)
+{ return getThis(self)->UnregisterBuffer(bufferHandle); }
+
+IOReturn
+IOUSBInterfaceClass::interfaceReadPipeRegisteredAsync(void *self, UInt8 pipeRef, UInt64 bufferHandle, UInt64 offset, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refcon)
+{ return getThis(self)->ReadPipeRegisteredAsync(pipeRef, bufferHandle, offset, size, noDataTimeout, completionTimeout, callback, refcon); }
+
+IOReturn
+IOUSBInterfaceClass::interfaceWritePipeRegisteredAsync(void *self, UInt8 pipeRef, UInt64 bufferHandle, UInt64 offset, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refcon)
+{ return getThis(self)->WritePipeRegisteredAsync(pipeRef, bufferHandle, offset, size, noDataTimeout, completionTimeout, callback, refcon); }
 #endif
 
 
@@ -26,6 +26,7 @@
 
 #include <IOKit/usb/IOUSBLib.h>
 #include <IOKit/usb/USB.h>
+#include <IOKit/usb/IOUSBDescriptorIndex.h>
 #include <asl.h>
 
 #include <AvailabilityMacros.h>
@@ -60,7 +61,7 @@ protected:
 
     static IOCFPlugInInterface			sIOCFPlugInInterfaceV1;
 #ifdef SUPPORTS_SS_USB
-    static IOUSBInterfaceInterface500  	sUSBInterfaceInterfaceV500;
+    static IOUSBInterfaceInterface550  	sUSBInterfaceInterfaceV550;
 #else
     static IOUSBInterfaceInterface300  	sUSBInterfaceInterfaceV300;
 #endif
@@ -93,6 +94,7 @@ protected:
     UInt32								fConfigLength;
     IOUSBInterfaceDescriptorPtr			fInterfaceDescriptor;
     IOUSBConfigurationDescriptorPtr		*fConfigurations;
+	IOUSBDescriptorIndex				*fConfigIndexes;			// one per fConfigurations entry, built by CacheConfigDescriptor
     bool								fConfigDescCacheValid;
 	UInt8								fCurrentConfigIndex;
 	bool								fNeedContiguousMemoryForLowLatencyIsoch;
@@ -172,6 +174,11 @@ public:
 #ifdef SUPPORTS_SS_USB
     // ----- new with 5.0.0
 	virtual IOReturn					GetPipePropertiesV2(UInt8 pipeRef, UInt8 *direction, UInt8 *address, UInt8 *attributes, UInt16 *maxpacketSize, UInt8 *interval, UInt8 *maxBurst, UInt8 *mult, UInt16 *bytesPerInterval);
+    // ----- new with 5.5.0
+	virtual IOReturn					RegisterBuffer(void *buffer, UInt64 size, UInt32 direction, UInt64 *bufferHandle);
+	virtual IOReturn					UnregisterBuffer(UInt64 bufferHandle);
+	virtual IOReturn					ReadPipeRegisteredAsync(UInt8 pipeRef, UInt64 bufferHandle, UInt64 offset, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refCon);
+	virtual IOReturn					WritePipeRegisteredAsync(UInt8 pipeRef, UInt64 bufferHandle, UInt64 offset, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refCon);
 #endif
 private:
     IOReturn							GetPropertyInfo(void);
@@ -253,6 +260,11 @@ protected:
 #ifdef SUPPORTS_SS_USB
    // ----------------- added in 5.0.0
     static IOReturn				interfaceGetPipePropertiesV2(void *self, UInt8 pipeRef, UInt8 *direction, UInt8 *address, UInt8 *attributes,  UInt16 *maxpacketSize, UInt8 *interval, UInt8 *maxBurst, UInt8 *mult, UInt16 *bytesPerInterval);
+   // ----------------- added in 5.5.0
+    static IOReturn				interfaceRegisterBuffer(void *self, void *buffer, UInt64 size, UInt32 direction, UInt64 *bufferHandle);
+    static IOReturn				interfaceUnregisterBuffer(void *self, UInt64 bufferHandle);
+    static IOReturn				interfaceReadPipeRegisteredAsync(void *self, UInt8 pipeRef, UInt64 bufferHandle, UInt64 offset, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refcon);
+    static IOReturn				interfaceWritePipeRegisteredAsync(void *self, UInt8 pipeRef, UInt64 bufferHandle, UInt64 offset, UInt32 size, UInt32 noDataTimeout, UInt32 completionTimeout, IOAsyncCallback1 callback, void *refcon);
 #endif
 };
 
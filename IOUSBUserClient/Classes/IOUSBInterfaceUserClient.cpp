@@ -28,6 +28,8 @@
 //================================================================================================
 //
 
+#include <mach/vm_param.h>
+
 #include <IOKit/usb/IOUSBControllerV3.h>
 #include <IOKit/IOKitKeys.h>
 
@@ -50,6 +52,8 @@
 #define FOPENED_FOR_EXCLUSIVEACCESS					fIOUSBInterfaceUserClientExpansionData->fOpenedForExclusiveAccess
 #define FDELAYED_WORKLOOP_FREE						fIOUSBInterfaceUserClientExpansionData->fDelayedWorkLoopFree
 #define FOWNER_WAS_RELEASED							fIOUSBInterfaceUserClientExpansionData->fOwnerWasReleased
+#define FPREPARED_BUFFER_CACHE						fIOUSBInterfaceUserClientExpansionData->fPreparedBufferCache
+#define FREGISTERED_BUFFERS							fIOUSBInterfaceUserClientExpansionData->fRegisteredBuffers
 
 #ifndef kIOUserClientCrossEndianKey
 #define kIOUserClientCrossEndianKey "IOUserClientCrossEndian"
@@ -73,6 +77,63 @@ __attribute__((format(printf, 1, 2)));
 #define USBLog( LEVEL, FORMAT, ARGS... )  if ((LEVEL) <= IOUSBINTERFACEUSERCLIENT_USE_KPRINTF) { kprintf( FORMAT "\n", ## ARGS ) ; }
 #define USBError( LEVEL, FORMAT, ARGS... )  { kprintf( FORMAT "\n", ## ARGS ) ; }
 #endif
+
+//================================================================================================
+//
+//   Prepared buffer cache
+//
+//	See IOUSBPreparedBufferCache.h. An entry is only reused while every page of its range still translates, in our task's
+//	pmap, to the physical page its descriptor has wired. The VM map's timestamp would be cheaper to compare, but it is
+//	private to the VM system, so a hit costs one pmap lookup per page. That is still far less than wiring the range again.
+//
+//================================================================================================
+//
+// not in the kext headers, but exported through com.apple.kpi.unsupported
+struct pmap;
+
+extern "C"
+{
+	vm_map_t		get_task_map(task_t task);
+	struct pmap *	get_task_pmap(task_t task);
+	ppnum_t			pmap_find_phys(struct pmap *pmap, addr64_t va);
+}
+
+struct IOUSBPreparedBufferCacheOps
+{
+	// context is the pmap of the task the entry's range is in
+	static bool
+	SameMapping(const IOUSBPreparedBufferCacheEntry *entry, void *context)
+	{
+		mach_vm_address_t	page = trunc_page_64(entry->address);
+		mach_vm_address_t	end = entry->address + entry->size;
+		IOByteCount			offset = 0;
+		addr64_t			physical;
+		
+		for ( ; page < end; page += PAGE_SIZE)
+		{
+			physical = entry->mem->getPhysicalSegment(offset, NULL, kIOMemoryMapperNone);
+			if (!physical || (pmap_find_phys((struct pmap *)context, page) != (ppnum_t)(physical >> PAGE_SHIFT)))
+				return false;
+			offset = (IOByteCount)(page + PAGE_SIZE - entry->address);
+		}
+		return true;
+	}
+};
+
+//================================================================================================
+//
+//   Registered buffers
+//
+//	A buffer registered by our client is wired once, when it is registered, and found by handle in a hash table for
+//	every ReadPipeRegistered/WritePipeRegistered. I/O at offset 0 uses the buffer's own descriptor, and I/O at any other
+//	offset uses an IOSubMemoryDescriptor which goes back to the buffer when the request completes, so a client cycling
+//	through its registered buffers doesn't create any descriptors once it is running. A buffer unregistered while it
+//	is in use is unlinked from the table right away, and freed when its last request returns it. The table itself is in
+//	IOUSBRegisteredBufferTable.h.
+//
+//================================================================================================
+//
+
 //=============================================================================================
 //
 //	Note on the use of IncrementOutstandingIO(), DecrementOutstandingIO() and doing extra
@@ -253,6 +314,26 @@ IOUSBInterfaceUserClientV2::sMethods[kIOUSBLibInterfaceUserClientNumCommands] =
 		8, 0
     },
 #endif
+    {	//    kUSBInterfaceUserClientRegisterBuffer
+		(IOExternalMethodAction) &IOUSBInterfaceUserClientV2::_RegisterBuffer,
+		3, 0,
+		1, 0
+    },
+    {	//    kUSBInterfaceUserClientUnregisterBuffer
+		(IOExternalMethodAction) &IOUSBInterfaceUserClientV2::_UnregisterBuffer,
+		1, 0,
+		0, 0
+    },
+    {	//    kUSBInterfaceUserClientReadPipeRegistered
+		(IOExternalMethodAction) &IOUSBInterfaceUserClientV2::_ReadPipeRegistered,
+		6, 0,
+		0, 0
+    },
+    {	//    kUSBInterfaceUserClientWritePipeRegistered
+		(IOExternalMethodAction) &IOUSBInterfaceUserClientV2::_WritePipeRegistered,
+		6, 0,
+		0, 0
+    },
 };
 
 
@@ -330,9 +411,41 @@ IOUSBInterfaceUserClientV2::ReqComplete(void *obj, void *param, IOReturn res, UI
     }
     if (pb->fMem)
     {
-		pb->fMem->complete();
-		pb->fMem->release();
+		me->ReturnPreparedBuffer(pb->fMem);
+    }
+	
+    if (!me->fDead)
+		sendAsyncResult64(pb->fAsyncRef, res, args, 1);
+	
+	releaseAsyncReference64(pb->fAsyncRef);
+    IOFree(pb, sizeof(*pb));
+    me->DecrementOutstandingIO();
+	me->release();
+}
+
+
+void
+IOUSBInterfaceUserClientV2::RegisteredReqComplete(void *obj, void *param, IOReturn res, UInt32 remaining)
+{
+    io_user_reference_t							args[1];
+    IOUSBUserClientRegisteredAsyncParamBlock *	pb = (IOUSBUserClientRegisteredAsyncParamBlock *)param;
+    IOUSBInterfaceUserClientV2 *				me = OSDynamicCast(IOUSBInterfaceUserClientV2, (OSObject*)obj);
+	
+    if (!me)
+		return;
+	
+    USBLog(7, "IOUSBInterfaceUserClientV2[%p]::RegisteredReqComplete, result = 0x%x (%s), req = %08x, remaining = %08x",  me, res, USBStringFromReturn(res), (int)pb->fMax, (int)remaining);
+	
+	if ((res == kIOReturnSuccess) || (res == kIOReturnOverrun) )
+    {
+		// Return the len done anyway, its in the buffer
+        args[0] = (io_user_reference_t)(pb->fMax - remaining);
+    }
+    else 
+    {
+        args[0] = 0;
     }
+	me->ReturnRegisteredBuffer(pb->fBuffer, pb->fMem);
 	
     if (!me->fDead)
 		sendAsyncResult64(pb->fAsyncRef, res, args, 1);
@@ -486,6 +599,38 @@ IOUSBInterfaceUserClientV2::initWithTask(task_t owningTask,void *security_id , U
         bzero(fIOUSBInterfaceUserClientExpansionData, sizeof(IOUSBInterfaceUserClientExpansionData));
     }
 	
+	// without a cache, ReadPipe/WritePipe prepare every buffer themselves
+	if (!FPREPARED_BUFFER_CACHE)
+	{
+		IOUSBPreparedBufferCache *	cache = (IOUSBPreparedBufferCache *)IOMalloc(sizeof(IOUSBPreparedBufferCache));
+		
+		if (cache)
+		{
+			bzero(cache, sizeof(IOUSBPreparedBufferCache));
+			queue_init(&cache->entries);
+			cache->lock = IOLockAlloc();
+			if (cache->lock)
+				FPREPARED_BUFFER_CACHE = cache;
+			else
+				IOFree(cache, sizeof(IOUSBPreparedBufferCache));
+		}
+	}
+	
+	// without a table, RegisterBuffer fails and clients use ReadPipe/WritePipe
+	if (!FREGISTERED_BUFFERS)
+	{
+		IOUSBRegisteredBufferTable *	table = (IOUSBRegisteredBufferTable *)IOMalloc(sizeof(IOUSBRegisteredBufferTable));
+		
+		if (table)
+		{
+			bzero(table, sizeof(IOUSBRegisteredBufferTable));
+			table->lock = IOLockAlloc();
+			if (table->lock)
+				FREGISTERED_BUFFERS = table;
+			else
+				IOFree(table, sizeof(IOUSBRegisteredBufferTable));
+		}
+	}
 	
     fTask = owningTask;
     fDead = false;
@@ -785,6 +930,11 @@ IOUSBInterfaceUserClientV2::close()
 			}
 		}
 		
+		// don't keep the client's buffers wired while the interface is closed
+		FlushPreparedBufferCache();
+		PublishPreparedBufferCacheStatistics();
+		UnregisterAllBuffers();
+		
 		if (FOPENED_FOR_EXCLUSIVEACCESS)
 		{
 			IOOptionBits	options = kUSBOptionBitOpenExclusivelyMask;
@@ -1425,25 +1575,17 @@ IOUSBInterfaceUserClientV2::ReadPipe(UInt8 pipeRef, UInt32 noDataTimeout, UInt32
 			// This is an Async request 
 			IOUSBUserClientAsyncParamBlock * pb = (IOUSBUserClientAsyncParamBlock *)completion->parameter;
 			
-			USBLog(7,"IOUSBInterfaceUserClientV2[%p]::ReadPipe (Async) creating IOMD:  buffer: 0x%qx, size: %qd", this, buffer, size); 
-			mem = IOMemoryDescriptor::withAddressRange( buffer, size, kIODirectionIn, fTask);
-			if (!mem)
-			{
-				USBLog(1,"IOUSBInterfaceUserClientV2[%p]::ReadPipe (async ) IOMemoryDescriptor::withAddressRange returned NULL",  this); 
-				USBTrace( kUSBTInterfaceUserClient,  kTPInterfaceUCReadPipe, (uintptr_t)this, size, (uintptr_t)mem, kIOReturnNoMemory );
-				ret = kIOReturnNoMemory;
-				goto Exit;
-			}
-			
-			USBLog(7,"IOUSBInterfaceUserClientV2[%p]::ReadPipe (async) created IOMD %p",  this, mem); 
-			ret = mem->prepare();
+			USBLog(7,"IOUSBInterfaceUserClientV2[%p]::ReadPipe (Async) getting prepared IOMD:  buffer: 0x%qx, size: %qd", this, buffer, size); 
+			ret = CopyPreparedBuffer(buffer, size, kIODirectionIn, &mem);
 			if ( ret != kIOReturnSuccess)
 			{
-				USBLog(3,"IOUSBInterfaceUserClientV2[%p]::ReadPipe (async) mem->prepare() returned 0x%x (%s)", this, ret, USBStringFromReturn(ret)); 
-				mem->release();
+				USBLog(3,"IOUSBInterfaceUserClientV2[%p]::ReadPipe (async) CopyPreparedBuffer returned 0x%x (%s)", this, ret, USBStringFromReturn(ret)); 
+				USBTrace( kUSBTInterfaceUserClient,  kTPInterfaceUCReadPipe, (uintptr_t)this, size, (uintptr_t)mem, ret );
 				goto Exit;
 			}
 			
+			USBLog(7,"IOUSBInterfaceUserClientV2[%p]::ReadPipe (async) using IOMD %p",  this, mem); 
+			
 			pb->fMax = size;
 			pb->fMem = mem;
 			
@@ -1453,8 +1595,7 @@ IOUSBInterfaceUserClientV2::ReadPipe(UInt8 pipeRef, UInt32 noDataTimeout, UInt32
 				USBLog(5,"IOUSBInterfaceUserClientV2[%p]::ReadPipe (async) returned 0x%x (%s)", this, ret, USBStringFromReturn(ret)); 
 				if (mem != NULL)
 				{
-					mem->complete();
-					mem->release();
+					ReturnPreparedBuffer(mem);
 				}
 			}
 		}
@@ -1689,24 +1830,16 @@ IOUSBInterfaceUserClientV2::WritePipe(UInt8 pipeRef, UInt32 noDataTimeout, UInt3
 			// This is an Async request 
 			IOUSBUserClientAsyncParamBlock * pb = (IOUSBUserClientAsyncParamBlock *)completion->parameter;
 			
-			mem = IOMemoryDescriptor::withAddressRange( buffer, size, kIODirectionOut, fTask);
-			if (!mem)
-			{
-				USBLog(1,"IOUSBInterfaceUserClientV2[%p]::WritePipe (async ) IOMemoryDescriptor::withAddressRange returned NULL",  this); 
-				USBTrace( kUSBTInterfaceUserClient,  kTPInterfaceUCWritePipe, (uintptr_t)this, size, (uintptr_t)mem, kIOReturnNoMemory );
-				ret = kIOReturnNoMemory;
-				goto Exit;
-			}
-
-			USBLog(7,"IOUSBInterfaceUserClientV2[%p]::WritePipe (async) created IOMD %p",  this, mem); 
-			ret = mem->prepare();
+			ret = CopyPreparedBuffer(buffer, size, kIODirectionOut, &mem);
 			if ( ret != kIOReturnSuccess)
 			{
-				USBLog(3,"IOUSBInterfaceUserClientV2[%p]::WritePipe (async) mem->prepare() returned 0x%x (%s)", this, ret, USBStringFromReturn(ret)); 
-				mem->release();
+				USBLog(3,"IOUSBInterfaceUserClientV2[%p]::WritePipe (async) CopyPreparedBuffer returned 0x%x (%s)", this, ret, USBStringFromReturn(ret)); 
+				USBTrace( kUSBTInterfaceUserClient,  kTPInterfaceUCWritePipe, (uintptr_t)this, size, (uintptr_t)mem, ret );
 				goto Exit;
 			}
 
+			USBLog(7,"IOUSBInterfaceUserClientV2[%p]::WritePipe (async) using IOMD %p",  this, mem); 
+
 			pb->fMax = size;
 			pb->fMem = mem;
 			
@@ -1716,8 +1849,7 @@ IOUSBInterfaceUserClientV2::WritePipe(UInt8 pipeRef, UInt32 noDataTimeout, UInt3
 				USBLog(5,"IOUSBInterfaceUserClientV2[%p]::WritePipe (async) returned 0x%x (%s)", this, ret, USBStringFromReturn(ret)); 
 				if (mem != NULL)
 				{
-					mem->complete();
-					mem->release();
+					ReturnPreparedBuffer(mem);
 				}
 			}
 		}
@@ -4284,6 +4416,10 @@ IOUSBInterfaceUserClientV2::ReleaseWorkLoopAndGate()
         ReleasePreparedDescriptors();
     }
 	
+	// and unwire the buffers ReadPipe/WritePipe kept prepared, and the ones our client registered
+	FlushPreparedBufferCache();
+	UnregisterAllBuffers();
+	
 	// IOCommandPool::free() requires the workloop, so don't call it from free().
     if ( fFreeUSBLowLatencyCommandPool )
     {
@@ -4316,6 +4452,722 @@ IOUSBInterfaceUserClientV2::ReleaseWorkLoopAndGate()
 	}
 }
 
+#pragma mark Prepared Buffer Cache
+
+//================================================================================================
+//
+//   ReleasePreparedBufferCacheEntries
+//
+//	Unwires and frees the entries which left the cache, once the cache's lock is dropped.
+//
+//================================================================================================
+//
+static void
+ReleasePreparedBufferCacheEntries(queue_head_t *released)
+{
+	IOUSBPreparedBufferCacheEntry *	entry;
+	
+	while (!queue_empty(released))
+	{
+		queue_remove_first(released, entry, IOUSBPreparedBufferCacheEntry *, link);
+		entry->mem->complete();
+		entry->mem->release();
+		IOFree(entry, sizeof(IOUSBPreparedBufferCacheEntry));
+	}
+}
+
+
+
+//================================================================================================
+//
+//   CopyPreparedBuffer
+//
+//	Returns a retained, prepared descriptor for a range of our task's memory, from the cache if it has one. The caller
+//	gives it back with ReturnPreparedBuffer, never with complete()/release().
+//
+//================================================================================================
+//
+IOReturn
+IOUSBInterfaceUserClientV2::CopyPreparedBuffer(mach_vm_address_t buffer, mach_vm_size_t size, IODirection direction, IOMemoryDescriptor **memOut)
+{
+	IOUSBPreparedBufferCache *		cache = fIOUSBInterfaceUserClientExpansionData ? FPREPARED_BUFFER_CACHE : NULL;
+	IOUSBPreparedBufferCacheEntry *	entry;
+	IOUSBPreparedBufferCacheEntry *	newEntry = NULL;
+	IOMemoryDescriptor *			mem;
+	vm_map_t						map = NULL;
+	queue_head_t					released;
+	bool							publish = false;
+	IOReturn						ret;
+	
+	*memOut = NULL;
+	queue_init(&released);
+	
+	if (cache)
+	{
+		map = get_task_map(fTask);
+		
+		IOLockLock(cache->lock);
+		entry = IOUSBPreparedBufferCacheLookupLocked<IOUSBPreparedBufferCacheOps>(cache, map, buffer, size, direction, get_task_pmap(fTask), &released);
+		if (entry)
+		{
+			if (++cache->hitsSincePublish >= kUSBPreparedBufferCacheStatisticsInterval)
+			{
+				cache->hitsSincePublish = 0;
+				publish = true;
+			}
+			mem = entry->mem;
+			mem->retain();
+			IOLockUnlock(cache->lock);
+			
+			if (publish)
+				PublishPreparedBufferCacheStatistics();
+			*memOut = mem;
+			return kIOReturnSuccess;
+		}
+		IOLockUnlock(cache->lock);
+		
+		// a stale entry nobody was using
+		ReleasePreparedBufferCacheEntries(&released);
+	}
+	
+	mem = IOMemoryDescriptor::withAddressRange(buffer, size, direction, fTask);
+	if (!mem)
+	{
+		USBLog(1,"IOUSBInterfaceUserClientV2[%p]::CopyPreparedBuffer IOMemoryDescriptor::withAddressRange returned NULL",  this);
+		return kIOReturnNoMemory;
+	}
+	
+	ret = mem->prepare();
+	if ( ret != kIOReturnSuccess)
+	{
+		USBLog(3,"IOUSBInterfaceUserClientV2[%p]::CopyPreparedBuffer mem->prepare() returned 0x%x (%s)", this, ret, USBStringFromReturn(ret));
+		mem->release();
+		return ret;
+	}
+	*memOut = mem;
+	
+	if (!cache || (size > kUSBPreparedBufferCacheMaxWiredBytes))
+		return kIOReturnSuccess;
+	
+	newEntry = (IOUSBPreparedBufferCacheEntry *)IOMalloc(sizeof(IOUSBPreparedBufferCacheEntry));
+	if (!newEntry)
+		return kIOReturnSuccess;
+	bzero(newEntry, sizeof(IOUSBPreparedBufferCacheEntry));
+	newEntry->map = map;
+	newEntry->address = buffer;
+	newEntry->size = size;
+	newEntry->direction = direction;
+	newEntry->mem = mem;
+	newEntry->useCount = 1;
+	
+	IOLockLock(cache->lock);
+	if (IOUSBPreparedBufferCacheInsertLocked(cache, newEntry, &released))
+	{
+		// the cache keeps the prepare and the reference from withAddressRange, the caller gets its own reference
+		mem->retain();
+		newEntry = NULL;
+	}
+	IOLockUnlock(cache->lock);
+	
+	if (newEntry)
+		IOFree(newEntry, sizeof(IOUSBPreparedBufferCacheEntry));
+	
+	ReleasePreparedBufferCacheEntries(&released);
+	
+	PublishPreparedBufferCacheStatistics();
+	
+	return kIOReturnSuccess;
+}
+
+
+
+//================================================================================================
+//
+//   ReturnPreparedBuffer
+//
+//================================================================================================
+//
+void
+IOUSBInterfaceUserClientV2::ReturnPreparedBuffer(IOMemoryDescriptor *mem)
+{
+	IOUSBPreparedBufferCache *		cache = fIOUSBInterfaceUserClientExpansionData ? FPREPARED_BUFFER_CACHE : NULL;
+	queue_head_t					released;
+	bool							cached = false;
+	
+	queue_init(&released);
+	
+	if (cache)
+	{
+		IOLockLock(cache->lock);
+		cached = IOUSBPreparedBufferCacheReturnLocked(cache, mem, &released);
+		IOLockUnlock(cache->lock);
+		
+		ReleasePreparedBufferCacheEntries(&released);
+	}
+	
+	// a buffer which never made it into the cache is the caller's to unwire
+	if (!cached)
+		mem->complete();
+	mem->release();
+}
+
+
+
+//================================================================================================
+//
+//   FlushPreparedBufferCache
+//
+//================================================================================================
+//
+void
+IOUSBInterfaceUserClientV2::FlushPreparedBufferCache(void)
+{
+	IOUSBPreparedBufferCache *		cache = fIOUSBInterfaceUserClientExpansionData ? FPREPARED_BUFFER_CACHE : NULL;
+	queue_head_t					released;
+	
+	if (!cache)
+		return;
+	
+	queue_init(&released);
+	
+	IOLockLock(cache->lock);
+	IOUSBPreparedBufferCacheFlushLocked(cache, &released);
+	IOLockUnlock(cache->lock);
+	
+	ReleasePreparedBufferCacheEntries(&released);
+}
+
+
+
+//================================================================================================
+//
+//   PublishPreparedBufferCacheStatistics
+//
+//================================================================================================
+//
+void
+IOUSBInterfaceUserClientV2::PublishPreparedBufferCacheStatistics(void)
+{
+	IOUSBPreparedBufferCache *		cache = fIOUSBInterfaceUserClientExpansionData ? FPREPARED_BUFFER_CACHE : NULL;
+	static const char *				names[7] = { "Hits", "Misses", "Stale", "Evictions", "Uncached", "Entries", "WiredBytes" };
+	UInt64							values[7];
+	OSDictionary *					dict;
+	OSNumber *						num;
+	int								i;
+	
+	if (!cache)
+		return;
+	
+	IOLockLock(cache->lock);
+	values[0] = cache->hits;
+	values[1] = cache->misses;
+	values[2] = cache->stale;
+	values[3] = cache->evictions;
+	values[4] = cache->uncached;
+	values[5] = cache->entryCount;
+	values[6] = cache->wiredBytes;
+	IOLockUnlock(cache->lock);
+	
+	dict = OSDictionary::withCapacity(7);
+	if (!dict)
+		return;
+	
+	for (i=0; i < 7; i++)
+	{
+		num = OSNumber::withNumber(values[i], 64);
+		if (num)
+		{
+			dict->setObject(names[i], num);
+			num->release();
+		}
+	}
+	setProperty(kUSBPreparedBufferCacheKey, dict);
+	dict->release();
+}
+
+
+
+#pragma mark Registered Buffers
+
+//================================================================================================
+//
+//   _RegisterBuffer
+//
+//	scalarInput[0] is the buffer's address in our client's task, [1] its size and [2] the direction it will be used
+//	in (kUSBIn, kUSBOut or kUSBAnyDirn). The handle for the buffer comes back in scalarOutput[0].
+//
+//================================================================================================
+//
+IOReturn IOUSBInterfaceUserClientV2::_RegisterBuffer(IOUSBInterfaceUserClientV2 * target, void * reference, IOExternalMethodArguments * arguments)
+{
+#pragma unused (reference)
+	IODirection		direction;
+	IOReturn		ret;
+	
+    USBLog(7, "+IOUSBInterfaceUserClientV2[%p]::_RegisterBuffer",  target);
+	
+	switch (arguments->scalarInput[2])
+	{
+		case kUSBIn:
+			direction = kIODirectionIn;
+			break;
+		case kUSBOut:
+			direction = kIODirectionOut;
+			break;
+		case kUSBAnyDirn:
+			direction = kIODirectionInOut;
+			break;
+		default:
+			return kIOReturnBadArgument;
+	}
+	
+	target->retain();
+	ret = target->RegisterBuffer((mach_vm_address_t) arguments->scalarInput[0], (mach_vm_size_t) arguments->scalarInput[1], direction, &(arguments->scalarOutput[0]));
+	target->release();
+	
+	return ret;
+}
+
+IOReturn
+IOUSBInterfaceUserClientV2::RegisterBuffer(mach_vm_address_t buffer, mach_vm_size_t size, IODirection direction, uint64_t *handle)
+{
+	IOUSBRegisteredBufferTable *	table = fIOUSBInterfaceUserClientExpansionData ? FREGISTERED_BUFFERS : NULL;
+	IOUSBRegisteredBuffer *			entry = NULL;
+	IOMemoryDescriptor *			mem = NULL;
+	IOReturn						ret = kIOReturnSuccess;
+	
+    USBLog(7, "+IOUSBInterfaceUserClientV2[%p]::RegisterBuffer (buffer: 0x%qx, size: %qd, direction: %d)",  this, buffer, size, (int)direction);
+	
+	*handle = 0;
+	
+	if (!fOwner || isInactive())
+		return kIOReturnNotAttached;
+	
+	if (!table)
+		return kIOReturnNoResources;
+	
+	if ((size == 0) || (size > kUSBRegisteredBufferMaxWiredBytes))
+		return kIOReturnBadArgument;
+	
+	mem = IOMemoryDescriptor::withAddressRange(buffer, size, direction, fTask);
+	if (!mem)
+	{
+		USBLog(1,"IOUSBInterfaceUserClientV2[%p]::RegisterBuffer IOMemoryDescriptor::withAddressRange returned NULL",  this);
+		return kIOReturnNoMemory;
+	}
+	
+	ret = mem->prepare();
+	if ( ret != kIOReturnSuccess)
+	{
+		USBLog(3,"IOUSBInterfaceUserClientV2[%p]::RegisterBuffer mem->prepare() returned 0x%x (%s)", this, ret, USBStringFromReturn(ret));
+		mem->release();
+		return ret;
+	}
+	
+	entry = (IOUSBRegisteredBuffer *)IOMalloc(sizeof(IOUSBRegisteredBuffer));
+	if (entry)
+	{
+		bzero(entry, sizeof(IOUSBRegisteredBuffer));
+		entry->idleSubRanges = OSArray::withCapacity(kUSBRegisteredBufferMaxIdleSubRanges);
+	}
+	if (!entry || !entry->idleSubRanges)
+	{
+		if (entry)
+			IOFree(entry, sizeof(IOUSBRegisteredBuffer));
+		mem->complete();
+		mem->release();
+		return kIOReturnNoMemory;
+	}
+	entry->size = size;
+	entry->direction = direction;
+	entry->mem = mem;
+	
+	IOLockLock(table->lock);
+	if (IOUSBRegisteredBufferTableInsertLocked(table, entry))
+		*handle = entry->handle;
+	else
+		ret = kIOReturnNoResources;
+	IOLockUnlock(table->lock);
+	
+	if (ret)
+	{
+		USBLog(3,"IOUSBInterfaceUserClientV2[%p]::RegisterBuffer  too many buffers registered (%d, %qd bytes)", this, (uint32_t)table->count, table->wiredBytes);
+		entry->idleSubRanges->release();
+		IOFree(entry, sizeof(IOUSBRegisteredBuffer));
+		mem->complete();
+		mem->release();
+	}
+	
+    USBLog(7, "-IOUSBInterfaceUserClientV2[%p]::RegisterBuffer - returning 0x%x (%s), handle: %qd", this, ret, USBStringFromReturn(ret), *handle);
+	
+	return ret;
+}
+
+
+
+//================================================================================================
+//
+//   _UnregisterBuffer
+//
+//================================================================================================
+//
+IOReturn IOUSBInterfaceUserClientV2::_UnregisterBuffer(IOUSBInterfaceUserClientV2 * target, void * reference, IOExternalMethodArguments * arguments)
+{
+#pragma unused (reference)
+	IOReturn		ret;
+	
+    USBLog(7, "+IOUSBInterfaceUserClientV2[%p]::_UnregisterBuffer",  target);
+	
+	target->retain();
+	ret = target->UnregisterBuffer(arguments->scalarInput[0]);
+	target->release();
+	
+	return ret;
+}
+
+IOReturn
+IOUSBInterfaceUserClientV2::UnregisterBuffer(uint64_t handle)
+{
+	IOUSBRegisteredBufferTable *	table = fIOUSBInterfaceUserClientExpansionData ? FREGISTERED_BUFFERS : NULL;
+	IOUSBRegisteredBuffer *			entry;
+	bool							freeIt = false;
+	
+    USBLog(7, "+IOUSBInterfaceUserClientV2[%p]::UnregisterBuffer (handle: %qd)",  this, handle);
+	
+	if (!table)
+		return kIOReturnNoResources;
+	
+	IOLockLock(table->lock);
+	entry = IOUSBRegisteredBufferTableRemoveLocked(table, handle);
+	
+	// a buffer which is still in use goes away when the last request returns it
+	if (entry)
+		freeIt = (entry->useCount == 0);
+	IOLockUnlock(table->lock);
+	
+	if (!entry)
+	{
+		USBLog(3,"IOUSBInterfaceUserClientV2[%p]::UnregisterBuffer  no buffer with handle %qd", this, handle);
+		return kIOReturnBadArgument;
+	}
+	
+	if (freeIt)
+		FreeRegisteredBuffer(entry);
+	
+	return kIOReturnSuccess;
+}
+
+
+
+//================================================================================================
+//
+//   _ReadPipeRegistered, _WritePipeRegistered
+//
+//	Async only. scalarInput[0] is the pipeRef, [1] the noDataTimeout, [2] the completionTimeout, [3] the handle of a
+//	registered buffer and [4] and [5] the offset and length of the transfer within the buffer.
+//
+//================================================================================================
+//
+IOReturn IOUSBInterfaceUserClientV2::_ReadPipeRegistered(IOUSBInterfaceUserClientV2 * target, void * reference, IOExternalMethodArguments * arguments)
+{
+#pragma unused (reference)
+    USBLog(7, "+IOUSBInterfaceUserClientV2[%p]::_ReadPipeRegistered",  target);
+	
+	return _PipeRegistered(target, arguments, kIODirectionIn);
+}
+
+IOReturn IOUSBInterfaceUserClientV2::_WritePipeRegistered(IOUSBInterfaceUserClientV2 * target, void * reference, IOExternalMethodArguments * arguments)
+{
+#pragma unused (reference)
+    USBLog(7, "+IOUSBInterfaceUserClientV2[%p]::_WritePipeRegistered",  target);
+	
+	return _PipeRegistered(target, arguments, kIODirectionOut);
+}
+
+IOReturn IOUSBInterfaceUserClientV2::_PipeRegistered(IOUSBInterfaceUserClientV2 * target, IOExternalMethodArguments * arguments, IODirection direction)
+{
+	IOUSBCompletion								tap;
+	IOUSBUserClientRegisteredAsyncParamBlock *	pb;
+	IOReturn									ret;
+	
+	if ( !arguments->asyncWakePort ) 
+		return kIOReturnBadArgument;
+	
+	pb = (IOUSBUserClientRegisteredAsyncParamBlock*) IOMalloc(sizeof(IOUSBUserClientRegisteredAsyncParamBlock));
+	if (!pb) 
+		return kIOReturnNoMemory;
+	bzero(pb, sizeof(IOUSBUserClientRegisteredAsyncParamBlock));
+	
+	target->retain();
+	target->IncrementOutstandingIO();
+	
+	bcopy(arguments->asyncReference, pb->fAsyncRef, sizeof(OSAsyncReference64));
+	pb->fAsyncCount = arguments->asyncReferenceCount;
+	
+	tap.target = target;
+	tap.action = &IOUSBInterfaceUserClientV2::RegisteredReqComplete;
+	tap.parameter = pb;
+	
+	ret = target->PipeRegistered(	(UInt8) arguments->scalarInput[0],				// pipeRef
+									(UInt32) arguments->scalarInput[1],				// noDataTimeout
+									(UInt32) arguments->scalarInput[2],				// completionTimeout
+									arguments->scalarInput[3],						// buffer handle
+									(mach_vm_size_t) arguments->scalarInput[4],		// offset in the buffer
+									(mach_vm_size_t) arguments->scalarInput[5],		// length of the transfer
+									direction,
+									&tap);											// completion
+	if ( ret ) 
+	{
+		IOFree(pb, sizeof(*pb));
+		target->DecrementOutstandingIO();
+		target->release();
+	}
+	
+	return ret;
+}
+
+IOReturn
+IOUSBInterfaceUserClientV2::PipeRegistered(UInt8 pipeRef, UInt32 noDataTimeout, UInt32 completionTimeout, uint64_t handle, mach_vm_size_t offset, mach_vm_size_t length, IODirection direction, IOUSBCompletion * completion)
+{
+	IOReturn					ret = kIOReturnNotAttached;
+	IOUSBRegisteredBuffer *		buffer = NULL;
+    IOMemoryDescriptor *		mem = NULL;
+    IOUSBPipe *					pipeObj = NULL;
+	
+    USBLog(7, "+IOUSBInterfaceUserClientV2[%p]::PipeRegistered (pipeRef: %d, %d, %d, handle: %qd, offset: %qd, length: %qd, direction: %d)",  this, pipeRef, (uint32_t)noDataTimeout, (uint32_t)completionTimeout, handle, offset, length, (int)direction);
+    
+	if (fOwner && !isInactive())
+    {
+		if ((completion == NULL) || (length > 0xFFFFFFFF))
+		{
+			USBLog(1,"IOUSBInterfaceUserClientV2[%p]::PipeRegistered bad arguments (%qd, %p)",  this, length, completion); 
+			ret = kIOReturnBadArgument;
+			goto Exit;
+		}
+		
+		pipeObj = GetPipeObj(pipeRef);
+		if (pipeObj)
+		{
+			IOUSBUserClientRegisteredAsyncParamBlock * pb = (IOUSBUserClientRegisteredAsyncParamBlock *)completion->parameter;
+			
+			ret = CopyRegisteredBuffer(handle, offset, length, direction, &buffer, &mem);
+			if ( ret != kIOReturnSuccess)
+			{
+				USBLog(3,"IOUSBInterfaceUserClientV2[%p]::PipeRegistered CopyRegisteredBuffer returned 0x%x (%s)", this, ret, USBStringFromReturn(ret)); 
+				goto Exit;
+			}
+			
+			pb->fMax = (uint32_t)length;
+			pb->fBuffer = buffer;
+			pb->fMem = mem;
+			
+			if (direction == kIODirectionIn)
+				ret = pipeObj->Read(mem, noDataTimeout, completionTimeout, (IOByteCount)length, completion, NULL);
+			else
+				ret = pipeObj->Write(mem, noDataTimeout, completionTimeout, (IOByteCount)length, completion);
+			
+			if ( ret != kIOReturnSuccess)
+			{
+				USBLog(5,"IOUSBInterfaceUserClientV2[%p]::PipeRegistered returned 0x%x (%s)", this, ret, USBStringFromReturn(ret)); 
+				ReturnRegisteredBuffer(buffer, mem);
+			}
+		}
+		else
+		{
+			USBLog(5,"IOUSBInterfaceUserClientV2[%p]::PipeRegistered can't find pipeRef, returning kIOUSBUnknownPipeErr",  this); 
+			ret = kIOUSBUnknownPipeErr;
+		}
+	}
+	else
+		ret = kIOReturnNotAttached;
+	
+Exit:
+	
+	if (pipeObj)
+		pipeObj->release();
+	
+    if (ret)
+	{
+		USBLog(3, "IOUSBInterfaceUserClientV2[%p]::PipeRegistered - returning err 0x%x (%s)", this, ret, USBStringFromReturn(ret));
+	}
+	
+	return ret;
+}
+
+
+
+//================================================================================================
+//
+//   CopyRegisteredBuffer
+//
+//	Finds a registered buffer and returns a retained descriptor for the part of it a request uses: the buffer's own
+//	descriptor if the request starts at its beginning (the pipe is given the length), or a sub range of it. Both go
+//	back with ReturnRegisteredBuffer.
+//
+//================================================================================================
+//
+IOReturn
+IOUSBInterfaceUserClientV2::CopyRegisteredBuffer(uint64_t handle, mach_vm_size_t offset, mach_vm_size_t length, IODirection direction, IOUSBRegisteredBuffer **bufferOut, IOMemoryDescriptor **memOut)
+{
+	IOUSBRegisteredBufferTable *	table = fIOUSBInterfaceUserClientExpansionData ? FREGISTERED_BUFFERS : NULL;
+	IOUSBRegisteredBuffer *			entry;
+	IOSubMemoryDescriptor *			subRange = NULL;
+	bool							useSubRange = ((offset != 0) && (length != 0));
+	IOReturn						ret = kIOReturnSuccess;
+	
+	*bufferOut = NULL;
+	*memOut = NULL;
+	
+	if (!table)
+		return kIOReturnNoResources;
+	
+	IOLockLock(table->lock);
+	entry = IOUSBRegisteredBufferTableFindLocked(table, handle);
+	if (!entry || !IOUSBRegisteredBufferAllows(entry, offset, length, direction))
+	{
+		ret = kIOReturnBadArgument;
+	}
+	else
+	{
+		entry->useCount++;
+		if (useSubRange)
+		{
+			unsigned int	count = entry->idleSubRanges->getCount();
+			
+			if (count)
+			{
+				subRange = (IOSubMemoryDescriptor *)entry->idleSubRanges->getObject(count - 1);
+				subRange->retain();
+				entry->idleSubRanges->removeObject(count - 1);
+			}
+		}
+	}
+	IOLockUnlock(table->lock);
+	
+	if (ret)
+		return ret;
+	
+	if (!useSubRange)
+	{
+		entry->mem->retain();
+		*memOut = entry->mem;
+	}
+	else
+	{
+		// the buffer's descriptor stays prepared for as long as the buffer exists, so the sub range needs no prepare of its own
+		if (subRange && !subRange->initSubRange(entry->mem, (IOByteCount)offset, (IOByteCount)length, direction))
+		{
+			subRange->release();
+			subRange = NULL;
+		}
+		if (!subRange)
+			subRange = IOSubMemoryDescriptor::withSubRange(entry->mem, (IOByteCount)offset, (IOByteCount)length, direction);
+		if (!subRange)
+		{
+			USBLog(1,"IOUSBInterfaceUserClientV2[%p]::CopyRegisteredBuffer IOSubMemoryDescriptor::withSubRange returned NULL",  this);
+			ReturnRegisteredBuffer(entry, NULL);
+			return kIOReturnNoMemory;
+		}
+		*memOut = subRange;
+	}
+	*bufferOut = entry;
+	
+	return kIOReturnSuccess;
+}
+
+
+
+//================================================================================================
+//
+//   ReturnRegisteredBuffer
+//
+//================================================================================================
+//
+void
+IOUSBInterfaceUserClientV2::ReturnRegisteredBuffer(IOUSBRegisteredBuffer *buffer, IOMemoryDescriptor *mem)
+{
+	IOUSBRegisteredBufferTable *	table = fIOUSBInterfaceUserClientExpansionData ? FREGISTERED_BUFFERS : NULL;
+	bool							freeIt = false;
+	
+	if (!table || !buffer)
+		return;
+	
+	IOLockLock(table->lock);
+	
+	// keep the sub range for the next request at an offset
+	if (mem && (mem != buffer->mem) && !buffer->unregistered && (buffer->idleSubRanges->getCount() < kUSBRegisteredBufferMaxIdleSubRanges))
+		buffer->idleSubRanges->setObject(mem);
+	
+	freeIt = IOUSBRegisteredBufferReturnLocked(buffer);
+	IOLockUnlock(table->lock);
+	
+	if (mem)
+		mem->release();
+	
+	if (freeIt)
+		FreeRegisteredBuffer(buffer);
+}
+
+
+
+//================================================================================================
+//
+//   FreeRegisteredBuffer
+//
+//	The buffer must already be unlinked from the table, and not be in use.
+//
+//================================================================================================
+//
+void
+IOUSBInterfaceUserClientV2::FreeRegisteredBuffer(IOUSBRegisteredBuffer *buffer)
+{
+	IOUSBRegisteredBufferTable *	table = FREGISTERED_BUFFERS;
+	
+	USBLog(6, "IOUSBInterfaceUserClientV2[%p]::FreeRegisteredBuffer  handle %qd, size %qd", this, buffer->handle, buffer->size);
+	
+	IOLockLock(table->lock);
+	IOUSBRegisteredBufferTableForgetLocked(table, buffer);
+	IOLockUnlock(table->lock);
+	
+	// the sub ranges hold references on the buffer's descriptor, so they go first
+	buffer->idleSubRanges->release();
+	buffer->mem->complete();
+	buffer->mem->release();
+	IOFree(buffer, sizeof(IOUSBRegisteredBuffer));
+}
+
+
+
+//================================================================================================
+//
+//   UnregisterAllBuffers
+//
+//================================================================================================
+//
+void
+IOUSBInterfaceUserClientV2::UnregisterAllBuffers(void)
+{
+	IOUSBRegisteredBufferTable *	table = fIOUSBInterfaceUserClientExpansionData ? FREGISTERED_BUFFERS : NULL;
+	IOUSBRegisteredBuffer *			entry;
+	IOUSBRegisteredBuffer *			unused;
+	
+	if (!table)
+		return;
+	
+	// buffers still in use are freed by ReturnRegisteredBuffer
+	IOLockLock(table->lock);
+	unused = IOUSBRegisteredBufferTableRemoveAllLocked(table);
+	IOLockUnlock(table->lock);
+	
+	while ((entry = unused) != NULL)
+	{
+		unused = entry->next;
+		FreeRegisteredBuffer(entry);
+	}
+}
+
+
+
 #pragma mark IOKit Methods
 
 //
@@ -4534,6 +5386,21 @@ IOUSBInterfaceUserClientV2::free()
     //
     if (fIOUSBInterfaceUserClientExpansionData)
     {
+		if (FPREPARED_BUFFER_CACHE)
+		{
+			// every request retains us, so nothing can be in use any more
+			FlushPreparedBufferCache();
+			IOLockFree(FPREPARED_BUFFER_CACHE->lock);
+			IOFree(FPREPARED_BUFFER_CACHE, sizeof(IOUSBPreparedBufferCache));
+			FPREPARED_BUFFER_CACHE = NULL;
+		}
+		if (FREGISTERED_BUFFERS)
+		{
+			UnregisterAllBuffers();
+			IOLockFree(FREGISTERED_BUFFERS->lock);
+			IOFree(FREGISTERED_BUFFERS, sizeof(IOUSBRegisteredBufferTable));
+			FREGISTERED_BUFFERS = NULL;
+		}
         IOFree(fIOUSBInterfaceUserClientExpansionData, sizeof(IOUSBInterfaceUserClientExpansionData));
         fIOUSBInterfaceUserClientExpansionData = NULL;
     }
@@ -54,6 +54,14 @@ enum
 	kMaxExtendedDataEntriesSupported = 20
 };
 
+// Async ReadPipe/WritePipe keep the user buffers they prepare wired in a per client cache, so that a client streaming
+// through the same buffers doesn't wire and unwire them for every request
+#include "IOUSBPreparedBufferCache.h"
+
+// Buffers registered with RegisterBuffer stay wired until they are unregistered or the client closes, and
+// ReadPipeRegistered/WritePipeRegistered refer to them by handle instead of creating a descriptor for every request
+#include "IOUSBRegisteredBufferTable.h"
+
 
 //================================================================================================
 //
@@ -257,6 +265,8 @@ private:
 		bool									fOpenedForExclusiveAccess;
 		bool									fDelayedWorkLoopFree;
 		bool									fOwnerWasReleased;
+		IOUSBPreparedBufferCache *				fPreparedBufferCache;
+		IOUSBRegisteredBufferTable *			fRegisteredBuffers;
     };
     
     IOUSBInterfaceUserClientExpansionData *		fIOUSBInterfaceUserClientExpansionData;
@@ -345,6 +355,19 @@ public:
 	virtual IOReturn                            WritePipe(UInt8 pipeRef, UInt32 noDataTimeout, UInt32 completionTimeout, const void *buf, UInt32 size);
 	virtual IOReturn                            WritePipe(UInt8 pipeRef, UInt32 noDataTimeout, UInt32 completionTimeout, IOMemoryDescriptor *mem);
 	
+	// registered buffers
+	//
+	static	IOReturn							_RegisterBuffer(IOUSBInterfaceUserClientV2 * target, void * reference, IOExternalMethodArguments * arguments);
+	IOReturn									RegisterBuffer(mach_vm_address_t buffer, mach_vm_size_t size, IODirection direction, uint64_t *handle);
+	
+	static	IOReturn							_UnregisterBuffer(IOUSBInterfaceUserClientV2 * target, void * reference, IOExternalMethodArguments * arguments);
+	IOReturn									UnregisterBuffer(uint64_t handle);
+	
+	static	IOReturn							_ReadPipeRegistered(IOUSBInterfaceUserClientV2 * target, void * reference, IOExternalMethodArguments * arguments);
+	static	IOReturn							_WritePipeRegistered(IOUSBInterfaceUserClientV2 * target, void * reference, IOExternalMethodArguments * arguments);
+	static	IOReturn							_PipeRegistered(IOUSBInterfaceUserClientV2 * target, IOExternalMethodArguments * arguments, IODirection direction);
+	IOReturn									PipeRegistered(UInt8 pipeRef, UInt32 noDataTimeout, UInt32 completionTimeout, uint64_t handle, mach_vm_size_t offset, mach_vm_size_t length, IODirection direction, IOUSBCompletion * completion);
+	
 	static	IOReturn							_GetPipeStatus(IOUSBInterfaceUserClientV2 * target, void * reference, IOExternalMethodArguments * arguments);
 	virtual IOReturn                            GetPipeStatus(UInt8 pipeRef);
     
@@ -411,9 +434,24 @@ public:
 	void										PrintExternalMethodArgs( IOExternalMethodArguments * arguments, UInt32 level );
 	void										ReleaseWorkLoopAndGate();
 	
+	// prepared buffer cache
+	//
+	IOReturn									CopyPreparedBuffer(mach_vm_address_t buffer, mach_vm_size_t size, IODirection direction, IOMemoryDescriptor **mem);
+	void										ReturnPreparedBuffer(IOMemoryDescriptor *mem);
+	void										FlushPreparedBufferCache(void);
+	void										PublishPreparedBufferCacheStatistics(void);
+	
+	// registered buffer table
+	//
+	IOReturn									CopyRegisteredBuffer(uint64_t handle, mach_vm_size_t offset, mach_vm_size_t length, IODirection direction, IOUSBRegisteredBuffer **buffer, IOMemoryDescriptor **mem);
+	void										ReturnRegisteredBuffer(IOUSBRegisteredBuffer *buffer, IOMemoryDescriptor *mem);
+	void										FreeRegisteredBuffer(IOUSBRegisteredBuffer *buffer);
+	void										UnregisterAllBuffers(void);
+	
     // static methods
     //
     static void                                 ReqComplete(void *obj, void *param, IOReturn status, UInt32 remaining);
+    static void                                 RegisteredReqComplete(void *obj, void *param, IOReturn status, UInt32 remaining);
     static void                                 IsoReqComplete(void *obj, void *param, IOReturn res, IOUSBIsocFrame *pFrames);
     static void                                 LowLatencyIsoReqComplete(void *obj, void *param, IOReturn res, IOUSBLowLatencyIsocFrame *pFrames);
     static IOReturn                             ChangeOutstandingIO(OSObject *target, void *arg0, void *arg1, void *arg2, void *arg3);
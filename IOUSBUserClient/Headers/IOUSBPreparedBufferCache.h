@@ -0,0 +1,216 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_IOUSBPREPAREDBUFFERCACHE_H
+#define _IOKIT_IOUSBPREPAREDBUFFERCACHE_H
+
+#include <IOKit/IOTypes.h>
+#include <IOKit/IOLocks.h>
+
+#include <kern/queue.h>
+
+//
+// The prepared buffer cache of an IOUSBInterfaceUserClientV2. The user buffers of async ReadPipe/WritePipe requests are
+// kept prepared (wired) after the request completes, so that a client streaming through the same buffers doesn't wire
+// and unwire them for every request.
+//
+// An entry is keyed by the VM map it was prepared in and by address, size and direction. A key match is only a hit if
+// Ops::SameMapping(entry, context) says every page of the range is still mapped to the page the entry's descriptor has
+// wired: a buffer which the client unmapped, and replaced with other memory at the same address, misses, and its entry
+// is dropped as stale.
+//
+// An entry is in use while requests which got it are outstanding. When the cache is over its entry count or wired byte
+// budget, the least recently used idle entries go. Entries which have to go while in use are retired, and leave when
+// their last request returns them.
+//
+// The functions ending in Locked are called with the cache's lock held. Entries which leave the cache are put on the
+// caller's released queue, for the caller to complete, release and free after it drops the lock.
+//
+
+class IOMemoryDescriptor;
+
+enum
+{
+	kUSBPreparedBufferCacheMaxEntries				= 32,
+	kUSBPreparedBufferCacheMaxWiredBytes			= 8 * 1024 * 1024,
+	kUSBPreparedBufferCacheStatisticsInterval		= 1024				// hits between updates of the statistics property
+};
+
+#define kUSBPreparedBufferCacheKey					"PreparedBufferCache"
+
+struct IOUSBPreparedBufferCacheEntry
+{
+	queue_chain_t			link;						// on the cache's list, most recently used first
+	const void *			map;						// the VM map of the task the range was prepared in
+	mach_vm_address_t		address;
+	mach_vm_size_t			size;
+	IOOptionBits			direction;
+	IOMemoryDescriptor *	mem;						// prepared, and retained by the cache
+	UInt32					useCount;
+	bool					retired;
+};
+
+struct IOUSBPreparedBufferCache
+{
+	IOLock *				lock;
+	queue_head_t			entries;
+	UInt32					entryCount;
+	UInt64					wiredBytes;
+	UInt64					hits;
+	UInt64					misses;
+	UInt64					stale;						// misses on an entry whose pages had been remapped
+	UInt64					evictions;
+	UInt64					uncached;					// misses which could not be cached because every entry was in use
+	UInt32					hitsSincePublish;
+};
+
+
+
+static inline void
+IOUSBPreparedBufferCacheUnlinkLocked(IOUSBPreparedBufferCache *cache, IOUSBPreparedBufferCacheEntry *entry, queue_head_t *released)
+{
+	queue_remove(&cache->entries, entry, IOUSBPreparedBufferCacheEntry *, link);
+	cache->entryCount--;
+	cache->wiredBytes -= entry->size;
+	queue_enter(released, entry, IOUSBPreparedBufferCacheEntry *, link);
+}
+
+
+
+// The entry for a range, counted as in use by the caller, or NULL on a miss
+template <class Ops>
+static inline IOUSBPreparedBufferCacheEntry *
+IOUSBPreparedBufferCacheLookupLocked(IOUSBPreparedBufferCache *cache, const void *map, mach_vm_address_t address, mach_vm_size_t size, IOOptionBits direction, void *context, queue_head_t *released)
+{
+	IOUSBPreparedBufferCacheEntry	*entry;
+	
+	queue_iterate(&cache->entries, entry, IOUSBPreparedBufferCacheEntry *, link)
+	{
+		if (entry->retired || (entry->map != map) || (entry->address != address) || (entry->size != size) || (entry->direction != direction))
+			continue;
+		
+		if (!Ops::SameMapping(entry, context))
+		{
+			// the client has put other memory at the address - nobody gets these pages again
+			cache->stale++;
+			if (entry->useCount == 0)
+				IOUSBPreparedBufferCacheUnlinkLocked(cache, entry, released);
+			else
+				entry->retired = true;
+			break;
+		}
+		
+		entry->useCount++;
+		queue_remove(&cache->entries, entry, IOUSBPreparedBufferCacheEntry *, link);
+		queue_enter_first(&cache->entries, entry, IOUSBPreparedBufferCacheEntry *, link);
+		cache->hits++;
+		return entry;
+	}
+	cache->misses++;
+	return NULL;
+}
+
+
+
+// Adds a freshly prepared range, in use by the caller, making room by dropping the least recently used idle entries.
+// Returns false if there is no room, and the caller keeps the entry
+static inline bool
+IOUSBPreparedBufferCacheInsertLocked(IOUSBPreparedBufferCache *cache, IOUSBPreparedBufferCacheEntry *newEntry, queue_head_t *released)
+{
+	IOUSBPreparedBufferCacheEntry	*entry;
+	IOUSBPreparedBufferCacheEntry	*victim;
+	
+	while ((cache->entryCount >= kUSBPreparedBufferCacheMaxEntries) || ((cache->wiredBytes + newEntry->size) > kUSBPreparedBufferCacheMaxWiredBytes))
+	{
+		victim = NULL;
+		for (entry = (IOUSBPreparedBufferCacheEntry *)queue_last(&cache->entries); !queue_end(&cache->entries, (queue_entry_t)entry); entry = (IOUSBPreparedBufferCacheEntry *)queue_prev(&entry->link))
+		{
+			if (entry->useCount == 0)
+			{
+				victim = entry;
+				break;
+			}
+		}
+		if (!victim)
+			break;
+		
+		IOUSBPreparedBufferCacheUnlinkLocked(cache, victim, released);
+		cache->evictions++;
+	}
+	
+	if ((cache->entryCount >= kUSBPreparedBufferCacheMaxEntries) || ((cache->wiredBytes + newEntry->size) > kUSBPreparedBufferCacheMaxWiredBytes))
+	{
+		cache->uncached++;
+		return false;
+	}
+	
+	queue_enter_first(&cache->entries, newEntry, IOUSBPreparedBufferCacheEntry *, link);
+	cache->entryCount++;
+	cache->wiredBytes += newEntry->size;
+	return true;
+}
+
+
+
+// Gives back a descriptor which a lookup or an insert handed out. Returns false if the cache doesn't have it, and the
+// caller completes it
+static inline bool
+IOUSBPreparedBufferCacheReturnLocked(IOUSBPreparedBufferCache *cache, IOMemoryDescriptor *mem, queue_head_t *released)
+{
+	IOUSBPreparedBufferCacheEntry	*entry;
+	
+	queue_iterate(&cache->entries, entry, IOUSBPreparedBufferCacheEntry *, link)
+	{
+		if (entry->mem == mem)
+		{
+			if ((--entry->useCount == 0) && entry->retired)
+				IOUSBPreparedBufferCacheUnlinkLocked(cache, entry, released);
+			return true;
+		}
+	}
+	return false;
+}
+
+
+
+// Drops the idle entries and retires the ones in use
+static inline void
+IOUSBPreparedBufferCacheFlushLocked(IOUSBPreparedBufferCache *cache, queue_head_t *released)
+{
+	IOUSBPreparedBufferCacheEntry	*entry;
+	IOUSBPreparedBufferCacheEntry	*next;
+	
+	entry = (IOUSBPreparedBufferCacheEntry *)queue_first(&cache->entries);
+	while (!queue_end(&cache->entries, (queue_entry_t)entry))
+	{
+		next = (IOUSBPreparedBufferCacheEntry *)queue_next(&entry->link);
+		if (entry->useCount == 0)
+			IOUSBPreparedBufferCacheUnlinkLocked(cache, entry, released);
+		else
+			entry->retired = true;				// still with a request - its return lets go of it
+		entry = next;
+	}
+}
+
+#endif /* _IOKIT_IOUSBPREPAREDBUFFERCACHE_H */
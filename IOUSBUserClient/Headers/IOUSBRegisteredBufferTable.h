@@ -0,0 +1,200 @@
+/*
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * Copyright (c) 1998-2007 Apple Inc.  All Rights Reserved.
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_IOUSBREGISTEREDBUFFERTABLE_H
+#define _IOKIT_IOUSBREGISTEREDBUFFERTABLE_H
+
+#include <IOKit/IOTypes.h>
+#include <IOKit/IOLocks.h>
+
+//
+// The registered buffer table of an IOUSBInterfaceUserClientV2. Buffers registered with RegisterBuffer stay wired until
+// they are unregistered or the client closes, and ReadPipeRegistered/WritePipeRegistered find them by handle in a hash
+// table instead of creating a descriptor for every request.
+//
+// Handles count up from 1 and are never reused, so a stale handle can't reach a buffer registered later. They are spread
+// over the buckets by a multiplicative hash, so that the handles a client keeps stay spread out whichever ones it
+// unregisters. A buffer unregistered while requests are using it is unlinked right away, and freed by the caller when
+// the last request returns it.
+//
+// The functions ending in Locked are called with the table's lock held.
+//
+
+class IOMemoryDescriptor;
+class OSArray;
+
+enum
+{
+	kUSBRegisteredBufferHashShift					= 6,
+	kUSBRegisteredBufferHashBuckets					= 1 << kUSBRegisteredBufferHashShift,
+	kUSBRegisteredBufferMaxCount					= 256,
+	kUSBRegisteredBufferMaxWiredBytes				= 64 * 1024 * 1024,
+	kUSBRegisteredBufferMaxIdleSubRanges			= 16				// sub range descriptors kept per buffer for I/O at an offset
+};
+
+struct IOUSBRegisteredBuffer
+{
+	IOUSBRegisteredBuffer *	next;						// in its hash bucket
+	uint64_t				handle;
+	mach_vm_size_t			size;
+	IOOptionBits			direction;
+	IOMemoryDescriptor *	mem;						// prepared for as long as the buffer exists
+	OSArray *				idleSubRanges;
+	UInt32					useCount;
+	bool					unregistered;
+};
+
+struct IOUSBRegisteredBufferTable
+{
+	IOLock *				lock;
+	IOUSBRegisteredBuffer *	buckets[kUSBRegisteredBufferHashBuckets];
+	uint64_t				lastHandle;
+	UInt32					count;						// registered buffers, and unregistered ones not freed yet
+	UInt64					wiredBytes;
+};
+
+
+
+static inline UInt32
+IOUSBRegisteredBufferBucket(uint64_t handle)
+{
+	return (UInt32)((handle * 0x9E3779B97F4A7C15ULL) >> (64 - kUSBRegisteredBufferHashShift));
+}
+
+
+
+// Gives the buffer the next handle and links it in. Returns false if the table is over its count or wired byte budget
+static inline bool
+IOUSBRegisteredBufferTableInsertLocked(IOUSBRegisteredBufferTable *table, IOUSBRegisteredBuffer *buffer)
+{
+	UInt32		bucket;
+	
+	if ((table->count >= kUSBRegisteredBufferMaxCount) || ((table->wiredBytes + buffer->size) > kUSBRegisteredBufferMaxWiredBytes))
+		return false;
+	
+	buffer->handle = ++table->lastHandle;
+	bucket = IOUSBRegisteredBufferBucket(buffer->handle);
+	buffer->next = table->buckets[bucket];
+	table->buckets[bucket] = buffer;
+	table->count++;
+	table->wiredBytes += buffer->size;
+	return true;
+}
+
+
+
+// The registered buffer with a handle, or NULL
+static inline IOUSBRegisteredBuffer *
+IOUSBRegisteredBufferTableFindLocked(IOUSBRegisteredBufferTable *table, uint64_t handle)
+{
+	IOUSBRegisteredBuffer	*buffer;
+	
+	for (buffer = table->buckets[IOUSBRegisteredBufferBucket(handle)]; buffer; buffer = buffer->next)
+	{
+		if (buffer->handle == handle)
+			break;
+	}
+	return buffer;
+}
+
+
+
+// Whether a request may use length bytes at offset in the buffer, in direction
+static inline bool
+IOUSBRegisteredBufferAllows(const IOUSBRegisteredBuffer *buffer, mach_vm_size_t offset, mach_vm_size_t length, IOOptionBits direction)
+{
+	return ((buffer->direction & direction) == direction) && (offset <= buffer->size) && (length <= (buffer->size - offset));
+}
+
+
+
+// Unlinks the buffer with a handle and marks it unregistered. Returns it, or NULL if there is none
+static inline IOUSBRegisteredBuffer *
+IOUSBRegisteredBufferTableRemoveLocked(IOUSBRegisteredBufferTable *table, uint64_t handle)
+{
+	IOUSBRegisteredBuffer	**link;
+	IOUSBRegisteredBuffer	*buffer;
+	
+	for (link = &table->buckets[IOUSBRegisteredBufferBucket(handle)]; *link; link = &(*link)->next)
+	{
+		if ((*link)->handle == handle)
+		{
+			buffer = *link;
+			*link = buffer->next;
+			buffer->next = NULL;
+			buffer->unregistered = true;
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+
+
+// Unlinks every buffer and marks it unregistered. Returns the ones nobody is using, linked through next, for the caller
+// to free - the others are freed when their last request returns them
+static inline IOUSBRegisteredBuffer *
+IOUSBRegisteredBufferTableRemoveAllLocked(IOUSBRegisteredBufferTable *table)
+{
+	IOUSBRegisteredBuffer	*buffer;
+	IOUSBRegisteredBuffer	*unused = NULL;
+	int						i;
+	
+	for (i = 0; i < kUSBRegisteredBufferHashBuckets; i++)
+	{
+		while ((buffer = table->buckets[i]) != NULL)
+		{
+			table->buckets[i] = buffer->next;
+			buffer->next = NULL;
+			buffer->unregistered = true;
+			if (buffer->useCount == 0)
+			{
+				buffer->next = unused;
+				unused = buffer;
+			}
+		}
+	}
+	return unused;
+}
+
+
+
+// Counts a request's use of the buffer as over. Returns true if the buffer was unregistered and the caller frees it now
+static inline bool
+IOUSBRegisteredBufferReturnLocked(IOUSBRegisteredBuffer *buffer)
+{
+	return (--buffer->useCount == 0) && buffer->unregistered;
+}
+
+
+
+// Takes a buffer which is about to be freed off the table's budgets
+static inline void
+IOUSBRegisteredBufferTableForgetLocked(IOUSBRegisteredBufferTable *table, IOUSBRegisteredBuffer *buffer)
+{
+	table->count--;
+	table->wiredBytes -= buffer->size;
+}
+
+#endif /* _IOKIT_IOUSBREGISTEREDBUFFERTABLE_H */
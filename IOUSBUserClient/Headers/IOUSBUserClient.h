@@ -84,6 +84,10 @@ enum {
 #ifdef SUPPORTS_SS_USB
 	kUSBInterfaceUserClientGetPipePropertiesV2,
 #endif
+	kUSBInterfaceUserClientRegisterBuffer,
+	kUSBInterfaceUserClientUnregisterBuffer,
+	kUSBInterfaceUserClientReadPipeRegistered,
+	kUSBInterfaceUserClientWritePipeRegistered,
     kIOUSBLibInterfaceUserClientNumCommands
     };
 
@@ -110,6 +114,18 @@ struct IOUSBUserClientAsyncParamBlock
     IOUSBDevRequestDesc			req;
 };
 
+struct IOUSBRegisteredBuffer;
+
+typedef struct IOUSBUserClientRegisteredAsyncParamBlock IOUSBUserClientRegisteredAsyncParamBlock;
+struct IOUSBUserClientRegisteredAsyncParamBlock 
+{
+    OSAsyncReference64			fAsyncRef;
+    uint32_t					fAsyncCount;
+    uint32_t					fMax;
+    IOUSBRegisteredBuffer *		fBuffer;	// registered buffer the request is using
+    IOMemoryDescriptor *		fMem;		// the buffer's descriptor, or a sub range of it
+};
+
 typedef struct IOUSBInterfaceUserClientISOAsyncParamBlock IOUSBInterfaceUserClientISOAsyncParamBlock;
 struct IOUSBInterfaceUserClientISOAsyncParamBlock 
 {